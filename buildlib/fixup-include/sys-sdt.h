@@ -0,0 +1,7 @@
+#define DTRACE_PROBE(provider, name) do {} while (0)
+#define DTRACE_PROBE1(provider, name, a1) do {} while (0)
+#define DTRACE_PROBE2(provider, name, a1, a2) do {} while (0)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3) do {} while (0)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4) do {} while (0)
+#define DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5) do {} while (0)
+#define DTRACE_PROBE6(provider, name, a1, a2, a3, a4, a5, a6) do {} while (0)
@@ -197,7 +197,8 @@ acm_get_device_from_gid(union ibv_gid *sgid, uint8_t *port);
 static struct acmc_ep *acm_find_ep(struct acmc_port *port, uint16_t pkey);
 static int acm_ep_insert_addr(struct acmc_ep *ep, const char *name, uint8_t *addr,
 			      uint8_t addr_type);
-static void acm_event_handler(struct acmc_device *dev);
+static void acm_event_handler(struct ibv_context *verbs,
+			      struct ibv_async_event *event, void *arg);
 static int acm_nl_send(int sock, struct acm_msg *msg);
 
 static struct sa_data {
@@ -1880,20 +1881,37 @@ static int acm_init_nl(void)
 
 static void acm_server(bool systemd)
 {
+	struct ibv_async_dispatcher *async_disp;
 	fd_set readfds;
 	int i, n, ret;
+	int async_fd;
 	struct acmc_device *dev;
 
 	acm_log(0, "started\n");
 	acm_init_server();
 
+	async_disp = ibv_async_dispatcher_create();
+	if (!async_disp) {
+		acm_log(0, "ERROR - unable to create async event dispatcher\n");
+		return;
+	}
+	async_fd = ibv_async_dispatcher_get_fd(async_disp);
+
+	list_for_each(&dev_list, dev, entry) {
+		ret = ibv_async_dispatcher_add(async_disp, dev->device.verbs,
+					       acm_event_handler, dev);
+		if (ret)
+			acm_log(0, "ERROR - unable to watch events of %s\n",
+				dev->device.verbs->device->name);
+	}
+
 	client_array[NL_CLIENT_INDEX].sock = -1;
 	listen_socket = -1;
 	if (systemd) {
 		ret = acm_listen_systemd();
 		if (ret) {
 			acm_log(0, "ERROR - systemd server listen failed\n");
-			return;
+			goto out;
 		}
 	}
 
@@ -1901,7 +1919,7 @@ static void acm_server(bool systemd)
 		ret = acm_listen();
 		if (ret) {
 			acm_log(0, "ERROR - server listen failed\n");
-			return;
+			goto out;
 		}
 	}
 
@@ -1928,10 +1946,8 @@ static void acm_server(bool systemd)
 			}
 		}
 
-		list_for_each(&dev_list, dev, entry) {
-			FD_SET(dev->device.verbs->async_fd, &readfds);
-			n = max(n, (int) dev->device.verbs->async_fd);
-		}
+		FD_SET(async_fd, &readfds);
+		n = max(n, async_fd);
 
 		ret = select(n + 1, &readfds, NULL, NULL, NULL);
 		if (ret == -1) {
@@ -1956,14 +1972,12 @@ static void acm_server(bool systemd)
 			}
 		}
 
-		list_for_each(&dev_list, dev, entry) {
-			if (FD_ISSET(dev->device.verbs->async_fd, &readfds)) {
-				acm_log(2, "handling event from %s\n",
-					dev->device.verbs->device->name);
-				acm_event_handler(dev);
-			}
-		}
+		if (FD_ISSET(async_fd, &readfds))
+			ibv_async_dispatcher_run(async_disp, 0);
 	}
+
+out:
+	ibv_async_dispatcher_destroy(async_disp);
 }
 
 enum ibv_rate acm_get_rate(uint8_t width, uint8_t speed)
@@ -2563,21 +2577,18 @@ static void acm_port_change(struct acmc_port *port)
 	acm_port_up(port);
 }
 
-static void acm_event_handler(struct acmc_device *dev)
+static void acm_event_handler(struct ibv_context *verbs,
+			      struct ibv_async_event *event, void *arg)
 {
-	struct ibv_async_event event;
-	int i, ret;
-
-	ret = ibv_get_async_event(dev->device.verbs, &event);
-	if (ret)
-		return;
+	struct acmc_device *dev = arg;
+	int i;
 
 	acm_log(2, "processing async event %s for %s\n",
-		ibv_event_type_str(event.event_type),
-		dev->device.verbs->device->name);
-	i = event.element.port_num - 1;
+		ibv_event_type_str(event->event_type),
+		verbs->device->name);
+	i = event->element.port_num - 1;
 
-	switch (event.event_type) {
+	switch (event->event_type) {
 	case IBV_EVENT_PORT_ACTIVE:
 		if (dev->port[i].state != IBV_PORT_ACTIVE)
 			acm_port_up(&dev->port[i]);
@@ -2598,7 +2609,7 @@ static void acm_event_handler(struct acmc_device *dev)
 		if ((dev->port[i].state == IBV_PORT_ACTIVE) &&
 		    dev->port[i].prov_port_context) {
 			dev->port[i].prov->handle_event(dev->port[i].prov_port_context,
-							event.event_type);
+							event->event_type);
 			acm_log(1, "%s %d has reregistered\n",
 				dev->device.verbs->device->name, i + 1);
 		} else {
@@ -2616,8 +2627,6 @@ static void acm_event_handler(struct acmc_device *dev)
 	default:
 		break;
 	}
-
-	ibv_ack_async_event(&event);
 }
 
 static void acm_activate_devices(void)
@@ -48,6 +48,7 @@
 #include <infiniband/ibnetdisc.h>
 
 #include "ibdiag_common.h"
+#include "ibdiag_fts.h"
 
 static struct ibmad_port *srcport;
 
@@ -58,8 +59,6 @@ static int brief, dump_all, multicast;
 static char *node_name_map_file = NULL;
 static nn_map_t *node_name_map = NULL;
 
-#define IB_MLIDS_IN_BLOCK	(IB_SMP_DATA_SIZE/2)
-
 static int dump_mlid(char *str, int strlen, unsigned mlid, unsigned nports,
 		     __be16 mft[16][IB_MLIDS_IN_BLOCK])
 {
@@ -103,57 +102,166 @@ static int dump_mlid(char *str, int strlen, unsigned mlid, unsigned nports,
 	return i * 2;
 }
 
-static __be16 mft[16][IB_MLIDS_IN_BLOCK];
+#define DEF_SMP_WINDOW	32
 
-static void dump_multicast_tables(ibnd_node_t *node, unsigned startl,
-				  unsigned endl, struct ibmad_port *mad_port)
-{
-	ib_portid_t *portid = &node->path_portid;
-	char nd[IB_SMP_DATA_SIZE] = { 0 };
-	char str[512];
-	char *s;
-	uint64_t nodeguid;
-	uint32_t mod;
-	unsigned block, i, j, e, nports, cap, chunks, startblock, lastblock,
-	    top;
-	char *mapnd = NULL;
-	int n = 0;
+static int smp_window = DEF_SMP_WINDOW;
+static char *save_file, *load_file, *diff_file;
 
-	memcpy(nd, node->nodedesc, strlen(node->nodedesc));
-	nports = node->numports;
-	nodeguid = node->guid;
+static struct fts_table switches;
 
-	mad_decode_field(node->switchinfo, IB_SW_MCAST_FDB_CAP_F, &cap);
-	mad_decode_field(node->switchinfo, IB_SW_MCAST_FDB_TOP_F, &top);
+static void multicast_range(struct fts_switch *sw, unsigned *startl,
+			    unsigned *endl)
+{
+	unsigned cap = sw->cap, top = sw->top;
 
-	if (!endl || endl > IB_MIN_MCAST_LID + cap - 1)
-		endl = IB_MIN_MCAST_LID + cap - 1;
-	if (!dump_all && top && top < endl) {
+	if (!*endl || *endl > IB_MIN_MCAST_LID + cap - 1)
+		*endl = IB_MIN_MCAST_LID + cap - 1;
+	if (!dump_all && top && top < *endl) {
 		if (top < IB_MIN_MCAST_LID - 1)
 			IBWARN("illegal top mlid %x", top);
 		else
-			endl = top;
+			*endl = top;
 	}
 
-	if (!startl)
-		startl = IB_MIN_MCAST_LID;
-	else if (startl < IB_MIN_MCAST_LID) {
-		IBWARN("illegal start mlid %x, set to %x", startl,
+	if (!*startl)
+		*startl = IB_MIN_MCAST_LID;
+	else if (*startl < IB_MIN_MCAST_LID) {
+		IBWARN("illegal start mlid %x, set to %x", *startl,
 		       IB_MIN_MCAST_LID);
-		startl = IB_MIN_MCAST_LID;
+		*startl = IB_MIN_MCAST_LID;
 	}
 
-	if (endl > IB_MAX_MCAST_LID) {
-		IBWARN("illegal end mlid %x, truncate to %x", endl,
+	if (*endl > IB_MAX_MCAST_LID) {
+		IBWARN("illegal end mlid %x, truncate to %x", *endl,
 		       IB_MAX_MCAST_LID);
-		endl = IB_MAX_MCAST_LID;
+		*endl = IB_MAX_MCAST_LID;
 	}
+}
 
-	mapnd = remap_node_name(node_name_map, nodeguid, nd);
+static void unicast_range(struct fts_switch *sw, unsigned *startl,
+			  unsigned *endl)
+{
+	if (!*endl || *endl > sw->top)
+		*endl = sw->top;
+
+	if (*endl > IB_MAX_UCAST_LID) {
+		IBWARN("illegal lft top %d, truncate to %d", *endl,
+		       IB_MAX_UCAST_LID);
+		*endl = IB_MAX_UCAST_LID;
+	}
+}
+
+static void add_switch(ibnd_node_t *node, void *user_data)
+{
+	struct fts_switch *sw = fts_new_switch(&switches);
+
+	sw->guid = node->guid;
+	sw->lid = node->smalid;
+	sw->nports = node->numports;
+	sw->portid = node->path_portid;
+	memcpy(sw->nodedesc, node->nodedesc, sizeof(sw->nodedesc));
+	sw->startl = startlid;
+	sw->endl = endlid;
+
+	if (multicast) {
+		mad_decode_field(node->switchinfo, IB_SW_MCAST_FDB_CAP_F,
+				 &sw->cap);
+		mad_decode_field(node->switchinfo, IB_SW_MCAST_FDB_TOP_F,
+				 &sw->top);
+		multicast_range(sw, &sw->startl, &sw->endl);
+		sw->chunks = ALIGN(sw->nports + 1, 16) / 16;
+		sw->startblock = sw->startl / IB_MLIDS_IN_BLOCK;
+		sw->nblocks = sw->endl / IB_MLIDS_IN_BLOCK - sw->startblock + 1;
+	} else {
+		mad_decode_field(node->switchinfo, IB_SW_LINEAR_FDB_TOP_F,
+				 &sw->top);
+		unicast_range(sw, &sw->startl, &sw->endl);
+		sw->chunks = 1;
+		sw->startblock = sw->startl / IB_SMP_DATA_SIZE;
+		sw->nblocks = ALIGN(sw->endl, IB_SMP_DATA_SIZE) /
+			      IB_SMP_DATA_SIZE;
+		sw->nblocks = sw->nblocks > sw->startblock ?
+			      sw->nblocks - sw->startblock : 0;
+	}
+
+	fts_alloc_tables(sw);
+}
+
+/* Retrieve the tables of all switches at once, window SMPs at a time */
+static void fetch_tables(struct ibmad_port *mad_port)
+{
+	struct smp_batch_req *reqs;
+	size_t num = 0, k = 0;
+	unsigned b, j;
+	int i;
+
+	for (i = 0; i < switches.num; i++)
+		num += (size_t)switches.sw[i].nblocks * switches.sw[i].chunks;
+
+	reqs = calloc(num ? num : 1, sizeof(*reqs));
+	if (!reqs)
+		IBEXIT("out of memory for %zu requests", num);
+
+	for (i = 0; i < switches.num; i++) {
+		struct fts_switch *sw = &switches.sw[i];
+
+		for (b = 0; b < sw->nblocks; b++) {
+			for (j = 0; j < sw->chunks; j++, k++) {
+				reqs[k].portid = &sw->portid;
+				reqs[k].rcvbuf = sw->tbl +
+					(b * sw->chunks + j) * IB_SMP_DATA_SIZE;
+				if (multicast) {
+					reqs[k].attrid = IB_ATTR_MULTICASTFORWTBL;
+					reqs[k].mod = (sw->startblock + b -
+						       IB_MIN_MCAST_LID /
+						       IB_MLIDS_IN_BLOCK) |
+						      (j << 28);
+				} else {
+					reqs[k].attrid = IB_ATTR_LINEARFORWTBL;
+					reqs[k].mod = sw->startblock + b;
+				}
+			}
+		}
+	}
+
+	if (query_smp_batch(reqs, num, smp_window, mad_port) < 0)
+		IBEXIT("failed to issue forwarding table queries");
+
+	for (i = 0, k = 0; i < switches.num; i++) {
+		struct fts_switch *sw = &switches.sw[i];
+
+		for (b = 0; b < sw->nblocks * sw->chunks; b++)
+			sw->status[b] = reqs[k++].status;
+	}
+
+	free(reqs);
+}
+
+static void report_failed_block(struct fts_switch *sw, const char *attr,
+				char *mapnd, int status, uint32_t mod)
+{
+	fprintf(stderr, "SubnGet(%s) failed on switch '%s' %s Node GUID 0x%"
+		PRIx64 " SMA LID %d; MAD status 0x%x AM 0x%x\n", attr, mapnd,
+		portid2str(&sw->portid), sw->guid, sw->lid,
+		status > 0 ? status : 0, mod);
+}
+
+static __be16 mft[16][IB_MLIDS_IN_BLOCK];
+
+static void dump_multicast_tables(struct fts_switch *sw)
+{
+	char str[512];
+	char *s;
+	uint32_t mod;
+	unsigned block, b, i, j, e, nports = sw->nports;
+	char *mapnd = NULL;
+	int n = 0;
+
+	mapnd = remap_node_name(node_name_map, sw->guid, sw->nodedesc);
 
 	printf("Multicast mlids [0x%x-0x%x] of switch %s guid 0x%016" PRIx64
-	       " (%s):\n", startl, endl, portid2str(portid), nodeguid,
-	       mapnd);
+	       " (%s):\n", sw->startl, sw->endl, portid2str(&sw->portid),
+	       sw->guid, mapnd);
 
 	if (brief)
 		printf(" MLid       Port Mask\n");
@@ -173,39 +281,30 @@ static void dump_multicast_tables(ibnd_node_t *node, unsigned startl,
 	}
 	if (ibverbose)
 		printf("Switch multicast mlid capability is %d top is 0x%x\n",
-		       cap, top);
+		       sw->cap, sw->top);
 
-	chunks = ALIGN(nports + 1, 16) / 16;
+	for (b = 0; b < sw->nblocks; b++) {
+		block = sw->startblock + b;
+		for (j = 0; j < sw->chunks; j++) {
+			unsigned idx = b * sw->chunks + j;
 
-	startblock = startl / IB_MLIDS_IN_BLOCK;
-	lastblock = endl / IB_MLIDS_IN_BLOCK;
-	for (block = startblock; block <= lastblock; block++) {
-		for (j = 0; j < chunks; j++) {
-			int status;
 			mod = (block - IB_MIN_MCAST_LID / IB_MLIDS_IN_BLOCK)
 			    | (j << 28);
-
-			DEBUG("reading block %x chunk %d mod %x", block, j,
-			      mod);
-			if (!smp_query_status_via
-			    (mft + j, portid, IB_ATTR_MULTICASTFORWTBL, mod, 0,
-			     &status, mad_port)) {
-				fprintf(stderr, "SubnGet(MFT) failed on switch "
-						"'%s' %s Node GUID 0x%"PRIx64
-						" SMA LID %d; MAD status 0x%x "
-						"AM 0x%x\n",
-						mapnd, portid2str(portid),
-						node->guid, node->smalid,
-						status, mod);
-			}
+			if (sw->status[idx]) {
+				report_failed_block(sw, "MFT", mapnd,
+						    sw->status[idx], mod);
+				memset(mft[j], 0, sizeof(mft[j]));
+			} else
+				memcpy(mft[j], sw->tbl + idx * IB_SMP_DATA_SIZE,
+				       sizeof(mft[j]));
 		}
 
 		i = block * IB_MLIDS_IN_BLOCK;
 		e = i + IB_MLIDS_IN_BLOCK;
-		if (i < startl)
-			i = startl;
-		if (e > endl + 1)
-			e = endl + 1;
+		if (i < sw->startl)
+			i = sw->startl;
+		if (e > sw->endl + 1)
+			e = sw->endl + 1;
 
 		for (; i < e; i++) {
 			if (dump_mlid(str, sizeof str, i, nports, mft) == 0)
@@ -296,70 +395,46 @@ static int dump_lid(char *str, int str_len, int lid, int valid,
 	return rc;
 }
 
-static void dump_unicast_tables(ibnd_node_t *node, int startl, int endl,
-				struct ibmad_port *mad_port,
-				ibnd_fabric_t *fabric)
+static void dump_unicast_tables(struct fts_switch *sw, ibnd_fabric_t *fabric)
 {
-	ib_portid_t * portid = &node->path_portid;
-	char lft[IB_SMP_DATA_SIZE] = { 0 };
-	char nd[IB_SMP_DATA_SIZE] = { 0 };
 	char str[200];
-	uint64_t nodeguid;
-	int block, i, e, top;
-	unsigned nports;
-	int n = 0, startblock, endblock;
+	unsigned block, b;
+	int i, e;
+	int n = 0;
 	char *mapnd = NULL;
 	int last_port_lid = 0, base_port_lid = 0;
 	uint64_t portguid = 0;
 
-	mad_decode_field(node->switchinfo, IB_SW_LINEAR_FDB_TOP_F, &top);
-	nodeguid = node->guid;
-	nports = node->numports;
-	memcpy(nd, node->nodedesc, strlen(node->nodedesc));
-
-	if (!endl || endl > top)
-		endl = top;
-
-	if (endl > IB_MAX_UCAST_LID) {
-		IBWARN("illegal lft top %d, truncate to %d", endl,
-		       IB_MAX_UCAST_LID);
-		endl = IB_MAX_UCAST_LID;
-	}
-
-	mapnd = remap_node_name(node_name_map, nodeguid, nd);
+	mapnd = remap_node_name(node_name_map, sw->guid, sw->nodedesc);
 
 	printf("Unicast lids [0x%x-0x%x] of switch %s guid 0x%016" PRIx64
-	       " (%s):\n", startl, endl, portid2str(portid), nodeguid,
-	       mapnd);
+	       " (%s):\n", sw->startl, sw->endl, portid2str(&sw->portid),
+	       sw->guid, mapnd);
 
-	DEBUG("Switch top is 0x%x\n", top);
+	DEBUG("Switch top is 0x%x\n", sw->top);
 
 	printf("  Lid  Out   Destination\n");
 	printf("       Port     Info \n");
-	startblock = startl / IB_SMP_DATA_SIZE;
-	endblock = ALIGN(endl, IB_SMP_DATA_SIZE) / IB_SMP_DATA_SIZE;
-	for (block = startblock; block < endblock; block++) {
-		int status;
-		DEBUG("reading block %d", block);
-		if (!smp_query_status_via(lft, portid, IB_ATTR_LINEARFORWTBL, block,
-				   0, &status, mad_port)) {
-			fprintf(stderr, "SubnGet(LFT) failed on switch "
-					"'%s' %s Node GUID 0x%"PRIx64
-					" SMA LID %d; MAD status 0x%x AM 0x%x\n",
-					mapnd, portid2str(portid),
-					node->guid, node->smalid,
-					status, block);
+	for (b = 0; b < sw->nblocks; b++) {
+		uint8_t *lft = sw->tbl + b * IB_SMP_DATA_SIZE;
+
+		block = sw->startblock + b;
+		if (sw->status[b]) {
+			report_failed_block(sw, "LFT", mapnd, sw->status[b],
+					    block);
+			continue;
 		}
+
 		i = block * IB_SMP_DATA_SIZE;
 		e = i + IB_SMP_DATA_SIZE;
-		if (i < startl)
-			i = startl;
-		if (e > endl + 1)
-			e = endl + 1;
+		if (i < sw->startl)
+			i = sw->startl;
+		if (e > sw->endl + 1)
+			e = sw->endl + 1;
 
 		for (; i < e; i++) {
 			unsigned outport = lft[i % IB_SMP_DATA_SIZE];
-			unsigned valid = (outport <= nports);
+			unsigned valid = (outport <= sw->nports);
 
 			if (!valid && !dump_all)
 				continue;
@@ -374,19 +449,129 @@ static void dump_unicast_tables(ibnd_node_t *node, int startl, int endl,
 	free(mapnd);
 }
 
-static void dump_node(ibnd_node_t *node, struct ibmad_port *mad_port,
-		      ibnd_fabric_t *fabric)
+static int cmp_switch_guid(const void *a, const void *b)
 {
-	if (multicast)
-		dump_multicast_tables(node, startlid, endlid, mad_port);
-	else
-		dump_unicast_tables(node, startlid, endlid,
-						mad_port, fabric);
+	const struct fts_switch *sa = a, *sb = b;
+
+	if (sa->guid == sb->guid)
+		return 0;
+	return sa->guid < sb->guid ? -1 : 1;
+}
+
+static void print_diff_header(struct fts_switch *sw, int *header_printed)
+{
+	char *mapnd;
+
+	if (*header_printed)
+		return;
+
+	mapnd = remap_node_name(node_name_map, sw->guid, sw->nodedesc);
+	printf("%s changes on switch %s guid 0x%016" PRIx64 " (%s):\n",
+	       multicast ? "Multicast" : "Unicast", portid2str(&sw->portid),
+	       sw->guid, mapnd);
+	free(mapnd);
+	*header_printed = 1;
+}
+
+static int diff_switch(struct fts_switch *old, struct fts_switch *cur)
+{
+	unsigned first = old->startl < cur->startl ? old->startl : cur->startl;
+	unsigned last = old->endl > cur->endl ? old->endl : cur->endl;
+	int header_printed = 0, n = 0;
+	unsigned i, j, chunks;
+
+	if (!multicast) {
+		for (i = first; i <= last; i++) {
+			int o = fts_lft_entry(old, i), c = fts_lft_entry(cur, i);
+
+			if (o < 0 || c < 0 || o == c)
+				continue;
+			print_diff_header(cur, &header_printed);
+			printf("0x%04x %03u -> %03u\n", i, o, c);
+			n++;
+		}
+		return n;
+	}
+
+	chunks = old->chunks > cur->chunks ? old->chunks : cur->chunks;
+	for (i = first; i <= last; i++) {
+		char ostr[16 * 4 + 1], cstr[16 * 4 + 1];
+		int changed = 0, failed = 0, on = 0, cn = 0;
+
+		for (j = 0; j < chunks; j++) {
+			int o = fts_mft_entry(old, i, j), c = fts_mft_entry(cur, i, j);
+
+			if (o < 0 || c < 0)
+				failed = 1;
+			if (o != c)
+				changed = 1;
+			on += sprintf(ostr + on, "%04x", o < 0 ? 0 : o);
+			cn += sprintf(cstr + cn, "%04x", c < 0 ? 0 : c);
+		}
+		if (!changed || failed)
+			continue;
+		print_diff_header(cur, &header_printed);
+		printf("0x%04x      %s -> %s\n", i, ostr, cstr);
+		n++;
+	}
+	return n;
 }
 
-static void process_switch(ibnd_node_t *node, void *fabric)
+/* Compare the current tables against an older snapshot */
+static int diff_tables(struct fts_table *old, struct fts_table *cur)
 {
-	dump_node(node, srcport, (ibnd_fabric_t *)fabric);
+	int i, changed = 0, changed_sw = 0, added = 0, removed = 0;
+	struct fts_switch *o;
+	uint8_t *matched;
+	char *mapnd;
+
+	matched = calloc(old->num ? old->num : 1, sizeof(*matched));
+	if (!matched)
+		IBEXIT("out of memory for %d switches", old->num);
+
+	qsort(old->sw, old->num, sizeof(*old->sw), cmp_switch_guid);
+	qsort(cur->sw, cur->num, sizeof(*cur->sw), cmp_switch_guid);
+
+	for (i = 0; i < cur->num; i++) {
+		struct fts_switch *c = &cur->sw[i];
+		int n;
+
+		o = bsearch(c, old->sw, old->num, sizeof(*old->sw),
+			    cmp_switch_guid);
+		if (!o) {
+			mapnd = remap_node_name(node_name_map, c->guid,
+						c->nodedesc);
+			printf("Switch guid 0x%016" PRIx64 " (%s) added\n",
+			       c->guid, mapnd);
+			free(mapnd);
+			added++;
+			continue;
+		}
+		matched[o - old->sw] = 1;
+		n = diff_switch(o, c);
+		if (n) {
+			changed += n;
+			changed_sw++;
+		}
+	}
+
+	for (i = 0; i < old->num; i++) {
+		if (matched[i])
+			continue;
+		o = &old->sw[i];
+		mapnd = remap_node_name(node_name_map, o->guid, o->nodedesc);
+		printf("Switch guid 0x%016" PRIx64 " (%s) removed\n", o->guid,
+		       mapnd);
+		free(mapnd);
+		removed++;
+	}
+	free(matched);
+
+	printf("%d %s entries changed on %d switches, %d switches added, "
+	       "%d removed\n", changed, multicast ? "mlid" : "lid",
+	       changed_sw, added, removed);
+
+	return changed || added || removed;
 }
 
 static int process_opt(void *context, int ch)
@@ -406,6 +591,20 @@ static int process_opt(void *context, int ch)
 		if (node_name_map_file == NULL)
 			IBEXIT("out of memory, strdup for node_name_map_file name failed");
 		break;
+	case 2:
+		smp_window = strtoul(optarg, NULL, 0);
+		if (smp_window <= 0)
+			IBEXIT("invalid window %s", optarg);
+		break;
+	case 3:
+		save_file = optarg;
+		break;
+	case 4:
+		load_file = optarg;
+		break;
+	case 5:
+		diff_file = optarg;
+		break;
 	default:
 		return -1;
 	}
@@ -415,6 +614,7 @@ static int process_opt(void *context, int ch)
 int main(int argc, char **argv)
 {
 	int rc = 0;
+	int i;
 	int mgmt_classes[3] =
 	    { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS, IB_SA_CLASS };
 
@@ -427,6 +627,14 @@ int main(int argc, char **argv)
 		 "do not try to resolve destinations"},
 		{"Multicast", 'M', 0, NULL, "show multicast forwarding tables"},
 		{"node-name-map", 1, 1, "<file>", "node name map file"},
+		{"window", 2, 1, "<n>",
+		 "maximum number of outstanding table queries, default 32"},
+		{"save", 3, 1, "<file>",
+		 "save the forwarding tables to a binary snapshot"},
+		{"load", 4, 1, "<file>",
+		 "use the tables of a snapshot instead of querying the fabric"},
+		{"diff", 5, 1, "<file>",
+		 "report the differences to an older snapshot"},
 		{}
 	};
 	char usage_args[] = "[<dest dr_path|lid|guid> [<startlid> [<endlid>]]]";
@@ -440,6 +648,10 @@ int main(int argc, char **argv)
 		"-M\t# dump all non empty mlids of switch with lid 4",
 		"-M 0xc010 0xc020\t# same, but with range",
 		"-M -n\t# simple dump format",
+		" -- Snapshot examples:",
+		"--save fts.snap\t# dump and save all unicast tables",
+		"--diff fts.snap\t# compare current tables against a snapshot",
+		"--load new.snap --diff old.snap\t# compare two snapshots",
 		NULL,
 	};
 
@@ -462,7 +674,13 @@ int main(int argc, char **argv)
 	config.flags = ibd_ibnetdisc_flags;
 	config.mkey = ibd_mkey;
 
-	if ((fabric = ibnd_discover_fabric(ibd_ca, ibd_ca_port, NULL,
+	if (load_file) {
+		if (fts_load(load_file, &switches) < 0) {
+			rc = -1;
+			goto Exit;
+		}
+		multicast = switches.multicast;
+	} else if ((fabric = ibnd_discover_fabric(ibd_ca, ibd_ca_port, NULL,
 						&config)) != NULL) {
 
 		srcport = mad_rpc_open_port(ibd_ca, ibd_ca_port, mgmt_classes, 3);
@@ -478,15 +696,45 @@ int main(int argc, char **argv)
 			mad_rpc_set_timeout(srcport, ibd_timeout);
 		}
 
-		ibnd_iter_nodes_type(fabric, process_switch, IB_NODE_SWITCH, fabric);
+		switches.multicast = multicast;
+		ibnd_iter_nodes_type(fabric, add_switch, IB_NODE_SWITCH, NULL);
+		fetch_tables(srcport);
 
 		mad_rpc_close_port(srcport);
 
 	} else {
 		fprintf(stderr, "Failed to discover fabric\n");
 		rc = -1;
+		goto Exit;
+	}
+
+	if (save_file && fts_save(save_file, &switches) < 0) {
+		rc = -1;
+		goto Exit;
+	}
+
+	if (diff_file) {
+		struct fts_table old = { NULL, 0, 0, 0 };
+
+		if (fts_load(diff_file, &old) < 0)
+			rc = -1;
+		else if (old.multicast != multicast) {
+			fprintf(stderr, "%s holds %s tables\n", diff_file,
+				old.multicast ? "multicast" : "unicast");
+			rc = -1;
+		} else
+			rc = diff_tables(&old, &switches);
+		fts_free(&old);
+	} else {
+		for (i = 0; i < switches.num; i++) {
+			if (multicast)
+				dump_multicast_tables(&switches.sw[i]);
+			else
+				dump_unicast_tables(&switches.sw[i], fabric);
+		}
 	}
 Exit:
+	fts_free(&switches);
 	ibnd_destroy_fabric(fabric);
 
 	close_node_name_map(node_name_map);
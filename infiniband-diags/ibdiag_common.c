@@ -940,6 +940,79 @@ void dump_portinfo(void *pi, int tabs)
 	}
 }
 
+static void smp_batch_done(struct mad_async *async, ib_rpc_t *rpc,
+			   ib_portid_t *dport, int status, uint8_t *mad,
+			   int len, void *context)
+{
+	struct smp_batch_req *req = context;
+
+	if (status) {
+		req->status = -status;
+		return;
+	}
+
+	req->status = rpc->rstatus;
+	if (!req->status)
+		memcpy(req->rcvbuf, mad + rpc->dataoffs, IB_SMP_DATA_SIZE);
+}
+
+int query_smp_batch(struct smp_batch_req *reqs, int num, int window,
+		    const struct ibmad_port *srcport)
+{
+	struct mad_async *async;
+	int next = 0, failed = 0, i;
+
+	for (i = 0; i < num; i++)
+		reqs[i].status = -EIO;
+
+	async = mad_async_create(srcport, window);
+	if (!async)
+		return -1;
+
+	while (next < num || mad_async_pending(async)) {
+		/* feed the engine only as fast as the window drains */
+		while (next < num && mad_async_pending(async) < window) {
+			struct smp_batch_req *req = &reqs[next++];
+			ib_rpc_t rpc = { 0 };
+
+			DEBUG("attr 0x%x mod 0x%x route %s", req->attrid,
+			      req->mod, portid2str(req->portid));
+			rpc.method = IB_MAD_METHOD_GET;
+			rpc.attr.id = req->attrid;
+			rpc.attr.mod = req->mod;
+			rpc.timeout = req->timeout;
+			rpc.datasz = IB_SMP_DATA_SIZE;
+			rpc.dataoffs = IB_SMP_DATA_OFFS;
+			rpc.mkey = smp_mkey_get(srcport);
+
+			if ((req->portid->lid <= 0) ||
+			    (req->portid->drpath.drslid == 0xffff) ||
+			    (req->portid->drpath.drdlid == 0xffff))
+				rpc.mgtclass = IB_SMI_DIRECT_CLASS;
+			else
+				rpc.mgtclass = IB_SMI_CLASS;
+
+			req->portid->sl = 0;
+			req->portid->qp = 0;
+
+			if (mad_async_submit(async, &rpc, req->portid,
+					     req->rcvbuf, smp_batch_done,
+					     req) < 0)
+				req->status = -errno;
+		}
+
+		if (mad_async_poll(async, -1) < 0)
+			break;
+	}
+
+	mad_async_destroy(async);
+
+	for (i = 0; i < num; i++)
+		if (reqs[i].status)
+			failed++;
+	return failed;
+}
+
 op_fn_t *match_op(const match_rec_t match_tbl[], char *name)
 {
 	const match_rec_t *r;
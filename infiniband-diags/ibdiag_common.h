@@ -120,6 +120,20 @@ int snprint_field(char *buf, size_t n, enum MAD_FIELDS f, int spacing,
 	__attribute__((format(printf, 5, 6)));
 void dump_portinfo(void *pi, int tabs);
 
+/* One SubnGet of a pipelined batch issued with query_smp_batch() */
+struct smp_batch_req {
+	ib_portid_t *portid;
+	unsigned attrid;
+	unsigned mod;
+	unsigned timeout;
+	void *rcvbuf;		/* receives IB_SMP_DATA_SIZE bytes */
+	int status;		/* MAD status, or -errno without a response */
+};
+
+/* Issue all requests with up to window outstanding; returns # failed */
+int query_smp_batch(struct smp_batch_req *reqs, int num, int window,
+		    const struct ibmad_port *srcport);
+
 /**
  * Some common command line parsing
  */
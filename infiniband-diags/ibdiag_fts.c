@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2004-2009 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2009-2011 Mellanox Technologies LTD.  All rights reserved.
+ * Copyright (c) 2013 Lawrence Livermore National Security.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <netinet/in.h>
+
+#include "ibdiag_common.h"
+#include "ibdiag_fts.h"
+
+/*
+ * Snapshot file: a header followed by one record per switch, each
+ * followed by its nblocks * chunks status words and table blocks.  Table
+ * blocks are stored as returned by the SMA; other fields are little
+ * endian.
+ */
+#define FTS_SNAP_MAGIC		"IBFT"
+#define FTS_SNAP_VERSION	1
+#define FTS_SNAP_MULTICAST	(1 << 0)
+#define FTS_SNAP_MAX_BLOCKS	1024
+
+struct fts_snap_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_switches;
+	uint32_t flags;
+};
+
+struct fts_snap_switch {
+	uint64_t guid;
+	uint16_t lid;
+	uint8_t nports;
+	uint8_t chunks;
+	uint32_t startl;
+	uint32_t endl;
+	uint32_t startblock;
+	uint32_t nblocks;
+	uint32_t top;
+	uint32_t cap;
+	uint32_t reserved;
+	char nodedesc[IB_SMP_DATA_SIZE];
+};
+
+struct fts_switch *fts_new_switch(struct fts_table *fts)
+{
+	struct fts_switch *sw;
+
+	if (fts->num == fts->max) {
+		fts->max = fts->max ? fts->max * 2 : 64;
+		fts->sw = realloc(fts->sw, fts->max * sizeof(*fts->sw));
+		if (!fts->sw)
+			IBEXIT("out of memory for %d switches", fts->max);
+	}
+
+	sw = &fts->sw[fts->num++];
+	memset(sw, 0, sizeof(*sw));
+	return sw;
+}
+
+void fts_alloc_tables(struct fts_switch *sw)
+{
+	size_t n = (size_t)sw->nblocks * sw->chunks;
+
+	sw->tbl = calloc(n ? n : 1, IB_SMP_DATA_SIZE);
+	sw->status = calloc(n ? n : 1, sizeof(*sw->status));
+	if (!sw->tbl || !sw->status)
+		IBEXIT("out of memory for %zu table blocks", n);
+}
+
+void fts_free(struct fts_table *fts)
+{
+	int i;
+
+	for (i = 0; i < fts->num; i++) {
+		free(fts->sw[i].tbl);
+		free(fts->sw[i].status);
+	}
+	free(fts->sw);
+	fts->sw = NULL;
+	fts->num = fts->max = 0;
+}
+
+int fts_save(const char *file, const struct fts_table *fts)
+{
+	struct fts_snap_header hdr;
+	FILE *f;
+	int i;
+	unsigned k;
+
+	if (!(f = fopen(file, "w"))) {
+		fprintf(stderr, "cannot create snapshot %s: %m\n", file);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FTS_SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(FTS_SNAP_VERSION);
+	hdr.num_switches = htole32(fts->num);
+	hdr.flags = htole32(fts->multicast ? FTS_SNAP_MULTICAST : 0);
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err;
+
+	for (i = 0; i < fts->num; i++) {
+		const struct fts_switch *sw = &fts->sw[i];
+		struct fts_snap_switch rec;
+		unsigned n = sw->nblocks * sw->chunks;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.guid = htole64(sw->guid);
+		rec.lid = htole16(sw->lid);
+		rec.nports = sw->nports;
+		rec.chunks = sw->chunks;
+		rec.startl = htole32(sw->startl);
+		rec.endl = htole32(sw->endl);
+		rec.startblock = htole32(sw->startblock);
+		rec.nblocks = htole32(sw->nblocks);
+		rec.top = htole32(sw->top);
+		rec.cap = htole32(sw->cap);
+		memcpy(rec.nodedesc, sw->nodedesc, sizeof(rec.nodedesc));
+		if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+			goto err;
+
+		for (k = 0; k < n; k++) {
+			uint32_t status = htole32(sw->status[k]);
+
+			if (fwrite(&status, sizeof(status), 1, f) != 1)
+				goto err;
+		}
+		if (n && fwrite(sw->tbl, IB_SMP_DATA_SIZE, n, f) != n)
+			goto err;
+	}
+
+	if (fclose(f))
+		goto fail;
+	return 0;
+err:
+	fclose(f);
+fail:
+	fprintf(stderr, "cannot write snapshot %s: %m\n", file);
+	return -1;
+}
+
+int fts_load(const char *file, struct fts_table *fts)
+{
+	struct fts_snap_header hdr;
+	uint32_t i, num;
+	unsigned k;
+	FILE *f;
+
+	if (!(f = fopen(file, "r"))) {
+		fprintf(stderr, "cannot open snapshot %s: %m\n", file);
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, FTS_SNAP_MAGIC, sizeof(hdr.magic)) ||
+	    le32toh(hdr.version) != FTS_SNAP_VERSION)
+		goto bad;
+
+	fts->multicast = !!(le32toh(hdr.flags) & FTS_SNAP_MULTICAST);
+	num = le32toh(hdr.num_switches);
+
+	for (i = 0; i < num; i++) {
+		struct fts_snap_switch rec;
+		struct fts_switch *sw;
+		unsigned n;
+
+		if (fread(&rec, sizeof(rec), 1, f) != 1)
+			goto bad;
+
+		sw = fts_new_switch(fts);
+		sw->guid = le64toh(rec.guid);
+		sw->lid = le16toh(rec.lid);
+		sw->nports = rec.nports;
+		sw->chunks = rec.chunks;
+		sw->startl = le32toh(rec.startl);
+		sw->endl = le32toh(rec.endl);
+		sw->startblock = le32toh(rec.startblock);
+		sw->nblocks = le32toh(rec.nblocks);
+		sw->top = le32toh(rec.top);
+		sw->cap = le32toh(rec.cap);
+		memcpy(sw->nodedesc, rec.nodedesc, sizeof(sw->nodedesc));
+		sw->nodedesc[sizeof(sw->nodedesc) - 1] = '\0';
+		ib_portid_set(&sw->portid, sw->lid, 0, 0);
+
+		if (!sw->chunks || sw->chunks > 16 ||
+		    sw->nblocks > FTS_SNAP_MAX_BLOCKS ||
+		    (!fts->multicast && sw->chunks != 1))
+			goto bad;
+
+		fts_alloc_tables(sw);
+		n = sw->nblocks * sw->chunks;
+		for (k = 0; k < n; k++) {
+			uint32_t status;
+
+			if (fread(&status, sizeof(status), 1, f) != 1)
+				goto bad;
+			sw->status[k] = (int)le32toh(status);
+		}
+		if (n && fread(sw->tbl, IB_SMP_DATA_SIZE, n, f) != n)
+			goto bad;
+	}
+
+	fclose(f);
+	return 0;
+bad:
+	fprintf(stderr, "%s is not a valid forwarding table snapshot\n", file);
+	fclose(f);
+	return -1;
+}
+
+int fts_lft_entry(const struct fts_switch *sw, unsigned lid)
+{
+	unsigned b = lid / IB_SMP_DATA_SIZE - sw->startblock;
+
+	if (lid < sw->startl || lid > sw->endl ||
+	    lid / IB_SMP_DATA_SIZE < sw->startblock || b >= sw->nblocks)
+		return 255;
+	if (sw->status[b])
+		return -1;
+	return sw->tbl[b * IB_SMP_DATA_SIZE + lid % IB_SMP_DATA_SIZE];
+}
+
+int fts_mft_entry(const struct fts_switch *sw, unsigned mlid, unsigned chunk)
+{
+	unsigned b = mlid / IB_MLIDS_IN_BLOCK - sw->startblock;
+	unsigned idx = b * sw->chunks + chunk;
+	__be16 mask;
+
+	if (mlid < sw->startl || mlid > sw->endl || chunk >= sw->chunks ||
+	    mlid / IB_MLIDS_IN_BLOCK < sw->startblock || b >= sw->nblocks)
+		return 0;
+	if (sw->status[idx])
+		return -1;
+	memcpy(&mask, sw->tbl + idx * IB_SMP_DATA_SIZE +
+	       (mlid % IB_MLIDS_IN_BLOCK) * sizeof(mask), sizeof(mask));
+	return ntohs(mask);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2004-2009 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2009-2011 Mellanox Technologies LTD.  All rights reserved.
+ * Copyright (c) 2013 Lawrence Livermore National Security.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef _IBDIAG_FTS_H_
+#define _IBDIAG_FTS_H_
+
+#include <stdint.h>
+#include <infiniband/mad.h>
+
+#define IB_MLIDS_IN_BLOCK	(IB_SMP_DATA_SIZE/2)
+
+/* Forwarding table of one switch, retrieved from the fabric or a snapshot */
+struct fts_switch {
+	uint64_t guid;
+	uint16_t lid;
+	uint8_t nports;
+	uint8_t chunks;		/* MFT port mask blocks per mlid block */
+	unsigned startl, endl;
+	unsigned startblock, nblocks;
+	unsigned top, cap;
+	char nodedesc[IB_SMP_DATA_SIZE];
+	ib_portid_t portid;
+	uint8_t *tbl;		/* nblocks * chunks SMP data blocks */
+	int *status;		/* per block: MAD status, or -errno */
+};
+
+/* The unicast or multicast tables of a set of switches */
+struct fts_table {
+	struct fts_switch *sw;
+	int num, max;
+	int multicast;
+};
+
+struct fts_switch *fts_new_switch(struct fts_table *fts);
+void fts_alloc_tables(struct fts_switch *sw);
+void fts_free(struct fts_table *fts);
+
+int fts_save(const char *file, const struct fts_table *fts);
+int fts_load(const char *file, struct fts_table *fts);
+
+/* Out port for lid; 255 outside the table, -1 if its block failed */
+int fts_lft_entry(const struct fts_switch *sw, unsigned lid);
+/* Port mask chunk for mlid; 0 outside the table, -1 if its block failed */
+int fts_mft_entry(const struct fts_switch *sw, unsigned mlid, unsigned chunk);
+
+#endif				/* _IBDIAG_FTS_H_ */
@@ -63,6 +63,7 @@ struct sa_handle * sa_get_handle(void)
 		goto err;
 	}
 
+	handle->rmpp_agent = -1;
 	handle->dport.qp = 1;
 	if (!handle->dport.qkey)
 		handle->dport.qkey = IB_DEFAULT_QP1_QKEY;
@@ -90,6 +91,8 @@ err:
 
 void sa_free_handle(struct sa_handle * h)
 {
+	if (h->rmpp_agent >= 0)
+		umad_unregister(h->fd, h->rmpp_agent);
 	umad_unregister(h->fd, h->agent);
 	umad_close_port(h->fd);
 	free(h);
@@ -177,6 +180,252 @@ void sa_free_result_mad(struct sa_query_result *result)
 	}
 }
 
+/*
+ * Streaming queries register a second agent without kernel RMPP support,
+ * so the segments of a response are passed up as they arrive and are
+ * acknowledged here.  Records are handed out straight from the segments;
+ * only one split across two segments is copied, so memory use does not
+ * depend on the size of the response.
+ */
+#define SA_RMPP_HDR_SIZE	36	/* MAD and RMPP headers */
+#define SA_RMPP_SEG_DATA	(IB_MAD_SIZE - IB_SA_DATA_OFFS)
+#define SA_RMPP_WINDOW		32
+#define SA_RMPP_RETRIES		3
+
+struct sa_stream {
+	sa_record_fn_t fn;
+	void *context;
+	unsigned recsz;
+	uint8_t *carry;		/* start of a record split across segments */
+	unsigned carried;
+	unsigned cnt;
+};
+
+static void stream_records(struct sa_stream *s, uint8_t *data, unsigned len)
+{
+	unsigned n;
+
+	if (s->carried) {
+		n = s->recsz - s->carried;
+		if (n > len)
+			n = len;
+		memcpy(s->carry + s->carried, data, n);
+		s->carried += n;
+		data += n;
+		len -= n;
+		if (s->carried < s->recsz)
+			return;
+		s->fn(s->carry, s->recsz, s->context);
+		s->cnt++;
+		s->carried = 0;
+	}
+
+	for (; len >= s->recsz; data += s->recsz, len -= s->recsz) {
+		s->fn(data, s->recsz, s->context);
+		s->cnt++;
+	}
+
+	if (len) {
+		memcpy(s->carry, data, len);
+		s->carried = len;
+	}
+}
+
+static int send_rmpp_ack(struct sa_handle *h, void *umad, uint8_t *data_mad,
+			 unsigned segnum, unsigned newwin)
+{
+	uint8_t *mad = umad_get_mad(umad);
+
+	memset(umad, 0, umad_size() + IB_MAD_SIZE);
+	memcpy(mad, data_mad, SA_RMPP_HDR_SIZE);
+	/* ACKs carry the request method, GetTable rather than GetTableResp */
+	mad_set_field(mad, 0, IB_MAD_RESPONSE_F, 0);
+	mad_set_field(mad, 0, IB_SA_RMPP_TYPE_F, IB_RMPP_TYPE_ACK);
+	mad_set_field(mad, 0, IB_SA_RMPP_FLAGS_F, IB_RMPP_FLAG_ACTIVE);
+	mad_set_field(mad, 0, IB_SA_RMPP_STATUS_F, 0);
+	mad_set_field(mad, 0, IB_SA_RMPP_SEGNUM_F, segnum);
+	mad_set_field(mad, 0, IB_SA_RMPP_NEWWIN_F, newwin);
+	umad_set_addr(umad, h->dport.lid, h->dport.qp, h->dport.sl,
+		      h->dport.qkey);
+
+	if (umad_send(h->fd, h->rmpp_agent, umad, IB_MAD_SIZE, 0, 0) < 0) {
+		IBWARN("umad_send of RMPP ACK failed: %s", strerror(errno));
+		return errno;
+	}
+	return 0;
+}
+
+int sa_query_stream(struct sa_handle *h, uint8_t method,
+		    uint16_t attr, uint32_t mod, uint64_t comp_mask,
+		    uint64_t sm_key, void *data, size_t datasz,
+		    sa_record_fn_t fn, void *context,
+		    struct sa_query_result *result)
+{
+	struct sa_stream s = { fn, context, 0, NULL, 0, 0 };
+	uint8_t last_mad[SA_RMPP_HDR_SIZE];
+	unsigned expected = 1, ack_at = 1, segnum, n;
+	int ret, len, flags, type, retries = 0;
+	void *umad, *ack;
+	uint32_t trid;
+	uint8_t *mad;
+	ib_rpc_t rpc;
+
+	memset(result, 0, sizeof(*result));
+
+	if (h->rmpp_agent < 0 &&
+	    (h->rmpp_agent = umad_register(h->fd, IB_SA_CLASS, 2, 0,
+					   NULL)) < 0) {
+		IBWARN("umad_register for SA class failed on port %s:%d",
+		       ibd_ca ? "" : ibd_ca, ibd_ca_port);
+		return EIO;
+	}
+
+	memset(&rpc, 0, sizeof(rpc));
+	rpc.mgtclass = IB_SA_CLASS;
+	rpc.method = method;
+	rpc.attr.id = attr;
+	rpc.attr.mod = mod;
+	rpc.mask = comp_mask;
+	rpc.datasz = datasz;
+	rpc.dataoffs = IB_SA_DATA_OFFS;
+
+	umad = calloc(1, IB_MAD_SIZE + umad_size());
+	ack = calloc(1, IB_MAD_SIZE + umad_size());
+	if (!umad || !ack)
+		IBPANIC("cannot alloc mem for umad: %s\n", strerror(errno));
+
+	mad_build_pkt(umad, &rpc, &h->dport, NULL, data);
+	mad = umad_get_mad(umad);
+	mad_set_field64(mad, 0, IB_SA_MKEY_F, sm_key);
+	trid = (uint32_t) mad_get_field64(mad, 0, IB_MAD_TRID_F);
+
+	if (ibdebug > 1)
+		xdump(stdout, "SA Request:\n", mad, IB_MAD_SIZE);
+
+	if (umad_send(h->fd, h->rmpp_agent, umad, IB_MAD_SIZE, ibd_timeout,
+		      0) < 0) {
+		IBWARN("umad_send failed: attr 0x%x: %s\n",
+			attr, strerror(errno));
+		ret = errno;
+		goto out;
+	}
+
+	for (;;) {
+		len = IB_MAD_SIZE;
+		ret = umad_recv(h->fd, umad, &len, ibd_timeout);
+		if (ret == -ETIMEDOUT && expected > 1 &&
+		    retries++ < SA_RMPP_RETRIES) {
+			/* our ACK may have been lost; repeat it */
+			ack_at = expected - 1 + SA_RMPP_WINDOW / 2;
+			if ((ret = send_rmpp_ack(h, ack, last_mad, expected - 1,
+						 expected - 1 + SA_RMPP_WINDOW)))
+				goto out;
+			continue;
+		}
+		if (ret < 0) {
+			IBWARN("umad_recv failed: attr 0x%x: %s\n", attr,
+			       strerror(-ret));
+			ret = -ret;
+			goto out;
+		}
+		if ((ret = umad_status(umad)))
+			goto out;
+
+		mad = umad_get_mad(umad);
+		if ((uint32_t) mad_get_field64(mad, 0, IB_MAD_TRID_F) != trid)
+			continue;	/* left over from an earlier query */
+		if (ibdebug > 1)
+			xdump(stdout, "SA Response:\n", mad, IB_MAD_SIZE);
+		retries = 0;
+
+		result->status = mad_get_field(mad, 0, IB_MAD_STATUS_F);
+		flags = mad_get_field(mad, 0, IB_SA_RMPP_FLAGS_F);
+		if (!(flags & IB_RMPP_FLAG_ACTIVE)) {
+			/* the response fit in a single MAD */
+			if (result->status != IB_SA_MAD_STATUS_SUCCESS)
+				break;
+			s.recsz = mad_get_field(mad, 0, IB_SA_ATTROFFS_F) << 3;
+			n = SA_RMPP_SEG_DATA;
+			if (mad_get_field(mad, 0, IB_MAD_METHOD_F) !=
+			    IB_MAD_METHOD_GET_TABLE || !s.recsz) {
+				/* a single record */
+				if (!s.recsz || s.recsz > n)
+					s.recsz = n;
+				n = s.recsz;
+			}
+			s.carry = malloc(s.recsz);
+			if (!s.carry)
+				IBPANIC("cannot alloc mem for record");
+			stream_records(&s, mad + IB_SA_DATA_OFFS, n);
+			break;
+		}
+
+		type = mad_get_field(mad, 0, IB_SA_RMPP_TYPE_F);
+		if (type == IB_RMPP_TYPE_STOP || type == IB_RMPP_TYPE_ABORT) {
+			IBWARN("SA ended the transfer of attr 0x%x: RMPP status "
+			       "%d", attr, mad_get_field(mad, 0,
+							 IB_SA_RMPP_STATUS_F));
+			ret = EIO;
+			goto out;
+		}
+		if (type != IB_RMPP_TYPE_DATA)
+			continue;
+
+		segnum = mad_get_field(mad, 0, IB_SA_RMPP_SEGNUM_F);
+		if (segnum != expected) {
+			/* a duplicate or a gap: tell where we are */
+			if (expected > 1 &&
+			    (ret = send_rmpp_ack(h, ack, last_mad, expected - 1,
+						 expected - 1 + SA_RMPP_WINDOW)))
+				goto out;
+			continue;
+		}
+		memcpy(last_mad, mad, sizeof(last_mad));
+
+		if (segnum == 1 && result->status == IB_SA_MAD_STATUS_SUCCESS) {
+			s.recsz = mad_get_field(mad, 0, IB_SA_ATTROFFS_F) << 3;
+			if (s.recsz && !(s.carry = malloc(s.recsz)))
+				IBPANIC("cannot alloc mem for record");
+		}
+
+		n = SA_RMPP_SEG_DATA;
+		if (flags & IB_RMPP_FLAG_LAST) {
+			/* payload length counts the SA header */
+			n = mad_get_field(mad, 0, IB_SA_RMPP_LEN_F);
+			n = n > IB_SA_DATA_OFFS - SA_RMPP_HDR_SIZE ?
+			    n - (IB_SA_DATA_OFFS - SA_RMPP_HDR_SIZE) : 0;
+			if (n > SA_RMPP_SEG_DATA)
+				n = SA_RMPP_SEG_DATA;
+		}
+		if (s.recsz)
+			stream_records(&s, mad + IB_SA_DATA_OFFS, n);
+		expected++;
+
+		if (flags & IB_RMPP_FLAG_LAST) {
+			ret = send_rmpp_ack(h, ack, mad, segnum, segnum);
+			break;
+		}
+		if (segnum >= ack_at) {
+			/* keep the sender going while this window drains */
+			ack_at = segnum + SA_RMPP_WINDOW / 2;
+			if ((ret = send_rmpp_ack(h, ack, mad, segnum,
+						 segnum + SA_RMPP_WINDOW)))
+				goto out;
+		}
+	}
+
+	if (s.carried)
+		IBWARN("%u trailing bytes of attr 0x%x dropped", s.carried,
+		       attr);
+	if (result->status == IB_SA_MAD_STATUS_SUCCESS)
+		result->result_cnt = s.cnt;
+out:
+	free(s.carry);
+	free(ack);
+	free(umad);
+	return ret;
+}
+
 void *sa_get_query_rec(void *mad, unsigned i)
 {
 	int offset = mad_get_field(mad, 0, IB_SA_ATTROFFS_F);
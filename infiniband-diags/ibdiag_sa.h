@@ -50,6 +50,7 @@ struct sa_handle {
 	int fd, agent;
 	ib_portid_t dport;
 	struct ibmad_port *srcport;
+	int rmpp_agent;		/* user RMPP agent of sa_query_stream */
 };
 
 struct sa_query_result {
@@ -66,6 +67,17 @@ int sa_query(struct sa_handle *h, uint8_t method,
 	     uint16_t attr, uint32_t mod, uint64_t comp_mask, uint64_t sm_key,
 	     void *data, size_t datasz, struct sa_query_result *result);
 void sa_free_result_mad(struct sa_query_result *result);
+
+/* Called by sa_query_stream for every record received */
+typedef void (*sa_record_fn_t)(void *rec, unsigned recsz, void *context);
+
+/* Like sa_query, but records are passed to fn as they arrive rather than
+ * gathered into result, of which only status and result_cnt are set. */
+int sa_query_stream(struct sa_handle *h, uint8_t method,
+		    uint16_t attr, uint32_t mod, uint64_t comp_mask,
+		    uint64_t sm_key, void *data, size_t datasz,
+		    sa_record_fn_t fn, void *context,
+		    struct sa_query_result *result);
 void *sa_get_query_rec(void *mad, unsigned i);
 void sa_report_err(int status);
 
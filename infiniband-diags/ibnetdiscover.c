@@ -70,9 +70,14 @@ static nn_map_t *node_name_map = NULL;
 static char *cache_file = NULL;
 static char *load_cache_file = NULL;
 static char *diff_cache_file = NULL;
+static char *refresh_cache_file = NULL;
+static unsigned refresh_flags = IBND_REFRESH_FABRIC_FLAG_DEFAULT;
+static unsigned cache_flags = IBND_CACHE_FABRIC_FLAG_DEFAULT;
 static unsigned diffcheck_flags = DIFF_FLAG_DEFAULT;
 
 static int report_max_hops = 0;
+static int report_smp_stats = 0;
+static uint32_t adaptive_flags = 0;
 static int full_info;
 
 /**
@@ -541,6 +546,58 @@ static void router_iter_func(ibnd_node_t * node, void *iter_user_data)
 	}
 }
 
+static void dump_smp_stats(ibnd_fabric_t *fabric)
+{
+	ibnd_smp_stats_t stats[64];
+	int i, n;
+
+	n = ibnd_get_smp_stats(fabric, stats, 64);
+	if (n > 64)
+		n = 64;
+	fprintf(f, "# SMP response times:\n# %4s %8s %8s %10s %10s %10s\n",
+		"hops", "SMPs", "timeouts", "min usec", "avg usec", "max usec");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].smps && !stats[i].timeouts)
+			continue;
+		fprintf(f, "# %4u %8u %8u %10" PRIu64 " %10" PRIu64 " %10"
+			PRIu64 "\n", stats[i].hops, stats[i].smps,
+			stats[i].timeouts, stats[i].min_usec,
+			stats[i].smps ? stats[i].total_usec / stats[i].smps : 0,
+			stats[i].max_usec);
+	}
+}
+
+static void dump_delta(ibnd_delta_t *delta, void *user_data)
+{
+	static const char *const names[] = {
+		[IBND_DELTA_NODE_ADDED] = "node added",
+		[IBND_DELTA_NODE_REMOVED] = "node removed",
+		[IBND_DELTA_NODE_CHANGED] = "node changed",
+		[IBND_DELTA_LINK_ADDED] = "link added",
+		[IBND_DELTA_LINK_REMOVED] = "link removed",
+		[IBND_DELTA_LINK_CHANGED] = "link changed",
+	};
+	unsigned *n = user_data;
+
+	if (!(*n)++)
+		fprintf(f, "# Changes since %s:\n", refresh_cache_file);
+
+	fprintf(f, "#   %-12s %016" PRIx64, names[delta->type], delta->guid);
+	if (delta->type >= IBND_DELTA_LINK_ADDED)
+		fprintf(f, "[%d] - %016" PRIx64 "[%d]", delta->portnum,
+			delta->remote_guid, delta->remote_portnum);
+	fprintf(f, "\n");
+}
+
+static void dump_deltas(ibnd_fabric_t *fabric)
+{
+	unsigned n = 0;
+
+	ibnd_iter_deltas(fabric, dump_delta, &n);
+	if (!n)
+		fprintf(f, "# No changes since %s\n", refresh_cache_file);
+}
+
 static int dump_topology(int group, ibnd_fabric_t *fabric)
 {
 	ibnd_node_t *node;
@@ -556,6 +613,10 @@ static int dump_topology(int group, ibnd_fabric_t *fabric)
 		fprintf(f, "# Reported max hops discovered: %u\n"
 			"# Total MADs used: %u\n",
 			fabric->maxhops_discovered, fabric->total_mads_used);
+	if (report_smp_stats)
+		dump_smp_stats(fabric);
+	if (refresh_cache_file)
+		dump_deltas(fabric);
 	fprintf(f, "# Initiated from node %016" PRIx64 " port %016" PRIx64 "\n",
 		fabric->from_node->guid,
 		mad_get_field64(fabric->from_node->info, 0,
@@ -1030,6 +1091,36 @@ static int process_opt(void *context, int ch)
 			p = strtok(NULL, ",");
 		}
 		break;
+	case 6:
+		refresh_cache_file = strdup(optarg);
+		break;
+	case 7:
+		refresh_flags |= IBND_REFRESH_FABRIC_FLAG_QUICK;
+		break;
+	case 8:
+		adaptive_flags = IBND_CONFIG_ADAPTIVE_SMPS;
+		cfg->max_smps_limit = strtoul(optarg, NULL, 0);
+		break;
+	case 9:
+		cfg->ca_ports = 0;
+		p = strtok(optarg, ",");
+		while (p) {
+			unsigned long port = strtoul(p, NULL, 0);
+
+			if (!port || port > 31) {
+				fprintf(stderr, "invalid CA port: %s\n", p);
+				return -1;
+			}
+			cfg->ca_ports |= 1U << port;
+			p = strtok(NULL, ",");
+		}
+		break;
+	case 10:
+		report_smp_stats = 1;
+		break;
+	case 11:
+		cache_flags |= IBND_CACHE_FABRIC_FLAG_VERSION2;
+		break;
 	case 's':
 		cfg->show_progress = 1;
 		break;
@@ -1090,12 +1181,24 @@ int main(int argc, char **argv)
 		 "filename of ibnetdiscover cache to diff"},
 		{"diffcheck", 5, 1, "<key(s)>",
 		 "specify checks to execute for --diff"},
+		{"refresh", 6, 1, "<file>",
+		 "report what changed since the ibnetdiscover cache"},
+		{"quick-refresh", 7, 0, NULL,
+		 "only verify nodes for --refresh unless the topology changed"},
 		{"ports", 'p', 0, NULL, "obtain a ports report"},
 		{"max_hops", 'm', 0, NULL,
 		 "report max hops discovered by the library"},
 		{"outstanding_smps", 'o', 1, NULL,
 		 "specify the number of outstanding SMP's which should be "
 		 "issued during the scan"},
+		{"adaptive-smps", 8, 1, "<max>",
+		 "adapt the outstanding SMPs to response times, up to <max>"},
+		{"ca-ports", 9, 1, "<port(s)>",
+		 "also send SMPs from these ports of the CA"},
+		{"smp-stats", 10, 0, NULL,
+		 "report SMP response times by hops"},
+		{"cache-v2", 11, 0, NULL,
+		 "write the --cache file in the faster to load version 2 format"},
 		{}
 	};
 	char usage_args[] = "[topology-file]";
@@ -1111,7 +1214,7 @@ int main(int argc, char **argv)
 	if (ibd_timeout)
 		config.timeout_ms = ibd_timeout;
 
-	config.flags = ibd_ibnetdisc_flags;
+	config.flags = ibd_ibnetdisc_flags | adaptive_flags;
 
 	if (argc && !(f = fopen(argv[0], "w")))
 		IBEXIT("can't open file %s for writing", argv[0]);
@@ -1127,6 +1230,16 @@ int main(int argc, char **argv)
 	if (load_cache_file) {
 		if ((fabric = ibnd_load_fabric(load_cache_file, 0)) == NULL)
 			IBEXIT("loading cached fabric failed\n");
+	} else if (refresh_cache_file) {
+		ibnd_fabric_t *prev = ibnd_load_fabric(refresh_cache_file, 0);
+
+		if (!prev)
+			IBEXIT("loading cached fabric for refresh failed\n");
+		if ((fabric = ibnd_refresh_fabric(prev, ibd_ca, ibd_ca_port,
+						  NULL, &config,
+						  refresh_flags)) == NULL)
+			IBEXIT("refresh failed\n");
+		ibnd_destroy_fabric(prev);
 	} else {
 		if ((fabric =
 		     ibnd_discover_fabric(ibd_ca, ibd_ca_port, NULL, &config)) == NULL)
@@ -1143,7 +1256,7 @@ int main(int argc, char **argv)
 		dump_topology(group, fabric);
 
 	if (cache_file)
-		if (ibnd_cache_fabric(fabric, cache_file, 0) < 0)
+		if (ibnd_cache_fabric(fabric, cache_file, cache_flags) < 0)
 			IBEXIT("caching ibnetdiscover data failed\n");
 
 	ibnd_destroy_fabric(fabric);
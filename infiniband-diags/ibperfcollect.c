@@ -0,0 +1,774 @@
+/*
+ * Copyright (c) 2004-2009 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2010,2011 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <util/node_name_map.h>
+#include <infiniband/ibnetdisc.h>
+#include <infiniband/mad.h>
+
+#include "ibdiag_common.h"
+
+/*
+ * Ring buffer file layout.  All values are in host byte order.
+ *
+ *   struct perf_ring_header
+ *   struct perf_ring_port    [num_ports]	at port_offset
+ *   struct perf_ring_slot    [num_slots]	at slot_offset
+ *   struct perf_ring_sample  [num_slots][num_ports]	at sample_offset
+ *
+ * Sample number seq is stored in slot (seq % num_slots).  The collector
+ * fills a slot and then publishes it by incrementing header->seq, so
+ * header->seq is the number of samples written so far.  A reader that
+ * copies slot s must re-read header->seq afterwards; if it advanced by
+ * num_slots or more past s the slot was overwritten while being read.
+ */
+#define PERF_RING_MAGIC		0x49425052	/* "IBPR" */
+#define PERF_RING_VERSION	1
+
+struct perf_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_ports;
+	uint32_t num_slots;
+	uint32_t interval_ms;
+	uint32_t reserved;
+	uint64_t seq;
+	uint64_t port_offset;
+	uint64_t slot_offset;
+	uint64_t sample_offset;
+};
+
+#define PERF_RING_PORT_EXT		(1 << 0)	/* 64 bit data counters */
+#define PERF_RING_PORT_XMIT_WAIT	(1 << 1)	/* PortXmitWait supported */
+
+struct perf_ring_port {
+	uint64_t node_guid;
+	uint64_t port_guid;
+	uint16_t lid;
+	uint8_t portnum;
+	uint8_t flags;
+	uint32_t reserved;
+	char nodedesc[IB_SMP_DATA_SIZE];
+};
+
+struct perf_ring_slot {
+	uint64_t time_ns;	/* CLOCK_REALTIME at the start of the sweep */
+	uint64_t interval_ns;	/* time since the previous sweep */
+};
+
+#define PERF_SAMPLE_VALID	(1 << 0)	/* deltas are meaningful */
+#define PERF_SAMPLE_RESET	(1 << 1)	/* counters were reset */
+#define PERF_SAMPLE_WRAP	(1 << 2)	/* a counter wrapped */
+#define PERF_SAMPLE_SATURATED	(1 << 3)	/* a 32 bit counter is stuck */
+
+/* Counter increments over one interval; data counters are in 4 octet units */
+struct perf_ring_sample {
+	uint64_t xmit_data;
+	uint64_t rcv_data;
+	uint64_t xmit_pkts;
+	uint64_t rcv_pkts;
+	uint64_t xmit_wait;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+enum perf_ctr {
+	CTR_XMIT_DATA,
+	CTR_RCV_DATA,
+	CTR_XMIT_PKTS,
+	CTR_RCV_PKTS,
+	CTR_XMIT_WAIT,
+	CTR_MAX
+};
+
+static const enum MAD_FIELDS pc_fields[CTR_MAX] = {
+	IB_PC_XMT_BYTES_F, IB_PC_RCV_BYTES_F, IB_PC_XMT_PKTS_F,
+	IB_PC_RCV_PKTS_F, IB_PC_XMT_WAIT_F
+};
+
+static const enum MAD_FIELDS pce_fields[CTR_MAX] = {
+	IB_PC_EXT_XMT_BYTES_F, IB_PC_EXT_RCV_BYTES_F, IB_PC_EXT_XMT_PKTS_F,
+	IB_PC_EXT_RCV_PKTS_F, IB_PC_EXT_XMT_WAIT_F
+};
+
+struct collect_port {
+	ib_portid_t portid;
+	int portnum;
+	__be16 cap_mask;
+	uint32_t cap_mask2;
+	int cpi_valid;
+	int pc_valid, pce_valid;
+	uint8_t pc[IB_PC_DATA_SZ];
+	uint8_t pce[IB_PC_DATA_SZ];
+	int have_last;
+	uint64_t last[CTR_MAX];
+	ibnd_port_t *port;
+	char *name;
+};
+
+static struct ibmad_port *ibmad_port;
+static struct mad_async *pma_async;
+static char *node_name_map_file;
+static nn_map_t *node_name_map;
+static char *load_cache_file;
+static char *ring_file;
+static char *read_file;
+static int interval_sec = 10;
+static int num_slots = 360;
+static int pma_window = 64;
+static int sample_count;
+static int show_samples = 1;
+
+static struct collect_port *ports;
+static int num_ports, max_ports;
+static volatile sig_atomic_t stop;
+
+static struct perf_ring_header *ring;
+static size_t ring_size;
+
+static inline struct perf_ring_port *ring_port(struct perf_ring_header *hdr,
+					       unsigned i)
+{
+	return (struct perf_ring_port *)((uint8_t *)hdr + hdr->port_offset) +
+	       i;
+}
+
+static inline struct perf_ring_slot *ring_slot(struct perf_ring_header *hdr,
+					       unsigned slot)
+{
+	return (struct perf_ring_slot *)((uint8_t *)hdr + hdr->slot_offset) +
+	       slot;
+}
+
+static inline struct perf_ring_sample *
+ring_sample(struct perf_ring_header *hdr, unsigned slot, unsigned i)
+{
+	return (struct perf_ring_sample *)((uint8_t *)hdr +
+					   hdr->sample_offset) +
+	       (size_t)slot * hdr->num_ports + i;
+}
+
+static void add_port(ibnd_port_t *port)
+{
+	ibnd_node_t *node = port->node;
+	struct collect_port *cp;
+
+	if (num_ports == max_ports) {
+		max_ports = max_ports ? max_ports * 2 : 1024;
+		ports = realloc(ports, max_ports * sizeof(*ports));
+		if (!ports)
+			IBEXIT("out of memory for %d ports", max_ports);
+	}
+
+	cp = &ports[num_ports++];
+	memset(cp, 0, sizeof(*cp));
+	ib_portid_set(&cp->portid, node->type == IB_NODE_SWITCH ?
+		      node->smalid : port->base_lid, 0, 0);
+	cp->portid.qp = 1;
+	cp->portid.qkey = IB_DEFAULT_QP1_QKEY;
+	cp->portnum = port->portnum;
+	cp->port = port;
+	cp->name = remap_node_name(node_name_map, node->guid, node->nodedesc);
+}
+
+static void add_node_ports(ibnd_node_t *node, void *user_data)
+{
+	int p;
+
+	/* only ports with a link carry traffic worth sampling */
+	for (p = 1; p <= node->numports; p++)
+		if (node->ports[p] && node->ports[p]->remoteport)
+			add_port(node->ports[p]);
+}
+
+static void pma_done(struct mad_async *async, ib_rpc_t *rpc,
+		     ib_portid_t *dport, int status, uint8_t *mad, int len,
+		     void *context)
+{
+	struct collect_port *cp = context;
+	uint8_t *buf;
+
+	if (status || rpc->rstatus) {
+		if (ibverbose)
+			IBWARN("PMA attribute 0x%x query failed on %s, %s "
+			       "port %d", rpc->attr.id, cp->name,
+			       portid2str(dport), cp->portnum);
+		return;
+	}
+
+	switch (rpc->attr.id) {
+	case CLASS_PORT_INFO:
+		memcpy(&cp->cap_mask, mad + rpc->dataoffs + 2,
+		       sizeof(cp->cap_mask));
+		memcpy(&cp->cap_mask2, mad + rpc->dataoffs + 4,
+		       sizeof(cp->cap_mask2));
+		cp->cap_mask2 = ntohl(cp->cap_mask2) >> 5;
+		cp->cpi_valid = 1;
+		return;
+	case IB_GSI_PORT_COUNTERS:
+		buf = cp->pc;
+		cp->pc_valid = 1;
+		break;
+	default:
+		buf = cp->pce;
+		cp->pce_valid = 1;
+		break;
+	}
+	memcpy(buf, mad + rpc->dataoffs, IB_PC_DATA_SZ);
+}
+
+static void pma_submit(struct collect_port *cp, uint16_t attr_id)
+{
+	ib_rpc_t rpc = { 0 };
+	uint8_t data[IB_PC_DATA_SZ] = { 0 };
+
+	rpc.mgtclass = IB_PERFORMANCE_CLASS;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.attr.id = attr_id;
+	rpc.timeout = ibd_timeout;
+	rpc.datasz = IB_PC_DATA_SZ;
+	rpc.dataoffs = IB_PC_DATA_OFFS;
+	mad_set_field(data, 0, IB_PC_PORT_SELECT_F, cp->portnum);
+
+	if (mad_async_submit(pma_async, &rpc, &cp->portid, data, pma_done,
+			     cp) < 0)
+		IBWARN("PMA query submit failed on %s port %d", cp->name,
+		       cp->portnum);
+}
+
+static int port_has_ext(struct collect_port *cp)
+{
+	return !!(cp->cap_mask & (IB_PM_EXT_WIDTH_SUPPORTED |
+				  IB_PM_EXT_WIDTH_NOIETF_SUP));
+}
+
+static int port_has_ext_xmit_wait(struct collect_port *cp)
+{
+	return port_has_ext(cp) &&
+	       (htonl(cp->cap_mask2) & IB_PM_IS_ADDL_PORT_CTRS_EXT_SUP);
+}
+
+static int port_has_xmit_wait(struct collect_port *cp)
+{
+	return port_has_ext_xmit_wait(cp) ||
+	       (cp->cap_mask & IB_PM_PC_XMIT_WAIT_SUP);
+}
+
+/* PortCounters is only needed for 32 bit data counters or PortXmitWait */
+static int port_needs_pc(struct collect_port *cp)
+{
+	return !port_has_ext(cp) ||
+	       (port_has_xmit_wait(cp) && !port_has_ext_xmit_wait(cp));
+}
+
+static void sweep(void)
+{
+	int i;
+
+	for (i = 0; i < num_ports; i++) {
+		struct collect_port *cp = &ports[i];
+
+		cp->pc_valid = cp->pce_valid = 0;
+		if (port_needs_pc(cp))
+			pma_submit(cp, IB_GSI_PORT_COUNTERS);
+		if (port_has_ext(cp))
+			pma_submit(cp, IB_GSI_PORT_COUNTERS_EXT);
+	}
+
+	if (mad_async_wait(pma_async) < 0)
+		IBWARN("PMA sweep receive failed: %s", strerror(errno));
+}
+
+/*
+ * Increment of a counter of the given bit width.  PortCounters fields
+ * narrower than 64 bits saturate at their maximum rather than wrap, so
+ * one that went backwards was reset by someone and the current value is
+ * all we know was counted this interval.  Only 64 bit counters wrap, and
+ * only when they were near the top of the range and are now near the
+ * bottom.
+ */
+static uint64_t counter_delta(uint64_t cur, uint64_t last, int bits,
+			      uint32_t *flags)
+{
+	if (bits < 64) {
+		if (cur == (1ULL << bits) - 1)
+			*flags |= PERF_SAMPLE_SATURATED;
+		if (cur >= last)
+			return cur - last;
+		*flags |= PERF_SAMPLE_RESET;
+		return cur;
+	}
+
+	if (cur >= last)
+		return cur - last;
+
+	if (last > UINT64_MAX - (UINT64_MAX >> 2) && cur < (UINT64_MAX >> 2)) {
+		*flags |= PERF_SAMPLE_WRAP;
+		return UINT64_MAX - last + cur + 1;
+	}
+
+	*flags |= PERF_SAMPLE_RESET;
+	return cur;
+}
+
+static int field_is_64bit(enum MAD_FIELDS field)
+{
+	return (field >= IB_PC_EXT_XMT_BYTES_F &&
+		field <= IB_PC_EXT_RCV_MPKTS_F) ||
+	       (field >= IB_PC_EXT_ERR_SYM_F && field <= IB_PC_EXT_QP1_DROP_F);
+}
+
+static uint64_t get_counter(uint8_t *buf, enum MAD_FIELDS field)
+{
+	if (field_is_64bit(field))
+		return mad_get_field64(buf, 0, field);
+	return mad_get_field(buf, 0, field);
+}
+
+static void record_port(struct collect_port *cp, struct perf_ring_sample *s)
+{
+	uint64_t cur[CTR_MAX] = { 0 }, delta[CTR_MAX] = { 0 };
+	enum MAD_FIELDS field[CTR_MAX] = { 0 };
+	uint8_t *buf[CTR_MAX] = { NULL };
+	int bits[CTR_MAX] = { 0 };
+	int ext = port_has_ext(cp);
+	int i;
+
+	memset(s, 0, sizeof(*s));
+
+	if ((ext && !cp->pce_valid) || (port_needs_pc(cp) && !cp->pc_valid)) {
+		cp->have_last = 0;
+		return;
+	}
+
+	for (i = CTR_XMIT_DATA; i <= CTR_RCV_PKTS; i++) {
+		if (ext) {
+			buf[i] = cp->pce;
+			field[i] = pce_fields[i];
+		} else {
+			buf[i] = cp->pc;
+			field[i] = pc_fields[i];
+		}
+	}
+	if (port_has_ext_xmit_wait(cp)) {
+		buf[CTR_XMIT_WAIT] = cp->pce;
+		field[CTR_XMIT_WAIT] = IB_PC_EXT_XMT_WAIT_F;
+	} else if (port_has_xmit_wait(cp)) {
+		buf[CTR_XMIT_WAIT] = cp->pc;
+		field[CTR_XMIT_WAIT] = IB_PC_XMT_WAIT_F;
+	}
+
+	for (i = 0; i < CTR_MAX; i++) {
+		if (!buf[i])
+			continue;
+		cur[i] = get_counter(buf[i], field[i]);
+		bits[i] = field_is_64bit(field[i]) ? 64 : 32;
+	}
+
+	if (cp->have_last) {
+		for (i = 0; i < CTR_MAX; i++)
+			if (buf[i])
+				delta[i] = counter_delta(cur[i], cp->last[i],
+							 bits[i], &s->flags);
+		s->flags |= PERF_SAMPLE_VALID;
+	}
+
+	s->xmit_data = delta[CTR_XMIT_DATA];
+	s->rcv_data = delta[CTR_RCV_DATA];
+	s->xmit_pkts = delta[CTR_XMIT_PKTS];
+	s->rcv_pkts = delta[CTR_RCV_PKTS];
+	s->xmit_wait = delta[CTR_XMIT_WAIT];
+
+	memcpy(cp->last, cur, sizeof(cp->last));
+	cp->have_last = 1;
+}
+
+static void *create_ring(const char *file)
+{
+	struct perf_ring_header *hdr;
+	size_t port_offset, slot_offset, sample_offset;
+	int fd, i;
+
+	port_offset = sizeof(*hdr);
+	slot_offset = port_offset + num_ports * sizeof(struct perf_ring_port);
+	sample_offset = slot_offset + num_slots * sizeof(struct perf_ring_slot);
+	ring_size = sample_offset +
+		    (size_t)num_slots * num_ports *
+		    sizeof(struct perf_ring_sample);
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		IBEXIT("cannot create %s: %s", file, strerror(errno));
+	if (ftruncate(fd, ring_size) < 0)
+		IBEXIT("cannot size %s: %s", file, strerror(errno));
+	hdr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		IBEXIT("cannot map %s: %s", file, strerror(errno));
+
+	hdr->version = PERF_RING_VERSION;
+	hdr->num_ports = num_ports;
+	hdr->num_slots = num_slots;
+	hdr->interval_ms = interval_sec * 1000;
+	hdr->port_offset = port_offset;
+	hdr->slot_offset = slot_offset;
+	hdr->sample_offset = sample_offset;
+
+	for (i = 0; i < num_ports; i++) {
+		struct perf_ring_port *rp = ring_port(hdr, i);
+		struct collect_port *cp = &ports[i];
+
+		rp->node_guid = cp->port->node->guid;
+		rp->port_guid = cp->port->guid;
+		rp->lid = cp->portid.lid;
+		rp->portnum = cp->portnum;
+		strncpy(rp->nodedesc, cp->name, sizeof(rp->nodedesc) - 1);
+		if (port_has_ext(cp))
+			rp->flags |= PERF_RING_PORT_EXT;
+		if (port_has_xmit_wait(cp))
+			rp->flags |= PERF_RING_PORT_XMIT_WAIT;
+	}
+
+	return hdr;
+}
+
+static uint64_t timespec_ns(struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static void collect(void)
+{
+	struct timespec mono, last_mono = { 0 }, real;
+	uint64_t seq;
+	int i;
+
+	for (seq = 0; !stop && (!sample_count || seq < (uint64_t)sample_count);
+	     seq++) {
+		unsigned slot = seq % num_slots;
+		struct perf_ring_slot *rs = ring_slot(ring, slot);
+		int64_t wait_ns;
+
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		clock_gettime(CLOCK_REALTIME, &real);
+		sweep();
+
+		rs->time_ns = timespec_ns(&real);
+		rs->interval_ns = seq ? timespec_ns(&mono) -
+					timespec_ns(&last_mono) : 0;
+		for (i = 0; i < num_ports; i++)
+			record_port(&ports[i], ring_sample(ring, slot, i));
+
+		/* publish the slot only once it is complete */
+		__atomic_store_n(&ring->seq, seq + 1, __ATOMIC_RELEASE);
+		last_mono = mono;
+
+		if (sample_count && seq + 1 == (uint64_t)sample_count)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &real);
+		wait_ns = interval_sec * 1000000000LL -
+			  (int64_t)(timespec_ns(&real) - timespec_ns(&mono));
+		while (wait_ns > 0 && !stop) {
+			struct timespec ts = {
+				.tv_sec = wait_ns / 1000000000LL,
+				.tv_nsec = wait_ns % 1000000000LL
+			};
+
+			if (!nanosleep(&ts, &ts))
+				break;
+			wait_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		}
+	}
+
+	msync(ring, ring_size, MS_ASYNC);
+}
+
+static void print_rate(uint64_t delta, double secs, int data)
+{
+	const char *unit;
+	float val = 0;
+
+	unit = conv_cnt_human_readable((uint64_t)(delta / secs), &val, data);
+	printf(" %8.3f%-2s", val, unit);
+}
+
+static int dump_ring(const char *file)
+{
+	struct perf_ring_header *hdr;
+	struct stat st;
+	uint64_t seq, first, s;
+	unsigned i;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	if ((size_t)st.st_size < sizeof(*hdr) ||
+	    hdr->magic != PERF_RING_MAGIC ||
+	    hdr->version != PERF_RING_VERSION || !hdr->num_slots ||
+	    hdr->sample_offset + (uint64_t)hdr->num_slots * hdr->num_ports *
+	    sizeof(struct perf_ring_sample) > (uint64_t)st.st_size ||
+	    hdr->port_offset + (uint64_t)hdr->num_ports *
+	    sizeof(struct perf_ring_port) > hdr->slot_offset ||
+	    hdr->slot_offset + (uint64_t)hdr->num_slots *
+	    sizeof(struct perf_ring_slot) > hdr->sample_offset) {
+		fprintf(stderr, "%s is not a valid counter ring file\n", file);
+		munmap(hdr, st.st_size);
+		return -1;
+	}
+
+	seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+	first = seq > (uint64_t)show_samples ? seq - show_samples : 0;
+	/* the slot after the newest is the one the writer fills next */
+	if (seq >= hdr->num_slots && first <= seq - hdr->num_slots)
+		first = seq - hdr->num_slots + 1;
+
+	printf("# %u ports, %u slots, interval %u ms, %" PRIu64
+	       " samples\n", hdr->num_ports, hdr->num_slots,
+	       hdr->interval_ms, seq);
+	printf("%-8s %-18s %4s %10s %10s %10s %10s %10s  flags  node\n",
+	       "# sample", "PortGUID", "port", "XmitData/s", "RcvData/s",
+	       "XmitPkts/s", "RcvPkts/s", "XmitWait/s");
+
+	for (s = first; s < seq; s++) {
+		struct perf_ring_slot *rs = ring_slot(hdr, s % hdr->num_slots);
+		double secs = rs->interval_ns / 1e9;
+
+		for (i = 0; i < hdr->num_ports; i++) {
+			struct perf_ring_sample *smp =
+				ring_sample(hdr, s % hdr->num_slots, i);
+			struct perf_ring_port *rp = ring_port(hdr, i);
+
+			if (!(smp->flags & PERF_SAMPLE_VALID) || secs <= 0)
+				continue;
+			printf("%8" PRIu64 " 0x%016" PRIx64 " %4u", s,
+			       rp->port_guid, rp->portnum);
+			print_rate(smp->xmit_data, secs, 1);
+			print_rate(smp->rcv_data, secs, 1);
+			print_rate(smp->xmit_pkts, secs, 0);
+			print_rate(smp->rcv_pkts, secs, 0);
+			print_rate(smp->xmit_wait, secs, 0);
+			printf("  0x%02x  \"%.*s\"\n", smp->flags,
+			       (int)sizeof(rp->nodedesc), rp->nodedesc);
+		}
+	}
+
+	/*
+	 * Writing sample n reuses the slot of sample n - num_slots, so the
+	 * oldest sample printed is intact only while the writer has not
+	 * moved past it, i.e. header->seq is still below first + num_slots.
+	 */
+	if (first < seq && __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE) >=
+	    first + hdr->num_slots)
+		fprintf(stderr, "warning: ring wrapped while reading\n");
+
+	munmap(hdr, st.st_size);
+	return 0;
+}
+
+static int process_opt(void *context, int ch)
+{
+	struct ibnd_config *cfg = context;
+
+	switch (ch) {
+	case 1:
+		node_name_map_file = strdup(optarg);
+		if (node_name_map_file == NULL)
+			IBEXIT("out of memory, strdup for node_name_map_file name failed");
+		break;
+	case 2:
+		load_cache_file = strdup(optarg);
+		break;
+	case 3:
+		pma_window = strtoul(optarg, NULL, 0);
+		if (pma_window <= 0)
+			IBEXIT("invalid window %s", optarg);
+		break;
+	case 4:
+		read_file = optarg;
+		break;
+	case 'w':
+		ring_file = optarg;
+		break;
+	case 'i':
+		interval_sec = strtoul(optarg, NULL, 0);
+		if (interval_sec <= 0)
+			IBEXIT("invalid interval %s", optarg);
+		break;
+	case 'n':
+		num_slots = strtoul(optarg, NULL, 0);
+		if (num_slots <= 0)
+			IBEXIT("invalid number of slots %s", optarg);
+		break;
+	case 'c':
+		sample_count = strtoul(optarg, NULL, 0);
+		break;
+	case 'l':
+		show_samples = strtoul(optarg, NULL, 0);
+		break;
+	case 'o':
+		cfg->max_smps = strtoul(optarg, NULL, 0);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct ibnd_config config = { 0 };
+	ibnd_fabric_t *fabric;
+	struct sigaction sa = { .sa_handler = handle_signal };
+	int mgmt_classes[1] = { IB_PERFORMANCE_CLASS };
+	int i;
+
+	const struct ibdiag_opt opts[] = {
+		{"output", 'w', 1, "<file>",
+		 "ring buffer file to write samples to"},
+		{"interval", 'i', 1, "<seconds>",
+		 "sampling interval, default 10"},
+		{"slots", 'n', 1, "<n>",
+		 "number of samples kept per port, default 360"},
+		{"count", 'c', 1, "<n>",
+		 "stop after <n> samples (default: run until interrupted)"},
+		{"window", 3, 1, "<n>",
+		 "maximum number of outstanding PMA queries, default 64"},
+		{"read", 4, 1, "<file>",
+		 "print the rates stored in a ring buffer file and exit"},
+		{"last", 'l', 1, "<n>",
+		 "number of samples to print with --read, default 1"},
+		{"node-name-map", 1, 1, "<file>", "node name map file"},
+		{"load-cache", 2, 1, "<file>",
+		 "filename of ibnetdiscover cache to load"},
+		{"outstanding_smps", 'o', 1, NULL,
+		 "specify the number of outstanding SMP's which should be "
+		 "issued during the scan"},
+		{}
+	};
+	char usage_args[] = "";
+
+	ibdiag_process_opts(argc, argv, &config, "DGKLs", opts,
+			    process_opt, usage_args, NULL);
+
+	if (read_file)
+		exit(dump_ring(read_file) ? 1 : 0);
+
+	if (!ring_file)
+		IBEXIT("an output file (-w) is required");
+
+	node_name_map = open_node_name_map(node_name_map_file);
+
+	if (ibd_timeout)
+		config.timeout_ms = ibd_timeout;
+	config.flags = ibd_ibnetdisc_flags;
+	config.mkey = ibd_mkey;
+
+	if (load_cache_file) {
+		if ((fabric = ibnd_load_fabric(load_cache_file, 0)) == NULL)
+			IBEXIT("loading cached fabric failed");
+	} else if (!(fabric = ibnd_discover_fabric(ibd_ca, ibd_ca_port, NULL,
+						   &config)))
+		IBEXIT("discover failed");
+
+	ibnd_iter_nodes(fabric, add_node_ports, NULL);
+	if (!num_ports)
+		IBEXIT("no linked ports found");
+
+	ibmad_port = mad_rpc_open_port(ibd_ca, ibd_ca_port, mgmt_classes, 1);
+	if (!ibmad_port)
+		IBEXIT("Failed to open port; %s:%d\n", ibd_ca, ibd_ca_port);
+	if (ibd_timeout)
+		mad_rpc_set_timeout(ibmad_port, ibd_timeout);
+
+	pma_async = mad_async_create(ibmad_port, pma_window);
+	if (!pma_async)
+		IBEXIT("Failed to create PMA query engine: %s",
+		       strerror(errno));
+
+	/* capabilities decide which attributes are sampled for each port */
+	for (i = 0; i < num_ports; i++)
+		pma_submit(&ports[i], CLASS_PORT_INFO);
+	if (mad_async_wait(pma_async) < 0)
+		IBWARN("ClassPortInfo sweep failed: %s", strerror(errno));
+
+	ring = create_ring(ring_file);
+	__atomic_store_n(&ring->magic, PERF_RING_MAGIC, __ATOMIC_RELEASE);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	collect();
+
+	munmap(ring, ring_size);
+	mad_async_destroy(pma_async);
+	mad_rpc_close_port(ibmad_port);
+	for (i = 0; i < num_ports; i++)
+		free(ports[i].name);
+	free(ports);
+	ibnd_destroy_fabric(fabric);
+	close_node_name_map(node_name_map);
+	exit(0);
+}
@@ -534,6 +534,31 @@ static int print_results(ib_portid_t * portid, char *node_name,
 	return (n);
 }
 
+/* The same test print_results() applies before reporting a port */
+static int has_errors(uint8_t *pc, uint8_t *pce, uint32_t cap_mask2)
+{
+	char buf[2048];
+	int i, ext_i, n = 0;
+
+	for (i = IB_PC_ERR_SYM_F, ext_i = IB_PC_EXT_ERR_SYM_F;
+			i <= IB_PC_VL15_DROPPED_F; i++, ext_i++) {
+		if (suppress(i))
+			continue;
+		if (i == IB_PC_COUNTER_SELECT2_F) {
+			ext_i--;
+			continue;
+		}
+		check_threshold(pc, pce, cap_mask2, i, ext_i, &n, buf,
+				sizeof(buf));
+	}
+
+	if (!suppress(IB_PC_XMT_WAIT_F))
+		check_threshold(pc, pce, cap_mask2, IB_PC_XMT_WAIT_F,
+				IB_PC_EXT_XMT_WAIT_F, &n, buf, sizeof(buf));
+
+	return (n != 0);
+}
+
 static int query_cap_mask(ib_portid_t * portid, char *node_name, int portnum,
 			  __be16 * cap_mask, uint32_t * cap_mask2)
 {
@@ -561,42 +586,19 @@ static int query_cap_mask(ib_portid_t * portid, char *node_name, int portnum,
 	return 0;
 }
 
-static int print_data_cnts(ib_portid_t * portid, __be16 cap_mask,
-			   char *node_name, ibnd_node_t * node, int portnum,
-			   int *header_printed)
+static void dump_data_cnts(uint8_t *pc, __be16 cap_mask, char *node_name,
+			   ibnd_node_t *node, int portnum, int *header_printed)
 {
-	uint8_t pc[1024];
 	int i;
 	int start_field = IB_PC_XMT_BYTES_F;
 	int end_field = IB_PC_RCV_PKTS_F;
 
-	memset(pc, 0, 1024);
-
-	portid->sl = lid2sl_table[portid->lid];
-
 	if (cap_mask & (IB_PM_EXT_WIDTH_SUPPORTED | IB_PM_EXT_WIDTH_NOIETF_SUP)) {
-		if (!pma_query_via(pc, portid, portnum, ibd_timeout,
-				   IB_GSI_PORT_COUNTERS_EXT, ibmad_port)) {
-			IBWARN("IB_GSI_PORT_COUNTERS_EXT query failed on %s, %s port %d",
-			       node_name, portid2str(portid), portnum);
-			summary.pma_query_failures++;
-			return (1);
-		}
 		start_field = IB_PC_EXT_XMT_BYTES_F;
 		if (cap_mask & IB_PM_EXT_WIDTH_SUPPORTED)
 			end_field = IB_PC_EXT_RCV_MPKTS_F;
 		else
 			end_field = IB_PC_EXT_RCV_PKTS_F;
-	} else {
-		if (!pma_query_via(pc, portid, portnum, ibd_timeout,
-				   IB_GSI_PORT_COUNTERS, ibmad_port)) {
-			IBWARN("IB_GSI_PORT_COUNTERS query failed on %s, %s port %d",
-			       node_name, portid2str(portid), portnum);
-			summary.pma_query_failures++;
-			return (1);
-		}
-		start_field = IB_PC_XMT_BYTES_F;
-		end_field = IB_PC_RCV_PKTS_F;
 	}
 
 	if (!*header_printed) {
@@ -628,10 +630,49 @@ static int print_data_cnts(ib_portid_t * portid, __be16 cap_mask,
 
 	if (portnum != 0xFF && port_config)
 		print_port_config(node, portnum);
+}
+
+static int print_data_cnts(ib_portid_t * portid, __be16 cap_mask,
+			   char *node_name, ibnd_node_t * node, int portnum,
+			   int *header_printed)
+{
+	uint8_t pc[1024];
+
+	memset(pc, 0, 1024);
+
+	portid->sl = lid2sl_table[portid->lid];
+
+	if (cap_mask & (IB_PM_EXT_WIDTH_SUPPORTED | IB_PM_EXT_WIDTH_NOIETF_SUP)) {
+		if (!pma_query_via(pc, portid, portnum, ibd_timeout,
+				   IB_GSI_PORT_COUNTERS_EXT, ibmad_port)) {
+			IBWARN("IB_GSI_PORT_COUNTERS_EXT query failed on %s, %s port %d",
+			       node_name, portid2str(portid), portnum);
+			summary.pma_query_failures++;
+			return (1);
+		}
+	} else {
+		if (!pma_query_via(pc, portid, portnum, ibd_timeout,
+				   IB_GSI_PORT_COUNTERS, ibmad_port)) {
+			IBWARN("IB_GSI_PORT_COUNTERS query failed on %s, %s port %d",
+			       node_name, portid2str(portid), portnum);
+			summary.pma_query_failures++;
+			return (1);
+		}
+	}
 
+	dump_data_cnts(pc, cap_mask, node_name, node, portnum, header_printed);
 	return (0);
 }
 
+static void fixup_xmit_wait(uint8_t *pc, __be16 cap_mask)
+{
+	if (!(cap_mask & IB_PM_PC_XMIT_WAIT_SUP)) {
+		/* if PortCounters:PortXmitWait not supported clear this counter */
+		uint32_t foo = 0;
+		mad_encode_field(pc, IB_PC_XMT_WAIT_F, &foo);
+	}
+}
+
 static int print_errors(ib_portid_t * portid, __be16 cap_mask, uint32_t cap_mask2,
 			char *node_name, ibnd_node_t * node, int portnum,
 			int *header_printed)
@@ -664,11 +705,7 @@ static int print_errors(ib_portid_t * portid, __be16 cap_mask, uint32_t cap_mask
 		pc_ext = pce;
 	}
 
-	if (!(cap_mask & IB_PM_PC_XMIT_WAIT_SUP)) {
-		/* if PortCounters:PortXmitWait not supported clear this counter */
-		uint32_t foo = 0;
-		mad_encode_field(pc, IB_PC_XMT_WAIT_F, &foo);
-	}
+	fixup_xmit_wait(pc, cap_mask);
 	return (print_results(portid, node_name, node, pc, portnum,
 			      header_printed, pc_ext, cap_mask, cap_mask2));
 }
@@ -869,6 +906,602 @@ clear:
 	free(node_name);
 }
 
+/*
+ * Parallel sweep: ClassPortInfo, PortCounters and PortCountersExtended
+ * queries for the whole fabric are pipelined through a bounded window of
+ * outstanding MADs, and the results are kept in memory so they can be
+ * reported in node order (or compared between intervals in delta mode).
+ */
+#define DEF_PMA_WINDOW 64
+
+static int pma_window;
+static int delta_interval;
+static int delta_iterations;
+static struct mad_async *pma_async;
+
+struct sweep_node;
+
+struct pma_result {
+	struct sweep_node *snode;
+	int portnum;
+	uint16_t attr_id;
+	int valid;
+	uint8_t data[IB_PC_DATA_SZ];
+};
+
+struct sweep_port {
+	ib_portid_t portid;
+	struct pma_result pc;
+	struct pma_result pce;
+	uint8_t prev_pc[IB_PC_DATA_SZ];
+	uint8_t prev_pce[IB_PC_DATA_SZ];
+	int have_prev;
+};
+
+struct sweep_node {
+	ibnd_node_t *node;
+	char *node_name;
+	ib_portid_t portid;
+	int cpi_port;
+	__be16 cap_mask;
+	uint32_t cap_mask2;
+	struct pma_result cpi;
+	struct pma_result all_pc;
+	struct pma_result all_pce;
+	struct sweep_port *ports;	/* indexed by port number */
+};
+
+static struct {
+	struct sweep_node *nodes;
+	int num_nodes;
+	int max_nodes;
+} sweep;
+
+static const char *pma_attr_name(uint16_t attr_id)
+{
+	switch (attr_id) {
+	case CLASS_PORT_INFO:
+		return "classportinfo";
+	case IB_GSI_PORT_COUNTERS:
+		return "IB_GSI_PORT_COUNTERS";
+	case IB_GSI_PORT_COUNTERS_EXT:
+		return "IB_GSI_PORT_COUNTERS_EXT";
+	}
+	return "PMA";
+}
+
+static int has_ext_counters(__be16 cap_mask)
+{
+	return !!(cap_mask & (IB_PM_EXT_WIDTH_SUPPORTED |
+			      IB_PM_EXT_WIDTH_NOIETF_SUP));
+}
+
+static void pma_done(struct mad_async *async, ib_rpc_t *rpc,
+		     ib_portid_t *dport, int status, uint8_t *mad, int len,
+		     void *context)
+{
+	struct pma_result *res = context;
+
+	if (status || rpc->rstatus) {
+		IBWARN("%s query failed on %s, %s port %d",
+		       pma_attr_name(res->attr_id), res->snode->node_name,
+		       portid2str(dport), res->portnum);
+		summary.pma_query_failures++;
+		return;
+	}
+
+	memcpy(res->data, mad + rpc->dataoffs, sizeof(res->data));
+	res->valid = 1;
+}
+
+static void pma_submit(struct pma_result *res, struct sweep_node *sn,
+		       ib_portid_t *portid, int portnum, uint16_t attr_id)
+{
+	ib_rpc_t rpc = { 0 };
+	uint8_t data[IB_PC_DATA_SZ] = { 0 };
+
+	res->snode = sn;
+	res->portnum = portnum;
+	res->attr_id = attr_id;
+	res->valid = 0;
+
+	rpc.mgtclass = IB_PERFORMANCE_CLASS;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.attr.id = attr_id;
+	rpc.timeout = ibd_timeout;
+	rpc.datasz = IB_PC_DATA_SZ;
+	rpc.dataoffs = IB_PC_DATA_OFFS;
+	mad_set_field(data, 0, IB_PC_PORT_SELECT_F, portnum);
+
+	if (mad_async_submit(pma_async, &rpc, portid, data, pma_done,
+			     res) < 0) {
+		IBWARN("%s query submit failed on %s, %s port %d",
+		       pma_attr_name(attr_id), sn->node_name,
+		       portid2str(portid), portnum);
+		summary.pma_query_failures++;
+	}
+}
+
+static void sweep_wait(void)
+{
+	if (mad_async_wait(pma_async) < 0)
+		IBWARN("PMA sweep receive failed: %s", strerror(errno));
+}
+
+static void set_pma_portid(ib_portid_t *portid, int lid)
+{
+	ib_portid_set(portid, lid, 0, 0);
+	portid->sl = lid2sl_table[portid->lid];
+	portid->qp = 1;
+	portid->qkey = IB_DEFAULT_QP1_QKEY;
+}
+
+static void add_sweep_node(ibnd_node_t *node, void *user_data)
+{
+	struct sweep_node *sn;
+	int type = 0, p;
+
+	switch (node->type) {
+	case IB_NODE_SWITCH:
+		type = PRINT_SWITCH;
+		break;
+	case IB_NODE_CA:
+		type = PRINT_CA;
+		break;
+	case IB_NODE_ROUTER:
+		type = PRINT_ROUTER;
+		break;
+	}
+
+	if ((type & node_type_to_print) == 0)
+		return;
+
+	if (sweep.num_nodes == sweep.max_nodes) {
+		sweep.max_nodes = sweep.max_nodes ? sweep.max_nodes * 2 : 256;
+		sweep.nodes = realloc(sweep.nodes,
+				      sweep.max_nodes * sizeof(*sweep.nodes));
+		if (!sweep.nodes)
+			IBEXIT("out of memory for %d sweep nodes",
+			       sweep.max_nodes);
+	}
+
+	sn = &sweep.nodes[sweep.num_nodes++];
+	memset(sn, 0, sizeof(*sn));
+	sn->node = node;
+	sn->node_name = remap_node_name(node_name_map, node->guid,
+					node->nodedesc);
+	sn->ports = calloc(node->numports + 1, sizeof(*sn->ports));
+	if (!sn->ports)
+		IBEXIT("out of memory for %d sweep ports", node->numports + 1);
+
+	if (node->type == IB_NODE_SWITCH) {
+		set_pma_portid(&sn->portid, node->smalid);
+		sn->cpi_port = 0;
+	} else {
+		for (p = 1; p <= node->numports; p++) {
+			if (node->ports[p]) {
+				set_pma_portid(&sn->portid,
+					       node->ports[p]->base_lid);
+				sn->cpi_port = p;
+				break;
+			}
+		}
+	}
+
+	for (p = 0; p <= node->numports; p++) {
+		if (!node->ports[p])
+			continue;
+		if (node->type == IB_NODE_SWITCH)
+			sn->ports[p].portid = sn->portid;
+		else
+			set_pma_portid(&sn->ports[p].portid,
+				       node->ports[p]->base_lid);
+	}
+}
+
+static int sweep_start_port(struct sweep_node *sn)
+{
+	if (sn->node->type == IB_NODE_SWITCH && sn->node->smaenhsp0)
+		return 0;
+	return 1;
+}
+
+static int sweep_all_port_sup(struct sweep_node *sn)
+{
+	return sn->cpi.valid && (sn->cap_mask & IB_PM_ALL_PORT_SELECT);
+}
+
+static void sweep_class_port_info(void)
+{
+	struct sweep_node *sn;
+	__be16 rc_cap_mask;
+	__be32 rc_cap_mask2;
+	int i;
+
+	for (i = 0; i < sweep.num_nodes; i++) {
+		sn = &sweep.nodes[i];
+		pma_submit(&sn->cpi, sn, &sn->portid, sn->cpi_port,
+			   CLASS_PORT_INFO);
+	}
+	sweep_wait();
+
+	for (i = 0; i < sweep.num_nodes; i++) {
+		sn = &sweep.nodes[i];
+		if (!sn->cpi.valid)
+			continue;
+		/* CapabilityMask and CapabilityMask2, see query_cap_mask() */
+		memcpy(&rc_cap_mask, sn->cpi.data + 2, sizeof(rc_cap_mask));
+		memcpy(&rc_cap_mask2, sn->cpi.data + 4, sizeof(rc_cap_mask2));
+		sn->cap_mask = rc_cap_mask;
+		sn->cap_mask2 = ntohl(rc_cap_mask2) >> 5;
+	}
+}
+
+static void sweep_port_counters(struct sweep_node *sn, int portnum,
+				struct pma_result *pc, struct pma_result *pce,
+				ib_portid_t *portid, int want_pc)
+{
+	pc->valid = pce->valid = 0;
+	if (want_pc)
+		pma_submit(pc, sn, portid, portnum, IB_GSI_PORT_COUNTERS);
+	if (has_ext_counters(sn->cap_mask))
+		pma_submit(pce, sn, portid, portnum,
+			   IB_GSI_PORT_COUNTERS_EXT);
+}
+
+/* The all-port counters decide whether a node needs per port queries */
+static int sweep_needs_ports(struct sweep_node *sn)
+{
+	if (data_counters_only || !sweep_all_port_sup(sn))
+		return 1;
+	if (!sn->all_pc.valid ||
+	    (has_ext_counters(sn->cap_mask) && !sn->all_pce.valid))
+		return 0;
+	fixup_xmit_wait(sn->all_pc.data, sn->cap_mask);
+	return has_errors(sn->all_pc.data,
+			  has_ext_counters(sn->cap_mask) ?
+			  sn->all_pce.data : NULL, sn->cap_mask2);
+}
+
+static void sweep_ports(int all_ports)
+{
+	struct sweep_node *sn;
+	int i, p;
+
+	for (i = 0; i < sweep.num_nodes; i++) {
+		sn = &sweep.nodes[i];
+
+		if (!all_ports && !sweep_needs_ports(sn))
+			continue;
+
+		for (p = sweep_start_port(sn); p <= sn->node->numports; p++) {
+			struct sweep_port *sp = &sn->ports[p];
+
+			if (!sn->node->ports[p])
+				continue;
+			sweep_port_counters(sn, p, &sp->pc, &sp->pce,
+					    &sp->portid,
+					    delta_interval ||
+					    !data_counters_only ||
+					    !has_ext_counters(sn->cap_mask));
+		}
+	}
+	sweep_wait();
+}
+
+static void print_sweep_node(struct sweep_node *sn)
+{
+	ibnd_node_t *node = sn->node;
+	int header_printed = 0;
+	int all_port_sup = sweep_all_port_sup(sn);
+	int ext = has_ext_counters(sn->cap_mask);
+	int p;
+
+	if (data_counters_only) {
+		for (p = sweep_start_port(sn); p <= node->numports; p++) {
+			struct sweep_port *sp = &sn->ports[p];
+
+			if (!node->ports[p])
+				continue;
+			if (ext ? sp->pce.valid : sp->pc.valid)
+				dump_data_cnts(ext ? sp->pce.data :
+					       sp->pc.data, sn->cap_mask,
+					       sn->node_name, node, p,
+					       &header_printed);
+			summary.ports_checked++;
+			if (!all_port_sup)
+				clear_port(&sp->portid, sn->cap_mask,
+					   sn->cap_mask2, sn->node_name, p);
+		}
+	} else {
+		if (all_port_sup && !sweep_needs_ports(sn)) {
+			summary.ports_checked += node->numports;
+			goto clear;
+		}
+		if (all_port_sup)
+			print_results(&sn->portid, sn->node_name, node,
+				      sn->all_pc.data, 0xFF, &header_printed,
+				      ext ? sn->all_pce.data : NULL,
+				      sn->cap_mask, sn->cap_mask2);
+
+		for (p = sweep_start_port(sn); p <= node->numports; p++) {
+			struct sweep_port *sp = &sn->ports[p];
+
+			if (!node->ports[p])
+				continue;
+			if (sp->pc.valid && (!ext || sp->pce.valid)) {
+				fixup_xmit_wait(sp->pc.data, sn->cap_mask);
+				print_results(&sp->portid, sn->node_name, node,
+					      sp->pc.data, p, &header_printed,
+					      ext ? sp->pce.data : NULL,
+					      sn->cap_mask, sn->cap_mask2);
+			}
+			summary.ports_checked++;
+			if (!all_port_sup)
+				clear_port(&sp->portid, sn->cap_mask,
+					   sn->cap_mask2, sn->node_name, p);
+		}
+	}
+
+clear:
+	summary.nodes_checked++;
+	if (all_port_sup)
+		clear_port(&sn->portid, sn->cap_mask, sn->cap_mask2,
+			   sn->node_name, 0xFF);
+}
+
+static void parallel_sweep(void)
+{
+	struct sweep_node *sn;
+	int i;
+
+	sweep_class_port_info();
+
+	if (!data_counters_only) {
+		for (i = 0; i < sweep.num_nodes; i++) {
+			sn = &sweep.nodes[i];
+			if (sweep_all_port_sup(sn))
+				sweep_port_counters(sn, 0xFF, &sn->all_pc,
+						    &sn->all_pce, &sn->portid,
+						    1);
+		}
+		sweep_wait();
+	}
+
+	sweep_ports(0);
+
+	/* Detail queries and counter resets are issued synchronously */
+	for (i = 0; i < sweep.num_nodes; i++)
+		print_sweep_node(&sweep.nodes[i]);
+}
+
+/* PortCounters fields are up to 32 bits wide, PortCountersExtended ones 64 */
+static uint64_t get_counter(uint8_t *buf, enum MAD_FIELDS field)
+{
+	if ((field >= IB_PC_EXT_XMT_BYTES_F &&
+	     field <= IB_PC_EXT_RCV_MPKTS_F) ||
+	    (field >= IB_PC_EXT_ERR_SYM_F && field <= IB_PC_EXT_QP1_DROP_F))
+		return mad_get_field64(buf, 0, field);
+	return mad_get_field(buf, 0, field);
+}
+
+/*
+ * Like conv_cnt_human_readable() but for a rate, which is usually not a whole
+ * number; data counters count 4 byte words.
+ */
+static const char *rate_human_readable(double rate, double *val, int data)
+{
+	static const char *const cnt_units[] = { "", "K", "M", "G", "T", "P",
+						 "E" };
+	static const char *const data_units[] = { "B", "KB", "MB", "GB", "TB",
+						  "PB", "EB" };
+	unsigned ui = 0;
+
+	if (data)
+		rate *= 4;
+	while (rate >= 1024 && ui < 6) {
+		rate /= 1024;
+		ui++;
+	}
+
+	*val = rate;
+	return data ? data_units[ui] : cnt_units[ui];
+}
+
+static int print_delta_field(char *buf, size_t size, enum MAD_FIELDS field,
+			     uint8_t *cur, uint8_t *prev, double secs,
+			     int data)
+{
+	uint64_t val64, prev64, delta;
+	const char *unit;
+	double val;
+
+	val64 = get_counter(cur, field);
+	prev64 = get_counter(prev, field);
+
+	/* counters only go backwards when they were reset */
+	delta = val64 >= prev64 ? val64 - prev64 : val64;
+	if (!delta)
+		return 0;
+
+	unit = rate_human_readable(delta / secs, &val, data);
+	return snprintf(buf, size, " [%s +%" PRIu64 " (%5.3f%s/s)]",
+			mad_field_name(field), delta, val, unit);
+}
+
+static int print_delta_err(char *buf, size_t size, struct sweep_port *sp,
+			   int ext_err, enum MAD_FIELDS field,
+			   enum MAD_FIELDS ext_field, double secs)
+{
+	if (ext_err)
+		return print_delta_field(buf, size, ext_field, sp->pce.data,
+					 sp->prev_pce, secs, 0);
+	return print_delta_field(buf, size, field, sp->pc.data, sp->prev_pc,
+				 secs, 0);
+}
+
+static int print_port_delta(struct sweep_node *sn, int portnum, double secs,
+			    int *header_printed)
+{
+	struct sweep_port *sp = &sn->ports[portnum];
+	int ext = has_ext_counters(sn->cap_mask);
+	int ext_err = ext &&
+		(htonl(sn->cap_mask2) & IB_PM_IS_ADDL_PORT_CTRS_EXT_SUP);
+	char buf[2048];
+	int i, ext_i, n = 0;
+
+	for (i = IB_PC_ERR_SYM_F, ext_i = IB_PC_EXT_ERR_SYM_F;
+			!data_counters_only && i <= IB_PC_VL15_DROPPED_F;
+			i++, ext_i++) {
+		if (i == IB_PC_COUNTER_SELECT2_F) {
+			ext_i--;
+			continue;
+		}
+		if (suppress(i))
+			continue;
+		n += print_delta_err(buf + n, sizeof(buf) - n, sp, ext_err,
+				     i, ext_i, secs);
+	}
+
+	if (!data_counters_only && !suppress(IB_PC_XMT_WAIT_F))
+		n += print_delta_err(buf + n, sizeof(buf) - n, sp, ext_err,
+				     IB_PC_XMT_WAIT_F, IB_PC_EXT_XMT_WAIT_F,
+				     secs);
+
+	if ((n && data_counters) || data_counters_only) {
+		int start_field = IB_PC_XMT_BYTES_F;
+		int end_field = IB_PC_RCV_PKTS_F;
+		uint8_t *cur = sp->pc.data, *prev = sp->prev_pc;
+
+		if (ext) {
+			cur = sp->pce.data;
+			prev = sp->prev_pce;
+			start_field = IB_PC_EXT_XMT_BYTES_F;
+			if (sn->cap_mask & IB_PM_EXT_WIDTH_SUPPORTED)
+				end_field = IB_PC_EXT_RCV_MPKTS_F;
+			else
+				end_field = IB_PC_EXT_RCV_PKTS_F;
+		}
+
+		for (i = start_field; i <= end_field; i++)
+			n += print_delta_field(buf + n, sizeof(buf) - n, i,
+					       cur, prev, secs,
+					       i == IB_PC_EXT_XMT_BYTES_F ||
+					       i == IB_PC_EXT_RCV_BYTES_F ||
+					       i == IB_PC_XMT_BYTES_F ||
+					       i == IB_PC_RCV_BYTES_F);
+	}
+
+	if (!n)
+		return 0;
+
+	if (!*header_printed) {
+		printf("Rates for 0x%" PRIx64 " \"%s\"\n", sn->node->guid,
+		       sn->node_name);
+		*header_printed = 1;
+	}
+	printf("   GUID 0x%" PRIx64 " port %d:%s\n",
+	       sn->node->ports[portnum]->guid, portnum, buf);
+	return 1;
+}
+
+static double timespec_diff(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/*
+ * Continuous delta mode: every interval all ports are swept again and the
+ * counter increase since the previous sweep is reported as a rate.
+ */
+static void delta_sweep(void)
+{
+	struct timespec start, last = { 0 }, now;
+	int iter, i, p;
+
+	sweep_class_port_info();
+
+	for (iter = 0; !delta_iterations || iter <= delta_iterations; iter++) {
+		int ports = 0, bad_ports = 0, failures;
+		double secs;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		failures = summary.pma_query_failures;
+		sweep_ports(1);
+
+		secs = timespec_diff(&start, &last);
+		for (i = 0; i < sweep.num_nodes; i++) {
+			struct sweep_node *sn = &sweep.nodes[i];
+			int ext = has_ext_counters(sn->cap_mask);
+			int header_printed = 0;
+
+			for (p = sweep_start_port(sn);
+			     p <= sn->node->numports; p++) {
+				struct sweep_port *sp = &sn->ports[p];
+
+				if (!sn->node->ports[p])
+					continue;
+				if (!sp->pc.valid || (ext && !sp->pce.valid)) {
+					sp->have_prev = 0;
+					continue;
+				}
+				fixup_xmit_wait(sp->pc.data, sn->cap_mask);
+				if (sp->have_prev) {
+					ports++;
+					bad_ports += print_port_delta(sn, p,
+							secs, &header_printed);
+				}
+				memcpy(sp->prev_pc, sp->pc.data,
+				       sizeof(sp->prev_pc));
+				memcpy(sp->prev_pce, sp->pce.data,
+				       sizeof(sp->prev_pce));
+				sp->have_prev = 1;
+			}
+		}
+
+		if (iter)
+			printf("## Interval %d: %.3f s, %d ports sampled, "
+			       "%d ports with increasing counters, "
+			       "%d PMA query failures\n", iter, secs, ports,
+			       bad_ports, summary.pma_query_failures - failures);
+		fflush(stdout);
+		last = start;
+
+		if (delta_iterations && iter == delta_iterations)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = delta_interval - timespec_diff(&now, &start);
+		if (secs > 0)
+			usleep((useconds_t)(secs * 1e6));
+	}
+}
+
+static void run_parallel_sweep(ibnd_fabric_t *fabric)
+{
+	int i;
+
+	pma_async = mad_async_create(ibmad_port,
+				     pma_window ? pma_window : DEF_PMA_WINDOW);
+	if (!pma_async)
+		IBEXIT("Failed to create PMA sweep engine: %s",
+		       strerror(errno));
+
+	ibnd_iter_nodes(fabric, add_sweep_node, NULL);
+
+	if (delta_interval)
+		delta_sweep();
+	else
+		parallel_sweep();
+
+	mad_async_destroy(pma_async);
+	for (i = 0; i < sweep.num_nodes; i++) {
+		free(sweep.nodes[i].node_name);
+		free(sweep.nodes[i].ports);
+	}
+	free(sweep.nodes);
+}
+
 static void add_suppressed(enum MAD_FIELDS field)
 {
 	if (sup_total >= SUP_MAX) {
@@ -939,6 +1572,19 @@ static int process_opt(void *context, int ch)
 	case 10:
 		obtain_sl = 0;
 		break;
+	case 11:
+		pma_window = strtoul(optarg, NULL, 0);
+		if (pma_window <= 0)
+			IBEXIT("invalid parallel window %s", optarg);
+		break;
+	case 12:
+		delta_interval = strtoul(optarg, NULL, 0);
+		if (delta_interval <= 0)
+			IBEXIT("invalid delta interval %s", optarg);
+		break;
+	case 13:
+		delta_iterations = strtoul(optarg, NULL, 0);
+		break;
 	case 'G':
 	case 'S':
 		port_guid_str = optarg;
@@ -1017,6 +1663,12 @@ int main(int argc, char **argv)
 		{"outstanding_smps", 'o', 1, NULL,
 		 "specify the number of outstanding SMP's which should be "
 		 "issued during the scan"},
+		{"parallel", 11, 1, "<window>",
+		 "sweep all ports with up to <window> outstanding PMA queries"},
+		{"delta", 12, 1, "<seconds>",
+		 "continuously sweep and report counter rates every <seconds>"},
+		{"iterations", 13, 1, "<n>",
+		 "stop delta mode after <n> intervals (default: run forever)"},
 		{}
 	};
 	char usage_args[] = "";
@@ -1031,6 +1683,11 @@ int main(int argc, char **argv)
 	if (!node_type_to_print)
 		node_type_to_print = PRINT_ALL;
 
+	if (delta_interval && (port_guid_str || dr_path))
+		IBEXIT("--delta requires a full fabric sweep");
+	if (delta_interval && (clear_errors || clear_counts))
+		IBEXIT("--delta cannot be combined with clearing counters");
+
 	ibmad_port = mad_rpc_open_port(ibd_ca, ibd_ca_port, mgmt_classes, 4);
 	if (!ibmad_port)
 		IBEXIT("Failed to open port; %s:%d\n", ibd_ca, ibd_ca_port);
@@ -1153,9 +1810,15 @@ int main(int argc, char **argv)
 			if(path_record_query(self_gid,0))
 				goto close_port;
 
-		ibnd_iter_nodes(fabric, print_node, NULL);
+		if (pma_window || delta_interval)
+			run_parallel_sweep(fabric);
+		else
+			ibnd_iter_nodes(fabric, print_node, NULL);
 	}
 
+	if (delta_interval)
+		goto close_port;
+
 	rc = print_summary();
 	if (rc)
 		rc = 1;
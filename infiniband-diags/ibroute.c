@@ -37,17 +37,20 @@
 #include <unistd.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <netinet/in.h>
 
 #include <infiniband/umad.h>
 #include <infiniband/mad.h>
 #include <util/node_name_map.h>
+#include <ccan/container_of.h>
 
 #include "ibdiag_common.h"
 
 static struct ibmad_port *srcport;
 
 static int brief, dump_all, multicast;
+static int smp_window = 32;
 
 static char *node_name_map_file = NULL;
 static nn_map_t *node_name_map = NULL;
@@ -138,9 +141,10 @@ static const char *dump_multicast_tables(ib_portid_t *portid, unsigned startlid,
 	char str[512], *s;
 	const char *err;
 	uint64_t nodeguid;
-	uint32_t mod;
 	unsigned block, i, j, e, nports, cap, chunks, startblock, lastblock,
-	    top;
+	    top, nblocks, k;
+	struct smp_batch_req *reqs;
+	uint8_t *tbl;
 	char *mapnd = NULL;
 	int n = 0;
 
@@ -203,23 +207,37 @@ static const char *dump_multicast_tables(ib_portid_t *portid, unsigned startlid,
 
 	startblock = startlid / IB_MLIDS_IN_BLOCK;
 	lastblock = endlid / IB_MLIDS_IN_BLOCK;
-	for (block = startblock; block <= lastblock; block++) {
-		for (j = 0; j < chunks; j++) {
-			int status;
-			mod = (block - IB_MIN_MCAST_LID / IB_MLIDS_IN_BLOCK)
-			    | (j << 28);
-
-			DEBUG("reading block %x chunk %d mod %x", block, j,
-			      mod);
-			if (!smp_query_status_via
-			    (mft + j, portid, IB_ATTR_MULTICASTFORWTBL, mod, 0,
-			     &status, srcport)) {
+	nblocks = (lastblock - startblock + 1) * chunks;
+
+	tbl = calloc(nblocks, IB_SMP_DATA_SIZE);
+	reqs = calloc(nblocks, sizeof(*reqs));
+	if (!tbl || !reqs)
+		IBEXIT("out of memory for %u table blocks", nblocks);
+
+	for (block = startblock, k = 0; block <= lastblock; block++)
+		for (j = 0; j < chunks; j++, k++) {
+			reqs[k].portid = portid;
+			reqs[k].attrid = IB_ATTR_MULTICASTFORWTBL;
+			reqs[k].mod = (block - IB_MIN_MCAST_LID /
+				       IB_MLIDS_IN_BLOCK) | (j << 28);
+			reqs[k].rcvbuf = tbl + k * IB_SMP_DATA_SIZE;
+		}
+
+	DEBUG("reading %u blocks, window %d", nblocks, smp_window);
+	if (query_smp_batch(reqs, nblocks, smp_window, srcport) < 0)
+		IBEXIT("failed to issue MFT queries");
+
+	for (block = startblock, k = 0; block <= lastblock; block++) {
+		for (j = 0; j < chunks; j++, k++) {
+			if (reqs[k].status) {
 				fprintf(stderr, "SubnGet() failed"
 						"; MAD status 0x%x AM 0x%x\n",
-						status, mod);
-				free(mapnd);
-				return NULL;
+						reqs[k].status > 0 ?
+						reqs[k].status : 0,
+						reqs[k].mod);
+				goto done;
 			}
+			memcpy(mft[j], reqs[k].rcvbuf, sizeof(mft[j]));
 		}
 
 		i = block * IB_MLIDS_IN_BLOCK;
@@ -238,17 +256,96 @@ static const char *dump_multicast_tables(ib_portid_t *portid, unsigned startlid,
 	}
 
 	printf("%d %smlids dumped \n", n, dump_all ? "" : "valid ");
-
+done:
+	free(reqs);
+	free(tbl);
 	free(mapnd);
 	return NULL;
 }
 
-static int dump_lid(char *str, int strlen, int lid, int valid)
+/* Destination attributes prefetched for one lid of the dumped range */
+struct dest_info {
+	ib_portid_t lidport;
+	uint8_t nd[IB_SMP_DATA_SIZE];
+	uint8_t pi[IB_SMP_DATA_SIZE];
+	uint8_t ni[IB_SMP_DATA_SIZE];
+	int status;		/* nonzero if any query failed */
+};
+
+static void add_dest_req(struct smp_batch_req *req, struct dest_info *di,
+			 unsigned attrid, void *rcvbuf)
+{
+	req->portid = &di->lidport;
+	req->attrid = attrid;
+	req->timeout = 100;
+	req->rcvbuf = rcvbuf;
+}
+
+/*
+ * Query the destinations dump_lid() is going to resolve.  PortInfo is
+ * fetched for every valid lid first, so that lids covered by the LMC
+ * range of a preceding port can be skipped when fetching NodeDesc and
+ * NodeInfo.
+ */
+static void prefetch_dests(struct dest_info *dests, const uint8_t *lft,
+			   int startlid, int endlid, unsigned nports)
+{
+	int nlids = endlid - startlid + 1, lid, num, k, last_port_lid = 0;
+	struct smp_batch_req *reqs;
+
+	reqs = calloc(2 * nlids, sizeof(*reqs));
+	if (!reqs)
+		IBEXIT("out of memory for %d requests", 2 * nlids);
+
+	for (lid = startlid, num = 0; lid <= endlid; lid++) {
+		struct dest_info *di = &dests[lid - startlid];
+
+		di->status = -EIO;
+		if (lft[lid - startlid] > nports)
+			continue;
+		di->lidport.lid = lid;
+		add_dest_req(&reqs[num++], di, IB_ATTR_PORT_INFO, di->pi);
+	}
+
+	DEBUG("reading PortInfo of %d destinations", num);
+	if (query_smp_batch(reqs, num, smp_window, srcport) < 0)
+		IBEXIT("failed to issue PortInfo queries");
+
+	for (k = 0; k < num; k++)
+		container_of(reqs[k].portid, struct dest_info,
+			     lidport)->status = reqs[k].status;
+
+	for (lid = startlid, num = 0; lid <= endlid; lid++) {
+		struct dest_info *di = &dests[lid - startlid];
+		int baselid, lmc;
+
+		if (di->status || lid <= last_port_lid)
+			continue;
+
+		add_dest_req(&reqs[num++], di, IB_ATTR_NODE_DESC, di->nd);
+		add_dest_req(&reqs[num++], di, IB_ATTR_NODE_INFO, di->ni);
+
+		mad_decode_field(di->pi, IB_PORT_LID_F, &baselid);
+		mad_decode_field(di->pi, IB_PORT_LMC_F, &lmc);
+		if (lmc > 0)
+			last_port_lid = baselid + (1 << lmc) - 1;
+	}
+
+	DEBUG("reading NodeDesc and NodeInfo of %d destinations", num / 2);
+	if (query_smp_batch(reqs, num, smp_window, srcport) < 0)
+		IBEXIT("failed to issue NodeInfo queries");
+
+	for (k = 0; k < num; k++)
+		if (reqs[k].status)
+			container_of(reqs[k].portid, struct dest_info,
+				     lidport)->status = reqs[k].status;
+
+	free(reqs);
+}
+
+static int dump_lid(char *str, int strlen, int lid, int valid,
+		    struct dest_info *di)
 {
-	char nd[IB_SMP_DATA_SIZE] = { 0 };
-	uint8_t ni[IB_SMP_DATA_SIZE] = { 0 };
-	uint8_t pi[IB_SMP_DATA_SIZE] = { 0 };
-	ib_portid_t lidport = { 0 };
 	static int last_port_lid, base_port_lid;
 	char ntype[50], sguid[30];
 	static uint64_t portguid;
@@ -286,26 +383,24 @@ static int dump_lid(char *str, int strlen, int lid, int valid)
 		return snprintf(str, strlen, ": (illegal port)");
 
 	portguid = 0;
-	lidport.lid = lid;
 
-	if (!smp_query_via(nd, &lidport, IB_ATTR_NODE_DESC, 0, 100, srcport) ||
-	    !smp_query_via(pi, &lidport, IB_ATTR_PORT_INFO, 0, 100, srcport) ||
-	    !smp_query_via(ni, &lidport, IB_ATTR_NODE_INFO, 0, 100, srcport))
+	if (di->status)
 		return snprintf(str, strlen, ": (unknown node and type)");
 
-	mad_decode_field(ni, IB_NODE_GUID_F, &nodeguid);
-	mad_decode_field(ni, IB_NODE_PORT_GUID_F, &portguid);
-	mad_decode_field(ni, IB_NODE_TYPE_F, &type);
+	mad_decode_field(di->ni, IB_NODE_GUID_F, &nodeguid);
+	mad_decode_field(di->ni, IB_NODE_PORT_GUID_F, &portguid);
+	mad_decode_field(di->ni, IB_NODE_TYPE_F, &type);
 
-	mad_decode_field(pi, IB_PORT_LID_F, &baselid);
-	mad_decode_field(pi, IB_PORT_LMC_F, &lmc);
+	mad_decode_field(di->pi, IB_PORT_LID_F, &baselid);
+	mad_decode_field(di->pi, IB_PORT_LMC_F, &lmc);
 
 	if (lmc > 0) {
 		base_port_lid = baselid;
 		last_port_lid = baselid + (1 << lmc) - 1;
 	}
 
-	mapnd = remap_node_name(node_name_map, nodeguid, nd);
+	di->nd[IB_SMP_DATA_SIZE - 1] = '\0';
+	mapnd = remap_node_name(node_name_map, nodeguid, (char *)di->nd);
  
 	rc = snprintf(str, strlen, ": (%s portguid %s: '%s')",
 		      mad_dump_val(IB_NODE_TYPE_F, ntype, sizeof ntype,
@@ -321,15 +416,17 @@ static int dump_lid(char *str, int strlen, int lid, int valid)
 static const char *dump_unicast_tables(ib_portid_t *portid, int startlid,
 				       int endlid)
 {
-	char lft[IB_SMP_DATA_SIZE] = { 0 };
 	char nd[IB_SMP_DATA_SIZE] = { 0 };
 	uint8_t sw[IB_SMP_DATA_SIZE] = { 0 };
+	struct smp_batch_req *reqs = NULL;
+	struct dest_info *dests = NULL;
+	uint8_t *tbl = NULL;
 	char str[200];
 	const char *s;
 	uint64_t nodeguid;
 	int block, i, e, top;
 	unsigned nports;
-	int n = 0, startblock, endblock;
+	int n = 0, startblock, endblock, nblocks, base;
 	char *mapnd = NULL;
 
 	if ((s = check_switch(portid, &nports, &nodeguid, sw, nd)))
@@ -358,17 +455,51 @@ static const char *dump_unicast_tables(ib_portid_t *portid, int startlid,
 	printf("       Port     Info \n");
 	startblock = startlid / IB_SMP_DATA_SIZE;
 	endblock = ALIGN(endlid, IB_SMP_DATA_SIZE) / IB_SMP_DATA_SIZE;
+	if (endblock <= startblock)
+		goto done;
+	nblocks = endblock - startblock;
+
+	tbl = calloc(nblocks, IB_SMP_DATA_SIZE);
+	reqs = calloc(nblocks, sizeof(*reqs));
+	if (!tbl || !reqs)
+		IBEXIT("out of memory for %d table blocks", nblocks);
+
 	for (block = startblock; block < endblock; block++) {
-		int status;
-		DEBUG("reading block %d", block);
-		if (!smp_query_status_via(lft, portid, IB_ATTR_LINEARFORWTBL, block,
-				   0, &status, srcport)) {
+		i = block - startblock;
+		reqs[i].portid = portid;
+		reqs[i].attrid = IB_ATTR_LINEARFORWTBL;
+		reqs[i].mod = block;
+		reqs[i].rcvbuf = tbl + i * IB_SMP_DATA_SIZE;
+	}
+
+	DEBUG("reading %d blocks, window %d", nblocks, smp_window);
+	if (query_smp_batch(reqs, nblocks, smp_window, srcport) < 0)
+		IBEXIT("failed to issue LFT queries");
+
+	/* only blocks up to the first failure are dumped */
+	for (i = 0; i < nblocks; i++)
+		if (reqs[i].status) {
 			fprintf(stderr, "SubnGet() failed"
 					"; MAD status 0x%x AM 0x%x\n",
-					status, block);
-			free(mapnd);
-			return NULL;
+					reqs[i].status > 0 ? reqs[i].status : 0,
+					startblock + i);
+			endblock = startblock + i;
+			if (endlid >= endblock * IB_SMP_DATA_SIZE)
+				endlid = endblock * IB_SMP_DATA_SIZE - 1;
+			break;
 		}
+
+	/* tbl[0] holds the entry of lid base */
+	base = startblock * IB_SMP_DATA_SIZE;
+	if (!brief && startlid <= endlid) {
+		dests = calloc(endlid - startlid + 1, sizeof(*dests));
+		if (!dests)
+			IBEXIT("out of memory for %d destinations",
+			       endlid - startlid + 1);
+		prefetch_dests(dests, tbl + startlid - base, startlid, endlid, nports);
+	}
+
+	for (block = startblock; block < endblock; block++) {
 		i = block * IB_SMP_DATA_SIZE;
 		e = i + IB_SMP_DATA_SIZE;
 		if (i < startlid)
@@ -377,18 +508,23 @@ static const char *dump_unicast_tables(ib_portid_t *portid, int startlid,
 			e = endlid + 1;
 
 		for (; i < e; i++) {
-			unsigned outport = lft[i % IB_SMP_DATA_SIZE];
+			unsigned outport = tbl[i - base];
 			unsigned valid = (outport <= nports);
 
 			if (!valid && !dump_all)
 				continue;
-			dump_lid(str, sizeof str, i, valid);
+			dump_lid(str, sizeof str, i, valid,
+				 dests ? &dests[i - startlid] : NULL);
 			printf("0x%04x %03u %s\n", i, outport & 0xff, str);
 			n++;
 		}
 	}
 
 	printf("%d %slids dumped \n", n, dump_all ? "" : "valid ");
+done:
+	free(dests);
+	free(reqs);
+	free(tbl);
 	free(mapnd);
 	return NULL;
 }
@@ -410,6 +546,11 @@ static int process_opt(void *context, int ch)
 		if (node_name_map_file == NULL)
 			IBEXIT("out of memory, strdup for node_name_map_file name failed");
 		break;
+	case 2:
+		smp_window = strtoul(optarg, NULL, 0);
+		if (smp_window <= 0)
+			IBEXIT("invalid window %s", optarg);
+		break;
 	default:
 		return -1;
 	}
@@ -430,6 +571,8 @@ int main(int argc, char **argv)
 		 "do not try to resolve destinations"},
 		{"Multicast", 'M', 0, NULL, "show multicast forwarding tables"},
 		{"node-name-map", 1, 1, "<file>", "node name map file"},
+		{"window", 2, 1, "<n>",
+		 "maximum number of outstanding table queries, default 32"},
 		{}
 	};
 	char usage_args[] = "[<dest dr_path|lid|guid> [<startlid> [<endlid>]]]";
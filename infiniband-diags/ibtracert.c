@@ -40,12 +40,16 @@
 #include <ctype.h>
 #include <netinet/in.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <infiniband/umad.h>
 #include <infiniband/mad.h>
+#include <infiniband/ibnetdisc.h>
 #include <util/node_name_map.h>
 
 #include "ibdiag_common.h"
+#include "ibdiag_fts.h"
 
 static struct ibmad_port *srcport;
 
@@ -754,6 +758,8 @@ static int resolve_lid(ib_portid_t *portid)
 }
 
 static int dumplevel = 2, multicast, mlid;
+static char *load_cache_file, *fts_file;
+static int route_threads, route_top = 10;
 
 static int process_opt(void *context, int ch)
 {
@@ -768,6 +774,22 @@ static int process_opt(void *context, int ch)
 		if (ports_file == NULL)
 			IBEXIT("out of memory, strdup for ports_file name failed");
 		break;
+	case 3:
+		load_cache_file = strdup(optarg);
+		if (load_cache_file == NULL)
+			IBEXIT("out of memory, strdup for load_cache_file name failed");
+		break;
+	case 4:
+		fts_file = strdup(optarg);
+		if (fts_file == NULL)
+			IBEXIT("out of memory, strdup for fts_file name failed");
+		break;
+	case 5:
+		route_threads = strtol(optarg, NULL, 0);
+		break;
+	case 6:
+		route_top = strtol(optarg, NULL, 0);
+		break;
 	case 'm':
 		multicast++;
 		mlid = strtoul(optarg, NULL, 0);
@@ -857,7 +879,8 @@ static int get_route(char *srcid, char *dstid) {
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* Call route_fn for every source/destination pair of the ports file */
+static void read_ports_file(int (*route_fn)(char *srcid, char *dstid))
 {
 	char dstbuf[21];
 	char srcbuf[21];
@@ -866,6 +889,718 @@ int main(int argc, char **argv)
 	int len, i;
 	int line_count = 0;
 	int num_port_pairs = 0;
+
+	ports_fd = fopen(ports_file, "r");
+	if (!ports_fd)
+		IBEXIT("cannot open ports-file %s", ports_file);
+
+	while (fgets(portsbuf, sizeof(portsbuf), ports_fd) != NULL) {
+		line_count++;
+		p_first = strtok(portsbuf, "\n");
+		if (!p_first)
+			continue;	/* ignore blank lines */
+
+		len = (int) strlen(p_first);
+		for (i = 0; i < len; i++) {
+			if (!isspace(p_first[i]))
+				break;
+		}
+		if (i == len)		/* ignore all spaces */
+			continue;
+		if (p_first[i] == '#')
+			continue;	/* ignore comment lines */
+
+		if (sscanf(portsbuf, "%20s %20s", srcbuf, dstbuf) != 2)
+			IBEXIT("ports-file, %s, at line %i contains bad data",
+				ports_file, line_count);
+		num_port_pairs++;
+		if (route_fn(srcbuf, dstbuf) != 0)
+			IBEXIT("Failed to get route information at line %i",
+				line_count);
+	}
+	printf("%i lid/guid pairs processed from %s\n",
+	       num_port_pairs, ports_file);
+	fclose(ports_fd);
+}
+
+/*
+ * Offline route computation
+ *
+ * Routes are walked through the forwarding tables of a dump_fts snapshot
+ * over the topology of an ibnetdiscover cache, without sending any MAD.
+ * Each switch egress port is a channel.  The routes crossing every channel
+ * are counted, and the dependencies between consecutive channels of a
+ * route are collected into a channel dependency graph, whose cycles are
+ * the credit loop candidates (assuming all routes share one VL).
+ */
+
+enum route_result {
+	ROUTE_DELIVERED,
+	ROUTE_NO_ENTRY,
+	ROUTE_DEAD_END,
+	ROUTE_MISROUTED,
+	ROUTE_LOOP,
+	ROUTE_NUM_RESULTS
+};
+
+static const char * const route_result_str[] = {
+	"delivered",
+	"no LFT entry",
+	"dead end",
+	"misrouted",
+	"loop",
+};
+
+/* Channel dependencies: per channel, a bitmap of the next hop's out ports */
+#define DEP_BYTES	(256 / 8)
+#define PAIR_CHUNK	256
+
+struct route_sw {
+	ibnd_node_t *node;
+	uint8_t *lft;		/* out port per lid, 255 if none */
+	unsigned chan;		/* channel of port 1 */
+};
+
+/* Route source: a port and the first switch consulted, or -1 */
+struct route_ep {
+	ibnd_port_t *port;
+	int sw;
+};
+
+struct route_pair {
+	struct route_ep src;
+	uint16_t dlid;
+};
+
+struct route_stats {
+	uint64_t results[ROUTE_NUM_RESULTS];
+	uint64_t hops;
+	unsigned max_hops;
+};
+
+struct route_fabric {
+	ibnd_fabric_t *fabric;
+	struct route_sw *sw;
+	int nsw;
+	unsigned max_lid;
+	unsigned nchan;
+	int *chan_sw;		/* per channel: owning switch */
+	int *peer_sw;		/* per channel: remote switch, or -1 */
+	ibnd_port_t **peer;	/* per channel: remote port, or NULL */
+	struct route_ep *ep;	/* all end ports */
+	int nep;
+	struct route_pair *pairs;	/* explicit pairs, else all-to-all */
+	int npairs, maxpairs;
+};
+
+struct route_worker {
+	pthread_t thread;
+	struct route_fabric *rf;
+	uint64_t *count;	/* routes per channel */
+	uint8_t *deps;
+	struct route_stats st;
+};
+
+static unsigned route_next;
+static struct route_fabric route_fabric;
+
+static int port_has_lid(const ibnd_port_t *port, unsigned lid)
+{
+	return lid >= port->base_lid &&
+	       lid < port->base_lid + (1u << port->lmc);
+}
+
+static int cmp_route_sw(const void *a, const void *b)
+{
+	const struct route_sw *sa = a, *sb = b;
+
+	if (sa->node == sb->node)
+		return 0;
+	return sa->node < sb->node ? -1 : 1;
+}
+
+static int find_route_sw(struct route_fabric *rf, ibnd_node_t *node)
+{
+	struct route_sw key = { .node = node }, *s;
+
+	if (!node || node->type != IB_NODE_SWITCH)
+		return -1;
+	s = bsearch(&key, rf->sw, rf->nsw, sizeof(*rf->sw), cmp_route_sw);
+	return s ? s - rf->sw : -1;
+}
+
+static void route_ep_set(struct route_fabric *rf, struct route_ep *ep,
+			 ibnd_port_t *port)
+{
+	ep->port = port;
+	if (port->node->type == IB_NODE_SWITCH)
+		ep->sw = find_route_sw(rf, port->node);
+	else
+		ep->sw = port->remoteport ?
+			 find_route_sw(rf, port->remoteport->node) : -1;
+}
+
+static void add_route_sw(ibnd_node_t *node, void *user_data)
+{
+	struct route_fabric *rf = user_data;
+
+	rf->sw[rf->nsw++].node = node;
+}
+
+static void count_route_node(ibnd_node_t *node, void *user_data)
+{
+	struct route_fabric *rf = user_data;
+	int p;
+
+	if (node->type == IB_NODE_SWITCH) {
+		rf->nsw++;
+		rf->nchan += node->numports;
+		if (node->smalid + (1u << node->smalmc) - 1 > rf->max_lid)
+			rf->max_lid = node->smalid + (1u << node->smalmc) - 1;
+		return;
+	}
+
+	for (p = 1; p <= node->numports; p++) {
+		ibnd_port_t *port = node->ports[p];
+
+		if (!port || !port->base_lid)
+			continue;
+		rf->nep++;
+		if (port->base_lid + (1u << port->lmc) - 1 > rf->max_lid)
+			rf->max_lid = port->base_lid + (1u << port->lmc) - 1;
+	}
+}
+
+static void add_route_ep(ibnd_node_t *node, void *user_data)
+{
+	struct route_fabric *rf = user_data;
+	int p;
+
+	if (node->type == IB_NODE_SWITCH)
+		return;
+
+	for (p = 1; p <= node->numports; p++)
+		if (node->ports[p] && node->ports[p]->base_lid)
+			route_ep_set(rf, &rf->ep[rf->nep++], node->ports[p]);
+}
+
+/* Build the compact route tables from the fabric and the LFT snapshot */
+static void route_fabric_init(struct route_fabric *rf, ibnd_fabric_t *fabric,
+			      struct fts_table *fts)
+{
+	unsigned lid, nchan = 0;
+	int i, p, tables = 0;
+
+	rf->fabric = fabric;
+	for (i = 0; i < fts->num; i++)
+		if (fts->sw[i].endl > rf->max_lid)
+			rf->max_lid = fts->sw[i].endl;
+	ibnd_iter_nodes(fabric, count_route_node, rf);
+
+	rf->sw = calloc(rf->nsw ? rf->nsw : 1, sizeof(*rf->sw));
+	rf->ep = calloc(rf->nep ? rf->nep : 1, sizeof(*rf->ep));
+	rf->chan_sw = calloc(rf->nchan ? rf->nchan : 1, sizeof(*rf->chan_sw));
+	rf->peer_sw = calloc(rf->nchan ? rf->nchan : 1, sizeof(*rf->peer_sw));
+	rf->peer = calloc(rf->nchan ? rf->nchan : 1, sizeof(*rf->peer));
+	if (!rf->sw || !rf->ep || !rf->chan_sw || !rf->peer_sw || !rf->peer)
+		IBEXIT("out of memory for %d switches", rf->nsw);
+
+	rf->nsw = 0;
+	ibnd_iter_nodes_type(fabric, add_route_sw, IB_NODE_SWITCH, rf);
+	qsort(rf->sw, rf->nsw, sizeof(*rf->sw), cmp_route_sw);
+
+	for (i = 0; i < rf->nsw; i++) {
+		struct route_sw *s = &rf->sw[i];
+
+		s->lft = malloc(rf->max_lid + 1);
+		if (!s->lft)
+			IBEXIT("out of memory for the LFT of %d lids",
+			       rf->max_lid + 1);
+		memset(s->lft, 255, rf->max_lid + 1);
+
+		s->chan = nchan;
+		for (p = 1; p <= s->node->numports; p++, nchan++) {
+			ibnd_port_t *port = s->node->ports[p];
+
+			rf->chan_sw[nchan] = i;
+			rf->peer[nchan] = port ? port->remoteport : NULL;
+			rf->peer_sw[nchan] = port && port->remoteport ?
+				find_route_sw(rf, port->remoteport->node) : -1;
+		}
+	}
+
+	for (i = 0; i < fts->num; i++) {
+		struct fts_switch *fsw = &fts->sw[i];
+		int n = find_route_sw(rf, ibnd_find_node_guid(fabric,
+							      fsw->guid));
+
+		if (n < 0) {
+			IBWARN("switch guid 0x%016" PRIx64 " of %s is not in "
+			       "the fabric", fsw->guid, fts_file);
+			continue;
+		}
+		for (lid = fsw->startl; lid <= fsw->endl; lid++) {
+			int out = fts_lft_entry(fsw, lid);
+
+			rf->sw[n].lft[lid] = out < 0 ? 255 : out;
+		}
+		tables++;
+	}
+
+	if (tables < rf->nsw)
+		IBWARN("%d switches have no forwarding table in %s",
+		       rf->nsw - tables, fts_file);
+
+	rf->nep = 0;
+	ibnd_iter_nodes(fabric, add_route_ep, rf);
+}
+
+static void dump_route_hop(int out, ibnd_port_t *port)
+{
+	char *nodename;
+	ibnd_node_t *node = port->node;
+
+	if (dumplevel == 1) {
+		fprintf(f, "[%d] -> {0x%016" PRIx64 "}[%d]\n", out, port->guid,
+			port->portnum);
+		return;
+	}
+
+	nodename = remap_node_name(node_name_map, node->guid, node->nodedesc);
+	fprintf(f, "[%d] -> %s port {0x%016" PRIx64 "}[%d] lid %u-%u \"%s\"\n",
+		out, node->type <= IB_NODE_MAX ? node_type_str[node->type] :
+		"???", port->guid, port->portnum, port->base_lid,
+		port->base_lid + (1 << port->lmc) - 1, nodename);
+	free(nodename);
+}
+
+/*
+ * Walk the route from src to dlid.  The channels used are accounted to
+ * the worker w, if any, and the hops are printed if dump is set.
+ */
+static enum route_result route_walk(struct route_fabric *rf,
+				    const struct route_ep *src, unsigned dlid,
+				    struct route_worker *w, int dump,
+				    unsigned *hops)
+{
+	int sw = src->sw, prev = -1;
+	unsigned out, c;
+
+	*hops = 0;
+	if (sw < 0) {
+		ibnd_port_t *peer = src->port->remoteport;
+
+		if (dump && peer)
+			dump_route_hop(src->port->portnum, peer);
+		return peer && port_has_lid(peer, dlid) ?
+		       ROUTE_DELIVERED : ROUTE_DEAD_END;
+	}
+	if (dump && src->port->node->type != IB_NODE_SWITCH)
+		dump_route_hop(src->port->portnum, src->port->remoteport);
+
+	for (;;) {
+		struct route_sw *s = &rf->sw[sw];
+		ibnd_node_t *node = s->node;
+
+		out = dlid <= rf->max_lid ? s->lft[dlid] : 255;
+		if (out == 0)
+			return dlid >= node->smalid &&
+			       dlid < node->smalid + (1u << node->smalmc) ?
+			       ROUTE_DELIVERED : ROUTE_MISROUTED;
+		if (out > (unsigned)node->numports)
+			return ROUTE_NO_ENTRY;
+
+		c = s->chan + out - 1;
+		if (w) {
+			w->count[c]++;
+			if (prev >= 0)
+				w->deps[prev * DEP_BYTES + out / 8] |=
+					1 << (out % 8);
+		}
+		if (!rf->peer[c])
+			return ROUTE_DEAD_END;
+		if (dump)
+			dump_route_hop(out, rf->peer[c]);
+
+		if (rf->peer_sw[c] < 0)
+			return port_has_lid(rf->peer[c], dlid) ?
+			       ROUTE_DELIVERED : ROUTE_MISROUTED;
+
+		prev = c;
+		sw = rf->peer_sw[c];
+		if (++*hops > MAXHOPS)
+			return ROUTE_LOOP;
+	}
+}
+
+static void route_one(struct route_worker *w, const struct route_ep *src,
+		      unsigned dlid)
+{
+	unsigned hops;
+	enum route_result res;
+
+	res = route_walk(w->rf, src, dlid, w, 0, &hops);
+	w->st.results[res]++;
+	w->st.hops += hops;
+	if (hops > w->st.max_hops)
+		w->st.max_hops = hops;
+}
+
+static void *route_worker_run(void *arg)
+{
+	struct route_worker *w = arg;
+	struct route_fabric *rf = w->rf;
+	unsigned i, d, end;
+
+	if (rf->pairs) {
+		for (;;) {
+			i = __atomic_fetch_add(&route_next, PAIR_CHUNK,
+					       __ATOMIC_RELAXED);
+			if (i >= (unsigned)rf->npairs)
+				break;
+			end = i + PAIR_CHUNK;
+			if (end > (unsigned)rf->npairs)
+				end = rf->npairs;
+			for (; i < end; i++)
+				route_one(w, &rf->pairs[i].src,
+					  rf->pairs[i].dlid);
+		}
+		return NULL;
+	}
+
+	while ((i = __atomic_fetch_add(&route_next, 1, __ATOMIC_RELAXED)) <
+	       (unsigned)rf->nep)
+		for (d = 0; d < (unsigned)rf->nep; d++)
+			if (d != i)
+				route_one(w, &rf->ep[i],
+					  rf->ep[d].port->base_lid);
+	return NULL;
+}
+
+static void dump_channel(struct route_fabric *rf, unsigned c)
+{
+	struct route_sw *s = &rf->sw[rf->chan_sw[c]];
+	ibnd_port_t *peer = rf->peer[c];
+	char *name, *peername = NULL;
+
+	name = remap_node_name(node_name_map, s->node->guid,
+			       s->node->nodedesc);
+	if (peer)
+		peername = remap_node_name(node_name_map, peer->node->guid,
+					   peer->node->nodedesc);
+	fprintf(f, "0x%016" PRIx64 " %3u \"%s\" -> ", s->node->guid,
+		c - s->chan + 1, name);
+	if (peer)
+		fprintf(f, "0x%016" PRIx64 " %3u \"%s\"\n", peer->node->guid,
+			peer->portnum, peername);
+	else
+		fprintf(f, "(down)\n");
+	free(peername);
+	free(name);
+}
+
+/* Report the cycles of the channel dependency graph found by a DFS */
+static int find_credit_loops(struct route_fabric *rf, const uint8_t *deps)
+{
+	uint8_t *color = calloc(rf->nchan ? rf->nchan : 1, 1);
+	unsigned *stack = calloc(rf->nchan ? rf->nchan : 1, sizeof(*stack));
+	unsigned *iter = calloc(rf->nchan ? rf->nchan : 1, sizeof(*iter));
+	unsigned *pos = calloc(rf->nchan ? rf->nchan : 1, sizeof(*pos));
+	unsigned root, c, p, n, k;
+	int sp, loops = 0;
+
+	if (!color || !stack || !iter || !pos)
+		IBEXIT("out of memory for %u channels", rf->nchan);
+
+	for (root = 0; root < rf->nchan; root++) {
+		if (color[root])
+			continue;
+		sp = 0;
+		stack[sp] = root;
+		iter[sp] = 1;
+		pos[root] = sp++;
+		color[root] = 1;
+
+		while (sp > 0) {
+			c = stack[sp - 1];
+			for (p = iter[sp - 1]; p < 256; p++)
+				if (deps[c * DEP_BYTES + p / 8] & (1 << (p % 8)))
+					break;
+			if (p == 256) {
+				color[c] = 2;
+				sp--;
+				continue;
+			}
+			iter[sp - 1] = p + 1;
+			n = rf->sw[rf->peer_sw[c]].chan + p - 1;
+
+			if (color[n] == 1) {
+				if (loops++ < route_top || !route_top) {
+					fprintf(f, "Credit loop candidate %d, "
+						"%d channels:\n", loops,
+						sp - pos[n]);
+					for (k = pos[n]; k < (unsigned)sp; k++) {
+						fprintf(f, "   ");
+						dump_channel(rf, stack[k]);
+					}
+				}
+			} else if (!color[n]) {
+				stack[sp] = n;
+				iter[sp] = 1;
+				pos[n] = sp++;
+				color[n] = 1;
+			}
+		}
+	}
+
+	free(pos);
+	free(iter);
+	free(stack);
+	free(color);
+	return loops;
+}
+
+static uint64_t *sort_count;
+
+static int cmp_channel_count(const void *a, const void *b)
+{
+	uint64_t ca = sort_count[*(const unsigned *)a];
+	uint64_t cb = sort_count[*(const unsigned *)b];
+
+	if (ca == cb)
+		return *(const unsigned *)a < *(const unsigned *)b ? -1 : 1;
+	return ca > cb ? -1 : 1;
+}
+
+static void report_routes(struct route_fabric *rf, struct route_worker *w,
+			  int nthreads, double elapsed)
+{
+	struct route_stats st;
+	uint64_t *count = w[0].count, total = 0;
+	uint8_t *deps = w[0].deps;
+	unsigned *order, used = 0, c, k;
+	int i, r, loops;
+
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < nthreads; i++) {
+		for (r = 0; r < ROUTE_NUM_RESULTS; r++)
+			st.results[r] += w[i].st.results[r];
+		st.hops += w[i].st.hops;
+		if (w[i].st.max_hops > st.max_hops)
+			st.max_hops = w[i].st.max_hops;
+		if (!i)
+			continue;
+		for (c = 0; c < rf->nchan; c++)
+			count[c] += w[i].count[c];
+		for (k = 0; k < rf->nchan * DEP_BYTES; k++)
+			deps[k] |= w[i].deps[k];
+	}
+
+	for (r = 0; r < ROUTE_NUM_RESULTS; r++)
+		total += st.results[r];
+
+	fprintf(f, "%" PRIu64 " routes computed in %.3f s with %d threads\n",
+		total, elapsed, nthreads);
+	for (r = 0; r < ROUTE_NUM_RESULTS; r++)
+		fprintf(f, "   %-14s %" PRIu64 "\n", route_result_str[r],
+			st.results[r]);
+	fprintf(f, "   switch hops    average %.2f, max %u\n",
+		total ? (double)st.hops / total : 0.0, st.max_hops);
+
+	order = calloc(rf->nchan ? rf->nchan : 1, sizeof(*order));
+	if (!order)
+		IBEXIT("out of memory for %u channels", rf->nchan);
+	for (c = 0; c < rf->nchan; c++)
+		if (count[c])
+			order[used++] = c;
+	sort_count = count;
+	qsort(order, used, sizeof(*order), cmp_channel_count);
+
+	fprintf(f, "%u of %u switch ports carry routes, %" PRIu64
+		" routes on the busiest\n", used, rf->nchan,
+		used ? count[order[0]] : 0);
+	if (used) {
+		k = route_top && route_top < (int)used ? route_top : used;
+		fprintf(f, "%s links by route count:\n", k < used ?
+			"Busiest" : "All");
+		for (c = 0; c < k; c++) {
+			fprintf(f, "%10" PRIu64 " ", count[order[c]]);
+			dump_channel(rf, order[c]);
+		}
+	}
+	free(order);
+
+	loops = find_credit_loops(rf, deps);
+	fprintf(f, "%d credit loop candidates\n", loops);
+}
+
+static int resolve_offline_port(char *addr, struct route_ep *ep)
+{
+	ibnd_port_t *port = NULL;
+
+	switch (ibd_dest_type) {
+	case IB_DEST_LID:
+		port = ibnd_find_port_lid(route_fabric.fabric,
+					  strtoul(addr, NULL, 0));
+		break;
+	case IB_DEST_GUID:
+		port = ibnd_find_port_guid(route_fabric.fabric,
+					   strtoull(addr, NULL, 0));
+		break;
+	default:
+		IBEXIT("only lid and guid addresses can be routed offline");
+	}
+
+	if (!port || !port->base_lid) {
+		IBWARN("can't find port %s in the fabric", addr);
+		return -1;
+	}
+	route_ep_set(&route_fabric, ep, port);
+	return 0;
+}
+
+static int add_offline_pair(char *srcid, char *dstid)
+{
+	struct route_fabric *rf = &route_fabric;
+	struct route_ep src, dst;
+
+	if (resolve_offline_port(srcid, &src) < 0 ||
+	    resolve_offline_port(dstid, &dst) < 0)
+		return -1;
+
+	if (rf->npairs == rf->maxpairs) {
+		rf->maxpairs = rf->maxpairs ? rf->maxpairs * 2 : 1024;
+		rf->pairs = realloc(rf->pairs,
+				    rf->maxpairs * sizeof(*rf->pairs));
+		if (!rf->pairs)
+			IBEXIT("out of memory for %d port pairs",
+			       rf->maxpairs);
+	}
+
+	rf->pairs[rf->npairs].src = src;
+	rf->pairs[rf->npairs].dlid = dst.port->base_lid;
+	rf->npairs++;
+	return 0;
+}
+
+static void trace_offline(char *srcid, char *dstid)
+{
+	struct route_ep src, dst;
+	enum route_result res;
+	unsigned hops;
+	char *nodename;
+	ibnd_port_t *port;
+
+	if (resolve_offline_port(srcid, &src) < 0 ||
+	    resolve_offline_port(dstid, &dst) < 0)
+		IBEXIT("Failed to get route information");
+
+	port = src.port;
+	nodename = remap_node_name(node_name_map, port->node->guid,
+				   port->node->nodedesc);
+	fprintf(f, "From %s {0x%016" PRIx64 "} portnum %d lid %u-%u \"%s\"\n",
+		node_type_str[port->node->type <= IB_NODE_MAX ?
+			      port->node->type : 0], port->node->guid,
+		port->portnum, port->base_lid,
+		port->base_lid + (1 << port->lmc) - 1, nodename);
+	free(nodename);
+
+	res = route_walk(&route_fabric, &src, dst.port->base_lid, NULL,
+			 1, &hops);
+	if (res != ROUTE_DELIVERED)
+		IBEXIT("route to lid %u ends: %s", dst.port->base_lid,
+		       route_result_str[res]);
+
+	port = dst.port;
+	nodename = remap_node_name(node_name_map, port->node->guid,
+				   port->node->nodedesc);
+	fprintf(f, "To %s {0x%016" PRIx64 "} portnum %d lid %u-%u \"%s\"\n",
+		node_type_str[port->node->type <= IB_NODE_MAX ?
+			      port->node->type : 0], port->node->guid,
+		port->portnum, port->base_lid,
+		port->base_lid + (1 << port->lmc) - 1, nodename);
+	free(nodename);
+}
+
+static void offline_routes(int argc, char **argv)
+{
+	struct route_fabric *rf = &route_fabric;
+	struct fts_table fts = { NULL, 0, 0, 0 };
+	struct route_worker *w;
+	struct timespec start, end;
+	ibnd_fabric_t *fabric;
+	int i, nthreads;
+
+	if (!load_cache_file || !fts_file)
+		IBEXIT("offline routing needs both --load-cache and --fts");
+	if (multicast)
+		IBEXIT("multicast routes can not be traced offline");
+
+	if (!(fabric = ibnd_load_fabric(load_cache_file, 0)))
+		IBEXIT("loading cached fabric failed");
+	if (fts_load(fts_file, &fts) < 0)
+		IBEXIT("loading forwarding tables failed");
+	if (fts.multicast)
+		IBEXIT("%s holds multicast tables", fts_file);
+
+	route_fabric_init(rf, fabric, &fts);
+	fts_free(&fts);
+
+	if (argc >= 2 && !ports_file) {
+		trace_offline(argv[0], argv[1]);
+		goto out;
+	}
+	if (ports_file)
+		read_ports_file(add_offline_pair);
+
+	nthreads = route_threads;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	w = calloc(nthreads, sizeof(*w));
+	if (!w)
+		IBEXIT("out of memory for %d threads", nthreads);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		w[i].rf = rf;
+		w[i].count = calloc(rf->nchan ? rf->nchan : 1,
+				    sizeof(*w[i].count));
+		w[i].deps = calloc(rf->nchan ? rf->nchan : 1, DEP_BYTES);
+		if (!w[i].count || !w[i].deps)
+			IBEXIT("out of memory for %u channels", rf->nchan);
+		if (pthread_create(&w[i].thread, NULL, route_worker_run,
+				   &w[i]))
+			IBEXIT("cannot create route thread");
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(w[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	report_routes(rf, w, nthreads, (end.tv_sec - start.tv_sec) +
+		      (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	for (i = 0; i < nthreads; i++) {
+		free(w[i].count);
+		free(w[i].deps);
+	}
+	free(w);
+out:
+	for (i = 0; i < rf->nsw; i++)
+		free(rf->sw[i].lft);
+	free(rf->sw);
+	free(rf->ep);
+	free(rf->pairs);
+	free(rf->chan_sw);
+	free(rf->peer_sw);
+	free(rf->peer);
+	ibnd_destroy_fabric(fabric);
+}
+
+int main(int argc, char **argv)
+{
 	int mgmt_classes[3] =
 	    { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS, IB_SA_CLASS };
 
@@ -875,6 +1610,14 @@ int main(int argc, char **argv)
 		{"mlid", 'm', 1, "<mlid>", "multicast trace of the mlid"},
 		{"node-name-map", 1, 1, "<file>", "node name map file"},
 		{"ports-file", 2, 1, "<file>", "port pairs file"},
+		{"load-cache", 3, 1, "<file>",
+		 "route offline over an ibnetdiscover cache"},
+		{"fts", 4, 1, "<file>",
+		 "route offline through a dump_fts unicast snapshot"},
+		{"threads", 5, 1, "<n>",
+		 "threads computing offline routes, default one per cpu"},
+		{"top", 6, 1, "<n>",
+		 "offline links and loops reported, 0 for all, default 10"},
 		{}
 	};
 	char usage_args[] = "<src-addr> <dest-addr>";
@@ -886,6 +1629,10 @@ int main(int argc, char **argv)
 
 		" - Multicast examples:",
 		"-m 0xc000 4 16\t# show multicast path of mlid 0xc000 between lids 4 and 16",
+
+		" - Offline examples:",
+		"--load-cache fabric.cache --fts lft.snap\t# route all port pairs",
+		"--load-cache fabric.cache --fts lft.snap 4 16\t# route lid 4 to 16",
 		NULL,
 	};
 
@@ -896,6 +1643,13 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (load_cache_file || fts_file) {
+		node_name_map = open_node_name_map(node_name_map_file);
+		offline_routes(argc, argv);
+		close_node_name_map(node_name_map);
+		exit(0);
+	}
+
 	if (argc < 2 && ports_file == NULL)
 		ibdiag_show_usage();
 
@@ -916,37 +1670,8 @@ int main(int argc, char **argv)
 			IBEXIT("Failed to get route information");
 	} else {
 		/* multiple get_route calls when reading lids/guids from a file */
-		ports_fd = fopen(ports_file, "r");
-		if (!ports_fd)
-			IBEXIT("cannot open ports-file %s", ports_file);
-
-		while (fgets(portsbuf, sizeof(portsbuf), ports_fd) != NULL) {
-			line_count++;
-			p_first = strtok(portsbuf, "\n");
-			if (!p_first)
-				continue;	/* ignore blank lines */
-
-			len = (int) strlen(p_first);
-			for (i = 0; i < len; i++) {
-				if (!isspace(p_first[i]))
-					break;
-			}
-			if (i == len)		/* ignore all spaces */
-				continue;
-			if (p_first[i] == '#')
-				continue;	/* ignore comment lines */
-
-			if (sscanf(portsbuf, "%20s %20s", srcbuf, dstbuf) != 2)
-				IBEXIT("ports-file, %s, at line %i contains bad data",
-					ports_file, line_count);
-			num_port_pairs++;
-			if (get_route(srcbuf, dstbuf) != 0)
-				IBEXIT("Failed to get route information at line %i",
-					line_count);
-		}
-		printf("%i lid/guid pairs processed from %s\n",
-		       num_port_pairs, ports_file);
-        }
+		read_ports_file(get_route);
+	}
 	close_node_name_map(node_name_map);
 
 	mad_rpc_close_port(srcport);
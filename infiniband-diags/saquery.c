@@ -811,6 +811,117 @@ static int get_any_records(struct sa_handle * h,
 	return ret;
 }
 
+/*
+ * Machine readable output: JSON objects, one per line, or a binary stream
+ * of the records as sent by the SA, each preceded by its attribute ID and
+ * size (little endian 16 bit values), after a file header.
+ */
+#define SAQUERY_BIN_MAGIC	"SAQB"
+#define SAQUERY_BIN_VERSION	1
+
+static enum {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_BINARY,
+} output_format;
+
+struct dump_ctx {
+	uint16_t attr_id;
+	void (*dump_func) (void *, struct query_params *);
+	struct query_params *p;
+};
+
+static void print_json_string(const char *name, const char *str, size_t max)
+{
+	size_t i;
+
+	printf(",\"%s\":\"", name);
+	for (i = 0; i < max && str[i]; i++) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20 || c > 0x7e)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void print_json_record(uint16_t attr_id, void *data, unsigned recsz)
+{
+	char gid_str[INET6_ADDRSTRLEN];
+	ib_node_record_t *nr = data;
+	ib_path_rec_t *pr = data;
+	unsigned i;
+
+	printf("{\"attr\":\"0x%04x\"", attr_id);
+	switch (attr_id) {
+	case IB_SA_ATTR_NODERECORD:
+		printf(",\"lid\":%u,\"node_type\":%u,\"num_ports\":%u,"
+		       "\"node_guid\":\"0x%016" PRIx64 "\","
+		       "\"port_guid\":\"0x%016" PRIx64 "\",\"port_num\":%u",
+		       be16toh(nr->lid), nr->node_info.node_type,
+		       nr->node_info.num_ports,
+		       be64toh(nr->node_info.node_guid),
+		       be64toh(nr->node_info.port_guid),
+		       ib_node_info_get_local_port_num(&nr->node_info));
+		print_json_string("node_desc",
+				  (char *)nr->node_desc.description,
+				  sizeof(nr->node_desc.description));
+		break;
+	case IB_SA_ATTR_PATHRECORD:
+		printf(",\"dgid\":\"%s\"", inet_ntop(AF_INET6, pr->dgid.raw,
+						   gid_str, sizeof gid_str));
+		printf(",\"sgid\":\"%s\"", inet_ntop(AF_INET6, pr->sgid.raw,
+						   gid_str, sizeof gid_str));
+		printf(",\"dlid\":%u,\"slid\":%u,\"pkey\":%u,\"sl\":%u,"
+		       "\"mtu\":%u,\"rate\":%u,\"pkt_life\":%u}\n",
+		       be16toh(pr->dlid), be16toh(pr->slid), be16toh(pr->pkey),
+		       ib_path_rec_sl(pr), pr->mtu & 0x3f, pr->rate & 0x3f,
+		       pr->pkt_life & 0x3f);
+		return;
+	default:
+		printf(",\"data\":\"");
+		for (i = 0; i < recsz; i++)
+			printf("%02x", ((uint8_t *)data)[i]);
+		putchar('"');
+		break;
+	}
+	printf("}\n");
+}
+
+static void write_binary_record(uint16_t attr_id, void *data, unsigned recsz)
+{
+	uint16_t hdr[2] = { htole16(attr_id), htole16(recsz) };
+
+	if (fwrite(hdr, sizeof(hdr), 1, stdout) != 1 ||
+	    fwrite(data, recsz, 1, stdout) != 1)
+		IBEXIT("writing records failed: %m");
+}
+
+static void dump_streamed_record(void *data, unsigned recsz, void *context)
+{
+	struct dump_ctx *ctx = context;
+
+	switch (output_format) {
+	case OUTPUT_JSON:
+		print_json_record(ctx->attr_id, data, recsz);
+		break;
+	case OUTPUT_BINARY:
+		write_binary_record(ctx->attr_id, data, recsz);
+		break;
+	default:
+		ctx->dump_func(data, ctx->p);
+		break;
+	}
+}
+
+/*
+ * Records are dumped while the response is being received, so output
+ * starts early and memory use is bounded for tables of any size.
+ */
 static int get_and_dump_any_records(struct sa_handle * h, uint16_t attr_id,
 				    uint32_t attr_mod, __be64 comp_mask,
 				    void *attr,
@@ -819,14 +930,23 @@ static int get_and_dump_any_records(struct sa_handle * h, uint16_t attr_id,
 				    		       struct query_params *),
 				    struct query_params *p)
 {
+	struct dump_ctx ctx = { attr_id, dump_func, p };
 	struct sa_query_result result;
-	int ret = get_any_records(h, attr_id, attr_mod, comp_mask, attr,
-				  attr_size, &result);
-	if (ret)
+	int ret = sa_query_stream(h, IB_MAD_METHOD_GET_TABLE, attr_id,
+				  attr_mod, be64toh(comp_mask), ibd_sakey,
+				  attr, attr_size, dump_streamed_record, &ctx,
+				  &result);
+	if (ret) {
+		fprintf(stderr, "Query SA failed: %s\n", strerror(ret));
 		return ret;
+	}
 
-	dump_results(&result, dump_func, p);
-	sa_free_result_mad(&result);
+	if (result.status != IB_SA_MAD_STATUS_SUCCESS) {
+		sa_report_err(result.status);
+		return EIO;
+	}
+
+	fflush(stdout);
 	return 0;
 }
 
@@ -844,14 +964,8 @@ static int get_and_dump_all_records(struct sa_handle * h, uint16_t attr_id,
 						       struct query_params *p),
 				    struct query_params *p)
 {
-	struct sa_query_result result;
-	int ret = get_all_records(h, attr_id, &result);
-	if (ret)
-		return ret;
-
-	dump_results(&result, dump_func, p);
-	sa_free_result_mad(&result);
-	return ret;
+	return get_and_dump_any_records(h, attr_id, 0, 0, NULL, 0, dump_func,
+					p);
 }
 
 /**
@@ -1695,6 +1809,16 @@ static int process_opt(void *context, int ch)
 	case 22:
 		p->service_id = strtoull(optarg, NULL, 0);
 		break;
+	case 23:
+		if (!strcmp(optarg, "text"))
+			output_format = OUTPUT_TEXT;
+		else if (!strcmp(optarg, "json"))
+			output_format = OUTPUT_JSON;
+		else if (!strcmp(optarg, "binary"))
+			output_format = OUTPUT_BINARY;
+		else
+			IBEXIT("unknown output format %s", optarg);
+		break;
 	default:
 		return -1;
 	}
@@ -1779,6 +1903,8 @@ int main(int argc, char **argv)
 		{"join_state", 'J', 1, NULL, "Join state (MCMemberRecord)"},
 		{"proxy_join", 'X', 1, NULL, "Proxy join (MCMemberRecord)"},
 		{"service_id", 22, 1, NULL, "ServiceID (PathRecord)"},
+		{"format", 23, 1, "<text|json|binary>",
+		 "output format of record queries, default text"},
 		{}
 	};
 
@@ -1812,6 +1938,10 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (output_format != OUTPUT_TEXT &&
+	    (command != SAQUERY_CMD_QUERY || query_type == CLASS_PORT_INFO))
+		IBEXIT("--format applies to record queries only");
+
 	if (!query_type && command == SAQUERY_CMD_QUERY) {
 		if (!argc || !(q = find_query(argv[0])))
 			query_type = IB_SA_ATTR_NODERECORD;
@@ -1865,6 +1995,14 @@ int main(int argc, char **argv)
 
 	node_name_map = open_node_name_map(node_name_map_file);
 
+	if (output_format == OUTPUT_BINARY) {
+		uint32_t version = htole32(SAQUERY_BIN_VERSION);
+
+		if (fwrite(SAQUERY_BIN_MAGIC, 4, 1, stdout) != 1 ||
+		    fwrite(&version, sizeof(version), 1, stdout) != 1)
+			IBEXIT("writing records failed: %m");
+	}
+
 	if (src_lid && *src_lid)
 		params.slid = get_lid(h, src_lid);
 	if (dst_lid && *dst_lid)
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2004-2009 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2011 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+
+#include "mad_internal.h"
+
+#undef DEBUG
+#define DEBUG	if (ibdebug)	IBWARN
+
+/*
+ * Asynchronous MAD RPC engine.
+ *
+ * Up to "window" requests are kept outstanding on the umad port at once;
+ * further submissions are queued in FIFO order and sent as responses
+ * arrive.  Responses are matched to their request by the low 32 bits of
+ * the TID (see mad_trid()).  Retries and timeouts are left to the kernel
+ * MAD layer, which reports an expired request back as a receive carrying
+ * the original TID and an ETIMEDOUT status.  Likewise, RMPP reassembly is
+ * done by the kernel for classes registered with an RMPP version, so a
+ * response may be larger than a single MAD.
+ *
+ * Callbacks only run from mad_async_poll(); requests that fail to send
+ * while the window is filled are parked on the failed list until then.
+ */
+
+#define MAD_ASYNC_DEF_WINDOW	16
+#define MAD_ASYNC_RCV_SIZE	(IB_MAD_SIZE * 4)
+
+struct mad_async_req {
+	struct mad_async_req *next;	/* FIFO queue or hash chain */
+	ib_rpc_t rpc;
+	ib_portid_t dport;
+	mad_async_cb_t cb;
+	void *context;
+	uint32_t trid;
+	int agent;
+	int len;
+	int status;		/* on the failed list */
+	uint8_t umad[];
+};
+
+struct mad_async {
+	const struct ibmad_port *port;
+	unsigned window;
+	unsigned on_wire;
+	unsigned queued;
+	struct mad_async_req *head, *tail;
+	struct mad_async_req *failed, *failed_tail;
+	unsigned num_failed;
+	struct mad_async_req **wire;
+	unsigned wire_mask;
+	uint8_t *rcvbuf;
+	int rcvlen;		/* MAD bytes rcvbuf can hold */
+};
+
+static inline unsigned req_hash(struct mad_async *async, uint32_t trid)
+{
+	return (trid ^ (trid >> 16)) & async->wire_mask;
+}
+
+static void wire_insert(struct mad_async *async, struct mad_async_req *req)
+{
+	unsigned h = req_hash(async, req->trid);
+
+	req->next = async->wire[h];
+	async->wire[h] = req;
+	async->on_wire++;
+}
+
+static struct mad_async_req *wire_remove(struct mad_async *async,
+					 uint32_t trid)
+{
+	struct mad_async_req **pp = &async->wire[req_hash(async, trid)];
+	struct mad_async_req *req;
+
+	for (; (req = *pp); pp = &req->next)
+		if (req->trid == trid) {
+			*pp = req->next;
+			req->next = NULL;
+			async->on_wire--;
+			return req;
+		}
+	return NULL;
+}
+
+static void complete(struct mad_async *async, struct mad_async_req *req,
+		     int status, uint8_t *mad, int len)
+{
+	req->cb(async, &req->rpc, &req->dport, status, mad, len, req->context);
+	free(req);
+}
+
+static int send_req(struct mad_async *async, struct mad_async_req *req)
+{
+	const struct ibmad_port *port = async->port;
+	int retries = mad_get_retries(port);
+
+	if (ibdebug > 1) {
+		IBWARN(">>> sending: len %d pktsz %zu", req->len,
+		       umad_size() + req->len);
+		xdump(stderr, "send buf\n", req->umad, umad_size() + req->len);
+	}
+
+	if (umad_send(port->port_id, req->agent, req->umad, req->len,
+		      mad_get_timeout(port, req->rpc.timeout),
+		      retries > 0 ? retries - 1 : 0) < 0)
+		return -errno;
+
+	wire_insert(async, req);
+	return 0;
+}
+
+/* Move queued requests onto the wire while the window allows */
+static void fill_window(struct mad_async *async)
+{
+	struct mad_async_req *req;
+	int rc;
+
+	while (async->on_wire < async->window && (req = async->head)) {
+		async->head = req->next;
+		if (!async->head)
+			async->tail = NULL;
+		async->queued--;
+		req->next = NULL;
+
+		if ((rc = send_req(async, req)) < 0) {
+			IBWARN("send failed; %s", strerror(-rc));
+			req->status = -rc;
+			if (async->failed_tail)
+				async->failed_tail->next = req;
+			else
+				async->failed = req;
+			async->failed_tail = req;
+			async->num_failed++;
+		}
+	}
+}
+
+/* Report the requests that could not be sent */
+static int complete_failed(struct mad_async *async)
+{
+	struct mad_async_req *req;
+	int n = 0;
+
+	/* the callbacks may submit, and so fail, more requests */
+	while ((req = async->failed)) {
+		async->failed = req->next;
+		if (!async->failed)
+			async->failed_tail = NULL;
+		async->num_failed--;
+		complete(async, req, req->status, NULL, 0);
+		n++;
+	}
+	return n;
+}
+
+struct mad_async *mad_async_create(const struct ibmad_port *port, int window)
+{
+	struct mad_async *async;
+	unsigned size = 1;
+
+	if (!port) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (window <= 0)
+		window = MAD_ASYNC_DEF_WINDOW;
+
+	async = calloc(1, sizeof(*async));
+	if (!async)
+		return NULL;
+
+	while (size < 2 * (unsigned)window)
+		size <<= 1;
+
+	async->port = port;
+	async->window = window;
+	async->wire_mask = size - 1;
+	async->wire = calloc(size, sizeof(*async->wire));
+	async->rcvlen = MAD_ASYNC_RCV_SIZE;
+	async->rcvbuf = malloc(umad_size() + async->rcvlen);
+	if (!async->wire || !async->rcvbuf) {
+		free(async->wire);
+		free(async->rcvbuf);
+		free(async);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return async;
+}
+
+void mad_async_destroy(struct mad_async *async)
+{
+	struct mad_async_req *req;
+	unsigned i;
+
+	if (!async)
+		return;
+
+	while ((req = async->head)) {
+		async->head = req->next;
+		free(req);
+	}
+	while ((req = async->failed)) {
+		async->failed = req->next;
+		free(req);
+	}
+	for (i = 0; i <= async->wire_mask; i++)
+		while ((req = async->wire[i])) {
+			async->wire[i] = req->next;
+			free(req);
+		}
+
+	free(async->wire);
+	free(async->rcvbuf);
+	free(async);
+}
+
+int mad_async_submit(struct mad_async *async, ib_rpc_t *rpc,
+		     ib_portid_t *dport, void *payload, mad_async_cb_t cb,
+		     void *context)
+{
+	struct mad_async_req *req;
+	int agent;
+
+	if (!async || !rpc || !dport || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	agent = async->port->class_agents[rpc->mgtclass & 0xff];
+	if (agent < 0) {
+		IBWARN("class 0x%x is not registered", rpc->mgtclass & 0xff);
+		errno = EINVAL;
+		return -1;
+	}
+
+	req = calloc(1, sizeof(*req) + umad_size() + IB_MAD_SIZE);
+	if (!req) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	req->rpc = *rpc;
+	req->dport = *dport;
+	req->cb = cb;
+	req->context = context;
+	req->agent = agent;
+
+	if ((req->len = mad_build_pkt(req->umad, &req->rpc, &req->dport, NULL,
+				      payload)) < 0) {
+		free(req);
+		errno = EINVAL;
+		return -1;
+	}
+	req->trid = (uint32_t) mad_get_field64(umad_get_mad(req->umad), 0,
+					       IB_MAD_TRID_F);
+
+	if (async->tail)
+		async->tail->next = req;
+	else
+		async->head = req;
+	async->tail = req;
+	async->queued++;
+
+	fill_window(async);
+	return 0;
+}
+
+/* Grow the receive buffer to hold a reassembled RMPP response */
+static int grow_rcvbuf(struct mad_async *async, int length)
+{
+	uint8_t *buf;
+
+	buf = realloc(async->rcvbuf, umad_size() + length);
+	if (!buf)
+		return -ENOMEM;
+	async->rcvbuf = buf;
+	async->rcvlen = length;
+	return 0;
+}
+
+/*
+ * Receive one response and complete its request.  Returns 1 when a
+ * request was completed, 0 when nothing (or an unmatched MAD) arrived
+ * within timeout_ms, or a negative errno.
+ */
+static int recv_one(struct mad_async *async, int timeout_ms)
+{
+	struct mad_async_req *req;
+	int length, rc, status;
+	uint8_t *mad;
+	uint32_t trid;
+
+	for (;;) {
+		length = async->rcvlen;
+		rc = umad_recv(async->port->port_id, async->rcvbuf, &length,
+			       timeout_ms);
+		if (rc >= 0)
+			break;
+		if (rc == -ETIMEDOUT)
+			return 0;
+		if (rc == -ENOSPC && length > async->rcvlen) {
+			if ((rc = grow_rcvbuf(async, length)) < 0)
+				return rc;
+			continue;
+		}
+		IBWARN("recv failed: %s", strerror(-rc));
+		return rc;
+	}
+
+	mad = umad_get_mad(async->rcvbuf);
+	if (ibdebug > 2)
+		umad_addr_dump(umad_get_mad_addr(async->rcvbuf));
+	if (ibdebug > 1)
+		xdump(stderr, "rcv buf\n", mad, IB_MAD_SIZE);
+
+	trid = (uint32_t) mad_get_field64(mad, 0, IB_MAD_TRID_F);
+	req = wire_remove(async, trid);
+	if (!req) {
+		DEBUG("dropping unmatched MAD, trid 0x%x", trid);
+		return 0;
+	}
+
+	status = umad_status(async->rcvbuf);
+	if (status && status != ENOMEM) {
+		DEBUG("request trid 0x%x failed: %s; dport (%s)", trid,
+		      strerror(status), portid2str(&req->dport));
+		complete(async, req, status, NULL, 0);
+		return 1;
+	}
+
+	req->rpc.rstatus = mad_get_field(mad, 0, IB_DRSMP_STATUS_F);
+	if (req->rpc.rstatus == IB_MAD_STS_REDIRECT &&
+	    !mad_redirect_port(&req->dport, mad)) {
+		umad_set_addr(req->umad, req->dport.lid, req->dport.qp,
+			      req->dport.sl, req->dport.qkey);
+		if ((rc = send_req(async, req)) == 0)
+			return 0;
+		complete(async, req, -rc, NULL, 0);
+		return 1;
+	}
+
+	if ((req->rpc.mgtclass & 0xff) == IB_SA_CLASS)
+		req->rpc.recsz = mad_get_field(mad, 0, IB_SA_ATTROFFS_F);
+
+	complete(async, req, 0, mad, length);
+	return 1;
+}
+
+int mad_async_poll(struct mad_async *async, int timeout_ms)
+{
+	int n, rc;
+
+	fill_window(async);
+	n = complete_failed(async);
+	if (!async->on_wire)
+		return n;
+
+	rc = recv_one(async, n ? 0 : timeout_ms);
+	while (rc >= 0) {
+		fill_window(async);
+		n += rc + complete_failed(async);
+		if (!async->on_wire)
+			break;
+		rc = recv_one(async, 0);
+		if (!rc)
+			break;
+	}
+
+	return rc < 0 && !n ? rc : n;
+}
+
+int mad_async_wait(struct mad_async *async)
+{
+	int n = 0, rc;
+
+	while (async->on_wire || async->head || async->failed) {
+		rc = mad_async_poll(async, -1);
+		if (rc < 0)
+			return rc;
+		n += rc;
+	}
+	return n;
+}
+
+int mad_async_pending(const struct mad_async *async)
+{
+	return async->on_wire + async->queued + async->num_failed;
+}
+
+int mad_async_fd(const struct mad_async *async)
+{
+	return umad_get_fd(async->port->port_id);
+}
@@ -36,6 +36,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <endian.h>
 
 #include <infiniband/mad.h>
 
@@ -1186,6 +1187,257 @@ void mad_encode_field(uint8_t * buf, enum MAD_FIELDS field, void *val)
 	_set_array(buf, 0, f, val);
 }
 
+/*
+ * Whole attribute decoders/encoders.
+ *
+ * The generic accessors above walk every field byte by byte.  Every field
+ * of the attributes below sits inside one big endian 32 bit word (or is a
+ * byte aligned 64 bit value or array), so a field is one load, a byte swap
+ * and a shift.  The helpers are always inlined with a constant field, which
+ * lets the compiler fold the ib_mad_f[] entry into immediate offsets;
+ * anything that does not fit the fast cases falls back to the generic
+ * code, so the table stays the only description of the layout.
+ */
+static inline __attribute__((always_inline))
+uint32_t fast_get_field(void *buf, enum MAD_FIELDS field)
+{
+	const ib_field_t *f = ib_mad_f + field;
+	unsigned shift = f->bitoffs & 31;
+	uint8_t *w = (uint8_t *)buf + f->bitoffs / 32 * 4;
+	uint32_t v;
+	uint16_t h;
+
+	if (f->bitlen == 32 && !shift) {
+		memcpy(&v, w, sizeof(v));
+		return be32toh(v);
+	}
+	if (f->bitlen == 16 && !(shift & 15)) {
+		memcpy(&h, w + 2 - shift / 8, sizeof(h));
+		return be16toh(h);
+	}
+	if (f->bitlen == 8 && !(shift & 7))
+		return w[3 - shift / 8];
+	if (f->bitlen < 32 && shift + f->bitlen <= 32) {
+		memcpy(&v, w, sizeof(v));
+		return (be32toh(v) >> shift) & ((1u << f->bitlen) - 1);
+	}
+	return _get_field(buf, 0, f);
+}
+
+static inline __attribute__((always_inline))
+void fast_set_field(void *buf, enum MAD_FIELDS field, uint32_t val)
+{
+	const ib_field_t *f = ib_mad_f + field;
+	unsigned shift = f->bitoffs & 31;
+	uint8_t *w = (uint8_t *)buf + f->bitoffs / 32 * 4;
+	uint32_t v, mask;
+	uint16_t h;
+
+	if (f->bitlen == 32 && !shift) {
+		v = htobe32(val);
+		memcpy(w, &v, sizeof(v));
+		return;
+	}
+	if (f->bitlen == 16 && !(shift & 15)) {
+		h = htobe16(val);
+		memcpy(w + 2 - shift / 8, &h, sizeof(h));
+		return;
+	}
+	if (f->bitlen == 8 && !(shift & 7)) {
+		w[3 - shift / 8] = val;
+		return;
+	}
+	if (f->bitlen < 32 && shift + f->bitlen <= 32) {
+		mask = ((1u << f->bitlen) - 1) << shift;
+		memcpy(&v, w, sizeof(v));
+		v = htobe32((be32toh(v) & ~mask) | ((val << shift) & mask));
+		memcpy(w, &v, sizeof(v));
+		return;
+	}
+	_set_field(buf, 0, f, val);
+}
+
+static inline __attribute__((always_inline))
+uint64_t fast_get_field64(void *buf, enum MAD_FIELDS field)
+{
+	return _get_field64(buf, 0, ib_mad_f + field);
+}
+
+static inline __attribute__((always_inline))
+void fast_set_field64(void *buf, enum MAD_FIELDS field, uint64_t val)
+{
+	_set_field64(buf, 0, ib_mad_f + field, val);
+}
+
+#define MAD_PORTINFO_FIELDS(F32, F64, FARR) \
+	F64(IB_PORT_MKEY_F, mkey) \
+	F64(IB_PORT_GID_PREFIX_F, gid_prefix) \
+	F32(IB_PORT_LID_F, lid) \
+	F32(IB_PORT_SMLID_F, smlid) \
+	F32(IB_PORT_CAPMASK_F, capmask) \
+	F32(IB_PORT_DIAG_F, diag) \
+	F32(IB_PORT_MKEY_LEASE_F, mkey_lease) \
+	F32(IB_PORT_LOCAL_PORT_F, local_port) \
+	F32(IB_PORT_LINK_WIDTH_ENABLED_F, link_width_enabled) \
+	F32(IB_PORT_LINK_WIDTH_SUPPORTED_F, link_width_supported) \
+	F32(IB_PORT_LINK_WIDTH_ACTIVE_F, link_width_active) \
+	F32(IB_PORT_LINK_SPEED_SUPPORTED_F, link_speed_supported) \
+	F32(IB_PORT_STATE_F, state) \
+	F32(IB_PORT_PHYS_STATE_F, phys_state) \
+	F32(IB_PORT_LINK_DOWN_DEF_F, link_down_def) \
+	F32(IB_PORT_MKEY_PROT_BITS_F, mkey_prot_bits) \
+	F32(IB_PORT_LMC_F, lmc) \
+	F32(IB_PORT_LINK_SPEED_ACTIVE_F, link_speed_active) \
+	F32(IB_PORT_LINK_SPEED_ENABLED_F, link_speed_enabled) \
+	F32(IB_PORT_NEIGHBOR_MTU_F, neighbor_mtu) \
+	F32(IB_PORT_SMSL_F, smsl) \
+	F32(IB_PORT_VL_CAP_F, vl_cap) \
+	F32(IB_PORT_INIT_TYPE_F, init_type) \
+	F32(IB_PORT_VL_HIGH_LIMIT_F, vl_high_limit) \
+	F32(IB_PORT_VL_ARBITRATION_HIGH_CAP_F, vl_arbitration_high_cap) \
+	F32(IB_PORT_VL_ARBITRATION_LOW_CAP_F, vl_arbitration_low_cap) \
+	F32(IB_PORT_INIT_TYPE_REPLY_F, init_type_reply) \
+	F32(IB_PORT_MTU_CAP_F, mtu_cap) \
+	F32(IB_PORT_VL_STALL_COUNT_F, vl_stall_count) \
+	F32(IB_PORT_HOQ_LIFE_F, hoq_life) \
+	F32(IB_PORT_OPER_VLS_F, oper_vls) \
+	F32(IB_PORT_PART_EN_INB_F, part_en_inb) \
+	F32(IB_PORT_PART_EN_OUTB_F, part_en_outb) \
+	F32(IB_PORT_FILTER_RAW_INB_F, filter_raw_inb) \
+	F32(IB_PORT_FILTER_RAW_OUTB_F, filter_raw_outb) \
+	F32(IB_PORT_MKEY_VIOL_F, mkey_viol) \
+	F32(IB_PORT_PKEY_VIOL_F, pkey_viol) \
+	F32(IB_PORT_QKEY_VIOL_F, qkey_viol) \
+	F32(IB_PORT_GUID_CAP_F, guid_cap) \
+	F32(IB_PORT_CLIENT_REREG_F, client_rereg) \
+	F32(IB_PORT_MCAST_PKEY_SUPR_ENAB_F, mcast_pkey_supr_enab) \
+	F32(IB_PORT_SUBN_TIMEOUT_F, subn_timeout) \
+	F32(IB_PORT_RESP_TIME_VAL_F, resp_time_val) \
+	F32(IB_PORT_LOCAL_PHYS_ERR_F, local_phys_err) \
+	F32(IB_PORT_OVERRUN_ERR_F, overrun_err) \
+	F32(IB_PORT_MAX_CREDIT_HINT_F, max_credit_hint) \
+	F32(IB_PORT_LINK_ROUND_TRIP_F, link_round_trip) \
+	F32(IB_PORT_CAPMASK2_F, capmask2) \
+	F32(IB_PORT_LINK_SPEED_EXT_ACTIVE_F, link_speed_ext_active) \
+	F32(IB_PORT_LINK_SPEED_EXT_SUPPORTED_F, link_speed_ext_supported) \
+	F32(IB_PORT_LINK_SPEED_EXT_ENABLED_F, link_speed_ext_enabled)
+
+#define MAD_NODEINFO_FIELDS(F32, F64, FARR) \
+	F32(IB_NODE_BASE_VERS_F, base_vers) \
+	F32(IB_NODE_CLASS_VERS_F, class_vers) \
+	F32(IB_NODE_TYPE_F, type) \
+	F32(IB_NODE_NPORTS_F, nports) \
+	F64(IB_NODE_SYSTEM_GUID_F, system_guid) \
+	F64(IB_NODE_GUID_F, guid) \
+	F64(IB_NODE_PORT_GUID_F, port_guid) \
+	F32(IB_NODE_PARTITION_CAP_F, partition_cap) \
+	F32(IB_NODE_DEVID_F, devid) \
+	F32(IB_NODE_REVISION_F, revision) \
+	F32(IB_NODE_LOCAL_PORT_F, local_port) \
+	F32(IB_NODE_VENDORID_F, vendorid)
+
+#define MAD_SWITCHINFO_FIELDS(F32, F64, FARR) \
+	F32(IB_SW_LINEAR_FDB_CAP_F, linear_fdb_cap) \
+	F32(IB_SW_RANDOM_FDB_CAP_F, random_fdb_cap) \
+	F32(IB_SW_MCAST_FDB_CAP_F, mcast_fdb_cap) \
+	F32(IB_SW_LINEAR_FDB_TOP_F, linear_fdb_top) \
+	F32(IB_SW_DEF_PORT_F, def_port) \
+	F32(IB_SW_DEF_MCAST_PRIM_F, def_mcast_prim) \
+	F32(IB_SW_DEF_MCAST_NOT_PRIM_F, def_mcast_not_prim) \
+	F32(IB_SW_LIFE_TIME_F, life_time) \
+	F32(IB_SW_STATE_CHANGE_F, state_change) \
+	F32(IB_SW_OPT_SLTOVL_MAPPING_F, opt_sltovl_mapping) \
+	F32(IB_SW_LIDS_PER_PORT_F, lids_per_port) \
+	F32(IB_SW_PARTITION_ENFORCE_CAP_F, partition_enforce_cap) \
+	F32(IB_SW_PARTITION_ENF_INB_F, partition_enf_inb) \
+	F32(IB_SW_PARTITION_ENF_OUTB_F, partition_enf_outb) \
+	F32(IB_SW_FILTER_RAW_INB_F, filter_raw_inb) \
+	F32(IB_SW_FILTER_RAW_OUTB_F, filter_raw_outb) \
+	F32(IB_SW_ENHANCED_PORT0_F, enhanced_port0) \
+	F32(IB_SW_MCAST_FDB_TOP_F, mcast_fdb_top)
+
+#define MAD_PORTCOUNTERS_FIELDS(F32, F64, FARR) \
+	F32(IB_PC_PORT_SELECT_F, port_select) \
+	F32(IB_PC_COUNTER_SELECT_F, counter_select) \
+	F32(IB_PC_ERR_SYM_F, err_sym) \
+	F32(IB_PC_LINK_RECOVERS_F, link_recovers) \
+	F32(IB_PC_LINK_DOWNED_F, link_downed) \
+	F32(IB_PC_ERR_RCV_F, err_rcv) \
+	F32(IB_PC_ERR_PHYSRCV_F, err_physrcv) \
+	F32(IB_PC_ERR_SWITCH_REL_F, err_switch_rel) \
+	F32(IB_PC_XMT_DISCARDS_F, xmt_discards) \
+	F32(IB_PC_ERR_XMTCONSTR_F, err_xmtconstr) \
+	F32(IB_PC_ERR_RCVCONSTR_F, err_rcvconstr) \
+	F32(IB_PC_COUNTER_SELECT2_F, counter_select2) \
+	F32(IB_PC_ERR_LOCALINTEG_F, err_localinteg) \
+	F32(IB_PC_ERR_EXCESS_OVR_F, err_excess_ovr) \
+	F32(IB_PC_VL15_DROPPED_F, vl15_dropped) \
+	F32(IB_PC_XMT_BYTES_F, xmt_bytes) \
+	F32(IB_PC_RCV_BYTES_F, rcv_bytes) \
+	F32(IB_PC_XMT_PKTS_F, xmt_pkts) \
+	F32(IB_PC_RCV_PKTS_F, rcv_pkts) \
+	F32(IB_PC_XMT_WAIT_F, xmt_wait)
+
+#define MAD_PORTCOUNTERS_EXT_FIELDS(F32, F64, FARR) \
+	F32(IB_PC_EXT_PORT_SELECT_F, port_select) \
+	F32(IB_PC_EXT_COUNTER_SELECT_F, counter_select) \
+	F64(IB_PC_EXT_XMT_BYTES_F, xmt_bytes) \
+	F64(IB_PC_EXT_RCV_BYTES_F, rcv_bytes) \
+	F64(IB_PC_EXT_XMT_PKTS_F, xmt_pkts) \
+	F64(IB_PC_EXT_RCV_PKTS_F, rcv_pkts) \
+	F64(IB_PC_EXT_XMT_UPKTS_F, xmt_upkts) \
+	F64(IB_PC_EXT_RCV_UPKTS_F, rcv_upkts) \
+	F64(IB_PC_EXT_XMT_MPKTS_F, xmt_mpkts) \
+	F64(IB_PC_EXT_RCV_MPKTS_F, rcv_mpkts) \
+	F32(IB_PC_EXT_COUNTER_SELECT2_F, counter_select2) \
+	F64(IB_PC_EXT_ERR_SYM_F, err_sym) \
+	F64(IB_PC_EXT_LINK_RECOVERS_F, link_recovers) \
+	F64(IB_PC_EXT_LINK_DOWNED_F, link_downed) \
+	F64(IB_PC_EXT_ERR_RCV_F, err_rcv) \
+	F64(IB_PC_EXT_ERR_PHYSRCV_F, err_physrcv) \
+	F64(IB_PC_EXT_ERR_SWITCH_REL_F, err_switch_rel) \
+	F64(IB_PC_EXT_XMT_DISCARDS_F, xmt_discards) \
+	F64(IB_PC_EXT_ERR_XMTCONSTR_F, err_xmtconstr) \
+	F64(IB_PC_EXT_ERR_RCVCONSTR_F, err_rcvconstr) \
+	F64(IB_PC_EXT_ERR_LOCALINTEG_F, err_localinteg) \
+	F64(IB_PC_EXT_ERR_EXCESS_OVR_F, err_excess_ovr) \
+	F64(IB_PC_EXT_VL15_DROPPED_F, vl15_dropped) \
+	F64(IB_PC_EXT_XMT_WAIT_F, xmt_wait) \
+	F64(IB_PC_EXT_QP1_DROP_F, qp1_drop)
+
+#define MAD_PATHRECORD_FIELDS(F32, F64, FARR) \
+	FARR(IB_SA_PR_DGID_F, dgid) \
+	FARR(IB_SA_PR_SGID_F, sgid) \
+	F32(IB_SA_PR_DLID_F, dlid) \
+	F32(IB_SA_PR_SLID_F, slid) \
+	F32(IB_SA_PR_NPATH_F, npath) \
+	F32(IB_SA_PR_SL_F, sl)
+
+#define DECODE32(field, member) dst->member = fast_get_field(buf, field);
+#define DECODE64(field, member) dst->member = fast_get_field64(buf, field);
+#define DECODEARR(field, member) _get_array(buf, 0, ib_mad_f + field, dst->member);
+#define ENCODE32(field, member) fast_set_field(buf, field, src->member);
+#define ENCODE64(field, member) fast_set_field64(buf, field, src->member);
+#define ENCODEARR(field, member) \
+	_set_array(buf, 0, ib_mad_f + field, (void *)src->member);
+
+#define MAD_ATTR_CODEC(name, NAME) \
+void mad_decode_##name(void *buf, struct mad_##name *dst) \
+{ \
+	MAD_##NAME##_FIELDS(DECODE32, DECODE64, DECODEARR) \
+} \
+void mad_encode_##name(void *buf, const struct mad_##name *src) \
+{ \
+	MAD_##NAME##_FIELDS(ENCODE32, ENCODE64, ENCODEARR) \
+}
+
+MAD_ATTR_CODEC(portinfo, PORTINFO)
+MAD_ATTR_CODEC(nodeinfo, NODEINFO)
+MAD_ATTR_CODEC(switchinfo, SWITCHINFO)
+MAD_ATTR_CODEC(portcounters, PORTCOUNTERS)
+MAD_ATTR_CODEC(portcounters_ext, PORTCOUNTERS_EXT)
+MAD_ATTR_CODEC(pathrecord, PATHRECORD)
+
 /************************/
 
 static char *_mad_dump_val(const ib_field_t * f, char *buf, int bufsz,
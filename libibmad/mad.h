@@ -1456,6 +1456,176 @@ char *mad_dump_field(enum MAD_FIELDS field, char *buf, int bufsz, void *val);
 char *mad_dump_val(enum MAD_FIELDS field, char *buf, int bufsz, void *val);
 const char *mad_field_name(enum MAD_FIELDS field);
 
+/*
+ * Whole attribute decoders and encoders.  Each member holds the MAD_FIELDS
+ * entry it is named after (IB_PORT_LID_F is lid), exactly as
+ * mad_decode_field()/mad_encode_field() would on the attribute data, but
+ * all fields are converted in one pass with direct word accesses.
+ */
+struct mad_portinfo {
+	uint64_t mkey;			/* IB_PORT_MKEY_F */
+	uint64_t gid_prefix;		/* IB_PORT_GID_PREFIX_F */
+	uint32_t lid;
+	uint32_t smlid;
+	uint32_t capmask;
+	uint32_t diag;
+	uint32_t mkey_lease;
+	uint32_t local_port;
+	uint32_t link_width_enabled;
+	uint32_t link_width_supported;
+	uint32_t link_width_active;
+	uint32_t link_speed_supported;
+	uint32_t state;
+	uint32_t phys_state;
+	uint32_t link_down_def;
+	uint32_t mkey_prot_bits;
+	uint32_t lmc;
+	uint32_t link_speed_active;
+	uint32_t link_speed_enabled;
+	uint32_t neighbor_mtu;
+	uint32_t smsl;
+	uint32_t vl_cap;
+	uint32_t init_type;
+	uint32_t vl_high_limit;
+	uint32_t vl_arbitration_high_cap;
+	uint32_t vl_arbitration_low_cap;
+	uint32_t init_type_reply;
+	uint32_t mtu_cap;
+	uint32_t vl_stall_count;
+	uint32_t hoq_life;
+	uint32_t oper_vls;
+	uint32_t part_en_inb;
+	uint32_t part_en_outb;
+	uint32_t filter_raw_inb;
+	uint32_t filter_raw_outb;
+	uint32_t mkey_viol;
+	uint32_t pkey_viol;
+	uint32_t qkey_viol;
+	uint32_t guid_cap;
+	uint32_t client_rereg;
+	uint32_t mcast_pkey_supr_enab;
+	uint32_t subn_timeout;
+	uint32_t resp_time_val;
+	uint32_t local_phys_err;
+	uint32_t overrun_err;
+	uint32_t max_credit_hint;
+	uint32_t link_round_trip;
+	uint32_t capmask2;		/* IB_PORT_CAPMASK2_F */
+	uint32_t link_speed_ext_active;
+	uint32_t link_speed_ext_supported;
+	uint32_t link_speed_ext_enabled;
+};
+
+struct mad_nodeinfo {
+	uint32_t base_vers;		/* IB_NODE_BASE_VERS_F */
+	uint32_t class_vers;
+	uint32_t type;
+	uint32_t nports;
+	uint64_t system_guid;
+	uint64_t guid;
+	uint64_t port_guid;
+	uint32_t partition_cap;
+	uint32_t devid;
+	uint32_t revision;
+	uint32_t local_port;
+	uint32_t vendorid;
+};
+
+struct mad_switchinfo {
+	uint32_t linear_fdb_cap;	/* IB_SW_LINEAR_FDB_CAP_F */
+	uint32_t random_fdb_cap;
+	uint32_t mcast_fdb_cap;
+	uint32_t linear_fdb_top;
+	uint32_t def_port;
+	uint32_t def_mcast_prim;
+	uint32_t def_mcast_not_prim;
+	uint32_t life_time;
+	uint32_t state_change;
+	uint32_t opt_sltovl_mapping;
+	uint32_t lids_per_port;
+	uint32_t partition_enforce_cap;
+	uint32_t partition_enf_inb;
+	uint32_t partition_enf_outb;
+	uint32_t filter_raw_inb;
+	uint32_t filter_raw_outb;
+	uint32_t enhanced_port0;
+	uint32_t mcast_fdb_top;
+};
+
+struct mad_portcounters {
+	uint32_t port_select;		/* IB_PC_PORT_SELECT_F */
+	uint32_t counter_select;
+	uint32_t err_sym;
+	uint32_t link_recovers;
+	uint32_t link_downed;
+	uint32_t err_rcv;
+	uint32_t err_physrcv;
+	uint32_t err_switch_rel;
+	uint32_t xmt_discards;
+	uint32_t err_xmtconstr;
+	uint32_t err_rcvconstr;
+	uint32_t counter_select2;
+	uint32_t err_localinteg;
+	uint32_t err_excess_ovr;
+	uint32_t vl15_dropped;
+	uint32_t xmt_bytes;
+	uint32_t rcv_bytes;
+	uint32_t xmt_pkts;
+	uint32_t rcv_pkts;
+	uint32_t xmt_wait;
+};
+
+struct mad_portcounters_ext {
+	uint32_t port_select;		/* IB_PC_EXT_PORT_SELECT_F */
+	uint32_t counter_select;
+	uint64_t xmt_bytes;
+	uint64_t rcv_bytes;
+	uint64_t xmt_pkts;
+	uint64_t rcv_pkts;
+	uint64_t xmt_upkts;
+	uint64_t rcv_upkts;
+	uint64_t xmt_mpkts;
+	uint64_t rcv_mpkts;
+	uint32_t counter_select2;	/* IB_PC_EXT_COUNTER_SELECT2_F */
+	uint64_t err_sym;
+	uint64_t link_recovers;
+	uint64_t link_downed;
+	uint64_t err_rcv;
+	uint64_t err_physrcv;
+	uint64_t err_switch_rel;
+	uint64_t xmt_discards;
+	uint64_t err_xmtconstr;
+	uint64_t err_rcvconstr;
+	uint64_t err_localinteg;
+	uint64_t err_excess_ovr;
+	uint64_t vl15_dropped;
+	uint64_t xmt_wait;
+	uint64_t qp1_drop;
+};
+
+struct mad_pathrecord {
+	uint8_t dgid[16];		/* IB_SA_PR_DGID_F */
+	uint8_t sgid[16];
+	uint32_t dlid;
+	uint32_t slid;
+	uint32_t npath;
+	uint32_t sl;
+};
+
+void mad_decode_portinfo(void *buf, struct mad_portinfo *pi);
+void mad_encode_portinfo(void *buf, const struct mad_portinfo *pi);
+void mad_decode_nodeinfo(void *buf, struct mad_nodeinfo *ni);
+void mad_encode_nodeinfo(void *buf, const struct mad_nodeinfo *ni);
+void mad_decode_switchinfo(void *buf, struct mad_switchinfo *si);
+void mad_encode_switchinfo(void *buf, const struct mad_switchinfo *si);
+void mad_decode_portcounters(void *buf, struct mad_portcounters *pc);
+void mad_encode_portcounters(void *buf, const struct mad_portcounters *pc);
+void mad_decode_portcounters_ext(void *buf, struct mad_portcounters_ext *pc);
+void mad_encode_portcounters_ext(void *buf,
+				 const struct mad_portcounters_ext *pc);
+void mad_decode_pathrecord(void *buf, struct mad_pathrecord *pr);
+void mad_encode_pathrecord(void *buf, const struct mad_pathrecord *pr);
+
 /* mad.c */
 void *mad_encode(void *buf, ib_rpc_t *rpc, ib_dr_path_t *drpath, void *data);
 uint64_t mad_trid(void);
@@ -1488,6 +1658,39 @@ int mad_rpc_class_agent(struct ibmad_port *srcport, int cls);
 int mad_get_timeout(const struct ibmad_port *srcport, int override_ms);
 int mad_get_retries(const struct ibmad_port *srcport);
 
+/* async.c */
+struct mad_async;
+
+/*
+ * Completion callback for mad_async_submit().  status is 0 when a response
+ * was received; rpc->rstatus then holds the MAD status and mad/len the
+ * whole response MAD (or reassembled RMPP payload).  Otherwise status is
+ * an errno (e.g. ETIMEDOUT) and mad is NULL.  rpc and dport point to the
+ * engine's copies and are only valid during the callback; dport reflects
+ * any redirection.  The callback may submit new requests.  Callbacks are
+ * only called from mad_async_poll() and mad_async_wait(), also for requests
+ * that failed to be sent.
+ */
+typedef void (*mad_async_cb_t)(struct mad_async *async, ib_rpc_t *rpc,
+			       ib_portid_t *dport, int status, uint8_t *mad,
+			       int len, void *context);
+
+/*
+ * Keeps up to window requests outstanding on srcport.  Synchronous
+ * mad_rpc() calls must not be issued on the same port while asynchronous
+ * requests are pending, as they would consume each other's responses.
+ */
+struct mad_async *mad_async_create(const struct ibmad_port *srcport,
+				   int window);
+void mad_async_destroy(struct mad_async *async);
+int mad_async_submit(struct mad_async *async, ib_rpc_t *rpc,
+		     ib_portid_t *dport, void *payload, mad_async_cb_t cb,
+		     void *context);
+int mad_async_poll(struct mad_async *async, int timeout_ms);
+int mad_async_wait(struct mad_async *async);
+int mad_async_pending(const struct mad_async *async);
+int mad_async_fd(const struct mad_async *async);
+
 /* register.c */
 int mad_register_port_client(int port_id, int mgmt, uint8_t rmpp_version);
 int mad_register_client(int mgmt, uint8_t rmpp_version)
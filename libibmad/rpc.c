@@ -188,7 +188,7 @@ _do_madrpc(int port_id, void *sndbuf, void *rcvbuf, int agentid, int len,
 	return -1;
 }
 
-static int redirect_port(ib_portid_t * port, uint8_t * mad)
+int mad_redirect_port(ib_portid_t * port, uint8_t * mad)
 {
 	port->lid = mad_get_field(mad, 64, IB_CPI_REDIRECT_LID_F);
 	if (!port->lid) {
@@ -246,7 +246,7 @@ void *mad_rpc(const struct ibmad_port *port, ib_rpc_t * rpc,
 		if (status == IB_MAD_STS_REDIRECT) {
 			/* update dport for next request and retry */
 			/* bail if redirection fails */
-			if (redirect_port(dport, mad))
+			if (mad_redirect_port(dport, mad))
 				break;
 		} else
 			break;
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Check the whole attribute decoders/encoders of libibmad against
+ * mad_decode_field()/mad_encode_field() on random data, then time both.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <infiniband/mad.h>
+
+#define NUM_BUFS	64
+
+struct attr_field {
+	enum MAD_FIELDS field;
+	size_t offs;
+	size_t size;
+};
+
+#define FIELD(type, field, member) \
+	{ field, offsetof(struct type, member), \
+	  sizeof(((struct type *)0)->member) }
+
+static const struct attr_field portinfo_fields[] = {
+	FIELD(mad_portinfo, IB_PORT_MKEY_F, mkey),
+	FIELD(mad_portinfo, IB_PORT_GID_PREFIX_F, gid_prefix),
+	FIELD(mad_portinfo, IB_PORT_LID_F, lid),
+	FIELD(mad_portinfo, IB_PORT_SMLID_F, smlid),
+	FIELD(mad_portinfo, IB_PORT_CAPMASK_F, capmask),
+	FIELD(mad_portinfo, IB_PORT_DIAG_F, diag),
+	FIELD(mad_portinfo, IB_PORT_MKEY_LEASE_F, mkey_lease),
+	FIELD(mad_portinfo, IB_PORT_LOCAL_PORT_F, local_port),
+	FIELD(mad_portinfo, IB_PORT_LINK_WIDTH_ENABLED_F, link_width_enabled),
+	FIELD(mad_portinfo, IB_PORT_LINK_WIDTH_SUPPORTED_F,
+	      link_width_supported),
+	FIELD(mad_portinfo, IB_PORT_LINK_WIDTH_ACTIVE_F, link_width_active),
+	FIELD(mad_portinfo, IB_PORT_LINK_SPEED_SUPPORTED_F,
+	      link_speed_supported),
+	FIELD(mad_portinfo, IB_PORT_STATE_F, state),
+	FIELD(mad_portinfo, IB_PORT_PHYS_STATE_F, phys_state),
+	FIELD(mad_portinfo, IB_PORT_LINK_DOWN_DEF_F, link_down_def),
+	FIELD(mad_portinfo, IB_PORT_MKEY_PROT_BITS_F, mkey_prot_bits),
+	FIELD(mad_portinfo, IB_PORT_LMC_F, lmc),
+	FIELD(mad_portinfo, IB_PORT_LINK_SPEED_ACTIVE_F, link_speed_active),
+	FIELD(mad_portinfo, IB_PORT_LINK_SPEED_ENABLED_F, link_speed_enabled),
+	FIELD(mad_portinfo, IB_PORT_NEIGHBOR_MTU_F, neighbor_mtu),
+	FIELD(mad_portinfo, IB_PORT_SMSL_F, smsl),
+	FIELD(mad_portinfo, IB_PORT_VL_CAP_F, vl_cap),
+	FIELD(mad_portinfo, IB_PORT_INIT_TYPE_F, init_type),
+	FIELD(mad_portinfo, IB_PORT_VL_HIGH_LIMIT_F, vl_high_limit),
+	FIELD(mad_portinfo, IB_PORT_VL_ARBITRATION_HIGH_CAP_F,
+	      vl_arbitration_high_cap),
+	FIELD(mad_portinfo, IB_PORT_VL_ARBITRATION_LOW_CAP_F,
+	      vl_arbitration_low_cap),
+	FIELD(mad_portinfo, IB_PORT_INIT_TYPE_REPLY_F, init_type_reply),
+	FIELD(mad_portinfo, IB_PORT_MTU_CAP_F, mtu_cap),
+	FIELD(mad_portinfo, IB_PORT_VL_STALL_COUNT_F, vl_stall_count),
+	FIELD(mad_portinfo, IB_PORT_HOQ_LIFE_F, hoq_life),
+	FIELD(mad_portinfo, IB_PORT_OPER_VLS_F, oper_vls),
+	FIELD(mad_portinfo, IB_PORT_PART_EN_INB_F, part_en_inb),
+	FIELD(mad_portinfo, IB_PORT_PART_EN_OUTB_F, part_en_outb),
+	FIELD(mad_portinfo, IB_PORT_FILTER_RAW_INB_F, filter_raw_inb),
+	FIELD(mad_portinfo, IB_PORT_FILTER_RAW_OUTB_F, filter_raw_outb),
+	FIELD(mad_portinfo, IB_PORT_MKEY_VIOL_F, mkey_viol),
+	FIELD(mad_portinfo, IB_PORT_PKEY_VIOL_F, pkey_viol),
+	FIELD(mad_portinfo, IB_PORT_QKEY_VIOL_F, qkey_viol),
+	FIELD(mad_portinfo, IB_PORT_GUID_CAP_F, guid_cap),
+	FIELD(mad_portinfo, IB_PORT_CLIENT_REREG_F, client_rereg),
+	FIELD(mad_portinfo, IB_PORT_MCAST_PKEY_SUPR_ENAB_F,
+	      mcast_pkey_supr_enab),
+	FIELD(mad_portinfo, IB_PORT_SUBN_TIMEOUT_F, subn_timeout),
+	FIELD(mad_portinfo, IB_PORT_RESP_TIME_VAL_F, resp_time_val),
+	FIELD(mad_portinfo, IB_PORT_LOCAL_PHYS_ERR_F, local_phys_err),
+	FIELD(mad_portinfo, IB_PORT_OVERRUN_ERR_F, overrun_err),
+	FIELD(mad_portinfo, IB_PORT_MAX_CREDIT_HINT_F, max_credit_hint),
+	FIELD(mad_portinfo, IB_PORT_LINK_ROUND_TRIP_F, link_round_trip),
+	FIELD(mad_portinfo, IB_PORT_CAPMASK2_F, capmask2),
+	FIELD(mad_portinfo, IB_PORT_LINK_SPEED_EXT_ACTIVE_F,
+	      link_speed_ext_active),
+	FIELD(mad_portinfo, IB_PORT_LINK_SPEED_EXT_SUPPORTED_F,
+	      link_speed_ext_supported),
+	FIELD(mad_portinfo, IB_PORT_LINK_SPEED_EXT_ENABLED_F,
+	      link_speed_ext_enabled),
+};
+
+static const struct attr_field nodeinfo_fields[] = {
+	FIELD(mad_nodeinfo, IB_NODE_BASE_VERS_F, base_vers),
+	FIELD(mad_nodeinfo, IB_NODE_CLASS_VERS_F, class_vers),
+	FIELD(mad_nodeinfo, IB_NODE_TYPE_F, type),
+	FIELD(mad_nodeinfo, IB_NODE_NPORTS_F, nports),
+	FIELD(mad_nodeinfo, IB_NODE_SYSTEM_GUID_F, system_guid),
+	FIELD(mad_nodeinfo, IB_NODE_GUID_F, guid),
+	FIELD(mad_nodeinfo, IB_NODE_PORT_GUID_F, port_guid),
+	FIELD(mad_nodeinfo, IB_NODE_PARTITION_CAP_F, partition_cap),
+	FIELD(mad_nodeinfo, IB_NODE_DEVID_F, devid),
+	FIELD(mad_nodeinfo, IB_NODE_REVISION_F, revision),
+	FIELD(mad_nodeinfo, IB_NODE_LOCAL_PORT_F, local_port),
+	FIELD(mad_nodeinfo, IB_NODE_VENDORID_F, vendorid),
+};
+
+static const struct attr_field switchinfo_fields[] = {
+	FIELD(mad_switchinfo, IB_SW_LINEAR_FDB_CAP_F, linear_fdb_cap),
+	FIELD(mad_switchinfo, IB_SW_RANDOM_FDB_CAP_F, random_fdb_cap),
+	FIELD(mad_switchinfo, IB_SW_MCAST_FDB_CAP_F, mcast_fdb_cap),
+	FIELD(mad_switchinfo, IB_SW_LINEAR_FDB_TOP_F, linear_fdb_top),
+	FIELD(mad_switchinfo, IB_SW_DEF_PORT_F, def_port),
+	FIELD(mad_switchinfo, IB_SW_DEF_MCAST_PRIM_F, def_mcast_prim),
+	FIELD(mad_switchinfo, IB_SW_DEF_MCAST_NOT_PRIM_F, def_mcast_not_prim),
+	FIELD(mad_switchinfo, IB_SW_LIFE_TIME_F, life_time),
+	FIELD(mad_switchinfo, IB_SW_STATE_CHANGE_F, state_change),
+	FIELD(mad_switchinfo, IB_SW_OPT_SLTOVL_MAPPING_F, opt_sltovl_mapping),
+	FIELD(mad_switchinfo, IB_SW_LIDS_PER_PORT_F, lids_per_port),
+	FIELD(mad_switchinfo, IB_SW_PARTITION_ENFORCE_CAP_F,
+	      partition_enforce_cap),
+	FIELD(mad_switchinfo, IB_SW_PARTITION_ENF_INB_F, partition_enf_inb),
+	FIELD(mad_switchinfo, IB_SW_PARTITION_ENF_OUTB_F, partition_enf_outb),
+	FIELD(mad_switchinfo, IB_SW_FILTER_RAW_INB_F, filter_raw_inb),
+	FIELD(mad_switchinfo, IB_SW_FILTER_RAW_OUTB_F, filter_raw_outb),
+	FIELD(mad_switchinfo, IB_SW_ENHANCED_PORT0_F, enhanced_port0),
+	FIELD(mad_switchinfo, IB_SW_MCAST_FDB_TOP_F, mcast_fdb_top),
+};
+
+static const struct attr_field portcounters_fields[] = {
+	FIELD(mad_portcounters, IB_PC_PORT_SELECT_F, port_select),
+	FIELD(mad_portcounters, IB_PC_COUNTER_SELECT_F, counter_select),
+	FIELD(mad_portcounters, IB_PC_ERR_SYM_F, err_sym),
+	FIELD(mad_portcounters, IB_PC_LINK_RECOVERS_F, link_recovers),
+	FIELD(mad_portcounters, IB_PC_LINK_DOWNED_F, link_downed),
+	FIELD(mad_portcounters, IB_PC_ERR_RCV_F, err_rcv),
+	FIELD(mad_portcounters, IB_PC_ERR_PHYSRCV_F, err_physrcv),
+	FIELD(mad_portcounters, IB_PC_ERR_SWITCH_REL_F, err_switch_rel),
+	FIELD(mad_portcounters, IB_PC_XMT_DISCARDS_F, xmt_discards),
+	FIELD(mad_portcounters, IB_PC_ERR_XMTCONSTR_F, err_xmtconstr),
+	FIELD(mad_portcounters, IB_PC_ERR_RCVCONSTR_F, err_rcvconstr),
+	FIELD(mad_portcounters, IB_PC_COUNTER_SELECT2_F, counter_select2),
+	FIELD(mad_portcounters, IB_PC_ERR_LOCALINTEG_F, err_localinteg),
+	FIELD(mad_portcounters, IB_PC_ERR_EXCESS_OVR_F, err_excess_ovr),
+	FIELD(mad_portcounters, IB_PC_VL15_DROPPED_F, vl15_dropped),
+	FIELD(mad_portcounters, IB_PC_XMT_BYTES_F, xmt_bytes),
+	FIELD(mad_portcounters, IB_PC_RCV_BYTES_F, rcv_bytes),
+	FIELD(mad_portcounters, IB_PC_XMT_PKTS_F, xmt_pkts),
+	FIELD(mad_portcounters, IB_PC_RCV_PKTS_F, rcv_pkts),
+	FIELD(mad_portcounters, IB_PC_XMT_WAIT_F, xmt_wait),
+};
+
+static const struct attr_field portcounters_ext_fields[] = {
+	FIELD(mad_portcounters_ext, IB_PC_EXT_PORT_SELECT_F, port_select),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_COUNTER_SELECT_F,
+	      counter_select),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_XMT_BYTES_F, xmt_bytes),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_RCV_BYTES_F, rcv_bytes),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_XMT_PKTS_F, xmt_pkts),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_RCV_PKTS_F, rcv_pkts),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_XMT_UPKTS_F, xmt_upkts),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_RCV_UPKTS_F, rcv_upkts),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_XMT_MPKTS_F, xmt_mpkts),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_RCV_MPKTS_F, rcv_mpkts),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_COUNTER_SELECT2_F,
+	      counter_select2),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_SYM_F, err_sym),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_LINK_RECOVERS_F, link_recovers),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_LINK_DOWNED_F, link_downed),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_RCV_F, err_rcv),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_PHYSRCV_F, err_physrcv),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_SWITCH_REL_F,
+	      err_switch_rel),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_XMT_DISCARDS_F, xmt_discards),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_XMTCONSTR_F, err_xmtconstr),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_RCVCONSTR_F, err_rcvconstr),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_LOCALINTEG_F,
+	      err_localinteg),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_ERR_EXCESS_OVR_F,
+	      err_excess_ovr),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_VL15_DROPPED_F, vl15_dropped),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_XMT_WAIT_F, xmt_wait),
+	FIELD(mad_portcounters_ext, IB_PC_EXT_QP1_DROP_F, qp1_drop),
+};
+
+static const struct attr_field pathrecord_fields[] = {
+	FIELD(mad_pathrecord, IB_SA_PR_DGID_F, dgid),
+	FIELD(mad_pathrecord, IB_SA_PR_SGID_F, sgid),
+	FIELD(mad_pathrecord, IB_SA_PR_DLID_F, dlid),
+	FIELD(mad_pathrecord, IB_SA_PR_SLID_F, slid),
+	FIELD(mad_pathrecord, IB_SA_PR_NPATH_F, npath),
+	FIELD(mad_pathrecord, IB_SA_PR_SL_F, sl),
+};
+
+#define ATTR(name) \
+	{ #name, name##_fields, \
+	  sizeof(name##_fields) / sizeof(name##_fields[0]), \
+	  sizeof(struct mad_##name), \
+	  (void (*)(void *, void *))mad_decode_##name, \
+	  (void (*)(void *, const void *))mad_encode_##name }
+
+static const struct attr {
+	const char *name;
+	const struct attr_field *fields;
+	unsigned num_fields;
+	size_t size;
+	void (*decode)(void *buf, void *dst);
+	void (*encode)(void *buf, const void *src);
+} attrs[] = {
+	ATTR(portinfo),
+	ATTR(nodeinfo),
+	ATTR(switchinfo),
+	ATTR(portcounters),
+	ATTR(portcounters_ext),
+	ATTR(pathrecord),
+};
+
+static const char *argv0 = "benchfields";
+
+static uint8_t bufs[NUM_BUFS][IB_SMP_DATA_SIZE * 4];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t rnd(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void fill(uint32_t *state, void *p, size_t len)
+{
+	uint8_t *b = p;
+
+	while (len--)
+		*b++ = rnd(state);
+}
+
+static void generic_decode(const struct attr *a, void *buf, uint8_t *dst)
+{
+	unsigned i;
+
+	for (i = 0; i < a->num_fields; i++)
+		mad_decode_field(buf, a->fields[i].field,
+				 dst + a->fields[i].offs);
+}
+
+static void generic_encode(const struct attr *a, void *buf,
+			   const uint8_t *src)
+{
+	unsigned i;
+
+	for (i = 0; i < a->num_fields; i++)
+		mad_encode_field(buf, a->fields[i].field,
+				 (void *)(src + a->fields[i].offs));
+}
+
+/* Returns the number of mismatches over rounds random attributes */
+static unsigned long check(const struct attr *a, unsigned long rounds,
+			   uint32_t *state)
+{
+	uint8_t fast[512], generic[512], val[512];
+	uint8_t fast_buf[sizeof(bufs[0])], generic_buf[sizeof(bufs[0])];
+	unsigned long n, errs = 0;
+	unsigned i;
+
+	for (n = 0; n < rounds; n++) {
+		fill(state, generic_buf, sizeof(generic_buf));
+		fill(state, fast, a->size);
+		memcpy(generic, fast, a->size);
+
+		a->decode(generic_buf, fast);
+		generic_decode(a, generic_buf, generic);
+		for (i = 0; i < a->num_fields; i++) {
+			const struct attr_field *f = &a->fields[i];
+
+			if (!memcmp(fast + f->offs, generic + f->offs, f->size))
+				continue;
+			if (errs++ < 10)
+				fprintf(stderr, "%s: %s decodes differently\n",
+					a->name, mad_field_name(f->field));
+		}
+
+		/* out of range values must be truncated the same way too */
+		fill(state, val, a->size);
+		memcpy(fast_buf, generic_buf, sizeof(fast_buf));
+		a->encode(fast_buf, val);
+		generic_encode(a, generic_buf, val);
+		if (memcmp(fast_buf, generic_buf, sizeof(fast_buf)) &&
+		    errs++ < 10)
+			fprintf(stderr, "%s: encodes differently\n", a->name);
+	}
+
+	return errs;
+}
+
+static void bench(const struct attr *a, unsigned long iters)
+{
+	uint8_t val[512];
+	unsigned long n;
+	double generic, fast;
+
+	memset(val, 0, sizeof(val));
+
+	generic = now();
+	for (n = 0; n < iters; n++)
+		generic_decode(a, bufs[n % NUM_BUFS], val);
+	generic = (now() - generic) * 1e9 / iters;
+	fast = now();
+	for (n = 0; n < iters; n++)
+		a->decode(bufs[n % NUM_BUFS], val);
+	fast = (now() - fast) * 1e9 / iters;
+	printf("%-18s %2u fields  decode %8.1f -> %6.1f ns",
+	       a->name, a->num_fields, generic, fast);
+
+	generic = now();
+	for (n = 0; n < iters; n++)
+		generic_encode(a, bufs[n % NUM_BUFS], val);
+	generic = (now() - generic) * 1e9 / iters;
+	fast = now();
+	for (n = 0; n < iters; n++)
+		a->encode(bufs[n % NUM_BUFS], val);
+	fast = (now() - fast) * 1e9 / iters;
+	printf("  encode %8.1f -> %6.1f ns\n", generic, fast);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-c <rounds>] [-i <iterations>]\n"
+		"   Check and time the libibmad whole attribute decoders\n"
+		"   -c <rounds> random attributes checked per kind (default 100000)\n"
+		"   -i <iterations> timed conversions per kind (default 1000000)\n",
+		argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long rounds = 100000, iters = 1000000, errs = 0;
+	uint32_t state = 2463534242U;
+	unsigned i;
+	int ch;
+
+	argv0 = argv[0];
+
+	while ((ch = getopt(argc, argv, "c:i:h")) != -1) {
+		switch (ch) {
+		case 'c':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!iters)
+		usage();
+
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++)
+		errs += check(&attrs[i], rounds, &state);
+	if (errs) {
+		fprintf(stderr, "%lu mismatches\n", errs);
+		exit(1);
+	}
+	printf("%lu random attributes of each kind match the field table\n",
+	       rounds);
+
+	fill(&state, bufs, sizeof(bufs));
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++)
+		bench(&attrs[i], iters);
+
+	return 0;
+}
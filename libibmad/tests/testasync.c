@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Exercise the asynchronous MAD RPC engine against the simulated fabric of
+ * libibumad, see umad_sim(7).  A small fat tree is used unless UMAD_SIM is
+ * already set.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+
+#define WINDOW		4
+
+static struct ibmad_port *srcport;
+static int in_submit;
+static unsigned submitted, completed, responses, failed;
+
+static void node_info_cb(struct mad_async *async, ib_rpc_t *rpc,
+			 ib_portid_t *dport, int status, uint8_t *mad,
+			 int len, void *context);
+
+static int submit_node_info(struct mad_async *async, const char *path,
+			    void *context)
+{
+	ib_rpc_t rpc = {};
+	ib_portid_t portid = {};
+	int rc;
+
+	if (str2drpath(&portid.drpath, (char *)path, 0, 0) < 0)
+		return -1;
+
+	rpc.mgtclass = IB_SMI_DIRECT_CLASS;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.attr.id = IB_ATTR_NODE_INFO;
+	rpc.datasz = IB_SMP_DATA_SIZE;
+	rpc.dataoffs = IB_SMP_DATA_OFFS;
+
+	in_submit = 1;
+	rc = mad_async_submit(async, &rpc, &portid, NULL, node_info_cb,
+			      context);
+	in_submit = 0;
+	if (!rc)
+		submitted++;
+	return rc;
+}
+
+/* context is the DR path of the node, responses from switches fan out */
+static void node_info_cb(struct mad_async *async, ib_rpc_t *rpc,
+			 ib_portid_t *dport, int status, uint8_t *mad,
+			 int len, void *context)
+{
+	char *path = context;
+	char next[64];
+	unsigned type, nports, p;
+
+	if (in_submit) {
+		fprintf(stderr, "callback run from mad_async_submit\n");
+		exit(1);
+	}
+	if ((unsigned)mad_async_pending(async) > submitted - completed) {
+		fprintf(stderr, "more requests pending than submitted\n");
+		exit(1);
+	}
+	completed++;
+
+	if (status) {
+		/* nothing attached to that switch port */
+		if (status != ETIMEDOUT) {
+			fprintf(stderr, "%s: unexpected status %d\n", path,
+				status);
+			exit(1);
+		}
+		failed++;
+		free(path);
+		return;
+	}
+
+	responses++;
+	type = mad_get_field(mad + IB_SMP_DATA_OFFS, 0, IB_NODE_TYPE_F);
+	nports = mad_get_field(mad + IB_SMP_DATA_OFFS, 0, IB_NODE_NPORTS_F);
+
+	/* the local CA and the switch it is attached to */
+	if (!strcmp(path, "0") && type != IB_NODE_SWITCH) {
+		snprintf(next, sizeof(next), "0,%u",
+			 mad_get_field(mad + IB_SMP_DATA_OFFS, 0,
+				       IB_NODE_LOCAL_PORT_F));
+		if (submit_node_info(async, next, strdup(next))) {
+			fprintf(stderr, "submit from callback failed\n");
+			exit(1);
+		}
+	} else if (strchr(path, ',') && !strchr(strchr(path, ',') + 1, ',') &&
+		   type == IB_NODE_SWITCH) {
+		for (p = 1; p <= nports; p++) {
+			snprintf(next, sizeof(next), "%s,%u", path, p);
+			if (submit_node_info(async, next, strdup(next))) {
+				fprintf(stderr, "submit from callback failed\n");
+				exit(1);
+			}
+		}
+	}
+	free(path);
+}
+
+static void send_failed_cb(struct mad_async *async, ib_rpc_t *rpc,
+			   ib_portid_t *dport, int status, uint8_t *mad,
+			   int len, void *context)
+{
+	int *status_out = context;
+
+	if (in_submit) {
+		fprintf(stderr, "send failure reported from mad_async_submit\n");
+		exit(1);
+	}
+	*status_out = status;
+}
+
+/* A send that fails in mad_async_submit is only reported by a poll */
+static int test_send_failure(struct mad_async *async)
+{
+	ib_rpc_t rpc = {};
+	ib_portid_t portid = {};
+	int status = -1, rc;
+
+	if (umad_unregister(mad_rpc_portid(srcport),
+			    mad_rpc_class_agent(srcport,
+						IB_SMI_DIRECT_CLASS))) {
+		fprintf(stderr, "umad_unregister failed\n");
+		return 1;
+	}
+
+	rpc.mgtclass = IB_SMI_DIRECT_CLASS;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.attr.id = IB_ATTR_NODE_INFO;
+	rpc.datasz = IB_SMP_DATA_SIZE;
+	rpc.dataoffs = IB_SMP_DATA_OFFS;
+
+	in_submit = 1;
+	rc = mad_async_submit(async, &rpc, &portid, NULL, send_failed_cb,
+			      &status);
+	in_submit = 0;
+	if (rc || status != -1 || mad_async_pending(async) != 1) {
+		fprintf(stderr, "failed send not deferred\n");
+		return 1;
+	}
+
+	if (mad_async_poll(async, 0) != 1 || status <= 0 ||
+	    mad_async_pending(async)) {
+		fprintf(stderr, "failed send not reported by poll\n");
+		return 1;
+	}
+
+	printf("send failure reported from poll, status %d\n", status);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int mgmt_classes[] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS };
+	struct mad_async *async;
+	int rc;
+
+	setenv("UMAD_SIM", "cas=16,radix=8", 0);
+
+	srcport = mad_rpc_open_port(NULL, 0, mgmt_classes, 2);
+	if (!srcport) {
+		fprintf(stderr, "Failed to open port\n");
+		return 1;
+	}
+
+	async = mad_async_create(srcport, WINDOW);
+	if (!async) {
+		fprintf(stderr, "mad_async_create failed\n");
+		return 1;
+	}
+
+	if (submit_node_info(async, "0", strdup("0"))) {
+		fprintf(stderr, "mad_async_submit failed\n");
+		return 1;
+	}
+	rc = mad_async_wait(async);
+	if (rc < 0 || (unsigned)rc != completed || completed != submitted ||
+	    responses < 3) {
+		fprintf(stderr,
+			"wait returned %d, %u submitted, %u completed, %u responses\n",
+			rc, submitted, completed, responses);
+		return 1;
+	}
+	printf("%u requests completed, %u responses, %u timeouts\n",
+	       completed, responses, failed);
+
+	rc = test_send_failure(async);
+
+	mad_async_destroy(async);
+	mad_rpc_close_port(srcport);
+	return rc;
+}
@@ -52,9 +52,6 @@
 #include "internal.h"
 #include "chassis.h"
 
-#define container_of(ptr, type, member)                                        \
-	((type *)((uint8_t *)(ptr)-offsetof(type, member)))
-
 /* forward declarations */
 struct ni_cbdata
 {
@@ -225,31 +222,22 @@ static int is_mlnx_ext_port_info_supported(ibnd_port_t * port)
 	return 0;
 }
 
-int mlnx_ext_port_info_err(smp_engine_t * engine, ibnd_smp_t * smp,
-			   uint8_t * mad, void *cb_data)
+/* Follow an active link out of port to the node on the other side */
+static int explore_port(smp_engine_t * engine, ib_portid_t * portid,
+			ibnd_node_t * node, ibnd_port_t * port)
 {
 	f_internal_t *f_int = ((ibnd_scan_t *) engine->user_data)->f_int;
-	ibnd_node_t *node = cb_data;
-	ibnd_port_t *port;
-	uint8_t port_num, local_port;
-
-	port_num = (uint8_t) mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
-	port = node->ports[port_num];
-	if (!port) {
-		IBND_ERROR("Failed to find 0x%" PRIx64 " port %u\n",
-			   node->guid, port_num);
-		return -1;
-	}
+	int port_num = port->portnum;
+	uint8_t local_port;
 
 	local_port = (uint8_t) mad_get_field(port->info, 0, IB_PORT_LOCAL_PORT_F);
-	debug_port(&smp->path, port);
 
 	if (port_num && mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F)
 	    == IB_PORT_PHYS_STATE_LINKUP
 	    && ((node->type == IB_NODE_SWITCH && port_num != local_port) ||
 		(node == f_int->fabric.from_node && port_num == f_int->fabric.from_portnum))) {
 		int rc = 0;
-		ib_portid_t path = smp->path;
+		ib_portid_t path = *portid;
 
 		if (node->type != IB_NODE_SWITCH &&
 		    node == f_int->fabric.from_node &&
@@ -272,14 +260,12 @@ int mlnx_ext_port_info_err(smp_engine_t * engine, ibnd_smp_t * smp,
 	return 0;
 }
 
-static int recv_mlnx_ext_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
-				   uint8_t * mad, void *cb_data)
+int mlnx_ext_port_info_err(smp_engine_t * engine, ibnd_smp_t * smp,
+			   uint8_t * mad, void *cb_data)
 {
-	f_internal_t *f_int = ((ibnd_scan_t *) engine->user_data)->f_int;
 	ibnd_node_t *node = cb_data;
 	ibnd_port_t *port;
-	uint8_t *ext_port_info = mad + IB_SMP_DATA_OFFS;
-	uint8_t port_num, local_port;
+	uint8_t port_num;
 
 	port_num = (uint8_t) mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
 	port = node->ports[port_num];
@@ -289,36 +275,31 @@ static int recv_mlnx_ext_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 		return -1;
 	}
 
-	memcpy(port->ext_info, ext_port_info, sizeof(port->ext_info));
-	local_port = (uint8_t) mad_get_field(port->info, 0, IB_PORT_LOCAL_PORT_F);
 	debug_port(&smp->path, port);
 
-	if (port_num && mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F)
-	    == IB_PORT_PHYS_STATE_LINKUP
-	    && ((node->type == IB_NODE_SWITCH && port_num != local_port) ||
-		(node == f_int->fabric.from_node && port_num == f_int->fabric.from_portnum))) {
-		int rc = 0;
-		ib_portid_t path = smp->path;
+	return explore_port(engine, &smp->path, node, port);
+}
 
-		if (node->type != IB_NODE_SWITCH &&
-		    node == f_int->fabric.from_node &&
-		    path.drpath.cnt > 1)
-			rc = retract_dpath(engine, &path);
-		else {
-			/* we can't proceed through an HCA with DR */
-			if (path.lid == 0 || node->type == IB_NODE_SWITCH)
-				rc = extend_dpath(engine, &path, port_num);
-		}
+static int recv_mlnx_ext_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
+				   uint8_t * mad, void *cb_data)
+{
+	ibnd_node_t *node = cb_data;
+	ibnd_port_t *port;
+	uint8_t *ext_port_info = mad + IB_SMP_DATA_OFFS;
+	uint8_t port_num;
 
-		if (rc > 0) {
-			struct ni_cbdata * cbdata = malloc(sizeof(*cbdata));
-			cbdata->node = node;
-			cbdata->port_num = port_num;
-			query_node_info(engine, &path, cbdata);
-		}
+	port_num = (uint8_t) mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
+	port = node->ports[port_num];
+	if (!port) {
+		IBND_ERROR("Failed to find 0x%" PRIx64 " port %u\n",
+			   node->guid, port_num);
+		return -1;
 	}
 
-	return 0;
+	memcpy(port->ext_info, ext_port_info, sizeof(port->ext_info));
+	debug_port(&smp->path, port);
+
+	return explore_port(engine, &smp->path, node, port);
 }
 
 static int query_mlnx_ext_port_info(smp_engine_t * engine, ib_portid_t * portid,
@@ -338,13 +319,12 @@ static int recv_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 	ibnd_node_t *node = cb_data;
 	ibnd_port_t *port;
 	uint8_t *port_info = mad + IB_SMP_DATA_OFFS;
-	uint8_t port_num, local_port;
+	uint8_t port_num;
 	int phystate, ispeed, espeed;
 	uint8_t *info;
 	uint32_t cap_mask;
 
 	port_num = (uint8_t) mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
-	local_port = (uint8_t) mad_get_field(port_info, 0, IB_PORT_LOCAL_PORT_F);
 
 	/* this may have been created before */
 	port = node->ports[port_num];
@@ -374,7 +354,7 @@ static int recv_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 		port->lmc = node->smalmc;
 	}
 
-	int rc1 = add_to_portguid_hash(port, f_int->fabric.portstbl);
+	int rc1 = add_to_portguid_hash(port, f_int);
 	if (rc1)
 		IBND_ERROR("Error Occurred when trying"
 			   " to insert new port guid 0x%016" PRIx64 " to DB\n",
@@ -407,33 +387,7 @@ static int recv_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 
 	debug_port(&smp->path, port);
 
-	if (port_num && mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F)
-	    == IB_PORT_PHYS_STATE_LINKUP
-	    && ((node->type == IB_NODE_SWITCH && port_num != local_port) ||
-		(node == f_int->fabric.from_node && port_num == f_int->fabric.from_portnum))) {
-
-		int rc = 0;
-		ib_portid_t path = smp->path;
-
-		if (node->type != IB_NODE_SWITCH &&
-		    node == f_int->fabric.from_node &&
-		    path.drpath.cnt > 1)
-			rc = retract_dpath(engine, &path);
-		else {
-			/* we can't proceed through an HCA with DR */
-			if (path.lid == 0 || node->type == IB_NODE_SWITCH)
-				rc = extend_dpath(engine, &path, port_num);
-		}
-
-		if (rc > 0) {
-			struct ni_cbdata * cbdata = malloc(sizeof(*cbdata));
-			cbdata->node = node;
-			cbdata->port_num = port_num;
-			query_node_info(engine, &path, cbdata);
-		}
-	}
-
-	return 0;
+	return explore_port(engine, &smp->path, node, port);
 }
 
 static int recv_port0_info(smp_engine_t * engine, ibnd_smp_t * smp,
@@ -484,7 +438,7 @@ static ibnd_node_t *create_node(smp_engine_t * engine, ib_portid_t * path,
 	rc->path_portid = *path;
 	memcpy(rc->info, node_info, sizeof(rc->info));
 
-	int rc1 = add_to_nodeguid_hash(rc, f_int->fabric.nodestbl);
+	int rc1 = add_to_nodeguid_hash(rc, f_int);
 	if (rc1)
 		IBND_ERROR("Error Occurred when trying"
 			   " to insert new node guid 0x%016" PRIx64 " to DB\n",
@@ -588,6 +542,14 @@ static int recv_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
 		}
 
 		link_ports(node, port, rem_node, rem_node->ports[rem_port_num]);
+
+		/* The start node is also attached through this port, SMPs
+		 * through the switch behind it can be sent from it */
+		if (node == f_int->fabric.from_node && !scan->initial_hops &&
+		    !smp->path.lid && port_num != f_int->fabric.from_portnum &&
+		    rem_node->type == IB_NODE_SWITCH)
+			smp_engine_set_port_path(engine, port_num,
+						 &rem_node->path_portid.drpath);
 	}
 
 	if (node_is_new) {
@@ -616,19 +578,12 @@ static int query_node_info(smp_engine_t * engine, ib_portid_t * portid,
 
 ibnd_node_t *ibnd_find_node_guid(ibnd_fabric_t * fabric, uint64_t guid)
 {
-	int hash = HASHGUID(guid) % HTSZ;
-	ibnd_node_t *node;
-
 	if (!fabric) {
 		IBND_DEBUG("fabric parameter NULL\n");
 		return NULL;
 	}
 
-	for (node = fabric->nodestbl[hash]; node; node = node->htnext)
-		if (node->guid == guid)
-			return node;
-
-	return NULL;
+	return guid_index_find(&((f_internal_t *)fabric)->node_index, guid);
 }
 
 ibnd_node_t *ibnd_find_node_dr(ibnd_fabric_t * fabric, char *dr_str)
@@ -637,85 +592,157 @@ ibnd_node_t *ibnd_find_node_dr(ibnd_fabric_t * fabric, char *dr_str)
 	return rc->node;
 }
 
-int add_to_nodeguid_hash(ibnd_node_t * node, ibnd_node_t * hash[])
+static unsigned guid_index_slot(guid_index_t * index, uint64_t guid)
+{
+	/* Fibonacci hashing, the low GUID bits alone are badly spread */
+	return (unsigned)((guid * 0x9E3779B97F4A7C15ULL) >> 32) &
+	       (index->size - 1);
+}
+
+void *guid_index_find(guid_index_t * index, uint64_t guid)
+{
+	unsigned i;
+
+	if (!index->count)
+		return NULL;
+
+	for (i = guid_index_slot(index, guid); index->tbl[i].item;
+	     i = (i + 1) & (index->size - 1))
+		if (index->tbl[i].guid == guid)
+			return index->tbl[i].item;
+
+	return NULL;
+}
+
+static void guid_index_put(guid_index_t * index, uint64_t guid, void *item)
+{
+	unsigned i;
+
+	for (i = guid_index_slot(index, guid); index->tbl[i].item;
+	     i = (i + 1) & (index->size - 1))
+		if (index->tbl[i].guid == guid)
+			break;
+
+	if (!index->tbl[i].item)
+		index->count++;
+	index->tbl[i].guid = guid;
+	index->tbl[i].item = item;
+}
+
+/* A later item with the same guid replaces the earlier one */
+int guid_index_insert(guid_index_t * index, uint64_t guid, void *item)
+{
+	if ((index->count + 1) * 2 > index->size) {
+		guid_index_t grown = { 0 };
+		unsigned i;
+
+		grown.size = index->size ? index->size * 2 : 256;
+		grown.tbl = calloc(grown.size, sizeof(*grown.tbl));
+		if (!grown.tbl)
+			return -ENOMEM;
+
+		for (i = 0; i < index->size; i++)
+			if (index->tbl[i].item)
+				guid_index_put(&grown, index->tbl[i].guid,
+					       index->tbl[i].item);
+		free(index->tbl);
+		*index = grown;
+	}
+
+	guid_index_put(index, guid, item);
+	return 0;
+}
+
+void guid_index_destroy(guid_index_t * index)
+{
+	free(index->tbl);
+	memset(index, 0, sizeof(*index));
+}
+
+int add_to_nodeguid_hash(ibnd_node_t * node, f_internal_t * f_int)
 {
-	int rc = 0;
-	ibnd_node_t *tblnode;
+	ibnd_node_t **hash = f_int->fabric.nodestbl;
 	int hash_idx = HASHGUID(node->guid) % HTSZ;
 
-	for (tblnode = hash[hash_idx]; tblnode; tblnode = tblnode->htnext) {
-		if (tblnode == node) {
-			IBND_ERROR("Duplicate Node: Node with guid 0x%016"
-				   PRIx64 " already exists in nodes DB\n",
-				   node->guid);
-			return 1;
-		}
+	if (guid_index_find(&f_int->node_index, node->guid) == node) {
+		IBND_ERROR("Duplicate Node: Node with guid 0x%016"
+			   PRIx64 " already exists in nodes DB\n",
+			   node->guid);
+		return 1;
 	}
+	if (guid_index_insert(&f_int->node_index, node->guid, node))
+		return 1;
+
 	node->htnext = hash[hash_idx];
 	hash[hash_idx] = node;
-	return rc;
+	return 0;
 }
 
-int add_to_portguid_hash(ibnd_port_t * port, ibnd_port_t * hash[])
+int add_to_portguid_hash(ibnd_port_t * port, f_internal_t * f_int)
 {
-	int rc = 0;
-	ibnd_port_t *tblport;
+	ibnd_port_t **hash = f_int->fabric.portstbl;
 	int hash_idx = HASHGUID(port->guid) % HTSZ;
 
-	for (tblport = hash[hash_idx]; tblport; tblport = tblport->htnext) {
-		if (tblport == port) {
-			IBND_ERROR("Duplicate Port: Port with guid 0x%016"
-				   PRIx64 " already exists in ports DB\n",
-				   port->guid);
-			return 1;
-		}
+	/* Switch ports share their GUID, so look the port up by address */
+	if (guid_index_find(&f_int->port_set, (uintptr_t)port)) {
+		IBND_ERROR("Duplicate Port: Port with guid 0x%016"
+			   PRIx64 " already exists in ports DB\n",
+			   port->guid);
+		return 1;
 	}
+	if (guid_index_insert(&f_int->port_set, (uintptr_t)port, port) ||
+	    guid_index_insert(&f_int->port_index, port->guid, port))
+		return 1;
+
 	port->htnext = hash[hash_idx];
 	hash[hash_idx] = port;
-	return rc;
-}
-
-struct lid2guid_item {
-	cl_map_item_t cl_map;
-	ibnd_port_t *port;
-};
-
-void create_lid2guid(f_internal_t *f_int)
-{
-	cl_qmap_init(&f_int->lid2guid);
+	return 0;
 }
 
-void destroy_lid2guid(f_internal_t *f_int)
+void destroy_fabric_indexes(f_internal_t *f_int)
 {
-	cl_map_item_t *item;
-
-	for (item = cl_qmap_head(&f_int->lid2guid); item != cl_qmap_end(&f_int->lid2guid);
-	     item = cl_qmap_head(&f_int->lid2guid)) {
-		cl_qmap_remove_item(&f_int->lid2guid, item);
-		free(container_of(item, struct lid2guid_item, cl_map));
-	}
+	guid_index_destroy(&f_int->node_index);
+	guid_index_destroy(&f_int->port_index);
+	guid_index_destroy(&f_int->port_set);
+	free(f_int->lid2port);
+	f_int->lid2port = NULL;
+	f_int->lid2port_size = 0;
 }
 
 void add_to_portlid_hash(ibnd_port_t * port, f_internal_t *f_int)
 {
-	uint16_t base_lid = port->base_lid;
-	uint16_t lid_mask = ((1 << port->lmc) -1);
-	uint16_t lid = 0;
+	unsigned base_lid = port->base_lid;
+	unsigned lid_mask = ((1 << port->lmc) -1);
+	unsigned lid = 0;
+
 	/* 0 < valid lid <= 0xbfff */
-	if (base_lid > 0 && base_lid <= 0xbfff) {
-		/* We add the port for all lids
-		 * so it is easier to find any "random" lid specified */
-		for (lid = base_lid; lid <= (base_lid + lid_mask); lid++) {
-			struct lid2guid_item *item;
-
-			item = malloc(sizeof(*item));
-			if (item) {
-				item->port = port;
-				cl_qmap_insert(&f_int->lid2guid, lid,
-					       &item->cl_map);
-			}
+	if (base_lid == 0 || base_lid > 0xbfff)
+		return;
+	if (base_lid + lid_mask > 0xbfff)
+		lid_mask = 0xbfff - base_lid;
+
+	if (base_lid + lid_mask >= f_int->lid2port_size) {
+		unsigned size = f_int->lid2port_size ? f_int->lid2port_size : 1024;
+		ibnd_port_t **lid2port;
+
+		while (size <= base_lid + lid_mask)
+			size *= 2;
+		lid2port = realloc(f_int->lid2port, size * sizeof(*lid2port));
+		if (!lid2port) {
+			IBND_ERROR("OOM: failed to grow the LID index\n");
+			return;
 		}
+		memset(lid2port + f_int->lid2port_size, 0,
+		       (size - f_int->lid2port_size) * sizeof(*lid2port));
+		f_int->lid2port = lid2port;
+		f_int->lid2port_size = size;
 	}
+
+	/* We add the port for all lids
+	 * so it is easier to find any "random" lid specified */
+	for (lid = base_lid; lid <= base_lid + lid_mask; lid++)
+		if (!f_int->lid2port[lid])
+			f_int->lid2port[lid] = port;
 }
 
 void add_to_type_list(ibnd_node_t * node, f_internal_t * f_int)
@@ -757,11 +784,43 @@ static int set_config(struct ibnd_config *config, struct ibnd_config *cfg)
 
 f_internal_t *allocate_fabric_internal(void)
 {
-	f_internal_t *f = calloc(1, sizeof(*f));
-	if (f)
-		create_lid2guid(f);
+	return calloc(1, sizeof(f_internal_t));
+}
 
-	return (f);
+static int init_scan(ibnd_scan_t * scan, smp_engine_t * engine,
+		     char * ca_name, int ca_port, ib_portid_t * from,
+		     struct ibnd_config *config)
+{
+	struct ibmad_port *ibmad_port;
+	int nc = 2;
+	int mc[2] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS };
+
+	memset(scan, 0, sizeof(*scan));
+	scan->cfg = config;
+	scan->initial_hops = from->drpath.cnt;
+
+	ibmad_port = mad_rpc_open_port(ca_name, ca_port, mc, nc);
+	if (!ibmad_port) {
+		IBND_ERROR("can't open MAD port (%s:%d)\n", ca_name, ca_port);
+		return -1;
+	}
+	mad_rpc_set_timeout(ibmad_port, config->timeout_ms);
+	mad_rpc_set_retries(ibmad_port, config->retries);
+	smp_mkey_set(ibmad_port, config->mkey);
+
+	if (ib_resolve_self_via(&scan->selfportid,
+				NULL, NULL, ibmad_port) < 0) {
+		IBND_ERROR("Failed to resolve self\n");
+		mad_rpc_close_port(ibmad_port);
+		return -1;
+	}
+	mad_rpc_close_port(ibmad_port);
+
+	if (smp_engine_init(engine, ca_name, ca_port, scan, config))
+		return -1;
+
+	IBND_DEBUG("from %s\n", portid2str(from));
+	return 0;
 }
 
 ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
@@ -773,9 +832,6 @@ ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
 	ib_portid_t my_portid = { 0 };
 	smp_engine_t engine;
 	ibnd_scan_t scan;
-	struct ibmad_port *ibmad_port;
-	int nc = 2;
-	int mc[2] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS };
 
 	/* If not specified start from "my" port */
 	if (!from)
@@ -786,56 +842,672 @@ ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
 		return NULL;
 	}
 
+	if (init_scan(&scan, &engine, ca_name, ca_port, from, &config))
+		return NULL;
+
 	f_int = allocate_fabric_internal();
 	if (!f_int) {
 		IBND_ERROR("OOM: failed to calloc ibnd_fabric_t\n");
+		smp_engine_destroy(&engine);
 		return NULL;
 	}
-
-	memset(&scan.selfportid, 0, sizeof(scan.selfportid));
 	scan.f_int = f_int;
-	scan.cfg = &config;
-	scan.initial_hops = from->drpath.cnt;
 
-	ibmad_port = mad_rpc_open_port(ca_name, ca_port, mc, nc);
-	if (!ibmad_port) {
-		IBND_ERROR("can't open MAD port (%s:%d)\n", ca_name, ca_port);
-		return (NULL);
+	if (!query_node_info(&engine, from, NULL))
+		if (process_mads(&engine) != 0)
+			goto error;
+
+	f_int->fabric.total_mads_used = engine.total_smps;
+	memcpy(f_int->smp_stats, engine.stats, sizeof(f_int->smp_stats));
+	f_int->fabric.maxhops_discovered += scan.initial_hops;
+
+	if (group_nodes(&f_int->fabric))
+		goto error;
+
+	smp_engine_destroy(&engine);
+	return (ibnd_fabric_t *)f_int;
+error:
+	smp_engine_destroy(&engine);
+	ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
+
+/* Copy node and its ports, but not their links, into f_int */
+static ibnd_node_t *clone_node(f_internal_t * f_int, ibnd_node_t * old)
+{
+	ibnd_node_t *node = calloc(1, sizeof(*node));
+	int p;
+
+	if (!node) {
+		IBND_ERROR("OOM: node creation failed\n");
+		return NULL;
 	}
-	mad_rpc_set_timeout(ibmad_port, cfg->timeout_ms);
-	mad_rpc_set_retries(ibmad_port, cfg->retries);
-	smp_mkey_set(ibmad_port, cfg->mkey);
 
-	if (ib_resolve_self_via(&scan.selfportid,
-				NULL, NULL, ibmad_port) < 0) {
-		IBND_ERROR("Failed to resolve self\n");
-		mad_rpc_close_port(ibmad_port);
+	node->path_portid = old->path_portid;
+	node->smalid = old->smalid;
+	node->smalmc = old->smalmc;
+	node->smaenhsp0 = old->smaenhsp0;
+	memcpy(node->switchinfo, old->switchinfo, sizeof(node->switchinfo));
+	node->guid = old->guid;
+	node->type = old->type;
+	node->numports = old->numports;
+	memcpy(node->info, old->info, sizeof(node->info));
+	memcpy(node->nodedesc, old->nodedesc, sizeof(node->nodedesc));
+
+	node->ports = calloc(node->numports + 1, sizeof(*node->ports));
+	if (!node->ports) {
+		free(node);
+		IBND_ERROR("OOM: Failed to allocate the ports array\n");
 		return NULL;
 	}
-	mad_rpc_close_port(ibmad_port);
 
-	if (smp_engine_init(&engine, ca_name, ca_port, &scan, &config)) {
+	for (p = 0; p <= node->numports; p++) {
+		ibnd_port_t *port;
+
+		if (!old->ports[p])
+			continue;
+
+		port = calloc(1, sizeof(*port));
+		if (!port) {
+			IBND_ERROR("OOM: Failed to allocate port\n");
+			destroy_node(node);
+			return NULL;
+		}
+		*port = *old->ports[p];
+		port->node = node;
+		port->remoteport = NULL;
+		port->htnext = NULL;
+		node->ports[p] = port;
+	}
+
+	add_to_nodeguid_hash(node, f_int);
+	node->next = f_int->fabric.nodes;
+	f_int->fabric.nodes = node;
+	add_to_type_list(node, f_int);
+
+	for (p = 0; p <= node->numports; p++) {
+		if (!node->ports[p])
+			continue;
+		add_to_portguid_hash(node->ports[p], f_int);
+		/* switch ports all share the LID of port 0 */
+		if (node->type != IB_NODE_SWITCH || p == 0)
+			add_to_portlid_hash(node->ports[p], f_int);
+	}
+
+	return node;
+}
+
+static int link_changed(ibnd_port_t * old, ibnd_port_t * port)
+{
+	static const enum MAD_FIELDS fields[] = {
+		IB_PORT_PHYS_STATE_F,
+		IB_PORT_LINK_WIDTH_ACTIVE_F,
+		IB_PORT_LINK_SPEED_ACTIVE_F,
+		IB_PORT_LINK_SPEED_EXT_ACTIVE_F,
+	};
+	unsigned i;
+
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+		if (mad_get_field(old->info, 0, fields[i]) !=
+		    mad_get_field(port->info, 0, fields[i]))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Copy of prev, in the same node order.  If keep is given only the nodes in
+ * it, keyed by address, and the links between them are copied.
+ */
+static f_internal_t *clone_fabric(ibnd_fabric_t * prev, guid_index_t * keep)
+{
+	f_internal_t *f_int;
+	ibnd_node_t **nodes, *old, *node, *rem;
+	unsigned n = 0, i;
+	int p;
+
+	for (old = prev->nodes; old; old = old->next)
+		if (!keep || guid_index_find(keep, (uintptr_t)old))
+			n++;
+
+	nodes = calloc(n ? n : 1, sizeof(*nodes));
+	f_int = allocate_fabric_internal();
+	if (!nodes || !f_int) {
+		IBND_ERROR("OOM: failed to clone ibnd_fabric_t\n");
+		free(nodes);
 		free(f_int);
-		return (NULL);
+		return NULL;
 	}
 
-	IBND_DEBUG("from %s\n", portid2str(from));
+	for (i = 0, old = prev->nodes; old; old = old->next)
+		if (!keep || guid_index_find(keep, (uintptr_t)old))
+			nodes[i++] = old;
+	while (i--)
+		if (!clone_node(f_int, nodes[i]))
+			goto error;
 
-	if (!query_node_info(&engine, from, NULL))
-		if (process_mads(&engine) != 0)
+	for (i = 0; i < n; i++) {
+		old = nodes[i];
+		node = ibnd_find_node_guid(&f_int->fabric, old->guid);
+		for (p = 0; p <= old->numports; p++) {
+			ibnd_port_t *op = old->ports[p];
+
+			if (!op || !op->remoteport || node->ports[p]->remoteport)
+				continue;
+			rem = ibnd_find_node_guid(&f_int->fabric,
+						  op->remoteport->node->guid);
+			if (!rem)
+				continue;
+			link_ports(node, node->ports[p], rem,
+				   rem->ports[op->remoteport->portnum]);
+		}
+	}
+
+	if (prev->from_node)
+		f_int->fabric.from_node =
+		    ibnd_find_node_guid(&f_int->fabric, prev->from_node->guid);
+	f_int->fabric.from_portnum = prev->from_portnum;
+	f_int->fabric.maxhops_discovered = prev->maxhops_discovered;
+
+	free(nodes);
+	return f_int;
+error:
+	free(nodes);
+	ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
+
+/* cb_data is a struct ni_cbdata, port_num the port the SMP must enter the
+ * node through or 0 for any */
+static int recv_verify_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
+				 uint8_t * mad, void *cb_data)
+{
+	ibnd_scan_t *scan = engine->user_data;
+	uint8_t *node_info = mad + IB_SMP_DATA_OFFS;
+	struct ni_cbdata *cbdata = cb_data;
+	ibnd_node_t *node = cbdata->node;
+	int port_num = mad_get_field(node_info, 0, IB_NODE_LOCAL_PORT_F);
+
+	if (mad_get_field64(node_info, 0, IB_NODE_GUID_F) != node->guid ||
+	    (int)mad_get_field(node_info, 0, IB_NODE_NPORTS_F) != node->numports ||
+	    (cbdata->port_num && port_num != cbdata->port_num)) {
+		IBND_DEBUG("%s: node 0x%" PRIx64 " replaced or moved\n",
+			   portid2str(&smp->path), node->guid);
+		return 0;
+	}
+
+	memcpy(node->info, node_info, sizeof(node->info));
+	if (node == scan->f_int->fabric.from_node)
+		scan->f_int->fabric.from_portnum = port_num;
+	scan->verified++;
+	return 0;
+}
+
+/*
+ * IBND_REFRESH_FABRIC_FLAG_QUICK: PortInfo of a known node.  Links that went
+ * down are removed, switch ports that came up are explored as a discovery
+ * does.  Width, speed and LID changes are only recorded for compute_deltas.
+ */
+static int recv_refresh_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
+				  uint8_t * mad, void *cb_data)
+{
+	uint8_t *port_info = mad + IB_SMP_DATA_OFFS;
+	ibnd_node_t *node = cb_data;
+	ibnd_port_t *port;
+	int port_num, linkup;
+
+	port_num = mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
+	if (port_num > node->numports)
+		return 0;
+
+	port = node->ports[port_num];
+	if (!port) {
+		port = node->ports[port_num] = calloc(1, sizeof(*port));
+		if (!port) {
+			IBND_ERROR("Failed to allocate 0x%" PRIx64 " port %u\n",
+				   node->guid, port_num);
+			return -1;
+		}
+		port->node = node;
+		port->portnum = port_num;
+		port->guid =
+		    mad_get_field64(node->info, 0, IB_NODE_PORT_GUID_F);
+	}
+
+	memcpy(port->info, port_info, sizeof(port->info));
+	port->base_lid = (uint16_t) mad_get_field(port->info, 0, IB_PORT_LID_F);
+	port->lmc = (uint8_t) mad_get_field(port->info, 0, IB_PORT_LMC_F);
+	if (port_num == 0) {
+		node->smalid = port->base_lid;
+		node->smalmc = port->lmc;
+	}
+
+	/* CA ports are only queried on the link they were reached through */
+	if (port_num == 0 || node->type != IB_NODE_SWITCH)
+		return 0;
+
+	linkup = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F) ==
+		 IB_PORT_PHYS_STATE_LINKUP;
+	if (port->remoteport && !linkup) {
+		IBND_DEBUG("%s: port %d went down\n", portid2str(&smp->path),
+			   port_num);
+		port->remoteport->remoteport = NULL;
+		port->remoteport = NULL;
+	} else if (!port->remoteport && linkup) {
+		IBND_DEBUG("%s: port %d came up\n", portid2str(&smp->path),
+			   port_num);
+		return explore_port(engine, &smp->path, node, port);
+	}
+
+	return 0;
+}
+
+static int issue_verify(smp_engine_t * engine, struct ni_cbdata * cbdata,
+			ibnd_node_t * node, int port_num)
+{
+	cbdata->node = node;
+	cbdata->port_num = port_num;
+	return issue_smp(engine, &node->path_portid, IB_ATTR_NODE_INFO, 0,
+			 recv_verify_node_info, cbdata);
+}
+
+/*
+ * Mark the nodes reachable from the start node over the links of f_int.
+ * Returns the number of reachable nodes which were neither verified nor
+ * found by the refresh, -1 on error.
+ */
+static int mark_reachable(f_internal_t * f_int, guid_index_t * reached)
+{
+	ibnd_node_t **queue, *node, *rem;
+	unsigned n = 0, head = 0, tail = 0;
+	int p, unverified = 0;
+
+	for (node = f_int->fabric.nodes; node; node = node->next)
+		n++;
+
+	queue = calloc(n ? n : 1, sizeof(*queue));
+	if (!queue)
+		return -1;
+
+	queue[tail++] = f_int->fabric.from_node;
+	if (guid_index_insert(reached, (uintptr_t)queue[0], queue[0]))
+		goto error;
+
+	while (head < tail) {
+		node = queue[head++];
+		if (node->path_portid.drpath.cnt == -1)
+			unverified++;
+
+		for (p = 1; p <= node->numports; p++) {
+			if (!node->ports[p] || !node->ports[p]->remoteport)
+				continue;
+			rem = node->ports[p]->remoteport->node;
+			if (guid_index_find(reached, (uintptr_t)rem))
+				continue;
+			if (guid_index_insert(reached, (uintptr_t)rem, rem))
+				goto error;
+			queue[tail++] = rem;
+		}
+	}
+
+	free(queue);
+	return unverified;
+error:
+	free(queue);
+	return -1;
+}
+
+/*
+ * IBND_REFRESH_FABRIC_FLAG_QUICK: walk the switches of the cloned fabric one
+ * hop at a time, over the links still up, reading NodeInfo and the PortInfo
+ * of every port.  CAs and routers get a NodeInfo and the PortInfo of the port
+ * they are reached through.  Only ports whose link came up are explored
+ * further; nodes no longer reachable are dropped.  On success scan->f_int is
+ * replaced by the refreshed fabric and 0 is returned.  Returns > 0 if a node
+ * was replaced or could not be reached on its previous path, and the fabric
+ * has to be walked.
+ */
+static int quick_refresh(smp_engine_t * engine, ibnd_scan_t * scan,
+			 ib_portid_t * from)
+{
+	f_internal_t *f_int = scan->f_int, *refreshed;
+	ibnd_node_t *from_node = f_int->fabric.from_node;
+	ibnd_node_t *node, *rem;
+	/* switches to walk, in the order they are reached */
+	struct ni_cbdata *queue = NULL, *verify = NULL;
+	guid_index_t reached = { 0 };
+	unsigned nswitches = 0, nnodes = 0, head = 0, tail = 0, level;
+	unsigned expected = 0;
+	ibnd_port_t *port;
+	int p, rc;
+
+	/* only DR paths from the local port are rebuilt */
+	if (!from_node || from->lid || from->drpath.cnt)
+		return 1;
+
+	/* A cnt of -1 marks the nodes not reached yet */
+	for (node = f_int->fabric.nodes; node; node = node->next) {
+		node->path_portid.drpath.cnt = -1;
+		if (node->type == IB_NODE_SWITCH)
+			nswitches++;
+		nnodes++;
+	}
+	from_node->path_portid = *from;
+
+	queue = calloc(nswitches ? nswitches : 1, sizeof(*queue));
+	verify = calloc(nnodes, sizeof(*verify));
+	if (!queue || !verify) {
+		rc = -1;
+		goto out;
+	}
+
+	/* The start node, also giving the port we are attached through */
+	rc = -1;
+	if (issue_verify(engine, &verify[expected++], from_node, 0))
+		goto out;
+	if ((rc = process_mads(engine)) != 0)
+		goto out;
+	rc = 1;
+	if (scan->verified != expected)
+		goto out;
+
+	if (from_node->type == IB_NODE_SWITCH) {
+		queue[tail++].node = from_node;
+	} else {
+		port = from_node->ports[f_int->fabric.from_portnum];
+		if (!port || !port->remoteport ||
+		    port->remoteport->node->type != IB_NODE_SWITCH)
+			goto out;
+		rc = -1;
+		if (issue_smp(engine, from, IB_ATTR_PORT_INFO, port->portnum,
+			      recv_refresh_port_info, from_node))
+			goto out;
+		rem = port->remoteport->node;
+		rem->path_portid = *from;
+		add_port_to_dpath(&rem->path_portid.drpath, port->portnum);
+		queue[tail].node = rem;
+		queue[tail++].port_num = port->remoteport->portnum;
+	}
+
+	while (head < tail) {
+		rc = -1;
+		for (level = head; level < tail; level++) {
+			node = queue[level].node;
+			expected++;
+			if (issue_smp(engine, &node->path_portid,
+				      IB_ATTR_NODE_INFO, 0,
+				      recv_verify_node_info, &queue[level]))
+				goto out;
+			for (p = 0; p <= node->numports; p++)
+				if (issue_smp(engine, &node->path_portid,
+					      IB_ATTR_PORT_INFO, p,
+					      recv_refresh_port_info, node))
+					goto out;
+		}
+		if ((rc = process_mads(engine)) != 0)
+			goto out;
+		rc = 1;
+		if (scan->verified != expected)
+			goto out;
+
+		rc = -1;
+		for (; head < level; head++) {
+			node = queue[head].node;
+			for (p = 1; p <= node->numports; p++) {
+				ib_portid_t path = node->path_portid;
+
+				port = node->ports[p];
+				if (!port)
+					continue;
+				/* switch ports all share the LID of port 0 */
+				port->base_lid = node->smalid;
+				port->lmc = node->smalmc;
+
+				if (!port->remoteport)
+					continue;
+				rem = port->remoteport->node;
+				/* keep the first, shortest, path found; nodes
+				 * found by exploring a new link have one */
+				if (rem->path_portid.drpath.cnt != -1)
+					continue;
+				if (add_port_to_dpath(&path.drpath, p) < 0)
+					continue;
+				rem->path_portid = path;
+				if (rem->type == IB_NODE_SWITCH) {
+					queue[tail].node = rem;
+					queue[tail++].port_num =
+					    port->remoteport->portnum;
+					continue;
+				}
+				if (issue_verify(engine, &verify[expected++],
+						 rem, port->remoteport->portnum) ||
+				    issue_smp(engine, &rem->path_portid,
+					      IB_ATTR_PORT_INFO,
+					      port->remoteport->portnum,
+					      recv_refresh_port_info, rem))
+					goto out;
+			}
+		}
+	}
+
+	if ((rc = process_mads(engine)) != 0)
+		goto out;
+	rc = 1;
+	if (scan->verified != expected)
+		goto out;
+
+	IBND_DEBUG("quick refresh: %u of %u nodes verified\n",
+		   scan->verified, nnodes);
+
+	/* A known node only reachable over a new link was never verified */
+	rc = mark_reachable(f_int, &reached);
+	if (rc)
+		goto out;
+
+	rc = -1;
+	refreshed = clone_fabric(&f_int->fabric, &reached);
+	if (!refreshed)
+		goto out;
+	ibnd_destroy_fabric(&f_int->fabric);
+	scan->f_int = refreshed;
+	rc = 0;
+out:
+	guid_index_destroy(&reached);
+	free(verify);
+	free(queue);
+	return rc;
+}
+
+static int add_delta(ibnd_delta_t *** tail, ibnd_delta_type_t type,
+		     ibnd_node_t * node, ibnd_port_t * port)
+{
+	ibnd_delta_t *delta = calloc(1, sizeof(*delta));
+
+	if (!delta) {
+		IBND_ERROR("OOM: failed to allocate delta\n");
+		return -1;
+	}
+
+	delta->type = type;
+	delta->guid = node->guid;
+	if (port) {
+		delta->portnum = port->portnum;
+		delta->remote_guid = port->remoteport->node->guid;
+		delta->remote_portnum = port->remoteport->portnum;
+	}
+
+	**tail = delta;
+	*tail = &delta->next;
+	return 0;
+}
+
+static int node_changed(ibnd_node_t * old, ibnd_node_t * node)
+{
+	int p;
+
+	if (old->type != node->type || old->numports != node->numports ||
+	    strncmp(old->nodedesc, node->nodedesc, sizeof(node->nodedesc)))
+		return 1;
+
+	for (p = 0; p <= node->numports; p++)
+		if (old->ports[p] && node->ports[p] &&
+		    (old->ports[p]->base_lid != node->ports[p]->base_lid ||
+		     old->ports[p]->lmc != node->ports[p]->lmc))
+			return 1;
+
+	return 0;
+}
+
+static ibnd_port_t *find_same_port(ibnd_fabric_t * fabric, ibnd_port_t * port)
+{
+	ibnd_node_t *node = ibnd_find_node_guid(fabric, port->node->guid);
+
+	if (!node || port->portnum > node->numports)
+		return NULL;
+
+	return node->ports[port->portnum];
+}
+
+static int same_link(ibnd_port_t * a, ibnd_port_t * b)
+{
+	return a && b && a->remoteport && b->remoteport &&
+	       a->remoteport->node->guid == b->remoteport->node->guid &&
+	       a->remoteport->portnum == b->remoteport->portnum;
+}
+
+/* Links are reported once, from their end with the lower guid and port */
+static int link_owner(ibnd_port_t * port)
+{
+	ibnd_port_t *rem = port->remoteport;
+
+	return port->node->guid < rem->node->guid ||
+	       (port->node->guid == rem->node->guid &&
+		port->portnum < rem->portnum);
+}
+
+static int compute_deltas(ibnd_fabric_t * prev, f_internal_t * f_int)
+{
+	ibnd_delta_t **tail = &f_int->deltas;
+	ibnd_node_t *node, *old;
+	ibnd_port_t *port, *other;
+	int p, rc = 0;
+
+	for (node = f_int->fabric.nodes; node && !rc; node = node->next) {
+		old = ibnd_find_node_guid(prev, node->guid);
+		if (!old)
+			rc = add_delta(&tail, IBND_DELTA_NODE_ADDED, node, NULL);
+		else if (node_changed(old, node))
+			rc = add_delta(&tail, IBND_DELTA_NODE_CHANGED, node,
+				       NULL);
+
+		for (p = 0; p <= node->numports && !rc; p++) {
+			port = node->ports[p];
+			if (!port || !port->remoteport || !link_owner(port))
+				continue;
+			other = find_same_port(prev, port);
+			if (!same_link(other, port))
+				rc = add_delta(&tail, IBND_DELTA_LINK_ADDED,
+					       node, port);
+			else if (link_changed(other, port))
+				rc = add_delta(&tail, IBND_DELTA_LINK_CHANGED,
+					       node, port);
+		}
+	}
+
+	for (old = prev->nodes; old && !rc; old = old->next) {
+		if (!ibnd_find_node_guid(&f_int->fabric, old->guid))
+			rc = add_delta(&tail, IBND_DELTA_NODE_REMOVED, old,
+				       NULL);
+
+		for (p = 0; p <= old->numports && !rc; p++) {
+			port = old->ports[p];
+			if (!port || !port->remoteport || !link_owner(port))
+				continue;
+			other = find_same_port(&f_int->fabric, port);
+			if (!same_link(port, other))
+				rc = add_delta(&tail, IBND_DELTA_LINK_REMOVED,
+					       old, port);
+		}
+	}
+
+	return rc;
+}
+
+ibnd_fabric_t *ibnd_refresh_fabric(ibnd_fabric_t * prev, char * ca_name,
+				   int ca_port, ib_portid_t * from,
+				   struct ibnd_config *cfg, unsigned int flags)
+{
+	struct ibnd_config config = { 0 };
+	f_internal_t *f_int = NULL;
+	ib_portid_t my_portid = { 0 };
+	smp_engine_t engine;
+	ibnd_scan_t scan;
+	int rc;
+
+	if (!prev) {
+		IBND_DEBUG("prev parameter NULL\n");
+		return NULL;
+	}
+
+	/* If not specified start from "my" port */
+	if (!from)
+		from = &my_portid;
+
+	if (set_config(&config, cfg)) {
+		IBND_ERROR("Invalid ibnd_config\n");
+		return NULL;
+	}
+
+	if (init_scan(&scan, &engine, ca_name, ca_port, from, &config))
+		return NULL;
+
+	if (flags & IBND_REFRESH_FABRIC_FLAG_QUICK) {
+		f_int = clone_fabric(prev, NULL);
+		if (!f_int)
+			goto error;
+		scan.f_int = f_int;
+
+		rc = quick_refresh(&engine, &scan, from);
+		f_int = scan.f_int;
+		if (rc < 0)
 			goto error;
+		if (rc > 0) {
+			IBND_DEBUG("quick refresh failed, walking the fabric\n");
+			ibnd_destroy_fabric(&f_int->fabric);
+			f_int = NULL;
+		}
+	}
+
+	if (!f_int) {
+		f_int = allocate_fabric_internal();
+		if (!f_int) {
+			IBND_ERROR("OOM: failed to calloc ibnd_fabric_t\n");
+			goto error;
+		}
+		scan.f_int = f_int;
+
+		if (!query_node_info(&engine, from, NULL))
+			if (process_mads(&engine) != 0)
+				goto error;
+
+		f_int->fabric.maxhops_discovered += scan.initial_hops;
+	}
 
 	f_int->fabric.total_mads_used = engine.total_smps;
-	f_int->fabric.maxhops_discovered += scan.initial_hops;
+	memcpy(f_int->smp_stats, engine.stats, sizeof(f_int->smp_stats));
 
 	if (group_nodes(&f_int->fabric))
 		goto error;
 
+	if (compute_deltas(prev, f_int))
+		goto error;
+
 	smp_engine_destroy(&engine);
 	return (ibnd_fabric_t *)f_int;
 error:
 	smp_engine_destroy(&engine);
-	ibnd_destroy_fabric(&f_int->fabric);
+	if (f_int)
+		ibnd_destroy_fabric(&f_int->fabric);
 	return NULL;
 }
 
@@ -853,9 +1525,11 @@ void destroy_node(ibnd_node_t * node)
 
 void ibnd_destroy_fabric(ibnd_fabric_t * fabric)
 {
+	f_internal_t *f_int = (f_internal_t *)fabric;
 	ibnd_node_t *node = NULL;
 	ibnd_node_t *next = NULL;
 	ibnd_chassis_t *ch, *ch_next;
+	ibnd_delta_t *delta, *delta_next;
 
 	if (!fabric)
 		return;
@@ -866,14 +1540,49 @@ void ibnd_destroy_fabric(ibnd_fabric_t * fabric)
 		free(ch);
 		ch = ch_next;
 	}
-	node = fabric->nodes;
-	while (node) {
-		next = node->next;
-		destroy_node(node);
-		node = next;
+	if (f_int->node_array) {
+		free(f_int->node_array);
+		free(f_int->port_array);
+		free(f_int->port_ptr_array);
+	} else {
+		node = fabric->nodes;
+		while (node) {
+			next = node->next;
+			destroy_node(node);
+			node = next;
+		}
 	}
-	destroy_lid2guid((f_internal_t *)fabric);
-	free(fabric);
+	delta = f_int->deltas;
+	while (delta) {
+		delta_next = delta->next;
+		free(delta);
+		delta = delta_next;
+	}
+	destroy_fabric_indexes(f_int);
+	free(f_int);
+}
+
+int ibnd_get_smp_stats(ibnd_fabric_t * fabric, ibnd_smp_stats_t * stats,
+		       int n)
+{
+	f_internal_t *f_int = (f_internal_t *)fabric;
+	int hops, used = 0;
+
+	if (!fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return -1;
+	}
+
+	for (hops = 0; hops <= MAXHOPS; hops++) {
+		if (f_int->smp_stats[hops].smps ||
+		    f_int->smp_stats[hops].timeouts)
+			used = hops + 1;
+		if (hops < n) {
+			stats[hops] = f_int->smp_stats[hops];
+			stats[hops].hops = hops;
+		}
+	}
+	return used;
 }
 
 void ibnd_iter_nodes(ibnd_fabric_t * fabric, ibnd_iter_node_func_t func,
@@ -930,31 +1639,49 @@ void ibnd_iter_nodes_type(ibnd_fabric_t * fabric, ibnd_iter_node_func_t func,
 		func(cur, user_data);
 }
 
+void ibnd_iter_deltas(ibnd_fabric_t * fabric, ibnd_iter_delta_func_t func,
+		      void *user_data)
+{
+	ibnd_delta_t *cur;
+
+	if (!fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return;
+	}
+
+	if (!func) {
+		IBND_DEBUG("func parameter NULL\n");
+		return;
+	}
+
+	for (cur = ((f_internal_t *)fabric)->deltas; cur; cur = cur->next)
+		func(cur, user_data);
+}
+
 ibnd_port_t *ibnd_find_port_lid(ibnd_fabric_t * fabric,
 				uint16_t lid)
 {
 	f_internal_t *f = (f_internal_t *)fabric;
 
-	return container_of(cl_qmap_get(&f->lid2guid, lid),
-			    struct lid2guid_item, cl_map)
-		->port;
+	if (!fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return NULL;
+	}
+
+	if (lid >= f->lid2port_size)
+		return NULL;
+
+	return f->lid2port[lid];
 }
 
 ibnd_port_t *ibnd_find_port_guid(ibnd_fabric_t * fabric, uint64_t guid)
 {
-	int hash = HASHGUID(guid) % HTSZ;
-	ibnd_port_t *port;
-
 	if (!fabric) {
 		IBND_DEBUG("fabric parameter NULL\n");
 		return NULL;
 	}
 
-	for (port = fabric->portstbl[hash]; port; port = port->htnext)
-		if (port->guid == guid)
-			return port;
-
-	return NULL;
+	return guid_index_find(&((f_internal_t *)fabric)->port_index, guid);
 }
 
 ibnd_port_t *ibnd_find_port_dr(ibnd_fabric_t * fabric, char *dr_str)
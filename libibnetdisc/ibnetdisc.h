@@ -141,6 +141,7 @@ typedef struct ibnd_chassis {
 
 /* define config flags */
 #define IBND_CONFIG_MLX_EPI (1 << 0)
+#define IBND_CONFIG_ADAPTIVE_SMPS (1 << 1)
 
 typedef struct ibnd_config {
 	unsigned max_smps;
@@ -151,7 +152,13 @@ typedef struct ibnd_config {
 	unsigned retries;
 	uint32_t flags;
 	uint64_t mkey;
-	uint8_t pad[44];
+	/* IBND_CONFIG_ADAPTIVE_SMPS: limit of the SMP window per port,
+	 * 0 for the default */
+	unsigned max_smps_limit;
+	/* mask of other ports of the CA, connected to the same subnet, to
+	 * send SMPs from (bit N for port N) */
+	uint32_t ca_ports;
+	uint8_t pad[36];
 } ibnd_config_t;
 
 /** =========================================================================
@@ -204,6 +211,28 @@ int ibnd_cache_fabric(ibnd_fabric_t *fabric, const char *file,
 
 #define IBND_CACHE_FABRIC_FLAG_DEFAULT      0x0000
 #define IBND_CACHE_FABRIC_FLAG_NO_OVERWRITE 0x0001
+/* write the version 2 format, which loads faster but cannot be loaded by
+ * releases before libibnetdisc 5.1 */
+#define IBND_CACHE_FABRIC_FLAG_VERSION2     0x0002
+
+ibnd_fabric_t *ibnd_refresh_fabric(ibnd_fabric_t *prev, char *ca_name,
+				   int ca_port, ib_portid_t *from,
+				   struct ibnd_config *config,
+				   unsigned int flags);
+	/**
+	 * prev: fabric from an earlier ibnd_discover_fabric,
+	 *       ibnd_refresh_fabric or ibnd_load_fabric call.  It is not
+	 *       modified and must still be destroyed by the caller.
+	 * flags: IBND_REFRESH_FABRIC_FLAG_*
+	 *
+	 * Returns a new fabric.  The differences to prev are available with
+	 * ibnd_iter_deltas.
+	 */
+
+#define IBND_REFRESH_FABRIC_FLAG_DEFAULT    0x0000
+/* Read the PortInfo of the known switch ports and only explore the ports
+ * that came up; walk the fabric if a known node is replaced or moved */
+#define IBND_REFRESH_FABRIC_FLAG_QUICK      0x0001
 
 /** =========================================================================
  * Node operations
@@ -228,6 +257,50 @@ typedef void (*ibnd_iter_port_func_t) (ibnd_port_t * port, void *user_data);
 void ibnd_iter_ports(ibnd_fabric_t *fabric, ibnd_iter_port_func_t func,
 		     void *user_data);
 
+/** =========================================================================
+ * Changes found by ibnd_refresh_fabric
+ */
+typedef enum ibnd_delta_type {
+	IBND_DELTA_NODE_ADDED,
+	IBND_DELTA_NODE_REMOVED,
+	IBND_DELTA_NODE_CHANGED,	/* description, port count or LIDs */
+	IBND_DELTA_LINK_ADDED,
+	IBND_DELTA_LINK_REMOVED,
+	IBND_DELTA_LINK_CHANGED		/* width or speed */
+} ibnd_delta_type_t;
+
+typedef struct ibnd_delta {
+	struct ibnd_delta *next;
+	ibnd_delta_type_t type;
+	uint64_t guid;		/* node guid */
+	int portnum;		/* link deltas only */
+	uint64_t remote_guid;	/* link deltas only */
+	int remote_portnum;	/* link deltas only */
+} ibnd_delta_t;
+
+typedef void (*ibnd_iter_delta_func_t) (ibnd_delta_t * delta, void *user_data);
+void ibnd_iter_deltas(ibnd_fabric_t *fabric, ibnd_iter_delta_func_t func,
+		      void *user_data);
+
+/** =========================================================================
+ * SMP statistics of the discovery, for each number of directed route hops
+ */
+typedef struct ibnd_smp_stats {
+	unsigned hops;
+	unsigned smps;		/* responses received */
+	unsigned timeouts;
+	uint64_t min_usec;
+	uint64_t max_usec;
+	uint64_t total_usec;	/* of all responses */
+} ibnd_smp_stats_t;
+
+int ibnd_get_smp_stats(ibnd_fabric_t *fabric, ibnd_smp_stats_t *stats,
+		       int n);
+	/**
+	 * fill stats[i] for i < n with the SMPs sent i hops.
+	 * Returns the number of hop counts SMPs were sent to.
+	 */
+
 /** =========================================================================
  * Chassis queries
  */
@@ -43,6 +43,9 @@
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <assert.h>
+#include <endian.h>
+#include <sys/mman.h>
 
 #include <infiniband/ibnetdisc.h>
 
@@ -94,6 +97,24 @@
  * 1 byte - port num remotely connected to
  */
 
+/* Version 2 cache format
+ *
+ * Version 2 is laid out to be used directly from a read only mapping of the
+ * file, without reading or unmarshalling it record by record.  Records are of
+ * fixed size, naturally aligned and refer to each other by index instead of
+ * by GUID, so no lookups are needed to link them.
+ *
+ * struct ibnd_cache_header_v2 - its first 28 bytes are laid out as in v1
+ * struct ibnd_cache_node_v2 - node_count records at node_offset
+ * struct ibnd_cache_port_v2 - port_count records at port_offset
+ *
+ * A node owns the numports + 1 consecutive port records starting at its
+ * first_port, one per port number including port 0.  The records of ports
+ * which do not exist do not have IBND_CACHE_PORT_PRESENT set.  Record sizes
+ * are stored in the header so that fields can be appended to the records
+ * without breaking older readers.
+ */
+
 /* Structs that hold cache info temporarily before
  * the real structs can be reconstructed.
  */
@@ -134,6 +155,7 @@ typedef struct ibnd_fabric_cache {
 #define IBND_FABRIC_CACHE_BUFLEN  4096
 #define IBND_FABRIC_CACHE_MAGIC   0x8FE7832B
 #define IBND_FABRIC_CACHE_VERSION 0x00000001
+#define IBND_FABRIC_CACHE_VERSION_2 0x00000002
 
 #define IBND_FABRIC_CACHE_COUNT_OFFSET 8
 
@@ -142,6 +164,53 @@ typedef struct ibnd_fabric_cache {
 #define IBND_PORT_CACHE_KEY_LEN        (8 + 1)
 #define IBND_PORT_CACHE_LEN            (31 + IB_SMP_DATA_SIZE)
 
+struct ibnd_cache_header_v2 {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t node_count;
+	uint32_t port_count;
+	uint64_t from_node_guid;
+	uint32_t maxhops;
+	uint32_t from_node;	/* node index */
+	uint32_t node_size;	/* size of a node record */
+	uint32_t port_size;	/* size of a port record */
+	uint64_t node_offset;
+	uint64_t port_offset;
+};
+
+struct ibnd_cache_node_v2 {
+	uint64_t guid;
+	uint32_t first_port;	/* port index of port 0 */
+	uint16_t smalid;
+	uint8_t smalmc;
+	uint8_t smaenhsp0;
+	uint8_t type;
+	uint8_t numports;
+	uint8_t reserved[6];
+	uint8_t switchinfo[IB_SMP_DATA_SIZE];
+	uint8_t info[IB_SMP_DATA_SIZE];
+	uint8_t nodedesc[IB_SMP_DATA_SIZE];
+};
+
+#define IBND_CACHE_PORT_PRESENT 0x01
+#define IBND_CACHE_NO_PORT      0xFFFFFFFF
+
+struct ibnd_cache_port_v2 {
+	uint64_t guid;
+	uint32_t remoteport;	/* port index or IBND_CACHE_NO_PORT */
+	uint16_t base_lid;
+	uint8_t portnum;
+	uint8_t ext_portnum;
+	uint8_t lmc;
+	uint8_t flags;
+	uint8_t reserved[6];
+	uint8_t info[IB_SMP_DATA_SIZE];
+};
+
+static_assert(sizeof(struct ibnd_cache_header_v2) == 56, "bad v2 header");
+static_assert(sizeof(struct ibnd_cache_node_v2) == 216, "bad v2 node");
+static_assert(sizeof(struct ibnd_cache_port_v2) == 88, "bad v2 port");
+
 static ssize_t ibnd_read(int fd, void *buf, size_t count)
 {
 	size_t count_done = 0;
@@ -511,8 +580,7 @@ static int _fill_port(ibnd_fabric_cache_t * fabric_cache, ibnd_node_t * node,
 	/* achu: needed if user wishes to re-cache a loaded fabric.
 	 * Otherwise, mostly unnecessary to do this.
 	 */
-	int rc = add_to_portguid_hash(port_cache->port,
-				      fabric_cache->f_int->fabric.portstbl);
+	int rc = add_to_portguid_hash(port_cache->port, fabric_cache->f_int);
 	if (rc) {
 		IBND_DEBUG("Error Occurred when trying"
 			   " to insert new port guid 0x%016" PRIx64 " to DB\n",
@@ -541,9 +609,7 @@ static int _rebuild_nodes(ibnd_fabric_cache_t * fabric_cache)
 		fabric_cache->f_int->fabric.nodes = node;
 
 		int rc = add_to_nodeguid_hash(node_cache->node,
-					      fabric_cache->
-					      f_int->
-					      fabric.nodestbl);
+					      fabric_cache->f_int);
 		if (rc) {
 			IBND_DEBUG("Error Occurred when trying"
 				   " to insert new node guid 0x%016" PRIx64 " to DB\n",
@@ -617,6 +683,202 @@ static int _rebuild_ports(ibnd_fabric_cache_t * fabric_cache)
 	return 0;
 }
 
+static const void *_cache_record(const uint8_t *map, uint64_t offset,
+				 unsigned int size, unsigned int i)
+{
+	return map + offset + (uint64_t)size * i;
+}
+
+static int _load_port_v2(f_internal_t *f_int, ibnd_node_t *node, unsigned p,
+			 const struct ibnd_cache_port_v2 *rec,
+			 unsigned int index, unsigned int port_count)
+{
+	ibnd_port_t *port = &f_int->port_array[index];
+	uint32_t remoteport = le32toh(rec->remoteport);
+
+	if (port->node) {
+		IBND_DEBUG("Cache invalid: duplicate port discovered\n");
+		return -1;
+	}
+	if (rec->portnum != p) {
+		IBND_DEBUG("Cache invalid: bad port number\n");
+		return -1;
+	}
+
+	port->guid = le64toh(rec->guid);
+	port->portnum = rec->portnum;
+	port->ext_portnum = rec->ext_portnum;
+	port->base_lid = le16toh(rec->base_lid);
+	port->lmc = rec->lmc;
+	memcpy(port->info, rec->info, IB_SMP_DATA_SIZE);
+	port->node = node;
+
+	if (remoteport != IBND_CACHE_NO_PORT) {
+		if (remoteport >= port_count) {
+			IBND_DEBUG("Cache invalid: cannot find remote port\n");
+			return -1;
+		}
+		port->remoteport = &f_int->port_array[remoteport];
+	}
+
+	node->ports[p] = port;
+	return 0;
+}
+
+static ibnd_fabric_t *_load_fabric_v2(const uint8_t *map, size_t len)
+{
+	const struct ibnd_cache_header_v2 *hdr = (const void *)map;
+	unsigned int node_count, port_count, node_size, port_size;
+	uint64_t node_offset, port_offset;
+	f_internal_t *f_int;
+	unsigned int i, p;
+
+	if (len < sizeof(*hdr)) {
+		IBND_DEBUG("Cache invalid: short header\n");
+		return NULL;
+	}
+
+	node_count = le32toh(hdr->node_count);
+	port_count = le32toh(hdr->port_count);
+	node_size = le32toh(hdr->node_size);
+	port_size = le32toh(hdr->port_size);
+	node_offset = le64toh(hdr->node_offset);
+	port_offset = le64toh(hdr->port_offset);
+
+	if (node_size < sizeof(struct ibnd_cache_node_v2) ||
+	    port_size < sizeof(struct ibnd_cache_port_v2) ||
+	    (node_size | port_size | node_offset | port_offset) % 8 ||
+	    node_offset > len || port_offset > len ||
+	    (len - node_offset) / node_size < node_count ||
+	    (len - port_offset) / port_size < port_count ||
+	    le32toh(hdr->from_node) >= node_count) {
+		IBND_DEBUG("Cache invalid: bad record layout\n");
+		return NULL;
+	}
+
+	f_int = allocate_fabric_internal();
+	if (!f_int) {
+		IBND_DEBUG("OOM: fabric\n");
+		return NULL;
+	}
+	f_int->fabric.maxhops_discovered = le32toh(hdr->maxhops);
+
+	f_int->node_array = calloc(node_count, sizeof(*f_int->node_array));
+	if (!f_int->node_array) {
+		IBND_DEBUG("OOM: nodes\n");
+		free(f_int);
+		return NULL;
+	}
+	if (port_count) {
+		f_int->port_array = calloc(port_count,
+					   sizeof(*f_int->port_array));
+		f_int->port_ptr_array = calloc(port_count,
+					       sizeof(*f_int->port_ptr_array));
+		if (!f_int->port_array || !f_int->port_ptr_array) {
+			IBND_DEBUG("OOM: ports\n");
+			goto cleanup;
+		}
+	}
+
+	/* walk backwards to get the nodes listed in the order they were
+	 * cached in */
+	for (i = node_count; i-- > 0;) {
+		const struct ibnd_cache_node_v2 *rec =
+			_cache_record(map, node_offset, node_size, i);
+		ibnd_node_t *node = &f_int->node_array[i];
+		unsigned int first_port = le32toh(rec->first_port);
+
+		node->guid = le64toh(rec->guid);
+		node->smalid = le16toh(rec->smalid);
+		node->smalmc = rec->smalmc;
+		node->smaenhsp0 = rec->smaenhsp0;
+		node->type = rec->type;
+		node->numports = rec->numports;
+		memcpy(node->switchinfo, rec->switchinfo, IB_SMP_DATA_SIZE);
+		memcpy(node->info, rec->info, IB_SMP_DATA_SIZE);
+		memcpy(node->nodedesc, rec->nodedesc, IB_SMP_DATA_SIZE);
+
+		if (first_port > port_count ||
+		    port_count - first_port < node->numports + 1u) {
+			IBND_DEBUG("Cache invalid: cannot find port\n");
+			goto cleanup;
+		}
+		node->ports = &f_int->port_ptr_array[first_port];
+
+		for (p = 0; p <= node->numports; p++) {
+			const struct ibnd_cache_port_v2 *port_rec =
+				_cache_record(map, port_offset, port_size,
+					      first_port + p);
+
+			if (!(port_rec->flags & IBND_CACHE_PORT_PRESENT))
+				continue;
+			if (_load_port_v2(f_int, node, p, port_rec,
+					  first_port + p, port_count))
+				goto cleanup;
+		}
+
+		node->next = f_int->fabric.nodes;
+		f_int->fabric.nodes = node;
+
+		if (add_to_nodeguid_hash(node, f_int))
+			IBND_DEBUG("Error Occurred when trying"
+				   " to insert new node guid 0x%016" PRIx64 " to DB\n",
+				   node->guid);
+		add_to_type_list(node, f_int);
+	}
+
+	for (i = 0; i < port_count; i++) {
+		ibnd_port_t *port = &f_int->port_array[i];
+
+		if (!port->node)
+			continue;
+		if (port->remoteport && !port->remoteport->node) {
+			IBND_DEBUG("Cache invalid: cannot find remote port\n");
+			goto cleanup;
+		}
+		if (add_to_portguid_hash(port, f_int))
+			IBND_DEBUG("Error Occurred when trying"
+				   " to insert new port guid 0x%016" PRIx64 " to DB\n",
+				   port->guid);
+		add_to_portlid_hash(port, f_int);
+	}
+
+	f_int->fabric.from_node = &f_int->node_array[le32toh(hdr->from_node)];
+
+	if (group_nodes(&f_int->fabric))
+		goto cleanup;
+
+	return &f_int->fabric;
+
+cleanup:
+	ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
+
+static ibnd_fabric_t *_map_fabric_v2(int fd)
+{
+	ibnd_fabric_t *fabric;
+	struct stat statbuf;
+	void *map;
+
+	if (fstat(fd, &statbuf) < 0) {
+		IBND_DEBUG("fstat: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		IBND_DEBUG("mmap: %s\n", strerror(errno));
+		return NULL;
+	}
+	madvise(map, statbuf.st_size, MADV_SEQUENTIAL);
+
+	fabric = _load_fabric_v2(map, statbuf.st_size);
+
+	munmap(map, statbuf.st_size);
+	return fabric;
+}
+
 ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
 {
 	unsigned int node_count = 0;
@@ -624,6 +886,7 @@ ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
 	ibnd_fabric_cache_t *fabric_cache = NULL;
 	f_internal_t *f_int = NULL;
 	ibnd_node_cache_t *node_cache = NULL;
+	uint32_t magic_version[2];
 	int fd = -1;
 	unsigned int i;
 
@@ -637,6 +900,16 @@ ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
 		return NULL;
 	}
 
+	if (pread(fd, magic_version, sizeof(magic_version), 0) ==
+		    sizeof(magic_version) &&
+	    le32toh(magic_version[0]) == IBND_FABRIC_CACHE_MAGIC &&
+	    le32toh(magic_version[1]) == IBND_FABRIC_CACHE_VERSION_2) {
+		ibnd_fabric_t *fabric = _map_fabric_v2(fd);
+
+		close(fd);
+		return fabric;
+	}
+
 	fabric_cache =
 	    (ibnd_fabric_cache_t *) malloc(sizeof(ibnd_fabric_cache_t));
 	if (!fabric_cache) {
@@ -875,6 +1148,124 @@ static int _cache_port(int fd, ibnd_port_t * port)
 	return 0;
 }
 
+static int _cache_fabric_v2(int fd, ibnd_fabric_t * fabric)
+{
+	struct ibnd_cache_header_v2 *hdr;
+	struct ibnd_cache_node_v2 *node_rec;
+	struct ibnd_cache_port_v2 *port_rec, *port_base;
+	unsigned int node_count = 0, port_count = 0;
+	uint32_t *first_port = NULL, *from_node;
+	guid_index_t node_index = {};
+	ibnd_node_t *node;
+	uint8_t *buf = NULL;
+	size_t len;
+	int rc = -1;
+	int p;
+
+	for (node = fabric->nodes; node; node = node->next) {
+		node_count++;
+		port_count += node->numports + 1;
+	}
+
+	/* nodes are indexed by their address so that remote ports can be
+	 * found even if GUIDs are not unique */
+	first_port = calloc(node_count, sizeof(*first_port));
+	if (node_count && !first_port) {
+		IBND_DEBUG("OOM: first_port\n");
+		goto out;
+	}
+	node_count = port_count = 0;
+	for (node = fabric->nodes; node; node = node->next) {
+		first_port[node_count] = port_count;
+		if (guid_index_insert(&node_index, (uintptr_t)node,
+				      &first_port[node_count]))
+			goto out;
+		node_count++;
+		port_count += node->numports + 1;
+	}
+
+	from_node = guid_index_find(&node_index, (uintptr_t)fabric->from_node);
+	if (!from_node) {
+		IBND_DEBUG("from node not in fabric\n");
+		goto out;
+	}
+
+	len = sizeof(*hdr) + node_count * sizeof(*node_rec) +
+	      port_count * sizeof(*port_rec);
+	buf = calloc(1, len);
+	if (!buf) {
+		IBND_DEBUG("OOM: cache buffer\n");
+		goto out;
+	}
+
+	hdr = (struct ibnd_cache_header_v2 *)buf;
+	hdr->magic = htole32(IBND_FABRIC_CACHE_MAGIC);
+	hdr->version = htole32(IBND_FABRIC_CACHE_VERSION_2);
+	hdr->node_count = htole32(node_count);
+	hdr->port_count = htole32(port_count);
+	hdr->from_node_guid = htole64(fabric->from_node->guid);
+	hdr->maxhops = htole32(fabric->maxhops_discovered);
+	hdr->from_node = htole32(from_node - first_port);
+	hdr->node_size = htole32(sizeof(*node_rec));
+	hdr->port_size = htole32(sizeof(*port_rec));
+	hdr->node_offset = htole64(sizeof(*hdr));
+	hdr->port_offset = htole64(sizeof(*hdr) +
+				   node_count * sizeof(*node_rec));
+
+	node_rec = (struct ibnd_cache_node_v2 *)(hdr + 1);
+	port_base = port_rec =
+		(struct ibnd_cache_port_v2 *)(node_rec + node_count);
+
+	for (node = fabric->nodes; node; node = node->next, node_rec++) {
+		node_rec->guid = htole64(node->guid);
+		node_rec->first_port = htole32(port_rec - port_base);
+		node_rec->smalid = htole16(node->smalid);
+		node_rec->smalmc = node->smalmc;
+		node_rec->smaenhsp0 = node->smaenhsp0;
+		node_rec->type = node->type;
+		node_rec->numports = node->numports;
+		memcpy(node_rec->switchinfo, node->switchinfo, IB_SMP_DATA_SIZE);
+		memcpy(node_rec->info, node->info, IB_SMP_DATA_SIZE);
+		memcpy(node_rec->nodedesc, node->nodedesc, IB_SMP_DATA_SIZE);
+
+		for (p = 0; p <= node->numports; p++, port_rec++) {
+			ibnd_port_t *port = node->ports[p];
+			ibnd_port_t *remote;
+			uint32_t *remote_first;
+
+			port_rec->portnum = p;
+			port_rec->remoteport = htole32(IBND_CACHE_NO_PORT);
+			if (!port)
+				continue;
+
+			port_rec->flags = IBND_CACHE_PORT_PRESENT;
+			port_rec->guid = htole64(port->guid);
+			port_rec->ext_portnum = port->ext_portnum;
+			port_rec->base_lid = htole16(port->base_lid);
+			port_rec->lmc = port->lmc;
+			memcpy(port_rec->info, port->info, IB_SMP_DATA_SIZE);
+
+			remote = port->remoteport;
+			if (!remote)
+				continue;
+			remote_first = guid_index_find(&node_index,
+						       (uintptr_t)remote->node);
+			if (remote_first && remote->portnum >= 0 &&
+			    remote->portnum <= remote->node->numports)
+				port_rec->remoteport =
+					htole32(*remote_first + remote->portnum);
+		}
+	}
+
+	rc = ibnd_write(fd, buf, len) < 0 ? -1 : 0;
+
+out:
+	guid_index_destroy(&node_index);
+	free(first_port);
+	free(buf);
+	return rc;
+}
+
 int ibnd_cache_fabric(ibnd_fabric_t * fabric, const char *file,
 		      unsigned int flags)
 {
@@ -919,6 +1310,12 @@ int ibnd_cache_fabric(ibnd_fabric_t * fabric, const char *file,
 		return -1;
 	}
 
+	if (flags & IBND_CACHE_FABRIC_FLAG_VERSION2) {
+		if (_cache_fabric_v2(fd, fabric) < 0)
+			goto cleanup;
+		goto done;
+	}
+
 	if (_cache_header_info(fd, fabric) < 0)
 		goto cleanup;
 
@@ -949,6 +1346,7 @@ int ibnd_cache_fabric(ibnd_fabric_t * fabric, const char *file,
 	if (_cache_header_counts(fd, node_count, port_count) < 0)
 		goto cleanup;
 
+done:
 	if (close(fd) < 0) {
 		IBND_DEBUG("close: %s\n", strerror(errno));
 		goto cleanup;
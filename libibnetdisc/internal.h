@@ -40,6 +40,7 @@
 
 #include <infiniband/ibnetdisc.h>
 #include <util/cl_qmap.h>
+#include <poll.h>
 
 #define	IBND_DEBUG(fmt, ...) \
 	if (ibdebug) { \
@@ -54,16 +55,47 @@
 #define MAXHOPS         63
 
 #define DEFAULT_MAX_SMP_ON_WIRE 2
+#define DEFAULT_MAX_SMPS_LIMIT 64
 #define DEFAULT_TIMEOUT 1000
 #define DEFAULT_RETRIES 3
 
+/* Open addressing, linear probing GUID index which doubles when half full */
+typedef struct guid_index_entry {
+	uint64_t guid;
+	void *item;		/* NULL for an empty slot */
+} guid_index_entry_t;
+
+typedef struct guid_index {
+	guid_index_entry_t *tbl;
+	unsigned size;		/* power of 2, 0 before the first insert */
+	unsigned count;
+} guid_index_t;
+
+void *guid_index_find(guid_index_t *index, uint64_t guid);
+int guid_index_insert(guid_index_t *index, uint64_t guid, void *item);
+void guid_index_destroy(guid_index_t *index);
+
+/*
+ * The public nodestbl/portstbl chains are still kept up to date for
+ * iteration, but lookups go through the indexes below.
+ */
 typedef struct f_internal {
 	ibnd_fabric_t fabric;
-	cl_qmap_t lid2guid;
+	guid_index_t node_index;
+	guid_index_t port_index;
+	guid_index_t port_set;	/* ports in portstbl, keyed by address */
+	ibnd_port_t **lid2port;	/* indexed by LID */
+	unsigned lid2port_size;
+	ibnd_delta_t *deltas;	/* set by ibnd_refresh_fabric */
+	ibnd_smp_stats_t smp_stats[MAXHOPS + 1];
+	/* ibnd_load_fabric of a version 2 cache allocates all nodes and ports
+	 * in these arrays instead of one by one */
+	ibnd_node_t *node_array;
+	ibnd_port_t *port_array;
+	ibnd_port_t **port_ptr_array;
 } f_internal_t;
 f_internal_t *allocate_fabric_internal(void);
-void create_lid2guid(f_internal_t *f_int);
-void destroy_lid2guid(f_internal_t *f_int);
+void destroy_fabric_indexes(f_internal_t *f_int);
 void add_to_portlid_hash(ibnd_port_t * port, f_internal_t *f_int);
 
 typedef struct ibnd_scan {
@@ -71,31 +103,63 @@ typedef struct ibnd_scan {
 	f_internal_t *f_int;
 	struct ibnd_config *cfg;
 	unsigned initial_hops;
+	unsigned verified;	/* ibnd_refresh_fabric: nodes found as before */
 } ibnd_scan_t;
 
 typedef struct ibnd_smp ibnd_smp_t;
 typedef struct smp_engine smp_engine_t;
 typedef int (*smp_comp_cb_t) (smp_engine_t * engine, ibnd_smp_t * smp,
 			      uint8_t * mad_resp, void *cb_data);
+
+/* A local port SMPs are sent from */
+typedef struct smp_channel {
+	int umad_fd;
+	int smi_agent;
+	int smi_dir_agent;
+	int portnum;
+	/* DR path from the first channel to the switch this port is attached
+	 * to, cnt is 0 until it is known */
+	ib_dr_path_t prefix;
+	unsigned on_wire;
+	unsigned window;	/* SMPs allowed on the wire */
+	unsigned acks;		/* responses since the window last grew */
+} smp_channel_t;
+
 struct ibnd_smp {
 	cl_map_item_t on_wire;
 	struct ibnd_smp *qnext;
 	smp_comp_cb_t cb;
 	void *cb_data;
-	ib_portid_t path;
+	ib_portid_t path;	/* from the first channel */
 	ib_rpc_t rpc;
+	smp_channel_t *channel;
+	int hops;		/* DR hops as sent, -1 if LID routed */
+	uint64_t sent_usec;
 };
 
+/* Response times of the SMPs sent a number of hops */
+typedef struct smp_rtt {
+	double srtt;		/* smoothed */
+	double rttvar;
+} smp_rtt_t;
+
 struct smp_engine {
-	int umad_fd;
-	int smi_agent;
-	int smi_dir_agent;
+	smp_channel_t *channels;	/* the port given first */
+	unsigned num_channels;
 	ibnd_smp_t *smp_queue_head;
 	ibnd_smp_t *smp_queue_tail;
 	void *user_data;
 	cl_qmap_t smps_on_wire;
 	struct ibnd_config *cfg;
 	unsigned total_smps;
+	unsigned on_wire;	/* over all channels */
+	unsigned max_window;
+	struct pollfd *pollfds;	/* of the channels */
+	unsigned next_poll;
+	uint8_t *send_umad;
+	uint8_t *recv_umad;
+	ibnd_smp_stats_t stats[MAXHOPS + 1];
+	smp_rtt_t rtt[MAXHOPS + 1];
 };
 
 int smp_engine_init(smp_engine_t * engine, char * ca_name, int ca_port,
@@ -104,10 +168,12 @@ int issue_smp(smp_engine_t * engine, ib_portid_t * portid,
 	      unsigned attrid, unsigned mod, smp_comp_cb_t cb, void *cb_data);
 int process_mads(smp_engine_t * engine);
 void smp_engine_destroy(smp_engine_t * engine);
+void smp_engine_set_port_path(smp_engine_t * engine, int portnum,
+			      ib_dr_path_t * prefix);
 
-int add_to_nodeguid_hash(ibnd_node_t * node, ibnd_node_t * hash[]);
+int add_to_nodeguid_hash(ibnd_node_t * node, f_internal_t * f_int);
 
-int add_to_portguid_hash(ibnd_port_t * port, ibnd_port_t * hash[]);
+int add_to_portguid_hash(ibnd_port_t * port, f_internal_t * f_int);
 
 void add_to_type_list(ibnd_node_t * node, f_internal_t * fabric);
 
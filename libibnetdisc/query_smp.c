@@ -33,10 +33,16 @@
  */
 
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <infiniband/ibnetdisc.h>
 #include <infiniband/umad.h>
 #include "internal.h"
 
+/* IBND_CONFIG_ADAPTIVE_SMPS */
+#define ADAPTIVE_MIN_TIMEOUT	20	/* ms */
+#define ADAPTIVE_MIN_SAMPLES	16	/* responses before timeouts adapt */
+
 static void queue_smp(smp_engine_t * engine, ibnd_smp_t * smp)
 {
 	smp->qnext = NULL;
@@ -62,36 +68,141 @@ static ibnd_smp_t *get_smp(smp_engine_t * engine)
 	return rc;
 }
 
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int is_dr_path(ib_portid_t * portid)
+{
+	return !portid->lid &&
+	       (!portid->drpath.drslid || portid->drpath.drslid == 0xffff) &&
+	       (!portid->drpath.drdlid || portid->drpath.drdlid == 0xffff);
+}
+
+/*
+ * The path of smp when sent from channel ch.  A DR path through the switch
+ * ch is attached to is cut to start at ch instead.
+ */
+static int channel_path(smp_engine_t * engine, smp_channel_t * ch,
+			ibnd_smp_t * smp, ib_portid_t * path)
+{
+	ib_dr_path_t *prefix = &ch->prefix;
+	int i;
+
+	*path = smp->path;
+	if (ch == engine->channels || smp->rpc.mgtclass == IB_SMI_CLASS)
+		return 0;
+
+	if (!prefix->cnt || !is_dr_path(&smp->path) ||
+	    smp->path.drpath.cnt < prefix->cnt)
+		return -1;
+	for (i = 1; i <= prefix->cnt; i++)
+		if (smp->path.drpath.p[i] != prefix->p[i])
+			return -1;
+
+	path->drpath.cnt = smp->path.drpath.cnt - prefix->cnt + 1;
+	path->drpath.p[1] = ch->portnum;
+	for (i = 2; i <= path->drpath.cnt; i++)
+		path->drpath.p[i] = smp->path.drpath.p[prefix->cnt + i - 1];
+	return 0;
+}
+
+/* The channel with room for smp which has the shortest path to its target */
+static smp_channel_t *pick_channel(smp_engine_t * engine, ibnd_smp_t * smp,
+				   ib_portid_t * path)
+{
+	smp_channel_t *best = NULL;
+	ib_portid_t ch_path;
+	unsigned i;
+
+	/* Without adaptation max_smps bounds the SMPs of all ports together */
+	if (!(engine->cfg->flags & IBND_CONFIG_ADAPTIVE_SMPS) &&
+	    engine->on_wire >= engine->cfg->max_smps)
+		return NULL;
+
+	for (i = 0; i < engine->num_channels; i++) {
+		smp_channel_t *ch = &engine->channels[i];
+
+		if (ch->on_wire >= ch->window ||
+		    channel_path(engine, ch, smp, &ch_path))
+			continue;
+		if (best && (ch_path.drpath.cnt > path->drpath.cnt ||
+			     (ch_path.drpath.cnt == path->drpath.cnt &&
+			      ch->on_wire >= best->on_wire)))
+			continue;
+		best = ch;
+		*path = ch_path;
+	}
+	return best;
+}
+
+static unsigned smp_timeout(smp_engine_t * engine, int hops)
+{
+	unsigned timeout = engine->cfg->timeout_ms;
+	smp_rtt_t *rtt;
+	unsigned rto;
+
+	if (!(engine->cfg->flags & IBND_CONFIG_ADAPTIVE_SMPS) || hops < 0 ||
+	    engine->stats[hops].smps < ADAPTIVE_MIN_SAMPLES)
+		return timeout;
+
+	/* leave a wide margin, SMAs are slow to respond at times */
+	rtt = &engine->rtt[hops];
+	rto = 4 * (rtt->srtt + 4 * rtt->rttvar) / 1000 + 1;
+	if (rto < ADAPTIVE_MIN_TIMEOUT)
+		rto = ADAPTIVE_MIN_TIMEOUT;
+	return rto < timeout ? rto : timeout;
+}
+
+/* Returns 1 if no channel has room for smp */
 static int send_smp(ibnd_smp_t * smp, smp_engine_t * engine)
 {
 	int rc = 0;
-	uint8_t umad[1024];
+	uint8_t *umad = engine->send_umad;
 	ib_rpc_t *rpc = &smp->rpc;
+	smp_channel_t *ch;
+	ib_portid_t path;
 	int agent = 0;
 
+	ch = pick_channel(engine, smp, &path);
+	if (!ch)
+		return 1;
+
 	memset(umad, 0, umad_size() + IB_MAD_SIZE);
 
 	if (rpc->mgtclass == IB_SMI_CLASS) {
-		agent = engine->smi_agent;
+		agent = ch->smi_agent;
 	} else if (rpc->mgtclass == IB_SMI_DIRECT_CLASS) {
-		agent = engine->smi_dir_agent;
+		agent = ch->smi_dir_agent;
 	} else {
 		IBND_ERROR("Invalid class for RPC\n");
 		return (-EIO);
 	}
 
-	if ((rc = mad_build_pkt(umad, &smp->rpc, &smp->path, NULL, NULL))
+	if ((rc = mad_build_pkt(umad, &smp->rpc, &path, NULL, NULL))
 	    < 0) {
 		IBND_ERROR("mad_build_pkt failed; %d\n", rc);
 		return rc;
 	}
 
-	if ((rc = umad_send(engine->umad_fd, agent, umad, IB_MAD_SIZE,
-			    engine->cfg->timeout_ms, engine->cfg->retries)) < 0) {
+	smp->hops = rpc->mgtclass == IB_SMI_DIRECT_CLASS && is_dr_path(&path) ?
+		    path.drpath.cnt : -1;
+
+	if ((rc = umad_send(ch->umad_fd, agent, umad, IB_MAD_SIZE,
+			    smp_timeout(engine, smp->hops),
+			    engine->cfg->retries)) < 0) {
 		IBND_ERROR("send failed; %d\n", rc);
 		return rc;
 	}
 
+	smp->channel = ch;
+	smp->sent_usec = now_usec();
+	ch->on_wire++;
+	engine->on_wire++;
 	return 0;
 }
 
@@ -99,13 +210,13 @@ static int process_smp_queue(smp_engine_t * engine)
 {
 	int rc = 0;
 	ibnd_smp_t *smp;
-	while (cl_qmap_count(&engine->smps_on_wire)
-	       < engine->cfg->max_smps) {
-		smp = get_smp(engine);
-		if (!smp)
+	while ((smp = engine->smp_queue_head)) {
+		rc = send_smp(smp, engine);
+		if (rc > 0)
 			return 0;
 
-		if ((rc = send_smp(smp, engine)) != 0) {
+		get_smp(engine);
+		if (rc < 0) {
 			free(smp);
 			return rc;
 		}
@@ -150,6 +261,98 @@ int issue_smp(smp_engine_t * engine, ib_portid_t * portid,
 	return process_smp_queue(engine);
 }
 
+/*
+ * Account the response time of smp and, with IBND_CONFIG_ADAPTIVE_SMPS, adapt
+ * the window of its channel: halve it on a timeout and grow it by one SMP
+ * per window of responses as long as response times do not build up.
+ */
+static void smp_done(smp_engine_t * engine, ibnd_smp_t * smp, int timed_out)
+{
+	smp_channel_t *ch = smp->channel;
+	uint64_t usec = now_usec() - smp->sent_usec;
+	ibnd_smp_stats_t *stats = NULL;
+
+	ch->on_wire--;
+	engine->on_wire--;
+
+	if (smp->hops >= 0) {
+		stats = &engine->stats[smp->hops];
+		if (timed_out) {
+			stats->timeouts++;
+		} else {
+			smp_rtt_t *rtt = &engine->rtt[smp->hops];
+			double err = rtt->srtt - usec;
+
+			if (!stats->smps || usec < stats->min_usec)
+				stats->min_usec = usec;
+			if (usec > stats->max_usec)
+				stats->max_usec = usec;
+			stats->total_usec += usec;
+			if (!stats->smps++) {
+				rtt->srtt = usec;
+				rtt->rttvar = usec / 2.0;
+			} else {
+				rtt->rttvar = 0.75 * rtt->rttvar +
+					      0.25 * (err < 0 ? -err : err);
+				rtt->srtt = 0.875 * rtt->srtt + 0.125 * usec;
+			}
+		}
+	}
+
+	if (!(engine->cfg->flags & IBND_CONFIG_ADAPTIVE_SMPS))
+		return;
+
+	if (timed_out) {
+		ch->window = ch->window > 1 ? ch->window / 2 : 1;
+		ch->acks = 0;
+		return;
+	}
+
+	if (stats && usec > 2 * stats->min_usec)
+		return;
+	if (++ch->acks >= ch->window && ch->window < engine->max_window) {
+		ch->window++;
+		ch->acks = 0;
+	}
+}
+
+static int recv_umad(smp_engine_t * engine, int *length)
+{
+	unsigned i, n = engine->num_channels;
+	int rc;
+
+	if (n == 1)
+		return umad_recv(engine->channels[0].umad_fd, engine->recv_umad,
+				 length, -1);
+
+	for (;;) {
+		rc = poll(engine->pollfds, n, -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* take turns between the ports */
+		for (i = 0; i < n; i++) {
+			struct pollfd *pfd =
+				&engine->pollfds[(engine->next_poll + i) % n];
+
+			if (!(pfd->revents & POLLIN)) {
+				if (pfd->revents & (POLLERR | POLLHUP |
+						    POLLNVAL)) {
+					IBND_ERROR("poll error on port fd %d\n",
+						   pfd->fd);
+					return -EIO;
+				}
+				continue;
+			}
+			engine->next_poll = (engine->next_poll + i + 1) % n;
+			return umad_recv(pfd->fd, engine->recv_umad, length, 0);
+		}
+	}
+}
+
 static int process_one_recv(smp_engine_t * engine)
 {
 	int rc = 0;
@@ -157,14 +360,13 @@ static int process_one_recv(smp_engine_t * engine)
 	ibnd_smp_t *smp;
 	uint8_t *mad;
 	uint32_t trid;
-	uint8_t umad[sizeof(struct ib_user_mad) + IB_MAD_SIZE];
+	uint8_t *umad = engine->recv_umad;
 	int length = umad_size() + IB_MAD_SIZE;
 
-	memset(umad, 0, sizeof(umad));
+	memset(umad, 0, length);
 
 	/* wait for the next message */
-	if ((rc = umad_recv(engine->umad_fd, umad, &length,
-			    -1)) < 0) {
+	if ((rc = recv_umad(engine, &length)) < 0) {
 		IBND_ERROR("umad_recv failed: %d\n", rc);
 		return -1;
 	}
@@ -178,11 +380,14 @@ static int process_one_recv(smp_engine_t * engine)
 		return -1;
 	}
 
+	status = umad_status(umad);
+	smp_done(engine, smp, status == ETIMEDOUT);
+
 	rc = process_smp_queue(engine);
 	if (rc)
 		goto error;
 
-	if ((status = umad_status(umad))) {
+	if (status) {
 		IBND_ERROR("umad (%s Attr 0x%x:%u) bad status %d; %s\n",
 			   portid2str(&smp->path), smp->rpc.attr.id,
 			   smp->rpc.attr.mod, status, strerror(status));
@@ -204,50 +409,134 @@ error:
 	return rc;
 }
 
-int smp_engine_init(smp_engine_t * engine, char * ca_name, int ca_port,
-		    void *user_data, ibnd_config_t *cfg)
+static int open_channel(smp_engine_t * engine, const char * ca_name,
+			int ca_port, int portnum)
 {
-	memset(engine, 0, sizeof(*engine));
-
-	if (umad_init() < 0) {
-		IBND_ERROR("umad_init failed\n");
-		return -EIO;
-	}
+	smp_channel_t *ch = &engine->channels[engine->num_channels];
 
-	engine->umad_fd = umad_open_port(ca_name, ca_port);
-	if (engine->umad_fd < 0) {
+	ch->umad_fd = umad_open_port(ca_name, ca_port);
+	if (ch->umad_fd < 0) {
 		IBND_ERROR("can't open UMAD port (%s:%d)\n", ca_name, ca_port);
 		return -EIO;
 	}
 
-	if ((engine->smi_agent = umad_register(engine->umad_fd,
+	if ((ch->smi_agent = umad_register(ch->umad_fd,
 	     IB_SMI_CLASS, 1, 0, NULL)) < 0) {
 		IBND_ERROR("Failed to register SMI agent on (%s:%d)\n",
 			   ca_name, ca_port);
 		goto eio_close;
 	}
 
-	if ((engine->smi_dir_agent = umad_register(engine->umad_fd,
+	if ((ch->smi_dir_agent = umad_register(ch->umad_fd,
 	     IB_SMI_DIRECT_CLASS, 1, 0, NULL)) < 0) {
 		IBND_ERROR("Failed to register SMI_DIRECT agent on (%s:%d)\n",
 			   ca_name, ca_port);
 		goto eio_close;
 	}
 
+	ch->portnum = portnum;
+	ch->window = engine->cfg->max_smps;
+	engine->pollfds[engine->num_channels].fd = ch->umad_fd;
+	engine->pollfds[engine->num_channels].events = POLLIN;
+	engine->num_channels++;
+	return 0;
+
+eio_close:
+	umad_close_port(ch->umad_fd);
+	return (-EIO);
+}
+
+/* Open the other ports of cfg->ca_ports */
+static int open_ca_ports(smp_engine_t * engine, char * ca_name, int ca_port)
+{
+	umad_port_t port;
+	int p, rc = 0;
+
+	if (umad_get_port(ca_name, ca_port, &port) < 0) {
+		IBND_ERROR("can't resolve UMAD port (%s:%d)\n", ca_name,
+			   ca_port);
+		return -EIO;
+	}
+	engine->channels[0].portnum = port.portnum;
+
+	for (p = 1; p < 32 && !rc; p++)
+		if (engine->cfg->ca_ports & (1U << p) && p != port.portnum)
+			rc = open_channel(engine, port.ca_name, p, p);
+
+	umad_release_port(&port);
+	return rc;
+}
+
+int smp_engine_init(smp_engine_t * engine, char * ca_name, int ca_port,
+		    void *user_data, ibnd_config_t *cfg)
+{
+	unsigned max_channels = 1 + __builtin_popcount(cfg->ca_ports);
+	int size = umad_size() + IB_MAD_SIZE;
+
+	memset(engine, 0, sizeof(*engine));
+
+	if (umad_init() < 0) {
+		IBND_ERROR("umad_init failed\n");
+		return -EIO;
+	}
+
+	engine->cfg = cfg;
+	engine->max_window = cfg->max_smps_limit ? cfg->max_smps_limit :
+			     DEFAULT_MAX_SMPS_LIMIT;
+	if (engine->max_window < cfg->max_smps)
+		engine->max_window = cfg->max_smps;
+
+	engine->channels = calloc(max_channels, sizeof(*engine->channels));
+	engine->pollfds = calloc(max_channels, sizeof(*engine->pollfds));
+	engine->send_umad = malloc(size);
+	engine->recv_umad = malloc(size);
+	if (!engine->channels || !engine->pollfds || !engine->send_umad ||
+	    !engine->recv_umad) {
+		IBND_ERROR("OOM\n");
+		goto error;
+	}
+
+	if (open_channel(engine, ca_name, ca_port, ca_port))
+		goto error;
+	if (cfg->ca_ports && open_ca_ports(engine, ca_name, ca_port))
+		goto error;
+
 	engine->user_data = user_data;
 	cl_qmap_init(&engine->smps_on_wire);
-	engine->cfg = cfg;
 	return (0);
 
-eio_close:
-	umad_close_port(engine->umad_fd);
+error:
+	while (engine->num_channels)
+		umad_close_port(engine->channels[--engine->num_channels].umad_fd);
+	free(engine->channels);
+	free(engine->pollfds);
+	free(engine->send_umad);
+	free(engine->recv_umad);
 	return (-EIO);
 }
 
+void smp_engine_set_port_path(smp_engine_t * engine, int portnum,
+			      ib_dr_path_t * prefix)
+{
+	char str[IB_SUBNET_PATH_HOPS_MAX * 4];
+	unsigned i;
+
+	for (i = 1; i < engine->num_channels; i++) {
+		smp_channel_t *ch = &engine->channels[i];
+
+		if (ch->portnum != portnum || ch->prefix.cnt || prefix->cnt < 1)
+			continue;
+		ch->prefix = *prefix;
+		IBND_DEBUG("SMPs through DR path %s go out of port %d\n",
+			   drpath2str(prefix, str, sizeof(str)), portnum);
+	}
+}
+
 void smp_engine_destroy(smp_engine_t * engine)
 {
 	cl_map_item_t *item;
 	ibnd_smp_t *smp;
+	unsigned i;
 
 	/* remove queued smps */
 	smp = get_smp(engine);
@@ -266,7 +555,12 @@ void smp_engine_destroy(smp_engine_t * engine)
 		free(item);
 	}
 
-	umad_close_port(engine->umad_fd);
+	for (i = 0; i < engine->num_channels; i++)
+		umad_close_port(engine->channels[i].umad_fd);
+	free(engine->channels);
+	free(engine->pollfds);
+	free(engine->send_umad);
+	free(engine->recv_umad);
 }
 
 int process_mads(smp_engine_t * engine)
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Build a synthetic two level fat tree as a version 1 ibnetdiscover cache
+ * file, load it, cache and load it again in the current format and time the
+ * GUID and LID lookups of libibnetdisc on it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <infiniband/ibnetdisc.h>
+
+#define CACHE_MAGIC	0x8FE7832B
+#define CACHE_VERSION	0x00000001
+
+#define CA_GUID(i)	(0x0002c90300000000ULL + 2 * (i))
+#define LEAF_GUID(i)	(0x0002c90400000000ULL + (i))
+#define SPINE_GUID(i)	(0x0002c90500000000ULL + (i))
+
+static const char *argv0 = "benchlookup";
+
+static unsigned num_cas = 20000;
+static unsigned radix = 36;
+static unsigned num_leaves, num_spines;
+
+static void put(FILE *f, uint64_t val, int bytes)
+{
+	while (bytes--) {
+		fputc(val & 0xff, f);
+		val >>= 8;
+	}
+}
+
+static void put_zero(FILE *f, int bytes)
+{
+	while (bytes--)
+		fputc(0, f);
+}
+
+static void put_node(FILE *f, uint64_t guid, int type, int numports,
+		     uint16_t lid, const char *desc)
+{
+	char nodedesc[IB_SMP_DATA_SIZE] = {};
+	int first = type == IB_NODE_SWITCH ? 0 : 1;
+	int p;
+
+	put(f, type == IB_NODE_SWITCH ? lid : 0, 2);	/* smalid */
+	put(f, 0, 1);					/* smalmc */
+	put(f, 0, 1);					/* smaenhsp0 */
+	put_zero(f, IB_SMP_DATA_SIZE);			/* switchinfo */
+	put(f, guid, 8);
+	put(f, type, 1);
+	put(f, numports, 1);
+	put_zero(f, IB_SMP_DATA_SIZE);			/* nodeinfo */
+	strncpy(nodedesc, desc, sizeof(nodedesc) - 1);
+	fwrite(nodedesc, sizeof(nodedesc), 1, f);
+	put(f, numports - first + 1, 1);
+	for (p = first; p <= numports; p++) {
+		put(f, type == IB_NODE_SWITCH ? guid : guid + 1, 8);
+		put(f, p, 1);
+	}
+}
+
+static void put_port(FILE *f, uint64_t node_guid, uint64_t port_guid,
+		     int portnum, uint16_t lid, uint64_t rem_guid, int rem_port)
+{
+	put(f, port_guid, 8);
+	put(f, portnum, 1);
+	put(f, 0, 1);					/* ext_portnum */
+	put(f, lid, 2);
+	put(f, 0, 1);					/* lmc */
+	put_zero(f, IB_SMP_DATA_SIZE);			/* portinfo */
+	put(f, node_guid, 8);
+	put(f, rem_guid ? 1 : 0, 1);
+	put(f, rem_guid, 8);
+	put(f, rem_port, 1);
+}
+
+static uint16_t ca_lid(unsigned i)
+{
+	return 1 + i;
+}
+
+static uint16_t leaf_lid(unsigned i)
+{
+	return 1 + num_cas + i;
+}
+
+static uint16_t spine_lid(unsigned i)
+{
+	return 1 + num_cas + num_leaves + i;
+}
+
+/*
+ * Leaf l serves CAs on ports 1..radix/2; uplink u goes to spine
+ * (l / radix) * radix/2 + u, on spine port l % radix + 1.
+ */
+static int write_fabric(const char *file, unsigned *nnodes, unsigned *nports)
+{
+	unsigned half = radix / 2, i, p;
+	FILE *f = fopen(file, "w");
+	char desc[64];
+
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+
+	*nnodes = num_cas + num_leaves + num_spines;
+	*nports = num_cas + (num_leaves + num_spines) * (radix + 1);
+
+	put(f, CACHE_MAGIC, 4);
+	put(f, CACHE_VERSION, 4);
+	put(f, *nnodes, 4);
+	put(f, *nports, 4);
+	put(f, CA_GUID(0), 8);				/* from node */
+	put(f, 4, 4);					/* maxhops */
+
+	for (i = 0; i < num_cas; i++) {
+		snprintf(desc, sizeof(desc), "node%05u HCA-1", i);
+		put_node(f, CA_GUID(i), IB_NODE_CA, 1, ca_lid(i), desc);
+	}
+	for (i = 0; i < num_leaves; i++) {
+		snprintf(desc, sizeof(desc), "leaf%04u", i);
+		put_node(f, LEAF_GUID(i), IB_NODE_SWITCH, radix, leaf_lid(i),
+			 desc);
+	}
+	for (i = 0; i < num_spines; i++) {
+		snprintf(desc, sizeof(desc), "spine%04u", i);
+		put_node(f, SPINE_GUID(i), IB_NODE_SWITCH, radix, spine_lid(i),
+			 desc);
+	}
+
+	for (i = 0; i < num_cas; i++)
+		put_port(f, CA_GUID(i), CA_GUID(i) + 1, 1, ca_lid(i),
+			 LEAF_GUID(i / half), i % half + 1);
+
+	for (i = 0; i < num_leaves; i++) {
+		put_port(f, LEAF_GUID(i), LEAF_GUID(i), 0, leaf_lid(i), 0, 0);
+		for (p = 1; p <= radix; p++) {
+			unsigned ca = i * half + p - 1;
+			unsigned spine = (i / radix) * half + p - half - 1;
+
+			if (p <= half)
+				put_port(f, LEAF_GUID(i), LEAF_GUID(i), p,
+					 leaf_lid(i),
+					 ca < num_cas ? CA_GUID(ca) + 1 : 0, 1);
+			else
+				put_port(f, LEAF_GUID(i), LEAF_GUID(i), p,
+					 leaf_lid(i), SPINE_GUID(spine),
+					 i % radix + 1);
+		}
+	}
+
+	for (i = 0; i < num_spines; i++) {
+		put_port(f, SPINE_GUID(i), SPINE_GUID(i), 0, spine_lid(i), 0, 0);
+		for (p = 1; p <= radix; p++) {
+			unsigned leaf = (i / half) * radix + p - 1;
+
+			put_port(f, SPINE_GUID(i), SPINE_GUID(i), p,
+				 spine_lid(i),
+				 leaf < num_leaves ? LEAF_GUID(leaf) : 0,
+				 i % half + half + 1);
+		}
+	}
+
+	if (fclose(f)) {
+		perror(file);
+		return -1;
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t rnd(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-c <cas>] [-r <radix>] [-i <lookups>] [-k] [<cache file>]\n"
+		"   Time libibnetdisc lookups on a synthetic fat tree\n"
+		"   -c <cas> number of CAs (default 20000)\n"
+		"   -r <radix> switch radix (default 36)\n"
+		"   -i <lookups> lookups per kind (default 1000000)\n"
+		"   -k keep the generated cache file\n", argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	char tmpl[] = "/tmp/benchlookupXXXXXX";
+	const char *file = NULL;
+	unsigned long lookups = 1000000, n, misses = 0;
+	unsigned nnodes, nports;
+	uint32_t state = 2463534242U;
+	ibnd_fabric_t *fabric;
+	double t;
+	int keep = 0, ch, fd;
+
+	argv0 = argv[0];
+
+	while ((ch = getopt(argc, argv, "c:r:i:kh")) != -1) {
+		switch (ch) {
+		case 'c':
+			num_cas = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			radix = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			lookups = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		file = argv[optind];
+
+	if (radix < 4 || radix > 254 || radix % 2 || !num_cas || !lookups)
+		usage();
+
+	num_leaves = (num_cas + radix / 2 - 1) / (radix / 2);
+	num_spines = (num_leaves + radix - 1) / radix * (radix / 2);
+	if (1 + num_cas + num_leaves + num_spines > 0xbfff) {
+		fprintf(stderr, "too many nodes for the unicast LID space\n");
+		exit(1);
+	}
+
+	if (!file) {
+		fd = mkstemp(tmpl);
+		if (fd < 0) {
+			perror("mkstemp");
+			exit(1);
+		}
+		close(fd);
+		file = tmpl;
+	}
+	if (write_fabric(file, &nnodes, &nports))
+		exit(1);
+
+	t = now();
+	fabric = ibnd_load_fabric(file, 0);
+	t = now() - t;
+	if (!fabric) {
+		fprintf(stderr, "loading %s failed\n", file);
+		unlink(file);
+		exit(1);
+	}
+	printf("fabric: %u nodes, %u ports, loaded in %.3f s\n",
+	       nnodes, nports, t);
+
+	/* load it again from the mappable version 2 cache format */
+	if (ibnd_cache_fabric(fabric, file, IBND_CACHE_FABRIC_FLAG_VERSION2)) {
+		fprintf(stderr, "caching to %s failed\n", file);
+		exit(1);
+	}
+	ibnd_destroy_fabric(fabric);
+	t = now();
+	fabric = ibnd_load_fabric(file, 0);
+	t = now() - t;
+	if (!keep)
+		unlink(file);
+	if (!fabric) {
+		fprintf(stderr, "loading %s failed\n", file);
+		exit(1);
+	}
+	printf("reloaded from version 2 cache in %.3f s\n", t);
+
+	t = now();
+	for (n = 0; n < lookups; n++) {
+		unsigned i = rnd(&state) % nnodes;
+		uint64_t guid = i < num_cas ? CA_GUID(i) :
+				i < num_cas + num_leaves ? LEAF_GUID(i - num_cas) :
+				SPINE_GUID(i - num_cas - num_leaves);
+
+		misses += !ibnd_find_node_guid(fabric, guid);
+	}
+	printf("ibnd_find_node_guid: %8.1f ns/lookup\n",
+	       (now() - t) * 1e9 / lookups);
+
+	t = now();
+	for (n = 0; n < lookups; n++) {
+		unsigned i = rnd(&state) % nnodes;
+		uint64_t guid = i < num_cas ? CA_GUID(i) + 1 :
+				i < num_cas + num_leaves ? LEAF_GUID(i - num_cas) :
+				SPINE_GUID(i - num_cas - num_leaves);
+
+		misses += !ibnd_find_port_guid(fabric, guid);
+	}
+	printf("ibnd_find_port_guid: %8.1f ns/lookup\n",
+	       (now() - t) * 1e9 / lookups);
+
+	t = now();
+	for (n = 0; n < lookups; n++)
+		misses += !ibnd_find_port_lid(fabric, 1 + rnd(&state) % nnodes);
+	printf("ibnd_find_port_lid:  %8.1f ns/lookup\n",
+	       (now() - t) * 1e9 / lookups);
+
+	ibnd_destroy_fabric(fabric);
+
+	if (misses) {
+		fprintf(stderr, "%lu lookups failed\n", misses);
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Check the deltas reported by ibnd_refresh_fabric against the UMAD_SIM
+ * fabric, e.g.
+ *
+ *	UMAD_SIM=cas=8,radix=4 testrefresh /tmp
+ *
+ * The simulated fabric is discovered and cached.  Two copies are made from
+ * the cache: the previous fabric, which misses one CA, and the fabric to be
+ * simulated, which misses one switch to switch link and has another CA on a
+ * new LID.  The test then runs itself again on the second copy and checks
+ * that both refresh modes report the added CA and its link, the removed link
+ * and the changed CA, and nothing else.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <infiniband/mad.h>
+#include <util/iba_types.h>
+#include <infiniband/ibnetdisc.h>
+
+static const char *argv0 = "testrefresh";
+
+struct expect {
+	uint64_t added;		/* CA missing from the previous fabric */
+	uint64_t link_guid;	/* one end of the removed link */
+	int link_port;
+	uint64_t changed;	/* CA with a new LID */
+};
+
+struct check {
+	const struct expect *exp;
+	int node_added;
+	int link_added;
+	int link_removed;
+	int node_changed;
+	int other;
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: UMAD_SIM=<options> %s <dir>\n"
+		"   Check ibnd_refresh_fabric against changes made to the\n"
+		"   simulated fabric, caches are written to <dir>\n", argv0);
+	exit(-1);
+}
+
+static int is_end(uint64_t guid, int port, uint64_t want_guid, int want_port)
+{
+	return guid == want_guid && port == want_port;
+}
+
+static void check_delta(ibnd_delta_t *delta, void *user_data)
+{
+	struct check *c = user_data;
+	const struct expect *exp = c->exp;
+
+	printf("  delta %d: 0x%016" PRIx64 " %d -> 0x%016" PRIx64 " %d\n",
+	       delta->type, delta->guid, delta->portnum, delta->remote_guid,
+	       delta->remote_portnum);
+
+	switch (delta->type) {
+	case IBND_DELTA_NODE_ADDED:
+		if (delta->guid == exp->added) {
+			c->node_added++;
+			return;
+		}
+		break;
+	case IBND_DELTA_LINK_ADDED:
+		if (delta->guid == exp->added ||
+		    delta->remote_guid == exp->added) {
+			c->link_added++;
+			return;
+		}
+		break;
+	case IBND_DELTA_LINK_REMOVED:
+		if (is_end(delta->guid, delta->portnum, exp->link_guid,
+			   exp->link_port) ||
+		    is_end(delta->remote_guid, delta->remote_portnum,
+			   exp->link_guid, exp->link_port)) {
+			c->link_removed++;
+			return;
+		}
+		break;
+	case IBND_DELTA_NODE_CHANGED:
+		if (delta->guid == exp->changed) {
+			c->node_changed++;
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+	c->other++;
+}
+
+static int refresh(ibnd_fabric_t *prev, const struct expect *exp,
+		   unsigned int flags, unsigned *mads)
+{
+	struct ibnd_config config = { 0 };
+	struct check c = { .exp = exp };
+	ibnd_fabric_t *fabric;
+
+	fabric = ibnd_refresh_fabric(prev, NULL, 0, NULL, &config, flags);
+	if (!fabric) {
+		fprintf(stderr, "refresh 0x%x failed\n", flags);
+		return 1;
+	}
+
+	printf("refresh 0x%x: %u MADs\n", flags, fabric->total_mads_used);
+	*mads = fabric->total_mads_used;
+	ibnd_iter_deltas(fabric, check_delta, &c);
+	ibnd_destroy_fabric(fabric);
+
+	if (c.node_added != 1 || c.link_added != 1 || c.link_removed != 1 ||
+	    c.node_changed != 1 || c.other) {
+		fprintf(stderr,
+			"refresh 0x%x: added %d, link added %d, link removed %d, changed %d, unexpected %d\n",
+			flags, c.node_added, c.link_added, c.link_removed,
+			c.node_changed, c.other);
+		return 1;
+	}
+	return 0;
+}
+
+/* Run on the changed fabric, prev is the path of the previous fabric */
+static int check(const char *prev_file, const struct expect *exp)
+{
+	unsigned quick_mads, full_mads;
+	ibnd_fabric_t *prev;
+	int rc;
+
+	prev = ibnd_load_fabric(prev_file, 0);
+	if (!prev) {
+		fprintf(stderr, "failed to load %s\n", prev_file);
+		return 1;
+	}
+
+	rc = refresh(prev, exp, IBND_REFRESH_FABRIC_FLAG_QUICK, &quick_mads) ||
+	     refresh(prev, exp, IBND_REFRESH_FABRIC_FLAG_DEFAULT, &full_mads);
+	if (!rc && quick_mads >= full_mads) {
+		fprintf(stderr, "quick refresh used %u MADs, full %u\n",
+			quick_mads, full_mads);
+		rc = 1;
+	}
+
+	ibnd_destroy_fabric(prev);
+	return rc;
+}
+
+static ibnd_port_t *ca_port(ibnd_node_t *node)
+{
+	int p;
+
+	for (p = 1; p <= node->numports; p++)
+		if (node->ports[p] && node->ports[p]->remoteport)
+			return node->ports[p];
+	return NULL;
+}
+
+static void set_down(ibnd_port_t *port)
+{
+	mad_set_field(port->info, 0, IB_PORT_STATE_F, IB_LINK_DOWN);
+	mad_set_field(port->info, 0, IB_PORT_PHYS_STATE_F,
+		      IB_PORT_PHYS_STATE_POLLING);
+}
+
+static void unlink_port(ibnd_port_t *port)
+{
+	ibnd_port_t *rem = port->remoteport;
+
+	set_down(port);
+	port->remoteport = NULL;
+	if (rem->node->type == IB_NODE_SWITCH)
+		set_down(rem);
+	rem->remoteport = NULL;
+}
+
+/* The previous fabric: without the added CA */
+static int make_prev(const char *orig, const char *file, struct expect *exp)
+{
+	ibnd_fabric_t *fabric = ibnd_load_fabric(orig, 0);
+	ibnd_node_t *node, **pnode;
+	ibnd_port_t *port;
+	int rc;
+
+	if (!fabric)
+		return 1;
+
+	for (node = fabric->ch_adapters; node; node = node->type_next)
+		if (node != fabric->from_node && ca_port(node))
+			break;
+	if (!node) {
+		fprintf(stderr, "no CA to remove\n");
+		ibnd_destroy_fabric(fabric);
+		return 1;
+	}
+
+	exp->added = node->guid;
+	port = ca_port(node);
+	unlink_port(port->remoteport);
+	for (pnode = &fabric->nodes; *pnode != node; pnode = &(*pnode)->next)
+		;
+	*pnode = node->next;
+
+	rc = ibnd_cache_fabric(fabric, file, IBND_CACHE_FABRIC_FLAG_VERSION2);
+	*pnode = node;
+	ibnd_destroy_fabric(fabric);
+	return rc;
+}
+
+/* The simulated fabric: without a switch link and a CA on a new LID */
+static int make_sim(const char *orig, const char *file, struct expect *exp)
+{
+	ibnd_fabric_t *fabric = ibnd_load_fabric(orig, 0);
+	ibnd_node_t *node;
+	ibnd_port_t *port = NULL;
+	uint16_t max_lid = 0;
+	int p, rc;
+
+	if (!fabric)
+		return 1;
+
+	for (node = fabric->nodes; node; node = node->next)
+		for (p = 0; p <= node->numports; p++)
+			if (node->ports[p] && node->ports[p]->base_lid > max_lid)
+				max_lid = node->ports[p]->base_lid;
+
+	for (node = fabric->switches; node && !port; node = node->type_next)
+		for (p = 1; p <= node->numports && !port; p++)
+			if (node->ports[p] && node->ports[p]->remoteport &&
+			    node->ports[p]->remoteport->node->type ==
+			    IB_NODE_SWITCH)
+				port = node->ports[p];
+	for (node = fabric->ch_adapters; node; node = node->type_next)
+		if (node != fabric->from_node && node->guid != exp->added &&
+		    ca_port(node))
+			break;
+	if (!port || !node) {
+		fprintf(stderr, "fabric too small\n");
+		ibnd_destroy_fabric(fabric);
+		return 1;
+	}
+
+	exp->link_guid = port->node->guid;
+	exp->link_port = port->portnum;
+	unlink_port(port);
+
+	exp->changed = node->guid;
+	port = ca_port(node);
+	port->base_lid = max_lid + 1;
+	mad_set_field(port->info, 0, IB_PORT_LID_F, port->base_lid);
+
+	rc = ibnd_cache_fabric(fabric, file, IBND_CACHE_FABRIC_FLAG_VERSION2);
+	ibnd_destroy_fabric(fabric);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct ibnd_config config = { 0 };
+	char orig[4096], prev[4096], sim[4096], env[4200];
+	char added[32], link_guid[32], link_port[16], changed[32];
+	struct expect exp = { 0 };
+	ibnd_fabric_t *fabric;
+
+	argv0 = argv[0];
+
+	if (argc == 7 && !strcmp(argv[1], "--check")) {
+		exp.added = strtoull(argv[3], NULL, 0);
+		exp.link_guid = strtoull(argv[4], NULL, 0);
+		exp.link_port = strtol(argv[5], NULL, 0);
+		exp.changed = strtoull(argv[6], NULL, 0);
+		if (check(argv[2], &exp)) {
+			printf("FAIL\n");
+			return 1;
+		}
+		printf("PASS\n");
+		return 0;
+	}
+	if (argc != 2 || !getenv("UMAD_SIM"))
+		usage();
+
+	snprintf(orig, sizeof(orig), "%s/testrefresh.orig", argv[1]);
+	snprintf(prev, sizeof(prev), "%s/testrefresh.prev", argv[1]);
+	snprintf(sim, sizeof(sim), "%s/testrefresh.sim", argv[1]);
+
+	fabric = ibnd_discover_fabric(NULL, 0, NULL, &config);
+	if (!fabric) {
+		fprintf(stderr, "discover failed\n");
+		return 1;
+	}
+	if (ibnd_cache_fabric(fabric, orig, IBND_CACHE_FABRIC_FLAG_VERSION2)) {
+		fprintf(stderr, "failed to cache %s\n", orig);
+		ibnd_destroy_fabric(fabric);
+		return 1;
+	}
+	ibnd_destroy_fabric(fabric);
+
+	if (make_prev(orig, prev, &exp) || make_sim(orig, sim, &exp)) {
+		fprintf(stderr, "failed to build the test fabrics\n");
+		return 1;
+	}
+
+	/* The simulated fabric is set up once per process */
+	snprintf(env, sizeof(env), "cache=%s", sim);
+	setenv("UMAD_SIM", env, 1);
+	snprintf(added, sizeof(added), "0x%" PRIx64, exp.added);
+	snprintf(link_guid, sizeof(link_guid), "0x%" PRIx64, exp.link_guid);
+	snprintf(link_port, sizeof(link_port), "%d", exp.link_port);
+	snprintf(changed, sizeof(changed), "0x%" PRIx64, exp.changed);
+	execl("/proc/self/exe", argv0, "--check", prev, added, link_guid,
+	      link_port, changed, NULL);
+	perror("execl");
+	return 1;
+}
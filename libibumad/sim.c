@@ -0,0 +1,2710 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "sim.h"
+
+/*
+ * The simulator stands in for the umad character device and sysfs.  It
+ * exposes one CA, "sim0", attached to a fabric that is either generated
+ * (fat tree or dragonfly) or loaded from an ibnetdiscover version 2 cache
+ * file, and answers the SMPs, PMA MADs and SA queries written to its ports
+ * the way the kernel and the subnet would: responses are matched to the
+ * sending agent, sends that get no response complete with ETIMEDOUT after
+ * timeout_ms * (retries + 1), and SA tables are returned through RMPP,
+ * reassembled for agents with kernel RMPP and segment by segment for the
+ * others.  Every MAD is answered after the configured latency and each
+ * send attempt can be lost.
+ */
+
+#define SIM_CA_NAME		"sim0"
+#define SIM_SMP_DATA		64
+#define SIM_MAD_SIZE		256
+#define SIM_NO_PORT		UINT32_MAX
+#define SIM_NO_ROUTE		0xff
+#define SIM_MAX_HOPS		64
+#define SIM_MAX_LID		0xbfff
+#define SIM_GUID_BASE		0xe41d2d0300000000ULL
+#define SIM_GID_PREFIX		0xfe80000000000000ULL
+
+/* 4x QDR, in dwords per second */
+#define SIM_LINK_DWORDS		1250000000.0
+
+#define NODE_CA			1
+#define NODE_SWITCH		2
+
+#define MAD_CLASS_SMI		0x01
+#define MAD_CLASS_SA		0x03
+#define MAD_CLASS_PERF		0x04
+#define MAD_CLASS_SMI_DR	0x81
+
+#define MAD_METHOD_GET		0x01
+#define MAD_METHOD_SET		0x02
+#define MAD_METHOD_GET_TABLE	0x12
+#define MAD_METHOD_RESP		0x80
+
+#define MAD_STATUS_UNSUP_METHOD	0x0008
+#define MAD_STATUS_UNSUP_ATTR	0x000c
+#define MAD_STATUS_INV_FIELD	0x001c
+#define SA_STATUS_NO_RECORDS	0x0300
+#define DR_DIRECTION		0x8000
+
+#define MAD_STATUS_OFFS		4
+#define MAD_TRID_OFFS		8
+#define MAD_ATTR_ID_OFFS	16
+#define MAD_ATTR_MOD_OFFS	20
+#define SMP_DR_HOP_CNT_OFFS	7
+#define SMP_DR_DLID_OFFS	34
+#define SMP_DATA_OFFS		64
+#define SMP_DR_PATH_OFFS	128
+#define PERF_DATA_OFFS		64
+#define SA_ATTR_OFFS_OFFS	44
+#define SA_COMP_MASK_OFFS	48
+#define SA_DATA_OFFS		56
+#define SA_SEG_DATA		(SIM_MAD_SIZE - SA_DATA_OFFS)
+#define SA_HDR_SIZE		20	/* SA header, counted in PayloadLength */
+
+#define RMPP_VERSION_OFFS	24
+#define RMPP_TYPE_OFFS		25
+#define RMPP_FLAGS_OFFS		26
+#define RMPP_SEGNUM_OFFS	28
+#define RMPP_PAYLEN_OFFS	32
+#define RMPP_TYPE_DATA		1
+#define RMPP_TYPE_ACK		2
+#define RMPP_TYPE_STOP		3
+#define RMPP_TYPE_ABORT		4
+#define RMPP_FLAG_ACTIVE	0x1
+#define RMPP_FLAG_FIRST		0x2
+#define RMPP_FLAG_LAST		0x4
+
+#define SMP_ATTR_NODE_DESC	0x0010
+#define SMP_ATTR_NODE_INFO	0x0011
+#define SMP_ATTR_SWITCH_INFO	0x0012
+#define SMP_ATTR_GUID_INFO	0x0014
+#define SMP_ATTR_PORT_INFO	0x0015
+#define SMP_ATTR_PKEY_TABLE	0x0016
+#define SMP_ATTR_SLVL_TABLE	0x0017
+#define SMP_ATTR_VL_ARB		0x0018
+#define SMP_ATTR_LFT		0x0019
+#define SMP_ATTR_MFT		0x001b
+#define SMP_ATTR_SM_INFO	0x0020
+#define SMP_ATTR_MLNX_EXT_PORT_INFO	0xff90
+
+#define PERF_ATTR_CLASS_PORT_INFO	0x0001
+#define PERF_ATTR_PORT_COUNTERS		0x0012
+#define PERF_ATTR_PORT_COUNTERS_EXT	0x001d
+/* AllPortSelect, extended width counters and PortXmitWait */
+#define PERF_CAP_MASK			0x1300
+
+#define SA_ATTR_CLASS_PORT_INFO		0x0001
+#define SA_ATTR_NODE_RECORD		0x0011
+#define SA_ATTR_PORTINFO_RECORD		0x0012
+#define SA_ATTR_SWITCHINFO_RECORD	0x0014
+#define SA_ATTR_LFT_RECORD		0x0015
+#define SA_ATTR_LINK_RECORD		0x0020
+#define SA_ATTR_PATH_RECORD		0x0035
+
+enum sim_topo {
+	SIM_TOPO_FATTREE,
+	SIM_TOPO_DRAGONFLY,
+	SIM_TOPO_CACHE,
+};
+
+struct sim_opts {
+	enum sim_topo topo;
+	unsigned cas;
+	unsigned radix;
+	unsigned dfly_a;
+	unsigned dfly_p;
+	unsigned dfly_h;
+	unsigned dfly_groups;
+	char *cache;
+	unsigned latency_us;
+	unsigned jitter_us;
+	double loss;
+	double errors;
+	uint64_t seed;
+};
+
+struct sim_node {
+	uint64_t guid;
+	uint32_t first_port;	/* index of port 0 */
+	int32_t sw;		/* index in switches, -1 for CAs */
+	uint16_t lid;		/* switches only */
+	uint8_t type;
+	uint8_t numports;
+	uint8_t info[SIM_SMP_DATA];
+	uint8_t switchinfo[SIM_SMP_DATA];
+	uint8_t nodedesc[SIM_SMP_DATA];
+	uint8_t *lft;		/* max_lid + 1 entries */
+};
+
+enum {
+	CTR_SYMBOL_ERR,
+	CTR_LINK_RECOVERS,
+	CTR_LINK_DOWNED,
+	CTR_RCV_ERR,
+	CTR_RCV_REMOTE_PHYS,
+	CTR_RCV_SW_RELAY,
+	CTR_XMIT_DISCARDS,
+	CTR_XMIT_CONSTRAINT,
+	CTR_RCV_CONSTRAINT,
+	CTR_LOCAL_INTEGRITY,
+	CTR_EXCESS_OVERRUN,
+	CTR_VL15_DROPPED,
+	CTR_XMIT_DATA,
+	CTR_RCV_DATA,
+	CTR_XMIT_PKTS,
+	CTR_RCV_PKTS,
+	CTR_XMIT_WAIT,
+	CTR_UNICAST_XMIT,
+	CTR_UNICAST_RCV,
+	CTR_MCAST_XMIT,
+	CTR_MCAST_RCV,
+	CTR_NUM,
+};
+
+/* Counter values at the last clear, for PortCounters and the extended set */
+struct sim_pma {
+	uint64_t base[CTR_NUM];
+	uint64_t base_ext[CTR_NUM];
+};
+
+struct sim_ibport {
+	uint64_t guid;
+	uint32_t node;
+	uint32_t remote;	/* port index or SIM_NO_PORT */
+	uint16_t lid;		/* CA ports only, see port_lid() */
+	uint8_t lmc;
+	uint8_t portnum;
+	bool present;
+	uint8_t info[SIM_SMP_DATA];
+	struct sim_pma *pma;
+};
+
+struct sim_fabric {
+	struct sim_node *nodes;
+	uint32_t num_nodes;
+	uint32_t nodes_size;
+	struct sim_ibport *ports;
+	uint32_t num_ports;
+	uint32_t ports_size;
+	uint32_t *switches;
+	uint32_t num_switches;
+	uint32_t *lid_port;	/* max_lid + 1 entries */
+	unsigned max_lid;
+	uint32_t local_node;
+	uint32_t local_port;	/* port index */
+	uint64_t start_ns;
+	pthread_mutex_t lock;	/* PMA baselines and rng */
+	uint64_t rng;
+	struct sim_opts opts;
+};
+
+/* An umad message: struct ib_user_mad followed by the MAD */
+struct sim_msg {
+	struct sim_msg *next;
+	uint64_t due_ns;
+	size_t size;
+	uint8_t buf[];
+};
+
+/* An SA table being returned to an agent without kernel RMPP */
+struct sim_rmpp {
+	struct sim_rmpp *next;
+	uint32_t agent_id;
+	uint64_t trid;
+	struct ib_user_mad umad;	/* address of the segments */
+	uint8_t hdr[SA_DATA_OFFS];
+	uint8_t *data;
+	size_t len;
+	unsigned nsegs;
+	unsigned sent;
+	unsigned acked;
+};
+
+struct sim_agent {
+	bool used;
+	uint8_t mgmt_class;
+	uint8_t class_version;
+	uint8_t rmpp_version;
+};
+
+struct sim_umad {
+	struct sim_umad *next;
+	int fd;			/* eventfd counting the ready messages */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool thread_started;
+	bool stopping;
+	struct sim_msg *pending;	/* sorted by due_ns */
+	struct sim_msg *pending_tail;
+	struct sim_msg *ready;
+	struct sim_msg **ready_tail;
+	uint64_t last_resp_ns;
+	struct sim_rmpp *rmpp;
+	struct sim_agent agents[UMAD_CA_MAX_AGENTS];
+};
+
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+static bool sim_enabled;
+static struct sim_fabric *sim_fabric;
+
+static pthread_mutex_t sim_umads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_umad *sim_umads;
+
+/*************************************
+ * Helpers
+ */
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static inline void put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+	return (uint32_t)get16(p) << 16 | get16(p + 2);
+}
+
+static inline uint64_t get64(const uint8_t *p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* Uniform in [0, 1) */
+static double sim_random(struct sim_fabric *f)
+{
+	uint64_t x;
+
+	pthread_mutex_lock(&f->lock);
+	x = f->rng;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	f->rng = x;
+	pthread_mutex_unlock(&f->lock);
+
+	return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t sim_latency_ns(struct sim_fabric *f)
+{
+	uint64_t ns = f->opts.latency_us * 1000ULL;
+
+	if (f->opts.jitter_us)
+		ns += sim_random(f) * f->opts.jitter_us * 1000.0;
+	return ns;
+}
+
+/* The LID a port answers to; switch ports all use the port 0 LID */
+static uint16_t port_lid(struct sim_fabric *f, uint32_t idx)
+{
+	struct sim_node *n = &f->nodes[f->ports[idx].node];
+
+	return n->type == NODE_SWITCH ? n->lid : f->ports[idx].lid;
+}
+
+/*************************************
+ * Options
+ */
+
+static int parse_uint(const char *key, const char *val, unsigned *out)
+{
+	char *end;
+	unsigned long v;
+
+	errno = 0;
+	v = strtoul(val, &end, 0);
+	if (errno || end == val || *end || v > UINT32_MAX) {
+		IBWARN("%s: bad value '%s' for %s", SIM_ENV, val, key);
+		return -1;
+	}
+	*out = v;
+	return 0;
+}
+
+static int parse_fraction(const char *key, const char *val, double *out)
+{
+	char *end;
+	double v;
+
+	v = strtod(val, &end);
+	if (end == val || *end || v < 0 || v > 1) {
+		IBWARN("%s: bad value '%s' for %s", SIM_ENV, val, key);
+		return -1;
+	}
+	*out = v;
+	return 0;
+}
+
+static int parse_opts(const char *env, struct sim_opts *o)
+{
+	char *str, *tok, *save, *val;
+	unsigned seed;
+	int ret = 0;
+
+	memset(o, 0, sizeof(*o));
+	o->topo = SIM_TOPO_FATTREE;
+	o->cas = 648;
+	o->radix = 36;
+	o->dfly_a = 4;
+	o->dfly_p = 4;
+	o->dfly_h = 2;
+	o->seed = 1;
+
+	str = strdup(env);
+	if (!str)
+		return -1;
+
+	for (tok = strtok_r(str, ",", &save); tok && !ret;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (!val) {
+			/* UMAD_SIM=1 just enables the defaults */
+			if (strcmp(tok, "1")) {
+				IBWARN("%s: bad option '%s'", SIM_ENV, tok);
+				ret = -1;
+			}
+			continue;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(tok, "topo")) {
+			if (!strcmp(val, "fattree"))
+				o->topo = SIM_TOPO_FATTREE;
+			else if (!strcmp(val, "dragonfly"))
+				o->topo = SIM_TOPO_DRAGONFLY;
+			else {
+				IBWARN("%s: unknown topology '%s'", SIM_ENV,
+				       val);
+				ret = -1;
+			}
+		} else if (!strcmp(tok, "cache")) {
+			free(o->cache);
+			o->cache = strdup(val);
+			o->topo = SIM_TOPO_CACHE;
+			if (!o->cache)
+				ret = -1;
+		} else if (!strcmp(tok, "cas"))
+			ret = parse_uint(tok, val, &o->cas);
+		else if (!strcmp(tok, "radix"))
+			ret = parse_uint(tok, val, &o->radix);
+		else if (!strcmp(tok, "a"))
+			ret = parse_uint(tok, val, &o->dfly_a);
+		else if (!strcmp(tok, "p"))
+			ret = parse_uint(tok, val, &o->dfly_p);
+		else if (!strcmp(tok, "h"))
+			ret = parse_uint(tok, val, &o->dfly_h);
+		else if (!strcmp(tok, "groups"))
+			ret = parse_uint(tok, val, &o->dfly_groups);
+		else if (!strcmp(tok, "latency"))
+			ret = parse_uint(tok, val, &o->latency_us);
+		else if (!strcmp(tok, "jitter"))
+			ret = parse_uint(tok, val, &o->jitter_us);
+		else if (!strcmp(tok, "loss"))
+			ret = parse_fraction(tok, val, &o->loss);
+		else if (!strcmp(tok, "errors"))
+			ret = parse_fraction(tok, val, &o->errors);
+		else if (!strcmp(tok, "seed")) {
+			ret = parse_uint(tok, val, &seed);
+			o->seed = seed ? seed : 1;
+		} else {
+			IBWARN("%s: unknown option '%s'", SIM_ENV, tok);
+			ret = -1;
+		}
+	}
+
+	free(str);
+	return ret;
+}
+
+/*************************************
+ * Fabric construction
+ */
+
+static uint32_t add_node(struct sim_fabric *f, uint8_t type,
+			 unsigned numports, const char *fmt, ...)
+{
+	struct sim_node *n;
+	uint32_t idx = f->num_nodes, p;
+	va_list ap;
+
+	if (f->num_nodes == f->nodes_size) {
+		f->nodes_size = f->nodes_size ? f->nodes_size * 2 : 1024;
+		n = realloc(f->nodes, f->nodes_size * sizeof(*n));
+		if (!n)
+			return SIM_NO_PORT;
+		f->nodes = n;
+	}
+	if (f->num_ports + numports + 1 > f->ports_size) {
+		struct sim_ibport *ports;
+
+		while (f->num_ports + numports + 1 > f->ports_size)
+			f->ports_size = f->ports_size ? f->ports_size * 2 :
+							4096;
+		ports = realloc(f->ports, f->ports_size * sizeof(*ports));
+		if (!ports)
+			return SIM_NO_PORT;
+		f->ports = ports;
+	}
+
+	n = &f->nodes[f->num_nodes++];
+	memset(n, 0, sizeof(*n));
+	n->guid = SIM_GUID_BASE + ((uint64_t)idx << 8);
+	n->type = type;
+	n->numports = numports;
+	n->first_port = f->num_ports;
+	n->sw = -1;
+
+	va_start(ap, fmt);
+	vsnprintf((char *)n->nodedesc, sizeof(n->nodedesc), fmt, ap);
+	va_end(ap);
+
+	for (p = 0; p <= numports; p++) {
+		struct sim_ibport *port = &f->ports[f->num_ports++];
+
+		memset(port, 0, sizeof(*port));
+		port->node = idx;
+		port->remote = SIM_NO_PORT;
+		port->portnum = p;
+		port->present = type == NODE_SWITCH || p;
+		port->guid = type == NODE_SWITCH ? n->guid : n->guid + p;
+	}
+
+	return idx;
+}
+
+static void connect_ports(struct sim_fabric *f, uint32_t na, unsigned pa,
+			  uint32_t nb, unsigned pb)
+{
+	uint32_t a = f->nodes[na].first_port + pa;
+	uint32_t b = f->nodes[nb].first_port + pb;
+
+	f->ports[a].remote = b;
+	f->ports[b].remote = a;
+}
+
+/*
+ * A folded Clos of radix port switches: leaves use half of their ports
+ * for CAs and half for uplinks.  Up to radix leaves are joined by radix/2
+ * spines, beyond that leaves are grouped in pods of radix/2 with as many
+ * aggregation switches, joined by (radix/2)^2 core switches.
+ */
+static int build_fattree(struct sim_fabric *f, const struct sim_opts *o)
+{
+	unsigned half = o->radix / 2, leaves, pods, i, k, q, c;
+	uint32_t *leaf = NULL, *upper = NULL, n;
+	int ret = -1;
+
+	if (o->radix < 2 || o->radix > 254 || o->radix % 2 || !o->cas) {
+		IBWARN("%s: bad fat tree cas=%u radix=%u", SIM_ENV, o->cas,
+		       o->radix);
+		return -1;
+	}
+
+	leaves = (o->cas + half - 1) / half;
+	pods = (leaves + half - 1) / half;
+	if (leaves > o->radix && pods > o->radix) {
+		IBWARN("%s: %u CAs need more than three levels of radix %u",
+		       SIM_ENV, o->cas, o->radix);
+		return -1;
+	}
+
+	leaf = calloc(leaves, sizeof(*leaf));
+	upper = calloc(half * half + half, sizeof(*upper));
+	if (!leaf || !upper)
+		goto out;
+
+	if (leaves <= o->radix) {
+		for (k = 0; leaves > 1 && k < half; k++)
+			if ((upper[k] = add_node(f, NODE_SWITCH, o->radix,
+						 "spine%u", k)) == SIM_NO_PORT)
+				goto out;
+		for (i = 0; i < leaves; i++) {
+			if ((leaf[i] = add_node(f, NODE_SWITCH, o->radix,
+						"leaf%u", i)) == SIM_NO_PORT)
+				goto out;
+			for (k = 0; leaves > 1 && k < half; k++)
+				connect_ports(f, leaf[i], half + 1 + k,
+					      upper[k], i + 1);
+		}
+	} else {
+		/* upper[0 .. half^2) are the cores, then a pod's aggregation */
+		for (k = 0; k < half * half; k++)
+			if ((upper[k] = add_node(f, NODE_SWITCH, o->radix,
+						 "core%u", k)) == SIM_NO_PORT)
+				goto out;
+		for (q = 0, i = 0; q < pods; q++) {
+			uint32_t *agg = &upper[half * half];
+
+			for (k = 0; k < half; k++) {
+				if ((agg[k] = add_node(f, NODE_SWITCH, o->radix,
+						       "agg%u/%u", q, k)) ==
+				    SIM_NO_PORT)
+					goto out;
+				for (c = 0; c < half; c++)
+					connect_ports(f, agg[k], half + 1 + c,
+						      upper[k * half + c],
+						      q + 1);
+			}
+			for (c = 0; c < half && i < leaves; c++, i++) {
+				if ((leaf[i] = add_node(f, NODE_SWITCH,
+							o->radix, "leaf%u",
+							i)) == SIM_NO_PORT)
+					goto out;
+				for (k = 0; k < half; k++)
+					connect_ports(f, leaf[i], half + 1 + k,
+						      agg[k], c + 1);
+			}
+		}
+	}
+
+	for (c = 0; c < o->cas; c++) {
+		if ((n = add_node(f, NODE_CA, 1, "node%05u HCA-1", c)) ==
+		    SIM_NO_PORT)
+			goto out;
+		if (!c)
+			f->local_node = n;
+		connect_ports(f, n, 1, leaf[c / half], c % half + 1);
+	}
+	ret = 0;
+out:
+	free(leaf);
+	free(upper);
+	return ret;
+}
+
+/*
+ * groups of a switches each, all to all within a group.  Every switch has
+ * p CAs and h global links; link l = s * h + k of group i leads to group
+ * l < i ? l : l + 1, so a*h + 1 groups are fully connected.
+ */
+static int build_dragonfly(struct sim_fabric *f, const struct sim_opts *o)
+{
+	unsigned a = o->dfly_a, p = o->dfly_p, h = o->dfly_h;
+	unsigned groups = o->dfly_groups ? o->dfly_groups : a * h + 1;
+	unsigned numports = p + a - 1 + h, i, j, s, t, k, l, m, c = 0;
+	uint32_t *sw, n;
+	int ret = -1;
+
+	if (!a || !p || numports > 254 || !groups || groups > a * h + 1) {
+		IBWARN("%s: bad dragonfly a=%u p=%u h=%u groups=%u", SIM_ENV,
+		       a, p, h, groups);
+		return -1;
+	}
+
+	sw = calloc(groups * a, sizeof(*sw));
+	if (!sw)
+		return -1;
+
+	for (i = 0; i < groups; i++)
+		for (s = 0; s < a; s++)
+			if ((sw[i * a + s] = add_node(f, NODE_SWITCH, numports,
+						      "dfly g%u s%u", i, s)) ==
+			    SIM_NO_PORT)
+				goto out;
+
+	for (i = 0; i < groups; i++) {
+		for (s = 0; s < a; s++)
+			for (t = s + 1; t < a; t++)
+				connect_ports(f, sw[i * a + s], p + t,
+					      sw[i * a + t], p + 1 + s);
+		for (s = 0; s < a; s++)
+			for (k = 0; k < h; k++) {
+				l = s * h + k;
+				j = l < i ? l : l + 1;
+				if (j >= groups || j < i)
+					continue;
+				m = i;	/* the link of group j back to i */
+				connect_ports(f, sw[i * a + s], p + a + k,
+					      sw[j * a + m / h],
+					      p + a + m % h);
+			}
+	}
+
+	for (i = 0; i < groups * a; i++)
+		for (k = 0; k < p; k++, c++) {
+			if ((n = add_node(f, NODE_CA, 1, "node%05u HCA-1",
+					  c)) == SIM_NO_PORT)
+				goto out;
+			if (!c)
+				f->local_node = n;
+			connect_ports(f, n, 1, sw[i], k + 1);
+		}
+	ret = 0;
+out:
+	free(sw);
+	return ret;
+}
+
+static void make_node_info(struct sim_node *n, uint64_t port_guid)
+{
+	uint8_t *d = n->info;
+
+	d[0] = 1;		/* BaseVersion */
+	d[1] = 1;		/* ClassVersion */
+	d[2] = n->type;
+	d[3] = n->numports;
+	put64(d + 4, n->guid);	/* SystemImageGUID */
+	put64(d + 12, n->guid);
+	put64(d + 20, port_guid);
+	put16(d + 28, n->type == NODE_SWITCH ? 8 : 128);	/* PartitionCap */
+	put16(d + 30, n->type == NODE_SWITCH ? 0xcb84 : 0x1017);
+	d[36] = 1;		/* LocalPortNum */
+	d[37] = 0x00;		/* VendorID */
+	d[38] = 0x02;
+	d[39] = 0xc9;
+}
+
+static void make_switch_info(struct sim_fabric *f, struct sim_node *n)
+{
+	uint8_t *d = n->switchinfo;
+
+	put16(d, 0xc000);		/* LinearFDBCap */
+	put16(d + 4, 0x400);		/* MulticastFDBCap */
+	put16(d + 6, f->max_lid);	/* LinearFDBTop */
+	d[11] = 18 << 3;		/* LifeTimeValue */
+	put16(d + 14, 8);		/* PartitionEnforcementCap */
+}
+
+static void make_port_info(struct sim_fabric *f, uint32_t idx, uint16_t sm_lid)
+{
+	struct sim_ibport *port = &f->ports[idx];
+	struct sim_node *n = &f->nodes[port->node];
+	bool up = port->remote != SIM_NO_PORT || !port->portnum;
+	uint32_t capmask;
+	uint8_t *d = port->info;
+
+	if (n->type == NODE_SWITCH)
+		capmask = port->portnum ? 0 : 0x00000048;
+	else
+		capmask = idx == f->local_port ? 0x0251086a : 0x02510868;
+
+	put64(d + 8, SIM_GID_PREFIX);
+	put16(d + 16, port_lid(f, idx));
+	put16(d + 18, sm_lid);
+	put32(d + 20, capmask);
+	d[28] = port->portnum;
+	d[29] = 3;		/* LinkWidthEnabled 1x, 4x */
+	d[30] = 3;		/* LinkWidthSupported */
+	d[31] = 2;		/* LinkWidthActive 4x */
+	d[32] = 7 << 4 | (up ? 4 : 1);	/* speeds up to QDR, Active/Down */
+	d[33] = (up ? 5 : 2) << 4 | 2;	/* LinkUp/Polling */
+	d[34] = port->lmc & 7;
+	d[35] = 4 << 4 | 7;	/* LinkSpeedActive QDR */
+	d[36] = 5 << 4;		/* NeighborMTU 4096 */
+	d[37] = 4 << 4;		/* VLCap VL0-7 */
+	d[39] = 8;		/* VLArbHighCap */
+	d[40] = 8;		/* VLArbLowCap */
+	d[41] = 5;		/* MTUCap 4096 */
+	d[42] = 7 << 5 | 16;	/* VLStallCount, HOQLife */
+	d[43] = 4 << 4;		/* OperationalVLs */
+	d[50] = 1;		/* GUIDCap */
+	d[51] = 18;		/* SubnetTimeOut */
+	d[52] = 16;		/* RespTimeValue */
+	d[53] = 8 << 4 | 8;	/* LocalPhyErrors, OverrunErrors */
+}
+
+static int finish_synthetic(struct sim_fabric *f)
+{
+	unsigned lid = 1;
+	uint32_t i, p;
+
+	for (i = 0; i < f->num_nodes; i++) {
+		struct sim_node *n = &f->nodes[i];
+
+		if (n->type == NODE_SWITCH) {
+			n->lid = lid++;
+			continue;
+		}
+		for (p = 1; p <= n->numports; p++)
+			if (f->ports[n->first_port + p].remote != SIM_NO_PORT)
+				f->ports[n->first_port + p].lid = lid++;
+	}
+	if (lid - 1 > SIM_MAX_LID) {
+		IBWARN("%s: %u LIDs needed", SIM_ENV, lid - 1);
+		return -1;
+	}
+	f->max_lid = lid - 1;
+
+	f->local_port = f->nodes[f->local_node].first_port + 1;
+	for (i = 0; i < f->num_nodes; i++) {
+		struct sim_node *n = &f->nodes[i];
+
+		make_node_info(n, f->ports[n->first_port +
+					   (n->type == NODE_CA)].guid);
+		if (n->type == NODE_SWITCH)
+			make_switch_info(f, n);
+		for (p = 0; p <= n->numports; p++)
+			if (f->ports[n->first_port + p].present)
+				make_port_info(f, n->first_port + p,
+					       f->ports[f->local_port].lid);
+	}
+	return 0;
+}
+
+/* The version 2 ibnetdiscover cache, as written by libibnetdisc */
+#define CACHE_MAGIC		0x8FE7832B
+#define CACHE_VERSION_2		2
+#define CACHE_PORT_PRESENT	0x01
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t node_count;
+	uint32_t port_count;
+	uint64_t from_node_guid;
+	uint32_t maxhops;
+	uint32_t from_node;
+	uint32_t node_size;
+	uint32_t port_size;
+	uint64_t node_offset;
+	uint64_t port_offset;
+};
+
+struct cache_node {
+	uint64_t guid;
+	uint32_t first_port;
+	uint16_t smalid;
+	uint8_t smalmc;
+	uint8_t smaenhsp0;
+	uint8_t type;
+	uint8_t numports;
+	uint8_t reserved[6];
+	uint8_t switchinfo[SIM_SMP_DATA];
+	uint8_t info[SIM_SMP_DATA];
+	uint8_t nodedesc[SIM_SMP_DATA];
+};
+
+struct cache_port {
+	uint64_t guid;
+	uint32_t remoteport;
+	uint16_t base_lid;
+	uint8_t portnum;
+	uint8_t ext_portnum;
+	uint8_t lmc;
+	uint8_t flags;
+	uint8_t reserved[6];
+	uint8_t info[SIM_SMP_DATA];
+};
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+	struct stat st;
+	uint8_t *buf = NULL;
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		goto err;
+	buf = malloc(st.st_size ? st.st_size : 1);
+	if (!buf)
+		goto err;
+	while (done < (size_t)st.st_size) {
+		n = read(fd, buf + done, st.st_size - done);
+		if (n <= 0)
+			goto err;
+		done += n;
+	}
+	close(fd);
+	*len = done;
+	return buf;
+
+err:
+	IBWARN("%s: can't read %s: %m", SIM_ENV, path);
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int load_cache(struct sim_fabric *f, const char *path)
+{
+	const struct cache_header *hdr;
+	uint32_t node_count, port_count, node_size, port_size, i, p;
+	uint64_t node_offset, port_offset;
+	unsigned lid;
+	uint8_t *map;
+	size_t len;
+	int ret = -1;
+
+	map = read_file(path, &len);
+	if (!map)
+		return -1;
+
+	hdr = (const void *)map;
+	if (len < sizeof(*hdr) || le32toh(hdr->magic) != CACHE_MAGIC ||
+	    le32toh(hdr->version) != CACHE_VERSION_2) {
+		IBWARN("%s: %s is not a version 2 ibnetdiscover cache",
+		       SIM_ENV, path);
+		goto out;
+	}
+
+	node_count = le32toh(hdr->node_count);
+	port_count = le32toh(hdr->port_count);
+	node_size = le32toh(hdr->node_size);
+	port_size = le32toh(hdr->port_size);
+	node_offset = le64toh(hdr->node_offset);
+	port_offset = le64toh(hdr->port_offset);
+	if (node_size < sizeof(struct cache_node) ||
+	    port_size < sizeof(struct cache_port) ||
+	    (node_size | port_size | node_offset | port_offset) % 8 ||
+	    node_offset > len || port_offset > len ||
+	    (len - node_offset) / node_size < node_count ||
+	    (len - port_offset) / port_size < port_count ||
+	    le32toh(hdr->from_node) >= node_count) {
+		IBWARN("%s: %s has a bad record layout", SIM_ENV, path);
+		goto out;
+	}
+
+	f->nodes = calloc(node_count, sizeof(*f->nodes));
+	f->ports = calloc(port_count ? port_count : 1, sizeof(*f->ports));
+	if (!f->nodes || !f->ports)
+		goto out;
+	f->num_nodes = node_count;
+	f->num_ports = port_count;
+	for (i = 0; i < port_count; i++)
+		f->ports[i].remote = SIM_NO_PORT;
+
+	for (i = 0; i < node_count; i++) {
+		const struct cache_node *rec = (const void *)
+			(map + node_offset + (uint64_t)i * node_size);
+		struct sim_node *n = &f->nodes[i];
+
+		n->guid = le64toh(rec->guid);
+		n->first_port = le32toh(rec->first_port);
+		n->type = rec->type;
+		n->numports = rec->numports;
+		n->sw = -1;
+		memcpy(n->info, rec->info, SIM_SMP_DATA);
+		memcpy(n->switchinfo, rec->switchinfo, SIM_SMP_DATA);
+		memcpy(n->nodedesc, rec->nodedesc, SIM_SMP_DATA);
+		if (n->first_port > port_count ||
+		    port_count - n->first_port < n->numports + 1u) {
+			IBWARN("%s: %s: bad ports of node %u", SIM_ENV, path,
+			       i);
+			goto out;
+		}
+
+		for (p = 0; p <= n->numports; p++) {
+			const struct cache_port *prec = (const void *)
+				(map + port_offset +
+				 (uint64_t)(n->first_port + p) * port_size);
+			struct sim_ibport *port =
+				&f->ports[n->first_port + p];
+
+			if (!(prec->flags & CACHE_PORT_PRESENT))
+				continue;
+			port->guid = le64toh(prec->guid);
+			port->node = i;
+			port->portnum = p;
+			port->present = true;
+			port->remote = le32toh(prec->remoteport);
+			port->lid = le16toh(prec->base_lid);
+			port->lmc = prec->lmc;
+			memcpy(port->info, prec->info, SIM_SMP_DATA);
+			if (port->remote != SIM_NO_PORT &&
+			    port->remote >= port_count) {
+				IBWARN("%s: %s: bad remote port", SIM_ENV,
+				       path);
+				goto out;
+			}
+		}
+		if (n->type == NODE_SWITCH)
+			n->lid = f->ports[n->first_port].lid;
+	}
+
+	/* Links must be recorded at both ends for routing */
+	for (i = 0; i < port_count; i++) {
+		struct sim_ibport *port = &f->ports[i];
+
+		if (port->remote == SIM_NO_PORT)
+			continue;
+		if (!f->ports[port->remote].present ||
+		    f->ports[port->remote].remote != i) {
+			IBWARN("%s: %s: inconsistent link", SIM_ENV, path);
+			goto out;
+		}
+	}
+
+	f->local_node = le32toh(hdr->from_node);
+	f->local_port = f->nodes[f->local_node].first_port;
+	if (f->nodes[f->local_node].type != NODE_SWITCH)
+		for (p = 1; p <= f->nodes[f->local_node].numports; p++)
+			if (f->ports[f->local_port + p].remote !=
+			    SIM_NO_PORT) {
+				f->local_port += p;
+				break;
+			}
+
+	for (i = 0; i < port_count; i++) {
+		struct sim_ibport *port = &f->ports[i];
+
+		if (!port->present || !port->lid ||
+		    (f->nodes[port->node].type == NODE_SWITCH &&
+		     port->portnum))
+			continue;
+		lid = port->lid + (1u << port->lmc) - 1;
+		if (lid > SIM_MAX_LID)
+			continue;
+		if (f->max_lid < lid)
+			f->max_lid = lid;
+	}
+	for (i = 0; i < node_count; i++)
+		if (f->nodes[i].type == NODE_SWITCH)
+			put16(f->nodes[i].switchinfo + 6, f->max_lid);
+	ret = 0;
+out:
+	free(map);
+	return ret;
+}
+
+static int build_lid_table(struct sim_fabric *f)
+{
+	unsigned l, last;
+	uint32_t i;
+
+	f->lid_port = malloc((f->max_lid + 1) * sizeof(*f->lid_port));
+	if (!f->lid_port)
+		return -1;
+	for (l = 0; l <= f->max_lid; l++)
+		f->lid_port[l] = SIM_NO_PORT;
+
+	for (i = 0; i < f->num_ports; i++) {
+		struct sim_ibport *port = &f->ports[i];
+
+		if (!port->present || !port_lid(f, i) ||
+		    (f->nodes[port->node].type == NODE_SWITCH &&
+		     port->portnum))
+			continue;
+		last = port_lid(f, i) + (1u << port->lmc) - 1;
+		for (l = port_lid(f, i); l <= last && l <= f->max_lid; l++)
+			f->lid_port[l] = i;
+	}
+	return 0;
+}
+
+/*
+ * Minimum hop routes: a breadth first search from every switch with
+ * LIDs attached, then each other switch spreads those LIDs over its ports
+ * leading one hop closer.
+ */
+static int build_routes(struct sim_fabric *f)
+{
+	uint32_t *attach_sw = NULL, *start = NULL, *lids = NULL;
+	uint32_t *queue = NULL;
+	uint8_t *attach_port = NULL, cand[256];
+	int32_t *dist = NULL;
+	unsigned l, ncand, p;
+	uint32_t i, d, s, head, tail;
+	int ret = -1;
+
+	for (i = 0; i < f->num_nodes; i++)
+		if (f->nodes[i].type == NODE_SWITCH)
+			f->num_switches++;
+	if (!f->num_switches)
+		return 0;
+
+	f->switches = calloc(f->num_switches, sizeof(*f->switches));
+	attach_sw = malloc((f->max_lid + 1) * sizeof(*attach_sw));
+	attach_port = malloc(f->max_lid + 1);
+	start = calloc(f->num_switches + 1, sizeof(*start));
+	lids = malloc((f->max_lid + 1) * sizeof(*lids));
+	dist = malloc(f->num_switches * sizeof(*dist));
+	queue = malloc(f->num_switches * sizeof(*queue));
+	if (!f->switches || !attach_sw || !attach_port || !start || !lids ||
+	    !dist || !queue)
+		goto out;
+
+	for (i = 0, s = 0; i < f->num_nodes; i++) {
+		struct sim_node *n = &f->nodes[i];
+
+		if (n->type != NODE_SWITCH)
+			continue;
+		n->sw = s;
+		f->switches[s++] = i;
+		n->lft = malloc(f->max_lid + 1);
+		if (!n->lft)
+			goto out;
+		memset(n->lft, SIM_NO_ROUTE, f->max_lid + 1);
+	}
+
+	/* The switch each LID hangs off, bucketed by switch */
+	for (l = 0; l <= f->max_lid; l++) {
+		uint32_t idx = f->lid_port[l], r;
+		struct sim_node *n;
+
+		attach_sw[l] = SIM_NO_PORT;
+		if (idx == SIM_NO_PORT)
+			continue;
+		n = &f->nodes[f->ports[idx].node];
+		if (n->type == NODE_SWITCH) {
+			attach_sw[l] = n->sw;
+			attach_port[l] = 0;
+		} else if ((r = f->ports[idx].remote) != SIM_NO_PORT &&
+			   f->nodes[f->ports[r].node].type == NODE_SWITCH) {
+			attach_sw[l] = f->nodes[f->ports[r].node].sw;
+			attach_port[l] = f->ports[r].portnum;
+		}
+		if (attach_sw[l] != SIM_NO_PORT)
+			start[attach_sw[l] + 1]++;
+	}
+	for (s = 0; s < f->num_switches; s++)
+		start[s + 1] += start[s];
+	for (l = 0; l <= f->max_lid; l++)
+		if (attach_sw[l] != SIM_NO_PORT)
+			lids[start[attach_sw[l]]++] = l;
+	for (s = f->num_switches; s > 0; s--)
+		start[s] = start[s - 1];
+	start[0] = 0;
+
+	for (d = 0; d < f->num_switches; d++) {
+		if (start[d] == start[d + 1])
+			continue;
+
+		for (s = 0; s < f->num_switches; s++)
+			dist[s] = -1;
+		dist[d] = 0;
+		queue[0] = d;
+		for (head = 0, tail = 1; head < tail; head++) {
+			struct sim_node *n =
+				&f->nodes[f->switches[queue[head]]];
+
+			for (p = 1; p <= n->numports; p++) {
+				uint32_t r = f->ports[n->first_port + p].remote;
+				struct sim_node *peer;
+
+				if (r == SIM_NO_PORT)
+					continue;
+				peer = &f->nodes[f->ports[r].node];
+				if (peer->sw < 0 || dist[peer->sw] >= 0)
+					continue;
+				dist[peer->sw] = dist[queue[head]] + 1;
+				queue[tail++] = peer->sw;
+			}
+		}
+
+		for (i = start[d]; i < start[d + 1]; i++)
+			f->nodes[f->switches[d]].lft[lids[i]] =
+				attach_port[lids[i]];
+
+		for (s = 0; s < f->num_switches; s++) {
+			struct sim_node *n = &f->nodes[f->switches[s]];
+
+			if (s == d || dist[s] < 0)
+				continue;
+			for (p = 1, ncand = 0; p <= n->numports; p++) {
+				uint32_t r = f->ports[n->first_port + p].remote;
+				struct sim_node *peer;
+
+				if (r == SIM_NO_PORT)
+					continue;
+				peer = &f->nodes[f->ports[r].node];
+				if (peer->sw >= 0 &&
+				    dist[peer->sw] == dist[s] - 1)
+					cand[ncand++] = p;
+			}
+			for (i = start[d]; i < start[d + 1]; i++)
+				n->lft[lids[i]] = cand[lids[i] % ncand];
+		}
+	}
+	ret = 0;
+out:
+	free(attach_sw);
+	free(attach_port);
+	free(start);
+	free(lids);
+	free(dist);
+	free(queue);
+	return ret;
+}
+
+static void free_fabric(struct sim_fabric *f)
+{
+	uint32_t i;
+
+	if (!f)
+		return;
+	for (i = 0; i < f->num_nodes; i++)
+		free(f->nodes[i].lft);
+	for (i = 0; i < f->num_ports; i++)
+		free(f->ports[i].pma);
+	free(f->nodes);
+	free(f->ports);
+	free(f->switches);
+	free(f->lid_port);
+	free(f->opts.cache);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+static struct sim_fabric *build_fabric(const char *env)
+{
+	struct sim_fabric *f;
+	int ret;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+	pthread_mutex_init(&f->lock, NULL);
+
+	if (parse_opts(env, &f->opts))
+		goto err;
+
+	switch (f->opts.topo) {
+	case SIM_TOPO_FATTREE:
+		ret = build_fattree(f, &f->opts) ?: finish_synthetic(f);
+		break;
+	case SIM_TOPO_DRAGONFLY:
+		ret = build_dragonfly(f, &f->opts) ?: finish_synthetic(f);
+		break;
+	default:
+		ret = load_cache(f, f->opts.cache);
+		break;
+	}
+	if (ret || build_lid_table(f) || build_routes(f))
+		goto err;
+
+	f->rng = mix64(f->opts.seed);
+	f->start_ns = now_ns();
+	return f;
+
+err:
+	IBWARN("%s: no simulated fabric", SIM_ENV);
+	free_fabric(f);
+	return NULL;
+}
+
+static void sim_init(void)
+{
+	const char *env = getenv(SIM_ENV);
+
+	if (!env)
+		return;
+	sim_enabled = true;
+	sim_fabric = build_fabric(env);
+}
+
+bool sim_active(void)
+{
+	pthread_once(&sim_once, sim_init);
+	return sim_enabled;
+}
+
+/*************************************
+ * Device attributes
+ */
+
+static struct sim_fabric *sim_ca(const char *ca_name)
+{
+	if (!sim_active() || !sim_fabric || !ca_name ||
+	    strcmp(ca_name, SIM_CA_NAME))
+		return NULL;
+	return sim_fabric;
+}
+
+/* Index of port portnum of the simulated CA, or SIM_NO_PORT */
+static uint32_t sim_ca_port(struct sim_fabric *f, int portnum)
+{
+	struct sim_node *n = &f->nodes[f->local_node];
+
+	if (portnum < 0 || portnum > n->numports ||
+	    portnum >= UMAD_CA_MAX_PORTS ||
+	    !f->ports[n->first_port + portnum].present)
+		return SIM_NO_PORT;
+	if (n->type == NODE_SWITCH && portnum)
+		return SIM_NO_PORT;
+	return n->first_port + portnum;
+}
+
+int sim_get_cas_names(char cas[][UMAD_CA_NAME_LEN], int max)
+{
+	if (!sim_ca(SIM_CA_NAME) || max < 1)
+		return 0;
+	strcpy(cas[0], SIM_CA_NAME);
+	return 1;
+}
+
+int sim_query_ca(const char *ca_name, struct sim_ca_attr *attr)
+{
+	struct sim_fabric *f = sim_ca(ca_name);
+	struct sim_node *n;
+
+	if (!f)
+		return -ENOENT;
+	n = &f->nodes[f->local_node];
+	attr->node_type = n->type;
+	attr->numports = n->type == NODE_SWITCH ? 0 :
+		(n->numports < UMAD_CA_MAX_PORTS ? n->numports :
+		 UMAD_CA_MAX_PORTS - 1);
+	attr->node_guid = htobe64(n->guid);
+	attr->system_guid = htobe64(get64(n->info + 4));
+	return 0;
+}
+
+int sim_query_port_state(const char *ca_name, int portnum, unsigned *state,
+			 unsigned *phys_state)
+{
+	struct sim_fabric *f = sim_ca(ca_name);
+	uint32_t idx;
+
+	if (!f || (idx = sim_ca_port(f, portnum)) == SIM_NO_PORT)
+		return -EIO;
+	*state = f->ports[idx].info[32] & 0xf;
+	*phys_state = f->ports[idx].info[33] >> 4;
+	return 0;
+}
+
+int sim_query_port(const char *ca_name, int portnum, umad_port_t *port)
+{
+	static const unsigned width[] = { [1] = 1, [2] = 4, [4] = 8, [8] = 12 };
+	struct sim_fabric *f = sim_ca(ca_name);
+	const uint8_t *info;
+	unsigned w, speed;
+	uint32_t idx;
+
+	if (!f || (idx = sim_ca_port(f, portnum)) == SIM_NO_PORT)
+		return -EIO;
+	info = f->ports[idx].info;
+
+	memset(port, 0, sizeof(*port));
+	strncpy(port->ca_name, ca_name, sizeof(port->ca_name) - 1);
+	port->portnum = portnum;
+	port->base_lid = port_lid(f, idx);
+	port->lmc = info[34] & 7;
+	port->sm_lid = get16(info + 18);
+	port->sm_sl = info[36] & 0xf;
+	port->state = info[32] & 0xf;
+	port->phys_state = info[33] >> 4;
+	w = info[31] < 9 ? width[info[31]] : 0;
+	speed = info[35] >> 4;
+	port->rate = w * (speed == 1 ? 25 : speed == 2 ? 50 : 100) / 10;
+	port->capmask = htobe32(get32(info + 20));
+	port->gid_prefix = htobe64(get64(info + 8));
+	port->port_guid = htobe64(f->ports[idx].guid);
+	strcpy(port->link_layer, "InfiniBand");
+
+	port->pkeys = calloc(1, sizeof(*port->pkeys));
+	if (!port->pkeys)
+		return -ENOMEM;
+	port->pkeys[0] = 0xffff;
+	port->pkeys_size = 1;
+	return 0;
+}
+
+int sim_umad_id(const char *ca_name, unsigned portnum)
+{
+	struct sim_fabric *f = sim_ca(ca_name);
+
+	if (!f || sim_ca_port(f, portnum) == SIM_NO_PORT)
+		return -1;
+	return portnum;
+}
+
+/*************************************
+ * Message queues
+ */
+
+static struct sim_msg *msg_alloc(size_t mad_len)
+{
+	struct sim_msg *m;
+
+	m = calloc(1, sizeof(*m) + sizeof(struct ib_user_mad) + mad_len);
+	if (!m)
+		return NULL;
+	m->size = sizeof(struct ib_user_mad) + mad_len;
+	((struct ib_user_mad *)m->buf)->length = m->size;
+	return m;
+}
+
+static inline struct ib_user_mad *msg_umad(struct sim_msg *m)
+{
+	return (struct ib_user_mad *)m->buf;
+}
+
+static inline uint8_t *msg_mad(struct sim_msg *m)
+{
+	return m->buf + sizeof(struct ib_user_mad);
+}
+
+static void ready_push_locked(struct sim_umad *su, struct sim_msg *m)
+{
+	m->next = NULL;
+	*su->ready_tail = m;
+	su->ready_tail = &m->next;
+	eventfd_write(su->fd, 1);
+}
+
+static void *delivery_thread(void *arg)
+{
+	struct sim_umad *su = arg;
+	struct sim_msg *m;
+	struct timespec ts;
+	uint64_t now;
+
+	pthread_mutex_lock(&su->lock);
+	while (!su->stopping) {
+		if (!su->pending) {
+			pthread_cond_wait(&su->cond, &su->lock);
+			continue;
+		}
+		now = now_ns();
+		if (su->pending->due_ns > now) {
+			ts.tv_sec = su->pending->due_ns / 1000000000ULL;
+			ts.tv_nsec = su->pending->due_ns % 1000000000ULL;
+			pthread_cond_timedwait(&su->cond, &su->lock, &ts);
+			continue;
+		}
+		m = su->pending;
+		su->pending = m->next;
+		if (!su->pending)
+			su->pending_tail = NULL;
+		ready_push_locked(su, m);
+	}
+	pthread_mutex_unlock(&su->lock);
+	return NULL;
+}
+
+/*
+ * Make m readable at due_ns.  Responses all come back over the same path,
+ * so jitter never lets one overtake another.
+ */
+static void deliver_locked(struct sim_umad *su, struct sim_msg *m,
+			   uint64_t due_ns, bool response)
+{
+	struct sim_msg **pp;
+
+	if (response) {
+		if (due_ns < su->last_resp_ns)
+			due_ns = su->last_resp_ns;
+		su->last_resp_ns = due_ns;
+	}
+
+	if (due_ns <= now_ns()) {
+		ready_push_locked(su, m);
+		return;
+	}
+
+	if (!su->thread_started) {
+		if (pthread_create(&su->thread, NULL, delivery_thread, su)) {
+			/* deliver early rather than never */
+			ready_push_locked(su, m);
+			return;
+		}
+		su->thread_started = true;
+	}
+
+	m->due_ns = due_ns;
+	m->next = NULL;
+	if (!su->pending || su->pending_tail->due_ns <= due_ns) {
+		if (su->pending)
+			su->pending_tail->next = m;
+		else
+			su->pending = m;
+		su->pending_tail = m;
+	} else {
+		for (pp = &su->pending; (*pp)->due_ns <= due_ns;
+		     pp = &(*pp)->next)
+			;
+		m->next = *pp;
+		*pp = m;
+	}
+	pthread_cond_signal(&su->cond);
+}
+
+static void free_msgs(struct sim_msg *m)
+{
+	struct sim_msg *next;
+
+	for (; m; m = next) {
+		next = m->next;
+		free(m);
+	}
+}
+
+/*************************************
+ * SMPs
+ */
+
+/* Follow the directed route of an SMP, then its LID routed tail if any */
+static bool route_dr(struct sim_fabric *f, const uint8_t *smp, uint32_t *node,
+		     unsigned *inport)
+{
+	unsigned hops = smp[SMP_DR_HOP_CNT_OFFS], i, p;
+	uint16_t dlid = get16(smp + SMP_DR_DLID_OFFS);
+	uint32_t cur = f->local_node, r;
+
+	*inport = f->ports[f->local_port].portnum;
+	if (hops >= SIM_MAX_HOPS)
+		return false;
+
+	for (i = 1; i <= hops; i++) {
+		struct sim_node *n = &f->nodes[cur];
+
+		p = smp[SMP_DR_PATH_OFFS + i];
+		/* CAs only send out of their own port and don't forward */
+		if (n->type != NODE_SWITCH &&
+		    (i > 1 || p != f->ports[f->local_port].portnum))
+			return false;
+		if (!p || p > n->numports)
+			return false;
+		r = f->ports[n->first_port + p].remote;
+		if (r == SIM_NO_PORT)
+			return false;
+		cur = f->ports[r].node;
+		*inport = f->ports[r].portnum;
+	}
+
+	for (i = 0; dlid != 0xffff && i < SIM_MAX_HOPS; i++) {
+		struct sim_node *n = &f->nodes[cur];
+
+		if (n->type != NODE_SWITCH) {
+			if (dlid >= port_lid(f, n->first_port + *inport) &&
+			    dlid < port_lid(f, n->first_port + *inport) +
+			    (1u << f->ports[n->first_port + *inport].lmc))
+				break;
+			if (i || cur != f->local_node)
+				return false;
+			p = *inport;
+		} else {
+			if (dlid == n->lid)
+				break;
+			if (dlid > f->max_lid ||
+			    (p = n->lft[dlid]) == SIM_NO_ROUTE)
+				return false;
+			if (!p)
+				break;
+		}
+		r = f->ports[n->first_port + p].remote;
+		if (r == SIM_NO_PORT)
+			return false;
+		cur = f->ports[r].node;
+		*inport = f->ports[r].portnum;
+	}
+
+	*node = cur;
+	if (f->nodes[cur].type == NODE_SWITCH && dlid != 0xffff)
+		*inport = 0;
+	return i < SIM_MAX_HOPS;
+}
+
+static bool route_lid(struct sim_fabric *f, uint16_t dlid, uint32_t *node,
+		      unsigned *inport)
+{
+	uint32_t idx;
+
+	if (dlid > f->max_lid || (idx = f->lid_port[dlid]) == SIM_NO_PORT)
+		return false;
+	*node = f->ports[idx].node;
+	*inport = f->ports[idx].portnum;
+	return true;
+}
+
+static uint16_t smp_attr(struct sim_fabric *f, uint32_t ni, unsigned inport,
+			 const uint8_t *req, uint8_t *data)
+{
+	struct sim_node *n = &f->nodes[ni];
+	uint32_t mod = get32(req + MAD_ATTR_MOD_OFFS), lid;
+	unsigned i;
+
+	switch (get16(req + MAD_ATTR_ID_OFFS)) {
+	case SMP_ATTR_NODE_DESC:
+		memcpy(data, n->nodedesc, SIM_SMP_DATA);
+		break;
+	case SMP_ATTR_NODE_INFO:
+		memcpy(data, n->info, SIM_SMP_DATA);
+		data[36] = inport;
+		if (n->type != NODE_SWITCH)
+			put64(data + 20, f->ports[n->first_port + inport].guid);
+		break;
+	case SMP_ATTR_PORT_INFO:
+		if (!mod && n->type != NODE_SWITCH)
+			mod = inport;
+		if (mod > n->numports || !f->ports[n->first_port + mod].present)
+			return MAD_STATUS_INV_FIELD;
+		memcpy(data, f->ports[n->first_port + mod].info, SIM_SMP_DATA);
+		data[28] = inport;	/* LocalPortNum is where the SMP came in */
+		break;
+	case SMP_ATTR_SWITCH_INFO:
+		if (n->type != NODE_SWITCH)
+			return MAD_STATUS_UNSUP_ATTR;
+		memcpy(data, n->switchinfo, SIM_SMP_DATA);
+		break;
+	case SMP_ATTR_LFT:
+		if (n->type != NODE_SWITCH || !n->lft)
+			return MAD_STATUS_UNSUP_ATTR;
+		for (i = 0; i < 64; i++) {
+			lid = mod * 64 + i;
+			data[i] = lid <= f->max_lid ? n->lft[lid] :
+						     SIM_NO_ROUTE;
+		}
+		break;
+	case SMP_ATTR_MFT:
+		if (n->type != NODE_SWITCH)
+			return MAD_STATUS_UNSUP_ATTR;
+		break;
+	case SMP_ATTR_GUID_INFO:
+		if (!mod)
+			put64(data, f->ports[n->first_port + inport].guid);
+		break;
+	case SMP_ATTR_PKEY_TABLE:
+		if (!(mod & 0xffff))
+			put16(data, 0xffff);
+		break;
+	case SMP_ATTR_SLVL_TABLE:
+	case SMP_ATTR_VL_ARB:
+	case SMP_ATTR_MLNX_EXT_PORT_INFO:	/* no FDR10 */
+		break;
+	case SMP_ATTR_SM_INFO:
+		if (ni != f->local_node)
+			return MAD_STATUS_UNSUP_ATTR;
+		put64(data, f->ports[f->local_port].guid);
+		data[20] = 1 << 4 | 3;	/* priority 1, master */
+		break;
+	default:
+		return MAD_STATUS_UNSUP_ATTR;
+	}
+	return 0;
+}
+
+static struct sim_msg *process_smp(struct sim_fabric *f, uint16_t dlid,
+				   const uint8_t *req)
+{
+	bool dr = req[1] == MAD_CLASS_SMI_DR;
+	struct sim_msg *m;
+	unsigned inport;
+	uint16_t status;
+	uint32_t ni;
+	uint8_t *mad;
+
+	if (dr ? !route_dr(f, req, &ni, &inport) :
+		 !route_lid(f, dlid, &ni, &inport))
+		return NULL;
+
+	m = msg_alloc(SIM_MAD_SIZE);
+	if (!m)
+		return NULL;
+	mad = msg_mad(m);
+	memcpy(mad, req, SIM_MAD_SIZE);
+	memset(mad + SMP_DATA_OFFS, 0, SIM_SMP_DATA);
+	mad[3] = MAD_METHOD_GET | MAD_METHOD_RESP;
+
+	status = smp_attr(f, ni, inport, req, mad + SMP_DATA_OFFS);
+	put16(mad + MAD_STATUS_OFFS, dr ? DR_DIRECTION | status : status);
+	return m;
+}
+
+/*************************************
+ * Performance management
+ */
+
+/*
+ * Counters grow with the time since the fabric was built, at rates fixed
+ * per port.  The errors option is the fraction of ports that also count
+ * errors.
+ */
+static void port_counters(struct sim_fabric *f, uint32_t idx, double secs,
+			  uint64_t *c)
+{
+	struct sim_ibport *port = &f->ports[idx];
+	uint64_t h, e;
+	double pkt_dwords;
+
+	memset(c, 0, CTR_NUM * sizeof(*c));
+	if (port->remote == SIM_NO_PORT)
+		return;
+
+	h = mix64(port->guid ^ (uint64_t)port->portnum << 56 ^ f->opts.seed);
+	secs += h >> 40 & 0xfff;	/* the link came up before we started */
+	c[CTR_XMIT_DATA] = (h & 0xff) / 512.0 * SIM_LINK_DWORDS * secs;
+	c[CTR_RCV_DATA] = (h >> 8 & 0xff) / 512.0 * SIM_LINK_DWORDS * secs;
+	pkt_dwords = 16 + (h >> 16 & 0x3f) * 8;
+	c[CTR_XMIT_PKTS] = c[CTR_XMIT_DATA] / pkt_dwords;
+	c[CTR_RCV_PKTS] = c[CTR_RCV_DATA] / pkt_dwords;
+	c[CTR_MCAST_XMIT] = c[CTR_XMIT_PKTS] / 64;
+	c[CTR_MCAST_RCV] = c[CTR_RCV_PKTS] / 64;
+	c[CTR_UNICAST_XMIT] = c[CTR_XMIT_PKTS] - c[CTR_MCAST_XMIT];
+	c[CTR_UNICAST_RCV] = c[CTR_RCV_PKTS] - c[CTR_MCAST_RCV];
+
+	e = mix64(h);
+	if ((e & 0xffffff) >= f->opts.errors * 0x1000000)
+		return;
+	c[CTR_SYMBOL_ERR] = (e >> 24 & 0xff) + secs * (e >> 32 & 0xf);
+	c[CTR_RCV_ERR] = c[CTR_SYMBOL_ERR] / 4;
+	c[CTR_LINK_RECOVERS] = e >> 36 & 3;
+	c[CTR_LINK_DOWNED] = e >> 38 & 1;
+	c[CTR_LOCAL_INTEGRITY] = e >> 39 & 3;
+	c[CTR_XMIT_DISCARDS] = secs * (e >> 41 & 7) / 10;
+	c[CTR_RCV_REMOTE_PHYS] = (e >> 44 & 1) ? c[CTR_RCV_ERR] / 2 : 0;
+	c[CTR_XMIT_WAIT] = secs * (e >> 45 & 0xffff);
+}
+
+/* Add the counters of port idx since their last clear to sum */
+static void add_port_counters(struct sim_fabric *f, uint32_t idx, bool ext,
+			      double secs, uint64_t *sum)
+{
+	uint64_t c[CTR_NUM];
+	struct sim_pma *pma;
+	unsigned i;
+
+	port_counters(f, idx, secs, c);
+	pthread_mutex_lock(&f->lock);
+	pma = f->ports[idx].pma;
+	for (i = 0; i < CTR_NUM; i++) {
+		uint64_t base = !pma ? 0 : ext ? pma->base_ext[i] : pma->base[i];
+
+		sum[i] += c[i] > base ? c[i] - base : 0;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void clear_port_counters(struct sim_fabric *f, uint32_t idx, bool ext,
+				double secs)
+{
+	struct sim_ibport *port = &f->ports[idx];
+	uint64_t c[CTR_NUM];
+
+	port_counters(f, idx, secs, c);
+	pthread_mutex_lock(&f->lock);
+	if (!port->pma)
+		port->pma = calloc(1, sizeof(*port->pma));
+	if (port->pma)
+		memcpy(ext ? port->pma->base_ext : port->pma->base, c,
+		       sizeof(c));
+	pthread_mutex_unlock(&f->lock);
+}
+
+static inline uint64_t sat(uint64_t v, uint64_t max)
+{
+	return v < max ? v : max;
+}
+
+static void put_port_counters(uint8_t *d, const uint64_t *c)
+{
+	put16(d + 4, sat(c[CTR_SYMBOL_ERR], 0xffff));
+	d[6] = sat(c[CTR_LINK_RECOVERS], 0xff);
+	d[7] = sat(c[CTR_LINK_DOWNED], 0xff);
+	put16(d + 8, sat(c[CTR_RCV_ERR], 0xffff));
+	put16(d + 10, sat(c[CTR_RCV_REMOTE_PHYS], 0xffff));
+	put16(d + 12, sat(c[CTR_RCV_SW_RELAY], 0xffff));
+	put16(d + 14, sat(c[CTR_XMIT_DISCARDS], 0xffff));
+	d[16] = sat(c[CTR_XMIT_CONSTRAINT], 0xff);
+	d[17] = sat(c[CTR_RCV_CONSTRAINT], 0xff);
+	d[19] = sat(c[CTR_LOCAL_INTEGRITY], 0xf) << 4 |
+		sat(c[CTR_EXCESS_OVERRUN], 0xf);
+	put16(d + 22, sat(c[CTR_VL15_DROPPED], 0xffff));
+	put32(d + 24, sat(c[CTR_XMIT_DATA], UINT32_MAX));
+	put32(d + 28, sat(c[CTR_RCV_DATA], UINT32_MAX));
+	put32(d + 32, sat(c[CTR_XMIT_PKTS], UINT32_MAX));
+	put32(d + 36, sat(c[CTR_RCV_PKTS], UINT32_MAX));
+	put32(d + 40, sat(c[CTR_XMIT_WAIT], UINT32_MAX));
+}
+
+static void put_port_counters_ext(uint8_t *d, const uint64_t *c)
+{
+	put64(d + 8, c[CTR_XMIT_DATA]);
+	put64(d + 16, c[CTR_RCV_DATA]);
+	put64(d + 24, c[CTR_XMIT_PKTS]);
+	put64(d + 32, c[CTR_RCV_PKTS]);
+	put64(d + 40, c[CTR_UNICAST_XMIT]);
+	put64(d + 48, c[CTR_UNICAST_RCV]);
+	put64(d + 56, c[CTR_MCAST_XMIT]);
+	put64(d + 64, c[CTR_MCAST_RCV]);
+}
+
+static uint16_t perf_counters(struct sim_fabric *f, uint32_t ni,
+			      const uint8_t *req, uint8_t *d)
+{
+	struct sim_node *n = &f->nodes[ni];
+	bool ext = get16(req + MAD_ATTR_ID_OFFS) == PERF_ATTR_PORT_COUNTERS_EXT;
+	double secs = (now_ns() - f->start_ns) / 1e9;
+	unsigned sel = d[1], first, last, p;
+	uint64_t sum[CTR_NUM] = {};
+
+	if (sel == 0xff) {
+		first = 1;
+		last = n->numports;
+	} else {
+		if (sel > n->numports || !f->ports[n->first_port + sel].present)
+			return MAD_STATUS_INV_FIELD;
+		first = last = sel;
+	}
+
+	for (p = first; p <= last; p++) {
+		if (req[3] == MAD_METHOD_SET)
+			clear_port_counters(f, n->first_port + p, ext, secs);
+		add_port_counters(f, n->first_port + p, ext, secs, sum);
+	}
+
+	/* PortSelect and CounterSelect are echoed */
+	memset(d + 4, 0, SIM_MAD_SIZE - PERF_DATA_OFFS - 4);
+	if (ext)
+		put_port_counters_ext(d, sum);
+	else
+		put_port_counters(d, sum);
+	return 0;
+}
+
+static struct sim_msg *process_perf(struct sim_fabric *f, uint16_t dlid,
+				    const uint8_t *req)
+{
+	struct sim_msg *m;
+	unsigned inport;
+	uint16_t status = 0;
+	uint32_t ni;
+	uint8_t *mad, *d;
+
+	if (!route_lid(f, dlid, &ni, &inport))
+		return NULL;
+
+	m = msg_alloc(SIM_MAD_SIZE);
+	if (!m)
+		return NULL;
+	mad = msg_mad(m);
+	memcpy(mad, req, SIM_MAD_SIZE);
+	mad[3] = MAD_METHOD_GET | MAD_METHOD_RESP;
+	d = mad + PERF_DATA_OFFS;
+
+	if (req[3] != MAD_METHOD_GET && req[3] != MAD_METHOD_SET)
+		status = MAD_STATUS_UNSUP_METHOD;
+	else switch (get16(req + MAD_ATTR_ID_OFFS)) {
+	case PERF_ATTR_CLASS_PORT_INFO:
+		memset(d, 0, SIM_MAD_SIZE - PERF_DATA_OFFS);
+		d[0] = 1;	/* BaseVersion */
+		d[1] = 1;	/* ClassVersion */
+		put16(d + 2, PERF_CAP_MASK);
+		d[7] = 18;	/* RespTimeValue */
+		break;
+	case PERF_ATTR_PORT_COUNTERS:
+	case PERF_ATTR_PORT_COUNTERS_EXT:
+		status = perf_counters(f, ni, req, d);
+		break;
+	default:
+		status = MAD_STATUS_UNSUP_ATTR;
+		break;
+	}
+
+	put16(mad + MAD_STATUS_OFFS, status);
+	return m;
+}
+
+/*************************************
+ * Subnet administration
+ */
+
+struct sim_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	bool failed;
+};
+
+/* Zeroed room for n more bytes, or NULL */
+static uint8_t *buf_add(struct sim_buf *b, size_t n)
+{
+	size_t size;
+	uint8_t *p;
+
+	if (b->failed)
+		return NULL;
+	if (b->len + n > b->size) {
+		size = b->size ? b->size * 2 : 4096;
+		while (size < b->len + n)
+			size *= 2;
+		p = realloc(b->data, size);
+		if (!p) {
+			b->failed = true;
+			return NULL;
+		}
+		b->data = p;
+		b->size = size;
+	}
+	p = b->data + b->len;
+	memset(p, 0, n);
+	b->len += n;
+	return p;
+}
+
+/* A component of a record that can be selected by the ComponentMask */
+struct sa_filter {
+	uint8_t bit;
+	uint8_t offs;
+	uint8_t len;
+};
+
+static const struct sa_filter node_rec_filter[] = {
+	{ 0, 0, 2 },		/* LID */
+	{ 4, 4 + 2, 1 },	/* NodeType */
+	{ 7, 4 + 12, 8 },	/* NodeGUID */
+	{ 8, 4 + 20, 8 },	/* PortGUID */
+	{}
+};
+
+static const struct sa_filter portinfo_rec_filter[] = {
+	{ 0, 0, 2 },		/* EndportLID */
+	{ 1, 2, 1 },		/* PortNum */
+	{}
+};
+
+static const struct sa_filter lid_rec_filter[] = {
+	{ 0, 0, 2 },		/* LID */
+	{}
+};
+
+static const struct sa_filter lft_rec_filter[] = {
+	{ 0, 0, 2 },		/* LID */
+	{ 1, 2, 2 },		/* BlockNum */
+	{}
+};
+
+static const struct sa_filter link_rec_filter[] = {
+	{ 0, 0, 2 },		/* FromLID */
+	{ 1, 2, 1 },		/* FromPort */
+	{ 2, 3, 1 },		/* ToPort */
+	{ 3, 4, 2 },		/* ToLID */
+	{}
+};
+
+static const struct sa_filter path_rec_filter[] = {
+	{ 2, 8, 16 },		/* DGID */
+	{ 3, 24, 16 },		/* SGID */
+	{ 4, 40, 2 },		/* DLID */
+	{ 5, 42, 2 },		/* SLID */
+	{}
+};
+
+struct sa_query {
+	uint64_t mask;
+	const uint8_t *rec;	/* the template record */
+	size_t recsz;
+	const struct sa_filter *filter;
+	struct sim_buf *out;
+};
+
+/* Cheap check for the LID, which is the first component of most records */
+static bool sa_skip_lid(const struct sa_query *q, uint16_t lid)
+{
+	return (q->mask & 1) && get16(q->rec) != lid;
+}
+
+/* Drop the record just added if it doesn't match the query */
+static void sa_filter(const struct sa_query *q, const uint8_t *r)
+{
+	const struct sa_filter *flt;
+
+	for (flt = q->filter; flt->len; flt++)
+		if ((q->mask & 1ULL << flt->bit) &&
+		    memcmp(q->rec + flt->offs, r + flt->offs, flt->len)) {
+			q->out->len -= q->recsz;
+			return;
+		}
+}
+
+static void sa_node_records(struct sim_fabric *f, const struct sa_query *q)
+{
+	uint32_t i, idx;
+	unsigned p;
+	uint8_t *r;
+
+	for (i = 0; i < f->num_nodes; i++) {
+		struct sim_node *n = &f->nodes[i];
+
+		for (p = n->type == NODE_SWITCH ? 0 : 1; p <= n->numports;
+		     p++) {
+			idx = n->first_port + p;
+			if (!f->ports[idx].present || !port_lid(f, idx) ||
+			    sa_skip_lid(q, port_lid(f, idx)))
+				continue;
+			if (!(r = buf_add(q->out, q->recsz)))
+				return;
+			put16(r, port_lid(f, idx));
+			memcpy(r + 4, n->info, 40);
+			put64(r + 4 + 20, f->ports[idx].guid);
+			r[4 + 36] = p;
+			memcpy(r + 44, n->nodedesc, SIM_SMP_DATA);
+			sa_filter(q, r);
+			if (n->type == NODE_SWITCH)
+				break;
+		}
+	}
+}
+
+static void sa_portinfo_records(struct sim_fabric *f,
+				const struct sa_query *q)
+{
+	uint32_t i;
+	uint8_t *r;
+
+	for (i = 0; i < f->num_ports; i++) {
+		if (!f->ports[i].present || sa_skip_lid(q, port_lid(f, i)))
+			continue;
+		if (!(r = buf_add(q->out, q->recsz)))
+			return;
+		put16(r, port_lid(f, i));
+		r[2] = f->ports[i].portnum;
+		memcpy(r + 4, f->ports[i].info, SIM_SMP_DATA);
+		sa_filter(q, r);
+	}
+}
+
+static void sa_switch_records(struct sim_fabric *f, const struct sa_query *q,
+			      bool lft)
+{
+	unsigned block;
+	uint32_t s;
+	uint8_t *r;
+
+	for (s = 0; s < f->num_switches; s++) {
+		struct sim_node *n = &f->nodes[f->switches[s]];
+
+		if (sa_skip_lid(q, n->lid))
+			continue;
+		if (!lft) {
+			if (!(r = buf_add(q->out, q->recsz)))
+				return;
+			put16(r, n->lid);
+			memcpy(r + 4, n->switchinfo, 20);
+			sa_filter(q, r);
+			continue;
+		}
+		for (block = 0; block <= f->max_lid / 64; block++) {
+			if ((q->mask & 2) && get16(q->rec + 2) != block)
+				continue;
+			if (!(r = buf_add(q->out, q->recsz)))
+				return;
+			put16(r, n->lid);
+			put16(r + 2, block);
+			memcpy(r + 8, n->lft + block * 64,
+			       f->max_lid + 1 - block * 64 < 64 ?
+			       f->max_lid + 1 - block * 64 : 64);
+			sa_filter(q, r);
+		}
+	}
+}
+
+static void sa_link_records(struct sim_fabric *f, const struct sa_query *q)
+{
+	uint32_t i, r;
+	uint8_t *rec;
+
+	for (i = 0; i < f->num_ports; i++) {
+		if ((r = f->ports[i].remote) == SIM_NO_PORT ||
+		    sa_skip_lid(q, port_lid(f, i)))
+			continue;
+		if (!(rec = buf_add(q->out, q->recsz)))
+			return;
+		put16(rec, port_lid(f, i));
+		rec[2] = f->ports[i].portnum;
+		rec[3] = f->ports[r].portnum;
+		put16(rec + 4, port_lid(f, r));
+		sa_filter(q, rec);
+	}
+}
+
+/* The number of switches on the route from port src to dlid, or -1 */
+static int path_hops(struct sim_fabric *f, uint32_t src, uint16_t dlid)
+{
+	uint32_t cur = f->ports[src].node, idx, r;
+	unsigned inport = f->ports[src].portnum, p;
+	int hops;
+
+	if (dlid > f->max_lid)
+		return -1;
+
+	for (hops = 0; hops < SIM_MAX_HOPS; hops++) {
+		struct sim_node *n = &f->nodes[cur];
+
+		if (n->type == NODE_SWITCH) {
+			if (dlid == n->lid)
+				return hops;
+			if ((p = n->lft[dlid]) == SIM_NO_ROUTE)
+				return -1;
+			if (!p)
+				return hops;
+		} else {
+			idx = n->first_port + inport;
+			if (dlid >= port_lid(f, idx) &&
+			    dlid < port_lid(f, idx) + (1u << f->ports[idx].lmc))
+				return hops;
+			if (hops)
+				return -1;
+			p = inport;
+		}
+		r = f->ports[n->first_port + p].remote;
+		if (r == SIM_NO_PORT)
+			return -1;
+		cur = f->ports[r].node;
+		inport = f->ports[r].portnum;
+	}
+	return -1;
+}
+
+/* The endport with this GUID, which is port 0 for switches */
+static uint32_t find_endport(struct sim_fabric *f, uint64_t guid)
+{
+	uint32_t i;
+
+	for (i = 0; i < f->num_ports; i++)
+		if (f->ports[i].present && f->ports[i].guid == guid &&
+		    port_lid(f, i))
+			return i;
+	return SIM_NO_PORT;
+}
+
+static uint32_t lid_endport(struct sim_fabric *f, uint16_t lid)
+{
+	return lid <= f->max_lid ? f->lid_port[lid] : SIM_NO_PORT;
+}
+
+static void sa_path_record(struct sim_fabric *f, const struct sa_query *q,
+			   uint32_t src, uint32_t dst)
+{
+	uint16_t slid = port_lid(f, src), dlid = port_lid(f, dst);
+	uint8_t *r;
+
+	if (path_hops(f, src, dlid) < 0 || !(r = buf_add(q->out, q->recsz)))
+		return;
+	put64(r + 8, get64(f->ports[dst].info + 8));
+	put64(r + 16, f->ports[dst].guid);
+	put64(r + 24, get64(f->ports[src].info + 8));
+	put64(r + 32, f->ports[src].guid);
+	put16(r + 40, dlid);
+	put16(r + 42, slid);
+	r[49] = 0x80 | 1;	/* reversible, one path */
+	put16(r + 50, 0xffff);	/* PKey */
+	r[54] = 2 << 6 | 5;	/* MTU 4096 */
+	r[55] = 2 << 6 | 7;	/* 40 Gb/s */
+	r[56] = 2 << 6 | 18;	/* PacketLifeTime */
+	sa_filter(q, r);
+}
+
+/*
+ * Paths from SLID or SGID, or from the simulated port if neither is given,
+ * to DLID or DGID or every endport.
+ */
+static void sa_path_records(struct sim_fabric *f, const struct sa_query *q)
+{
+	uint32_t src, dst;
+	unsigned lid;
+
+	if (q->mask & 1 << 5)
+		src = lid_endport(f, get16(q->rec + 42));
+	else if (q->mask & 1 << 3)
+		src = find_endport(f, get64(q->rec + 32));
+	else
+		src = f->local_port;
+	if (src == SIM_NO_PORT)
+		return;
+
+	if (q->mask & (1 << 4 | 1 << 2)) {
+		dst = q->mask & 1 << 4 ? lid_endport(f, get16(q->rec + 40)) :
+					 find_endport(f, get64(q->rec + 16));
+		if (dst != SIM_NO_PORT)
+			sa_path_record(f, q, src, dst);
+		return;
+	}
+
+	for (lid = 1; lid <= f->max_lid; lid++) {
+		dst = f->lid_port[lid];
+		if (dst != SIM_NO_PORT && port_lid(f, dst) == lid)
+			sa_path_record(f, q, src, dst);
+	}
+}
+
+/* Fill out with the records matching req, returns a MAD status */
+static uint16_t sa_records(struct sim_fabric *f, const uint8_t *req,
+			   struct sim_buf *out, size_t *recsz)
+{
+	struct sa_query q = {
+		.mask = get64(req + SA_COMP_MASK_OFFS),
+		.rec = req + SA_DATA_OFFS,
+		.out = out,
+	};
+	uint8_t *r;
+
+	switch (get16(req + MAD_ATTR_ID_OFFS)) {
+	case SA_ATTR_CLASS_PORT_INFO:
+		q.recsz = 72;
+		if ((r = buf_add(out, q.recsz))) {
+			r[0] = 1;	/* BaseVersion */
+			r[1] = 2;	/* ClassVersion */
+			r[7] = 18;	/* RespTimeValue */
+		}
+		break;
+	case SA_ATTR_NODE_RECORD:
+		q.recsz = 112;
+		q.filter = node_rec_filter;
+		sa_node_records(f, &q);
+		break;
+	case SA_ATTR_PORTINFO_RECORD:
+		q.recsz = 72;
+		q.filter = portinfo_rec_filter;
+		sa_portinfo_records(f, &q);
+		break;
+	case SA_ATTR_SWITCHINFO_RECORD:
+		q.recsz = 24;
+		q.filter = lid_rec_filter;
+		sa_switch_records(f, &q, false);
+		break;
+	case SA_ATTR_LFT_RECORD:
+		q.recsz = 72;
+		q.filter = lft_rec_filter;
+		sa_switch_records(f, &q, true);
+		break;
+	case SA_ATTR_LINK_RECORD:
+		q.recsz = 8;
+		q.filter = link_rec_filter;
+		sa_link_records(f, &q);
+		break;
+	case SA_ATTR_PATH_RECORD:
+		q.recsz = 64;
+		q.filter = path_rec_filter;
+		sa_path_records(f, &q);
+		break;
+	default:
+		/* Nothing else is kept by this SA, the table is empty */
+		break;
+	}
+
+	*recsz = q.recsz;
+	return out->failed ? MAD_STATUS_INV_FIELD : 0;
+}
+
+static struct sim_msg *rmpp_segment(struct sim_rmpp *t, unsigned seg)
+{
+	size_t offs = (size_t)(seg - 1) * SA_SEG_DATA;
+	struct sim_msg *m;
+	uint32_t paylen = 0;
+	uint8_t *mad;
+
+	m = msg_alloc(SIM_MAD_SIZE);
+	if (!m)
+		return NULL;
+	*msg_umad(m) = t->umad;
+	msg_umad(m)->length = m->size;
+	mad = msg_mad(m);
+	memcpy(mad, t->hdr, SA_DATA_OFFS);
+
+	mad[RMPP_FLAGS_OFFS] = RMPP_FLAG_ACTIVE;
+	if (seg == 1) {
+		mad[RMPP_FLAGS_OFFS] |= RMPP_FLAG_FIRST;
+		paylen = t->len + SA_HDR_SIZE * t->nsegs;
+	}
+	if (seg == t->nsegs) {
+		mad[RMPP_FLAGS_OFFS] |= RMPP_FLAG_LAST;
+		paylen = t->len - offs + SA_HDR_SIZE;
+	}
+	put32(mad + RMPP_SEGNUM_OFFS, seg);
+	put32(mad + RMPP_PAYLEN_OFFS, paylen);
+	memcpy(mad + SA_DATA_OFFS, t->data + offs,
+	       t->len - offs < SA_SEG_DATA ? t->len - offs : SA_SEG_DATA);
+	return m;
+}
+
+static void free_rmpp(struct sim_rmpp *t)
+{
+	free(t->data);
+	free(t);
+}
+
+static struct sim_msg *process_sa(struct sim_fabric *f, struct sim_umad *su,
+				  const struct ib_user_mad *umad,
+				  const uint8_t *req, bool kernel_rmpp)
+{
+	struct sim_buf out = {};
+	struct sim_msg *m = NULL;
+	struct sim_rmpp *t;
+	uint8_t method = req[3], *mad;
+	uint16_t status = 0;
+	size_t recsz = 0, nrec;
+
+	if (method != MAD_METHOD_GET && method != MAD_METHOD_GET_TABLE)
+		status = MAD_STATUS_UNSUP_METHOD;
+	else
+		status = sa_records(f, req, &out, &recsz);
+	nrec = status || !recsz ? 0 : out.len / recsz;
+	if (!nrec)
+		out.len = 0;
+
+	if (method != MAD_METHOD_GET_TABLE) {
+		if (!status && !nrec)
+			status = SA_STATUS_NO_RECORDS;
+		if (!(m = msg_alloc(SIM_MAD_SIZE)))
+			goto out;
+		mad = msg_mad(m);
+		memcpy(mad, req, SA_DATA_OFFS);
+		memcpy(mad + SA_DATA_OFFS, out.data,
+		       recsz < SA_SEG_DATA && nrec ? recsz : 0);
+		goto reply;
+	}
+
+	/* Kernel RMPP hands over the reassembled table */
+	if (kernel_rmpp) {
+		if (!(m = msg_alloc(SA_DATA_OFFS + out.len)))
+			goto out;
+		mad = msg_mad(m);
+		memcpy(mad, req, SA_DATA_OFFS);
+		mad[RMPP_VERSION_OFFS] = 1;
+		mad[RMPP_TYPE_OFFS] = RMPP_TYPE_DATA;
+		mad[RMPP_FLAGS_OFFS] = RMPP_FLAG_ACTIVE | RMPP_FLAG_FIRST |
+				       RMPP_FLAG_LAST;
+		put32(mad + RMPP_SEGNUM_OFFS, 1);
+		put32(mad + RMPP_PAYLEN_OFFS, out.len + SA_HDR_SIZE);
+		if (out.len)
+			memcpy(mad + SA_DATA_OFFS, out.data, out.len);
+		goto reply;
+	}
+
+	/* Otherwise the first segment goes now, the rest as it is ACKed */
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		goto out;
+	t->agent_id = umad->agent_id;
+	t->trid = get64(req + MAD_TRID_OFFS);
+	t->umad = *umad;
+	t->umad.status = 0;
+	t->umad.timeout_ms = 0;
+	t->umad.retries = 0;
+	memcpy(t->hdr, req, SA_DATA_OFFS);
+	t->hdr[3] = method | MAD_METHOD_RESP;
+	put16(t->hdr + MAD_STATUS_OFFS, status);
+	put16(t->hdr + SA_ATTR_OFFS_OFFS, nrec ? recsz / 8 : 0);
+	t->hdr[RMPP_VERSION_OFFS] = 1;
+	t->hdr[RMPP_TYPE_OFFS] = RMPP_TYPE_DATA;
+	t->data = out.data;
+	t->len = out.len;
+	t->nsegs = t->len ? (t->len + SA_SEG_DATA - 1) / SA_SEG_DATA : 1;
+	t->sent = 1;
+	out.data = NULL;
+
+	m = rmpp_segment(t, 1);
+	if (m && t->nsegs > 1) {
+		pthread_mutex_lock(&su->lock);
+		/* the agent may have been unregistered meanwhile */
+		if (su->agents[t->agent_id].used) {
+			t->next = su->rmpp;
+			su->rmpp = t;
+			t = NULL;
+		}
+		pthread_mutex_unlock(&su->lock);
+	}
+	if (t)
+		free_rmpp(t);
+	goto out;
+
+reply:
+	mad[3] = method | MAD_METHOD_RESP;
+	put16(mad + MAD_STATUS_OFFS, status);
+	put16(mad + SA_ATTR_OFFS_OFFS, nrec ? recsz / 8 : 0);
+out:
+	free(out.data);
+	return m;
+}
+
+/* An ACK, STOP or ABORT for a table being sent by RMPP */
+static void rmpp_control(struct sim_umad *su, const struct ib_user_mad *umad,
+			 const uint8_t *req, uint64_t due_ns)
+{
+	uint64_t trid = get64(req + MAD_TRID_OFFS);
+	unsigned segnum, newwin, s, from;
+	struct sim_rmpp **pp, *t;
+	struct sim_msg *m;
+
+	/* Sent by the receiver, so with the request method (e.g. GetTable) */
+	if (req[3] & MAD_METHOD_RESP) {
+		IBWARN("%s: RMPP type %u with response method 0x%x dropped",
+		       SIM_ENV, req[RMPP_TYPE_OFFS], req[3]);
+		return;
+	}
+
+	pthread_mutex_lock(&su->lock);
+	for (pp = &su->rmpp; (t = *pp); pp = &t->next)
+		if (t->agent_id == umad->agent_id && t->trid == trid)
+			break;
+	if (!t)
+		goto out;
+
+	segnum = get32(req + RMPP_SEGNUM_OFFS);
+	newwin = get32(req + RMPP_PAYLEN_OFFS);
+	if (req[RMPP_TYPE_OFFS] != RMPP_TYPE_ACK || segnum >= t->nsegs) {
+		*pp = t->next;
+		free_rmpp(t);
+		goto out;
+	}
+
+	/* A repeated ACK asks for what follows it again */
+	from = segnum == t->acked && segnum < t->sent ? segnum + 1 :
+							t->sent + 1;
+	t->acked = segnum;
+	if (newwin > t->nsegs)
+		newwin = t->nsegs;
+	for (s = from; s <= newwin; s++) {
+		if (!(m = rmpp_segment(t, s)))
+			break;
+		deliver_locked(su, m, due_ns, true);
+	}
+	if (t->sent < s - 1)
+		t->sent = s - 1;
+out:
+	pthread_mutex_unlock(&su->lock);
+}
+
+/*************************************
+ * The umad device
+ */
+
+static struct sim_umad *sim_lookup(int fd)
+{
+	struct sim_umad *su;
+
+	pthread_mutex_lock(&sim_umads_lock);
+	for (su = sim_umads; su; su = su->next)
+		if (su->fd == fd)
+			break;
+	pthread_mutex_unlock(&sim_umads_lock);
+	return su;
+}
+
+bool sim_is_port(int fd)
+{
+	return sim_active() && sim_lookup(fd);
+}
+
+int sim_open(const char *ca_name, int portnum)
+{
+	struct sim_fabric *f = sim_ca(ca_name);
+	pthread_condattr_t attr;
+	struct sim_umad *su;
+
+	if (!f || sim_ca_port(f, portnum) != f->local_port) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	su = calloc(1, sizeof(*su));
+	if (!su)
+		return -1;
+	su->fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+	if (su->fd < 0) {
+		free(su);
+		return -1;
+	}
+	pthread_mutex_init(&su->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&su->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	su->ready_tail = &su->ready;
+
+	pthread_mutex_lock(&sim_umads_lock);
+	su->next = sim_umads;
+	sim_umads = su;
+	pthread_mutex_unlock(&sim_umads_lock);
+
+	return su->fd;
+}
+
+int sim_close(int fd)
+{
+	struct sim_umad **pp, *su;
+	struct sim_rmpp *t;
+
+	pthread_mutex_lock(&sim_umads_lock);
+	for (pp = &sim_umads; (su = *pp); pp = &su->next)
+		if (su->fd == fd) {
+			*pp = su->next;
+			break;
+		}
+	pthread_mutex_unlock(&sim_umads_lock);
+	if (!su) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&su->lock);
+	su->stopping = true;
+	pthread_cond_signal(&su->cond);
+	pthread_mutex_unlock(&su->lock);
+	if (su->thread_started)
+		pthread_join(su->thread, NULL);
+
+	free_msgs(su->pending);
+	free_msgs(su->ready);
+	while ((t = su->rmpp)) {
+		su->rmpp = t->next;
+		free_rmpp(t);
+	}
+	pthread_cond_destroy(&su->cond);
+	pthread_mutex_destroy(&su->lock);
+	close(su->fd);
+	free(su);
+	return 0;
+}
+
+int sim_register_agent(int fd, unsigned mgmt_class, unsigned class_version,
+		       unsigned rmpp_version)
+{
+	struct sim_umad *su = sim_lookup(fd);
+	int id;
+
+	if (!su)
+		return -EBADF;
+
+	pthread_mutex_lock(&su->lock);
+	for (id = 0; id < UMAD_CA_MAX_AGENTS; id++)
+		if (!su->agents[id].used)
+			break;
+	if (id < UMAD_CA_MAX_AGENTS) {
+		su->agents[id].used = true;
+		su->agents[id].mgmt_class = mgmt_class;
+		su->agents[id].class_version = class_version;
+		su->agents[id].rmpp_version = rmpp_version;
+	}
+	pthread_mutex_unlock(&su->lock);
+
+	return id < UMAD_CA_MAX_AGENTS ? id : -ENOMEM;
+}
+
+int sim_unregister_agent(int fd, uint32_t agent_id)
+{
+	struct sim_umad *su = sim_lookup(fd);
+	struct sim_rmpp **pp, *t;
+
+	if (!su)
+		return -EBADF;
+	if (agent_id >= UMAD_CA_MAX_AGENTS)
+		return -EINVAL;
+
+	pthread_mutex_lock(&su->lock);
+	su->agents[agent_id].used = false;
+	for (pp = &su->rmpp; (t = *pp);) {
+		if (t->agent_id == agent_id) {
+			*pp = t->next;
+			free_rmpp(t);
+		} else
+			pp = &t->next;
+	}
+	pthread_mutex_unlock(&su->lock);
+	return 0;
+}
+
+/*
+ * The kernel completes an unanswered send when its own timer fires, which
+ * is a little before the poll the caller starts after sending times out.
+ */
+#define SIM_TIMEOUT_SLACK_NS	1000000ULL
+
+ssize_t sim_write(int fd, const void *buf, size_t count)
+{
+	const struct ib_user_mad *umad = buf;
+	struct sim_fabric *f = sim_fabric;
+	uint8_t req[SIM_MAD_SIZE] = {};
+	uint64_t now = now_ns(), timeout_ns, due;
+	unsigned tries, lost = 0;
+	struct sim_agent agent;
+	struct sim_umad *su;
+	struct sim_msg *m = NULL;
+
+	su = sim_lookup(fd);
+	if (!su) {
+		errno = EBADF;
+		return -1;
+	}
+	if (count < sizeof(*umad) + 24 ||
+	    umad->agent_id >= UMAD_CA_MAX_AGENTS) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&su->lock);
+	agent = su->agents[umad->agent_id];
+	pthread_mutex_unlock(&su->lock);
+	if (!agent.used) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(req, (const uint8_t *)buf + sizeof(*umad),
+	       count - sizeof(*umad) < SIM_MAD_SIZE ?
+	       count - sizeof(*umad) : SIM_MAD_SIZE);
+
+	timeout_ns = umad->timeout_ms * 1000000ULL;
+	tries = umad->timeout_ms ? umad->retries + 1 : 1;
+	while (lost < tries && f->opts.loss > 0 && sim_random(f) < f->opts.loss)
+		lost++;
+	if (lost == tries)
+		goto no_response;
+	due = now + lost * timeout_ns + sim_latency_ns(f);
+
+	if (req[1] == MAD_CLASS_SA && req[RMPP_VERSION_OFFS] &&
+	    (req[RMPP_FLAGS_OFFS] & RMPP_FLAG_ACTIVE) &&
+	    req[RMPP_TYPE_OFFS] != RMPP_TYPE_DATA) {
+		rmpp_control(su, umad, req, due);
+		return count;
+	}
+	if (req[3] & MAD_METHOD_RESP)
+		return count;
+
+	switch (req[1]) {
+	case MAD_CLASS_SMI:
+	case MAD_CLASS_SMI_DR:
+		m = process_smp(f, be16toh(umad->addr.lid), req);
+		break;
+	case MAD_CLASS_PERF:
+		m = process_perf(f, be16toh(umad->addr.lid), req);
+		break;
+	case MAD_CLASS_SA:
+		m = process_sa(f, su, umad, req, agent.rmpp_version);
+		break;
+	default:
+		break;
+	}
+
+	if (m) {
+		msg_umad(m)->agent_id = umad->agent_id;
+		msg_umad(m)->addr = umad->addr;
+		pthread_mutex_lock(&su->lock);
+		deliver_locked(su, m, due, true);
+		pthread_mutex_unlock(&su->lock);
+		return count;
+	}
+
+no_response:
+	if (!umad->timeout_ms)
+		return count;
+	m = msg_alloc(count - sizeof(*umad));
+	if (!m)
+		return count;
+	memcpy(m->buf, buf, count);
+	msg_umad(m)->status = ETIMEDOUT;
+	msg_umad(m)->length = m->size;
+	due = now + tries * timeout_ns;
+	due -= timeout_ns / 8 < SIM_TIMEOUT_SLACK_NS ? timeout_ns / 8 :
+						       SIM_TIMEOUT_SLACK_NS;
+	pthread_mutex_lock(&su->lock);
+	deliver_locked(su, m, due, false);
+	pthread_mutex_unlock(&su->lock);
+	return count;
+}
+
+ssize_t sim_read(int fd, void *buf, size_t count)
+{
+	struct sim_umad *su = sim_lookup(fd);
+	struct sim_msg *m;
+	eventfd_t v;
+	ssize_t n;
+
+	if (!su) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&su->lock);
+	m = su->ready;
+	if (!m) {
+		pthread_mutex_unlock(&su->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+	/* Like the kernel, report the size needed and keep the message */
+	if (m->size > count) {
+		if (count >= sizeof(struct ib_user_mad))
+			memcpy(buf, m->buf, sizeof(struct ib_user_mad));
+		pthread_mutex_unlock(&su->lock);
+		errno = ENOSPC;
+		return -1;
+	}
+	su->ready = m->next;
+	if (!su->ready)
+		su->ready_tail = &su->ready;
+	eventfd_read(su->fd, &v);
+	pthread_mutex_unlock(&su->lock);
+
+	memcpy(buf, m->buf, m->size);
+	n = m->size;
+	free(m);
+	return n;
+}
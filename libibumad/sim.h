@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#ifndef _UMAD_SIM_H
+#define _UMAD_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include <infiniband/umad.h>
+
+/*
+ * Simulated fabric backend, enabled by the UMAD_SIM environment variable.
+ * When it is set the only device is the simulated one and none of the
+ * sysfs or /dev files are used; see umad_sim(7).
+ */
+
+#define SIM_ENV			"UMAD_SIM"
+
+/* Warnings of umad.c and the simulator */
+#define IBWARN(fmt, args...) fprintf(stderr, "ibwarn: [%d] %s: " fmt "\n", getpid(), __func__, ## args)
+
+struct sim_ca_attr {
+	unsigned node_type;
+	int numports;
+	__be64 node_guid;
+	__be64 system_guid;
+};
+
+extern bool sim_active(void);
+
+extern int sim_get_cas_names(char cas[][UMAD_CA_NAME_LEN], int max);
+extern int sim_query_ca(const char *ca_name, struct sim_ca_attr *attr);
+extern int sim_query_port(const char *ca_name, int portnum,
+			  umad_port_t *port);
+extern int sim_query_port_state(const char *ca_name, int portnum,
+				unsigned *state, unsigned *phys_state);
+extern int sim_umad_id(const char *ca_name, unsigned portnum);
+
+extern int sim_open(const char *ca_name, int portnum);
+extern bool sim_is_port(int fd);
+extern int sim_close(int fd);
+extern ssize_t sim_write(int fd, const void *buf, size_t count);
+extern ssize_t sim_read(int fd, void *buf, size_t count);
+extern int sim_register_agent(int fd, unsigned mgmt_class,
+			      unsigned class_version, unsigned rmpp_version);
+extern int sim_unregister_agent(int fd, uint32_t agent_id);
+
+#endif /* _UMAD_SIM_H */
@@ -35,6 +35,7 @@
 #include <config.h>
 
 #include <sys/poll.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
@@ -46,6 +47,9 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <util/compiler.h>
 
 #include <infiniband/umad.h>
@@ -54,6 +58,7 @@
 
 #include <valgrind/memcheck.h>
 #include "sysfs.h"
+#include "sim.h"
 
 typedef struct ib_user_mad_reg_req {
 	uint32_t id;
@@ -78,8 +83,6 @@ struct ib_user_mad_reg_req2 {
 	uint8_t  reserved[3];
 };
 
-#define IBWARN(fmt, args...) fprintf(stderr, "ibwarn: [%d] %s: " fmt "\n", getpid(), __func__, ## args)
-
 #define TRACE	if (umaddebug)	IBWARN
 #define DEBUG	if (umaddebug)	IBWARN
 
@@ -99,6 +102,9 @@ static unsigned int get_abi_version(void)
 	if (abi_version != 0)
 		return abi_version & 0x7FFFFFFF;
 
+	if (sim_active())
+		return abi_version = IB_UMAD_ABI_VERSION;
+
 	if (sys_read_uint(IB_UMAD_ABI_DIR, IB_UMAD_ABI_FILE, &abi_version) <
 	    0) {
 		IBWARN("can't read ABI version from %s/%s (%m): is ib_umad module loaded?",
@@ -118,16 +124,6 @@ static unsigned int get_abi_version(void)
 /*************************************
  * Port
  */
-static int find_cached_ca(const char *ca_name, umad_ca_t * ca)
-{
-	return 0;		/* caching not implemented yet */
-}
-
-static int put_ca(umad_ca_t * ca)
-{
-	return 0;		/* caching not implemented yet */
-}
-
 static int release_port(umad_port_t * port)
 {
 	free(port->pkeys);
@@ -144,7 +140,25 @@ static int check_for_digit_name(const struct dirent *dent)
 	return *p ? 0 : 1;
 }
 
-static int get_port(const char *ca_name, const char *dir, int portnum, umad_port_t * port)
+static void read_link_layer(const char *port_dir, char *link_layer)
+{
+	if (sys_read_string(port_dir, SYS_PORT_LINK_LAYER,
+	    link_layer, UMAD_CA_NAME_LEN) < 0)
+		/* assume IB by default */
+		sprintf(link_layer, "IB");
+}
+
+static bool is_ib_link_layer(const char *link_layer)
+{
+	return !strcmp(link_layer, "InfiniBand") || !strcmp(link_layer, "IB");
+}
+
+/*
+ * link_layer is the cached value for this port, or NULL to read it from
+ * sysfs.
+ */
+static int get_port(const char *ca_name, const char *dir, int portnum,
+		    const char *link_layer, umad_port_t * port)
 {
 	char port_dir[256];
 	union umad_gid gid;
@@ -152,6 +166,9 @@ static int get_port(const char *ca_name, const char *dir, int portnum, umad_port
 	int i, len, num_pkeys = 0;
 	uint32_t capmask;
 
+	if (sim_active())
+		return sim_query_port(ca_name, portnum, port);
+
 	strncpy(port->ca_name, ca_name, sizeof port->ca_name - 1);
 	port->portnum = portnum;
 	port->pkeys = NULL;
@@ -176,10 +193,10 @@ static int get_port(const char *ca_name, const char *dir, int portnum, umad_port
 	if (sys_read_uint(port_dir, SYS_PORT_CAPMASK, &capmask) < 0)
 		goto clean;
 
-	if (sys_read_string(port_dir, SYS_PORT_LINK_LAYER,
-	    port->link_layer, UMAD_CA_NAME_LEN) < 0)
-		/* assume IB by default */
-		sprintf(port->link_layer, "IB");
+	if (link_layer)
+		memcpy(port->link_layer, link_layer, UMAD_CA_NAME_LEN);
+	else
+		read_link_layer(port_dir, port->link_layer);
 
 	port->capmask = htobe32(capmask);
 
@@ -242,6 +259,345 @@ static int release_ca(umad_ca_t * ca)
 	return 0;
 }
 
+/*************************************
+ * CA cache
+ *
+ * The parts of a CA that only change when the device itself comes or goes
+ * (node type, GUIDs, versions, the set of ports and their link layer) and
+ * the umad device number of each port are kept per process, so repeated
+ * umad_get_ca()/umad_get_port()/umad_open_port() calls only re-read the
+ * attributes the SM can change.  The cache is dropped whenever an umad
+ * device node is created or removed under RDMA_CDEV_DIR, and a cached CA
+ * is only trusted while its node GUID still matches, which catches
+ * renames.  If the inotify watch cannot be set up nothing is cached.
+ */
+struct cached_port {
+	bool present;
+	char link_layer[UMAD_CA_NAME_LEN];
+};
+
+struct cached_ca {
+	struct cached_ca *next;
+	char ca_name[UMAD_CA_NAME_LEN];
+	unsigned node_type;
+	int numports;
+	char fw_ver[20];
+	char ca_type[40];
+	char hw_ver[20];
+	__be64 node_guid;
+	__be64 system_guid;
+	struct cached_port ports[UMAD_CA_MAX_PORTS];
+};
+
+struct cached_umad_dev {
+	bool valid;
+	unsigned port;
+	char ca_name[UMAD_CA_NAME_LEN];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_ca *cache_cas;
+static struct cached_umad_dev cache_umad_devs[UMAD_MAX_PORTS];
+static unsigned int cache_gen;
+static int cache_fd = -1;
+static pid_t cache_pid;
+
+static void cache_flush_locked(void)
+{
+	struct cached_ca *ca;
+
+	while ((ca = cache_cas)) {
+		cache_cas = ca->next;
+		free(ca);
+	}
+	memset(cache_umad_devs, 0, sizeof(cache_umad_devs));
+	cache_gen++;
+}
+
+static void cache_disarm_locked(void)
+{
+	if (cache_fd >= 0)
+		close(cache_fd);
+	cache_fd = -1;
+	cache_pid = 0;
+}
+
+/*
+ * Returns true if the cache can be used, after dropping it if the set of
+ * umad devices changed since the last call.  The watch is (re)armed on
+ * first use, after fork() and after the watched directory went away.
+ */
+static bool cache_check_locked(void)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = false, rearm = false;
+	ssize_t n;
+	char *p;
+
+	if (cache_pid != getpid()) {
+		/*
+		 * A watch inherited over fork() is left alone, the child may
+		 * already have closed it and reused the fd number.
+		 */
+		cache_fd = -1;
+		cache_flush_locked();
+		cache_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (cache_fd < 0)
+			return false;
+		if (inotify_add_watch(cache_fd, RDMA_CDEV_DIR,
+				      IN_CREATE | IN_DELETE | IN_MOVE |
+				      IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+			DEBUG("can't watch %s (%m), not caching",
+			      RDMA_CDEV_DIR);
+			cache_disarm_locked();
+			return false;
+		}
+		cache_pid = getpid();
+		return true;
+	}
+
+	if (cache_fd < 0)
+		return false;
+
+	while ((n = read(cache_fd, buf, sizeof(buf))) > 0) {
+		changed = true;
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_IGNORED)
+				rearm = true;
+		}
+	}
+
+	if (changed) {
+		DEBUG("umad devices changed, dropping cache");
+		cache_flush_locked();
+	}
+	if (rearm) {
+		cache_disarm_locked();
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Validate the cache and return its generation in *gen.  Entries read from
+ * sysfs are only added if the generation is unchanged by then.
+ */
+static bool cache_begin(unsigned int *gen)
+{
+	bool usable;
+
+	pthread_mutex_lock(&cache_lock);
+	usable = cache_check_locked();
+	*gen = cache_gen;
+	pthread_mutex_unlock(&cache_lock);
+
+	return usable;
+}
+
+static struct cached_ca *cache_find_locked(const char *ca_name)
+{
+	struct cached_ca *ca;
+
+	for (ca = cache_cas; ca; ca = ca->next)
+		if (!strncmp(ca->ca_name, ca_name, UMAD_CA_NAME_LEN))
+			return ca;
+	return NULL;
+}
+
+static int read_ca(const char *ca_name, struct cached_ca *ca)
+{
+	char dir_name[256];
+	char port_dir[sizeof(dir_name) + 8];
+	struct dirent **namelist;
+	int r, i, ret = 0;
+	int portnum;
+
+	memset(ca, 0, sizeof(*ca));
+	strncpy(ca->ca_name, ca_name, sizeof(ca->ca_name) - 1);
+
+	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND,
+		 ca->ca_name);
+
+	if ((r = sys_read_uint(dir_name, SYS_NODE_TYPE, &ca->node_type)) < 0)
+		return r;
+	if (sys_read_string(dir_name, SYS_CA_FW_VERS, ca->fw_ver,
+			    sizeof ca->fw_ver) < 0)
+		ca->fw_ver[0] = '\0';
+	if (sys_read_string(dir_name, SYS_CA_HW_VERS, ca->hw_ver,
+			    sizeof ca->hw_ver) < 0)
+		ca->hw_ver[0] = '\0';
+	if (sys_read_string(dir_name, SYS_CA_TYPE, ca->ca_type,
+			    sizeof ca->ca_type) < 0)
+		ca->ca_type[0] = '\0';
+	if ((r = sys_read_guid(dir_name, SYS_CA_NODE_GUID, &ca->node_guid)) < 0)
+		return r;
+	if ((r =
+	     sys_read_guid(dir_name, SYS_CA_SYS_GUID, &ca->system_guid)) < 0)
+		return r;
+
+	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
+		 SYS_INFINIBAND, ca->ca_name, SYS_CA_PORTS_DIR);
+
+	if ((r = scandir(dir_name, &namelist, NULL, alphasort)) < 0)
+		return -ENOENT;
+
+	for (i = 0; i < r; i++) {
+		portnum = 0;
+		if (!strcmp(".", namelist[i]->d_name) ||
+		    !strcmp("..", namelist[i]->d_name))
+			continue;
+		if (strcmp("0", namelist[i]->d_name) &&
+		    ((portnum = atoi(namelist[i]->d_name)) <= 0 ||
+		     portnum >= UMAD_CA_MAX_PORTS)) {
+			ret = -EIO;
+			break;
+		}
+		snprintf(port_dir, sizeof(port_dir), "%s/%d", dir_name,
+			 portnum);
+		read_link_layer(port_dir, ca->ports[portnum].link_layer);
+		ca->ports[portnum].present = true;
+		if (ca->numports < portnum)
+			ca->numports = portnum;
+	}
+
+	for (i = 0; i < r; i++)
+		free(namelist[i]);
+	free(namelist);
+
+	return ret;
+}
+
+static int read_sim_ca(const char *ca_name, struct cached_ca *ca)
+{
+	struct sim_ca_attr attr;
+	unsigned state, phys_state;
+	int r, i;
+
+	memset(ca, 0, sizeof(*ca));
+	if ((r = sim_query_ca(ca_name, &attr)) < 0)
+		return r;
+
+	strncpy(ca->ca_name, ca_name, sizeof(ca->ca_name) - 1);
+	strcpy(ca->ca_type, "simulated");
+	ca->node_type = attr.node_type;
+	ca->node_guid = attr.node_guid;
+	ca->system_guid = attr.system_guid;
+	for (i = 0; i <= attr.numports; i++) {
+		if (sim_query_port_state(ca_name, i, &state, &phys_state) < 0)
+			continue;
+		strcpy(ca->ports[i].link_layer, "InfiniBand");
+		ca->ports[i].present = true;
+		ca->numports = i;
+	}
+	return 0;
+}
+
+/* Fill *ca with the static attributes of ca_name */
+static int cache_get_ca(const char *ca_name, struct cached_ca *ca)
+{
+	char dir_name[256];
+	struct cached_ca *c;
+	unsigned int gen;
+	__be64 guid;
+	bool usable;
+	int r;
+
+	/* Nothing to cache, the simulated CA lives in this process */
+	if (sim_active())
+		return read_sim_ca(ca_name, ca);
+
+	pthread_mutex_lock(&cache_lock);
+	usable = cache_check_locked();
+	c = usable ? cache_find_locked(ca_name) : NULL;
+	if (c)
+		*ca = *c;
+	gen = cache_gen;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (c) {
+		snprintf(dir_name, sizeof(dir_name), "%s/%s",
+			 SYS_INFINIBAND, ca_name);
+		if (!sys_read_guid(dir_name, SYS_CA_NODE_GUID, &guid) &&
+		    guid == ca->node_guid)
+			return 0;
+
+		DEBUG("cached %s is stale", ca_name);
+		pthread_mutex_lock(&cache_lock);
+		cache_flush_locked();
+		gen = cache_gen;
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	if ((r = read_ca(ca_name, ca)) < 0 || !usable)
+		return r;
+
+	pthread_mutex_lock(&cache_lock);
+	if (gen == cache_gen && !cache_find_locked(ca_name)) {
+		c = malloc(sizeof(*c));
+		if (c) {
+			*c = *ca;
+			c->next = cache_cas;
+			cache_cas = c;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+static int cache_find_umad_id(const char *dev, unsigned port)
+{
+	unsigned int gen;
+	int id;
+
+	if (!cache_begin(&gen))
+		return -1;
+
+	pthread_mutex_lock(&cache_lock);
+	for (id = 0; id < UMAD_MAX_PORTS; id++)
+		if (cache_umad_devs[id].valid &&
+		    cache_umad_devs[id].port == port &&
+		    !strncmp(cache_umad_devs[id].ca_name, dev,
+			     UMAD_CA_NAME_LEN))
+			break;
+	pthread_mutex_unlock(&cache_lock);
+
+	return id < UMAD_MAX_PORTS ? id : -1;
+}
+
+static void cache_add_umad_id(unsigned int gen, int id,
+			      const char dev[UMAD_CA_NAME_LEN], unsigned port)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (gen == cache_gen) {
+		cache_umad_devs[id].valid = true;
+		cache_umad_devs[id].port = port;
+		memcpy(cache_umad_devs[id].ca_name, dev, UMAD_CA_NAME_LEN);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static int read_port_state(const char *ca_name, int portnum,
+			   unsigned *state, unsigned *phys_state)
+{
+	char port_dir[256];
+
+	if (sim_active())
+		return sim_query_port_state(ca_name, portnum, state,
+					    phys_state);
+
+	snprintf(port_dir, sizeof(port_dir), "%s/%s/%s/%d", SYS_INFINIBAND,
+		 ca_name, SYS_CA_PORTS_DIR, portnum);
+
+	if (sys_read_uint(port_dir, SYS_PORT_STATE, state) < 0 ||
+	    sys_read_uint(port_dir, SYS_PORT_PHY_STATE, phys_state) < 0)
+		return -EIO;
+	return 0;
+}
+
 /*
  * if *port > 0, check ca[port] state. Otherwise set *port to
  * the first port that is active, and if such is not found, to
@@ -250,55 +606,56 @@ static int release_ca(umad_ca_t * ca)
  */
 static int resolve_ca_port(const char *ca_name, int *port)
 {
-	umad_ca_t ca;
+	struct cached_ca ca;
+	unsigned state[UMAD_CA_MAX_PORTS];
+	unsigned phys_state[UMAD_CA_MAX_PORTS];
 	int active = -1, up = -1;
-	int i, ret = 0;
+	int i;
 
 	TRACE("checking ca '%s'", ca_name);
 
-	if (umad_get_ca(ca_name, &ca) < 0)
+	/* Only the port states are needed here, not full umad_port_t's */
+	if (cache_get_ca(ca_name, &ca) < 0)
 		return -1;
 
 	if (ca.node_type == 2) {
 		*port = 0;	/* switch sma port 0 */
-		ret = 1;
-		goto Exit;
+		return 1;
 	}
 
 	if (*port > 0) {	/* check only the port the user wants */
-		if (*port > ca.numports) {
-			ret = -1;
-			goto Exit;
-		}
-		if (!ca.ports[*port]) {
-			ret = -1;
-			goto Exit;
-		}
-		if (strcmp(ca.ports[*port]->link_layer, "InfiniBand") &&
-		    strcmp(ca.ports[*port]->link_layer, "IB")) {
-			ret = -1;
-			goto Exit;
-		}
-		if (ca.ports[*port]->state == 4) {
-			ret = 1;
-			goto Exit;
-		}
-		if (ca.ports[*port]->phys_state != 3)
-			goto Exit;
-		ret = -1;
-		goto Exit;
+		if (*port > ca.numports)
+			return -1;
+		if (!ca.ports[*port].present)
+			return -1;
+		if (!is_ib_link_layer(ca.ports[*port].link_layer))
+			return -1;
+		if (read_port_state(ca_name, *port, &state[*port],
+				    &phys_state[*port]) < 0)
+			return -1;
+		if (state[*port] == 4)
+			return 1;
+		if (phys_state[*port] != 3)
+			return 0;
+		return -1;
+	}
+
+	for (i = 0; i <= ca.numports; i++) {
+		if (!ca.ports[i].present)
+			continue;
+		if (read_port_state(ca_name, i, &state[i], &phys_state[i]) < 0)
+			return -1;
 	}
 
 	for (i = 0; i <= ca.numports; i++) {
 		DEBUG("checking port %d", i);
-		if (!ca.ports[i])
+		if (!ca.ports[i].present)
 			continue;
-		if (strcmp(ca.ports[i]->link_layer, "InfiniBand") &&
-		    strcmp(ca.ports[i]->link_layer, "IB"))
+		if (!is_ib_link_layer(ca.ports[i].link_layer))
 			continue;
-		if (up < 0 && ca.ports[i]->phys_state == 5)
+		if (up < 0 && phys_state[i] == 5)
 			up = *port = i;
-		if (ca.ports[i]->state == 4) {
+		if (state[i] == 4) {
 			active = *port = i;
 			DEBUG("found active port %d", i);
 			break;
@@ -308,27 +665,20 @@ static int resolve_ca_port(const char *ca_name, int *port)
 	if (active == -1 && up == -1) {	/* no active or linkup port found */
 		for (i = 0; i <= ca.numports; i++) {
 			DEBUG("checking port %d", i);
-			if (!ca.ports[i])
+			if (!ca.ports[i].present)
 				continue;
-			if (ca.ports[i]->phys_state != 3) {
+			if (phys_state[i] != 3) {
 				up = *port = i;
 				break;
 			}
 		}
 	}
 
-	if (active >= 0) {
-		ret = 1;
-		goto Exit;
-	}
-	if (up >= 0) {
-		ret = 0;
-		goto Exit;
-	}
-	ret = -1;
-Exit:
-	release_ca(&ca);
-	return ret;
+	if (active >= 0)
+		return 1;
+	if (up >= 0)
+		return 0;
+	return -1;
 }
 
 static int resolve_ca_name(const char *ca_in, int *best_port,
@@ -425,92 +775,50 @@ static int resolve_ca_name(const char *ca_in, int *best_port,
 
 static int get_ca(const char *ca_name, umad_ca_t * ca)
 {
-	DIR *dir;
+	struct cached_ca c;
 	char dir_name[256];
-	struct dirent **namelist;
-	int r, i, ret;
-	int portnum;
+	int r, i;
 
 	ca->numports = 0;
 	memset(ca->ports, 0, sizeof ca->ports);
 	strncpy(ca->ca_name, ca_name, sizeof(ca->ca_name) - 1);
 
-	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND,
-		 ca->ca_name);
-
-	if ((r = sys_read_uint(dir_name, SYS_NODE_TYPE, &ca->node_type)) < 0)
-		return r;
-	if (sys_read_string(dir_name, SYS_CA_FW_VERS, ca->fw_ver,
-			    sizeof ca->fw_ver) < 0)
-		ca->fw_ver[0] = '\0';
-	if (sys_read_string(dir_name, SYS_CA_HW_VERS, ca->hw_ver,
-			    sizeof ca->hw_ver) < 0)
-		ca->hw_ver[0] = '\0';
-	if ((r = sys_read_string(dir_name, SYS_CA_TYPE, ca->ca_type,
-				 sizeof ca->ca_type)) < 0)
-		ca->ca_type[0] = '\0';
-	if ((r = sys_read_guid(dir_name, SYS_CA_NODE_GUID, &ca->node_guid)) < 0)
-		return r;
-	if ((r =
-	     sys_read_guid(dir_name, SYS_CA_SYS_GUID, &ca->system_guid)) < 0)
+	if ((r = cache_get_ca(ca_name, &c)) < 0)
 		return r;
 
+	ca->node_type = c.node_type;
+	memcpy(ca->fw_ver, c.fw_ver, sizeof(ca->fw_ver));
+	memcpy(ca->ca_type, c.ca_type, sizeof(ca->ca_type));
+	memcpy(ca->hw_ver, c.hw_ver, sizeof(ca->hw_ver));
+	ca->node_guid = c.node_guid;
+	ca->system_guid = c.system_guid;
+
 	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
 		 SYS_INFINIBAND, ca->ca_name, SYS_CA_PORTS_DIR);
 
-	if (!(dir = opendir(dir_name)))
-		return -ENOENT;
-
-	if ((r = scandir(dir_name, &namelist, NULL, alphasort)) < 0) {
-		ret = errno < 0 ? errno : -EIO;
-		goto error;
-	}
-
-	ret = 0;
-	for (i = 0; i < r; i++) {
-		portnum = 0;
-		if (!strcmp(".", namelist[i]->d_name) ||
-		    !strcmp("..", namelist[i]->d_name))
+	for (i = 0; i <= c.numports; i++) {
+		if (!c.ports[i].present)
 			continue;
-		if (strcmp("0", namelist[i]->d_name) &&
-		    ((portnum = atoi(namelist[i]->d_name)) <= 0 ||
-		     portnum >= UMAD_CA_MAX_PORTS)) {
-			ret = -EIO;
+		if (!(ca->ports[i] = calloc(1, sizeof(*ca->ports[i])))) {
+			r = -ENOMEM;
 			goto clean;
 		}
-		if (!(ca->ports[portnum] =
-		      calloc(1, sizeof(*ca->ports[portnum])))) {
-			ret = -ENOMEM;
-			goto clean;
-		}
-		if (get_port(ca_name, dir_name, portnum, ca->ports[portnum]) <
-		    0) {
-			free(ca->ports[portnum]);
-			ca->ports[portnum] = NULL;
-			ret = -EIO;
+		if (get_port(ca_name, dir_name, i, c.ports[i].link_layer,
+			     ca->ports[i]) < 0) {
+			free(ca->ports[i]);
+			ca->ports[i] = NULL;
+			r = -EIO;
 			goto clean;
 		}
-		if (ca->numports < portnum)
-			ca->numports = portnum;
+		ca->numports = i;
 	}
 
-	for (i = 0; i < r; i++)
-		free(namelist[i]);
-	free(namelist);
-
-	closedir(dir);
-	put_ca(ca);
 	return 0;
 
 clean:
-	for (i = 0; i < r; i++)
-		free(namelist[i]);
-	free(namelist);
-error:
-	closedir(dir);
 	release_ca(ca);
 
-	return ret;
+	return r;
 }
 
 static int umad_id_to_dev(int umad_id, char *dev, unsigned *port)
@@ -530,15 +838,27 @@ static int umad_id_to_dev(int umad_id, char *dev, unsigned *port)
 	return 0;
 }
 
-static int dev_to_umad_id(const char *dev, unsigned port)
+/*
+ * Walk the umad devices until the one for dev:port is found, or all of
+ * them if dev is NULL, caching every mapping seen on the way.
+ */
+static int scan_umad_ids(const char *dev, unsigned port)
 {
 	char umad_dev[UMAD_CA_NAME_LEN];
 	unsigned umad_port;
+	unsigned int gen;
+	bool usable;
 	int id;
 
+	usable = cache_begin(&gen);
+
 	for (id = 0; id < UMAD_MAX_PORTS; id++) {
 		if (umad_id_to_dev(id, umad_dev, &umad_port) < 0)
 			continue;
+		if (usable)
+			cache_add_umad_id(gen, id, umad_dev, umad_port);
+		if (!dev)
+			continue;
 		if (strncmp(dev, umad_dev, UMAD_CA_NAME_LEN))
 			continue;
 		if (port != umad_port)
@@ -551,6 +871,26 @@ static int dev_to_umad_id(const char *dev, unsigned port)
 	return -1;		/* not found */
 }
 
+static int dev_to_umad_id(const char *dev, unsigned port)
+{
+	char umad_dev[UMAD_CA_NAME_LEN];
+	unsigned umad_port;
+	int id;
+
+	if (sim_active())
+		return sim_umad_id(dev, port);
+
+	/* A cached id costs two reads to confirm instead of a full scan */
+	id = cache_find_umad_id(dev, port);
+	if (id >= 0 && !umad_id_to_dev(id, umad_dev, &umad_port) &&
+	    !strncmp(dev, umad_dev, UMAD_CA_NAME_LEN) && port == umad_port) {
+		DEBUG("mapped %s %d to %d (cached)", dev, port, id);
+		return id;
+	}
+
+	return scan_umad_ids(dev, port);
+}
+
 /*******************************
  * Public interface
  */
@@ -565,14 +905,19 @@ int umad_done(void)
 {
 	TRACE("umad_done");
 	/* FIXME - verify that all ports are closed */
+	umad_invalidate_ca_cache();
 	return 0;
 }
 
 static unsigned is_ib_type(const char *ca_name)
 {
 	char dir_name[256];
+	struct sim_ca_attr attr;
 	unsigned type;
 
+	if (sim_active())
+		return !sim_query_ca(ca_name, &attr);
+
 	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND, ca_name);
 
 	if (sys_read_uint(dir_name, SYS_NODE_TYPE, &type) < 0)
@@ -588,6 +933,9 @@ int umad_get_cas_names(char cas[][UMAD_CA_NAME_LEN], int max)
 
 	TRACE("max %d", max);
 
+	if (sim_active())
+		return sim_get_cas_names(cas, max);
+
 	n = scandir(SYS_INFINIBAND, &namelist, NULL, alphasort);
 	if (n > 0) {
 		for (i = 0; i < n; i++) {
@@ -677,6 +1025,48 @@ exit:
 	return result;
 }
 
+/* ioctl() on an umad port, which the simulator implements itself */
+static int umad_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct ib_user_mad_reg_req2 *req2 = arg;
+	struct ib_user_mad_reg_req *req = arg;
+	int id;
+
+	if (!sim_is_port(fd))
+		return ioctl(fd, request, arg);
+
+	switch (request) {
+	case IB_USER_MAD_REGISTER_AGENT:
+		id = sim_register_agent(fd, req->mgmt_class,
+					req->mgmt_class_version,
+					req->rmpp_version);
+		if (id >= 0)
+			req->id = id;
+		break;
+	case IB_USER_MAD_REGISTER_AGENT2:
+		id = sim_register_agent(fd, req2->mgmt_class,
+					req2->mgmt_class_version,
+					req2->rmpp_version);
+		if (id >= 0)
+			req2->id = id;
+		break;
+	case IB_USER_MAD_UNREGISTER_AGENT:
+		id = sim_unregister_agent(fd, *(uint32_t *)arg);
+		break;
+	case IB_USER_MAD_ENABLE_PKEY:
+		return 0;
+	default:
+		id = -ENOTTY;
+		break;
+	}
+
+	if (id < 0) {
+		errno = -id;
+		return -1;
+	}
+	return 0;
+}
+
 int umad_open_port(const char *ca_name, int portnum)
 {
 	char dev_file[UMAD_DEV_FILE_SZ];
@@ -707,13 +1097,17 @@ int umad_open_port(const char *ca_name, int portnum)
 	snprintf(dev_file, sizeof(dev_file), "%s/umad%d",
 		 RDMA_CDEV_DIR, umad_id);
 
-	if ((fd = open(dev_file, O_RDWR | O_NONBLOCK)) < 0) {
+	if (sim_active())
+		fd = sim_open(found_ca_name, portnum);
+	else
+		fd = open(dev_file, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
 		DEBUG("open %s failed: %s", dev_file, strerror(errno));
 		result =  -EIO;
 		goto exit;
 	}
 
-	if (abi_version > 5 || !ioctl(fd, IB_USER_MAD_ENABLE_PKEY, NULL))
+	if (abi_version > 5 || !umad_ioctl(fd, IB_USER_MAD_ENABLE_PKEY, NULL))
 		new_user_mad_api = 1;
 	else
 		new_user_mad_api = 0;
@@ -738,9 +1132,6 @@ int umad_get_ca(const char *ca_name, umad_ca_t *ca)
 		goto exit;
 	}
 
-	if (find_cached_ca(found_ca_name, ca) > 0)
-		goto exit;
-
 	r = get_ca(found_ca_name, ca);
 	if (r < 0)
 		goto exit;
@@ -771,6 +1162,8 @@ int umad_get_port(const char *ca_name, int portnum, umad_port_t *port)
 {
 	char dir_name[256];
 	char *found_ca_name;
+	const char *link_layer = NULL;
+	struct cached_ca ca;
 	int result;
 
 	TRACE("ca_name %s portnum %d", ca_name, portnum);
@@ -783,7 +1176,11 @@ int umad_get_port(const char *ca_name, int portnum, umad_port_t *port)
 	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
 		 SYS_INFINIBAND, found_ca_name, SYS_CA_PORTS_DIR);
 
-	result = get_port(found_ca_name, dir_name, portnum, port);
+	if (!cache_get_ca(found_ca_name, &ca) && portnum >= 0 &&
+	    portnum <= ca.numports && ca.ports[portnum].present)
+		link_layer = ca.ports[portnum].link_layer;
+
+	result = get_port(found_ca_name, dir_name, portnum, link_layer, port);
 exit:
 	free(found_ca_name);
 
@@ -807,7 +1204,8 @@ int umad_release_port(umad_port_t * port)
 
 int umad_close_port(int fd)
 {
-	close(fd);
+	if (!sim_is_port(fd) || sim_close(fd) < 0)
+		close(fd);
 	DEBUG("closed fd %d", fd);
 	return 0;
 }
@@ -907,7 +1305,10 @@ int umad_send(int fd, int agentid, void *umad, int length,
 	if (umaddebug > 1)
 		umad_dump(mad);
 
-	n = write(fd, mad, length + umad_size());
+	if (sim_is_port(fd))
+		n = sim_write(fd, mad, length + umad_size());
+	else
+		n = write(fd, mad, length + umad_size());
 	if (n == length + umad_size())
 		return 0;
 
@@ -954,7 +1355,10 @@ int umad_recv(int fd, void *umad, int *length, int timeout_ms)
 		return n;
 	}
 
-	n = read(fd, umad, umad_size() + *length);
+	if (sim_is_port(fd))
+		n = sim_read(fd, umad, umad_size() + *length);
+	else
+		n = read(fd, umad, umad_size() + *length);
 
 	VALGRIND_MAKE_MEM_DEFINED(umad, umad_size() + *length);
 
@@ -1021,7 +1425,7 @@ int umad_register_oui(int fd, int mgmt_class, uint8_t rmpp_version,
 
 	VALGRIND_MAKE_MEM_DEFINED(&req, sizeof req);
 
-	if (!ioctl(fd, IB_USER_MAD_REGISTER_AGENT, (void *)&req)) {
+	if (!umad_ioctl(fd, IB_USER_MAD_REGISTER_AGENT, (void *)&req)) {
 		DEBUG
 		    ("fd %d registered to use agent %d qp %d class 0x%x oui %p",
 		     fd, req.id, req.qpn, req.mgmt_class, oui);
@@ -1058,7 +1462,7 @@ int umad_register(int fd, int mgmt_class, int mgmt_version,
 
 	VALGRIND_MAKE_MEM_DEFINED(&req, sizeof req);
 
-	if (!ioctl(fd, IB_USER_MAD_REGISTER_AGENT, (void *)&req)) {
+	if (!umad_ioctl(fd, IB_USER_MAD_REGISTER_AGENT, (void *)&req)) {
 		DEBUG("fd %d registered to use agent %d qp %d", fd, req.id, qp);
 		return req.id;	/* return agentid */
 	}
@@ -1102,7 +1506,7 @@ int umad_register2(int port_fd, struct umad_reg_attr *attr, uint32_t *agent_id)
 
 	VALGRIND_MAKE_MEM_DEFINED(&req, sizeof req);
 
-	if ((rc = ioctl(port_fd, IB_USER_MAD_REGISTER_AGENT2, (void *)&req)) == 0) {
+	if ((rc = umad_ioctl(port_fd, IB_USER_MAD_REGISTER_AGENT2, (void *)&req)) == 0) {
 		DEBUG("fd %d registered to use agent %d qp %d class 0x%x oui 0x%06x",
 		      port_fd, req.id, req.qpn, req.mgmt_class, attr->oui);
 		*agent_id = req.id;
@@ -1130,7 +1534,7 @@ int umad_register2(int port_fd, struct umad_reg_attr *attr, uint32_t *agent_id)
 
 			memcpy(req_v1.method_mask, req.method_mask, sizeof req_v1.method_mask);
 
-			if ((rc = ioctl(port_fd, IB_USER_MAD_REGISTER_AGENT,
+			if ((rc = umad_ioctl(port_fd, IB_USER_MAD_REGISTER_AGENT,
 					(void *)&req_v1)) == 0) {
 				DEBUG("fd %d registered to use agent %d qp %d class 0x%x oui 0x%06x",
 				      port_fd, req_v1.id, req_v1.qpn, req_v1.mgmt_class, attr->oui);
@@ -1154,7 +1558,7 @@ int umad_register2(int port_fd, struct umad_reg_attr *attr, uint32_t *agent_id)
 int umad_unregister(int fd, int agentid)
 {
 	TRACE("fd %d unregistering agent %d", fd, agentid);
-	return ioctl(fd, IB_USER_MAD_UNREGISTER_AGENT, &agentid);
+	return umad_ioctl(fd, IB_USER_MAD_UNREGISTER_AGENT, &agentid);
 }
 
 int umad_status(void *umad)
@@ -1207,18 +1611,44 @@ void umad_dump(void *umad)
 	umad_addr_dump(&mad->addr);
 }
 
-struct umad_device_node *umad_get_ca_device_list(void)
+static struct umad_device_node *get_sim_device_list(void)
 {
+	char cas[UMAD_MAX_DEVICES][UMAD_CA_NAME_LEN];
+	struct umad_device_node *head = NULL, *node;
+	int n;
+
+	n = sim_get_cas_names(cas, UMAD_MAX_DEVICES);
+	while (n--) {
+		node = calloc(1, sizeof(*node) + UMAD_CA_NAME_LEN);
+		if (!node) {
+			umad_free_ca_device_list(head);
+			errno = ENOMEM;
+			return NULL;
+		}
+		node->ca_name = strcpy((char *)(node + 1), cas[n]);
+		node->next = head;
+		head = node;
+	}
+	errno = 0;
+	return head;
+}
+
+static struct umad_device_node *get_ca_device_list(bool fill_cache)
+{
+	struct cached_ca ca;
 	DIR *dir;
 	struct dirent *entry;
 	struct umad_device_node *head = NULL;
-	struct umad_device_node *tail;
+	struct umad_device_node *tail = NULL;
 	struct umad_device_node *node;
 	char *ca_name;
 	size_t cas_num = 0;
 	size_t d_name_size;
 	int errsv = 0;
 
+	if (sim_active())
+		return get_sim_device_list();
+
 	dir = opendir(SYS_INFINIBAND);
 	if (!dir) {
 		if (errno == ENOENT)
@@ -1231,7 +1661,12 @@ struct umad_device_node *umad_get_ca_device_list(void)
 		    (strcmp(entry->d_name, "..") == 0))
 			continue;
 
-		if (!is_ib_type(entry->d_name))
+		/* Reading the CA into the cache gives us its type as well */
+		if (fill_cache) {
+			if (cache_get_ca(entry->d_name, &ca) < 0 ||
+			    ca.node_type < 1 || ca.node_type > 3)
+				continue;
+		} else if (!is_ib_type(entry->d_name))
 			continue;
 
 		d_name_size = strlen(entry->d_name) + 1;
@@ -1256,6 +1691,9 @@ struct umad_device_node *umad_get_ca_device_list(void)
 		cas_num++;
 	}
 
+	if (fill_cache)
+		scan_umad_ids(NULL, 0);
+
 	DEBUG("return %zu cas", cas_num);
 exit:
 	closedir(dir);
@@ -1264,6 +1702,21 @@ exit:
 	return head;
 }
 
+struct umad_device_node *umad_get_ca_device_list(void)
+{
+	return get_ca_device_list(false);
+}
+
+struct umad_device_node *umad_get_ca_device_list2(uint32_t flags)
+{
+	if (flags & ~UMAD_DEVICE_LIST_FILL_CACHE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return get_ca_device_list(flags & UMAD_DEVICE_LIST_FILL_CACHE);
+}
+
 void umad_free_ca_device_list(struct umad_device_node *head)
 {
 	struct umad_device_node *node;
@@ -1274,3 +1727,10 @@ void umad_free_ca_device_list(struct umad_device_node *head)
 		free(node);
 	}
 }
+
+void umad_invalidate_ca_cache(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_flush_locked();
+	pthread_mutex_unlock(&cache_lock);
+}
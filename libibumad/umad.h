@@ -216,6 +216,13 @@ int umad_unregister(int portid, int agentid);
 struct umad_device_node *umad_get_ca_device_list(void);
 void umad_free_ca_device_list(struct umad_device_node *head);
 
+enum {
+	UMAD_DEVICE_LIST_FILL_CACHE = (1 << 0)
+};
+
+struct umad_device_node *umad_get_ca_device_list2(uint32_t flags);
+void umad_invalidate_ca_cache(void);
+
 enum {
 	UMAD_USER_RMPP = (1 << 0)
 };
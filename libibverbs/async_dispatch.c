@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <ccan/list.h>
+
+#include "ibverbs.h"
+
+#define DISPATCH_MAX_READY 64
+#define DISPATCH_EVENTS_BATCH 16
+
+struct async_dispatch_entry {
+	struct list_node entry;
+	struct ibv_context *context;
+	ibv_async_event_cb cb;
+	void *cb_arg;
+	/* Number of ibv_async_dispatcher_run() calls dispatching this entry */
+	unsigned int running;
+	/* Deleted from its own callback, freed once no run uses it */
+	bool removed;
+};
+
+/* The entry whose callback this thread is running, if any */
+static __thread struct async_dispatch_entry *dispatching;
+
+struct ibv_async_dispatcher {
+	int epoll_fd;
+	pthread_mutex_t lock;
+	/* Signalled when an entry stops running */
+	pthread_cond_t idle;
+	struct list_head entries;
+};
+
+struct ibv_async_dispatcher *ibv_async_dispatcher_create(void)
+{
+	struct ibv_async_dispatcher *disp;
+
+	disp = calloc(1, sizeof(*disp));
+	if (!disp) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	disp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (disp->epoll_fd < 0) {
+		free(disp);
+		return NULL;
+	}
+
+	pthread_mutex_init(&disp->lock, NULL);
+	pthread_cond_init(&disp->idle, NULL);
+	list_head_init(&disp->entries);
+	return disp;
+}
+
+void ibv_async_dispatcher_destroy(struct ibv_async_dispatcher *disp)
+{
+	struct async_dispatch_entry *ent, *tmp;
+
+	list_for_each_safe(&disp->entries, ent, tmp, entry) {
+		list_del(&ent->entry);
+		free(ent);
+	}
+
+	close(disp->epoll_fd);
+	pthread_cond_destroy(&disp->idle);
+	pthread_mutex_destroy(&disp->lock);
+	free(disp);
+}
+
+int ibv_async_dispatcher_get_fd(struct ibv_async_dispatcher *disp)
+{
+	return disp->epoll_fd;
+}
+
+int ibv_async_dispatcher_add(struct ibv_async_dispatcher *disp,
+			     struct ibv_context *context,
+			     ibv_async_event_cb cb, void *cb_arg)
+{
+	struct async_dispatch_entry *ent;
+	struct epoll_event ev = {};
+	int flags;
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent)
+		return ENOMEM;
+
+	ent->context = context;
+	ent->cb = cb;
+	ent->cb_arg = cb_arg;
+
+	/* Needed so ibv_get_async_events() drains the queue in one go */
+	flags = fcntl(context->async_fd, F_GETFL);
+	if (flags < 0 ||
+	    fcntl(context->async_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		goto err;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = ent;
+	if (epoll_ctl(disp->epoll_fd, EPOLL_CTL_ADD, context->async_fd, &ev))
+		goto err;
+
+	pthread_mutex_lock(&disp->lock);
+	list_add_tail(&disp->entries, &ent->entry);
+	pthread_mutex_unlock(&disp->lock);
+	return 0;
+
+err:
+	free(ent);
+	return errno;
+}
+
+int ibv_async_dispatcher_del(struct ibv_async_dispatcher *disp,
+			     struct ibv_context *context)
+{
+	struct async_dispatch_entry *ent;
+	unsigned int self;
+
+	pthread_mutex_lock(&disp->lock);
+	list_for_each(&disp->entries, ent, entry) {
+		if (ent->context != context)
+			continue;
+
+		epoll_ctl(disp->epoll_fd, EPOLL_CTL_DEL, context->async_fd,
+			  NULL);
+		list_del(&ent->entry);
+
+		/*
+		 * The context is closed once we return, wait for concurrent
+		 * runs that already picked the entry up. When called from
+		 * the entry's own callback this thread is one of them, it
+		 * frees the entry after the callback returns.
+		 */
+		self = dispatching == ent;
+		while (ent->running > self)
+			pthread_cond_wait(&disp->idle, &disp->lock);
+		if (self)
+			ent->removed = true;
+		pthread_mutex_unlock(&disp->lock);
+		if (!self)
+			free(ent);
+		return 0;
+	}
+	pthread_mutex_unlock(&disp->lock);
+
+	return ENOENT;
+}
+
+/*
+ * epoll may return an entry that ibv_async_dispatcher_del() freed after
+ * epoll_wait() returned, only use entries that are still on the list.
+ */
+static bool get_entry(struct ibv_async_dispatcher *disp,
+		      struct async_dispatch_entry *ready)
+{
+	struct async_dispatch_entry *ent;
+
+	pthread_mutex_lock(&disp->lock);
+	list_for_each(&disp->entries, ent, entry) {
+		if (ent == ready) {
+			ent->running++;
+			pthread_mutex_unlock(&disp->lock);
+			return true;
+		}
+	}
+	pthread_mutex_unlock(&disp->lock);
+
+	return false;
+}
+
+static void put_entry(struct ibv_async_dispatcher *disp,
+		      struct async_dispatch_entry *ent)
+{
+	bool removed;
+
+	pthread_mutex_lock(&disp->lock);
+	removed = ent->removed;
+	if (!--ent->running)
+		pthread_cond_broadcast(&disp->idle);
+	pthread_mutex_unlock(&disp->lock);
+
+	/* ibv_async_dispatcher_del() left only this run on the entry */
+	if (removed)
+		free(ent);
+}
+
+static int dispatch_context(struct async_dispatch_entry *ent)
+{
+	struct async_dispatch_entry *outer = dispatching;
+	struct ibv_async_event events[DISPATCH_EVENTS_BATCH];
+	int total = 0;
+	int i, n;
+
+	dispatching = ent;
+	do {
+		n = ibv_get_async_events(ent->context, events,
+					 DISPATCH_EVENTS_BATCH);
+		if (n < 0)
+			break;
+
+		/* Events after a callback deleted its context are dropped */
+		for (i = 0; i != n; i++) {
+			if (!ent->removed) {
+				ent->cb(ent->context, &events[i], ent->cb_arg);
+				total++;
+			}
+			ibv_ack_async_event(&events[i]);
+		}
+	} while (n == DISPATCH_EVENTS_BATCH && !ent->removed);
+	dispatching = outer;
+
+	return total;
+}
+
+int ibv_async_dispatcher_run(struct ibv_async_dispatcher *disp, int timeout)
+{
+	struct epoll_event ready[DISPATCH_MAX_READY];
+	int total = 0;
+	int i, n;
+
+	n = epoll_wait(disp->epoll_fd, ready, DISPATCH_MAX_READY, timeout);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i != n; i++) {
+		struct async_dispatch_entry *ent = ready[i].data.ptr;
+
+		if (!get_entry(disp, ent))
+			continue;
+		total += dispatch_context(ent);
+		put_entry(disp, ent);
+	}
+
+	return total;
+}
@@ -33,6 +33,7 @@
 #include <infiniband/cmd_ioctl.h>
 #include <infiniband/cmd_write.h>
 #include "ibverbs.h"
+#include "trace.h"
 
 #include <util/compiler.h>
 #include <ccan/build_assert.h>
@@ -236,6 +237,7 @@ int _execute_cmd_write(struct ibv_context *ctx, unsigned int write_method,
 		       size_t resp_size)
 {
 	struct verbs_ex_private *priv = get_priv(ctx);
+	uint64_t start;
 
 	if (!VERBS_WRITE_ONLY && (VERBS_IOCTL_ONLY || priv->use_ioctl_write))
 		return ioctl_write(ctx, write_method, req + 1,
@@ -247,8 +249,14 @@ int _execute_cmd_write(struct ibv_context *ctx, unsigned int write_method,
 	req->in_words = __check_divide(req_size, 4);
 	req->out_words = __check_divide(resp_size, 4);
 
-	if (write(ctx->cmd_fd, req, req_size) != req_size)
+	start = verbs_trace_begin();
+	if (write(ctx->cmd_fd, req, req_size) != req_size) {
+		verbs_trace_end(VERBS_TRACE_CMD_WRITE, start, errno);
+		VERBS_PROBE2(cmd_write, write_method, errno);
 		return errno;
+	}
+	verbs_trace_end(VERBS_TRACE_CMD_WRITE, start, 0);
+	VERBS_PROBE2(cmd_write, write_method, 0);
 
 	if (resp)
 		VALGRIND_MAKE_MEM_DEFINED(resp, resp_size);
@@ -265,6 +273,7 @@ int _execute_cmd_write_ex(struct ibv_context *ctx, unsigned int write_method,
 		       size_t resp_size)
 {
 	struct verbs_ex_private *priv = get_priv(ctx);
+	uint64_t start;
 
 	if (!VERBS_WRITE_ONLY && (VERBS_IOCTL_ONLY || priv->use_ioctl_write))
 		return ioctl_write(
@@ -292,8 +301,14 @@ int _execute_cmd_write_ex(struct ibv_context *ctx, unsigned int write_method,
 	if (resp)
 		memset(resp, 0, resp_size);
 
-	if (write(ctx->cmd_fd, req, req_size) != req_size)
+	start = verbs_trace_begin();
+	if (write(ctx->cmd_fd, req, req_size) != req_size) {
+		verbs_trace_end(VERBS_TRACE_CMD_WRITE, start, errno);
+		VERBS_PROBE2(cmd_write, req->hdr.command, errno);
 		return errno;
+	}
+	verbs_trace_end(VERBS_TRACE_CMD_WRITE, start, 0);
+	VERBS_PROBE2(cmd_write, req->hdr.command, 0);
 
 	if (resp)
 		VALGRIND_MAKE_MEM_DEFINED(resp, resp_size);
@@ -33,6 +33,7 @@
 #include <infiniband/cmd_ioctl.h>
 #include <infiniband/cmd_write.h>
 #include "ibverbs.h"
+#include "trace.h"
 
 #include <sys/ioctl.h>
 #include <infiniband/driver.h>
@@ -128,6 +129,7 @@ static void finalize_attrs(struct ibv_command_buffer *cmd)
 int execute_ioctl(struct ibv_context *context, struct ibv_command_buffer *cmd)
 {
 	struct verbs_context *vctx = verbs_get_ctx(context);
+	uint64_t start;
 
 	/*
 	 * One of the fill functions was given input that cannot be marshaled
@@ -144,8 +146,15 @@ int execute_ioctl(struct ibv_context *context, struct ibv_command_buffer *cmd)
 	cmd->hdr.reserved2 = 0;
 	cmd->hdr.driver_id = vctx->priv->driver_id;
 
-	if (ioctl(context->cmd_fd, RDMA_VERBS_IOCTL, &cmd->hdr))
+	start = verbs_trace_begin();
+	if (ioctl(context->cmd_fd, RDMA_VERBS_IOCTL, &cmd->hdr)) {
+		verbs_trace_end(VERBS_TRACE_CMD_IOCTL, start, errno);
+		VERBS_PROBE3(cmd_ioctl, cmd->hdr.object_id, cmd->hdr.method_id,
+			     errno);
 		return errno;
+	}
+	verbs_trace_end(VERBS_TRACE_CMD_IOCTL, start, 0);
+	VERBS_PROBE3(cmd_ioctl, cmd->hdr.object_id, cmd->hdr.method_id, 0);
 
 	finalize_attrs(cmd);
 
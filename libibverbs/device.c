@@ -42,11 +42,14 @@
 #include <stdlib.h>
 #include <alloca.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include <rdma/ib_user_ioctl_cmds.h>
+#include <ccan/minmax.h>
 #include <util/symver.h>
 #include <util/util.h>
 #include "ibverbs.h"
+#include "trace.h"
 
 static pthread_mutex_t dev_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct list_head device_list = LIST_HEAD_INIT(device_list);
@@ -195,21 +198,68 @@ __lib_ibv_create_cq_ex(struct ibv_context *context,
 		       struct ibv_cq_init_attr_ex *cq_attr)
 {
 	struct ibv_cq_ex *cq;
+	uint64_t start;
 
 	if (cq_attr->wc_flags & ~IBV_CREATE_CQ_SUP_WC_FLAGS) {
 		errno = EOPNOTSUPP;
 		return NULL;
 	}
 
+	start = verbs_trace_begin();
 	cq = get_ops(context)->create_cq_ex(context, cq_attr);
 
 	if (cq)
 		verbs_init_cq(ibv_cq_ex_to_cq(cq), context,
 			        cq_attr->channel, cq_attr->cq_context);
 
+	verbs_trace_end(VERBS_TRACE_CREATE_CQ, start, cq ? 0 : errno);
+	VERBS_PROBE3(create_cq_ex, context, cq_attr->cqe, cq);
 	return cq;
 }
 
+/*
+ * The extended create verbs below are inline in verbs.h and call through
+ * verbs_context, these wrappers give them the tracepoints of their basic
+ * counterparts.
+ */
+static struct ibv_qp *
+__lib_ibv_create_qp_ex(struct ibv_context *context,
+		       struct ibv_qp_init_attr_ex *qp_attr)
+{
+	uint64_t start = verbs_trace_begin();
+	struct ibv_qp *qp;
+
+	qp = get_ops(context)->create_qp_ex(context, qp_attr);
+
+	verbs_trace_end(VERBS_TRACE_CREATE_QP, start, qp ? 0 : errno);
+	VERBS_PROBE3(create_qp_ex, context, qp_attr->qp_type, qp);
+	return qp;
+}
+
+static struct ibv_wq *__lib_ibv_create_wq(struct ibv_context *context,
+					  struct ibv_wq_init_attr *wq_attr)
+{
+	uint64_t start = verbs_trace_begin();
+	struct ibv_wq *wq;
+
+	wq = get_ops(context)->create_wq(context, wq_attr);
+
+	verbs_trace_end(VERBS_TRACE_CREATE_WQ, start, wq ? 0 : errno);
+	VERBS_PROBE3(create_wq, context, wq_attr->wq_type, wq);
+	return wq;
+}
+
+static int __lib_ibv_destroy_wq(struct ibv_wq *wq)
+{
+	uint64_t start = verbs_trace_begin();
+	int ret;
+
+	VERBS_PROBE1(destroy_wq, wq);
+	ret = get_ops(wq->context)->destroy_wq(wq);
+	verbs_trace_end(VERBS_TRACE_DESTROY_WQ, start, ret);
+	return ret;
+}
+
 static bool has_ioctl_write(struct ibv_context *ctx)
 {
 	int rc;
@@ -322,6 +372,9 @@ err_free:
 static void set_lib_ops(struct verbs_context *vctx)
 {
 	vctx->create_cq_ex = __lib_ibv_create_cq_ex;
+	vctx->create_qp_ex = __lib_ibv_create_qp_ex;
+	vctx->create_wq = __lib_ibv_create_wq;
+	vctx->destroy_wq = __lib_ibv_destroy_wq;
 
 	/*
 	 * The compat symver entry point behaves identically to what used to
@@ -330,6 +383,8 @@ static void set_lib_ops(struct verbs_context *vctx)
 #undef ibv_query_port
 	vctx->context.ops._compat_query_port = ibv_query_port;
 	vctx->query_port = __lib_query_port;
+
+	verbs_trace_setup_context(vctx);
 }
 
 struct ibv_context *verbs_open_device(struct ibv_device *device, void *private_data)
@@ -385,21 +440,15 @@ LATEST_SYMVER_FUNC(ibv_close_device, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
-LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
-		   int,
-		   struct ibv_context *context,
-		   struct ibv_async_event *event)
+static void decode_async_event(struct ibv_context *context,
+			       const struct ib_uverbs_async_event_desc *ev,
+			       struct ibv_async_event *event)
 {
-	struct ib_uverbs_async_event_desc ev;
-
-	if (read(context->async_fd, &ev, sizeof ev) != sizeof ev)
-		return -1;
-
-	event->event_type = ev.event_type;
+	event->event_type = ev->event_type;
 
 	switch (event->event_type) {
 	case IBV_EVENT_CQ_ERR:
-		event->element.cq = (void *) (uintptr_t) ev.element;
+		event->element.cq = (void *) (uintptr_t) ev->element;
 		break;
 
 	case IBV_EVENT_QP_FATAL:
@@ -410,27 +459,85 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 	case IBV_EVENT_PATH_MIG:
 	case IBV_EVENT_PATH_MIG_ERR:
 	case IBV_EVENT_QP_LAST_WQE_REACHED:
-		event->element.qp = (void *) (uintptr_t) ev.element;
+		event->element.qp = (void *) (uintptr_t) ev->element;
 		break;
 
 	case IBV_EVENT_SRQ_ERR:
 	case IBV_EVENT_SRQ_LIMIT_REACHED:
-		event->element.srq = (void *) (uintptr_t) ev.element;
+		event->element.srq = (void *) (uintptr_t) ev->element;
 		break;
 
 	case IBV_EVENT_WQ_FATAL:
-		event->element.wq = (void *) (uintptr_t) ev.element;
+		event->element.wq = (void *) (uintptr_t) ev->element;
 		break;
 	default:
-		event->element.port_num = ev.element;
+		event->element.port_num = ev->element;
 		break;
 	}
 
 	get_ops(context)->async_event(context, event);
+}
+
+LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
+		   int,
+		   struct ibv_context *context,
+		   struct ibv_async_event *event)
+{
+	struct ib_uverbs_async_event_desc ev;
+
+	if (read(context->async_fd, &ev, sizeof ev) != sizeof ev)
+		return -1;
+
+	decode_async_event(context, &ev, event);
 
 	return 0;
 }
 
+/*
+ * The kernel returns a single event per read() on the async FD, but the FD
+ * only implements the plain read file operation so readv() is looped in
+ * the kernel over every iovec until one comes back short. With a
+ * non-blocking FD that drains the whole queue in one system call, the loop
+ * stops with EAGAIN once it is empty.
+ */
+#define ASYNC_EVENTS_BATCH 64
+
+int ibv_get_async_events(struct ibv_context *context,
+			 struct ibv_async_event *events, int num_events)
+{
+	struct ib_uverbs_async_event_desc ev[ASYNC_EVENTS_BATCH];
+	struct iovec iov[ASYNC_EVENTS_BATCH];
+	ssize_t len;
+	int flags;
+	int i, n;
+
+	if (num_events <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	flags = fcntl(context->async_fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+
+	/* A blocking readv() would wait for the whole array to fill up */
+	n = (flags & O_NONBLOCK) ? min(num_events, ASYNC_EVENTS_BATCH) : 1;
+	for (i = 0; i != n; i++) {
+		iov[i].iov_base = &ev[i];
+		iov[i].iov_len = sizeof(ev[i]);
+	}
+
+	len = readv(context->async_fd, iov, n);
+	if (len < (ssize_t)sizeof(ev[0]))
+		return -1;
+
+	n = len / sizeof(ev[0]);
+	for (i = 0; i != n; i++)
+		decode_async_event(context, &ev[i], &events[i]);
+
+	return n;
+}
+
 LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
 		   void,
 		   struct ibv_async_event *event)
@@ -0,0 +1,1515 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <malloc.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "pingpong.h"
+
+#include <ccan/array_size.h>
+#include <ccan/minmax.h>
+#include <util/util.h>
+
+/*
+ * Verbs microbenchmark. A server and a client instance exchange QP
+ * information over TCP, like the pingpong examples, and then run one of:
+ *
+ * lat - For sends each iteration is a ping-pong and half the round trip is
+ *       recorded. For RDMA write, read and atomics the client waits for the
+ *       completion of every operation and records its latency.
+ * bw  - The client keeps up to tx-depth operations in flight on every QP,
+ *       posted in chains of 'batch' work requests of which only the last
+ *       one is signaled, and reports bandwidth and message rate.
+ *
+ * Every thread owns a CQ and 'qps' QPs, the threads of both sides are paired
+ * up one to one.
+ */
+
+#define BENCH_GRH_SIZE 40
+#define BENCH_POLL_BATCH 16
+
+enum bench_test {
+	BENCH_TEST_LAT,
+	BENCH_TEST_BW,
+};
+
+enum bench_op {
+	BENCH_OP_SEND,
+	BENCH_OP_WRITE,
+	BENCH_OP_READ,
+	BENCH_OP_ATOMIC,
+};
+
+static const char *const test_names[] = {
+	[BENCH_TEST_LAT] = "lat",
+	[BENCH_TEST_BW] = "bw",
+};
+
+static const char *const op_names[] = {
+	[BENCH_OP_SEND] = "send",
+	[BENCH_OP_WRITE] = "write",
+	[BENCH_OP_READ] = "read",
+	[BENCH_OP_ATOMIC] = "atomic",
+};
+
+static const char *qp_type_str(enum ibv_qp_type type)
+{
+	switch (type) {
+	case IBV_QPT_UC:
+		return "uc";
+	case IBV_QPT_UD:
+		return "ud";
+	default:
+		return "rc";
+	}
+}
+
+struct bench_cfg {
+	enum bench_test test;
+	enum bench_op op;
+	enum ibv_qp_type qp_type;
+	unsigned int size;
+	unsigned int iters;
+	unsigned int threads;
+	unsigned int qps;
+	unsigned int tx_depth;
+	unsigned int rx_depth;
+	unsigned int batch;
+	unsigned int inline_size;
+	int use_new_send;
+	int use_cq_ex;
+	int json;
+	int ib_port;
+	enum ibv_mtu mtu;
+	int sl;
+	int gidx;
+};
+
+static struct bench_cfg cfg = {
+	.test = BENCH_TEST_LAT,
+	.op = BENCH_OP_SEND,
+	.qp_type = IBV_QPT_RC,
+	.size = 64,
+	.iters = 10000,
+	.threads = 1,
+	.qps = 1,
+	.tx_depth = 128,
+	.rx_depth = 512,
+	.batch = 1,
+	.inline_size = 0,
+	.ib_port = 1,
+	.mtu = IBV_MTU_1024,
+	.gidx = -1,
+};
+
+struct bench_dest {
+	int lid;
+	int qpn;
+	int psn;
+	union ibv_gid gid;
+	uint64_t addr;
+	uint32_t rkey;
+};
+
+struct bench_qp {
+	struct ibv_qp *qp;
+	struct ibv_qp_ex *qpx;
+	struct ibv_ah *ah;
+	char *send_buf;
+	char *recv_buf;
+	unsigned int outstanding;
+	uint64_t posted;
+	struct bench_dest local;
+	struct bench_dest remote;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct bench_ctx *ctx;
+	unsigned int id;
+	union {
+		struct ibv_cq *cq;
+		struct ibv_cq_ex *cq_ex;
+	} cq_s;
+	struct bench_qp *qps;
+	uint64_t *lat;
+	uint64_t msgs;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	int err;
+};
+
+struct bench_ctx {
+	struct ibv_context *context;
+	struct ibv_pd *pd;
+	struct ibv_mr *mr;
+	char *buf;
+	size_t slot_size;
+	struct ibv_port_attr portinfo;
+	struct bench_thread *threads;
+	volatile int stop;
+	int is_client;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int bench_connect_sock(const char *servername, int port)
+{
+	struct addrinfo *res, *t;
+	struct addrinfo hints = {
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	char *service;
+	int sockfd = -1;
+	int n;
+
+	if (asprintf(&service, "%d", port) < 0)
+		return -1;
+
+	n = getaddrinfo(servername, service, &hints, &res);
+	if (n < 0) {
+		fprintf(stderr, "%s for %s:%d\n", gai_strerror(n), servername,
+			port);
+		free(service);
+		return -1;
+	}
+
+	for (t = res; t; t = t->ai_next) {
+		sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
+		if (sockfd >= 0) {
+			if (!connect(sockfd, t->ai_addr, t->ai_addrlen))
+				break;
+			close(sockfd);
+			sockfd = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+	free(service);
+
+	if (sockfd < 0)
+		fprintf(stderr, "Couldn't connect to %s:%d\n", servername,
+			port);
+	return sockfd;
+}
+
+static int bench_accept_sock(int port)
+{
+	struct addrinfo *res, *t;
+	struct addrinfo hints = {
+		.ai_flags    = AI_PASSIVE,
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	char *service;
+	int sockfd = -1, connfd;
+	int n;
+
+	if (asprintf(&service, "%d", port) < 0)
+		return -1;
+
+	n = getaddrinfo(NULL, service, &hints, &res);
+	if (n < 0) {
+		fprintf(stderr, "%s for port %d\n", gai_strerror(n), port);
+		free(service);
+		return -1;
+	}
+
+	for (t = res; t; t = t->ai_next) {
+		sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
+		if (sockfd >= 0) {
+			n = 1;
+
+			setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &n,
+				   sizeof(n));
+
+			if (!bind(sockfd, t->ai_addr, t->ai_addrlen))
+				break;
+			close(sockfd);
+			sockfd = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+	free(service);
+
+	if (sockfd < 0) {
+		fprintf(stderr, "Couldn't listen to port %d\n", port);
+		return -1;
+	}
+
+	listen(sockfd, 1);
+	connfd = accept(sockfd, NULL, NULL);
+	close(sockfd);
+	if (connfd < 0)
+		fprintf(stderr, "accept() failed\n");
+	return connfd;
+}
+
+#define BENCH_CFG_MSG_SIZE 128
+#define BENCH_DEST_MSG_SIZE                                                    \
+	sizeof("0000:000000:000000:0000000000000000:00000000:"                \
+	       "00000000000000000000000000000000")
+
+static void bench_cfg_to_msg(char *msg)
+{
+	memset(msg, 0, BENCH_CFG_MSG_SIZE);
+	snprintf(msg, BENCH_CFG_MSG_SIZE, "%d:%d:%d:%u:%u:%u:%u:%u", cfg.test,
+		 cfg.op, cfg.qp_type, cfg.size, cfg.iters, cfg.threads,
+		 cfg.qps, cfg.batch);
+}
+
+static int bench_exch_dest(struct bench_ctx *ctx, int sockfd)
+{
+	unsigned int num = cfg.threads * cfg.qps;
+	char msg[BENCH_DEST_MSG_SIZE];
+	char gid[33];
+	unsigned int i;
+	int pass;
+
+	/* The client sends first, the server answers */
+	for (pass = 0; pass != 2; pass++) {
+		bool sending = (pass == 0) == ctx->is_client;
+
+		for (i = 0; i != num; i++) {
+			struct bench_qp *bqp =
+				&ctx->threads[i / cfg.qps].qps[i % cfg.qps];
+
+			if (sending) {
+				gid_to_wire_gid(&bqp->local.gid, gid);
+				snprintf(msg, sizeof(msg),
+					 "%04x:%06x:%06x:%016" PRIx64 ":%08x:%s",
+					 bqp->local.lid, bqp->local.qpn,
+					 bqp->local.psn, bqp->local.addr,
+					 bqp->local.rkey, gid);
+				if (write_all(sockfd, msg, sizeof(msg)))
+					return 1;
+				continue;
+			}
+
+			if (read_all(sockfd, msg, sizeof(msg)))
+				return 1;
+			sscanf(msg, "%x:%x:%x:%" SCNx64 ":%x:%32s",
+			       &bqp->remote.lid, &bqp->remote.qpn,
+			       &bqp->remote.psn, &bqp->remote.addr,
+			       &bqp->remote.rkey, gid);
+			wire_gid_to_gid(gid, &bqp->remote.gid);
+		}
+	}
+
+	return 0;
+}
+
+static struct ibv_cq *bench_cq(struct bench_thread *thr)
+{
+	return cfg.use_cq_ex ? ibv_cq_ex_to_cq(thr->cq_s.cq_ex) : thr->cq_s.cq;
+}
+
+/*
+ * Poll through ibv_poll_cq() or the extended CQ API, only the fields the
+ * benchmark looks at are filled in.
+ */
+static int bench_poll_cq(struct bench_thread *thr, int num, struct ibv_wc *wc)
+{
+	struct ibv_poll_cq_attr attr = {};
+	struct ibv_cq_ex *cq_ex = thr->cq_s.cq_ex;
+	int ne = 0;
+	int ret;
+
+	if (!cfg.use_cq_ex)
+		return ibv_poll_cq(thr->cq_s.cq, num, wc);
+
+	ret = ibv_start_poll(cq_ex, &attr);
+	if (ret)
+		return ret == ENOENT ? 0 : -ret;
+
+	do {
+		wc[ne].wr_id = cq_ex->wr_id;
+		wc[ne].status = cq_ex->status;
+		wc[ne].opcode = ibv_wc_read_opcode(cq_ex);
+		if (++ne == num)
+			break;
+		ret = ibv_next_poll(cq_ex);
+	} while (!ret);
+
+	ibv_end_poll(cq_ex);
+
+	if (ret && ret != ENOENT)
+		return -ret;
+	return ne;
+}
+
+static int bench_init_qp(struct bench_ctx *ctx, struct bench_thread *thr,
+			 struct bench_qp *bqp, unsigned int idx)
+{
+	struct ibv_qp_init_attr_ex init_attr = {
+		.send_cq = bench_cq(thr),
+		.recv_cq = bench_cq(thr),
+		.cap = {
+			.max_send_wr = cfg.tx_depth,
+			.max_recv_wr = cfg.rx_depth,
+			.max_send_sge = 1,
+			.max_recv_sge = 1,
+			.max_inline_data = cfg.inline_size,
+		},
+		.qp_type = cfg.qp_type,
+		.comp_mask = IBV_QP_INIT_ATTR_PD,
+		.pd = ctx->pd,
+	};
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_INIT,
+		.pkey_index = 0,
+		.port_num = cfg.ib_port,
+	};
+	int mask = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT;
+
+	if (cfg.use_new_send) {
+		init_attr.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+		switch (cfg.op) {
+		case BENCH_OP_SEND:
+			init_attr.send_ops_flags = IBV_QP_EX_WITH_SEND;
+			break;
+		case BENCH_OP_WRITE:
+			init_attr.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE;
+			break;
+		case BENCH_OP_READ:
+			init_attr.send_ops_flags = IBV_QP_EX_WITH_RDMA_READ;
+			break;
+		case BENCH_OP_ATOMIC:
+			init_attr.send_ops_flags =
+				IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
+			break;
+		}
+	}
+
+	bqp->send_buf = ctx->buf + (2 * idx) * ctx->slot_size;
+	bqp->recv_buf = ctx->buf + (2 * idx + 1) * ctx->slot_size;
+
+	bqp->qp = ibv_create_qp_ex(ctx->context, &init_attr);
+	if (!bqp->qp) {
+		fprintf(stderr, "Couldn't create QP\n");
+		return 1;
+	}
+
+	if (cfg.use_new_send) {
+		bqp->qpx = ibv_qp_to_qp_ex(bqp->qp);
+		if (!bqp->qpx) {
+			fprintf(stderr, "Couldn't get the extended QP\n");
+			return 1;
+		}
+	}
+
+	switch (cfg.qp_type) {
+	case IBV_QPT_UD:
+		attr.qkey = 0x11111111;
+		mask |= IBV_QP_QKEY;
+		break;
+	case IBV_QPT_UC:
+		attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE;
+		mask |= IBV_QP_ACCESS_FLAGS;
+		break;
+	default:
+		attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE |
+				       IBV_ACCESS_REMOTE_READ |
+				       IBV_ACCESS_REMOTE_ATOMIC;
+		mask |= IBV_QP_ACCESS_FLAGS;
+		break;
+	}
+
+	if (ibv_modify_qp(bqp->qp, &attr, mask)) {
+		fprintf(stderr, "Failed to modify QP to INIT\n");
+		return 1;
+	}
+
+	bqp->local.lid = ctx->portinfo.lid;
+	bqp->local.qpn = bqp->qp->qp_num;
+	bqp->local.psn = lrand48() & 0xffffff;
+	bqp->local.addr = (uintptr_t)bqp->recv_buf;
+	bqp->local.rkey = ctx->mr->rkey;
+	if (cfg.gidx >= 0) {
+		if (ibv_query_gid(ctx->context, cfg.ib_port, cfg.gidx,
+				  &bqp->local.gid)) {
+			fprintf(stderr, "can't read sgid of index %d\n",
+				cfg.gidx);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int bench_connect_qp(struct bench_ctx *ctx, struct bench_qp *bqp)
+{
+	struct ibv_ah_attr ah_attr = {
+		.is_global = 0,
+		.dlid = bqp->remote.lid,
+		.sl = cfg.sl,
+		.src_path_bits = 0,
+		.port_num = cfg.ib_port,
+	};
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_RTR,
+		.path_mtu = cfg.mtu,
+		.dest_qp_num = bqp->remote.qpn,
+		.rq_psn = bqp->remote.psn,
+		.max_dest_rd_atomic = 16,
+		.min_rnr_timer = 12,
+	};
+	int mask = IBV_QP_STATE;
+
+	if (bqp->remote.gid.global.interface_id) {
+		ah_attr.is_global = 1;
+		ah_attr.grh.hop_limit = 1;
+		ah_attr.grh.dgid = bqp->remote.gid;
+		ah_attr.grh.sgid_index = cfg.gidx;
+	}
+
+	if (cfg.qp_type != IBV_QPT_UD) {
+		attr.ah_attr = ah_attr;
+		mask |= IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+			IBV_QP_RQ_PSN;
+		if (cfg.qp_type == IBV_QPT_RC)
+			mask |= IBV_QP_MAX_DEST_RD_ATOMIC |
+				IBV_QP_MIN_RNR_TIMER;
+	}
+
+	if (ibv_modify_qp(bqp->qp, &attr, mask)) {
+		fprintf(stderr, "Failed to modify QP to RTR\n");
+		return 1;
+	}
+
+	attr.qp_state = IBV_QPS_RTS;
+	attr.sq_psn = bqp->local.psn;
+	attr.timeout = 14;
+	attr.retry_cnt = 7;
+	attr.rnr_retry = 7;
+	attr.max_rd_atomic = 16;
+	mask = IBV_QP_STATE | IBV_QP_SQ_PSN;
+	if (cfg.qp_type == IBV_QPT_RC)
+		mask |= IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+			IBV_QP_MAX_QP_RD_ATOMIC;
+
+	if (ibv_modify_qp(bqp->qp, &attr, mask)) {
+		fprintf(stderr, "Failed to modify QP to RTS\n");
+		return 1;
+	}
+
+	if (cfg.qp_type == IBV_QPT_UD) {
+		bqp->ah = ibv_create_ah(ctx->pd, &ah_attr);
+		if (!bqp->ah) {
+			fprintf(stderr, "Failed to create AH\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int bench_post_recv(struct bench_ctx *ctx, struct bench_qp *bqp,
+			   uint64_t wr_id, unsigned int n)
+{
+	struct ibv_sge sge = {
+		.addr = (uintptr_t)bqp->recv_buf,
+		.length = cfg.size + BENCH_GRH_SIZE,
+		.lkey = ctx->mr->lkey,
+	};
+	struct ibv_recv_wr wr = {
+		.wr_id = wr_id,
+		.sg_list = &sge,
+		.num_sge = 1,
+	};
+	struct ibv_recv_wr *bad_wr;
+	unsigned int i;
+
+	for (i = 0; i != n; i++)
+		if (ibv_post_recv(bqp->qp, &wr, &bad_wr))
+			return 1;
+	return 0;
+}
+
+static unsigned int bench_send_flags(void)
+{
+	unsigned int flags = 0;
+
+	if (cfg.inline_size && cfg.size <= cfg.inline_size &&
+	    (cfg.op == BENCH_OP_SEND || cfg.op == BENCH_OP_WRITE))
+		flags |= IBV_SEND_INLINE;
+	return flags;
+}
+
+static int bench_post_wr_api(struct bench_ctx *ctx, struct bench_qp *bqp,
+			     uint64_t wr_id, unsigned int n)
+{
+	struct ibv_qp_ex *qpx = bqp->qpx;
+	unsigned int flags = bench_send_flags();
+	unsigned int i;
+
+	ibv_wr_start(qpx);
+	for (i = 0; i != n; i++) {
+		qpx->wr_id = wr_id;
+		qpx->wr_flags = i == n - 1 ? IBV_SEND_SIGNALED : 0;
+
+		switch (cfg.op) {
+		case BENCH_OP_SEND:
+			ibv_wr_send(qpx);
+			break;
+		case BENCH_OP_WRITE:
+			ibv_wr_rdma_write(qpx, bqp->remote.rkey,
+					  bqp->remote.addr);
+			break;
+		case BENCH_OP_READ:
+			ibv_wr_rdma_read(qpx, bqp->remote.rkey,
+					 bqp->remote.addr);
+			break;
+		case BENCH_OP_ATOMIC:
+			ibv_wr_atomic_fetch_add(qpx, bqp->remote.rkey,
+						bqp->remote.addr, 1);
+			break;
+		}
+
+		if (cfg.qp_type == IBV_QPT_UD)
+			ibv_wr_set_ud_addr(qpx, bqp->ah, bqp->remote.qpn,
+					   0x11111111);
+
+		if (flags & IBV_SEND_INLINE)
+			ibv_wr_set_inline_data(qpx, bqp->send_buf, cfg.size);
+		else
+			ibv_wr_set_sge(qpx, ctx->mr->lkey,
+				       (uintptr_t)bqp->send_buf,
+				       cfg.op == BENCH_OP_ATOMIC ? 8 : cfg.size);
+	}
+
+	return ibv_wr_complete(qpx);
+}
+
+static int bench_post_legacy(struct bench_ctx *ctx, struct bench_qp *bqp,
+			     uint64_t wr_id, unsigned int n)
+{
+	struct ibv_send_wr wrs[n];
+	struct ibv_sge sge = {
+		.addr = (uintptr_t)bqp->send_buf,
+		.length = cfg.op == BENCH_OP_ATOMIC ? 8 : cfg.size,
+		.lkey = ctx->mr->lkey,
+	};
+	struct ibv_send_wr *bad_wr;
+	unsigned int flags = bench_send_flags();
+	unsigned int i;
+
+	memset(wrs, 0, sizeof(wrs));
+	for (i = 0; i != n; i++) {
+		struct ibv_send_wr *wr = &wrs[i];
+
+		wr->wr_id = wr_id;
+		wr->sg_list = &sge;
+		wr->num_sge = 1;
+		wr->send_flags = flags;
+		if (i == n - 1)
+			wr->send_flags |= IBV_SEND_SIGNALED;
+		else
+			wr->next = &wrs[i + 1];
+
+		switch (cfg.op) {
+		case BENCH_OP_SEND:
+			wr->opcode = IBV_WR_SEND;
+			break;
+		case BENCH_OP_WRITE:
+			wr->opcode = IBV_WR_RDMA_WRITE;
+			wr->wr.rdma.remote_addr = bqp->remote.addr;
+			wr->wr.rdma.rkey = bqp->remote.rkey;
+			break;
+		case BENCH_OP_READ:
+			wr->opcode = IBV_WR_RDMA_READ;
+			wr->wr.rdma.remote_addr = bqp->remote.addr;
+			wr->wr.rdma.rkey = bqp->remote.rkey;
+			break;
+		case BENCH_OP_ATOMIC:
+			wr->opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+			wr->wr.atomic.remote_addr = bqp->remote.addr;
+			wr->wr.atomic.rkey = bqp->remote.rkey;
+			wr->wr.atomic.compare_add = 1;
+			break;
+		}
+
+		if (cfg.qp_type == IBV_QPT_UD) {
+			wr->wr.ud.ah = bqp->ah;
+			wr->wr.ud.remote_qpn = bqp->remote.qpn;
+			wr->wr.ud.remote_qkey = 0x11111111;
+		}
+	}
+
+	return ibv_post_send(bqp->qp, wrs, &bad_wr);
+}
+
+/* Post a chain of n work requests, only the last one is signaled */
+static int bench_post_send(struct bench_ctx *ctx, struct bench_qp *bqp,
+			   uint64_t wr_id, unsigned int n)
+{
+	if (cfg.use_new_send)
+		return bench_post_wr_api(ctx, bqp, wr_id, n);
+	return bench_post_legacy(ctx, bqp, wr_id, n);
+}
+
+static int bench_check_wc(struct ibv_wc *wc)
+{
+	if (wc->status != IBV_WC_SUCCESS) {
+		fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+			ibv_wc_status_str(wc->status), wc->status,
+			(int)wc->wr_id);
+		return 1;
+	}
+	return 0;
+}
+
+/* Wait for the next successful completion on the thread CQ */
+static int bench_wait_wc(struct bench_thread *thr, struct ibv_wc *wc)
+{
+	int ne;
+
+	while (!thr->ctx->stop) {
+		ne = bench_poll_cq(thr, 1, wc);
+		if (ne < 0) {
+			fprintf(stderr, "poll CQ failed %d\n", ne);
+			return 1;
+		}
+		if (ne)
+			return bench_check_wc(wc);
+	}
+	return 1;
+}
+
+/*
+ * Send and receive completions share the CQ and may arrive in any order, e.g.
+ * the pong can be received before the ping send completes. Track both kinds
+ * and repost the receive buffer as soon as its completion is reaped.
+ */
+static int bench_lat_send(struct bench_thread *thr)
+{
+	struct bench_ctx *ctx = thr->ctx;
+	unsigned int sends = 0, i = 0;
+	bool recv_pending = false;
+	uint64_t start = 0;
+	struct ibv_wc wc;
+
+	for (;;) {
+		if (ctx->is_client && !sends && !recv_pending) {
+			if (i)
+				thr->lat[i - 1] = (now_ns() - start) / 2;
+			if (i == cfg.iters)
+				break;
+
+			start = now_ns();
+			if (bench_post_send(ctx, &thr->qps[i % cfg.qps],
+					    i % cfg.qps, 1))
+				return 1;
+			sends++;
+			recv_pending = true;
+			i++;
+		}
+		if (!ctx->is_client && i == cfg.iters && !sends)
+			break;
+
+		if (bench_wait_wc(thr, &wc))
+			return 1;
+
+		if (!(wc.opcode & IBV_WC_RECV)) {
+			sends--;
+			continue;
+		}
+
+		if (bench_post_recv(ctx, &thr->qps[wc.wr_id], wc.wr_id, 1))
+			return 1;
+
+		if (ctx->is_client) {
+			recv_pending = false;
+		} else {
+			if (bench_post_send(ctx, &thr->qps[wc.wr_id],
+					    wc.wr_id, 1))
+				return 1;
+			sends++;
+			i++;
+		}
+	}
+
+	thr->msgs = cfg.iters;
+	return 0;
+}
+
+static int bench_lat_rdma(struct bench_thread *thr)
+{
+	struct bench_ctx *ctx = thr->ctx;
+	unsigned int i;
+
+	for (i = 0; i != cfg.iters; i++) {
+		struct bench_qp *bqp = &thr->qps[i % cfg.qps];
+		uint64_t start = now_ns();
+		struct ibv_wc wc;
+
+		if (bench_post_send(ctx, bqp, i % cfg.qps, 1) ||
+		    bench_wait_wc(thr, &wc))
+			return 1;
+		thr->lat[i] = now_ns() - start;
+	}
+
+	thr->msgs = cfg.iters;
+	return 0;
+}
+
+static int bench_bw_client(struct bench_thread *thr)
+{
+	struct bench_ctx *ctx = thr->ctx;
+	struct ibv_wc wc[BENCH_POLL_BATCH];
+	uint64_t completed = 0;
+	uint64_t total = (uint64_t)cfg.iters * cfg.qps;
+	unsigned int q, n;
+	int ne, i;
+
+	while (completed < total) {
+		for (q = 0; q != cfg.qps; q++) {
+			struct bench_qp *bqp = &thr->qps[q];
+
+			n = min_t(uint64_t, cfg.batch, cfg.iters - bqp->posted);
+			if (!n || bqp->outstanding + n > cfg.tx_depth)
+				continue;
+
+			if (bench_post_send(ctx, bqp, q, n)) {
+				fprintf(stderr, "Couldn't post send\n");
+				return 1;
+			}
+			bqp->outstanding += n;
+			bqp->posted += n;
+		}
+
+		ne = bench_poll_cq(thr, BENCH_POLL_BATCH, wc);
+		if (ne < 0) {
+			fprintf(stderr, "poll CQ failed %d\n", ne);
+			return 1;
+		}
+
+		for (i = 0; i < ne; i++) {
+			struct bench_qp *bqp = &thr->qps[wc[i].wr_id];
+
+			if (bench_check_wc(&wc[i]))
+				return 1;
+
+			/* Each completion retires one whole chain */
+			n = min_t(unsigned int, cfg.batch, bqp->outstanding);
+			bqp->outstanding -= n;
+			completed += n;
+		}
+	}
+
+	thr->msgs = completed;
+	return 0;
+}
+
+static int bench_bw_server(struct bench_thread *thr)
+{
+	struct bench_ctx *ctx = thr->ctx;
+	struct ibv_wc wc[BENCH_POLL_BATCH];
+	uint64_t total = (uint64_t)cfg.iters * cfg.qps;
+	int ne, i;
+
+	while (thr->msgs < total && !ctx->stop) {
+		ne = bench_poll_cq(thr, BENCH_POLL_BATCH, wc);
+		if (ne < 0) {
+			fprintf(stderr, "poll CQ failed %d\n", ne);
+			return 1;
+		}
+
+		for (i = 0; i < ne; i++) {
+			if (bench_check_wc(&wc[i]))
+				return 1;
+			if (!thr->msgs)
+				thr->start_ns = now_ns();
+			thr->msgs++;
+			if (bench_post_recv(ctx, &thr->qps[wc[i].wr_id],
+					    wc[i].wr_id, 1))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *bench_thread_run(void *arg)
+{
+	struct bench_thread *thr = arg;
+	struct bench_ctx *ctx = thr->ctx;
+	int ret = 0;
+
+	thr->start_ns = now_ns();
+
+	if (cfg.test == BENCH_TEST_LAT) {
+		if (cfg.op == BENCH_OP_SEND)
+			ret = bench_lat_send(thr);
+		else if (ctx->is_client)
+			ret = bench_lat_rdma(thr);
+	} else {
+		if (ctx->is_client)
+			ret = bench_bw_client(thr);
+		else if (cfg.op == BENCH_OP_SEND)
+			ret = bench_bw_server(thr);
+	}
+
+	thr->end_ns = now_ns();
+	/* A server stopped by the client has nothing left to receive */
+	thr->err = ret && !ctx->stop;
+	return NULL;
+}
+
+static struct bench_ctx *bench_init_ctx(struct ibv_device *ib_dev)
+{
+	unsigned int nqps = cfg.threads * cfg.qps;
+	struct bench_ctx *ctx;
+	int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+		     IBV_ACCESS_REMOTE_READ;
+	unsigned int t, q;
+
+	if (cfg.op == BENCH_OP_ATOMIC)
+		access |= IBV_ACCESS_REMOTE_ATOMIC;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->context = ibv_open_device(ib_dev);
+	if (!ctx->context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+			ibv_get_device_name(ib_dev));
+		return NULL;
+	}
+
+	if (pp_get_port_info(ctx->context, cfg.ib_port, &ctx->portinfo)) {
+		fprintf(stderr, "Couldn't get port info\n");
+		return NULL;
+	}
+
+	if (ctx->portinfo.link_layer != IBV_LINK_LAYER_ETHERNET &&
+	    !ctx->portinfo.lid) {
+		fprintf(stderr, "Couldn't get local LID\n");
+		return NULL;
+	}
+
+	ctx->pd = ibv_alloc_pd(ctx->context);
+	if (!ctx->pd) {
+		fprintf(stderr, "Couldn't allocate PD\n");
+		return NULL;
+	}
+
+	ctx->slot_size = align(cfg.size + BENCH_GRH_SIZE, 64);
+	ctx->buf = memalign(sysconf(_SC_PAGESIZE), 2 * nqps * ctx->slot_size);
+	if (!ctx->buf) {
+		fprintf(stderr, "Couldn't allocate work buf.\n");
+		return NULL;
+	}
+	memset(ctx->buf, 0x7b, 2 * nqps * ctx->slot_size);
+
+	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, 2 * nqps * ctx->slot_size,
+			     access);
+	if (!ctx->mr) {
+		fprintf(stderr, "Couldn't register MR\n");
+		return NULL;
+	}
+
+	ctx->threads = calloc(cfg.threads, sizeof(*ctx->threads));
+	if (!ctx->threads)
+		return NULL;
+
+	for (t = 0; t != cfg.threads; t++) {
+		struct bench_thread *thr = &ctx->threads[t];
+
+		thr->ctx = ctx;
+		thr->id = t;
+		thr->qps = calloc(cfg.qps, sizeof(*thr->qps));
+		thr->lat = calloc(cfg.iters, sizeof(*thr->lat));
+		if (!thr->qps || !thr->lat)
+			return NULL;
+
+		if (cfg.use_cq_ex) {
+			struct ibv_cq_init_attr_ex attr_ex = {
+				.cqe = cfg.qps * (cfg.tx_depth + cfg.rx_depth),
+			};
+
+			thr->cq_s.cq_ex = ibv_create_cq_ex(ctx->context,
+							   &attr_ex);
+		} else {
+			thr->cq_s.cq = ibv_create_cq(ctx->context,
+					cfg.qps * (cfg.tx_depth + cfg.rx_depth),
+					NULL, NULL, 0);
+		}
+		if (!thr->cq_s.cq) {
+			fprintf(stderr, "Couldn't create CQ\n");
+			return NULL;
+		}
+
+		for (q = 0; q != cfg.qps; q++)
+			if (bench_init_qp(ctx, thr, &thr->qps[q],
+					  t * cfg.qps + q))
+				return NULL;
+	}
+
+	return ctx;
+}
+
+static void bench_close_ctx(struct bench_ctx *ctx)
+{
+	unsigned int t, q;
+
+	for (t = 0; t != cfg.threads; t++) {
+		struct bench_thread *thr = &ctx->threads[t];
+
+		for (q = 0; q != cfg.qps; q++) {
+			if (thr->qps[q].ah)
+				ibv_destroy_ah(thr->qps[q].ah);
+			ibv_destroy_qp(thr->qps[q].qp);
+		}
+		ibv_destroy_cq(bench_cq(thr));
+		free(thr->qps);
+		free(thr->lat);
+	}
+	free(ctx->threads);
+	ibv_dereg_mr(ctx->mr);
+	ibv_dealloc_pd(ctx->pd);
+	ibv_close_device(ctx->context);
+	free(ctx->buf);
+	free(ctx);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+struct bench_lat_stats {
+	double min, avg, p50, p90, p99, p999, max;
+};
+
+static void bench_lat_stats(uint64_t *lat, size_t n,
+			    struct bench_lat_stats *st)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	memset(st, 0, sizeof(*st));
+	if (!n)
+		return;
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	for (i = 0; i != n; i++)
+		sum += lat[i];
+
+	st->min = lat[0] / 1000.;
+	st->max = lat[n - 1] / 1000.;
+	st->avg = (double)sum / n / 1000.;
+	st->p50 = lat[(n - 1) * 50 / 100] / 1000.;
+	st->p90 = lat[(n - 1) * 90 / 100] / 1000.;
+	st->p99 = lat[(n - 1) * 99 / 100] / 1000.;
+	st->p999 = lat[(n - 1) * 999 / 1000] / 1000.;
+}
+
+static void bench_report(struct bench_ctx *ctx)
+{
+	size_t nlat = (size_t)cfg.iters * cfg.threads;
+	uint64_t start = UINT64_MAX, end = 0, msgs = 0;
+	struct bench_lat_stats st;
+	uint64_t *lat = NULL;
+	double secs, bytes;
+	unsigned int t;
+
+	for (t = 0; t != cfg.threads; t++) {
+		struct bench_thread *thr = &ctx->threads[t];
+
+		start = min(start, thr->start_ns);
+		end = max(end, thr->end_ns);
+		msgs += thr->msgs;
+	}
+	secs = (end - start) / 1e9;
+	bytes = (double)msgs * (cfg.op == BENCH_OP_ATOMIC ? 8 : cfg.size);
+
+	if (cfg.test == BENCH_TEST_LAT) {
+		lat = malloc(nlat * sizeof(*lat));
+		if (!lat)
+			return;
+		for (t = 0; t != cfg.threads; t++)
+			memcpy(lat + (size_t)t * cfg.iters,
+			       ctx->threads[t].lat,
+			       cfg.iters * sizeof(*lat));
+		bench_lat_stats(lat, nlat, &st);
+		free(lat);
+	}
+
+	if (!cfg.json) {
+		printf("%s %s %s%s%s: %u threads x %u QPs, %u bytes, %" PRIu64 " messages in %.3f seconds\n",
+		       test_names[cfg.test], op_names[cfg.op],
+		       qp_type_str(cfg.qp_type),
+		       cfg.use_new_send ? " (ibv_wr_*)" : "",
+		       cfg.use_cq_ex ? " (ibv_start_poll)" : "", cfg.threads,
+		       cfg.qps, cfg.size, msgs, secs);
+		if (cfg.test == BENCH_TEST_LAT)
+			printf("latency usec: min %.2f avg %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+			       st.min, st.avg, st.p50, st.p90, st.p99, st.p999,
+			       st.max);
+		else
+			printf("%.2f MB/sec, %.3f Mmsg/sec\n",
+			       bytes / secs / 1e6, msgs / secs / 1e6);
+		return;
+	}
+
+	printf("{\"test\": \"%s\", \"op\": \"%s\", \"qp_type\": \"%s\", \"api\": \"%s\", \"cq\": \"%s\", ",
+	       test_names[cfg.test], op_names[cfg.op],
+	       qp_type_str(cfg.qp_type),
+	       cfg.use_new_send ? "wr" : "post_send",
+	       cfg.use_cq_ex ? "cq_ex" : "poll_cq");
+	printf("\"size\": %u, \"iters\": %u, \"threads\": %u, \"qps_per_thread\": %u, \"tx_depth\": %u, \"batch\": %u, \"inline\": %u, ",
+	       cfg.size, cfg.iters, cfg.threads, cfg.qps, cfg.tx_depth,
+	       cfg.batch, cfg.inline_size);
+	printf("\"messages\": %" PRIu64 ", \"seconds\": %.6f, \"bw_MBps\": %.3f, \"msg_rate_Mpps\": %.6f",
+	       msgs, secs, bytes / secs / 1e6, msgs / secs / 1e6);
+	if (cfg.test == BENCH_TEST_LAT)
+		printf(", \"lat_usec\": {\"min\": %.3f, \"avg\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p99.9\": %.3f, \"max\": %.3f}",
+		       st.min, st.avg, st.p50, st.p90, st.p99, st.p999,
+		       st.max);
+	printf(", \"per_thread\": [");
+	for (t = 0; t != cfg.threads; t++) {
+		struct bench_thread *thr = &ctx->threads[t];
+		double tsecs = (thr->end_ns - thr->start_ns) / 1e9;
+
+		printf("%s{\"messages\": %" PRIu64 ", \"seconds\": %.6f, \"msg_rate_Mpps\": %.6f}",
+		       t ? ", " : "", thr->msgs, tsecs,
+		       tsecs ? thr->msgs / tsecs / 1e6 : 0);
+	}
+	printf("]}\n");
+}
+
+static int parse_enum(const char *arg, const char *const *names,
+		      unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i != num; i++)
+		if (!strcmp(arg, names[i]))
+			return i;
+	return -1;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            start a server and wait for connection\n", argv0);
+	printf("  %s <host>     connect to server at <host>\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -p, --port=<port>      listen on/connect to port <port> (default 18515)\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+	printf("  -T, --test=<test>      lat or bw (default lat)\n");
+	printf("  -o, --op=<op>          send, write, read or atomic (default send)\n");
+	printf("  -q, --qp-type=<type>   rc, uc or ud (default rc)\n");
+	printf("  -s, --size=<size>      size of message to exchange (default 64)\n");
+	printf("  -m, --mtu=<size>       path MTU (default 1024)\n");
+	printf("  -n, --iters=<iters>    number of messages per QP (default 10000)\n");
+	printf("  -t, --threads=<num>    number of threads (default 1)\n");
+	printf("  -Q, --qps=<num>        number of QPs per thread (default 1)\n");
+	printf("  -D, --tx-depth=<dep>   send queue depth (default 128)\n");
+	printf("  -r, --rx-depth=<dep>   number of receives to post per QP (default 512)\n");
+	printf("  -b, --batch=<num>      work requests per post, bw test only (default 1)\n");
+	printf("  -I, --inline=<size>    max inline data size (default 0)\n");
+	printf("  -l, --sl=<sl>          service level value\n");
+	printf("  -g, --gid-idx=<gid index> local port gid index\n");
+	printf("  -N, --new_send         use new post send WR API\n");
+	printf("  -x, --cq-ex            poll with the extended CQ API\n");
+	printf("  -j, --json             print the results as JSON\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_device      **dev_list;
+	struct ibv_device	*ib_dev;
+	struct bench_ctx	*ctx;
+	char                    *ib_devname = NULL;
+	char                    *servername = NULL;
+	unsigned int             port = 18515;
+	char			 msg[BENCH_CFG_MSG_SIZE];
+	char			 rmsg[BENCH_CFG_MSG_SIZE];
+	unsigned int		 t, q;
+	int			 sockfd;
+	int			 ret = 0;
+
+	srand48(getpid() * time(NULL));
+
+	while (1) {
+		int c;
+
+		static struct option long_options[] = {
+			{ .name = "port",     .has_arg = 1, .val = 'p' },
+			{ .name = "ib-dev",   .has_arg = 1, .val = 'd' },
+			{ .name = "ib-port",  .has_arg = 1, .val = 'i' },
+			{ .name = "test",     .has_arg = 1, .val = 'T' },
+			{ .name = "op",       .has_arg = 1, .val = 'o' },
+			{ .name = "qp-type",  .has_arg = 1, .val = 'q' },
+			{ .name = "size",     .has_arg = 1, .val = 's' },
+			{ .name = "mtu",      .has_arg = 1, .val = 'm' },
+			{ .name = "iters",    .has_arg = 1, .val = 'n' },
+			{ .name = "threads",  .has_arg = 1, .val = 't' },
+			{ .name = "qps",      .has_arg = 1, .val = 'Q' },
+			{ .name = "tx-depth", .has_arg = 1, .val = 'D' },
+			{ .name = "rx-depth", .has_arg = 1, .val = 'r' },
+			{ .name = "batch",    .has_arg = 1, .val = 'b' },
+			{ .name = "inline",   .has_arg = 1, .val = 'I' },
+			{ .name = "sl",       .has_arg = 1, .val = 'l' },
+			{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
+			{ .name = "new_send", .has_arg = 0, .val = 'N' },
+			{ .name = "cq-ex",    .has_arg = 0, .val = 'x' },
+			{ .name = "json",     .has_arg = 0, .val = 'j' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "p:d:i:T:o:q:s:m:n:t:Q:D:r:b:I:l:g:Nxj",
+				long_options, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'p':
+			port = strtoul(optarg, NULL, 0);
+			if (port > 65535) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'd':
+			ib_devname = strdupa(optarg);
+			break;
+
+		case 'i':
+			cfg.ib_port = strtol(optarg, NULL, 0);
+			if (cfg.ib_port < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'T':
+			ret = parse_enum(optarg, test_names,
+					 ARRAY_SIZE(test_names));
+			if (ret < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			cfg.test = ret;
+			break;
+
+		case 'o':
+			ret = parse_enum(optarg, op_names, ARRAY_SIZE(op_names));
+			if (ret < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			cfg.op = ret;
+			break;
+
+		case 'q':
+			if (!strcmp(optarg, "rc"))
+				cfg.qp_type = IBV_QPT_RC;
+			else if (!strcmp(optarg, "uc"))
+				cfg.qp_type = IBV_QPT_UC;
+			else if (!strcmp(optarg, "ud"))
+				cfg.qp_type = IBV_QPT_UD;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 's':
+			cfg.size = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'm':
+			cfg.mtu = pp_mtu_to_enum(strtol(optarg, NULL, 0));
+			if (cfg.mtu == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'n':
+			cfg.iters = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			cfg.threads = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'Q':
+			cfg.qps = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'D':
+			cfg.tx_depth = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			cfg.rx_depth = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'b':
+			cfg.batch = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'I':
+			cfg.inline_size = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'l':
+			cfg.sl = strtol(optarg, NULL, 0);
+			break;
+
+		case 'g':
+			cfg.gidx = strtol(optarg, NULL, 0);
+			break;
+
+		case 'N':
+			cfg.use_new_send = 1;
+			break;
+
+		case 'x':
+			cfg.use_cq_ex = 1;
+			break;
+
+		case 'j':
+			cfg.json = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	ret = 0;
+
+	if (optind == argc - 1)
+		servername = strdupa(argv[optind]);
+	else if (optind < argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!cfg.threads || !cfg.qps || !cfg.iters || !cfg.batch ||
+	    cfg.batch > cfg.tx_depth) {
+		fprintf(stderr, "threads, qps and iters must be non zero and batch must be within 1..tx-depth\n");
+		return 1;
+	}
+
+	if (cfg.op == BENCH_OP_ATOMIC)
+		cfg.size = 8;
+
+	if ((cfg.qp_type == IBV_QPT_UD && cfg.op != BENCH_OP_SEND) ||
+	    (cfg.qp_type == IBV_QPT_UC &&
+	     (cfg.op == BENCH_OP_READ || cfg.op == BENCH_OP_ATOMIC))) {
+		fprintf(stderr, "Operation %s is not supported on %s QPs\n",
+			op_names[cfg.op], qp_type_str(cfg.qp_type));
+		return 1;
+	}
+
+	if (cfg.test == BENCH_TEST_LAT && cfg.op == BENCH_OP_SEND)
+		cfg.batch = 1;
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return 1;
+	}
+
+	if (!ib_devname) {
+		ib_dev = *dev_list;
+		if (!ib_dev) {
+			fprintf(stderr, "No IB devices found\n");
+			return 1;
+		}
+	} else {
+		int i;
+		for (i = 0; dev_list[i]; ++i)
+			if (!strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
+				break;
+		ib_dev = dev_list[i];
+		if (!ib_dev) {
+			fprintf(stderr, "IB device %s not found\n", ib_devname);
+			return 1;
+		}
+	}
+
+	ctx = bench_init_ctx(ib_dev);
+	if (!ctx)
+		return 1;
+	ctx->is_client = !!servername;
+
+	if (cfg.op == BENCH_OP_SEND)
+		for (t = 0; t != cfg.threads; t++)
+			for (q = 0; q != cfg.qps; q++)
+				if (bench_post_recv(ctx,
+						    &ctx->threads[t].qps[q], q,
+						    cfg.rx_depth)) {
+					fprintf(stderr, "Couldn't post receive\n");
+					return 1;
+				}
+
+	if (servername)
+		sockfd = bench_connect_sock(servername, port);
+	else
+		sockfd = bench_accept_sock(port);
+	if (sockfd < 0)
+		return 1;
+
+	/* Both sides must agree on everything that shapes the traffic */
+	bench_cfg_to_msg(msg);
+	if (servername) {
+		if (write_all(sockfd, msg, sizeof(msg)))
+			return 1;
+	} else {
+		if (read_all(sockfd, rmsg, sizeof(rmsg)))
+			return 1;
+		if (strcmp(msg, rmsg)) {
+			fprintf(stderr, "Client configuration %s does not match %s\n",
+				rmsg, msg);
+			return 1;
+		}
+	}
+
+	if (bench_exch_dest(ctx, sockfd)) {
+		fprintf(stderr, "Couldn't exchange QP information\n");
+		return 1;
+	}
+
+	for (t = 0; t != cfg.threads; t++)
+		for (q = 0; q != cfg.qps; q++)
+			if (bench_connect_qp(ctx, &ctx->threads[t].qps[q]))
+				return 1;
+
+	/* The client may only start once the server QPs are ready */
+	if (servername) {
+		if (read_all(sockfd, msg, sizeof("go")))
+			return 1;
+	} else {
+		if (write_all(sockfd, "go", sizeof("go")))
+			return 1;
+	}
+
+	for (t = 0; t != cfg.threads; t++)
+		if (pthread_create(&ctx->threads[t].thread, NULL,
+				   bench_thread_run, &ctx->threads[t])) {
+			fprintf(stderr, "Couldn't create thread\n");
+			return 1;
+		}
+
+	if (servername) {
+		for (t = 0; t != cfg.threads; t++)
+			pthread_join(ctx->threads[t].thread, NULL);
+		if (write_all(sockfd, "done", sizeof("done")))
+			return 1;
+	} else {
+		/* Unreliable transports may lose messages, stop on request */
+		read_all(sockfd, msg, sizeof("done"));
+		ctx->stop = 1;
+		for (t = 0; t != cfg.threads; t++)
+			pthread_join(ctx->threads[t].thread, NULL);
+	}
+	close(sockfd);
+
+	for (t = 0; t != cfg.threads; t++)
+		ret |= ctx->threads[t].err;
+
+	if (!ret && (servername ||
+		     (cfg.test == BENCH_TEST_BW && cfg.op == BENCH_OP_SEND)))
+		bench_report(ctx);
+
+	bench_close_ctx(ctx);
+	ibv_free_device_list(dev_list);
+
+	return ret;
+}
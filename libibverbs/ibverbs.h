@@ -74,6 +74,15 @@ struct verbs_ex_private {
 	uint32_t driver_id;
 	bool use_ioctl_write;
 	struct verbs_context_ops ops;
+	/* Provider data path ops replaced by the sampling trace wrappers */
+	struct {
+		int (*post_send)(struct ibv_qp *qp, struct ibv_send_wr *wr,
+				 struct ibv_send_wr **bad_wr);
+		int (*post_recv)(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+				 struct ibv_recv_wr **bad_wr);
+		int (*poll_cq)(struct ibv_cq *cq, int num_entries,
+			       struct ibv_wc *wc);
+	} trace_ops;
 };
 
 static inline struct verbs_ex_private *get_priv(struct ibv_context *ctx)
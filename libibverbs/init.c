@@ -53,6 +53,7 @@
 
 #include <util/util.h>
 #include "ibverbs.h"
+#include "trace.h"
 #include <infiniband/cmd_write.h>
 
 int abi_ver;
@@ -617,6 +618,8 @@ int ibverbs_init(void)
 	if (getenv("RDMAV_ALLOW_DISASSOC_DESTROY"))
 		verbs_allow_disassociate_destroy = true;
 
+	verbs_trace_init();
+
 	if (!ibv_get_sysfs_path())
 		return -errno;
 
@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/list.h>
+
+#include "ibverbs.h"
+
+/*
+ * Registration cache.
+ *
+ * Cached registrations are kept in an interval tree keyed by their page
+ * aligned [start, end) range. The tree is a treap ordered by start address
+ * and augmented with the largest end address of each subtree, so both the
+ * "which entry covers this range" lookup and the "which entries overlap
+ * this range" invalidation walk prune whole subtrees.
+ *
+ * Entries whose reference count drops to zero stay registered and are
+ * parked on an LRU list. They are only deregistered when the pinned budget
+ * or entry budget is exceeded, when the owning range is invalidated, or
+ * when the cache is flushed or destroyed.
+ */
+
+struct mr_cache_entry {
+	struct mr_cache_entry	*left, *right;
+	uintptr_t		start, end;
+	uintptr_t		max_end;
+	uint32_t		prio;
+
+	struct list_node	lru;
+	struct ibv_mr		*mr;
+	struct ibv_pd		*pd;
+	int			access;
+	unsigned int		refcnt;
+	bool			invalid;
+};
+
+struct ibv_mr_cache {
+	struct list_node	entry;
+	pthread_mutex_t		lock;
+	struct mr_cache_entry	*root;
+	struct list_head	lru;
+	struct list_head	invalid;
+	uint32_t		seed;
+	/* Bumped by every invalidation, see ibv_reg_mr_cached() */
+	unsigned int		inval_gen;
+	size_t			max_pinned;
+	uint32_t		max_entries;
+	struct ibv_mr_cache_stats stats;
+};
+
+static LIST_HEAD(mr_cache_list);
+static pthread_mutex_t mr_cache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t mr_cache_rand(struct ibv_mr_cache *cache)
+{
+	uint32_t x = cache->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	cache->seed = x;
+	return x;
+}
+
+static bool entry_less(const struct mr_cache_entry *a,
+		       const struct mr_cache_entry *b)
+{
+	if (a->start != b->start)
+		return a->start < b->start;
+	return (uintptr_t)a < (uintptr_t)b;
+}
+
+static void entry_update(struct mr_cache_entry *e)
+{
+	e->max_end = e->end;
+	if (e->left && e->left->max_end > e->max_end)
+		e->max_end = e->left->max_end;
+	if (e->right && e->right->max_end > e->max_end)
+		e->max_end = e->right->max_end;
+}
+
+static struct mr_cache_entry *tree_merge(struct mr_cache_entry *l,
+					 struct mr_cache_entry *r)
+{
+	if (!l)
+		return r;
+	if (!r)
+		return l;
+
+	if (l->prio > r->prio) {
+		l->right = tree_merge(l->right, r);
+		entry_update(l);
+		return l;
+	}
+
+	r->left = tree_merge(l, r->left);
+	entry_update(r);
+	return r;
+}
+
+/* Split t into entries ordered before key (*l) and the rest (*r) */
+static void tree_split(struct mr_cache_entry *t,
+		       const struct mr_cache_entry *key,
+		       struct mr_cache_entry **l, struct mr_cache_entry **r)
+{
+	if (!t) {
+		*l = *r = NULL;
+		return;
+	}
+
+	if (entry_less(t, key)) {
+		tree_split(t->right, key, &t->right, r);
+		*l = t;
+	} else {
+		tree_split(t->left, key, l, &t->left);
+		*r = t;
+	}
+	entry_update(t);
+}
+
+static void tree_insert(struct ibv_mr_cache *cache, struct mr_cache_entry *e)
+{
+	struct mr_cache_entry *l, *r;
+
+	e->left = e->right = NULL;
+	e->prio = mr_cache_rand(cache);
+	entry_update(e);
+
+	tree_split(cache->root, e, &l, &r);
+	cache->root = tree_merge(tree_merge(l, e), r);
+}
+
+static struct mr_cache_entry *tree_erase(struct mr_cache_entry *t,
+					 struct mr_cache_entry *e)
+{
+	if (!t)
+		return NULL;
+
+	if (t == e)
+		return tree_merge(t->left, t->right);
+
+	if (entry_less(e, t))
+		t->left = tree_erase(t->left, e);
+	else
+		t->right = tree_erase(t->right, e);
+	entry_update(t);
+	return t;
+}
+
+/* Find a valid entry covering [start, end) registered on pd with access */
+static struct mr_cache_entry *tree_find(struct mr_cache_entry *t,
+					uintptr_t start, uintptr_t end,
+					struct ibv_pd *pd, int access)
+{
+	struct mr_cache_entry *res;
+
+	if (!t || t->max_end < end)
+		return NULL;
+
+	res = tree_find(t->left, start, end, pd, access);
+	if (res)
+		return res;
+
+	/* Everything from here on starts after the requested range */
+	if (t->start > start)
+		return NULL;
+
+	if (t->end >= end && t->pd == pd && t->access == access &&
+	    !t->invalid)
+		return t;
+
+	return tree_find(t->right, start, end, pd, access);
+}
+
+static struct mr_cache_entry *tree_find_mr(struct mr_cache_entry *t,
+					   struct ibv_mr *mr)
+{
+	uintptr_t start = (uintptr_t)mr->addr;
+	struct mr_cache_entry *res;
+
+	if (!t || t->max_end <= start)
+		return NULL;
+
+	res = tree_find_mr(t->left, mr);
+	if (res)
+		return res;
+
+	if (t->start > start)
+		return NULL;
+
+	if (t->mr == mr)
+		return t;
+
+	return tree_find_mr(t->right, mr);
+}
+
+static void entry_dereg(struct ibv_mr_cache *cache, struct mr_cache_entry *e)
+{
+	cache->stats.pinned_bytes -= e->end - e->start;
+	cache->stats.num_entries--;
+	ibv_dereg_mr(e->mr);
+	free(e);
+}
+
+/* Remove an entry from the lookup structures and release it if idle */
+static void entry_remove(struct ibv_mr_cache *cache, struct mr_cache_entry *e)
+{
+	cache->root = tree_erase(cache->root, e);
+
+	if (e->refcnt) {
+		/* Dropped by ibv_dereg_mr_cached() once the last user is gone */
+		e->invalid = true;
+		list_add_tail(&cache->invalid, &e->lru);
+		return;
+	}
+
+	list_del(&e->lru);
+	entry_dereg(cache, e);
+}
+
+/* Leftmost entry overlapping [start, end) */
+static struct mr_cache_entry *tree_overlap(struct mr_cache_entry *t,
+					   uintptr_t start, uintptr_t end)
+{
+	struct mr_cache_entry *res;
+
+	if (!t || t->max_end <= start)
+		return NULL;
+
+	res = tree_overlap(t->left, start, end);
+	if (res)
+		return res;
+
+	if (t->start >= end)
+		return NULL;
+
+	if (t->end > start)
+		return t;
+
+	return tree_overlap(t->right, start, end);
+}
+
+static void cache_invalidate(struct ibv_mr_cache *cache, uintptr_t start,
+			     uintptr_t end)
+{
+	struct mr_cache_entry *e;
+
+	cache->inval_gen++;
+	while ((e = tree_overlap(cache->root, start, end))) {
+		cache->stats.invalidations++;
+		entry_remove(cache, e);
+	}
+}
+
+/* Evict idle entries in LRU order until the new registration fits */
+static int cache_make_room(struct ibv_mr_cache *cache, size_t length)
+{
+	struct mr_cache_entry *e, *tmp;
+
+	list_for_each_safe(&cache->lru, e, tmp, lru) {
+		if ((!cache->max_pinned ||
+		     cache->stats.pinned_bytes + length <= cache->max_pinned) &&
+		    (!cache->max_entries ||
+		     cache->stats.num_entries < cache->max_entries))
+			return 0;
+
+		cache->stats.evictions++;
+		entry_remove(cache, e);
+	}
+
+	if ((cache->max_pinned &&
+	     cache->stats.pinned_bytes + length > cache->max_pinned) ||
+	    (cache->max_entries &&
+	     cache->stats.num_entries >= cache->max_entries))
+		return ENOMEM;
+	return 0;
+}
+
+static void cache_flush(struct ibv_mr_cache *cache, struct ibv_pd *pd)
+{
+	struct mr_cache_entry *e, *tmp;
+
+	list_for_each_safe(&cache->lru, e, tmp, lru) {
+		if (pd && e->pd != pd)
+			continue;
+		entry_remove(cache, e);
+	}
+}
+
+struct ibv_mr_cache *ibv_mr_cache_create(struct ibv_mr_cache_init_attr *attr)
+{
+	struct ibv_mr_cache *cache;
+
+	if (attr && attr->comp_mask) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&cache->lock, NULL)) {
+		free(cache);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	list_head_init(&cache->lru);
+	list_head_init(&cache->invalid);
+	cache->seed = (uint32_t)(uintptr_t)cache | 1;
+	if (attr) {
+		cache->max_pinned = attr->max_pinned;
+		cache->max_entries = attr->max_entries;
+	}
+
+	pthread_mutex_lock(&mr_cache_list_lock);
+	list_add_tail(&mr_cache_list, &cache->entry);
+	pthread_mutex_unlock(&mr_cache_list_lock);
+
+	return cache;
+}
+
+int ibv_mr_cache_destroy(struct ibv_mr_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache_flush(cache, NULL);
+	if (cache->root || !list_empty(&cache->invalid)) {
+		pthread_mutex_unlock(&cache->lock);
+		return EBUSY;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	pthread_mutex_lock(&mr_cache_list_lock);
+	list_del(&cache->entry);
+	pthread_mutex_unlock(&mr_cache_list_lock);
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	return 0;
+}
+
+/* Register outside of the cache lock, giving back idle entries on ENOMEM */
+static struct ibv_mr *cache_reg_mr(struct ibv_mr_cache *cache,
+				   struct ibv_pd *pd, uintptr_t start,
+				   uintptr_t end, int access)
+{
+	struct ibv_mr *mr;
+	bool retry;
+
+	mr = ibv_reg_mr(pd, (void *)start, end - start, access);
+	if (mr || (errno != ENOMEM && errno != EAGAIN))
+		return mr;
+
+	/* Give back everything idle to the kernel and try once more */
+	pthread_mutex_lock(&cache->lock);
+	retry = !list_empty(&cache->lru);
+	cache_flush(cache, NULL);
+	pthread_mutex_unlock(&cache->lock);
+	if (!retry) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return ibv_reg_mr(pd, (void *)start, end - start, access);
+}
+
+struct ibv_mr *ibv_reg_mr_cached(struct ibv_mr_cache *cache,
+				 struct ibv_pd *pd, void *addr, size_t length,
+				 int access)
+{
+	uintptr_t page_mask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+	struct mr_cache_entry *e, *old;
+	unsigned int inval_gen;
+	uintptr_t start, end;
+	int ret;
+
+	if (!length || (uintptr_t)addr + length < (uintptr_t)addr) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	start = (uintptr_t)addr & page_mask;
+	end = ((uintptr_t)addr + length + ~page_mask) & page_mask;
+
+	pthread_mutex_lock(&cache->lock);
+	e = tree_find(cache->root, start, end, pd, access);
+	if (e) {
+		if (!e->refcnt++)
+			list_del(&e->lru);
+		cache->stats.hits++;
+		pthread_mutex_unlock(&cache->lock);
+		return e->mr;
+	}
+
+	cache->stats.misses++;
+	ret = cache_make_room(cache, end - start);
+	inval_gen = cache->inval_gen;
+	pthread_mutex_unlock(&cache->lock);
+	if (ret)
+		goto err;
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		ret = ENOMEM;
+		goto err;
+	}
+
+	/* Registration can be slow, lookups of other threads go on meanwhile */
+	e->mr = cache_reg_mr(cache, pd, start, end, access);
+	if (!e->mr) {
+		ret = errno;
+		free(e);
+		goto err;
+	}
+
+	e->start = start;
+	e->end = end;
+	e->pd = pd;
+	e->access = access;
+	e->refcnt = 1;
+
+	pthread_mutex_lock(&cache->lock);
+	old = tree_find(cache->root, start, end, pd, access);
+	if (old) {
+		/* Another thread registered the range first, use its entry */
+		if (!old->refcnt++)
+			list_del(&old->lru);
+		pthread_mutex_unlock(&cache->lock);
+		ibv_dereg_mr(e->mr);
+		free(e);
+		return old->mr;
+	}
+
+	ret = cache_make_room(cache, end - start);
+	if (ret) {
+		pthread_mutex_unlock(&cache->lock);
+		ibv_dereg_mr(e->mr);
+		free(e);
+		goto err;
+	}
+
+	cache->stats.pinned_bytes += end - start;
+	cache->stats.num_entries++;
+	if (cache->inval_gen != inval_gen) {
+		/*
+		 * Part of the range may have been unmapped while it was being
+		 * registered, so the MR is handed out but never looked up.
+		 */
+		e->invalid = true;
+		list_add_tail(&cache->invalid, &e->lru);
+	} else {
+		tree_insert(cache, e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return e->mr;
+
+err:
+	errno = ret;
+	return NULL;
+}
+
+int ibv_dereg_mr_cached(struct ibv_mr_cache *cache, struct ibv_mr *mr)
+{
+	struct mr_cache_entry *e, *tmp;
+
+	pthread_mutex_lock(&cache->lock);
+	e = tree_find_mr(cache->root, mr);
+	if (e) {
+		if (!e->refcnt) {
+			pthread_mutex_unlock(&cache->lock);
+			return EINVAL;
+		}
+		if (!--e->refcnt)
+			list_add_tail(&cache->lru, &e->lru);
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+
+	/* Invalidated while in use, the registration goes with its last user */
+	list_for_each_safe(&cache->invalid, e, tmp, lru) {
+		if (e->mr != mr)
+			continue;
+		if (!--e->refcnt) {
+			list_del(&e->lru);
+			entry_dereg(cache, e);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return EINVAL;
+}
+
+void ibv_mr_cache_invalidate(struct ibv_mr_cache *cache, void *addr,
+			     size_t length)
+{
+	uintptr_t start = (uintptr_t)addr;
+	uintptr_t end = start + length;
+
+	if (end < start)
+		end = UINTPTR_MAX;
+
+	if (cache) {
+		pthread_mutex_lock(&cache->lock);
+		cache_invalidate(cache, start, end);
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&mr_cache_list_lock);
+	list_for_each(&mr_cache_list, cache, entry) {
+		pthread_mutex_lock(&cache->lock);
+		cache_invalidate(cache, start, end);
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_mutex_unlock(&mr_cache_list_lock);
+}
+
+void ibv_mr_cache_flush(struct ibv_mr_cache *cache, struct ibv_pd *pd)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache_flush(cache, pd);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int ibv_mr_cache_query(struct ibv_mr_cache *cache,
+		       struct ibv_mr_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
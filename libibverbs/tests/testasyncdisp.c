@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Exercise ibv_async_dispatcher_del() on a running dispatcher, including
+ * from the callback of the context being deleted. async_dispatch.c is built
+ * into this program with the event verbs replaced by the stubs below, each
+ * byte written to a pipe standing for one async event.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__,	\
+				__LINE__, #cond);			\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static struct ibv_async_dispatcher *disp;
+static unsigned int num_cb, num_acked;
+
+int ibv_get_async_events(struct ibv_context *context,
+			 struct ibv_async_event *events, int num_events)
+{
+	char buf[64];
+	ssize_t n;
+	int i;
+
+	if (num_events > (int)sizeof(buf))
+		num_events = sizeof(buf);
+	n = read(context->async_fd, buf, num_events);
+	if (n <= 0) {
+		if (!n)
+			errno = EAGAIN;
+		return -1;
+	}
+
+	for (i = 0; i != n; i++)
+		events[i].event_type = IBV_EVENT_PORT_ACTIVE;
+	return n;
+}
+
+void ibv_ack_async_event(struct ibv_async_event *event)
+{
+	num_acked++;
+}
+
+static void count_cb(struct ibv_context *context,
+		     struct ibv_async_event *event, void *cb_arg)
+{
+	num_cb++;
+}
+
+static void del_self_cb(struct ibv_context *context,
+			struct ibv_async_event *event, void *cb_arg)
+{
+	num_cb++;
+	CHECK(!ibv_async_dispatcher_del(disp, context));
+	CHECK(ibv_async_dispatcher_del(disp, context) == ENOENT);
+}
+
+static void del_other_cb(struct ibv_context *context,
+			 struct ibv_async_event *event, void *cb_arg)
+{
+	num_cb++;
+	CHECK(!ibv_async_dispatcher_del(disp, cb_arg));
+}
+
+static void open_context(struct ibv_context *context, int *wfd)
+{
+	int fds[2];
+
+	CHECK(!pipe(fds));
+	context->async_fd = fds[0];
+	*wfd = fds[1];
+}
+
+static void post_events(int wfd, unsigned int num)
+{
+	static const char ev[8];
+
+	CHECK(num <= sizeof(ev) && write(wfd, ev, num) == num);
+}
+
+int main(void)
+{
+	struct ibv_context ctx1 = {}, ctx2 = {};
+	int wfd1, wfd2;
+	char c;
+
+	/* A deadlock in ibv_async_dispatcher_del() fails the test */
+	alarm(10);
+
+	disp = ibv_async_dispatcher_create();
+	CHECK(disp);
+	open_context(&ctx1, &wfd1);
+	open_context(&ctx2, &wfd2);
+
+	/* Plain dispatch and deletion */
+	CHECK(!ibv_async_dispatcher_add(disp, &ctx1, count_cb, NULL));
+	post_events(wfd1, 3);
+	CHECK(ibv_async_dispatcher_run(disp, 1000) == 3);
+	CHECK(num_cb == 3 && num_acked == 3);
+	CHECK(!ibv_async_dispatcher_del(disp, &ctx1));
+	CHECK(ibv_async_dispatcher_del(disp, &ctx1) == ENOENT);
+
+	/* A callback deleting its own context gets no further events */
+	num_cb = num_acked = 0;
+	CHECK(!ibv_async_dispatcher_add(disp, &ctx1, del_self_cb, NULL));
+	post_events(wfd1, 4);
+	CHECK(ibv_async_dispatcher_run(disp, 1000) == 1);
+	CHECK(num_cb == 1 && num_acked == 4);
+	post_events(wfd1, 1);
+	CHECK(ibv_async_dispatcher_run(disp, 0) == 0);
+	CHECK(num_cb == 1);
+
+	/* A callback deleting another context */
+	num_cb = 0;
+	CHECK(read(ctx1.async_fd, &c, 1) == 1);
+	CHECK(!ibv_async_dispatcher_add(disp, &ctx1, count_cb, NULL));
+	CHECK(!ibv_async_dispatcher_add(disp, &ctx2, del_other_cb, &ctx1));
+	post_events(wfd2, 1);
+	CHECK(ibv_async_dispatcher_run(disp, 1000) == 1);
+	CHECK(num_cb == 1);
+	CHECK(ibv_async_dispatcher_del(disp, &ctx1) == ENOENT);
+	CHECK(!ibv_async_dispatcher_del(disp, &ctx2));
+
+	ibv_async_dispatcher_destroy(disp);
+	printf("async dispatcher test passed\n");
+	return 0;
+}
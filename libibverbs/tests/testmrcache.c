@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Exercise the lookup, eviction and invalidation logic of the registration
+ * cache. mr_cache.c is built into this program with the registration
+ * verbs replaced by the stubs below, so no device is needed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__,	\
+				__LINE__, #cond);			\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static struct ibv_mr_cache *cache;
+static unsigned int live_mrs, num_regs;
+
+/* Called from ibv_reg_mr(), while the cache lock must not be held */
+static void (*reg_hook)(void *addr, size_t length);
+
+struct ibv_mr *ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
+				uint64_t iova, unsigned int access)
+{
+	struct ibv_mr *mr;
+	void (*hook)(void *addr, size_t length) = reg_hook;
+
+	if (hook) {
+		reg_hook = NULL;
+		hook(addr, length);
+	}
+
+	mr = calloc(1, sizeof(*mr));
+	if (!mr) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	mr->pd = pd;
+	mr->addr = addr;
+	mr->length = length;
+	mr->lkey = mr->rkey = ++num_regs;
+	live_mrs++;
+	return mr;
+}
+
+struct ibv_mr *(ibv_reg_mr)(struct ibv_pd *pd, void *addr, size_t length,
+			    int access)
+{
+	return ibv_reg_mr_iova2(pd, addr, length, (uintptr_t)addr, access);
+}
+
+int ibv_dereg_mr(struct ibv_mr *mr)
+{
+	live_mrs--;
+	free(mr);
+	return 0;
+}
+
+static struct ibv_mr_cache_stats query(void)
+{
+	struct ibv_mr_cache_stats stats;
+
+	CHECK(!ibv_mr_cache_query(cache, &stats));
+	return stats;
+}
+
+static struct ibv_pd pd;
+static uint8_t *buf;
+static size_t page;
+static struct ibv_mr *racing_mr;
+
+static void racing_reg(void *addr, size_t length)
+{
+	racing_mr = ibv_reg_mr_cached(cache, &pd, addr, length, 0);
+	CHECK(racing_mr);
+}
+
+static void racing_invalidate(void *addr, size_t length)
+{
+	ibv_mr_cache_invalidate(cache, addr, length);
+}
+
+int main(void)
+{
+	struct ibv_mr_cache_init_attr attr = { .max_entries = 2 };
+	struct ibv_mr *a, *b, *c, *d;
+	struct ibv_mr_cache_stats stats;
+
+	page = sysconf(_SC_PAGESIZE);
+	buf = aligned_alloc(page, 8 * page);
+	CHECK(buf);
+	cache = ibv_mr_cache_create(&attr);
+	CHECK(cache);
+
+	/* Hits on ranges covered by a cached page aligned registration */
+	a = ibv_reg_mr_cached(cache, &pd, buf + 10, 100, 0);
+	CHECK(a && a->addr == buf && a->length == page);
+	b = ibv_reg_mr_cached(cache, &pd, buf + 200, page - 200, 0);
+	CHECK(b == a);
+	stats = query();
+	CHECK(stats.hits == 1 && stats.misses == 1 && stats.num_entries == 1);
+
+	/* Overlapping but not covered, or other access flags, is a miss */
+	c = ibv_reg_mr_cached(cache, &pd, buf + page / 2, page, 0);
+	CHECK(c && c != a && c->addr == buf && c->length == 2 * page);
+	stats = query();
+	CHECK(stats.misses == 2 && stats.num_entries == 2);
+	CHECK(!ibv_dereg_mr_cached(cache, a));
+	CHECK(!ibv_dereg_mr_cached(cache, b));
+	CHECK(ibv_dereg_mr_cached(cache, a) == EINVAL);
+
+	/* The entry budget is met by evicting the least recently used idle */
+	d = ibv_reg_mr_cached(cache, &pd, buf, page, IBV_ACCESS_LOCAL_WRITE);
+	CHECK(d && d != a && d != c);
+	stats = query();
+	CHECK(stats.evictions == 1 && stats.num_entries == 2);
+	CHECK(live_mrs == 2);
+
+	/* ... and fails if every entry is in use */
+	CHECK(!ibv_reg_mr_cached(cache, &pd, buf + 4 * page, page, 0));
+	CHECK(errno == ENOMEM);
+
+	/* An invalidated MR in use is no longer found, and freed when released */
+	ibv_mr_cache_invalidate(cache, buf + page, 1);
+	stats = query();
+	CHECK(stats.invalidations == 1 && stats.num_entries == 2);
+	CHECK(!ibv_dereg_mr_cached(cache, d));
+	a = ibv_reg_mr_cached(cache, &pd, buf + page, page, 0);
+	CHECK(a && a != c);
+	CHECK(live_mrs == 2);
+	CHECK(!ibv_dereg_mr_cached(cache, c));
+	CHECK(live_mrs == 1);
+	CHECK(!ibv_dereg_mr_cached(cache, a));
+	ibv_mr_cache_flush(cache, NULL);
+	CHECK(live_mrs == 0 && query().num_entries == 0);
+
+	/*
+	 * A registration racing with another one of the same range uses the
+	 * entry that got in first. The hook would deadlock if the cache lock
+	 * were held across ibv_reg_mr().
+	 */
+	reg_hook = racing_reg;
+	a = ibv_reg_mr_cached(cache, &pd, buf, page, 0);
+	CHECK(a && a == racing_mr);
+	CHECK(live_mrs == 1 && query().num_entries == 1);
+	CHECK(!ibv_dereg_mr_cached(cache, a));
+	CHECK(!ibv_dereg_mr_cached(cache, racing_mr));
+	ibv_mr_cache_flush(cache, NULL);
+
+	/* A range invalidated while being registered is not cached */
+	reg_hook = racing_invalidate;
+	a = ibv_reg_mr_cached(cache, &pd, buf, page, 0);
+	CHECK(a);
+	b = ibv_reg_mr_cached(cache, &pd, buf, page, 0);
+	CHECK(b && b != a);
+	CHECK(!ibv_dereg_mr_cached(cache, a));
+	CHECK(!ibv_dereg_mr_cached(cache, b));
+	CHECK(live_mrs == 1);
+
+	CHECK(!ibv_mr_cache_destroy(cache));
+	CHECK(live_mrs == 0);
+	free(buf);
+
+	printf("mr cache test passed\n");
+	return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/array_size.h>
+#include <ccan/ilog.h>
+
+#include "ibverbs.h"
+#include "trace.h"
+
+/* Latency histogram buckets are powers of two nanoseconds */
+#define TRACE_HIST_BUCKETS 40
+
+struct trace_op_stats {
+	atomic_uint_least64_t calls;
+	atomic_uint_least64_t errors;
+	atomic_uint_least64_t total_ns;
+	atomic_uint_least64_t max_ns;
+	atomic_int last_errno;
+	atomic_uint_least64_t hist[TRACE_HIST_BUCKETS];
+};
+
+static const char *const trace_op_names[] = {
+	[VERBS_TRACE_ALLOC_PD] = "alloc_pd",
+	[VERBS_TRACE_DEALLOC_PD] = "dealloc_pd",
+	[VERBS_TRACE_REG_MR] = "reg_mr",
+	[VERBS_TRACE_DEREG_MR] = "dereg_mr",
+	[VERBS_TRACE_CREATE_CQ] = "create_cq",
+	[VERBS_TRACE_DESTROY_CQ] = "destroy_cq",
+	[VERBS_TRACE_CREATE_QP] = "create_qp",
+	[VERBS_TRACE_MODIFY_QP] = "modify_qp",
+	[VERBS_TRACE_DESTROY_QP] = "destroy_qp",
+	[VERBS_TRACE_CREATE_WQ] = "create_wq",
+	[VERBS_TRACE_DESTROY_WQ] = "destroy_wq",
+	[VERBS_TRACE_CMD_IOCTL] = "cmd_ioctl",
+	[VERBS_TRACE_CMD_WRITE] = "cmd_write",
+	[VERBS_TRACE_POST_SEND] = "post_send",
+	[VERBS_TRACE_POST_RECV] = "post_recv",
+	[VERBS_TRACE_POLL_CQ] = "poll_cq",
+};
+
+bool verbs_trace_enabled;
+static unsigned int trace_sample_period;
+static const char *trace_output;
+static struct trace_op_stats trace_stats[VERBS_TRACE_NUM_OPS];
+static __thread unsigned int trace_sample_count;
+
+void verbs_trace_record(enum verbs_trace_op op, uint64_t start, int err)
+{
+	struct trace_op_stats *stats = &trace_stats[op];
+	uint64_t delta = verbs_trace_now() - start;
+	uint64_t max;
+	unsigned int bucket;
+
+	atomic_fetch_add_explicit(&stats->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->total_ns, delta,
+				  memory_order_relaxed);
+	if (err) {
+		atomic_fetch_add_explicit(&stats->errors, 1,
+					  memory_order_relaxed);
+		atomic_store_explicit(&stats->last_errno, err,
+				      memory_order_relaxed);
+	}
+
+	max = atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+	while (delta > max &&
+	       !atomic_compare_exchange_weak_explicit(&stats->max_ns, &max,
+						      delta,
+						      memory_order_relaxed,
+						      memory_order_relaxed))
+		;
+
+	bucket = ilog64(delta);
+	if (bucket >= TRACE_HIST_BUCKETS)
+		bucket = TRACE_HIST_BUCKETS - 1;
+	atomic_fetch_add_explicit(&stats->hist[bucket], 1,
+				  memory_order_relaxed);
+}
+
+/* Upper bound of the histogram bucket holding the given percentile */
+static uint64_t trace_percentile(struct trace_op_stats *stats, uint64_t calls,
+				 unsigned int pct)
+{
+	uint64_t target = (calls * pct + 99) / 100;
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i != TRACE_HIST_BUCKETS; i++) {
+		sum += atomic_load_explicit(&stats->hist[i],
+					    memory_order_relaxed);
+		if (sum >= target)
+			return 1ULL << i;
+	}
+	return 1ULL << (TRACE_HIST_BUCKETS - 1);
+}
+
+static void trace_dump(void)
+{
+	FILE *out = stderr;
+	unsigned int i;
+
+	if (strcmp(trace_output, "stderr") != 0) {
+		out = fopen(trace_output, "a" STREAM_CLOEXEC);
+		if (!out)
+			return;
+	}
+
+	for (i = 0; i != VERBS_TRACE_NUM_OPS; i++) {
+		struct trace_op_stats *stats = &trace_stats[i];
+		uint64_t calls = atomic_load(&stats->calls);
+
+		if (!calls)
+			continue;
+
+		fprintf(out,
+			PFX "trace pid %d %-10s calls %llu errors %llu last_errno %d avg_ns %llu p50_ns %llu p99_ns %llu max_ns %llu\n",
+			getpid(), trace_op_names[i], (unsigned long long)calls,
+			(unsigned long long)atomic_load(&stats->errors),
+			atomic_load(&stats->last_errno),
+			(unsigned long long)(atomic_load(&stats->total_ns) /
+					     calls),
+			(unsigned long long)trace_percentile(stats, calls, 50),
+			(unsigned long long)trace_percentile(stats, calls, 99),
+			(unsigned long long)atomic_load(&stats->max_ns));
+	}
+
+	if (out != stderr)
+		fclose(out);
+}
+
+/*
+ * RDMAV_TRACE=<file|stderr> enables the recorder, the summary is written
+ * when the process exits. RDMAV_TRACE_SAMPLE=<N> additionally times one of
+ * every N data path calls.
+ */
+void verbs_trace_init(void)
+{
+	const char *env;
+
+	static_assert(ARRAY_SIZE(trace_op_names) == VERBS_TRACE_NUM_OPS,
+		      "missing trace op name");
+
+	trace_output = getenv("RDMAV_TRACE");
+	if (!trace_output || !*trace_output)
+		return;
+
+	env = getenv("RDMAV_TRACE_SAMPLE");
+	if (env)
+		trace_sample_period = strtoul(env, NULL, 0);
+
+	verbs_trace_enabled = true;
+	atexit(trace_dump);
+}
+
+static inline bool trace_sample(void)
+{
+	if (++trace_sample_count < trace_sample_period)
+		return false;
+	trace_sample_count = 0;
+	return true;
+}
+
+static int trace_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			   struct ibv_send_wr **bad_wr)
+{
+	struct verbs_ex_private *priv = get_priv(qp->context);
+	uint64_t start;
+	int ret;
+
+	if (!trace_sample())
+		return priv->trace_ops.post_send(qp, wr, bad_wr);
+
+	start = verbs_trace_now();
+	ret = priv->trace_ops.post_send(qp, wr, bad_wr);
+	verbs_trace_record(VERBS_TRACE_POST_SEND, start, ret);
+	VERBS_PROBE3(post_send, qp->qp_num, wr->opcode, ret);
+	return ret;
+}
+
+static int trace_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			   struct ibv_recv_wr **bad_wr)
+{
+	struct verbs_ex_private *priv = get_priv(qp->context);
+	uint64_t start;
+	int ret;
+
+	if (!trace_sample())
+		return priv->trace_ops.post_recv(qp, wr, bad_wr);
+
+	start = verbs_trace_now();
+	ret = priv->trace_ops.post_recv(qp, wr, bad_wr);
+	verbs_trace_record(VERBS_TRACE_POST_RECV, start, ret);
+	VERBS_PROBE2(post_recv, qp->qp_num, ret);
+	return ret;
+}
+
+static int trace_poll_cq(struct ibv_cq *cq, int num_entries,
+			 struct ibv_wc *wc)
+{
+	struct verbs_ex_private *priv = get_priv(cq->context);
+	uint64_t start;
+	int ret;
+
+	if (!trace_sample())
+		return priv->trace_ops.poll_cq(cq, num_entries, wc);
+
+	start = verbs_trace_now();
+	ret = priv->trace_ops.poll_cq(cq, num_entries, wc);
+	verbs_trace_record(VERBS_TRACE_POLL_CQ, start, ret < 0 ? -ret : 0);
+	VERBS_PROBE3(poll_cq, cq, num_entries, ret);
+	return ret;
+}
+
+/*
+ * The data path verbs are inline in verbs.h and call straight into the
+ * provider through ibv_context_ops, so sampling is done by swapping those
+ * pointers for wrappers. Contexts opened without sampling requested keep
+ * the provider functions and pay nothing.
+ */
+void verbs_trace_setup_context(struct verbs_context *vctx)
+{
+	struct verbs_ex_private *priv = vctx->priv;
+	struct ibv_context_ops *ops = &vctx->context.ops;
+
+	if (!verbs_trace_enabled || !trace_sample_period)
+		return;
+
+	if (ops->post_send) {
+		priv->trace_ops.post_send = ops->post_send;
+		ops->post_send = trace_post_send;
+	}
+	if (ops->post_recv) {
+		priv->trace_ops.post_recv = ops->post_recv;
+		ops->post_recv = trace_post_recv;
+	}
+	if (ops->poll_cq) {
+		priv->trace_ops.poll_cq = ops->poll_cq;
+		ops->poll_cq = trace_poll_cq;
+	}
+}
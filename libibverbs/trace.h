@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __VERBS_TRACE_H
+#define __VERBS_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/sdt.h>
+
+#include <util/compiler.h>
+
+struct verbs_context;
+
+/*
+ * Two independent tracing facilities are provided:
+ *
+ * - USDT probes under the 'ibverbs' provider. They are emitted through
+ *   VERBS_PROBE*() and compile to a single nop when sys/sdt.h is available,
+ *   or to nothing at all otherwise.
+ *
+ * - An in-library recorder enabled at runtime with RDMAV_TRACE. Control
+ *   verbs and kernel commands bracket their work with verbs_trace_begin()
+ *   and verbs_trace_end(), which only read the clock while the recorder is
+ *   enabled. Data path calls are sampled, see verbs_trace_setup_context().
+ */
+#define VERBS_PROBE(name) DTRACE_PROBE(ibverbs, name)
+#define VERBS_PROBE1(name, a1) DTRACE_PROBE1(ibverbs, name, a1)
+#define VERBS_PROBE2(name, a1, a2) DTRACE_PROBE2(ibverbs, name, a1, a2)
+#define VERBS_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(ibverbs, name, a1, a2, a3)
+#define VERBS_PROBE4(name, a1, a2, a3, a4)                                     \
+	DTRACE_PROBE4(ibverbs, name, a1, a2, a3, a4)
+
+enum verbs_trace_op {
+	VERBS_TRACE_ALLOC_PD,
+	VERBS_TRACE_DEALLOC_PD,
+	VERBS_TRACE_REG_MR,
+	VERBS_TRACE_DEREG_MR,
+	VERBS_TRACE_CREATE_CQ,
+	VERBS_TRACE_DESTROY_CQ,
+	VERBS_TRACE_CREATE_QP,
+	VERBS_TRACE_MODIFY_QP,
+	VERBS_TRACE_DESTROY_QP,
+	VERBS_TRACE_CREATE_WQ,
+	VERBS_TRACE_DESTROY_WQ,
+	VERBS_TRACE_CMD_IOCTL,
+	VERBS_TRACE_CMD_WRITE,
+	VERBS_TRACE_POST_SEND,
+	VERBS_TRACE_POST_RECV,
+	VERBS_TRACE_POLL_CQ,
+	VERBS_TRACE_NUM_OPS,
+};
+
+extern bool verbs_trace_enabled;
+
+void verbs_trace_init(void);
+void verbs_trace_record(enum verbs_trace_op op, uint64_t start, int err);
+void verbs_trace_setup_context(struct verbs_context *vctx);
+
+static inline uint64_t verbs_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns 0 when the recorder is disabled */
+static inline uint64_t verbs_trace_begin(void)
+{
+	if (likely(!verbs_trace_enabled))
+		return 0;
+	return verbs_trace_now();
+}
+
+static inline void verbs_trace_end(enum verbs_trace_op op, uint64_t start,
+				   int err)
+{
+	if (unlikely(start))
+		verbs_trace_record(op, start, err);
+}
+
+#endif
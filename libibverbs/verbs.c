@@ -49,6 +49,7 @@
 #include <infiniband/cmd_write.h>
 
 #include "ibverbs.h"
+#include "trace.h"
 #include <net/if.h>
 #include <net/if_arp.h>
 #include "neigh.h"
@@ -280,12 +281,15 @@ LATEST_SYMVER_FUNC(ibv_alloc_pd, 1_1, "IBVERBS_1.1",
 		   struct ibv_pd *,
 		   struct ibv_context *context)
 {
+	uint64_t start = verbs_trace_begin();
 	struct ibv_pd *pd;
 
 	pd = get_ops(context)->alloc_pd(context);
 	if (pd)
 		pd->context = context;
 
+	verbs_trace_end(VERBS_TRACE_ALLOC_PD, start, pd ? 0 : errno);
+	VERBS_PROBE2(alloc_pd, context, pd);
 	return pd;
 }
 
@@ -293,22 +297,30 @@ LATEST_SYMVER_FUNC(ibv_dealloc_pd, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_pd *pd)
 {
-	return get_ops(pd->context)->dealloc_pd(pd);
+	uint64_t start = verbs_trace_begin();
+	int ret;
+
+	VERBS_PROBE1(dealloc_pd, pd);
+	ret = get_ops(pd->context)->dealloc_pd(pd);
+	verbs_trace_end(VERBS_TRACE_DEALLOC_PD, start, ret);
+	return ret;
 }
 
-#undef ibv_reg_mr
-LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
-		   struct ibv_mr *,
-		   struct ibv_pd *pd, void *addr,
-		   size_t length, int access)
+static struct ibv_mr *reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+			     uint64_t iova, int access)
 {
+	uint64_t start = verbs_trace_begin();
 	struct ibv_mr *mr;
 
-	if (ibv_dontfork_range(addr, length))
+	VERBS_PROBE4(reg_mr_entry, pd, addr, length, access);
+
+	if (ibv_dontfork_range(addr, length)) {
+		verbs_trace_end(VERBS_TRACE_REG_MR, start, errno);
+		VERBS_PROBE2(reg_mr_return, NULL, errno);
 		return NULL;
+	}
 
-	mr = get_ops(pd->context)->reg_mr(pd, addr, length, (uintptr_t) addr,
-					  access);
+	mr = get_ops(pd->context)->reg_mr(pd, addr, length, iova, access);
 	if (mr) {
 		mr->context = pd->context;
 		mr->pd      = pd;
@@ -317,28 +329,25 @@ LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
 	} else
 		ibv_dofork_range(addr, length);
 
+	verbs_trace_end(VERBS_TRACE_REG_MR, start, mr ? 0 : errno);
+	VERBS_PROBE2(reg_mr_return, mr, mr ? 0 : errno);
 	return mr;
 }
 
+#undef ibv_reg_mr
+LATEST_SYMVER_FUNC(ibv_reg_mr, 1_1, "IBVERBS_1.1",
+		   struct ibv_mr *,
+		   struct ibv_pd *pd, void *addr,
+		   size_t length, int access)
+{
+	return reg_mr(pd, addr, length, (uintptr_t)addr, access);
+}
+
 #undef ibv_reg_mr_iova
 struct ibv_mr *ibv_reg_mr_iova(struct ibv_pd *pd, void *addr, size_t length,
 			       uint64_t iova, int access)
 {
-	struct ibv_mr *mr;
-
-	if (ibv_dontfork_range(addr, length))
-		return NULL;
-
-	mr = get_ops(pd->context)->reg_mr(pd, addr, length, iova, access);
-	if (mr) {
-		mr->context = pd->context;
-		mr->pd      = pd;
-		mr->addr    = addr;
-		mr->length  = length;
-	} else
-		ibv_dofork_range(addr, length);
-
-	return mr;
+	return reg_mr(pd, addr, length, iova, access);
 }
 
 struct ibv_mr *ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
@@ -421,15 +430,19 @@ LATEST_SYMVER_FUNC(ibv_dereg_mr, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_mr *mr)
 {
+	uint64_t start = verbs_trace_begin();
 	int ret;
 	void *addr		= mr->addr;
 	size_t length		= mr->length;
 	enum ibv_mr_type type	= verbs_get_mr(mr)->mr_type;
 
+	VERBS_PROBE3(dereg_mr_entry, mr, addr, length);
 	ret = get_ops(mr->context)->dereg_mr(verbs_get_mr(mr));
 	if (!ret && type == IBV_MR_TYPE_MR)
 		ibv_dofork_range(addr, length);
 
+	verbs_trace_end(VERBS_TRACE_DEREG_MR, start, ret);
+	VERBS_PROBE1(dereg_mr_return, ret);
 	return ret;
 }
 
@@ -485,6 +498,7 @@ LATEST_SYMVER_FUNC(ibv_create_cq, 1_1, "IBVERBS_1.1",
 		   struct ibv_context *context, int cqe, void *cq_context,
 		   struct ibv_comp_channel *channel, int comp_vector)
 {
+	uint64_t start = verbs_trace_begin();
 	struct ibv_cq *cq;
 
 	cq = get_ops(context)->create_cq(context, cqe, channel, comp_vector);
@@ -492,6 +506,8 @@ LATEST_SYMVER_FUNC(ibv_create_cq, 1_1, "IBVERBS_1.1",
 	if (cq)
 		verbs_init_cq(cq, context, channel, cq_context);
 
+	verbs_trace_end(VERBS_TRACE_CREATE_CQ, start, cq ? 0 : errno);
+	VERBS_PROBE3(create_cq, context, cqe, cq);
 	return cq;
 }
 
@@ -507,9 +523,12 @@ LATEST_SYMVER_FUNC(ibv_destroy_cq, 1_1, "IBVERBS_1.1",
 		   struct ibv_cq *cq)
 {
 	struct ibv_comp_channel *channel = cq->channel;
+	uint64_t start = verbs_trace_begin();
 	int ret;
 
+	VERBS_PROBE1(destroy_cq, cq);
 	ret = get_ops(cq->context)->destroy_cq(cq);
+	verbs_trace_end(VERBS_TRACE_DESTROY_CQ, start, ret);
 
 	if (channel) {
 		if (!ret) {
@@ -598,8 +617,12 @@ LATEST_SYMVER_FUNC(ibv_create_qp, 1_1, "IBVERBS_1.1",
 		   struct ibv_pd *pd,
 		   struct ibv_qp_init_attr *qp_init_attr)
 {
+	uint64_t start = verbs_trace_begin();
 	struct ibv_qp *qp = get_ops(pd->context)->create_qp(pd, qp_init_attr);
 
+	verbs_trace_end(VERBS_TRACE_CREATE_QP, start, qp ? 0 : errno);
+	VERBS_PROBE3(create_qp, pd, qp_init_attr->qp_type, qp);
+
 	if (qp) {
 		qp->context    	     = pd->context;
 		qp->qp_context 	     = qp_init_attr->qp_context;
@@ -649,9 +672,14 @@ LATEST_SYMVER_FUNC(ibv_modify_qp, 1_1, "IBVERBS_1.1",
 		   struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		   int attr_mask)
 {
+	uint64_t start = verbs_trace_begin();
 	int ret;
 
 	ret = get_ops(qp->context)->modify_qp(qp, attr, attr_mask);
+	verbs_trace_end(VERBS_TRACE_MODIFY_QP, start, ret);
+	VERBS_PROBE4(modify_qp, qp->qp_num, attr_mask,
+		     (attr_mask & IBV_QP_STATE) ? attr->qp_state : qp->state,
+		     ret);
 	if (ret)
 		return ret;
 
@@ -665,7 +693,13 @@ LATEST_SYMVER_FUNC(ibv_destroy_qp, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_qp *qp)
 {
-	return get_ops(qp->context)->destroy_qp(qp);
+	uint64_t start = verbs_trace_begin();
+	int ret;
+
+	VERBS_PROBE1(destroy_qp, qp->qp_num);
+	ret = get_ops(qp->context)->destroy_qp(qp);
+	verbs_trace_end(VERBS_TRACE_DESTROY_QP, start, ret);
+	return ret;
 }
 
 LATEST_SYMVER_FUNC(ibv_create_ah, 1_1, "IBVERBS_1.1",
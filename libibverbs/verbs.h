@@ -2239,6 +2239,68 @@ int ibv_get_async_event(struct ibv_context *context,
  */
 void ibv_ack_async_event(struct ibv_async_event *event);
 
+/**
+ * ibv_get_async_events - Get up to num_events pending async events
+ * @events: Array to return the events in
+ *
+ * Returns the number of events stored in @events, or -1 and sets errno. If
+ * the async FD is non-blocking all pending events up to @num_events are
+ * returned with a single system call, otherwise this blocks like
+ * ibv_get_async_event() and returns one event. Each returned event must be
+ * acknowledged with ibv_ack_async_event().
+ */
+int ibv_get_async_events(struct ibv_context *context,
+			 struct ibv_async_event *events, int num_events);
+
+struct ibv_async_dispatcher;
+
+typedef void (*ibv_async_event_cb)(struct ibv_context *context,
+				   struct ibv_async_event *event,
+				   void *cb_arg);
+
+/**
+ * ibv_async_dispatcher_create - Create an epoll based async event dispatcher
+ *
+ * The dispatcher multiplexes the async FDs of many device contexts and
+ * invokes a per context callback for every event. Events are acknowledged
+ * by the dispatcher once the callback returns.
+ */
+struct ibv_async_dispatcher *ibv_async_dispatcher_create(void);
+
+/**
+ * ibv_async_dispatcher_destroy - Destroy a dispatcher
+ */
+void ibv_async_dispatcher_destroy(struct ibv_async_dispatcher *disp);
+
+/**
+ * ibv_async_dispatcher_add - Dispatch the async events of a context
+ *
+ * The context async FD is switched to non-blocking mode.
+ */
+int ibv_async_dispatcher_add(struct ibv_async_dispatcher *disp,
+			     struct ibv_context *context,
+			     ibv_async_event_cb cb, void *cb_arg);
+
+/**
+ * ibv_async_dispatcher_del - Stop dispatching the async events of a context
+ */
+int ibv_async_dispatcher_del(struct ibv_async_dispatcher *disp,
+			     struct ibv_context *context);
+
+/**
+ * ibv_async_dispatcher_get_fd - Get the FD that becomes readable on events
+ *
+ * Lets the dispatcher be nested in the caller's own poll loop.
+ */
+int ibv_async_dispatcher_get_fd(struct ibv_async_dispatcher *disp);
+
+/**
+ * ibv_async_dispatcher_run - Wait up to timeout ms and dispatch events
+ *
+ * Returns the number of events dispatched, or -1 and sets errno.
+ */
+int ibv_async_dispatcher_run(struct ibv_async_dispatcher *disp, int timeout);
+
 /**
  * ibv_query_device - Get device properties
  */
@@ -2465,6 +2527,78 @@ int ibv_rereg_mr(struct ibv_mr *mr, int flags,
  */
 int ibv_dereg_mr(struct ibv_mr *mr);
 
+struct ibv_mr_cache;
+
+struct ibv_mr_cache_init_attr {
+	uint32_t		comp_mask;
+	/* Upper bound on registered bytes, 0 means unlimited */
+	size_t			max_pinned;
+	/* Upper bound on cached registrations, 0 means unlimited */
+	uint32_t		max_entries;
+};
+
+struct ibv_mr_cache_stats {
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+	uint64_t		invalidations;
+	size_t			pinned_bytes;
+	uint32_t		num_entries;
+};
+
+/**
+ * ibv_mr_cache_create - Create a memory registration cache
+ */
+struct ibv_mr_cache *ibv_mr_cache_create(struct ibv_mr_cache_init_attr *attr);
+
+/**
+ * ibv_mr_cache_destroy - Destroy a memory registration cache
+ *
+ * Fails with EBUSY while registrations obtained from the cache are in use.
+ */
+int ibv_mr_cache_destroy(struct ibv_mr_cache *cache);
+
+/**
+ * ibv_reg_mr_cached - Get a registration covering [addr, addr + length)
+ *
+ * Returns a cached MR registered on pd with exactly the given access flags,
+ * registering a new one if none covers the range. The returned MR may cover
+ * a larger range than requested and must be released with
+ * ibv_dereg_mr_cached().
+ */
+struct ibv_mr *ibv_reg_mr_cached(struct ibv_mr_cache *cache,
+				 struct ibv_pd *pd, void *addr, size_t length,
+				 int access);
+
+/**
+ * ibv_dereg_mr_cached - Release a registration obtained from the cache
+ */
+int ibv_dereg_mr_cached(struct ibv_mr_cache *cache, struct ibv_mr *mr);
+
+/**
+ * ibv_mr_cache_invalidate - Drop cached registrations overlapping a range
+ *
+ * Must be called before memory backing cached registrations is unmapped or
+ * returned to the system, e.g. from munmap() or brk() hooks. A NULL cache
+ * invalidates the range in every cache of the process.
+ */
+void ibv_mr_cache_invalidate(struct ibv_mr_cache *cache, void *addr,
+			     size_t length);
+
+/**
+ * ibv_mr_cache_flush - Deregister idle cached registrations
+ *
+ * If pd is not NULL only registrations on that PD are dropped, which must be
+ * done before the PD is deallocated.
+ */
+void ibv_mr_cache_flush(struct ibv_mr_cache *cache, struct ibv_pd *pd);
+
+/**
+ * ibv_mr_cache_query - Read the cache statistics
+ */
+int ibv_mr_cache_query(struct ibv_mr_cache *cache,
+		       struct ibv_mr_cache_stats *stats);
+
 /**
  * ibv_alloc_mw - Allocate a memory window
  */
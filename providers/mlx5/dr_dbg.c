@@ -43,6 +43,8 @@ enum dr_dump_rec_type {
 	DR_DUMP_REC_TYPE_DOMAIN_INFO_VPORT = 3003,
 	DR_DUMP_REC_TYPE_DOMAIN_INFO_CAPS = 3004,
 	DR_DUMP_REC_TYPE_DOMAIN_SEND_RING = 3005,
+	DR_DUMP_REC_TYPE_DOMAIN_ICM_POOL = 3006,
+	DR_DUMP_REC_TYPE_DOMAIN_MEM = 3007,
 
 	DR_DUMP_REC_TYPE_TABLE = 3100,
 	DR_DUMP_REC_TYPE_TABLE_RX = 3101,
@@ -84,10 +86,9 @@ static void dump_hex_print(char *dest, char *src, uint32_t size)
 		sprintf(&dest[2 * i], "%02x", (uint8_t)src[i]);
 }
 
-static int dr_dump_rule_action_mem(FILE *f, const uint64_t rule_id,
-				   struct dr_rule_action_member *action_mem)
+static int dr_dump_rule_action(FILE *f, const uint64_t rule_id,
+			       struct mlx5dv_dr_action *action)
 {
-	struct mlx5dv_dr_action *action = action_mem->action;
 	const uint64_t action_id = (uint64_t) (uintptr_t) action;
 	int ret;
 
@@ -157,7 +158,7 @@ static int dr_dump_rule_action_mem(FILE *f, const uint64_t rule_id,
 	return 0;
 }
 
-static int dr_dump_rule_mem(FILE *f, struct dr_rule_member *rule_mem,
+static int dr_dump_rule_mem(FILE *f, struct dr_ste *ste,
 			    bool is_rx, const uint64_t rule_id)
 {
 	char hw_ste_dump[BUFF_SIZE] = {};
@@ -167,10 +168,11 @@ static int dr_dump_rule_mem(FILE *f, struct dr_rule_member *rule_mem,
 	mem_rec_type = is_rx ? DR_DUMP_REC_TYPE_RULE_RX_ENTRY :
 			       DR_DUMP_REC_TYPE_RULE_TX_ENTRY;
 
-	dump_hex_print(hw_ste_dump, (char *)rule_mem->ste->hw_ste, DR_STE_SIZE_REDUCED);
+	dump_hex_print(hw_ste_dump, (char *)dr_ste_get_hw_ste(ste),
+		       DR_STE_SIZE_REDUCED);
 	ret = fprintf(f, "%d,0x%" PRIx64 ",0x%" PRIx64 ",%s\n",
 		      mem_rec_type,
-		      dr_dump_icm_to_idx(dr_ste_get_icm_addr(rule_mem->ste)),
+		      dr_dump_icm_to_idx(dr_ste_get_icm_addr(ste)),
 		      rule_id,
 		      hw_ste_dump);
 	if (ret < 0)
@@ -182,11 +184,12 @@ static int dr_dump_rule_mem(FILE *f, struct dr_rule_member *rule_mem,
 static int dr_dump_rule_rx_tx(FILE *f, struct dr_rule_rx_tx *rule_rx_tx,
 			      bool is_rx, const uint64_t rule_id)
 {
-	struct dr_rule_member *rule_mem;
-	int ret;
+	struct dr_ste *ste_arr[DR_RULE_MAX_STE_CHAIN];
+	int num_of_stes, i, ret;
 
-	list_for_each(&rule_rx_tx->rule_members_list, rule_mem, list) {
-		ret = dr_dump_rule_mem(f, rule_mem, is_rx, rule_id);
+	num_of_stes = dr_rule_get_ste_chain(rule_rx_tx, ste_arr);
+	for (i = 0; i < num_of_stes; i++) {
+		ret = dr_dump_rule_mem(f, ste_arr[i], is_rx, rule_id);
 		if (ret < 0)
 			return ret;
 	}
@@ -195,11 +198,10 @@ static int dr_dump_rule_rx_tx(FILE *f, struct dr_rule_rx_tx *rule_rx_tx,
 
 static int dr_dump_rule(FILE *f, struct mlx5dv_dr_rule *rule)
 {
-	struct dr_rule_action_member *action_mem;
 	const uint64_t rule_id = (uint64_t) (uintptr_t) rule;
 	struct dr_rule_rx_tx *rx = &rule->rx;
 	struct dr_rule_rx_tx *tx = &rule->tx;
-	int ret;
+	int i, ret;
 
 	ret = fprintf(f, "%d,0x%" PRIx64 ",0x%" PRIx64 "\n",
 		      DR_DUMP_REC_TYPE_RULE,
@@ -222,8 +224,8 @@ static int dr_dump_rule(FILE *f, struct mlx5dv_dr_rule *rule)
 		}
 	}
 
-	list_for_each(&rule->rule_actions_list, action_mem, list) {
-		ret = dr_dump_rule_action_mem(f, rule_id, action_mem);
+	for (i = 0; i < rule->num_actions; i++) {
+		ret = dr_dump_rule_action(f, rule_id, rule->actions[i]);
 		if (ret < 0)
 			return ret;
 	}
@@ -238,11 +240,11 @@ int mlx5dv_dump_dr_rule(FILE *fout, struct mlx5dv_dr_rule *rule)
 	if (!fout || !rule)
 		return -EINVAL;
 
-	pthread_mutex_lock(&rule->matcher->tbl->dmn->mutex);
+	pthread_mutex_lock(&rule->matcher->mutex);
 
 	ret = dr_dump_rule(fout, rule);
 
-	pthread_mutex_unlock(&rule->matcher->tbl->dmn->mutex);
+	pthread_mutex_unlock(&rule->matcher->mutex);
 
 	return ret;
 }
@@ -407,13 +409,17 @@ static int dr_dump_matcher_all(FILE *fout, struct mlx5dv_dr_matcher *matcher)
 	if (ret < 0)
 		return ret;
 
+	pthread_mutex_lock(&matcher->mutex);
+
 	list_for_each(&matcher->rule_list, rule, rule_list) {
 		ret = dr_dump_rule(fout, rule);
 		if (ret < 0)
-			return ret;
+			break;
 	}
 
-	return 0;
+	pthread_mutex_unlock(&matcher->mutex);
+
+	return ret < 0 ? ret : 0;
 }
 
 int mlx5dv_dump_dr_matcher(FILE *fout, struct mlx5dv_dr_matcher *matcher)
@@ -539,6 +545,107 @@ static int dr_dump_send_ring(FILE *f, struct dr_send_ring *ring,
 	return 0;
 }
 
+static int dr_dump_icm_pool(FILE *f, struct dr_icm_pool *pool,
+			    enum dr_icm_type icm_type,
+			    const uint64_t domain_id)
+{
+	struct dr_icm_pool_stats stats;
+	unsigned int frag = 0;
+	int ret;
+
+	dr_icm_pool_get_stats(pool, &stats);
+
+	/* Percentage of the free memory outside the largest free segment */
+	if (stats.free_size)
+		frag = 100 - stats.max_free_seg_size * 100 / stats.free_size;
+
+	ret = fprintf(f, "%d,0x%" PRIx64 ",%d,%u,%" PRIu64 ",%" PRIu64 ",%"
+		      PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%u,%" PRIu64
+		      "\n",
+		      DR_DUMP_REC_TYPE_DOMAIN_ICM_POOL,
+		      domain_id,
+		      icm_type,
+		      stats.num_of_buddies,
+		      stats.total_size,
+		      stats.used_size,
+		      stats.hot_size,
+		      stats.free_size,
+		      stats.max_free_seg_size,
+		      stats.num_of_free_segs,
+		      frag,
+		      stats.num_of_syncs);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+/*
+ * Host memory used by the SW steering rules: the rule objects and the SW
+ * shadow of their STE hash tables.
+ */
+static int dr_dump_domain_mem(FILE *f, struct mlx5dv_dr_domain *dmn,
+			      const uint64_t domain_id)
+{
+	uint64_t num_rules = 0, num_actions = 0;
+	uint64_t rule_size, htbl_size, ste_size, num_entries;
+	uint64_t num_of_rule_entries, num_of_id_pages;
+	struct dr_icm_pool_stats stats;
+	struct mlx5dv_dr_matcher *matcher;
+	struct mlx5dv_dr_table *tbl;
+	struct mlx5dv_dr_rule *rule;
+	int ret;
+
+	list_for_each(&dmn->tbl_list, tbl, tbl_list) {
+		if (dr_is_root_table(tbl))
+			continue;
+
+		list_for_each(&tbl->matcher_list, matcher, matcher_list) {
+			pthread_mutex_lock(&matcher->mutex);
+			list_for_each(&matcher->rule_list, rule, rule_list) {
+				num_rules++;
+				num_actions += rule->num_actions;
+			}
+			pthread_mutex_unlock(&matcher->mutex);
+		}
+	}
+
+	dr_icm_pool_get_stats(dmn->ste_icm_pool, &stats);
+	num_entries = (stats.used_size - stats.hot_size) / DR_STE_SIZE;
+
+	pthread_mutex_lock(&dmn->htbl_ids.mutex);
+	num_of_rule_entries = dmn->htbl_ids.num_of_rule_entries;
+	num_of_id_pages = dmn->htbl_ids.num_of_pages;
+	pthread_mutex_unlock(&dmn->htbl_ids.mutex);
+
+	rule_size = num_rules * sizeof(struct mlx5dv_dr_rule) +
+		    num_actions * sizeof(struct mlx5dv_dr_action *);
+	htbl_size = stats.num_of_chunks * (sizeof(struct dr_ste_htbl) +
+					   sizeof(struct dr_icm_chunk)) +
+		    num_of_id_pages * DR_HTBL_ID_PAGE_SIZE *
+		    sizeof(union dr_htbl_id_entry);
+	ste_size = num_entries * (sizeof(struct dr_ste) +
+				  DR_STE_SIZE_REDUCED) +
+		   num_of_rule_entries * sizeof(struct dr_rule_rx_tx *);
+
+	ret = fprintf(f, "%d,0x%" PRIx64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+		      ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+		      DR_DUMP_REC_TYPE_DOMAIN_MEM,
+		      domain_id,
+		      num_rules,
+		      rule_size,
+		      stats.num_of_chunks,
+		      htbl_size,
+		      num_entries,
+		      ste_size,
+		      num_rules ?
+		      (rule_size + htbl_size + ste_size) / num_rules : 0);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
 static int dr_dump_domain_info_flex_parser(FILE *f, const char *flex_parser_name,
 					   const uint8_t flex_parser_value,
 					   const uint64_t domain_id)
@@ -639,7 +746,7 @@ static int dr_dump_domain(FILE *f, struct mlx5dv_dr_domain *dmn)
 	enum mlx5dv_dr_domain_type dmn_type = dmn->type;
 	char *dev_name = dmn->ctx->device->dev_name;
 	uint64_t domain_id;
-	int ret;
+	int i, ret;
 
 	domain_id = dr_domain_id_calc(dmn_type);
 
@@ -659,7 +766,23 @@ static int dr_dump_domain(FILE *f, struct mlx5dv_dr_domain *dmn)
 		return ret;
 
 	if (dmn->info.supp_sw_steering) {
-		ret = dr_dump_send_ring(f, dmn->send_ring, domain_id);
+		for (i = 0; i < DR_MAX_SEND_RINGS; i++) {
+			ret = dr_dump_send_ring(f, dmn->send_ring[i], domain_id);
+			if (ret < 0)
+				return ret;
+		}
+
+		ret = dr_dump_icm_pool(f, dmn->ste_icm_pool,
+				       DR_ICM_TYPE_STE, domain_id);
+		if (ret < 0)
+			return ret;
+
+		ret = dr_dump_icm_pool(f, dmn->action_icm_pool,
+				       DR_ICM_TYPE_MODIFY_ACTION, domain_id);
+		if (ret < 0)
+			return ret;
+
+		ret = dr_dump_domain_mem(f, dmn, domain_id);
 		if (ret < 0)
 			return ret;
 	}
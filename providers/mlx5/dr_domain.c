@@ -70,15 +70,23 @@ static int dr_domain_init_resources(struct mlx5dv_dr_domain *dmn)
 		goto free_ste_icm_pool;
 	}
 
+	ret = dr_htbl_ids_init(&dmn->htbl_ids);
+	if (ret) {
+		dr_dbg(dmn, "Couldn't allocate hash table ids\n");
+		goto free_action_icm_pool;
+	}
+
 	ret = dr_send_ring_alloc(dmn);
 	if (ret) {
 		dr_dbg(dmn, "Couldn't create send-ring for %s\n",
 		       ibv_get_device_name(dmn->ctx->device));
-		goto free_action_icm_pool;
+		goto uninit_htbl_ids;
 	}
 
 	return 0;
 
+uninit_htbl_ids:
+	dr_htbl_ids_uninit(&dmn->htbl_ids);
 free_action_icm_pool:
 	dr_icm_pool_destroy(dmn->action_icm_pool);
 free_ste_icm_pool:
@@ -93,7 +101,8 @@ clean_pd:
 
 static void dr_free_resources(struct mlx5dv_dr_domain *dmn)
 {
-	dr_send_ring_free(dmn->send_ring);
+	dr_send_ring_free(dmn);
+	dr_htbl_ids_uninit(&dmn->htbl_ids);
 	dr_icm_pool_destroy(dmn->action_icm_pool);
 	dr_icm_pool_destroy(dmn->ste_icm_pool);
 	mlx5dv_devx_free_uar(dmn->uar);
@@ -318,6 +327,7 @@ free_domain:
 int mlx5dv_dr_domain_sync(struct mlx5dv_dr_domain *dmn, uint32_t flags)
 {
 	int ret = 0;
+	int i;
 
 	if (!dmn->info.supp_sw_steering ||
 	    !check_comp_mask(flags, MLX5DV_DR_DOMAIN_SYNC_SUP_FLAGS)) {
@@ -326,22 +336,17 @@ int mlx5dv_dr_domain_sync(struct mlx5dv_dr_domain *dmn, uint32_t flags)
 	}
 
 	if (flags & MLX5DV_DR_DOMAIN_SYNC_FLAGS_SW) {
-		pthread_mutex_lock(&dmn->mutex);
-		ret = dr_send_ring_force_drain(dmn);
-		if (ret)
-			goto out_unlock;
-
-		pthread_mutex_unlock(&dmn->mutex);
+		for (i = 0; i < DR_MAX_SEND_RINGS; i++) {
+			ret = dr_send_ring_force_drain(dmn, dmn->send_ring[i]);
+			if (ret)
+				return ret;
+		}
 	}
 
 	if (flags & MLX5DV_DR_DOMAIN_SYNC_FLAGS_HW)
 		ret = dr_devx_sync_steering(dmn->ctx);
 
 	return ret;
-
-out_unlock:
-	pthread_mutex_unlock(&dmn->mutex);
-	return ret;
 }
 
 int mlx5dv_dr_domain_destroy(struct mlx5dv_dr_domain *dmn)
@@ -29,420 +29,361 @@
  * SOFTWARE.
  */
 
+
 #include <stdlib.h>
+#include <inttypes.h>
+#include <ccan/bitmap.h>
+#include <ccan/ilog.h>
 #include "mlx5dv_dr.h"
 
 #define DR_ICM_MODIFY_HDR_ALIGN_BASE	64
 
-struct dr_icm_pool;
-
 #define DR_ICM_SYNC_THRESHOLD (64 * 1024 * 1024)
 
-struct dr_icm_bucket {
+/*
+ * A registered ICM region split into blocks of the biggest chunk size, the
+ * blocks are managed by a buddy allocator so chunks of all sizes share the
+ * same memory. Offsets are counted in entries from icm_start_addr.
+ */
+struct dr_icm_buddy {
 	struct dr_icm_pool	*pool;
-
-	/* It is safe to allocate chunks from this list, now HW is guaranteed
-	 * to not access this memory
-	 */
-	struct list_head	free_list;
-	unsigned int		free_list_count;
-
-	/* This is the list of used chunks, HW may be accessing this memory */
-	struct list_head	used_list;
-	unsigned int		used_list_count;
-
-	/* HW may be accessing this memory but at some future,
-	 * undetermined time, it might cease to do so. Before deciding to call
-	 * sync_ste, this list is moved to tmp_list
-	 */
-	struct list_head	hot_list;
-	unsigned int		hot_list_count;
-
-	/* Temporary list, entries from the hot list are moved to this list.
-	 * sync_ste is executed and then tmp_list is concatenated to the free list
-	 */
-	struct list_head	tmp_list;
-	unsigned int		tmp_list_count;
-
-	uint32_t		total_chunks;
-	uint32_t		num_of_entries;
-	uint32_t		entry_size;
-	pthread_mutex_t		mutex;
+	struct ibv_mr		*mr;
+	struct ibv_dm		*dm;
+	uint64_t		icm_start_addr;
+	/* Offset of icm_start_addr from the start of the MR */
+	size_t			mr_offset;
+	unsigned int		num_of_blocks;
+	/* A set bit marks a free segment of that order */
+	bitmap			*bits[DR_CHUNK_SIZE_MAX];
+	unsigned int		num_free[DR_CHUNK_SIZE_MAX];
+	uint64_t		used_entries;
+	struct list_node	buddy_list;
 };
 
 struct dr_icm_pool {
-	struct dr_icm_bucket	*buckets;
 	enum dr_icm_type	icm_type;
 	enum dr_icm_chunk_size	max_log_chunk_sz;
-	enum dr_icm_chunk_size	num_of_buckets;
-	struct list_head	icm_mr_list;
-	pthread_mutex_t		mr_mutex;
+	uint32_t		entry_size;
 	struct mlx5dv_dr_domain	*dmn;
+	struct list_head	buddy_list;
+	/*
+	 * Chunks freed by SW, HW may still access them until the next
+	 * sync_ste. Ordered by free_epoch.
+	 */
+	struct list_head	hot_list;
+	uint64_t		hot_size;
+	/* Chunks freed in an epoch are released by the sync which ends it */
+	uint64_t		epoch;
+	uint64_t		num_of_syncs;
+	/* Allocated and not freed yet */
+	uint64_t		num_of_chunks;
+	/* Protects the buddies and the hot list */
+	pthread_mutex_t		mutex;
 };
 
-struct dr_icm_mr {
-	struct dr_icm_pool	*pool;
-	struct ibv_mr		*mr;
-	struct ibv_dm		*dm;
-	size_t			used_length;
-	uint64_t		icm_start_addr;
-	struct list_node	mr_list;
-};
-
-static struct dr_icm_mr *
-dr_icm_pool_mr_create(struct dr_icm_pool *pool,
-		      enum mlx5_ib_uapi_dm_type dm_type,
-		      size_t align_base)
+static unsigned long dr_icm_buddy_order_bits(struct dr_icm_buddy *buddy,
+					     unsigned int order)
 {
-	struct mlx5dv_alloc_dm_attr mlx5_dm_attr = {};
-	struct ibv_alloc_dm_attr dm_attr = {};
-	struct dr_icm_mr *icm_mr;
-	struct mlx5_dm *dm;
-	size_t align_diff;
-
-	icm_mr = calloc(1, sizeof(struct dr_icm_mr));
-	if (!icm_mr) {
-		errno = ENOMEM;
-		return NULL;
-	}
-
-	icm_mr->pool = pool;
-	list_node_init(&icm_mr->mr_list);
-
-	mlx5_dm_attr.type = dm_type;
-
-	/* 2^log_biggest_table * entry-size * double-for-alignment */
-	dm_attr.length = dr_icm_pool_chunk_size_to_byte(pool->max_log_chunk_sz,
-							pool->icm_type) * 2;
-
-	icm_mr->dm = mlx5dv_alloc_dm(pool->dmn->ctx, &dm_attr, &mlx5_dm_attr);
-	if (!icm_mr->dm) {
-		dr_dbg(pool->dmn, "Failed allocating DM\n");
-		goto free_icm_mr;
-	}
+	return (unsigned long)buddy->num_of_blocks <<
+	       (buddy->pool->max_log_chunk_sz - order);
+}
 
-	/* Register device memory */
-	icm_mr->mr = ibv_reg_dm_mr(pool->dmn->pd, icm_mr->dm, 0,
-				   dm_attr.length,
-				   IBV_ACCESS_ZERO_BASED |
-				   IBV_ACCESS_REMOTE_WRITE |
-				   IBV_ACCESS_LOCAL_WRITE |
-				   IBV_ACCESS_REMOTE_READ);
-	if (!icm_mr->mr) {
-		dr_dbg(pool->dmn, "Failed DM registration\n");
-		goto free_dm;
+/* Returns the offset of a free segment of 2^order entries, or -1 */
+static int64_t dr_icm_buddy_alloc(struct dr_icm_buddy *buddy,
+				  unsigned int order)
+{
+	unsigned int o, max_order = buddy->pool->max_log_chunk_sz;
+	unsigned long seg, nbits;
+
+	for (o = order; o <= max_order; o++)
+		if (buddy->num_free[o])
+			break;
+
+	if (o > max_order)
+		return -1;
+
+	nbits = dr_icm_buddy_order_bits(buddy, o);
+	seg = bitmap_ffs(buddy->bits[o], 0, nbits);
+	assert(seg < nbits);
+	bitmap_clear_bit(buddy->bits[o], seg);
+	buddy->num_free[o]--;
+
+	/* Split, keeping the lower half and freeing the upper one */
+	while (o > order) {
+		o--;
+		seg <<= 1;
+		bitmap_set_bit(buddy->bits[o], seg ^ 1);
+		buddy->num_free[o]++;
 	}
 
-	dm = to_mdm(icm_mr->dm);
-	icm_mr->icm_start_addr = dm->remote_va;
-
-	align_diff = icm_mr->icm_start_addr % align_base;
-	if (align_diff)
-		icm_mr->used_length = align_base - align_diff;
-
-	list_add_tail(&pool->icm_mr_list, &icm_mr->mr_list);
-
-	return icm_mr;
+	buddy->used_entries += 1ULL << order;
 
-free_dm:
-	mlx5_free_dm(icm_mr->dm);
-free_icm_mr:
-	free(icm_mr);
-	return NULL;
+	return (int64_t)seg << order;
 }
 
-static  void dr_icm_pool_mr_destroy(struct dr_icm_mr *icm_mr)
+static void dr_icm_buddy_free(struct dr_icm_buddy *buddy, uint64_t offset,
+			      unsigned int order)
 {
-	list_del(&icm_mr->mr_list);
-	ibv_dereg_mr(icm_mr->mr);
-	mlx5_free_dm(icm_mr->dm);
-	free(icm_mr);
+	unsigned int max_order = buddy->pool->max_log_chunk_sz;
+	unsigned long seg = offset >> order;
+
+	buddy->used_entries -= 1ULL << order;
+
+	/* Merge with the free buddies up to the biggest block */
+	while (order < max_order &&
+	       bitmap_test_bit(buddy->bits[order], seg ^ 1)) {
+		bitmap_clear_bit(buddy->bits[order], seg ^ 1);
+		buddy->num_free[order]--;
+		seg >>= 1;
+		order++;
+	}
+
+	bitmap_set_bit(buddy->bits[order], seg);
+	buddy->num_free[order]++;
 }
 
-static int dr_icm_chunk_ste_init(struct dr_icm_chunk *chunk)
+static void dr_icm_buddy_destroy(struct dr_icm_buddy *buddy)
 {
-	struct dr_icm_bucket *bucket = chunk->bucket;
-	struct dr_icm_pool *pool = bucket->pool;
+	int i;
 
-	chunk->ste_arr = calloc(bucket->num_of_entries, sizeof(struct dr_ste));
-	if (!chunk->ste_arr) {
-		dr_dbg(pool->dmn, "Failed allocating ste_arr for chunk\n");
-		errno = ENOMEM;
-		return errno;
-	}
+	list_del(&buddy->buddy_list);
 
-	chunk->hw_ste_arr = calloc(bucket->num_of_entries, DR_STE_SIZE_REDUCED);
-	if (!chunk->hw_ste_arr) {
-		dr_dbg(pool->dmn, "Failed allocating hw_ste_arr for chunk\n");
-		errno = ENOMEM;
-		goto out_free_ste_arr;
-	}
+	for (i = 0; i <= buddy->pool->max_log_chunk_sz; i++)
+		free(buddy->bits[i]);
 
-	chunk->miss_list = malloc(bucket->num_of_entries *
-				  sizeof(struct list_head));
-	if (!chunk->miss_list) {
-		dr_dbg(pool->dmn, "Failed allocating miss_list for chunk\n");
-		errno = ENOMEM;
-		goto out_free_hw_ste_arr;
-	}
-
-	return 0;
-
-out_free_hw_ste_arr:
-	free(chunk->hw_ste_arr);
-out_free_ste_arr:
-	free(chunk->ste_arr);
-	return errno;
+	if (buddy->mr)
+		ibv_dereg_mr(buddy->mr);
+	if (buddy->dm)
+		mlx5_free_dm(buddy->dm);
+	free(buddy);
 }
 
-static int dr_icm_chunks_create(struct dr_icm_bucket *bucket)
+static struct dr_icm_buddy *dr_icm_buddy_create(struct dr_icm_pool *pool)
 {
-	size_t mr_free_size, mr_req_size, mr_row_size;
-	struct dr_icm_pool *pool = bucket->pool;
+	struct mlx5dv_alloc_dm_attr mlx5_dm_attr = {};
+	struct ibv_alloc_dm_attr dm_attr = {};
 	enum mlx5_ib_uapi_dm_type dm_type;
-	struct dr_icm_chunk *chunk;
-	struct dr_icm_mr *icm_mr;
-	size_t align_base;
+	struct dr_icm_buddy *buddy;
+	size_t align_base, block_size;
+	unsigned long nbits;
+	struct mlx5_dm *dm;
+	size_t align_diff;
 	int i;
 
-	mr_req_size = bucket->num_of_entries * bucket->entry_size;
-	mr_row_size = dr_icm_pool_chunk_size_to_byte(pool->max_log_chunk_sz,
-						     pool->icm_type);
+	block_size = dr_icm_pool_chunk_size_to_byte(pool->max_log_chunk_sz,
+						    pool->icm_type);
 
 	if (pool->icm_type == DR_ICM_TYPE_STE) {
 		dm_type = MLX5_IB_UAPI_DM_TYPE_STEERING_SW_ICM;
-		/* Align base is the biggest chunk size / row size */
-		align_base = mr_row_size;
+		/* Align base is the biggest chunk size */
+		align_base = block_size;
 	} else {
 		dm_type = MLX5_IB_UAPI_DM_TYPE_HEADER_MODIFY_SW_ICM;
 		/* Align base is 64B */
 		align_base = DR_ICM_MODIFY_HDR_ALIGN_BASE;
 	}
 
-	pthread_mutex_lock(&pool->mr_mutex);
-	icm_mr = list_tail(&pool->icm_mr_list, struct dr_icm_mr, mr_list);
-	if (icm_mr)
-		mr_free_size = icm_mr->mr->length - icm_mr->used_length;
-
-	if (!icm_mr || mr_free_size < mr_row_size) {
-		icm_mr = dr_icm_pool_mr_create(pool, dm_type, align_base);
-		if (!icm_mr)
-			goto out_err;
-	}
-
-	/* Create memory aligned chunks */
-	for (i = 0; i < mr_row_size / mr_req_size; i++) {
-		chunk = calloc(1, sizeof(struct dr_icm_chunk));
-		if (!chunk) {
-			errno = ENOMEM;
-			goto out_err;
-		}
-
-		chunk->bucket = bucket;
-		chunk->rkey = icm_mr->mr->rkey;
-		chunk->mr_addr = (uintptr_t)icm_mr->mr->addr + icm_mr->used_length;
-		chunk->icm_addr = (uintptr_t)icm_mr->icm_start_addr + icm_mr->used_length;
-		icm_mr->used_length += mr_req_size;
-		chunk->num_of_entries = bucket->num_of_entries;
-		chunk->byte_size = chunk->num_of_entries * bucket->entry_size;
-
-		if (pool->icm_type == DR_ICM_TYPE_STE)
-			if (dr_icm_chunk_ste_init(chunk))
-				goto out_free_chunk;
-
-		list_node_init(&chunk->chunk_list);
-		list_add(&bucket->free_list, &chunk->chunk_list);
-		bucket->free_list_count++;
-		bucket->total_chunks++;
+	buddy = calloc(1, sizeof(*buddy));
+	if (!buddy) {
+		errno = ENOMEM;
+		return NULL;
 	}
-	pthread_mutex_unlock(&pool->mr_mutex);
-	return 0;
 
-out_free_chunk:
-	free(chunk);
-out_err:
-	pthread_mutex_unlock(&pool->mr_mutex);
-	return errno;
-}
+	buddy->pool = pool;
+	list_node_init(&buddy->buddy_list);
+	list_add_tail(&pool->buddy_list, &buddy->buddy_list);
 
-static void dr_icm_chunk_ste_cleanup(struct dr_icm_chunk *chunk)
-{
-	free(chunk->miss_list);
-	free(chunk->hw_ste_arr);
-	free(chunk->ste_arr);
-}
-
-static void dr_icm_chunk_destroy(struct dr_icm_chunk *chunk)
-{
-	struct dr_icm_bucket *bucket = chunk->bucket;
+	mlx5_dm_attr.type = dm_type;
 
-	list_del(&chunk->chunk_list);
-	bucket->total_chunks--;
+	/* 2^log_biggest_table * entry-size * double-for-alignment */
+	dm_attr.length = block_size * 2;
 
-	if (bucket->pool->icm_type == DR_ICM_TYPE_STE)
-		dr_icm_chunk_ste_cleanup(chunk);
+	buddy->dm = mlx5dv_alloc_dm(pool->dmn->ctx, &dm_attr, &mlx5_dm_attr);
+	if (!buddy->dm) {
+		dr_dbg(pool->dmn, "Failed allocating DM\n");
+		goto destroy_buddy;
+	}
 
-	free(chunk);
-}
+	/* Register device memory */
+	buddy->mr = ibv_reg_dm_mr(pool->dmn->pd, buddy->dm, 0,
+				  dm_attr.length,
+				  IBV_ACCESS_ZERO_BASED |
+				  IBV_ACCESS_REMOTE_WRITE |
+				  IBV_ACCESS_LOCAL_WRITE |
+				  IBV_ACCESS_REMOTE_READ);
+	if (!buddy->mr) {
+		dr_dbg(pool->dmn, "Failed DM registration\n");
+		goto destroy_buddy;
+	}
 
-static void dr_icm_bucket_init(struct dr_icm_pool *pool,
-			       struct dr_icm_bucket *bucket,
-			       enum dr_icm_chunk_size chunk_size)
-{
-	if (pool->icm_type == DR_ICM_TYPE_STE)
-		bucket->entry_size = DR_STE_SIZE;
-	else
-		bucket->entry_size = DR_MODIFY_ACTION_SIZE;
-
-	bucket->num_of_entries = dr_icm_pool_chunk_size_to_entries(chunk_size);
-	bucket->pool = pool;
-	pthread_mutex_init(&bucket->mutex, NULL);
-	list_head_init(&bucket->free_list);
-	list_head_init(&bucket->used_list);
-	list_head_init(&bucket->hot_list);
-	list_head_init(&bucket->tmp_list);
-}
+	dm = to_mdm(buddy->dm);
+	align_diff = dm->remote_va % align_base;
+	if (align_diff)
+		buddy->mr_offset = align_base - align_diff;
 
-static void dr_icm_bucket_cleanup(struct dr_icm_bucket *bucket)
-{
-	struct dr_icm_chunk *chunk, *next;
+	buddy->icm_start_addr = dm->remote_va + buddy->mr_offset;
+	buddy->num_of_blocks = (dm_attr.length - buddy->mr_offset) / block_size;
 
-	pthread_mutex_destroy(&bucket->mutex);
-	list_append_list(&bucket->free_list, &bucket->tmp_list);
-	list_append_list(&bucket->free_list, &bucket->hot_list);
+	for (i = 0; i <= pool->max_log_chunk_sz; i++) {
+		nbits = dr_icm_buddy_order_bits(buddy, i);
+		buddy->bits[i] = bitmap_alloc0(nbits);
+		if (!buddy->bits[i]) {
+			errno = ENOMEM;
+			goto destroy_buddy;
+		}
+	}
 
-	list_for_each_safe(&bucket->free_list, chunk, next, chunk_list)
-		dr_icm_chunk_destroy(chunk);
+	bitmap_fill_range(buddy->bits[pool->max_log_chunk_sz], 0,
+			  buddy->num_of_blocks);
+	buddy->num_free[pool->max_log_chunk_sz] = buddy->num_of_blocks;
 
-	assert(bucket->total_chunks == 0);
+	return buddy;
 
-	/* Cleanup of unreturned chunks */
-	list_for_each_safe(&bucket->used_list, chunk, next, chunk_list)
-		dr_icm_chunk_destroy(chunk);
+destroy_buddy:
+	dr_icm_buddy_destroy(buddy);
+	return NULL;
 }
 
-static uint64_t dr_icm_hot_mem_size(struct dr_icm_pool *pool)
+static void dr_icm_pool_get_stats_locked(struct dr_icm_pool *pool,
+					 struct dr_icm_pool_stats *stats)
 {
-	uint64_t hot_size = 0;
+	struct dr_icm_buddy *buddy;
+	uint64_t max_free = 0;
 	int i;
 
-	for (i = 0; i < pool->num_of_buckets; i++)
-		hot_size += pool->buckets[i].hot_list_count *
-			    dr_icm_pool_chunk_size_to_byte(i, pool->icm_type);
+	memset(stats, 0, sizeof(*stats));
 
-	return hot_size;
-}
+	list_for_each(&pool->buddy_list, buddy, buddy_list) {
+		stats->num_of_buddies++;
+		stats->total_size += (uint64_t)buddy->num_of_blocks <<
+				     pool->max_log_chunk_sz;
+		stats->used_size += buddy->used_entries;
 
-static bool dr_icm_reuse_hot_entries(struct dr_icm_pool *pool,
-				     struct dr_icm_bucket *bucket)
-{
-	uint64_t bytes_for_sync;
-
-	bytes_for_sync = dr_icm_hot_mem_size(pool);
-	if (bytes_for_sync < DR_ICM_SYNC_THRESHOLD || !bucket->hot_list_count)
-		return false;
+		for (i = 0; i <= pool->max_log_chunk_sz; i++) {
+			stats->num_of_free_segs += buddy->num_free[i];
+			if (buddy->num_free[i] && (1ULL << i) > max_free)
+				max_free = 1ULL << i;
+		}
+	}
 
-	return true;
+	stats->total_size *= pool->entry_size;
+	stats->used_size *= pool->entry_size;
+	stats->free_size = stats->total_size - stats->used_size;
+	stats->max_free_seg_size = max_free * pool->entry_size;
+	stats->hot_size = pool->hot_size;
+	stats->num_of_syncs = pool->num_of_syncs;
+	stats->num_of_chunks = pool->num_of_chunks;
 }
 
-static void dr_icm_chill_bucket_start(struct dr_icm_bucket *bucket)
+void dr_icm_pool_get_stats(struct dr_icm_pool *pool,
+			   struct dr_icm_pool_stats *stats)
 {
-	list_append_list(&bucket->tmp_list, &bucket->hot_list);
-	bucket->tmp_list_count += bucket->hot_list_count;
-	bucket->hot_list_count = 0;
+	pthread_mutex_lock(&pool->mutex);
+	dr_icm_pool_get_stats_locked(pool, stats);
+	pthread_mutex_unlock(&pool->mutex);
 }
 
-static void dr_icm_chill_bucket_end(struct dr_icm_bucket *bucket)
+static void dr_icm_pool_dbg_stats(struct dr_icm_pool *pool, const char *event)
 {
-	list_append_list(&bucket->free_list, &bucket->tmp_list);
-	bucket->free_list_count += bucket->tmp_list_count;
-	bucket->tmp_list_count = 0;
+	struct dr_icm_pool_stats stats;
+
+	dr_icm_pool_get_stats_locked(pool, &stats);
+	dr_dbg(pool->dmn, "ICM pool type %d %s: %u buddies, total %" PRIu64
+	       " used %" PRIu64 " hot %" PRIu64 " largest free %" PRIu64
+	       " in %" PRIu64 " segments, %" PRIu64 " syncs\n",
+	       pool->icm_type, event, stats.num_of_buddies, stats.total_size,
+	       stats.used_size, stats.hot_size, stats.max_free_seg_size,
+	       stats.num_of_free_segs, stats.num_of_syncs);
 }
 
-static void dr_icm_chill_bucket_abort(struct dr_icm_bucket *bucket)
+/*
+ * Must be called with pool->mutex held, which is released during the sync
+ * to let the other threads free chunks in the following epoch.
+ */
+static int dr_icm_pool_sync_hot(struct dr_icm_pool *pool)
 {
-	list_append_list(&bucket->hot_list, &bucket->tmp_list);
-	bucket->hot_list_count += bucket->tmp_list_count;
-	bucket->tmp_list_count = 0;
-}
+	struct dr_icm_chunk *chunk, *next;
+	uint64_t epoch = pool->epoch++;
+	int err;
 
-static void dr_icm_chill_buckets_start(struct dr_icm_pool *pool,
-				       struct dr_icm_bucket *cb,
-				       bool bucks[DR_CHUNK_SIZE_MAX])
-{
-	struct dr_icm_bucket *bucket;
-	int i;
+	pthread_mutex_unlock(&pool->mutex);
+	err = dr_devx_sync_steering(pool->dmn->ctx);
+	pthread_mutex_lock(&pool->mutex);
+	if (err) {
+		dr_dbg(pool->dmn, "Sync_steering failed\n");
+		return err;
+	}
 
-	for (i = 0; i < pool->num_of_buckets; i++) {
-		bucket = &pool->buckets[i];
-		if (bucket == cb) {
-			dr_icm_chill_bucket_start(bucket);
-			continue;
-		}
+	pool->num_of_syncs++;
 
-		/* Freeing the mutex is done at the end of that process, after
-		 * sync_ste was executed at dr_icm_chill_buckets_end func.
-		 */
-		if (!pthread_mutex_trylock(&bucket->mutex)) {
-			dr_icm_chill_bucket_start(bucket);
-			bucks[i] = true;
-		}
+	list_for_each_safe(&pool->hot_list, chunk, next, chunk_list) {
+		if (chunk->free_epoch > epoch)
+			break;
+
+		list_del(&chunk->chunk_list);
+		pool->hot_size -= chunk->byte_size;
+		dr_icm_buddy_free(chunk->buddy, chunk->seg,
+				  ilog32(chunk->num_of_entries) - 1);
+		free(chunk);
 	}
+
+	return 0;
 }
 
-static void dr_icm_chill_buckets_end(struct dr_icm_pool *pool,
-				     struct dr_icm_bucket *cb,
-				     bool bucks[DR_CHUNK_SIZE_MAX])
+/* Must be called with pool->mutex held */
+static int dr_icm_pool_alloc_seg(struct dr_icm_pool *pool,
+				 enum dr_icm_chunk_size chunk_size,
+				 struct dr_icm_buddy **seg_buddy,
+				 uint64_t *seg)
 {
-	struct dr_icm_bucket *bucket;
-	int i;
+	bool synced = false;
+	struct dr_icm_buddy *buddy;
+	int64_t offset;
+	int err;
 
-	for (i = 0; i < pool->num_of_buckets; i++) {
-		bucket = &pool->buckets[i];
-		if (bucket == cb) {
-			dr_icm_chill_bucket_end(bucket);
-			continue;
+	while (true) {
+		list_for_each(&pool->buddy_list, buddy, buddy_list) {
+			offset = dr_icm_buddy_alloc(buddy, chunk_size);
+			if (offset >= 0) {
+				*seg_buddy = buddy;
+				*seg = offset;
+				return 0;
+			}
 		}
 
-		if (!bucks[i])
-			continue;
+		/*
+		 * Freed memory of any size is reusable once HW is synced,
+		 * prefer it over a new region when there is enough of it.
+		 */
+		if (synced || pool->hot_size < DR_ICM_SYNC_THRESHOLD)
+			break;
 
-		dr_icm_chill_bucket_end(bucket);
-		pthread_mutex_unlock(&bucket->mutex);
+		err = dr_icm_pool_sync_hot(pool);
+		if (err)
+			return err;
+		synced = true;
 	}
-}
 
-static void dr_icm_chill_buckets_abort(struct dr_icm_pool *pool,
-				       struct dr_icm_bucket *cb,
-				       bool bucks[DR_CHUNK_SIZE_MAX])
-{
-	struct dr_icm_bucket *bucket;
-	int i;
+	buddy = dr_icm_buddy_create(pool);
+	if (!buddy)
+		return errno ? errno : ENOMEM;
 
-	for (i = 0; i < pool->num_of_buckets; i++) {
-		bucket = &pool->buckets[i];
-		if (bucket == cb) {
-			dr_icm_chill_bucket_abort(bucket);
-			continue;
-		}
+	dr_icm_pool_dbg_stats(pool, "new buddy");
 
-		if (!bucks[i])
-			continue;
-
-		dr_icm_chill_bucket_abort(bucket);
-		pthread_mutex_unlock(&bucket->mutex);
-	}
+	offset = dr_icm_buddy_alloc(buddy, chunk_size);
+	assert(offset >= 0);
+	*seg_buddy = buddy;
+	*seg = offset;
+	return 0;
 }
 
-/* Allocate an ICM chunk, each chunk holds a piece of ICM memory and
- * also memory used for HW STE management for optimisations.
- */
+/* Allocate an ICM chunk, each chunk holds a piece of ICM memory */
 struct dr_icm_chunk *dr_icm_alloc_chunk(struct dr_icm_pool *pool,
 					enum dr_icm_chunk_size chunk_size)
 {
-	bool bucks[DR_CHUNK_SIZE_MAX] = {};
-	struct dr_icm_bucket *bucket;
+	struct dr_icm_buddy *buddy = NULL;
 	struct dr_icm_chunk *chunk;
+	uint64_t seg = 0;
 	int err;
 
 	if (chunk_size > pool->max_log_chunk_sz) {
@@ -450,56 +391,51 @@ struct dr_icm_chunk *dr_icm_alloc_chunk(struct dr_icm_pool *pool,
 		return NULL;
 	}
 
-	bucket = &pool->buckets[chunk_size];
-
-	pthread_mutex_lock(&bucket->mutex);
-
-	/* Take chunk from pool if available, otherwise allocate new chunks */
-	if (list_empty(&bucket->free_list)) {
-		if (dr_icm_reuse_hot_entries(pool, bucket)) {
-			dr_icm_chill_buckets_start(pool, bucket, bucks);
-			err = dr_devx_sync_steering(pool->dmn->ctx);
-			if (err) {
-				dr_icm_chill_buckets_abort(pool, bucket, bucks);
-				dr_dbg(pool->dmn, "Sync_steering failed\n");
-				chunk = NULL;
-				goto out;
-			}
-			dr_icm_chill_buckets_end(pool, bucket, bucks);
-		} else {
-			dr_icm_chunks_create(bucket);
-		}
+	chunk = calloc(1, sizeof(struct dr_icm_chunk));
+	if (!chunk) {
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	chunk = list_tail(&bucket->free_list, struct dr_icm_chunk, chunk_list);
-	if (chunk) {
-		list_del_init(&chunk->chunk_list);
-		list_add_tail(&bucket->used_list, &chunk->chunk_list);
-		bucket->free_list_count--;
-		bucket->used_list_count++;
+	chunk->num_of_entries = dr_icm_pool_chunk_size_to_entries(chunk_size);
+	chunk->byte_size = dr_icm_pool_chunk_size_to_byte(chunk_size,
+							  pool->icm_type);
+
+	pthread_mutex_lock(&pool->mutex);
+	err = dr_icm_pool_alloc_seg(pool, chunk_size, &buddy, &seg);
+	if (!err)
+		pool->num_of_chunks++;
+	pthread_mutex_unlock(&pool->mutex);
+	if (err) {
+		errno = err;
+		goto free_chunk;
 	}
-out:
-	pthread_mutex_unlock(&bucket->mutex);
+
+	chunk->buddy = buddy;
+	chunk->seg = seg;
+	chunk->rkey = buddy->mr->rkey;
+	chunk->mr_addr = (uintptr_t)buddy->mr->addr + buddy->mr_offset +
+			 seg * pool->entry_size;
+	chunk->icm_addr = buddy->icm_start_addr + seg * pool->entry_size;
+	list_node_init(&chunk->chunk_list);
+
 	return chunk;
+
+free_chunk:
+	free(chunk);
+	return NULL;
 }
 
 void dr_icm_free_chunk(struct dr_icm_chunk *chunk)
 {
-	struct dr_icm_bucket *bucket = chunk->bucket;
-
-	if (bucket->pool->icm_type == DR_ICM_TYPE_STE) {
-		memset(chunk->ste_arr, 0,
-		       bucket->num_of_entries * sizeof(struct dr_ste));
-		memset(chunk->hw_ste_arr, 0,
-		       bucket->num_of_entries * DR_STE_SIZE_REDUCED);
-	}
-
-	pthread_mutex_lock(&bucket->mutex);
-	list_del_init(&chunk->chunk_list);
-	list_add_tail(&bucket->hot_list, &chunk->chunk_list);
-	bucket->hot_list_count++;
-	bucket->used_list_count--;
-	pthread_mutex_unlock(&bucket->mutex);
+	struct dr_icm_pool *pool = chunk->buddy->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	chunk->free_epoch = pool->epoch;
+	pool->num_of_chunks--;
+	list_add_tail(&pool->hot_list, &chunk->chunk_list);
+	pool->hot_size += chunk->byte_size;
+	pthread_mutex_unlock(&pool->mutex);
 }
 
 struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
@@ -507,7 +443,6 @@ struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 {
 	enum dr_icm_chunk_size max_log_chunk_sz;
 	struct dr_icm_pool *pool;
-	int i;
 
 	if (icm_type == DR_ICM_TYPE_STE)
 		max_log_chunk_sz = dmn->info.max_log_sw_icm_sz;
@@ -520,43 +455,35 @@ struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 		return NULL;
 	}
 
-	pool->buckets = calloc(max_log_chunk_sz + 1, sizeof(struct dr_icm_bucket));
-	if (!pool->buckets) {
-		errno = ENOMEM;
-		goto free_pool;
-	}
-
 	pool->dmn = dmn;
 	pool->icm_type = icm_type;
 	pool->max_log_chunk_sz = max_log_chunk_sz;
-	pool->num_of_buckets = max_log_chunk_sz + 1;
-	list_head_init(&pool->icm_mr_list);
-
-	for (i = 0; i < pool->num_of_buckets; i++)
-		dr_icm_bucket_init(pool, &pool->buckets[i], i);
-
-	pthread_mutex_init(&pool->mr_mutex, NULL);
+	if (icm_type == DR_ICM_TYPE_STE)
+		pool->entry_size = DR_STE_SIZE;
+	else
+		pool->entry_size = DR_MODIFY_ACTION_SIZE;
+	list_head_init(&pool->buddy_list);
+	list_head_init(&pool->hot_list);
+	pthread_mutex_init(&pool->mutex, NULL);
 
 	return pool;
-
-free_pool:
-	free(pool);
-	return NULL;
 }
 
 void dr_icm_pool_destroy(struct dr_icm_pool *pool)
 {
-	struct dr_icm_mr *icm_mr, *next;
-	int i;
+	struct dr_icm_buddy *buddy, *next_buddy;
+	struct dr_icm_chunk *chunk, *next;
 
-	pthread_mutex_destroy(&pool->mr_mutex);
+	dr_icm_pool_dbg_stats(pool, "destroy");
 
-	list_for_each_safe(&pool->icm_mr_list, icm_mr, next, mr_list)
-		dr_icm_pool_mr_destroy(icm_mr);
+	list_for_each_safe(&pool->hot_list, chunk, next, chunk_list) {
+		list_del(&chunk->chunk_list);
+		free(chunk);
+	}
 
-	for (i = 0; i < pool->num_of_buckets; i++)
-		dr_icm_bucket_cleanup(&pool->buckets[i]);
+	list_for_each_safe(&pool->buddy_list, buddy, next_buddy, buddy_list)
+		dr_icm_buddy_destroy(buddy);
 
-	free(pool->buckets);
+	pthread_mutex_destroy(&pool->mutex);
 	free(pool);
 }
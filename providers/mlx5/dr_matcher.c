@@ -444,6 +444,7 @@ static int dr_matcher_set_ste_builders(struct mlx5dv_dr_matcher *matcher,
 }
 
 static int dr_matcher_connect(struct mlx5dv_dr_domain *dmn,
+			      struct dr_send_ring *send_ring,
 			      struct dr_matcher_rx_tx *curr_nic_matcher,
 			      struct dr_matcher_rx_tx *next_nic_matcher,
 			      struct dr_matcher_rx_tx *prev_nic_matcher)
@@ -462,7 +463,7 @@ static int dr_matcher_connect(struct mlx5dv_dr_domain *dmn,
 		info.type = CONNECT_MISS;
 		info.miss_icm_addr = nic_dmn->default_icm_addr;
 	}
-	ret = dr_ste_htbl_init_and_postsend(dmn, nic_dmn,
+	ret = dr_ste_htbl_init_and_postsend(dmn, send_ring, nic_dmn,
 					    curr_nic_matcher->e_anchor,
 					    &info, info.type == CONNECT_HIT);
 	if (ret)
@@ -471,7 +472,7 @@ static int dr_matcher_connect(struct mlx5dv_dr_domain *dmn,
 	/* Connect start hash table to end anchor */
 	info.type = CONNECT_MISS;
 	info.miss_icm_addr = curr_nic_matcher->e_anchor->chunk->icm_addr;
-	ret = dr_ste_htbl_init_and_postsend(dmn, nic_dmn,
+	ret = dr_ste_htbl_init_and_postsend(dmn, send_ring, nic_dmn,
 					    curr_nic_matcher->s_htbl,
 					    &info, false);
 	if (ret)
@@ -485,18 +486,18 @@ static int dr_matcher_connect(struct mlx5dv_dr_domain *dmn,
 
 	info.type = CONNECT_HIT;
 	info.hit_next_htbl = curr_nic_matcher->s_htbl;
-	ret = dr_ste_htbl_init_and_postsend(dmn, nic_dmn, prev_htbl,
-					    &info, true);
+	ret = dr_ste_htbl_init_and_postsend(dmn, send_ring, nic_dmn,
+					    prev_htbl, &info, true);
 	if (ret)
 		return ret;
 
 	/* Update the pointing ste and next hash table */
 	curr_nic_matcher->s_htbl->pointing_ste = prev_htbl->ste_arr;
-	prev_htbl->ste_arr[0].next_htbl = curr_nic_matcher->s_htbl;
+	prev_htbl->ste_arr[0].next_htbl = curr_nic_matcher->s_htbl->id;
 
 	if (next_nic_matcher) {
 		next_nic_matcher->s_htbl->pointing_ste = curr_nic_matcher->e_anchor->ste_arr;
-		curr_nic_matcher->e_anchor->ste_arr[0].next_htbl = next_nic_matcher->s_htbl;
+		curr_nic_matcher->e_anchor->ste_arr[0].next_htbl = next_nic_matcher->s_htbl->id;
 	}
 
 	return 0;
@@ -529,24 +530,35 @@ static int dr_matcher_add_to_tbl(struct mlx5dv_dr_matcher *matcher)
 					 struct mlx5dv_dr_matcher,
 					 matcher_list);
 
+	pthread_mutex_lock(&tbl->mutex);
+
 	if (dmn->type == MLX5DV_DR_DOMAIN_TYPE_FDB ||
 	    dmn->type == MLX5DV_DR_DOMAIN_TYPE_NIC_RX) {
-		ret = dr_matcher_connect(dmn, &matcher->rx,
+		ret = dr_matcher_connect(dmn, matcher->send_ring, &matcher->rx,
 					 next_matcher ? &next_matcher->rx : NULL,
 					 prev_matcher ?	&prev_matcher->rx : NULL);
 		if (ret)
-			return ret;
+			goto unlock_tbl;
 	}
 
 	if (dmn->type == MLX5DV_DR_DOMAIN_TYPE_FDB ||
 	    dmn->type == MLX5DV_DR_DOMAIN_TYPE_NIC_TX) {
-		ret = dr_matcher_connect(dmn, &matcher->tx,
+		ret = dr_matcher_connect(dmn, matcher->send_ring, &matcher->tx,
 					 next_matcher ? &next_matcher->tx : NULL,
 					 prev_matcher ?	&prev_matcher->tx : NULL);
 		if (ret)
-			return ret;
+			goto unlock_tbl;
 	}
 
+	/*
+	 * The anchors are shared with the neighbour matchers which post on
+	 * other send rings, the writes must be done before releasing them.
+	 */
+	ret = dr_send_ring_force_drain(dmn, matcher->send_ring);
+	pthread_mutex_unlock(&tbl->mutex);
+	if (ret)
+		return ret;
+
 	if (prev_matcher)
 		list_add_after(&tbl->matcher_list,
 			       &prev_matcher->matcher_list,
@@ -559,6 +571,10 @@ static int dr_matcher_add_to_tbl(struct mlx5dv_dr_matcher *matcher)
 		list_add(&tbl->matcher_list, &matcher->matcher_list);
 
 	return 0;
+
+unlock_tbl:
+	pthread_mutex_unlock(&tbl->mutex);
+	return ret;
 }
 
 static void dr_matcher_uninit_nic(struct dr_matcher_rx_tx *nic_matcher)
@@ -613,17 +629,18 @@ static int dr_matcher_init_nic(struct mlx5dv_dr_matcher *matcher,
 	if (ret)
 		return ret;
 
-	nic_matcher->e_anchor = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+	nic_matcher->e_anchor = dr_ste_htbl_alloc(dmn,
 						  DR_CHUNK_SIZE_1,
 						  DR_STE_LU_TYPE_DONT_CARE,
-						  0);
+						  0, false);
 	if (!nic_matcher->e_anchor)
 		return errno;
 
-	nic_matcher->s_htbl = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+	nic_matcher->s_htbl = dr_ste_htbl_alloc(dmn,
 						DR_CHUNK_SIZE_1,
 						nic_matcher->ste_builder[0].lu_type,
-						nic_matcher->ste_builder[0].byte_mask);
+						nic_matcher->ste_builder[0].byte_mask,
+						dr_ste_is_last_in_rule(nic_matcher, 1));
 	if (!nic_matcher->s_htbl)
 		goto free_e_htbl;
 
@@ -756,9 +773,13 @@ mlx5dv_dr_matcher_create(struct mlx5dv_dr_table *tbl,
 	atomic_init(&matcher->refcount, 1);
 	list_node_init(&matcher->matcher_list);
 	list_head_init(&matcher->rule_list);
+	list_head_init(&matcher->bulk_list);
+	pthread_mutex_init(&matcher->mutex, NULL);
 
 	pthread_mutex_lock(&tbl->dmn->mutex);
 
+	matcher->send_ring = dr_send_ring_next(tbl->dmn);
+
 	ret = dr_matcher_init(matcher, mask);
 	if (ret)
 		goto free_matcher;
@@ -775,6 +796,7 @@ matcher_uninit:
 	dr_matcher_uninit(matcher);
 free_matcher:
 	pthread_mutex_unlock(&tbl->dmn->mutex);
+	pthread_mutex_destroy(&matcher->mutex);
 	free(matcher);
 dec_ref:
 	atomic_fetch_sub(&tbl->refcount, 1);
@@ -782,6 +804,7 @@ dec_ref:
 }
 
 static int dr_matcher_disconnect(struct mlx5dv_dr_domain *dmn,
+				 struct dr_send_ring *send_ring,
 				 struct dr_table_rx_tx *nic_tbl,
 				 struct dr_matcher_rx_tx *next_nic_matcher,
 				 struct dr_matcher_rx_tx *prev_nic_matcher)
@@ -800,15 +823,15 @@ static int dr_matcher_disconnect(struct mlx5dv_dr_domain *dmn,
 		info.type = CONNECT_HIT;
 		info.hit_next_htbl = next_nic_matcher->s_htbl;
 		next_nic_matcher->s_htbl->pointing_ste = prev_anchor->ste_arr;
-		prev_anchor->ste_arr[0].next_htbl = next_nic_matcher->s_htbl;
+		prev_anchor->ste_arr[0].next_htbl = next_nic_matcher->s_htbl->id;
 	} else {
 		info.type = CONNECT_MISS;
 		info.miss_icm_addr = nic_dmn->default_icm_addr;
-		prev_anchor->ste_arr[0].next_htbl = NULL;
+		prev_anchor->ste_arr[0].next_htbl = 0;
 	}
 
-	return dr_ste_htbl_init_and_postsend(dmn, nic_dmn, prev_anchor,
-					     &info, true);
+	return dr_ste_htbl_init_and_postsend(dmn, send_ring, nic_dmn,
+					     prev_anchor, &info, true);
 }
 
 static int dr_matcher_remove_from_tbl(struct mlx5dv_dr_matcher *matcher)
@@ -824,36 +847,51 @@ static int dr_matcher_remove_from_tbl(struct mlx5dv_dr_matcher *matcher)
 	prev_matcher = list_prev(&tbl->matcher_list, matcher, matcher_list);
 	next_matcher = list_next(&tbl->matcher_list, matcher, matcher_list);
 
+	pthread_mutex_lock(&tbl->mutex);
+
 	if (dmn->type == MLX5DV_DR_DOMAIN_TYPE_FDB ||
 	    dmn->type == MLX5DV_DR_DOMAIN_TYPE_NIC_RX) {
-		ret = dr_matcher_disconnect(dmn, &tbl->rx,
+		ret = dr_matcher_disconnect(dmn, matcher->send_ring, &tbl->rx,
 					    next_matcher ? &next_matcher->rx : NULL,
 					    prev_matcher ? &prev_matcher->rx : NULL);
 		if (ret)
-			return ret;
+			goto unlock_tbl;
 	}
 
 	if (dmn->type == MLX5DV_DR_DOMAIN_TYPE_FDB ||
 	    dmn->type == MLX5DV_DR_DOMAIN_TYPE_NIC_TX) {
-		ret = dr_matcher_disconnect(dmn, &tbl->tx,
+		ret = dr_matcher_disconnect(dmn, matcher->send_ring, &tbl->tx,
 					    next_matcher ? &next_matcher->tx : NULL,
 					    prev_matcher ? &prev_matcher->tx : NULL);
 		if (ret)
-			return ret;
+			goto unlock_tbl;
 	}
 
+	ret = dr_send_ring_force_drain(dmn, matcher->send_ring);
+	if (ret)
+		goto unlock_tbl;
+
 	list_del(&matcher->matcher_list);
 
-	return 0;
+unlock_tbl:
+	pthread_mutex_unlock(&tbl->mutex);
+	return ret;
 }
 
 int mlx5dv_dr_matcher_destroy(struct mlx5dv_dr_matcher *matcher)
 {
 	struct mlx5dv_dr_table *tbl = matcher->tbl;
+	struct dr_rule_bulk *bulk, *tmp;
 
 	if (atomic_load(&matcher->refcount) > 1)
 		return EBUSY;
 
+	/* Bulks of rules that were destroyed without being polled */
+	list_for_each_safe(&matcher->bulk_list, bulk, tmp, list) {
+		list_del(&bulk->list);
+		free(bulk);
+	}
+
 	pthread_mutex_lock(&tbl->dmn->mutex);
 
 	dr_matcher_remove_from_tbl(matcher);
@@ -861,6 +899,7 @@ int mlx5dv_dr_matcher_destroy(struct mlx5dv_dr_matcher *matcher)
 	atomic_fetch_sub(&matcher->tbl->refcount, 1);
 
 	pthread_mutex_unlock(&tbl->dmn->mutex);
+	pthread_mutex_destroy(&matcher->mutex);
 	free(matcher);
 
 	return 0;
@@ -34,18 +34,17 @@
 #include <ccan/minmax.h>
 #include "mlx5dv_dr.h"
 
-#define DR_RULE_MAX_STE_CHAIN (DR_RULE_MAX_STES + DR_ACTION_MAX_STES)
-
 static int dr_rule_append_to_miss_list(struct dr_ste *new_last_ste,
-				       struct list_head *miss_list,
+				       struct dr_ste *miss_head,
 				       struct list_head *send_list)
 {
 	struct dr_ste_send_info *ste_info_last;
-	struct dr_ste *last_ste;
+	struct dr_ste *last_ste, *next_ste;
 
 	/* The new entry will be inserted after the last */
-	last_ste = list_tail(miss_list, struct dr_ste, miss_list_node);
-	assert(last_ste);
+	last_ste = miss_head;
+	while ((next_ste = dr_ste_get_miss_next(last_ste)))
+		last_ste = next_ste;
 
 	ste_info_last = calloc(1, sizeof(*ste_info_last));
 	if (!ste_info_last) {
@@ -53,11 +52,12 @@ static int dr_rule_append_to_miss_list(struct dr_ste *new_last_ste,
 		return errno;
 	}
 
-	dr_ste_set_miss_addr(last_ste->hw_ste, dr_ste_get_icm_addr(new_last_ste));
-	list_add_tail(miss_list, &new_last_ste->miss_list_node);
+	dr_ste_set_miss_addr(dr_ste_get_hw_ste(last_ste),
+			     dr_ste_get_icm_addr(new_last_ste));
+	last_ste->miss_next = dr_ste_get_htbl(new_last_ste)->id;
 
 	dr_send_fill_and_append_ste_send_info(last_ste, DR_STE_SIZE_REDUCED,
-					      0, last_ste->hw_ste,
+					      0, dr_ste_get_hw_ste(last_ste),
 					      ste_info_last, send_list, true);
 
 	return 0;
@@ -66,17 +66,20 @@ static int dr_rule_append_to_miss_list(struct dr_ste *new_last_ste,
 static struct dr_ste
 *dr_rule_create_collision_htbl(struct mlx5dv_dr_matcher *matcher,
 			       struct dr_matcher_rx_tx *nic_matcher,
-			       uint8_t *hw_ste)
+			       uint8_t *hw_ste,
+			       uint8_t ste_location)
 {
 	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
 	struct dr_ste_htbl *new_htbl;
 	struct dr_ste *ste;
 
 	/* Create new table for miss entry */
-	new_htbl = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+	new_htbl = dr_ste_htbl_alloc(dmn,
 				     DR_CHUNK_SIZE_1,
 				     DR_STE_LU_TYPE_DONT_CARE,
-				     0);
+				     0,
+				     dr_ste_is_last_in_rule(nic_matcher,
+							    ste_location));
 	if (!new_htbl) {
 		dr_dbg(dmn, "Failed allocating collision table\n");
 		return NULL;
@@ -84,6 +87,7 @@ static struct dr_ste
 
 	/* One and only entry, never grows */
 	ste = new_htbl->ste_arr;
+	ste->ste_chain_location = ste_location;
 	dr_ste_set_miss_addr(hw_ste, nic_matcher->e_anchor->chunk->icm_addr);
 	dr_htbl_get(new_htbl);
 
@@ -97,17 +101,13 @@ static struct dr_ste *dr_rule_create_collision_entry(struct mlx5dv_dr_matcher *m
 {
 	struct dr_ste *ste;
 
-	ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste);
+	ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste,
+					    orig_ste->ste_chain_location);
 	if (!ste) {
 		dr_dbg(matcher->tbl->dmn, "Failed creating collision entry\n");
 		return NULL;
 	}
 
-	ste->ste_chain_location = orig_ste->ste_chain_location;
-
-	/* In collision entry, all members share the same miss_list_head */
-	ste->htbl->miss_list = dr_ste_get_miss_list(orig_ste);
-
 	/* Next table */
 	if (dr_ste_create_next_htbl(matcher, nic_matcher, ste, hw_ste,
 				    DR_CHUNK_SIZE_1)) {
@@ -122,62 +122,14 @@ free_tbl:
 	return NULL;
 }
 
-static int dr_rule_handle_one_ste_in_update_list(struct dr_ste_send_info *ste_info,
-						 struct mlx5dv_dr_domain *dmn)
-{
-	int ret;
-
-	list_del(&ste_info->send_list);
-	ret = dr_send_postsend_ste(dmn, ste_info->ste, ste_info->data,
-				   ste_info->size, ste_info->offset);
-	if (ret)
-		goto out;
-	/* Copy data to ste, only reduced size, the last 16B (mask)
-	 * is already written to the hw.
-	 */
-	memcpy(ste_info->ste->hw_ste, ste_info->data, DR_STE_SIZE_REDUCED);
-
-out:
-	free(ste_info);
-	return ret;
-}
-
-static int dr_rule_send_update_list(struct list_head *send_ste_list,
-				    struct mlx5dv_dr_domain *dmn,
-				    bool is_reverse)
-{
-	struct dr_ste_send_info *ste_info, *tmp_ste_info;
-	int ret;
-
-	if (is_reverse) {
-		list_for_each_rev_safe(send_ste_list, ste_info, tmp_ste_info,
-				       send_list) {
-			ret = dr_rule_handle_one_ste_in_update_list(ste_info,
-								    dmn);
-			if (ret)
-				return ret;
-		}
-	} else {
-		list_for_each_safe(send_ste_list, ste_info, tmp_ste_info,
-				   send_list) {
-			ret = dr_rule_handle_one_ste_in_update_list(ste_info,
-								    dmn);
-			if (ret)
-				return ret;
-		}
-	}
-
-	return 0;
-}
-
-static struct dr_ste *dr_rule_find_ste_in_miss_list(struct list_head *miss_list,
+static struct dr_ste *dr_rule_find_ste_in_miss_list(struct dr_ste *miss_head,
 						    uint8_t *hw_ste)
 {
 	struct dr_ste *ste;
 
 	/* Check if hw_ste is present in the list */
-	list_for_each(miss_list, ste, miss_list_node)
-		if (dr_ste_equal_tag(ste->hw_ste, hw_ste))
+	for (ste = miss_head; ste; ste = dr_ste_get_miss_next(ste))
+		if (dr_ste_equal_tag(dr_ste_get_hw_ste(ste), hw_ste))
 			return ste;
 
 	return NULL;
@@ -193,22 +145,21 @@ dr_rule_rehash_handle_collision(struct mlx5dv_dr_matcher *matcher,
 	struct dr_ste *new_ste;
 	int ret;
 
-	new_ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste);
+	new_ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste,
+						col_ste->ste_chain_location);
 	if (!new_ste)
 		return NULL;
 
-	/* In collision entry, all members share the same miss_list_head */
-	new_ste->htbl->miss_list = dr_ste_get_miss_list(col_ste);
-
 	/* Update the previous from the list */
-	ret = dr_rule_append_to_miss_list(new_ste,
-					  dr_ste_get_miss_list(col_ste),
-					  update_list);
+	ret = dr_rule_append_to_miss_list(new_ste, col_ste, update_list);
 	if (ret) {
 		dr_dbg(matcher->tbl->dmn, "Failed update dup entry\n");
 		goto err_exit;
 	}
 
+	/* In collision entry, all members share the same miss_list_head */
+	dr_ste_get_htbl(new_ste)->miss_head = col_ste;
+
 	return new_ste;
 
 err_exit:
@@ -224,8 +175,8 @@ static void dr_rule_rehash_copy_ste_ctrl(struct mlx5dv_dr_matcher *matcher,
 	new_ste->next_htbl = cur_ste->next_htbl;
 	new_ste->ste_chain_location = cur_ste->ste_chain_location;
 
-	if (!dr_ste_is_last_in_rule(nic_matcher, new_ste->ste_chain_location))
-		new_ste->next_htbl->pointing_ste = new_ste;
+	if (new_ste->next_htbl)
+		dr_ste_get_next_htbl(new_ste)->pointing_ste = new_ste;
 
 	/*
 	 * We need to copy the refcount since this ste
@@ -233,10 +184,8 @@ static void dr_rule_rehash_copy_ste_ctrl(struct mlx5dv_dr_matcher *matcher,
 	 */
 	atomic_init(&new_ste->refcount, atomic_load(&cur_ste->refcount));
 
-	/* Link old STEs rule_mem list to the new ste */
-	dr_rule_update_rule_member(cur_ste, new_ste);
-	list_head_init(&new_ste->rule_list);
-	list_append_list(&new_ste->rule_list, &cur_ste->rule_list);
+	/* The rule that ends at the old ste should know about that */
+	dr_rule_update_last_ste(cur_ste, new_ste);
 }
 
 static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
@@ -257,7 +206,7 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 	dr_ste_set_bit_mask(hw_ste, nic_matcher->ste_builder[sb_idx].bit_mask);
 
 	/* Copy STE control and tag */
-	memcpy(hw_ste, cur_ste->hw_ste, DR_STE_SIZE_REDUCED);
+	memcpy(hw_ste, dr_ste_get_hw_ste(cur_ste), DR_STE_SIZE_REDUCED);
 	dr_ste_set_miss_addr(hw_ste, nic_matcher->e_anchor->chunk->icm_addr);
 
 	new_idx = dr_ste_calc_hash_index(hw_ste, new_htbl);
@@ -265,7 +214,6 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 
 	if (dr_ste_not_used_ste(new_ste)) {
 		dr_htbl_get(new_htbl);
-		list_add_tail(dr_ste_get_miss_list(new_ste), &new_ste->miss_list_node);
 	} else {
 		new_ste = dr_rule_rehash_handle_collision(matcher,
 							  nic_matcher,
@@ -281,7 +229,7 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 		use_update_list = true;
 	}
 
-	memcpy(new_ste->hw_ste, hw_ste, DR_STE_SIZE_REDUCED);
+	memcpy(dr_ste_get_hw_ste(new_ste), hw_ste, DR_STE_SIZE_REDUCED);
 
 	new_htbl->ctrl.num_of_valid_entries++;
 
@@ -308,13 +256,14 @@ err_exit:
 
 static int dr_rule_rehash_copy_miss_list(struct mlx5dv_dr_matcher *matcher,
 					 struct dr_matcher_rx_tx *nic_matcher,
-					 struct list_head *cur_miss_list,
+					 struct dr_ste *cur_miss_head,
 					 struct dr_ste_htbl *new_htbl,
 					 struct list_head *update_list)
 {
-	struct dr_ste *tmp_ste, *cur_ste, *new_ste;
+	struct dr_ste *next_ste, *cur_ste, *new_ste;
 
-	list_for_each_safe(cur_miss_list, cur_ste, tmp_ste, miss_list_node) {
+	for (cur_ste = cur_miss_head; cur_ste; cur_ste = next_ste) {
+		next_ste = dr_ste_get_miss_next(cur_ste);
 		new_ste = dr_rule_rehash_copy_ste(matcher,
 						  nic_matcher,
 						  cur_ste,
@@ -323,8 +272,7 @@ static int dr_rule_rehash_copy_miss_list(struct mlx5dv_dr_matcher *matcher,
 		if (!new_ste)
 			goto err_insert;
 
-		list_del(&cur_ste->miss_list_node);
-		dr_htbl_put(cur_ste->htbl);
+		dr_htbl_put(dr_ste_get_htbl(cur_ste));
 	}
 	return 0;
 
@@ -354,7 +302,7 @@ static int dr_rule_rehash_copy_htbl(struct mlx5dv_dr_matcher *matcher,
 
 		err = dr_rule_rehash_copy_miss_list(matcher,
 						    nic_matcher,
-						    dr_ste_get_miss_list(cur_ste),
+						    cur_ste,
 						    new_htbl,
 						    update_list);
 		if (err)
@@ -391,10 +339,19 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl(struct mlx5dv_dr_rule *rule,
 		return NULL;
 	}
 
-	new_htbl = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+	/*
+	 * The first hash table of the matcher is pointed by an anchor which
+	 * is shared with the previous matcher of the table.
+	 */
+	if (ste_location == 1)
+		pthread_mutex_lock(&matcher->tbl->mutex);
+
+	new_htbl = dr_ste_htbl_alloc(dmn,
 				     new_size,
 				     cur_htbl->lu_type,
-				     cur_htbl->byte_mask);
+				     cur_htbl->byte_mask,
+				     dr_ste_is_last_in_rule(nic_matcher,
+							    ste_location));
 	if (!new_htbl) {
 		dr_dbg(dmn, "Failed to allocate new hash table\n");
 		goto free_ste_info;
@@ -410,7 +367,7 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl(struct mlx5dv_dr_rule *rule,
 				&info);
 
 	new_htbl->pointing_ste = cur_htbl->pointing_ste;
-	new_htbl->pointing_ste->next_htbl = new_htbl;
+	new_htbl->pointing_ste->next_htbl = new_htbl->id;
 	err = dr_rule_rehash_copy_htbl(matcher,
 				       nic_matcher,
 				       cur_htbl,
@@ -419,7 +376,7 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl(struct mlx5dv_dr_rule *rule,
 	if (err)
 		goto free_new_htbl;
 
-	if (dr_send_postsend_htbl(dmn, new_htbl, formated_ste,
+	if (dr_send_postsend_htbl(dmn, matcher->send_ring, new_htbl, formated_ste,
 				  nic_matcher->ste_builder[ste_location - 1].bit_mask)) {
 		dr_dbg(dmn, "Failed writing table to HW\n");
 		goto free_new_htbl;
@@ -430,7 +387,8 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl(struct mlx5dv_dr_rule *rule,
 	 * in order to have the origin data written before the miss address of
 	 * collision entries, if exists.
 	 */
-	if (dr_rule_send_update_list(&rehash_table_send_list, dmn, false)) {
+	if (dr_send_postsend_ste_list(dmn, matcher->send_ring,
+				      &rehash_table_send_list, false, false)) {
 		dr_dbg(dmn, "Failed updating table to HW\n");
 		goto free_ste_list;
 	}
@@ -438,32 +396,58 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl(struct mlx5dv_dr_rule *rule,
 	/* Connect previous hash table to current */
 	if (ste_location == 1) {
 		/* The previous table is an anchor, anchors size is always one STE */
-		struct dr_ste_htbl *prev_htbl = cur_htbl->pointing_ste->htbl;
+		struct dr_ste_htbl *prev_htbl = dr_ste_get_htbl(cur_htbl->pointing_ste);
+		uint8_t anchor_ste[DR_STE_SIZE_REDUCED];
 
-		/* On matcher s_anchor we keep an extra refcount */
-		dr_htbl_get(new_htbl);
-		dr_htbl_put(cur_htbl);
-
-		nic_matcher->s_htbl = new_htbl;
+		ste_to_update = &prev_htbl->ste_arr[0];
 
 		/*
 		 * It is safe to operate dr_ste_set_hit_addr on the hw_ste here
 		 * (48B len) which works only on first 32B
 		 */
-		dr_ste_set_hit_addr(prev_htbl->ste_arr[0].hw_ste,
+		memcpy(anchor_ste, dr_ste_get_hw_ste(ste_to_update),
+		       DR_STE_SIZE_REDUCED);
+		dr_ste_set_hit_addr(anchor_ste,
 				    new_htbl->chunk->icm_addr,
 				    new_htbl->chunk->num_of_entries);
 
-		ste_to_update = &prev_htbl->ste_arr[0];
+		/*
+		 * The anchor is updated right away instead of through the
+		 * update list, its write must be done before the table is
+		 * released as the previous matcher may use another send ring.
+		 */
+		err = dr_send_postsend_ste(dmn, matcher->send_ring,
+					   ste_to_update, anchor_ste,
+					   DR_STE_SIZE_REDUCED, 0);
+		if (!err)
+			err = dr_send_ring_force_drain(dmn, matcher->send_ring);
+		if (err) {
+			dr_dbg(dmn, "Failed updating anchor to HW\n");
+			goto free_new_htbl;
+		}
+
+		memcpy(dr_ste_get_hw_ste(ste_to_update), anchor_ste,
+		       DR_STE_SIZE_REDUCED);
+
+		/* On matcher s_anchor we keep an extra refcount */
+		dr_htbl_get(new_htbl);
+		dr_htbl_put(cur_htbl);
+
+		nic_matcher->s_htbl = new_htbl;
+
+		pthread_mutex_unlock(&matcher->tbl->mutex);
+		free(ste_info);
 	} else {
-		dr_ste_set_hit_addr_by_next_htbl(cur_htbl->pointing_ste->hw_ste,
+		dr_ste_set_hit_addr_by_next_htbl(dr_ste_get_hw_ste(cur_htbl->pointing_ste),
 						 new_htbl);
 		ste_to_update = cur_htbl->pointing_ste;
-	}
 
-	dr_send_fill_and_append_ste_send_info(ste_to_update, DR_STE_SIZE_REDUCED,
-					      0, ste_to_update->hw_ste, ste_info,
-					      update_list, false);
+		dr_send_fill_and_append_ste_send_info(ste_to_update,
+						      DR_STE_SIZE_REDUCED, 0,
+						      dr_ste_get_hw_ste(ste_to_update),
+						      ste_info, update_list,
+						      false);
+	}
 
 	return new_htbl;
 
@@ -478,6 +462,8 @@ free_ste_list:
 free_new_htbl:
 	dr_ste_htbl_free(new_htbl);
 free_ste_info:
+	if (ste_location == 1)
+		pthread_mutex_unlock(&matcher->tbl->mutex);
 	free(ste_info);
 	return NULL;
 }
@@ -505,7 +491,6 @@ static struct dr_ste *dr_rule_handle_collision(struct mlx5dv_dr_matcher *matcher
 					       struct dr_matcher_rx_tx *nic_matcher,
 					       struct dr_ste *ste,
 					       uint8_t *hw_ste,
-					       struct list_head *miss_list,
 					       struct list_head *send_list)
 {
 	struct dr_ste_send_info *ste_info;
@@ -524,16 +509,19 @@ static struct dr_ste *dr_rule_handle_collision(struct mlx5dv_dr_matcher *matcher
 		goto free_send_info;
 	}
 
-	if (dr_rule_append_to_miss_list(new_ste, miss_list, send_list)) {
+	if (dr_rule_append_to_miss_list(new_ste, ste, send_list)) {
 		dr_dbg(matcher->tbl->dmn, "Failed to update prev miss_list\n");
 		goto err_exit;
 	}
 
+	/* In collision entry, all members share the same miss_list_head */
+	dr_ste_get_htbl(new_ste)->miss_head = ste;
+
 	dr_send_fill_and_append_ste_send_info(new_ste, DR_STE_SIZE, 0, hw_ste,
 					      ste_info, send_list, false);
 
-	ste->htbl->ctrl.num_of_collisions++;
-	ste->htbl->ctrl.num_of_valid_entries++;
+	dr_ste_get_htbl(ste)->ctrl.num_of_collisions++;
+	dr_ste_get_htbl(ste)->ctrl.num_of_valid_entries++;
 
 	return new_ste;
 
@@ -546,69 +534,123 @@ free_send_info:
 
 static void dr_rule_remove_action_members(struct mlx5dv_dr_rule *rule)
 {
-	struct dr_rule_action_member *action_mem;
-	struct dr_rule_action_member *tmp;
+	size_t i;
 
-	list_for_each_safe(&rule->rule_actions_list, action_mem, tmp, list) {
-		list_del(&action_mem->list);
-		atomic_fetch_sub(&action_mem->action->refcount, 1);
-		free(action_mem);
-	}
+	for (i = 0; i < rule->num_actions; i++)
+		atomic_fetch_sub(&rule->actions[i]->refcount, 1);
+
+	free(rule->actions);
 }
 
 static int dr_rule_add_action_members(struct mlx5dv_dr_rule *rule,
 				      size_t num_actions,
 				      struct mlx5dv_dr_action *actions[])
 {
-	struct dr_rule_action_member *action_mem;
-	int i;
+	size_t i;
 
-	for (i = 0; i < num_actions; i++) {
-		action_mem = calloc(1, sizeof(*action_mem));
-		if (!action_mem) {
-			errno = ENOMEM;
-			goto free_action_members;
-		}
+	if (!num_actions)
+		return 0;
 
-		action_mem->action = actions[i];
-		list_node_init(&action_mem->list);
-		list_add_tail(&rule->rule_actions_list, &action_mem->list);
-		atomic_fetch_add(&action_mem->action->refcount, 1);
+	rule->actions = malloc(num_actions * sizeof(*actions));
+	if (!rule->actions) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	rule->num_actions = num_actions;
+	for (i = 0; i < num_actions; i++) {
+		rule->actions[i] = actions[i];
+		atomic_fetch_add(&actions[i]->refcount, 1);
 	}
 
 	return 0;
+}
 
-free_action_members:
-	dr_rule_remove_action_members(rule);
-	return errno;
+/*
+ * Only the last STE of the rule is kept, as the STEs of the tables of the
+ * matcher may move it is kept up to date through the rule_arr of its table.
+ * The STEs of action tables never move.
+ */
+static void dr_rule_set_last_ste(struct dr_rule_rx_tx *nic_rule,
+				 struct dr_ste *ste)
+{
+	struct dr_ste_htbl *htbl = dr_ste_get_htbl(ste);
+
+	nic_rule->last_ste = ste;
+	if (htbl->rule_arr)
+		htbl->rule_arr[dr_ste_get_index(ste)] = nic_rule;
 }
 
 /*
  * While the pointer of ste is no longer valid, like while moving ste to be
- * the first in the miss_list, and to be in the origin table,
- * all rule-members that are attached to this ste should update their ste member
- * to the new pointer
+ * the first in the miss_list, and to be in the origin table, the rule that
+ * ends at this ste should update its last ste to the new pointer
  */
-void dr_rule_update_rule_member(struct dr_ste *ste, struct dr_ste *new_ste)
+void dr_rule_update_last_ste(struct dr_ste *ste, struct dr_ste *new_ste)
 {
-	struct dr_rule_member *rule_mem;
+	struct dr_ste_htbl *htbl = dr_ste_get_htbl(ste);
+	struct dr_rule_rx_tx *nic_rule;
+
+	if (!htbl->rule_arr)
+		return;
+
+	nic_rule = htbl->rule_arr[dr_ste_get_index(ste)];
+	if (!nic_rule)
+		return;
 
-	list_for_each(&ste->rule_list, rule_mem, use_ste_list)
-		rule_mem->ste = new_ste;
+	htbl->rule_arr[dr_ste_get_index(ste)] = NULL;
+	assert(dr_ste_get_htbl(new_ste)->rule_arr);
+	dr_rule_set_last_ste(nic_rule, new_ste);
+}
+
+/* Walk back from the last STE of the rule, returns the number of STEs */
+int dr_rule_get_ste_chain(struct dr_rule_rx_tx *nic_rule,
+			  struct dr_ste *ste_arr[DR_RULE_MAX_STE_CHAIN])
+{
+	struct dr_ste *ste = nic_rule->last_ste;
+	int num_of_stes, i;
+
+	if (!ste)
+		return 0;
+
+	num_of_stes = ste->ste_chain_location;
+	for (i = num_of_stes - 1; i >= 0; i--) {
+		ste_arr[i] = ste;
+		if (i)
+			ste = dr_ste_get_pointing_ste(ste);
+	}
+
+	return num_of_stes;
+}
+
+static void dr_rule_put_stes(struct mlx5dv_dr_rule *rule,
+			     struct dr_rule_rx_tx *nic_rule,
+			     struct dr_ste **ste_arr,
+			     int num_of_stes)
+{
+	int i;
+
+	for (i = 0; i < num_of_stes; i++)
+		dr_ste_put(ste_arr[i], rule->matcher, nic_rule->nic_matcher);
 }
 
 static void dr_rule_clean_rule_members(struct mlx5dv_dr_rule *rule,
 				       struct dr_rule_rx_tx *nic_rule)
 {
-	struct dr_rule_member *rule_mem;
-	struct dr_rule_member *tmp_mem;
-
-	list_for_each_safe(&nic_rule->rule_members_list, rule_mem, tmp_mem, list) {
-		list_del(&rule_mem->list);
-		list_del(&rule_mem->use_ste_list);
-		dr_ste_put(rule_mem->ste, rule->matcher, nic_rule->nic_matcher);
-		free(rule_mem);
-	}
+	struct dr_ste *ste_arr[DR_RULE_MAX_STE_CHAIN];
+	struct dr_ste_htbl *htbl;
+	int num_of_stes;
+
+	num_of_stes = dr_rule_get_ste_chain(nic_rule, ste_arr);
+	if (!num_of_stes)
+		return;
+
+	htbl = dr_ste_get_htbl(nic_rule->last_ste);
+	if (htbl->rule_arr)
+		htbl->rule_arr[dr_ste_get_index(nic_rule->last_ste)] = NULL;
+	nic_rule->last_ste = NULL;
+
+	dr_rule_put_stes(rule, nic_rule, ste_arr, num_of_stes);
 }
 
 static uint16_t dr_get_bits_per_mask(uint16_t byte_mask)
@@ -645,29 +687,15 @@ static bool dr_rule_need_enlarge_hash(struct dr_ste_htbl *htbl,
 	return false;
 }
 
-static int dr_rule_add_member(struct dr_rule_rx_tx *nic_rule,
-			      struct dr_ste *ste)
-{
-	struct dr_rule_member *rule_mem;
-
-	rule_mem = calloc(1, sizeof(*rule_mem));
-	if (!rule_mem) {
-		errno = ENOMEM;
-		return errno;
-	}
-
-	rule_mem->ste = ste;
-	list_add_tail(&nic_rule->rule_members_list, &rule_mem->list);
-
-	list_add_tail(&ste->rule_list, &rule_mem->use_ste_list);
-
-	return 0;
-}
-
+/*
+ * The action STEs are added to ste_arr after the STEs of the matcher, each
+ * one pointed by the previous STE of the chain.
+ */
 static int dr_rule_handle_action_stes(struct mlx5dv_dr_rule *rule,
 				      struct dr_rule_rx_tx *nic_rule,
 				      struct list_head *send_ste_list,
-				      struct dr_ste *last_ste,
+				      struct dr_ste **ste_arr,
+				      int *num_of_stes,
 				      uint8_t *hw_ste_arr,
 				      uint32_t new_hw_ste_arr_sz)
 {
@@ -676,8 +704,9 @@ static int dr_rule_handle_action_stes(struct mlx5dv_dr_rule *rule,
 	uint8_t num_of_builders = nic_matcher->num_of_builders;
 	struct mlx5dv_dr_matcher *matcher = rule->matcher;
 	uint8_t *curr_hw_ste, *prev_hw_ste;
+	struct dr_ste_htbl *action_htbl;
 	struct dr_ste *action_ste;
-	int i, k, ret;
+	int i, k;
 
 	/* Two cases:
 	 * 1. num_of_builders is equal to new_hw_ste_arr_sz, the action in the ste
@@ -692,31 +721,28 @@ static int dr_rule_handle_action_stes(struct mlx5dv_dr_rule *rule,
 		prev_hw_ste = (i == 0) ? curr_hw_ste : hw_ste_arr + ((i - 1) * DR_STE_SIZE);
 		action_ste = dr_rule_create_collision_htbl(matcher,
 							   nic_matcher,
-							   curr_hw_ste);
+							   curr_hw_ste,
+							   i + 1);
 		if (!action_ste)
 			return errno;
 
 		dr_ste_get(action_ste);
 
-		/* While free ste we go over the miss list, so add this ste to the list */
-		list_add_tail(dr_ste_get_miss_list(action_ste),
-			      &action_ste->miss_list_node);
-
 		ste_info_arr[k] = calloc(1, sizeof(struct dr_ste_send_info));
 		if (!ste_info_arr[k]) {
 			dr_dbg(matcher->tbl->dmn, "Failed allocate ste_info, k: %d\n", k);
+			dr_ste_put(action_ste, matcher, nic_matcher);
 			errno = ENOMEM;
-			ret = errno;
-			goto err_exit;
+			return errno;
 		}
 
 		/* Point current ste to the new action */
-		dr_ste_set_hit_addr_by_next_htbl(prev_hw_ste, action_ste->htbl);
-		ret = dr_rule_add_member(nic_rule, action_ste);
-		if (ret) {
-			dr_dbg(matcher->tbl->dmn, "Failed adding rule member\n");
-			goto free_ste_info;
-		}
+		action_htbl = dr_ste_get_htbl(action_ste);
+		dr_ste_set_hit_addr_by_next_htbl(prev_hw_ste, action_htbl);
+		ste_arr[i - 1]->next_htbl = action_htbl->id;
+		action_htbl->pointing_ste = ste_arr[i - 1];
+		ste_arr[(*num_of_stes)++] = action_ste;
+
 		dr_send_fill_and_append_ste_send_info(action_ste, DR_STE_SIZE, 0,
 						      curr_hw_ste,
 						      ste_info_arr[k],
@@ -724,12 +750,6 @@ static int dr_rule_handle_action_stes(struct mlx5dv_dr_rule *rule,
 	}
 
 	return 0;
-
-free_ste_info:
-	free(ste_info_arr[k]);
-err_exit:
-	dr_ste_put(action_ste, matcher, nic_matcher);
-	return ret;
 }
 
 static int dr_rule_handle_empty_entry(struct mlx5dv_dr_matcher *matcher,
@@ -738,7 +758,6 @@ static int dr_rule_handle_empty_entry(struct mlx5dv_dr_matcher *matcher,
 				      struct dr_ste *ste,
 				      uint8_t ste_location,
 				      uint8_t *hw_ste,
-				      struct list_head *miss_list,
 				      struct list_head *send_list)
 {
 	struct dr_ste_send_info *ste_info;
@@ -746,8 +765,9 @@ static int dr_rule_handle_empty_entry(struct mlx5dv_dr_matcher *matcher,
 	/* Take ref on table, only on first time this ste is used */
 	dr_htbl_get(cur_htbl);
 
-	/* new entry -> new branch */
-	list_add_tail(miss_list, &ste->miss_list_node);
+	/* new entry -> new branch, alone in its miss list */
+	ste->miss_next = 0;
+	ste->next_htbl = 0;
 
 	dr_ste_set_miss_addr(hw_ste, nic_matcher->e_anchor->chunk->icm_addr);
 
@@ -780,7 +800,6 @@ clean_ste_info:
 	free(ste_info);
 
 clean_ste_setting:
-	list_del_init(&ste->miss_list_node);
 	dr_htbl_put(cur_htbl);
 
 	return ENOMEM;
@@ -799,7 +818,6 @@ static struct dr_ste *dr_rule_handle_ste_branch(struct mlx5dv_dr_rule *rule,
 	struct mlx5dv_dr_matcher *matcher = rule->matcher;
 	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
 	struct dr_ste_htbl *new_htbl;
-	struct list_head *miss_list;
 	struct dr_ste *matched_ste;
 	bool skip_rehash = false;
 	struct dr_ste *ste;
@@ -807,18 +825,16 @@ static struct dr_ste *dr_rule_handle_ste_branch(struct mlx5dv_dr_rule *rule,
 
 again:
 	index = dr_ste_calc_hash_index(hw_ste, cur_htbl);
-	miss_list = &cur_htbl->chunk->miss_list[index];
 	ste = &cur_htbl->ste_arr[index];
 
 	if (dr_ste_not_used_ste(ste)) {
 		if (dr_rule_handle_empty_entry(matcher, nic_matcher, cur_htbl,
 					       ste, ste_location,
-					       hw_ste, miss_list,
-					       send_ste_list))
+					       hw_ste, send_ste_list))
 			return NULL;
 	} else {
 		/* Hash table index in use, check if this ste is in the miss list */
-		matched_ste = dr_rule_find_ste_in_miss_list(miss_list, hw_ste);
+		matched_ste = dr_rule_find_ste_in_miss_list(ste, hw_ste);
 		if (matched_ste) {
 			/*
 			 * if it is last STE in the chain, and has the same tag
@@ -858,7 +874,6 @@ again:
 						       nic_matcher,
 						       ste,
 						       hw_ste,
-						       miss_list,
 						       send_ste_list);
 			if (!ste) {
 				dr_dbg(dmn, "Failed adding collision entry, index: %d\n",
@@ -1034,22 +1049,25 @@ dr_rule_create_rule_nic(struct mlx5dv_dr_rule *rule,
 			struct dr_rule_rx_tx *nic_rule,
 			struct dr_match_param *param,
 			size_t num_actions,
-			struct mlx5dv_dr_action *actions[])
+			struct mlx5dv_dr_action *actions[],
+			bool bulk)
 {
 	uint8_t hw_ste_arr[DR_RULE_MAX_STE_CHAIN * DR_STE_SIZE] = {};
 	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
 	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
 	struct mlx5dv_dr_matcher *matcher = rule->matcher;
 	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_ste *ste_arr[DR_RULE_MAX_STE_CHAIN];
 	struct dr_ste_send_info *ste_info, *tmp_ste_info;
 	struct dr_ste_htbl *htbl = NULL;
 	struct dr_ste_htbl *cur_htbl;
 	uint32_t new_hw_ste_arr_sz;
 	LIST_HEAD(send_ste_list);
-	struct dr_ste *ste = NULL; /* Fix compilation warning */
+	struct dr_ste *ste;
+	int num_of_stes = 0;
 	int ret, i;
 
-	list_head_init(&nic_rule->rule_members_list);
+	nic_rule->last_ste = NULL;
 
 	if (dr_rule_skip(dmn->type, nic_dmn->ste_type, &matcher->mask, param))
 		return 0;
@@ -1090,26 +1108,23 @@ dr_rule_create_rule_nic(struct mlx5dv_dr_rule *rule,
 			goto free_rule;
 		}
 
-		cur_htbl = ste->next_htbl;
-
-		/* Keep all STEs in the rule struct */
-		ret = dr_rule_add_member(nic_rule, ste);
-		if (ret) {
-			dr_dbg(dmn, "Failed adding rule member index %d\n", i);
-			goto free_ste;
-		}
+		cur_htbl = dr_ste_get_next_htbl(ste);
 
 		dr_ste_get(ste);
+		ste_arr[num_of_stes++] = ste;
 	}
 
 	/* Connect actions */
 	ret = dr_rule_handle_action_stes(rule, nic_rule, &send_ste_list,
-					 ste, hw_ste_arr, new_hw_ste_arr_sz);
+					 ste_arr, &num_of_stes, hw_ste_arr,
+					 new_hw_ste_arr_sz);
 	if (ret) {
 		dr_dbg(dmn, "Failed apply actions\n");
 		goto free_rule;
 	}
-	ret = dr_rule_send_update_list(&send_ste_list, dmn, true);
+	/* Within a bulk the HW is notified once for all the rules */
+	ret = dr_send_postsend_ste_list(dmn, matcher->send_ring,
+					&send_ste_list, true, bulk);
 	if (ret) {
 		dr_dbg(dmn, "Failed sending ste!\n");
 		goto free_rule;
@@ -1118,12 +1133,12 @@ dr_rule_create_rule_nic(struct mlx5dv_dr_rule *rule,
 	if (htbl)
 		dr_htbl_put(htbl);
 
+	dr_rule_set_last_ste(nic_rule, ste_arr[num_of_stes - 1]);
+
 	return 0;
 
-free_ste:
-	dr_ste_put(ste, matcher, nic_matcher);
 free_rule:
-	dr_rule_clean_rule_members(rule, nic_rule);
+	dr_rule_put_stes(rule, nic_rule, ste_arr, num_of_stes);
 	/* Clean all ste_info's */
 	list_for_each_safe(&send_ste_list, ste_info, tmp_ste_info, send_list) {
 		list_del(&ste_info->send_list);
@@ -1137,7 +1152,8 @@ static int
 dr_rule_create_rule_fdb(struct mlx5dv_dr_rule *rule,
 			struct dr_match_param *param,
 			size_t num_actions,
-			struct mlx5dv_dr_action *actions[])
+			struct mlx5dv_dr_action *actions[],
+			bool bulk)
 {
 	struct dr_match_param copy_param = {};
 	int ret;
@@ -1149,12 +1165,12 @@ dr_rule_create_rule_fdb(struct mlx5dv_dr_rule *rule,
 	memcpy(&copy_param, param, sizeof(struct dr_match_param));
 
 	ret = dr_rule_create_rule_nic(rule, &rule->rx, param,
-				      num_actions, actions);
+				      num_actions, actions, bulk);
 	if (ret)
 		return ret;
 
 	ret = dr_rule_create_rule_nic(rule, &rule->tx, &copy_param,
-				      num_actions, actions);
+				      num_actions, actions, bulk);
 	if (ret)
 		goto destroy_rule_nic_rx;
 
@@ -1169,7 +1185,8 @@ static struct mlx5dv_dr_rule *
 dr_rule_create_rule(struct mlx5dv_dr_matcher *matcher,
 		    struct mlx5dv_flow_match_parameters *value,
 		    size_t num_actions,
-		    struct mlx5dv_dr_action *actions[])
+		    struct mlx5dv_dr_action *actions[],
+		    bool bulk)
 {
 	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
 	struct dr_match_param param = {};
@@ -1186,7 +1203,6 @@ dr_rule_create_rule(struct mlx5dv_dr_matcher *matcher,
 	}
 
 	rule->matcher = matcher;
-	list_head_init(&rule->rule_actions_list);
 	list_node_init(&rule->rule_list);
 
 	ret = dr_rule_add_action_members(rule, num_actions, actions);
@@ -1197,18 +1213,18 @@ dr_rule_create_rule(struct mlx5dv_dr_matcher *matcher,
 	case MLX5DV_DR_DOMAIN_TYPE_NIC_RX:
 		rule->rx.nic_matcher = &matcher->rx;
 		ret = dr_rule_create_rule_nic(rule, &rule->rx, &param,
-					      num_actions, actions);
+					      num_actions, actions, bulk);
 		break;
 	case MLX5DV_DR_DOMAIN_TYPE_NIC_TX:
 		rule->tx.nic_matcher = &matcher->tx;
 		ret = dr_rule_create_rule_nic(rule, &rule->tx, &param,
-					      num_actions, actions);
+					      num_actions, actions, bulk);
 		break;
 	case MLX5DV_DR_DOMAIN_TYPE_FDB:
 		rule->rx.nic_matcher = &matcher->rx;
 		rule->tx.nic_matcher = &matcher->tx;
 		ret = dr_rule_create_rule_fdb(rule, &param,
-					      num_actions, actions);
+					      num_actions, actions, bulk);
 		break;
 	default:
 		ret = EINVAL;
@@ -1248,7 +1264,6 @@ dr_rule_create_rule_root(struct mlx5dv_dr_matcher *matcher,
 	}
 
 	rule->matcher = matcher;
-	list_head_init(&rule->rule_actions_list);
 
 	attr = calloc(num_actions, sizeof(*attr));
 	if (!attr) {
@@ -1294,43 +1309,178 @@ free_rule:
 	return NULL;
 }
 
-struct mlx5dv_dr_rule *mlx5dv_dr_rule_create(struct mlx5dv_dr_matcher *matcher,
-					     struct mlx5dv_flow_match_parameters *value,
-					     size_t num_actions,
-					     struct mlx5dv_dr_action *actions[])
+/* Must be called with matcher->mutex held */
+static struct mlx5dv_dr_rule *
+dr_rule_create_locked(struct mlx5dv_dr_matcher *matcher,
+		      struct mlx5dv_flow_match_parameters *value,
+		      size_t num_actions,
+		      struct mlx5dv_dr_action *actions[],
+		      bool bulk)
 {
 	struct mlx5dv_dr_rule *rule;
 
-	pthread_mutex_lock(&matcher->tbl->dmn->mutex);
 	atomic_fetch_add(&matcher->refcount, 1);
 
 	if (dr_is_root_table(matcher->tbl))
 		rule = dr_rule_create_rule_root(matcher, value, num_actions, actions);
 	else
-		rule = dr_rule_create_rule(matcher, value, num_actions, actions);
+		rule = dr_rule_create_rule(matcher, value, num_actions, actions,
+					   bulk);
 
 	if (!rule)
 		atomic_fetch_sub(&matcher->refcount, 1);
 
-	pthread_mutex_unlock(&matcher->tbl->dmn->mutex);
+	return rule;
+}
+
+struct mlx5dv_dr_rule *mlx5dv_dr_rule_create(struct mlx5dv_dr_matcher *matcher,
+					     struct mlx5dv_flow_match_parameters *value,
+					     size_t num_actions,
+					     struct mlx5dv_dr_action *actions[])
+{
+	struct mlx5dv_dr_rule *rule;
+
+	pthread_mutex_lock(&matcher->mutex);
+	rule = dr_rule_create_locked(matcher, value, num_actions, actions,
+				     false);
+	pthread_mutex_unlock(&matcher->mutex);
 
 	return rule;
 }
 
+int mlx5dv_dr_rule_create_bulk(struct mlx5dv_dr_matcher *matcher,
+			       size_t num_rules,
+			       struct mlx5dv_flow_match_parameters *values[],
+			       size_t num_actions,
+			       struct mlx5dv_dr_action *actions[],
+			       uint32_t flags,
+			       struct mlx5dv_dr_rule *rules[])
+{
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_rule_bulk *bulk = NULL;
+	uint64_t posted_wqe = 0;
+	size_t i, j;
+	int ret;
+
+	if (flags & ~MLX5DV_DR_RULE_BULK_FLAGS_ASYNC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (flags & MLX5DV_DR_RULE_BULK_FLAGS_ASYNC) {
+		bulk = malloc(sizeof(*bulk) +
+			      num_rules * sizeof(bulk->rules[0]));
+		if (!bulk) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&matcher->mutex);
+
+	for (i = 0; i < num_rules; i++) {
+		rules[i] = dr_rule_create_locked(matcher, values[i],
+						 num_actions, actions, true);
+		if (!rules[i])
+			break;
+	}
+
+	if (!dr_is_root_table(matcher->tbl)) {
+		ret = dr_send_ring_flush(dmn, matcher->send_ring, &posted_wqe);
+		if (ret) {
+			dr_dbg(dmn, "Failed flushing bulk to HW\n");
+			/* Nothing tells when the HW got the bulk, drop it */
+			for (j = 0; j < i; j++) {
+				if (!dr_rule_destroy_rule(rules[j]))
+					atomic_fetch_sub(&matcher->refcount, 1);
+				rules[j] = NULL;
+			}
+			pthread_mutex_unlock(&matcher->mutex);
+			free(bulk);
+			errno = ret;
+			return -1;
+		}
+	}
+
+	if (bulk && i) {
+		bulk->posted_wqe = posted_wqe;
+		bulk->num_rules = i;
+		bulk->next = 0;
+		memcpy(bulk->rules, rules, i * sizeof(bulk->rules[0]));
+		list_add_tail(&matcher->bulk_list, &bulk->list);
+		bulk = NULL;
+	}
+
+	pthread_mutex_unlock(&matcher->mutex);
+
+	free(bulk);
+
+	if (!i && num_rules)
+		return -1;
+
+	return i;
+}
+
+int mlx5dv_dr_rule_poll_bulk(struct mlx5dv_dr_matcher *matcher,
+			     size_t max_rules,
+			     struct mlx5dv_dr_rule *rules[])
+{
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_rule_bulk *bulk, *tmp;
+	uint64_t done_wqe = UINT64_MAX;
+	size_t num, polled = 0;
+	int ret;
+
+	pthread_mutex_lock(&matcher->mutex);
+
+	if (!dr_is_root_table(matcher->tbl) &&
+	    !list_empty(&matcher->bulk_list)) {
+		ret = dr_send_ring_poll(dmn, matcher->send_ring, &done_wqe);
+		if (ret) {
+			pthread_mutex_unlock(&matcher->mutex);
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	list_for_each_safe(&matcher->bulk_list, bulk, tmp, list) {
+		if (polled == max_rules || bulk->posted_wqe > done_wqe)
+			break;
+
+		num = bulk->num_rules - bulk->next;
+		if (num > max_rules - polled)
+			num = max_rules - polled;
+
+		memcpy(&rules[polled], &bulk->rules[bulk->next],
+		       num * sizeof(rules[0]));
+		polled += num;
+		bulk->next += num;
+
+		if (bulk->next == bulk->num_rules) {
+			list_del(&bulk->list);
+			free(bulk);
+		}
+	}
+
+	pthread_mutex_unlock(&matcher->mutex);
+
+	return polled;
+}
+
 int mlx5dv_dr_rule_destroy(struct mlx5dv_dr_rule *rule)
 {
 	struct mlx5dv_dr_matcher *matcher = rule->matcher;
 	struct mlx5dv_dr_table *tbl = rule->matcher->tbl;
 	int ret;
 
-	pthread_mutex_lock(&tbl->dmn->mutex);
+	pthread_mutex_lock(&matcher->mutex);
 
 	if (dr_is_root_table(tbl))
 		ret = dr_rule_destroy_rule_root(rule);
 	else
 		ret = dr_rule_destroy_rule(rule);
 
-	pthread_mutex_unlock(&tbl->dmn->mutex);
+	pthread_mutex_unlock(&matcher->mutex);
 
 	if (!ret)
 		atomic_fetch_sub(&matcher->refcount, 1);
@@ -379,9 +379,13 @@ static void dr_set_raddr_seg(struct mlx5_wqe_raddr_seg *rseg,
 	rseg->reserved = 0;
 }
 
-static void dr_post_send_db(struct dr_qp *dr_qp, int size, void *ctrl)
+static void dr_post_send_db(struct dr_qp *dr_qp)
 {
-	dr_qp->sq.head += 2; /* RDMA_WRITE + RDMA_READ */
+	if (!dr_qp->nreq)
+		return;
+
+	dr_qp->sq.head += dr_qp->nreq;
+	dr_qp->nreq = 0;
 
 	/*
 	 * Make sure that descriptors are written before
@@ -394,7 +398,8 @@ static void dr_post_send_db(struct dr_qp *dr_qp, int size, void *ctrl)
 	 * to WC memory below
 	 */
 	mmio_wc_start();
-	mmio_write64_be((uint8_t *)dr_qp->uar->reg_addr, *(__be64 *)ctrl);
+	mmio_write64_be((uint8_t *)dr_qp->uar->reg_addr,
+			*(__be64 *)dr_qp->last_ctrl);
 	mmio_flush_writes();
 }
 
@@ -454,7 +459,7 @@ static void dr_set_ctrl_seg(struct mlx5_wqe_ctrl_seg *ctrl,
 
 static void dr_rdma_segments(struct dr_qp *dr_qp, uint64_t remote_addr,
 			     uint32_t rkey, struct dr_data_seg *data_seg,
-			     uint32_t opcode, int nreq)
+			     uint32_t opcode, bool notify_hw)
 {
 	struct mlx5_wqe_ctrl_seg *ctrl = NULL;
 	void *qend = dr_qp->sq.qend;
@@ -487,19 +492,28 @@ static void dr_rdma_segments(struct dr_qp *dr_qp, uint64_t remote_addr,
 	ctrl->opmod_idx_opcode =
 		htobe32(((dr_qp->sq.cur_post & 0xffff) << 8) | opcode);
 	ctrl->qpn_ds = htobe32(size | (dr_qp->obj->object_id << 8));
-	dr_qp->sq.wqe_head[idx] = dr_qp->sq.head + nreq;
+	dr_qp->sq.wqe_head[idx] = dr_qp->sq.head + dr_qp->nreq++;
 	dr_qp->sq.cur_post += DIV_ROUND_UP(size * 16, MLX5_SEND_WQE_BB);
+	dr_qp->last_ctrl = ctrl;
 
-	if (nreq)
-		dr_post_send_db(dr_qp, size, ctrl);
+	if (notify_hw)
+		dr_post_send_db(dr_qp);
 }
 
-static void dr_post_send(struct dr_qp *dr_qp, struct postsend_info *send_info)
+/*
+ * A chained write is posted alone and the HW is not notified, the read back
+ * and the doorbell of the next unchained write cover all the writes before it.
+ */
+static void dr_post_send(struct dr_qp *dr_qp, struct postsend_info *send_info,
+			 bool chain)
 {
 	dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
-			 &send_info->write, MLX5_OPCODE_RDMA_WRITE, 0);
+			 &send_info->write, MLX5_OPCODE_RDMA_WRITE, false);
+	if (chain)
+		return;
+
 	dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
-			 &send_info->read, MLX5_OPCODE_RDMA_READ, 1);
+			 &send_info->read, MLX5_OPCODE_RDMA_READ, true);
 }
 
 /*
@@ -548,7 +562,9 @@ static bool dr_is_device_fatal(struct mlx5dv_dr_domain *dmn)
 /*
  * The function tries to consume one wc each time, unless the queue is full, in
  * that case, which means that the hw is behind the sw in a full queue len
- * the function will drain the cq till it empty.
+ * the function will drain the cq till it empty. Chained writes may leave a
+ * tail of less than signal_th unsignaled WQEs, those complete with the next
+ * signaled one.
  */
 static int dr_handle_pending_wc(struct mlx5dv_dr_domain *dmn,
 				struct dr_send_ring *send_ring)
@@ -558,9 +574,12 @@ static int dr_handle_pending_wc(struct mlx5dv_dr_domain *dmn,
 
 	if (send_ring->pending_wqe >= send_ring->signal_th) {
 		/* Queue is full start drain it */
-		if (send_ring->pending_wqe >= dmn->send_ring->signal_th * TH_NUMS_TO_DRAIN)
+		if (send_ring->pending_wqe >= send_ring->signal_th * TH_NUMS_TO_DRAIN)
 			is_drain = true;
 
+		/* Chained writes can't complete before the HW is notified */
+		dr_post_send_db(send_ring->qp);
+
 		do {
 			/*
 			 * On IBV_EVENT_DEVICE_FATAL a success is returned to
@@ -576,18 +595,21 @@ static int dr_handle_pending_wc(struct mlx5dv_dr_domain *dmn,
 			} else if (ne == 1) {
 				send_ring->pending_wqe -= send_ring->signal_th;
 			}
-		} while (is_drain && send_ring->pending_wqe);
+		} while (is_drain &&
+			 send_ring->pending_wqe >= send_ring->signal_th);
 	}
 
 	return 0;
 }
 
 static void dr_fill_data_segs(struct dr_send_ring *send_ring,
-			      struct postsend_info *send_info)
+			      struct postsend_info *send_info,
+			      bool chain)
 {
 	unsigned int inline_flag;
 
 	send_ring->pending_wqe++;
+	send_ring->posted_wqe++;
 	if (!send_info->write.lkey)
 		inline_flag = IBV_SEND_INLINE;
 	else
@@ -598,7 +620,11 @@ static void dr_fill_data_segs(struct dr_send_ring *send_ring,
 	if (send_ring->pending_wqe % send_ring->signal_th == 0)
 		send_info->write.send_flags |= IBV_SEND_SIGNALED;
 
+	if (chain)
+		return;
+
 	send_ring->pending_wqe++;
+	send_ring->posted_wqe++;
 	send_info->read.length = send_info->write.length;
 	if (inline_flag) {
 		/* Read into dedicated buffer */
@@ -616,20 +642,66 @@ static void dr_fill_data_segs(struct dr_send_ring *send_ring,
 		send_info->read.send_flags = 0;
 }
 
-static int dr_postsend_icm_data(struct mlx5dv_dr_domain *dmn,
-				struct postsend_info *send_info)
+/*
+ * Wait until the first wqe WQEs posted on the ring are done. Every WQE is
+ * followed by a signaled one at most signal_th - 1 WQEs later, which the
+ * caller must have posted already.
+ */
+static int dr_wait_wqe_done(struct mlx5dv_dr_domain *dmn,
+			    struct dr_send_ring *send_ring,
+			    uint64_t wqe)
 {
-	struct dr_send_ring *send_ring = dmn->send_ring;
-	uint32_t buff_offset;
+	int ne;
+
+	if (send_ring->posted_wqe - send_ring->pending_wqe >= wqe)
+		return 0;
+
+	dr_post_send_db(send_ring->qp);
+
+	do {
+		/* See dr_handle_pending_wc */
+		if (dr_is_device_fatal(dmn))
+			return 0;
+
+		ne = dr_poll_cq(&send_ring->cq, 1);
+		if (ne < 0) {
+			dr_dbg(dmn, "poll CQ failed\n");
+			return ne;
+		} else if (ne == 1) {
+			send_ring->pending_wqe -= send_ring->signal_th;
+		}
+	} while (send_ring->posted_wqe - send_ring->pending_wqe < wqe);
+
+	return 0;
+}
+
+/* Must be called with send_ring->mutex held */
+static int dr_postsend_icm_data_chain(struct mlx5dv_dr_domain *dmn,
+				      struct dr_send_ring *send_ring,
+				      struct postsend_info *send_info,
+				      bool chain)
+{
+	uint32_t buff_offset, slot = 0;
+	bool bounce;
 	int ret;
 
 	ret = dr_handle_pending_wc(dmn, send_ring);
 	if (ret)
 		return ret;
 
-	if (send_info->write.length > dmn->info.max_inline_size) {
-		buff_offset = (send_ring->tx_head & (dmn->send_ring->signal_th - 1)) *
-			send_ring->max_post_send_size;
+	bounce = send_info->write.length > dmn->info.max_inline_size;
+	if (bounce) {
+		/*
+		 * A chained write is a single WQE, so the previous write
+		 * through this slot may still be in flight, wait for it.
+		 */
+		slot = send_ring->tx_head & (send_ring->signal_th - 1);
+		ret = dr_wait_wqe_done(dmn, send_ring,
+				       send_ring->buf_wqe[slot]);
+		if (ret)
+			return ret;
+
+		buff_offset = slot * send_ring->max_post_send_size;
 		/* Copy to ring mr */
 		memcpy(send_ring->buf + buff_offset,
 		       (void *) (uintptr_t)send_info->write.addr,
@@ -638,14 +710,24 @@ static int dr_postsend_icm_data(struct mlx5dv_dr_domain *dmn,
 		send_info->write.lkey	= send_ring->mr->lkey;
 	}
 
-	send_ring->tx_head++;
-	dr_fill_data_segs(send_ring, send_info);
-	dr_post_send(send_ring->qp, send_info);
+	dr_fill_data_segs(send_ring, send_info, chain);
+	if (bounce) {
+		send_ring->buf_wqe[slot] = send_ring->posted_wqe;
+		send_ring->tx_head++;
+	}
+	dr_post_send(send_ring->qp, send_info, chain);
 
 	return 0;
 }
 
-static int dr_get_tbl_copy_details(struct mlx5dv_dr_domain *dmn,
+static int dr_postsend_icm_data(struct mlx5dv_dr_domain *dmn,
+				struct dr_send_ring *send_ring,
+				struct postsend_info *send_info)
+{
+	return dr_postsend_icm_data_chain(dmn, send_ring, send_info, false);
+}
+
+static int dr_get_tbl_copy_details(struct dr_send_ring *send_ring,
 				   struct dr_ste_htbl *htbl,
 				   uint8_t **data,
 				   uint32_t *byte_size,
@@ -654,9 +736,9 @@ static int dr_get_tbl_copy_details(struct mlx5dv_dr_domain *dmn,
 {
 	int alloc_size;
 
-	if (htbl->chunk->byte_size > dmn->send_ring->max_post_send_size) {
-		*iterations = htbl->chunk->byte_size / dmn->send_ring->max_post_send_size;
-		*byte_size = dmn->send_ring->max_post_send_size;
+	if (htbl->chunk->byte_size > send_ring->max_post_send_size) {
+		*iterations = htbl->chunk->byte_size / send_ring->max_post_send_size;
+		*byte_size = send_ring->max_post_send_size;
 		alloc_size = *byte_size;
 		*num_stes = *byte_size / DR_STE_SIZE;
 	} else {
@@ -678,7 +760,8 @@ static int dr_get_tbl_copy_details(struct mlx5dv_dr_domain *dmn,
  * dr_postsend_ste: write size bytes into offset from the hw icm.
  *
  * Input:
- *     dmn     - Domain
+ *     dmn       - Domain
+ *     send_ring - The send ring of the matcher that owns the ste
  *     ste     - The ste struct that contains the data (at least part of it)
  *     data    - The real data to send
  *     size    - data size for writing.
@@ -687,21 +770,118 @@ static int dr_get_tbl_copy_details(struct mlx5dv_dr_domain *dmn,
  *
  * Return: 0 on success.
  */
-int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn, struct dr_ste *ste,
+int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn,
+			 struct dr_send_ring *send_ring, struct dr_ste *ste,
 			 uint8_t *data, uint16_t size, uint16_t offset)
 {
 	struct postsend_info send_info = {};
+	int ret;
 
 	send_info.write.addr    = (uintptr_t) data;
 	send_info.write.length  = size;
 	send_info.write.lkey    = 0;
 	send_info.remote_addr   = dr_ste_get_mr_addr(ste) + offset;
-	send_info.rkey          = ste->htbl->chunk->rkey;
+	send_info.rkey          = dr_ste_get_htbl(ste)->chunk->rkey;
+
+	pthread_mutex_lock(&send_ring->mutex);
+	ret = dr_postsend_icm_data(dmn, send_ring, &send_info);
+	pthread_mutex_unlock(&send_ring->mutex);
+
+	return ret;
+}
+
+static int dr_send_postsend_ste_info(struct mlx5dv_dr_domain *dmn,
+				     struct dr_send_ring *send_ring,
+				     struct dr_ste_send_info *ste_info,
+				     bool chain)
+{
+	struct postsend_info send_info = {};
+	int ret;
+
+	list_del(&ste_info->send_list);
+
+	send_info.write.addr    = (uintptr_t) ste_info->data;
+	send_info.write.length  = ste_info->size;
+	send_info.write.lkey    = 0;
+	send_info.remote_addr   = dr_ste_get_mr_addr(ste_info->ste) +
+				  ste_info->offset;
+	send_info.rkey          = dr_ste_get_htbl(ste_info->ste)->chunk->rkey;
 
-	return dr_postsend_icm_data(dmn, &send_info);
+	ret = dr_postsend_icm_data_chain(dmn, send_ring, &send_info, chain);
+	if (ret)
+		goto out;
+
+	/* Copy data to ste, only reduced size, the last 16B (mask)
+	 * is already written to the hw.
+	 */
+	memcpy(dr_ste_get_hw_ste(ste_info->ste), ste_info->data,
+	       DR_STE_SIZE_REDUCED);
+
+out:
+	free(ste_info);
+	return ret;
 }
 
-int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl,
+/*
+ * dr_send_postsend_ste_list: write all the ste's of a send list in one
+ * batch and free the send list entries.
+ *
+ * The writes are chained, only the last one is read back and the doorbell is
+ * rung once for the whole list, which keeps the writes of the list ordered.
+ * With chain_last the last write is chained too and the caller must complete
+ * the batch with dr_send_ring_flush().
+ *
+ * Return: 0 on success.
+ */
+int dr_send_postsend_ste_list(struct mlx5dv_dr_domain *dmn,
+			      struct dr_send_ring *send_ring,
+			      struct list_head *send_ste_list,
+			      bool is_reverse, bool chain_last)
+{
+	struct dr_ste_send_info *ste_info, *tmp_ste_info, *last;
+	int ret = 0;
+
+	if (is_reverse)
+		last = list_top(send_ste_list, struct dr_ste_send_info,
+				send_list);
+	else
+		last = list_tail(send_ste_list, struct dr_ste_send_info,
+				 send_list);
+
+	pthread_mutex_lock(&send_ring->mutex);
+
+	if (is_reverse) {
+		list_for_each_rev_safe(send_ste_list, ste_info, tmp_ste_info,
+				       send_list) {
+			ret = dr_send_postsend_ste_info(dmn, send_ring, ste_info,
+							chain_last ||
+							ste_info != last);
+			if (ret)
+				break;
+		}
+	} else {
+		list_for_each_safe(send_ste_list, ste_info, tmp_ste_info,
+				   send_list) {
+			ret = dr_send_postsend_ste_info(dmn, send_ring, ste_info,
+							chain_last ||
+							ste_info != last);
+			if (ret)
+				break;
+		}
+	}
+
+	/* On failure notify the HW about the writes that were chained */
+	if (ret)
+		dr_post_send_db(send_ring->qp);
+
+	pthread_mutex_unlock(&send_ring->mutex);
+
+	return ret;
+}
+
+int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn,
+			  struct dr_send_ring *send_ring,
+			  struct dr_ste_htbl *htbl,
 			  uint8_t *formated_ste, uint8_t *mask)
 {
 	uint32_t byte_size = htbl->chunk->byte_size;
@@ -709,7 +889,7 @@ int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl
 	uint8_t *data;
 	int ret;
 
-	ret = dr_get_tbl_copy_details(dmn, htbl, &data, &byte_size,
+	ret = dr_get_tbl_copy_details(send_ring, htbl, &data, &byte_size,
 				      &iterations, &num_stes_per_iter);
 	if (ret)
 		return ret;
@@ -721,12 +901,15 @@ int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl
 
 		/* Copy all ste's on the data buffer, need to add the bit_mask */
 		for (j = 0; j < num_stes_per_iter; j++) {
-			if (dr_ste_is_not_valid_entry(htbl->ste_arr[ste_index + j].hw_ste)) {
+			uint8_t *hw_ste = htbl->hw_ste_arr +
+				(ste_index + j) * DR_STE_SIZE_REDUCED;
+
+			if (dr_ste_is_not_valid_entry(hw_ste)) {
 				memcpy(data + (j * DR_STE_SIZE),
 				       formated_ste, DR_STE_SIZE);
 			} else {
 				/* Copy data */
-				memcpy(data + (j * DR_STE_SIZE), htbl->ste_arr[ste_index + j].hw_ste,
+				memcpy(data + (j * DR_STE_SIZE), hw_ste,
 				       DR_STE_SIZE_REDUCED);
 				/* Copy bit_mask */
 				memcpy(data + (j * DR_STE_SIZE) + DR_STE_SIZE_REDUCED,
@@ -740,7 +923,9 @@ int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl
 		send_info.remote_addr	= dr_ste_get_mr_addr(htbl->ste_arr + ste_index);
 		send_info.rkey		= htbl->chunk->rkey;
 
-		ret = dr_postsend_icm_data(dmn, &send_info);
+		pthread_mutex_lock(&send_ring->mutex);
+		ret = dr_postsend_icm_data(dmn, send_ring, &send_info);
+		pthread_mutex_unlock(&send_ring->mutex);
 		if (ret)
 			goto out_free;
 	}
@@ -752,6 +937,7 @@ out_free:
 
 /* Initialize htble with default STEs */
 int dr_send_postsend_formated_htbl(struct mlx5dv_dr_domain *dmn,
+				   struct dr_send_ring *send_ring,
 				   struct dr_ste_htbl *htbl,
 				   uint8_t *ste_init_data,
 				   bool update_hw_ste)
@@ -760,7 +946,7 @@ int dr_send_postsend_formated_htbl(struct mlx5dv_dr_domain *dmn,
 	int i, num_stes, iterations, ret;
 	uint8_t *data;
 
-	ret = dr_get_tbl_copy_details(dmn, htbl, &data, &byte_size,
+	ret = dr_get_tbl_copy_details(send_ring, htbl, &data, &byte_size,
 				      &iterations, &num_stes);
 	if (ret)
 		return ret;
@@ -790,7 +976,9 @@ int dr_send_postsend_formated_htbl(struct mlx5dv_dr_domain *dmn,
 		send_info.remote_addr	= dr_ste_get_mr_addr(htbl->ste_arr + ste_index);
 		send_info.rkey		= htbl->chunk->rkey;
 
-		ret = dr_postsend_icm_data(dmn, &send_info);
+		pthread_mutex_lock(&send_ring->mutex);
+		ret = dr_postsend_icm_data(dmn, send_ring, &send_info);
+		pthread_mutex_unlock(&send_ring->mutex);
 		if (ret)
 			goto out_free;
 	}
@@ -803,6 +991,7 @@ out_free:
 int dr_send_postsend_action(struct mlx5dv_dr_domain *dmn,
 			    struct mlx5dv_dr_action *action)
 {
+	struct dr_send_ring *send_ring = dmn->send_ring[0];
 	struct postsend_info send_info = {};
 	int ret;
 
@@ -813,18 +1002,24 @@ int dr_send_postsend_action(struct mlx5dv_dr_domain *dmn,
 	send_info.remote_addr	= action->rewrite.chunk->mr_addr;
 	send_info.rkey		= action->rewrite.chunk->rkey;
 
-	pthread_mutex_lock(&dmn->mutex);
-	ret = dr_postsend_icm_data(dmn, &send_info);
-	pthread_mutex_unlock(&dmn->mutex);
+	pthread_mutex_lock(&send_ring->mutex);
+	ret = dr_postsend_icm_data(dmn, send_ring, &send_info);
+	pthread_mutex_unlock(&send_ring->mutex);
+	if (ret)
+		return ret;
 
-	return ret;
+	/*
+	 * Rules posted on the other rings may point to the action as soon as
+	 * it is returned, make sure it was written first.
+	 */
+	return dr_send_ring_force_drain(dmn, send_ring);
 }
 
-static int dr_prepare_qp_to_rts(struct mlx5dv_dr_domain *dmn)
+static int dr_prepare_qp_to_rts(struct mlx5dv_dr_domain *dmn,
+				struct dr_qp *dr_qp)
 {
 	struct dr_devx_qp_rts_attr rts_attr = {};
 	struct dr_devx_qp_rtr_attr rtr_attr = {};
-	struct dr_qp *dr_qp = dmn->send_ring->qp;
 	enum ibv_mtu mtu = IBV_MTU_1024;
 	uint16_t gid_index = 0;
 	int port = 1;
@@ -870,10 +1065,11 @@ static int dr_prepare_qp_to_rts(struct mlx5dv_dr_domain *dmn)
 	return 0;
 }
 
-/* Each domain has its own ib resources */
-int dr_send_ring_alloc(struct mlx5dv_dr_domain *dmn)
+static int dr_send_ring_alloc_one(struct mlx5dv_dr_domain *dmn,
+				  struct dr_send_ring **ring)
 {
 	struct dr_qp_init_attr init_attr = {};
+	struct dr_send_ring *send_ring;
 	struct mlx5dv_pd mlx5_pd = {};
 	struct mlx5dv_cq mlx5_cq = {};
 	int cq_size, page_size;
@@ -883,33 +1079,35 @@ int dr_send_ring_alloc(struct mlx5dv_dr_domain *dmn)
 			   IBV_ACCESS_REMOTE_READ;
 	int ret;
 
-	dmn->send_ring = calloc(1, sizeof(*dmn->send_ring));
-	if (!dmn->send_ring) {
+	send_ring = calloc(1, sizeof(*send_ring));
+	if (!send_ring) {
 		dr_dbg(dmn, "Couldn't allocate send-ring\n");
 		errno = ENOMEM;
 		return errno;
 	}
 
+	pthread_mutex_init(&send_ring->mutex, NULL);
+
 	cq_size = QUEUE_SIZE + 1;
-	dmn->send_ring->cq.ibv_cq = ibv_create_cq(dmn->ctx, cq_size, NULL, NULL, 0);
-	if (!dmn->send_ring->cq.ibv_cq) {
+	send_ring->cq.ibv_cq = ibv_create_cq(dmn->ctx, cq_size, NULL, NULL, 0);
+	if (!send_ring->cq.ibv_cq) {
 		dr_dbg(dmn, "Failed to create CQ with %u entries\n", cq_size);
 		ret = ENODEV;
 		errno = ENODEV;
 		goto free_send_ring;
 	}
 
-	obj.cq.in = dmn->send_ring->cq.ibv_cq;
+	obj.cq.in = send_ring->cq.ibv_cq;
 	obj.cq.out = &mlx5_cq;
 
 	ret = mlx5dv_init_obj(&obj, MLX5DV_OBJ_CQ);
 	if (ret)
 		goto clean_cq;
 
-	dmn->send_ring->cq.buf = mlx5_cq.buf;
-	dmn->send_ring->cq.db = mlx5_cq.dbrec;
-	dmn->send_ring->cq.ncqe = mlx5_cq.cqe_cnt;
-	dmn->send_ring->cq.cqe_sz = mlx5_cq.cqe_size;
+	send_ring->cq.buf = mlx5_cq.buf;
+	send_ring->cq.db = mlx5_cq.dbrec;
+	send_ring->cq.ncqe = mlx5_cq.cqe_cnt;
+	send_ring->cq.cqe_sz = mlx5_cq.cqe_size;
 
 	obj.pd.in = dmn->pd;
 	obj.pd.out = &mlx5_pd;
@@ -927,95 +1125,145 @@ int dr_send_ring_alloc(struct mlx5dv_dr_domain *dmn)
 	init_attr.cap.max_recv_sge	= 1;
 	init_attr.cap.max_inline_data	= DR_STE_SIZE;
 
-	dmn->send_ring->qp = dr_create_rc_qp(dmn->ctx, &init_attr);
-	if (!dmn->send_ring->qp)  {
+	send_ring->qp = dr_create_rc_qp(dmn->ctx, &init_attr);
+	if (!send_ring->qp)  {
 		dr_dbg(dmn, "Couldn't create QP\n");
 		ret = errno;
 		goto clean_cq;
 	}
-	dmn->send_ring->cq.qp = dmn->send_ring->qp;
+	send_ring->cq.qp = send_ring->qp;
 
 	dmn->info.max_send_wr = QUEUE_SIZE;
-	dmn->info.max_inline_size = min(dmn->send_ring->qp->max_inline_data,
+	dmn->info.max_inline_size = min(send_ring->qp->max_inline_data,
 					DR_STE_SIZE);
 
-	dmn->send_ring->signal_th = dmn->info.max_send_wr / SIGNAL_PER_DIV_QUEUE;
+	send_ring->signal_th = dmn->info.max_send_wr / SIGNAL_PER_DIV_QUEUE;
 
 	/* Prepare qp to be used */
-	ret = dr_prepare_qp_to_rts(dmn);
+	ret = dr_prepare_qp_to_rts(dmn, send_ring->qp);
 	if (ret) {
 		dr_dbg(dmn, "Couldn't prepare QP\n");
 		goto clean_qp;
 	}
 
-	dmn->send_ring->max_post_send_size =
+	send_ring->max_post_send_size =
 		dr_icm_pool_chunk_size_to_byte(DR_CHUNK_SIZE_1K, DR_ICM_TYPE_STE);
 
 	/* Allocating the max size as a buffer for writing */
-	size = dmn->send_ring->signal_th * dmn->send_ring->max_post_send_size;
+	size = send_ring->signal_th * send_ring->max_post_send_size;
 	page_size = sysconf(_SC_PAGESIZE);
-	ret = posix_memalign(&dmn->send_ring->buf, page_size, size);
+	ret = posix_memalign(&send_ring->buf, page_size, size);
 	if (ret) {
 		dr_dbg(dmn, "Couldn't allocate send-ring buf.\n");
 		errno = ret;
 		goto clean_qp;
 	}
 
-	memset(dmn->send_ring->buf, 0, size);
-	dmn->send_ring->buf_size = size;
+	memset(send_ring->buf, 0, size);
+	send_ring->buf_size = size;
 
-	dmn->send_ring->mr = ibv_reg_mr(dmn->pd, dmn->send_ring->buf, size,
-					access_flags);
-	if (!dmn->send_ring->mr) {
-		dr_dbg(dmn, "Couldn't register send-ring MR\n");
+	send_ring->buf_wqe = calloc(send_ring->signal_th,
+				    sizeof(*send_ring->buf_wqe));
+	if (!send_ring->buf_wqe) {
+		dr_dbg(dmn, "Couldn't allocate send-ring buf slots\n");
+		errno = ENOMEM;
 		ret = errno;
 		goto free_mem;
 	}
 
-	dmn->send_ring->sync_mr = ibv_reg_mr(dmn->pd, dmn->send_ring->sync_buff,
-					     MIN_READ_SYNC,
-					     IBV_ACCESS_LOCAL_WRITE |
-					     IBV_ACCESS_REMOTE_READ |
-					     IBV_ACCESS_REMOTE_WRITE);
-	if (!dmn->send_ring->sync_mr) {
+	send_ring->mr = ibv_reg_mr(dmn->pd, send_ring->buf, size, access_flags);
+	if (!send_ring->mr) {
+		dr_dbg(dmn, "Couldn't register send-ring MR\n");
+		ret = errno;
+		goto free_wqe;
+	}
+
+	send_ring->sync_mr = ibv_reg_mr(dmn->pd, send_ring->sync_buff,
+					MIN_READ_SYNC,
+					IBV_ACCESS_LOCAL_WRITE |
+					IBV_ACCESS_REMOTE_READ |
+					IBV_ACCESS_REMOTE_WRITE);
+	if (!send_ring->sync_mr) {
 		dr_dbg(dmn, "Couldn't register sync mr\n");
 		ret = errno;
 		goto clean_mr;
 	}
 
+	*ring = send_ring;
 	return 0;
 
 clean_mr:
-	ibv_dereg_mr(dmn->send_ring->mr);
+	ibv_dereg_mr(send_ring->mr);
+free_wqe:
+	free(send_ring->buf_wqe);
 free_mem:
-	free(dmn->send_ring->buf);
+	free(send_ring->buf);
 clean_qp:
-	dr_destroy_qp(dmn->send_ring->qp);
+	dr_destroy_qp(send_ring->qp);
 clean_cq:
-	ibv_destroy_cq(dmn->send_ring->cq.ibv_cq);
+	ibv_destroy_cq(send_ring->cq.ibv_cq);
 free_send_ring:
-	free(dmn->send_ring);
+	pthread_mutex_destroy(&send_ring->mutex);
+	free(send_ring);
 
 	return ret;
 }
 
-void dr_send_ring_free(struct dr_send_ring *send_ring)
+static void dr_send_ring_free_one(struct dr_send_ring *send_ring)
 {
 	dr_destroy_qp(send_ring->qp);
 	ibv_destroy_cq(send_ring->cq.ibv_cq);
 	ibv_dereg_mr(send_ring->sync_mr);
 	ibv_dereg_mr(send_ring->mr);
+	free(send_ring->buf_wqe);
 	free(send_ring->buf);
+	pthread_mutex_destroy(&send_ring->mutex);
 	free(send_ring);
 }
 
-int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn)
+/* Each domain has its own ib resources */
+int dr_send_ring_alloc(struct mlx5dv_dr_domain *dmn)
+{
+	int i, ret;
+
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++) {
+		ret = dr_send_ring_alloc_one(dmn, &dmn->send_ring[i]);
+		if (ret)
+			goto free_send_rings;
+	}
+
+	return 0;
+
+free_send_rings:
+	while (i--) {
+		dr_send_ring_free_one(dmn->send_ring[i]);
+		dmn->send_ring[i] = NULL;
+	}
+
+	return ret;
+}
+
+void dr_send_ring_free(struct mlx5dv_dr_domain *dmn)
+{
+	int i;
+
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++)
+		dr_send_ring_free_one(dmn->send_ring[i]);
+}
+
+/* Must be called with the domain mutex held */
+struct dr_send_ring *dr_send_ring_next(struct mlx5dv_dr_domain *dmn)
+{
+	return dmn->send_ring[dmn->next_send_ring++ % DR_MAX_SEND_RINGS];
+}
+
+int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn,
+			     struct dr_send_ring *send_ring)
 {
-	struct dr_send_ring *send_ring = dmn->send_ring;
 	struct postsend_info send_info = {};
 	uint8_t data[DR_STE_SIZE];
 	int i, num_of_sends_req;
-	int ret;
+	int ret = 0;
 
 	/* Sending this amount of requests makes sure we will get drain */
 	num_of_sends_req = send_ring->signal_th * TH_NUMS_TO_DRAIN / 2;
@@ -1028,14 +1276,100 @@ int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn)
 	send_info.remote_addr	= (uintptr_t) send_ring->sync_mr->addr;
 	send_info.rkey		= send_ring->sync_mr->rkey;
 
+	pthread_mutex_lock(&send_ring->mutex);
 
 	for (i = 0; i < num_of_sends_req; i++) {
-		ret = dr_postsend_icm_data(dmn, &send_info);
+		ret = dr_postsend_icm_data(dmn, send_ring, &send_info);
 		if (ret)
-			return ret;
+			goto out_unlock;
 	}
 
 	ret = dr_handle_pending_wc(dmn, send_ring);
 
+out_unlock:
+	pthread_mutex_unlock(&send_ring->mutex);
+	return ret;
+}
+
+/*
+ * Notify the HW about all the writes posted on the ring and pad it with fake
+ * requests until the last one is signaled, so a completion is generated for
+ * all of them. Returns the number of WQEs posted up to that point.
+ */
+int dr_send_ring_flush(struct mlx5dv_dr_domain *dmn,
+		       struct dr_send_ring *send_ring,
+		       uint64_t *posted_wqe)
+{
+	struct postsend_info send_info = {};
+	uint8_t data[DR_STE_SIZE];
+	int ret = 0;
+
+	send_info.write.addr	= (uintptr_t) data;
+	send_info.write.length	= DR_STE_SIZE;
+	send_info.write.lkey	= 0;
+	send_info.remote_addr	= (uintptr_t) send_ring->sync_mr->addr;
+	send_info.rkey		= send_ring->sync_mr->rkey;
+
+	pthread_mutex_lock(&send_ring->mutex);
+
+	/*
+	 * A request is a write and a read, a chained one only a write. Align
+	 * the pending count to even so the read of a request is the one to
+	 * hit the signaling threshold, signal_th is even.
+	 */
+	if (send_ring->pending_wqe % 2) {
+		ret = dr_postsend_icm_data_chain(dmn, send_ring, &send_info,
+						 true);
+		if (ret)
+			goto out_unlock;
+	}
+
+	do {
+		ret = dr_postsend_icm_data(dmn, send_ring, &send_info);
+		if (ret)
+			goto out_unlock;
+	} while (send_ring->pending_wqe % send_ring->signal_th);
+
+	*posted_wqe = send_ring->posted_wqe;
+
+out_unlock:
+	pthread_mutex_unlock(&send_ring->mutex);
+	return ret;
+}
+
+/*
+ * Consume the available completions of the ring without waiting. Returns the
+ * number of WQEs known to be done.
+ */
+int dr_send_ring_poll(struct mlx5dv_dr_domain *dmn,
+		      struct dr_send_ring *send_ring,
+		      uint64_t *done_wqe)
+{
+	int ne, ret = 0;
+
+	pthread_mutex_lock(&send_ring->mutex);
+
+	/* See dr_handle_pending_wc */
+	if (dr_is_device_fatal(dmn)) {
+		*done_wqe = send_ring->posted_wqe;
+		goto out_unlock;
+	}
+
+	while (send_ring->pending_wqe >= send_ring->signal_th) {
+		ne = dr_poll_cq(&send_ring->cq, 1);
+		if (ne < 0) {
+			dr_dbg(dmn, "poll CQ failed\n");
+			ret = ne;
+			goto out_unlock;
+		}
+		if (!ne)
+			break;
+		send_ring->pending_wqe -= send_ring->signal_th;
+	}
+
+	*done_wqe = send_ring->posted_wqe - send_ring->pending_wqe;
+
+out_unlock:
+	pthread_mutex_unlock(&send_ring->mutex);
 	return ret;
 }
@@ -296,35 +296,53 @@ void dr_ste_set_hit_addr(uint8_t *hw_ste, uint64_t icm_addr, uint32_t ht_size)
 
 uint64_t dr_ste_get_icm_addr(struct dr_ste *ste)
 {
-	uint32_t index = ste - ste->htbl->ste_arr;
+	uint32_t index = dr_ste_get_index(ste);
 
-	return ste->htbl->chunk->icm_addr + DR_STE_SIZE * index;
+	return dr_ste_get_htbl(ste)->chunk->icm_addr + DR_STE_SIZE * index;
 }
 
 uint64_t dr_ste_get_mr_addr(struct dr_ste *ste)
 {
-	uint32_t index = ste - ste->htbl->ste_arr;
+	uint32_t index = dr_ste_get_index(ste);
 
-	return ste->htbl->chunk->mr_addr + DR_STE_SIZE * index;
+	return dr_ste_get_htbl(ste)->chunk->mr_addr + DR_STE_SIZE * index;
 }
 
-struct list_head *dr_ste_get_miss_list(struct dr_ste *ste)
+/*
+ * The miss list starts at an entry of the origin table, the other STEs of
+ * the list are the only entry of their collision table.
+ */
+struct dr_ste *dr_ste_get_miss_head(struct dr_ste *ste)
 {
-	uint32_t index = ste - ste->htbl->ste_arr;
+	struct dr_ste_htbl *htbl = dr_ste_get_htbl(ste);
+
+	return htbl->miss_head ? htbl->miss_head : ste;
+}
+
+struct dr_ste *dr_ste_get_miss_next(struct dr_ste *ste)
+{
+	struct dr_ste_htbl *next_htbl;
 
-	return &ste->htbl->miss_list[index];
+	next_htbl = dr_htbl_get_by_id(dr_ste_get_htbl(ste)->ids, ste->miss_next);
+
+	return next_htbl ? next_htbl->ste_arr : NULL;
+}
+
+/* The STE of the previous location in the chain of the rules using ste */
+struct dr_ste *dr_ste_get_pointing_ste(struct dr_ste *ste)
+{
+	return dr_ste_get_htbl(dr_ste_get_miss_head(ste))->pointing_ste;
 }
 
-void dr_ste_always_hit_htbl(struct dr_ste *ste, struct dr_ste_htbl *next_htbl)
+void dr_ste_always_hit_htbl(uint8_t *hw_ste, struct dr_ste_htbl *next_htbl)
 {
 	struct dr_icm_chunk *chunk = next_htbl->chunk;
-	uint8_t *hw_ste = ste->hw_ste;
 
 	DR_STE_SET(general, hw_ste, byte_mask, next_htbl->byte_mask);
 	DR_STE_SET(general, hw_ste, next_lu_type, next_htbl->lu_type);
 	dr_ste_set_hit_addr(hw_ste, chunk->icm_addr, chunk->num_of_entries);
 
-	dr_ste_set_always_hit((struct dr_hw_ste_format *)ste->hw_ste);
+	dr_ste_set_always_hit((struct dr_hw_ste_format *)hw_ste);
 }
 
 bool dr_ste_is_last_in_rule(struct dr_matcher_rx_tx *nic_matcher,
@@ -348,15 +366,16 @@ bool dr_ste_is_last_in_rule(struct dr_matcher_rx_tx *nic_matcher,
  */
 static void dr_ste_replace(struct dr_ste *dst, struct dr_ste *src)
 {
-	memcpy(dst->hw_ste, src->hw_ste, DR_STE_SIZE_REDUCED);
+	memcpy(dr_ste_get_hw_ste(dst), dr_ste_get_hw_ste(src),
+	       DR_STE_SIZE_REDUCED);
 	dst->next_htbl = src->next_htbl;
 	if (dst->next_htbl)
-		dst->next_htbl->pointing_ste = dst;
+		dr_ste_get_next_htbl(dst)->pointing_ste = dst;
 
 	atomic_init(&dst->refcount, atomic_load(&src->refcount));
 
-	list_head_init(&dst->rule_list);
-	list_append_list(&dst->rule_list, &src->rule_list);
+	/* The rule that ends at src should know about that */
+	dr_rule_update_last_ste(src, dst);
 }
 
 /* Free ste which is the head and the only one in miss_list */
@@ -368,20 +387,17 @@ dr_ste_remove_head_ste(struct dr_ste *ste,
 		       struct dr_ste_htbl *stats_tbl)
 {
 	uint8_t tmp_data_ste[DR_STE_SIZE] = {};
-	struct dr_ste tmp_ste = {};
+	uint8_t *hw_ste = dr_ste_get_hw_ste(ste);
 	uint64_t miss_addr;
 
-	tmp_ste.hw_ste = tmp_data_ste;
 	/*
 	 * Use temp ste because dr_ste_always_miss_addr
-	 * touches bit_mask area which doesn't exist at ste->hw_ste.
+	 * touches bit_mask area which doesn't exist at the reduced hw_ste.
 	 */
-	memcpy(tmp_ste.hw_ste, ste->hw_ste, DR_STE_SIZE_REDUCED);
+	memcpy(tmp_data_ste, hw_ste, DR_STE_SIZE_REDUCED);
 	miss_addr = nic_matcher->e_anchor->chunk->icm_addr;
-	dr_ste_always_miss_addr(&tmp_ste, miss_addr);
-	memcpy(ste->hw_ste, tmp_ste.hw_ste, DR_STE_SIZE_REDUCED);
-
-	list_del_init(&ste->miss_list_node);
+	dr_ste_always_miss_addr(tmp_data_ste, miss_addr);
+	memcpy(hw_ste, tmp_data_ste, DR_STE_SIZE_REDUCED);
 
 	/* Write full STE size in order to have "always_miss" */
 	dr_send_fill_and_append_ste_send_info(ste, DR_STE_SIZE,
@@ -406,13 +422,10 @@ dr_ste_replace_head_ste(struct dr_ste *ste, struct dr_ste *next_ste,
 {
 	struct dr_ste_htbl *next_miss_htbl;
 
-	next_miss_htbl = next_ste->htbl;
+	next_miss_htbl = dr_ste_get_htbl(next_ste);
 
 	/* Remove from the miss_list the next_ste before copy */
-	list_del_init(&next_ste->miss_list_node);
-
-	/* All rule-members that use next_ste should know about that */
-	dr_rule_update_rule_member(next_ste, ste);
+	ste->miss_next = next_ste->miss_next;
 
 	/* Move data from next into ste */
 	dr_ste_replace(ste, next_ste);
@@ -424,7 +437,7 @@ dr_ste_replace_head_ste(struct dr_ste *ste, struct dr_ste *next_ste,
 	dr_htbl_put(next_miss_htbl);
 
 	dr_send_fill_and_append_ste_send_info(ste, DR_STE_SIZE_REDUCED,
-					      0, ste->hw_ste,
+					      0, dr_ste_get_hw_ste(ste),
 					      ste_info_head,
 					      send_ste_list,
 					      true /* Copy data */);
@@ -442,20 +455,23 @@ static void dr_ste_remove_middle_ste(struct dr_ste *ste,
 				     struct list_head *send_ste_list,
 				     struct dr_ste_htbl *stats_tbl)
 {
-	struct dr_ste *prev_ste;
+	struct dr_ste *prev_ste, *next_ste;
 	uint64_t miss_addr;
 
-	prev_ste = list_prev(dr_ste_get_miss_list(ste), ste, miss_list_node);
-	assert(prev_ste);
+	prev_ste = dr_ste_get_miss_head(ste);
+	while ((next_ste = dr_ste_get_miss_next(prev_ste)) != ste) {
+		assert(next_ste);
+		prev_ste = next_ste;
+	}
 
-	miss_addr = dr_ste_get_miss_addr(ste->hw_ste);
-	dr_ste_set_miss_addr(prev_ste->hw_ste, miss_addr);
+	miss_addr = dr_ste_get_miss_addr(dr_ste_get_hw_ste(ste));
+	dr_ste_set_miss_addr(dr_ste_get_hw_ste(prev_ste), miss_addr);
 
 	dr_send_fill_and_append_ste_send_info(prev_ste, DR_STE_SIZE_REDUCED, 0,
-					      prev_ste->hw_ste, ste_info,
+					      dr_ste_get_hw_ste(prev_ste), ste_info,
 					      send_ste_list, true /* Copy data*/);
 
-	list_del_init(&ste->miss_list_node);
+	prev_ste->miss_next = ste->miss_next;
 
 	stats_tbl->ctrl.num_of_valid_entries--;
 	stats_tbl->ctrl.num_of_collisions--;
@@ -473,8 +489,8 @@ void dr_ste_free(struct dr_ste *ste,
 	bool put_on_origin_table = true;
 	struct dr_ste_htbl *stats_tbl;
 
-	first_ste = list_top(dr_ste_get_miss_list(ste), struct dr_ste, miss_list_node);
-	stats_tbl = first_ste->htbl;
+	first_ste = dr_ste_get_miss_head(ste);
+	stats_tbl = dr_ste_get_htbl(first_ste);
 	/*
 	 * Two options:
 	 * 1. ste is head:
@@ -483,7 +499,7 @@ void dr_ste_free(struct dr_ste *ste,
 	 * 2. ste is not head
 	 */
 	if (first_ste == ste) { /* Ste is the head */
-		next_ste = list_next(dr_ste_get_miss_list(ste), ste, miss_list_node);
+		next_ste = dr_ste_get_miss_next(ste);
 		if (!next_ste) {
 			/* One and only entry in the list */
 			dr_ste_remove_head_ste(ste, nic_matcher,
@@ -503,13 +519,13 @@ void dr_ste_free(struct dr_ste *ste,
 	/* Update HW */
 	list_for_each_safe(&send_ste_list, cur_ste_info, tmp_ste_info, send_list) {
 		list_del(&cur_ste_info->send_list);
-		dr_send_postsend_ste(dmn, cur_ste_info->ste,
-				     cur_ste_info->data, cur_ste_info->size,
-				     cur_ste_info->offset);
+		dr_send_postsend_ste(dmn, matcher->send_ring,
+				     cur_ste_info->ste, cur_ste_info->data,
+				     cur_ste_info->size, cur_ste_info->offset);
 	}
 
 	if (put_on_origin_table)
-		dr_htbl_put(ste->htbl);
+		dr_htbl_put(dr_ste_get_htbl(ste));
 }
 
 bool dr_ste_equal_tag(void *src, void *dst)
@@ -537,17 +553,15 @@ void dr_ste_set_miss_addr(uint8_t *hw_ste_p, uint64_t miss_addr)
 	DR_STE_SET(rx_steering_mult, hw_ste_p, miss_address_31_6, index);
 }
 
-void dr_ste_always_miss_addr(struct dr_ste *ste, uint64_t miss_addr)
+void dr_ste_always_miss_addr(uint8_t *hw_ste, uint64_t miss_addr)
 {
-	uint8_t *hw_ste = ste->hw_ste;
-
 	DR_STE_SET(rx_steering_mult, hw_ste, next_lu_type, DR_STE_LU_TYPE_DONT_CARE);
 	dr_ste_set_miss_addr(hw_ste, miss_addr);
-	dr_ste_set_always_miss((struct dr_hw_ste_format *)ste->hw_ste);
+	dr_ste_set_always_miss((struct dr_hw_ste_format *)hw_ste);
 }
 
 /*
- * The assumption here is that we don't update the ste->hw_ste if it is not
+ * The assumption here is that we don't update the hw_ste if it is not
  * used ste, so it will be all zero, checking the next_lu_type.
  */
 bool dr_ste_is_not_valid_entry(uint8_t *p_hw_ste)
@@ -573,18 +587,17 @@ void dr_ste_set_formated_ste(uint16_t gvmi,
 			     uint8_t *formated_ste,
 			     struct dr_htbl_connect_info *connect_info)
 {
-	struct dr_ste ste = {};
-
 	dr_ste_init(formated_ste, htbl->lu_type, nic_dmn->ste_type, gvmi);
-	ste.hw_ste = formated_ste;
 
 	if (connect_info->type == CONNECT_HIT)
-		dr_ste_always_hit_htbl(&ste, connect_info->hit_next_htbl);
+		dr_ste_always_hit_htbl(formated_ste, connect_info->hit_next_htbl);
 	else
-		dr_ste_always_miss_addr(&ste, connect_info->miss_icm_addr);
+		dr_ste_always_miss_addr(formated_ste,
+					connect_info->miss_icm_addr);
 }
 
 int dr_ste_htbl_init_and_postsend(struct mlx5dv_dr_domain *dmn,
+				  struct dr_send_ring *send_ring,
 				  struct dr_domain_rx_tx *nic_dmn,
 				  struct dr_ste_htbl *htbl,
 				  struct dr_htbl_connect_info *connect_info,
@@ -598,7 +611,8 @@ int dr_ste_htbl_init_and_postsend(struct mlx5dv_dr_domain *dmn,
 				formated_ste,
 				connect_info);
 
-	return dr_send_postsend_formated_htbl(dmn, htbl, formated_ste, update_hw_ste);
+	return dr_send_postsend_formated_htbl(dmn, send_ring, htbl, formated_ste,
+					      update_hw_ste);
 }
 
 int dr_ste_create_next_htbl(struct mlx5dv_dr_matcher *matcher,
@@ -620,10 +634,12 @@ int dr_ste_create_next_htbl(struct mlx5dv_dr_matcher *matcher,
 		next_lu_type = DR_STE_GET(general, hw_ste, next_lu_type);
 		byte_mask = DR_STE_GET(general, hw_ste, byte_mask);
 
-		next_htbl = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+		next_htbl = dr_ste_htbl_alloc(dmn,
 					      log_table_size,
 					      next_lu_type,
-					      byte_mask);
+					      byte_mask,
+					      dr_ste_is_last_in_rule(nic_matcher,
+								     ste->ste_chain_location + 1));
 		if (!next_htbl) {
 			dr_dbg(dmn, "Failed allocating next hash table\n");
 			return errno;
@@ -632,14 +648,15 @@ int dr_ste_create_next_htbl(struct mlx5dv_dr_matcher *matcher,
 		/* Write new table to HW */
 		info.type = CONNECT_MISS;
 		info.miss_icm_addr = nic_matcher->e_anchor->chunk->icm_addr;
-		if (dr_ste_htbl_init_and_postsend(dmn, nic_dmn, next_htbl,
+		if (dr_ste_htbl_init_and_postsend(dmn, matcher->send_ring,
+						  nic_dmn, next_htbl,
 						  &info, false)) {
 			dr_dbg(dmn, "Failed writing table to HW\n");
 			goto free_table;
 		}
 
 		dr_ste_set_hit_addr_by_next_htbl(cur_hw_ste, next_htbl);
-		ste->next_htbl = next_htbl;
+		ste->next_htbl = next_htbl->id;
 		next_htbl->pointing_ste = ste;
 	}
 
@@ -665,47 +682,152 @@ static void dr_ste_set_ctrl(struct dr_ste_htbl *htbl)
 	ctrl->increase_threshold = (num_of_entries + 1) / 2;
 }
 
-struct dr_ste_htbl *dr_ste_htbl_alloc(struct dr_icm_pool *pool,
+int dr_htbl_ids_init(struct dr_htbl_ids *ids)
+{
+	ids->pages = calloc(DR_HTBL_ID_MAX_PAGES, sizeof(*ids->pages));
+	if (!ids->pages) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	/* Id 0 stands for no table */
+	ids->next_id = 1;
+	ids->free_id = 0;
+	ids->num_of_pages = 0;
+	ids->num_of_rule_entries = 0;
+	pthread_mutex_init(&ids->mutex, NULL);
+
+	return 0;
+}
+
+void dr_htbl_ids_uninit(struct dr_htbl_ids *ids)
+{
+	uint32_t i;
+
+	for (i = 0; i < ids->num_of_pages; i++)
+		free(ids->pages[i]);
+
+	free(ids->pages);
+	pthread_mutex_destroy(&ids->mutex);
+}
+
+static union dr_htbl_id_entry *dr_htbl_id_entry(struct dr_htbl_ids *ids,
+						uint32_t id)
+{
+	return &ids->pages[id >> DR_HTBL_ID_PAGE_SHIFT]
+			  [id & (DR_HTBL_ID_PAGE_SIZE - 1)];
+}
+
+static int dr_htbl_id_alloc(struct dr_htbl_ids *ids, struct dr_ste_htbl *htbl,
+			    uint32_t num_of_rule_entries)
+{
+	uint32_t page, id;
+
+	pthread_mutex_lock(&ids->mutex);
+
+	if (ids->free_id) {
+		id = ids->free_id;
+		ids->free_id = dr_htbl_id_entry(ids, id)->next_free;
+	} else {
+		if (!ids->next_id) {
+			/* All the ids are in use */
+			errno = ENOSPC;
+			goto err_unlock;
+		}
+
+		id = ids->next_id;
+		page = id >> DR_HTBL_ID_PAGE_SHIFT;
+		if (page == ids->num_of_pages) {
+			ids->pages[page] = calloc(DR_HTBL_ID_PAGE_SIZE,
+						  sizeof(union dr_htbl_id_entry));
+			if (!ids->pages[page]) {
+				errno = ENOMEM;
+				goto err_unlock;
+			}
+			ids->num_of_pages++;
+		}
+		ids->next_id++;
+	}
+
+	dr_htbl_id_entry(ids, id)->htbl = htbl;
+	ids->num_of_rule_entries += num_of_rule_entries;
+	pthread_mutex_unlock(&ids->mutex);
+
+	htbl->ids = ids;
+	htbl->id = id;
+	return 0;
+
+err_unlock:
+	pthread_mutex_unlock(&ids->mutex);
+	return errno;
+}
+
+static void dr_htbl_id_free(struct dr_ste_htbl *htbl,
+			    uint32_t num_of_rule_entries)
+{
+	struct dr_htbl_ids *ids = htbl->ids;
+
+	pthread_mutex_lock(&ids->mutex);
+	dr_htbl_id_entry(ids, htbl->id)->next_free = ids->free_id;
+	ids->free_id = htbl->id;
+	ids->num_of_rule_entries -= num_of_rule_entries;
+	pthread_mutex_unlock(&ids->mutex);
+}
+
+struct dr_ste_htbl *dr_ste_htbl_alloc(struct mlx5dv_dr_domain *dmn,
 				      enum dr_icm_chunk_size chunk_size,
-				      uint8_t lu_type, uint16_t byte_mask)
+				      uint8_t lu_type, uint16_t byte_mask,
+				      bool last_in_rule)
 {
+	uint32_t num_of_entries = dr_icm_pool_chunk_size_to_entries(chunk_size);
+	uint32_t num_of_rule_entries = last_in_rule ? num_of_entries : 0;
 	struct dr_icm_chunk *chunk;
 	struct dr_ste_htbl *htbl;
+	size_t rule_arr_offset;
 	int i;
 
-	htbl = calloc(1, sizeof(struct dr_ste_htbl));
+	/* One allocation for the table and its entries, see dr_ste_htbl */
+	rule_arr_offset = align(sizeof(struct dr_ste_htbl) +
+				num_of_entries * (sizeof(struct dr_ste) +
+						  DR_STE_SIZE_REDUCED),
+				sizeof(struct dr_rule_rx_tx *));
+	htbl = calloc(1, rule_arr_offset +
+			 num_of_rule_entries * sizeof(struct dr_rule_rx_tx *));
 	if (!htbl) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	chunk = dr_icm_alloc_chunk(pool, chunk_size);
+	chunk = dr_icm_alloc_chunk(dmn->ste_icm_pool, chunk_size);
 	if (!chunk)
 		goto out_free_htbl;
 
+	if (dr_htbl_id_alloc(&dmn->htbl_ids, htbl, num_of_rule_entries))
+		goto out_free_chunk;
+
 	htbl->chunk = chunk;
 	htbl->lu_type = lu_type;
 	htbl->byte_mask = byte_mask;
-	htbl->ste_arr = chunk->ste_arr;
-	htbl->hw_ste_arr = chunk->hw_ste_arr;
-	htbl->miss_list = chunk->miss_list;
+	htbl->ste_arr = (struct dr_ste *)(htbl + 1);
+	htbl->hw_ste_arr = (uint8_t *)(htbl->ste_arr + num_of_entries);
+	if (last_in_rule)
+		htbl->rule_arr = (struct dr_rule_rx_tx **)
+				 ((uint8_t *)htbl + rule_arr_offset);
 	atomic_init(&htbl->refcount, 0);
 
-	for (i = 0; i < chunk->num_of_entries; i++) {
+	for (i = 0; i < num_of_entries; i++) {
 		struct dr_ste *ste = &htbl->ste_arr[i];
 
-		ste->hw_ste = htbl->hw_ste_arr + i * DR_STE_SIZE_REDUCED;
-		ste->htbl = htbl;
+		ste->index = i;
 		atomic_init(&ste->refcount, 0);
-		list_node_init(&ste->miss_list_node);
-		list_head_init(&htbl->miss_list[i]);
-		list_head_init(&ste->rule_list);
 	}
 
 	htbl->chunk_size = chunk_size;
 	dr_ste_set_ctrl(htbl);
 	return htbl;
 
+out_free_chunk:
+	dr_icm_free_chunk(chunk);
 out_free_htbl:
 	free(htbl);
 	return NULL;
@@ -713,9 +835,15 @@ out_free_htbl:
 
 int dr_ste_htbl_free(struct dr_ste_htbl *htbl)
 {
+	uint32_t num_of_rule_entries = 0;
+
 	if (atomic_load(&htbl->refcount))
 		return EBUSY;
 
+	if (htbl->rule_arr)
+		num_of_rule_entries = htbl->chunk->num_of_entries;
+
+	dr_htbl_id_free(htbl, num_of_rule_entries);
 	dr_icm_free_chunk(htbl->chunk);
 	free(htbl);
 	return 0;
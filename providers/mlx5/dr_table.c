@@ -72,17 +72,17 @@ static int dr_table_init_nic(struct mlx5dv_dr_domain *dmn,
 	struct dr_htbl_connect_info info;
 	int ret;
 
-	nic_tbl->s_anchor = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+	nic_tbl->s_anchor = dr_ste_htbl_alloc(dmn,
 					      DR_CHUNK_SIZE_1,
 					      DR_STE_LU_TYPE_DONT_CARE,
-					      0);
+					      0, false);
 	if (!nic_tbl->s_anchor)
 		return errno;
 
 	info.type = CONNECT_MISS;
 	info.miss_icm_addr = nic_dmn->default_icm_addr;
-	ret = dr_ste_htbl_init_and_postsend(dmn, nic_dmn, nic_tbl->s_anchor,
-					    &info, true);
+	ret = dr_ste_htbl_init_and_postsend(dmn, dmn->send_ring[0], nic_dmn,
+					    nic_tbl->s_anchor, &info, true);
 	if (ret)
 		goto free_s_anchor;
 
@@ -144,6 +144,13 @@ static int dr_table_init(struct mlx5dv_dr_table *tbl)
 		break;
 	}
 
+	/*
+	 * Matchers and rules on other send rings may point to the anchors
+	 * as soon as the table is returned.
+	 */
+	if (!ret)
+		ret = dr_send_ring_force_drain(tbl->dmn, tbl->dmn->send_ring[0]);
+
 	pthread_mutex_unlock(&tbl->dmn->mutex);
 
 	return ret;
@@ -193,6 +200,7 @@ struct mlx5dv_dr_table *mlx5dv_dr_table_create(struct mlx5dv_dr_domain *dmn,
 	tbl->dmn = dmn;
 	tbl->level = level;
 	atomic_init(&tbl->refcount, 1);
+	pthread_mutex_init(&tbl->mutex, NULL);
 
 	if (!dr_is_root_table(tbl)) {
 		ret = dr_table_init(tbl);
@@ -205,13 +213,17 @@ struct mlx5dv_dr_table *mlx5dv_dr_table_create(struct mlx5dv_dr_domain *dmn,
 	}
 
 	list_node_init(&tbl->tbl_list);
+
+	pthread_mutex_lock(&dmn->mutex);
 	list_add_tail(&dmn->tbl_list, &tbl->tbl_list);
+	pthread_mutex_unlock(&dmn->mutex);
 
 	return tbl;
 
 uninit_tbl:
 	dr_table_uninit(tbl);
 free_tbl:
+	pthread_mutex_destroy(&tbl->mutex);
 	free(tbl);
 dec_ref:
 	atomic_fetch_sub(&dmn->refcount, 1);
@@ -233,8 +245,12 @@ int mlx5dv_dr_table_destroy(struct mlx5dv_dr_table *tbl)
 		dr_table_uninit(tbl);
 	}
 
+	pthread_mutex_lock(&tbl->dmn->mutex);
 	list_del(&tbl->tbl_list);
+	pthread_mutex_unlock(&tbl->dmn->mutex);
+
 	atomic_fetch_sub(&tbl->dmn->refcount, 1);
+	pthread_mutex_destroy(&tbl->mutex);
 	free(tbl);
 
 	return ret;
@@ -1477,6 +1477,22 @@ mlx5dv_dr_rule_create(struct mlx5dv_dr_matcher *matcher,
 
 int mlx5dv_dr_rule_destroy(struct mlx5dv_dr_rule *rule);
 
+enum mlx5dv_dr_rule_bulk_flags {
+	MLX5DV_DR_RULE_BULK_FLAGS_ASYNC		= 1 << 0,
+};
+
+int mlx5dv_dr_rule_create_bulk(struct mlx5dv_dr_matcher *matcher,
+			       size_t num_rules,
+			       struct mlx5dv_flow_match_parameters *values[],
+			       size_t num_actions,
+			       struct mlx5dv_dr_action *actions[],
+			       uint32_t flags,
+			       struct mlx5dv_dr_rule *rules[]);
+
+int mlx5dv_dr_rule_poll_bulk(struct mlx5dv_dr_matcher *matcher,
+			     size_t max_rules,
+			     struct mlx5dv_dr_rule *rules[]);
+
 enum mlx5dv_dr_action_flags {
 	MLX5DV_DR_ACTION_FLAGS_ROOT_LEVEL	= 1 << 0,
 };
@@ -42,6 +42,7 @@
 
 #define DR_RULE_MAX_STES	17
 #define DR_ACTION_MAX_STES	3
+#define DR_RULE_MAX_STE_CHAIN	(DR_RULE_MAX_STES + DR_ACTION_MAX_STES)
 #define WIRE_PORT		0xFFFF
 #define DR_STE_SVLAN		0x1
 #define DR_STE_CVLAN		0x2
@@ -186,7 +187,7 @@ enum dr_action_type {
 
 struct dr_icm_pool;
 struct dr_icm_chunk;
-struct dr_icm_bucket;
+struct dr_icm_buddy;
 struct dr_ste_htbl;
 struct dr_match_param;
 struct dr_devx_caps;
@@ -206,21 +207,24 @@ struct postsend_info {
 	uint32_t		rkey;
 };
 
+/*
+ * There is one for every entry of a hash table, keep it small. Its hash table
+ * is found from its index, see dr_ste_get_htbl(), and other tables are
+ * referred to by their id, see dr_htbl_ids. The reduced copy of the HW STE is
+ * kept by the table, see dr_ste_get_hw_ste().
+ */
 struct dr_ste {
-	uint8_t			*hw_ste;
 	/* refcount: indicates the num of rules that using this ste */
 	atomic_int		refcount;
 
-	/* attached to the miss_list head at each htbl entry */
-	struct list_node	miss_list_node;
+	/* this ste is member of htbl, at this index of its ste_arr */
+	uint32_t		index;
 
-	/* each rule member that uses this ste attached here */
-	struct list_head	rule_list;
-
-	/* this ste is member of htbl */
-	struct dr_ste_htbl	*htbl;
+	/* id of the htbl holding the next ste of the miss list, 0 if last */
+	uint32_t		miss_next;
 
-	struct dr_ste_htbl	*next_htbl;
+	/* id of the htbl pointed by the hit address, 0 if none */
+	uint32_t		next_htbl;
 
 	/* this ste is part of a rule, located in ste's chain */
 	uint8_t			ste_chain_location;
@@ -238,15 +242,26 @@ struct dr_ste_htbl_ctrl {
 	bool	may_grow;
 };
 
+/*
+ * The entry arrays are allocated along with the table: ste_arr right after
+ * the table, the reduced HW STE copies in hw_ste_arr and, for the tables of
+ * the last STE of the rules only, rule_arr.
+ */
 struct dr_ste_htbl {
 	uint8_t			lu_type;
 	uint16_t		byte_mask;
 	atomic_int		refcount;
+	uint32_t		id;
+	struct dr_htbl_ids	*ids;
 	struct dr_icm_chunk	*chunk;
 	struct dr_ste		*ste_arr;
 	uint8_t			*hw_ste_arr;
 
-	struct list_head	*miss_list;
+	/* The rule ending at each entry, which follows it when it moves */
+	struct dr_rule_rx_tx	**rule_arr;
+
+	/* Set on collision tables, the entry of the origin table */
+	struct dr_ste		*miss_head;
 
 	enum dr_icm_chunk_size	chunk_size;
 	struct dr_ste		*pointing_ste;
@@ -254,6 +269,67 @@ struct dr_ste_htbl {
 	struct dr_ste_htbl_ctrl ctrl;
 };
 
+/*
+ * STEs refer to hash tables by a 32-bit id, 0 stands for none. The ids index
+ * a two level table of which the pages never move, ids are looked up without
+ * taking the mutex.
+ */
+#define DR_HTBL_ID_PAGE_SHIFT	16
+#define DR_HTBL_ID_PAGE_SIZE	(1 << DR_HTBL_ID_PAGE_SHIFT)
+#define DR_HTBL_ID_MAX_PAGES	(1 << (32 - DR_HTBL_ID_PAGE_SHIFT))
+
+union dr_htbl_id_entry {
+	struct dr_ste_htbl	*htbl;
+	/* Once the id is freed, the next free id */
+	uint32_t		next_free;
+};
+
+struct dr_htbl_ids {
+	/* Protects the allocation of ids and pages */
+	pthread_mutex_t		mutex;
+	union dr_htbl_id_entry	**pages;
+	uint32_t		num_of_pages;
+	/* Ids from here on were never allocated */
+	uint32_t		next_id;
+	uint32_t		free_id;
+	/* Entries of the rule_arr of all tables */
+	uint64_t		num_of_rule_entries;
+};
+
+int dr_htbl_ids_init(struct dr_htbl_ids *ids);
+void dr_htbl_ids_uninit(struct dr_htbl_ids *ids);
+
+static inline struct dr_ste_htbl *dr_htbl_get_by_id(struct dr_htbl_ids *ids,
+						    uint32_t id)
+{
+	if (!id)
+		return NULL;
+
+	return ids->pages[id >> DR_HTBL_ID_PAGE_SHIFT]
+			 [id & (DR_HTBL_ID_PAGE_SIZE - 1)].htbl;
+}
+
+static inline struct dr_ste_htbl *dr_ste_get_htbl(struct dr_ste *ste)
+{
+	return (struct dr_ste_htbl *)(ste - ste->index) - 1;
+}
+
+static inline uint32_t dr_ste_get_index(struct dr_ste *ste)
+{
+	return ste->index;
+}
+
+static inline uint8_t *dr_ste_get_hw_ste(struct dr_ste *ste)
+{
+	return dr_ste_get_htbl(ste)->hw_ste_arr +
+	       ste->index * DR_STE_SIZE_REDUCED;
+}
+
+static inline struct dr_ste_htbl *dr_ste_get_next_htbl(struct dr_ste *ste)
+{
+	return dr_htbl_get_by_id(dr_ste_get_htbl(ste)->ids, ste->next_htbl);
+}
+
 struct dr_ste_send_info {
 	struct dr_ste		*ste;
 	struct list_node	send_list;
@@ -281,9 +357,10 @@ struct dr_ste_build {
 				  uint8_t *hw_ste_p);
 };
 
-struct dr_ste_htbl *dr_ste_htbl_alloc(struct dr_icm_pool *pool,
+struct dr_ste_htbl *dr_ste_htbl_alloc(struct mlx5dv_dr_domain *dmn,
 				      enum dr_icm_chunk_size chunk_size,
-				      uint8_t lu_type, uint16_t byte_mask);
+				      uint8_t lu_type, uint16_t byte_mask,
+				      bool last_in_rule);
 int dr_ste_htbl_free(struct dr_ste_htbl *htbl);
 
 static inline void dr_htbl_put(struct dr_ste_htbl *htbl)
@@ -300,11 +377,11 @@ static inline void dr_htbl_get(struct dr_ste_htbl *htbl)
 /* STE utils */
 uint32_t dr_ste_calc_hash_index(uint8_t *hw_ste_p, struct dr_ste_htbl *htbl);
 void dr_ste_init(uint8_t *hw_ste_p, uint8_t lu_type, uint8_t entry_type, uint16_t gvmi);
-void dr_ste_always_hit_htbl(struct dr_ste *ste, struct dr_ste_htbl *next_htbl);
+void dr_ste_always_hit_htbl(uint8_t *hw_ste, struct dr_ste_htbl *next_htbl);
 void dr_ste_set_miss_addr(uint8_t *hw_ste, uint64_t miss_addr);
 uint64_t dr_ste_get_miss_addr(uint8_t *hw_ste);
 void dr_ste_set_hit_addr(uint8_t *hw_ste, uint64_t icm_addr, uint32_t ht_size);
-void dr_ste_always_miss_addr(struct dr_ste *ste, uint64_t miss_addr);
+void dr_ste_always_miss_addr(uint8_t *hw_ste, uint64_t miss_addr);
 void dr_ste_set_bit_mask(uint8_t *hw_ste_p, uint8_t *bit_mask);
 bool dr_ste_not_used_ste(struct dr_ste *ste);
 bool dr_ste_is_last_in_rule(struct dr_matcher_rx_tx *nic_matcher,
@@ -320,7 +397,9 @@ void dr_ste_set_rewrite_actions(uint8_t *hw_ste_p, uint16_t num_of_actions,
 				uint32_t re_write_index);
 uint64_t dr_ste_get_icm_addr(struct dr_ste *ste);
 uint64_t dr_ste_get_mr_addr(struct dr_ste *ste);
-struct list_head *dr_ste_get_miss_list(struct dr_ste *ste);
+struct dr_ste *dr_ste_get_miss_head(struct dr_ste *ste);
+struct dr_ste *dr_ste_get_miss_next(struct dr_ste *ste);
+struct dr_ste *dr_ste_get_pointing_ste(struct dr_ste *ste);
 
 void dr_ste_free(struct dr_ste *ste,
 		 struct mlx5dv_dr_matcher *matcher,
@@ -614,16 +693,26 @@ struct dr_domain_info {
 	struct dr_devx_caps	caps;
 };
 
+/*
+ * Each matcher posts all of its STE writes on one send ring, so that writes
+ * of the same matcher are executed in order. Matchers are spread over the
+ * domain send rings round robin.
+ */
+#define DR_MAX_SEND_RINGS	4
+
 struct mlx5dv_dr_domain {
 	struct ibv_context		*ctx;
 	struct ibv_pd			*pd;
 	struct mlx5dv_devx_uar		*uar;
 	enum mlx5dv_dr_domain_type	type;
 	atomic_int			refcount;
+	/* Protects the table list and the matcher lists of all tables */
 	pthread_mutex_t			mutex;
 	struct dr_icm_pool		*ste_icm_pool;
 	struct dr_icm_pool		*action_icm_pool;
-	struct dr_send_ring		*send_ring;
+	struct dr_htbl_ids		htbl_ids;
+	struct dr_send_ring		*send_ring[DR_MAX_SEND_RINGS];
+	uint32_t			next_send_ring;
 	struct dr_domain_info		info;
 	struct list_head		tbl_list;
 };
@@ -643,6 +732,8 @@ struct mlx5dv_dr_table {
 	struct mlx5dv_devx_obj		*devx_obj;
 	atomic_int			refcount;
 	struct list_node		tbl_list;
+	/* Protects the anchors chaining the matchers of the table */
+	pthread_mutex_t			mutex;
 };
 
 struct dr_matcher_rx_tx {
@@ -665,14 +756,11 @@ struct mlx5dv_dr_matcher {
 	atomic_int			refcount;
 	struct mlx5dv_flow_matcher	*dv_matcher;
 	struct list_head		rule_list;
-};
-
-struct dr_rule_member {
-	struct dr_ste		*ste;
-	/* attached to dr_rule via this */
-	struct list_node	list;
-	/* attached to dr_ste via this */
-	struct list_node	use_ste_list;
+	/* Protects the matcher hash tables and rule list */
+	pthread_mutex_t			mutex;
+	struct dr_send_ring		*send_ring;
+	/* Asynchronous bulks not polled yet, oldest first */
+	struct list_head		bulk_list;
 };
 
 struct mlx5dv_dr_action {
@@ -728,11 +816,6 @@ struct mlx5dv_dr_action {
 	};
 };
 
-struct dr_rule_action_member {
-	struct mlx5dv_dr_action *action;
-	struct list_node	list;
-};
-
 enum dr_connect_type {
 	CONNECT_HIT	= 1,
 	CONNECT_MISS	= 2,
@@ -748,8 +831,9 @@ struct dr_htbl_connect_info {
 
 
 struct dr_rule_rx_tx {
-	struct list_head		rule_members_list;
 	struct dr_matcher_rx_tx		*nic_matcher;
+	/* The other STEs of the rule are found from it, see dr_rule_get_ste_chain() */
+	struct dr_ste			*last_ste;
 };
 
 struct mlx5dv_dr_rule {
@@ -761,25 +845,37 @@ struct mlx5dv_dr_rule {
 		};
 		struct ibv_flow *flow;
 	};
-	struct list_head	rule_actions_list;
+	struct mlx5dv_dr_action	**actions;
+	size_t			num_actions;
 	struct list_node	rule_list;
 };
 
-void dr_rule_update_rule_member(struct dr_ste *new_ste, struct dr_ste *ste);
+/* Rules of an asynchronous bulk, completed once posted_wqe WQEs are done */
+struct dr_rule_bulk {
+	struct list_node	list;
+	uint64_t		posted_wqe;
+	size_t			num_rules;
+	/* First rule not returned by poll yet */
+	size_t			next;
+	struct mlx5dv_dr_rule	*rules[];
+};
+
+void dr_rule_update_last_ste(struct dr_ste *ste, struct dr_ste *new_ste);
+int dr_rule_get_ste_chain(struct dr_rule_rx_tx *nic_rule,
+			  struct dr_ste *ste_arr[DR_RULE_MAX_STE_CHAIN]);
 
 struct dr_icm_chunk {
-	struct dr_icm_bucket	*bucket;
+	struct dr_icm_buddy	*buddy;
+	/* On the pool hot list once freed */
 	struct list_node	chunk_list;
+	/* Offset in entries of the chunk in its buddy */
+	uint64_t		seg;
+	uint64_t		free_epoch;
 	uint32_t		rkey;
 	uint32_t		num_of_entries;
 	uint32_t		byte_size;
 	uint64_t		icm_addr;
 	uint64_t		mr_addr;
-
-	/* Memory optimisation */
-	struct dr_ste		*ste_arr;
-	uint8_t			*hw_ste_arr;
-	struct list_head	*miss_list;
 };
 
 static inline int dr_matcher_supp_flex_parser_icmp_v4(struct dr_devx_caps *caps)
@@ -926,8 +1022,27 @@ void dr_icm_pool_destroy(struct dr_icm_pool *pool);
 struct dr_icm_chunk *dr_icm_alloc_chunk(struct dr_icm_pool *pool,
 					enum dr_icm_chunk_size chunk_size);
 void dr_icm_free_chunk(struct dr_icm_chunk *chunk);
+
+/* Sizes are in bytes */
+struct dr_icm_pool_stats {
+	uint32_t	num_of_buddies;
+	uint64_t	total_size;
+	uint64_t	used_size;
+	/* Freed but not reusable before the next sync, part of used_size */
+	uint64_t	hot_size;
+	uint64_t	free_size;
+	uint64_t	max_free_seg_size;
+	uint64_t	num_of_free_segs;
+	uint64_t	num_of_syncs;
+	/* Allocated and not freed yet */
+	uint64_t	num_of_chunks;
+};
+
+void dr_icm_pool_get_stats(struct dr_icm_pool *pool,
+			   struct dr_icm_pool_stats *stats);
 bool dr_ste_is_not_valid_entry(uint8_t *p_hw_ste);
 int dr_ste_htbl_init_and_postsend(struct mlx5dv_dr_domain *dmn,
+				  struct dr_send_ring *send_ring,
 				  struct dr_domain_rx_tx *nic_dmn,
 				  struct dr_ste_htbl *htbl,
 				  struct dr_htbl_connect_info *connect_info,
@@ -969,6 +1084,9 @@ struct dr_qp {
 	struct mlx5dv_devx_uar		*uar;
 	struct mlx5dv_devx_umem		*buf_umem;
 	struct mlx5dv_devx_umem		*db_umem;
+	/* WQEs posted since the last doorbell */
+	unsigned			nreq;
+	void				*last_ctrl;
 };
 
 struct dr_cq {
@@ -986,18 +1104,24 @@ struct dr_cq {
 #define MIN_READ_SYNC		64
 
 struct dr_send_ring {
+	/* Serializes the posting threads of the matchers sharing the ring */
+	pthread_mutex_t		mutex;
 	struct dr_cq		cq;
 	struct dr_qp		*qp;
 	struct ibv_mr		*mr;
 	/* How much wqes are waiting for completion */
 	uint32_t		pending_wqe;
+	/* How much wqes were ever posted, posted_wqe - pending_wqe are done */
+	uint64_t		posted_wqe;
 	/* Signal request per this trash hold value */
 	uint16_t		signal_th;
 	/* Each post_send_size less than max_post_send_size */
 	uint32_t		max_post_send_size;
-	/* manage the send queue */
+	/* Writes bounced through buf, each slot is reused signal_th later */
 	uint32_t		tx_head;
 	void			*buf;
+	/* Per buf slot, the posted_wqe that has to be done to reuse it */
+	uint64_t		*buf_wqe;
 	uint32_t		buf_size;
 	struct ibv_wc		wc[MAX_SEND_CQE];
 	uint8_t			sync_buff[MIN_READ_SYNC];
@@ -1005,13 +1129,29 @@ struct dr_send_ring {
 };
 
 int dr_send_ring_alloc(struct mlx5dv_dr_domain *dmn);
-void dr_send_ring_free(struct dr_send_ring *send_ring);
-int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn);
-int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn, struct dr_ste *ste,
+void dr_send_ring_free(struct mlx5dv_dr_domain *dmn);
+int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn,
+			     struct dr_send_ring *send_ring);
+struct dr_send_ring *dr_send_ring_next(struct mlx5dv_dr_domain *dmn);
+int dr_send_ring_flush(struct mlx5dv_dr_domain *dmn,
+		       struct dr_send_ring *send_ring,
+		       uint64_t *posted_wqe);
+int dr_send_ring_poll(struct mlx5dv_dr_domain *dmn,
+		      struct dr_send_ring *send_ring,
+		      uint64_t *done_wqe);
+int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn,
+			 struct dr_send_ring *send_ring, struct dr_ste *ste,
 			 uint8_t *data, uint16_t size, uint16_t offset);
-int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl,
+int dr_send_postsend_ste_list(struct mlx5dv_dr_domain *dmn,
+			      struct dr_send_ring *send_ring,
+			      struct list_head *send_ste_list,
+			      bool is_reverse, bool chain_last);
+int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn,
+			  struct dr_send_ring *send_ring,
+			  struct dr_ste_htbl *htbl,
 			  uint8_t *formated_ste, uint8_t *mask);
 int dr_send_postsend_formated_htbl(struct mlx5dv_dr_domain *dmn,
+				   struct dr_send_ring *send_ring,
 				   struct dr_ste_htbl *htbl,
 				   uint8_t *ste_init_data,
 				   bool update_hw_ste);
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2020 Mellanox Technologies, Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measure the software steering rule insertion and deletion rate. Every
+ * thread inserts IPv4/TCP 5-tuple rules with a drop action into its own
+ * matcher of a NIC RX table, or into one shared matcher with -s. With -b the
+ * rules are inserted asynchronously in bulks.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include <infiniband/mlx5dv.h>
+
+/* Offsets in the outer headers of the PRM fte_match_param layout */
+#define MATCH_ETHERTYPE		0x06
+#define MATCH_IP_PROTOCOL	0x10
+#define MATCH_TCP_SPORT		0x14
+#define MATCH_TCP_DPORT		0x16
+#define MATCH_SRC_IPV4		0x2c
+#define MATCH_DST_IPV4		0x3c
+#define MATCH_OUTER_SIZE	0x40
+#define MATCH_CRITERIA_OUTER	(1 << 0)
+
+struct bench_thread {
+	pthread_t thread;
+	unsigned int index;
+	struct mlx5dv_dr_matcher *matcher;
+	struct mlx5dv_dr_rule **rules;
+	double insert_time;
+	double delete_time;
+	int err;
+};
+
+static const char *argv0 = "benchrules";
+
+static unsigned int num_threads = 1;
+static unsigned int num_rules = 100000;
+static unsigned int bulk_size;
+static struct mlx5dv_dr_action *drop;
+static pthread_barrier_t barrier;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct mlx5dv_flow_match_parameters *alloc_match(void)
+{
+	struct mlx5dv_flow_match_parameters *match;
+
+	match = calloc(1, sizeof(*match) + MATCH_OUTER_SIZE);
+	if (match)
+		match->match_sz = MATCH_OUTER_SIZE;
+	return match;
+}
+
+static void put16(struct mlx5dv_flow_match_parameters *match, int off,
+		  uint16_t val)
+{
+	val = htobe16(val);
+	memcpy((uint8_t *)match->match_buf + off, &val, sizeof(val));
+}
+
+static void put32(struct mlx5dv_flow_match_parameters *match, int off,
+		  uint32_t val)
+{
+	val = htobe32(val);
+	memcpy((uint8_t *)match->match_buf + off, &val, sizeof(val));
+}
+
+static void set_tuple(struct mlx5dv_flow_match_parameters *match,
+		      uint16_t ethertype, uint8_t proto, uint32_t sip,
+		      uint32_t dip, uint16_t sport, uint16_t dport)
+{
+	put16(match, MATCH_ETHERTYPE, ethertype);
+	((uint8_t *)match->match_buf)[MATCH_IP_PROTOCOL] = proto;
+	put16(match, MATCH_TCP_SPORT, sport);
+	put16(match, MATCH_TCP_DPORT, dport);
+	put32(match, MATCH_SRC_IPV4, sip);
+	put32(match, MATCH_DST_IPV4, dip);
+}
+
+static struct mlx5dv_dr_matcher *create_matcher(struct mlx5dv_dr_table *tbl,
+						uint16_t prio)
+{
+	struct mlx5dv_flow_match_parameters *mask;
+	struct mlx5dv_dr_matcher *matcher;
+
+	mask = alloc_match();
+	if (!mask)
+		return NULL;
+
+	set_tuple(mask, 0xffff, 0xff, 0xffffffff, 0xffffffff, 0xffff, 0xffff);
+	matcher = mlx5dv_dr_matcher_create(tbl, prio, MATCH_CRITERIA_OUTER,
+					   mask);
+	free(mask);
+	return matcher;
+}
+
+static void set_rule_tuple(struct bench_thread *thr,
+			   struct mlx5dv_flow_match_parameters *value,
+			   unsigned int i)
+{
+	/* A distinct connection per rule, spread over all hash bits */
+	set_tuple(value, 0x0800, 6,
+		  0x0a000000 | thr->index << 16 | i >> 16,
+		  0x0b000000 | (i * 2654435761U) >> 8,
+		  1024 + (i & 0xffff) % 60000, 80);
+}
+
+static unsigned int insert_rules(struct bench_thread *thr,
+				 struct mlx5dv_flow_match_parameters *value)
+{
+	struct mlx5dv_dr_action *actions[] = { drop };
+	unsigned int i;
+
+	for (i = 0; i < num_rules; i++) {
+		set_rule_tuple(thr, value, i);
+		thr->rules[i] = mlx5dv_dr_rule_create(thr->matcher, value, 1,
+						      actions);
+		if (!thr->rules[i]) {
+			perror("mlx5dv_dr_rule_create");
+			thr->err = 1;
+			break;
+		}
+	}
+	return i;
+}
+
+static unsigned int
+insert_rules_bulk(struct bench_thread *thr,
+		  struct mlx5dv_flow_match_parameters **values)
+{
+	uint32_t flags = MLX5DV_DR_RULE_BULK_FLAGS_ASYNC;
+	struct mlx5dv_dr_action *actions[] = { drop };
+	unsigned int i, j, n, created = 0, polled = 0;
+	struct mlx5dv_dr_rule **done;
+	int ret;
+
+	done = calloc(num_rules, sizeof(*done));
+	if (!done) {
+		thr->err = 1;
+		return 0;
+	}
+
+	while (polled < num_rules) {
+		if (created < num_rules) {
+			n = num_rules - created;
+			if (n > bulk_size)
+				n = bulk_size;
+			for (j = 0; j < n; j++)
+				set_rule_tuple(thr, values[j], created + j);
+
+			ret = mlx5dv_dr_rule_create_bulk(thr->matcher, n,
+							 values, 1, actions,
+							 flags,
+							 &thr->rules[created]);
+			if (ret > 0)
+				created += ret;
+			if (ret < 0 || (unsigned int)ret < n) {
+				perror("mlx5dv_dr_rule_create_bulk");
+				thr->err = 1;
+				break;
+			}
+		}
+
+		ret = mlx5dv_dr_rule_poll_bulk(thr->matcher, num_rules - polled,
+					       &done[polled]);
+		if (ret < 0) {
+			perror("mlx5dv_dr_rule_poll_bulk");
+			thr->err = 1;
+			break;
+		}
+		polled += ret;
+	}
+
+	/* Rules must not be destroyed before they are polled */
+	while (thr->err && polled < created) {
+		ret = mlx5dv_dr_rule_poll_bulk(thr->matcher, created - polled,
+					       &done[polled]);
+		if (ret < 0)
+			break;
+		polled += ret;
+	}
+
+	/* Polling returns the rules in creation order */
+	for (i = 0; i < polled; i++) {
+		if (done[i] != thr->rules[i]) {
+			fprintf(stderr, "rule %u polled out of order\n", i);
+			thr->err = 1;
+		}
+	}
+
+	free(done);
+	return polled;
+}
+
+static void *bench_thread_run(void *arg)
+{
+	struct mlx5dv_flow_match_parameters **values;
+	struct bench_thread *thr = arg;
+	unsigned int i, num_values;
+	double t;
+
+	num_values = bulk_size ? bulk_size : 1;
+	values = calloc(num_values, sizeof(*values));
+	for (i = 0; values && i < num_values; i++) {
+		values[i] = alloc_match();
+		if (!values[i])
+			break;
+	}
+	if (!values || i < num_values)
+		thr->err = 1;
+
+	pthread_barrier_wait(&barrier);
+
+	t = now();
+	i = 0;
+	if (!thr->err)
+		i = bulk_size ? insert_rules_bulk(thr, values) :
+				insert_rules(thr, values[0]);
+	thr->insert_time = now() - t;
+
+	pthread_barrier_wait(&barrier);
+
+	t = now();
+	while (i--) {
+		if (mlx5dv_dr_rule_destroy(thr->rules[i])) {
+			perror("mlx5dv_dr_rule_destroy");
+			thr->err = 1;
+		}
+	}
+	thr->delete_time = now() - t;
+
+	for (i = 0; values && i < num_values; i++)
+		free(values[i]);
+	free(values);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-d <dev>] [-t <threads>] [-n <rules>] [-b <bulk>]"
+		" [-s]\n"
+		"   Time mlx5 software steering rule insertion and deletion\n"
+		"   -d <dev> use IB device <dev> (default first mlx5 device)\n"
+		"   -t <threads> number of inserting threads (default 1)\n"
+		"   -n <rules> rules per thread (default 100000)\n"
+		"   -b <bulk> insert asynchronously <bulk> rules at a time\n"
+		"   -s all threads insert into one shared matcher\n", argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	struct ibv_device **dev_list, *ib_dev = NULL;
+	struct mlx5dv_dr_matcher *shared = NULL;
+	struct mlx5dv_dr_domain *dmn;
+	struct bench_thread *threads;
+	struct mlx5dv_dr_table *tbl;
+	double insert = 0, delete = 0, t;
+	const char *dev_name = NULL;
+	struct ibv_context *ctx;
+	bool share = false;
+	unsigned int i;
+	int ch, ret = 1;
+
+	argv0 = argv[0];
+
+	while ((ch = getopt(argc, argv, "d:t:n:b:sh")) != -1) {
+		switch (ch) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 't':
+			num_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_rules = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bulk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			share = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!num_threads || !num_rules || num_threads > 0xffff)
+		usage();
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("ibv_get_device_list");
+		exit(1);
+	}
+	for (i = 0; dev_list[i]; i++) {
+		if (dev_name ? !strcmp(ibv_get_device_name(dev_list[i]), dev_name) :
+			       mlx5dv_is_supported(dev_list[i])) {
+			ib_dev = dev_list[i];
+			break;
+		}
+	}
+	if (!ib_dev) {
+		fprintf(stderr, "no mlx5 device found\n");
+		exit(1);
+	}
+
+	ctx = ibv_open_device(ib_dev);
+	if (!ctx) {
+		fprintf(stderr, "couldn't open %s\n", ibv_get_device_name(ib_dev));
+		exit(1);
+	}
+
+	dmn = mlx5dv_dr_domain_create(ctx, MLX5DV_DR_DOMAIN_TYPE_NIC_RX);
+	if (!dmn) {
+		perror("mlx5dv_dr_domain_create");
+		goto close_ctx;
+	}
+
+	tbl = mlx5dv_dr_table_create(dmn, 1);
+	if (!tbl) {
+		perror("mlx5dv_dr_table_create");
+		goto destroy_dmn;
+	}
+
+	drop = mlx5dv_dr_action_create_drop();
+	if (!drop) {
+		perror("mlx5dv_dr_action_create_drop");
+		goto destroy_tbl;
+	}
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads)
+		goto destroy_drop;
+
+	if (share) {
+		shared = create_matcher(tbl, 0);
+		if (!shared) {
+			perror("mlx5dv_dr_matcher_create");
+			goto free_threads;
+		}
+	}
+
+	pthread_barrier_init(&barrier, NULL, num_threads);
+
+	for (i = 0; i < num_threads; i++) {
+		struct bench_thread *thr = &threads[i];
+
+		thr->index = i;
+		thr->matcher = share ? shared : create_matcher(tbl, i);
+		thr->rules = calloc(num_rules, sizeof(*thr->rules));
+		if (!thr->matcher || !thr->rules) {
+			fprintf(stderr, "thread %u setup failed\n", i);
+			goto destroy_matchers;
+		}
+	}
+
+	t = now();
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, bench_thread_run,
+				   &threads[i])) {
+			fprintf(stderr, "couldn't create thread %u\n", i);
+			exit(1);
+		}
+	}
+
+	ret = 0;
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		ret |= threads[i].err;
+		if (threads[i].insert_time > insert)
+			insert = threads[i].insert_time;
+		if (threads[i].delete_time > delete)
+			delete = threads[i].delete_time;
+	}
+	t = now() - t;
+
+	if (!ret) {
+		unsigned long total = (unsigned long)num_threads * num_rules;
+
+		printf("%u thread(s), %u rules each, %s matcher(s)\n",
+		       num_threads, num_rules, share ? "shared" : "private");
+		if (bulk_size)
+			printf("bulks of %u rules\n", bulk_size);
+		printf("insert: %10.0f rules/s (%.3f s)\n", total / insert,
+		       insert);
+		printf("delete: %10.0f rules/s (%.3f s)\n", total / delete,
+		       delete);
+		printf("total:  %.3f s\n", t);
+	}
+
+destroy_matchers:
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i].matcher && threads[i].matcher != shared)
+			mlx5dv_dr_matcher_destroy(threads[i].matcher);
+		free(threads[i].rules);
+	}
+	if (shared)
+		mlx5dv_dr_matcher_destroy(shared);
+	pthread_barrier_destroy(&barrier);
+free_threads:
+	free(threads);
+destroy_drop:
+	mlx5dv_dr_action_destroy(drop);
+destroy_tbl:
+	mlx5dv_dr_table_destroy(tbl);
+destroy_dmn:
+	mlx5dv_dr_domain_destroy(dmn);
+close_ctx:
+	ibv_close_device(ctx);
+	ibv_free_device_list(dev_list);
+	return ret;
+}
@@ -49,6 +49,7 @@
 #include <pthread.h>
 #include <stddef.h>
 
+#include <ccan/minmax.h>
 #include <infiniband/driver.h>
 #include <infiniband/verbs.h>
 
@@ -57,6 +58,8 @@
 #include "rxe.h"
 
 static void rxe_free_context(struct ibv_context *ibctx);
+static void rxe_flush_db(struct rxe_context *ctx);
+static void rxe_cq_disarm(struct rxe_cq *cq);
 
 static const struct verbs_match_ent hca_table[] = {
 	VERBS_DRIVER_ID(RDMA_DRIVER_RXE),
@@ -99,31 +102,142 @@ static struct ibv_pd *rxe_alloc_pd(struct ibv_context *context)
 {
 	struct ibv_alloc_pd cmd;
 	struct ib_uverbs_alloc_pd_resp resp;
-	struct ibv_pd *pd;
+	struct rxe_pd *pd;
 
-	pd = malloc(sizeof *pd);
+	pd = calloc(1, sizeof(*pd));
 	if (!pd)
 		return NULL;
 
-	if (ibv_cmd_alloc_pd(context, pd, &cmd, sizeof cmd, &resp, sizeof resp)) {
+	if (ibv_cmd_alloc_pd(context, &pd->ibv_pd, &cmd, sizeof cmd,
+			     &resp, sizeof resp)) {
 		free(pd);
 		return NULL;
 	}
 
-	return pd;
+	atomic_init(&pd->refcount, 1);
+
+	return &pd->ibv_pd;
+}
+
+static int rxe_dealloc_parent_domain(struct rxe_parent_domain *rparent_domain)
+{
+	if (atomic_load(&rparent_domain->rpd.refcount) > 1)
+		return EBUSY;
+
+	atomic_fetch_sub(&rparent_domain->rpd.protection_domain->refcount, 1);
+
+	if (rparent_domain->rtd)
+		atomic_fetch_sub(&rparent_domain->rtd->refcount, 1);
+
+	free(rparent_domain);
+	return 0;
 }
 
-static int rxe_dealloc_pd(struct ibv_pd *pd)
+static int rxe_dealloc_pd(struct ibv_pd *ibpd)
 {
+	struct rxe_parent_domain *rparent_domain = to_rparent_domain(ibpd);
+	struct rxe_pd *pd = to_rpd(ibpd);
 	int ret;
 
-	ret = ibv_cmd_dealloc_pd(pd);
+	if (rparent_domain)
+		return rxe_dealloc_parent_domain(rparent_domain);
+
+	if (atomic_load(&pd->refcount) > 1)
+		return EBUSY;
+
+	ret = ibv_cmd_dealloc_pd(ibpd);
 	if (!ret)
 		free(pd);
 
 	return ret;
 }
 
+static struct ibv_td *rxe_alloc_td(struct ibv_context *context,
+				   struct ibv_td_init_attr *init_attr)
+{
+	struct rxe_td *td;
+
+	if (init_attr->comp_mask) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	td = calloc(1, sizeof(*td));
+	if (!td) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	td->ibv_td.context = context;
+	atomic_init(&td->refcount, 1);
+
+	return &td->ibv_td;
+}
+
+static int rxe_dealloc_td(struct ibv_td *ibtd)
+{
+	struct rxe_td *td = to_rtd(ibtd);
+
+	if (atomic_load(&td->refcount) > 1)
+		return EBUSY;
+
+	free(td);
+	return 0;
+}
+
+static struct ibv_pd *
+rxe_alloc_parent_domain(struct ibv_context *context,
+			struct ibv_parent_domain_init_attr *attr)
+{
+	struct rxe_parent_domain *rparent_domain;
+
+	if (ibv_check_alloc_parent_domain(attr))
+		return NULL;
+
+	/* There are no driver allocated buffers to hand out to the user */
+	if (attr->comp_mask) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rparent_domain = calloc(1, sizeof(*rparent_domain));
+	if (!rparent_domain) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (attr->td) {
+		rparent_domain->rtd = to_rtd(attr->td);
+		atomic_fetch_add(&rparent_domain->rtd->refcount, 1);
+	}
+
+	rparent_domain->rpd.protection_domain = to_rpd(attr->pd);
+	atomic_fetch_add(&rparent_domain->rpd.protection_domain->refcount, 1);
+	atomic_init(&rparent_domain->rpd.refcount, 1);
+
+	ibv_initialize_parent_domain(
+		&rparent_domain->rpd.ibv_pd,
+		&rparent_domain->rpd.protection_domain->ibv_pd);
+
+	return &rparent_domain->rpd.ibv_pd;
+}
+
+static void rxe_get_parent_domain(struct ibv_pd *pd)
+{
+	struct rxe_parent_domain *rparent_domain = to_rparent_domain(pd);
+
+	if (rparent_domain)
+		atomic_fetch_add(&rparent_domain->rpd.refcount, 1);
+}
+
+static void rxe_put_parent_domain(struct ibv_pd *pd)
+{
+	struct rxe_parent_domain *rparent_domain = to_rparent_domain(pd);
+
+	if (rparent_domain)
+		atomic_fetch_sub(&rparent_domain->rpd.refcount, 1);
+}
+
 static struct ibv_mr *rxe_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
 				 uint64_t hca_va, int access)
 {
@@ -158,21 +272,162 @@ static int rxe_dereg_mr(struct verbs_mr *vmr)
 	return 0;
 }
 
-static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
-				    struct ibv_comp_channel *channel,
-				    int comp_vector)
+static int rxe_start_poll(struct ibv_cq_ex *current,
+			  struct ibv_poll_cq_attr *attr)
+{
+	struct rxe_cq *cq = to_rcq_ex(current);
+
+	if (attr->comp_mask)
+		return EINVAL;
+
+	rxe_flush_db(to_rctx(current->context));
+
+	rxe_spin_lock(&cq->lock);
+
+	if (queue_empty(cq->queue)) {
+		rxe_spin_unlock(&cq->lock);
+		return ENOENT;
+	}
+
+	atomic_thread_fence(memory_order_acquire);
+	cq->wc = consumer_addr(cq->queue);
+	current->wr_id = cq->wc->wr_id;
+	current->status = cq->wc->status;
+
+	return 0;
+}
+
+static int rxe_next_poll(struct ibv_cq_ex *current)
+{
+	struct rxe_cq *cq = to_rcq_ex(current);
+
+	advance_consumer(cq->queue);
+
+	if (queue_empty(cq->queue)) {
+		cq->wc = NULL;
+		return ENOENT;
+	}
+
+	atomic_thread_fence(memory_order_acquire);
+	cq->wc = consumer_addr(cq->queue);
+	current->wr_id = cq->wc->wr_id;
+	current->status = cq->wc->status;
+
+	return 0;
+}
+
+static void rxe_end_poll(struct ibv_cq_ex *current)
+{
+	struct rxe_cq *cq = to_rcq_ex(current);
+
+	if (cq->wc) {
+		advance_consumer(cq->queue);
+		cq->wc = NULL;
+	}
+
+	rxe_spin_unlock(&cq->lock);
+}
+
+static enum ibv_wc_opcode rxe_read_opcode(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->opcode;
+}
+
+static uint32_t rxe_read_vendor_err(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->vendor_err;
+}
+
+static uint32_t rxe_read_byte_len(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->byte_len;
+}
+
+static __be32 rxe_read_imm_data(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->ex.imm_data;
+}
+
+static uint32_t rxe_read_qp_num(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->qp_num;
+}
+
+static uint32_t rxe_read_src_qp(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->src_qp;
+}
+
+static unsigned int rxe_read_wc_flags(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->wc_flags;
+}
+
+static uint32_t rxe_read_slid(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->slid;
+}
+
+static uint8_t rxe_read_sl(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->sl;
+}
+
+static uint8_t rxe_read_dlid_path_bits(struct ibv_cq_ex *current)
+{
+	return to_rcq_ex(current)->wc->dlid_path_bits;
+}
+
+enum {
+	RXE_SUP_WC_FLAGS = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_IMM |
+			   IBV_WC_EX_WITH_QP_NUM | IBV_WC_EX_WITH_SRC_QP |
+			   IBV_WC_EX_WITH_SLID | IBV_WC_EX_WITH_SL |
+			   IBV_WC_EX_WITH_DLID_PATH_BITS,
+};
+
+static struct rxe_cq *create_cq(struct ibv_context *context,
+				struct ibv_cq_init_attr_ex *attr)
 {
 	struct rxe_cq *cq;
 	struct urxe_create_cq_resp resp;
+	int need_lock = 1;
 	int ret;
 
-	cq = malloc(sizeof *cq);
-	if (!cq) {
+	if (!check_comp_mask(attr->comp_mask,
+			     IBV_CQ_INIT_ATTR_MASK_FLAGS |
+			     IBV_CQ_INIT_ATTR_MASK_PD) ||
+	    (attr->wc_flags & ~RXE_SUP_WC_FLAGS)) {
+		errno = EOPNOTSUPP;
 		return NULL;
 	}
 
-	ret = ibv_cmd_create_cq(context, cqe, channel, comp_vector,
-				&cq->ibv_cq, NULL, 0,
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS) {
+		if (attr->flags & ~IBV_CREATE_CQ_ATTR_SINGLE_THREADED) {
+			errno = EOPNOTSUPP;
+			return NULL;
+		}
+		if (attr->flags & IBV_CREATE_CQ_ATTR_SINGLE_THREADED)
+			need_lock = 0;
+	}
+
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		struct rxe_parent_domain *rparent_domain =
+			to_rparent_domain(attr->parent_domain);
+
+		if (!rparent_domain) {
+			errno = EINVAL;
+			return NULL;
+		}
+		if (rparent_domain->rtd)
+			need_lock = 0;
+	}
+
+	cq = calloc(1, sizeof(*cq));
+	if (!cq)
+		return NULL;
+
+	ret = ibv_cmd_create_cq(context, attr->cqe, attr->channel,
+				attr->comp_vector, &cq->ibv_cq, NULL, 0,
 				&resp.ibv_resp, sizeof resp);
 	if (ret) {
 		free(cq);
@@ -188,11 +443,67 @@ static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
 	}
 
 	cq->mmap_info = resp.mi;
-	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+	rxe_spinlock_init(&cq->lock, need_lock);
+
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		cq->parent_domain = attr->parent_domain;
+		rxe_get_parent_domain(cq->parent_domain);
+	}
+
+	return cq;
+}
+
+static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
+				    struct ibv_comp_channel *channel,
+				    int comp_vector)
+{
+	struct ibv_cq_init_attr_ex attr = {
+		.cqe = cqe,
+		.channel = channel,
+		.comp_vector = comp_vector,
+	};
+	struct rxe_cq *cq;
+
+	cq = create_cq(context, &attr);
+	if (!cq)
+		return NULL;
 
 	return &cq->ibv_cq;
 }
 
+static struct ibv_cq_ex *rxe_create_cq_ex(struct ibv_context *context,
+					  struct ibv_cq_init_attr_ex *attr)
+{
+	struct rxe_cq *cq;
+
+	cq = create_cq(context, attr);
+	if (!cq)
+		return NULL;
+
+	cq->ibv_cq_ex.start_poll = rxe_start_poll;
+	cq->ibv_cq_ex.next_poll = rxe_next_poll;
+	cq->ibv_cq_ex.end_poll = rxe_end_poll;
+	cq->ibv_cq_ex.read_opcode = rxe_read_opcode;
+	cq->ibv_cq_ex.read_vendor_err = rxe_read_vendor_err;
+	cq->ibv_cq_ex.read_wc_flags = rxe_read_wc_flags;
+	if (attr->wc_flags & IBV_WC_EX_WITH_BYTE_LEN)
+		cq->ibv_cq_ex.read_byte_len = rxe_read_byte_len;
+	if (attr->wc_flags & IBV_WC_EX_WITH_IMM)
+		cq->ibv_cq_ex.read_imm_data = rxe_read_imm_data;
+	if (attr->wc_flags & IBV_WC_EX_WITH_QP_NUM)
+		cq->ibv_cq_ex.read_qp_num = rxe_read_qp_num;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SRC_QP)
+		cq->ibv_cq_ex.read_src_qp = rxe_read_src_qp;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SLID)
+		cq->ibv_cq_ex.read_slid = rxe_read_slid;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SL)
+		cq->ibv_cq_ex.read_sl = rxe_read_sl;
+	if (attr->wc_flags & IBV_WC_EX_WITH_DLID_PATH_BITS)
+		cq->ibv_cq_ex.read_dlid_path_bits = rxe_read_dlid_path_bits;
+
+	return &cq->ibv_cq_ex;
+}
+
 static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 {
 	struct rxe_cq *cq = to_rcq(ibcq);
@@ -200,12 +511,12 @@ static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 	struct urxe_resize_cq_resp resp;
 	int ret;
 
-	pthread_spin_lock(&cq->lock);
+	rxe_spin_lock(&cq->lock);
 
 	ret = ibv_cmd_resize_cq(ibcq, cqe, &cmd, sizeof cmd,
 				&resp.ibv_resp, sizeof resp);
 	if (ret) {
-		pthread_spin_unlock(&cq->lock);
+		rxe_spin_unlock(&cq->lock);
 		return ret;
 	}
 
@@ -216,7 +527,7 @@ static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 			 ibcq->context->cmd_fd, resp.mi.offset);
 
 	ret = errno;
-	pthread_spin_unlock(&cq->lock);
+	rxe_spin_unlock(&cq->lock);
 
 	if ((void *)cq->queue == MAP_FAILED) {
 		cq->queue = NULL;
@@ -238,8 +549,11 @@ static int rxe_destroy_cq(struct ibv_cq *ibcq)
 	if (ret)
 		return ret;
 
+	rxe_cq_disarm(cq);
 	if (cq->mmap_info.size)
 		munmap(cq->queue, cq->mmap_info.size);
+	rxe_spinlock_destroy(&cq->lock);
+	rxe_put_parent_domain(cq->parent_domain);
 	free(cq);
 
 	return 0;
@@ -252,7 +566,9 @@ static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 	int npolled;
 	uint8_t *src;
 
-	pthread_spin_lock(&cq->lock);
+	rxe_flush_db(to_rctx(ibcq->context));
+
+	rxe_spin_lock(&cq->lock);
 	q = cq->queue;
 
 	for (npolled = 0; npolled < ne; ++npolled, ++wc) {
@@ -265,7 +581,7 @@ static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 		advance_consumer(q);
 	}
 
-	pthread_spin_unlock(&cq->lock);
+	rxe_spin_unlock(&cq->lock);
 	return npolled;
 }
 
@@ -300,7 +616,8 @@ static struct ibv_srq *rxe_create_srq(struct ibv_pd *pd,
 
 	srq->mmap_info = resp.mi;
 	srq->rq.max_sge = attr->attr.max_sge;
-	pthread_spin_init(&srq->rq.lock, PTHREAD_PROCESS_PRIVATE);
+	rxe_spinlock_init_pd(&srq->rq.lock, pd);
+	rxe_get_parent_domain(pd);
 
 	return &srq->ibv_srq;
 }
@@ -317,7 +634,7 @@ static int rxe_modify_srq(struct ibv_srq *ibsrq,
 	mi.size = 0;
 
 	if (attr_mask & IBV_SRQ_MAX_WR)
-		pthread_spin_lock(&srq->rq.lock);
+		rxe_spin_lock(&srq->rq.lock);
 
 	cmd.mmap_info_addr = (__u64)(uintptr_t) & mi;
 	rc = ibv_cmd_modify_srq(ibsrq, attr, attr_mask,
@@ -343,7 +660,7 @@ static int rxe_modify_srq(struct ibv_srq *ibsrq,
 
 out:
 	if (attr_mask & IBV_SRQ_MAX_WR)
-		pthread_spin_unlock(&srq->rq.lock);
+		rxe_spin_unlock(&srq->rq.lock);
 	return rc;
 }
 
@@ -364,6 +681,8 @@ static int rxe_destroy_srq(struct ibv_srq *ibvsrq)
 	if (!ret) {
 		if (srq->mmap_info.size)
 			munmap(q, srq->mmap_info.size);
+		rxe_spinlock_destroy(&srq->rq.lock);
+		rxe_put_parent_domain(ibvsrq->pd);
 		free(srq);
 	}
 
@@ -419,7 +738,7 @@ static int rxe_post_srq_recv(struct ibv_srq *ibvsrq,
 	struct rxe_srq *srq = to_rsrq(ibvsrq);
 	int rc = 0;
 
-	pthread_spin_lock(&srq->rq.lock);
+	rxe_spin_lock(&srq->rq.lock);
 
 	while (recv_wr) {
 		rc = rxe_post_one_recv(&srq->rq, recv_wr);
@@ -431,11 +750,51 @@ static int rxe_post_srq_recv(struct ibv_srq *ibvsrq,
 		recv_wr = recv_wr->next;
 	}
 
-	pthread_spin_unlock(&srq->rq.lock);
+	rxe_spin_unlock(&srq->rq.lock);
 
 	return rc;
 }
 
+static int map_queue_pair(int cmd_fd, struct rxe_qp *qp,
+			  struct ibv_pd *pd, struct ibv_qp_init_attr *attr,
+			  struct rxe_create_qp_resp *resp)
+{
+	if (attr->srq) {
+		qp->rq.max_sge = 0;
+		qp->rq.queue = NULL;
+		qp->rq_mmap_info.size = 0;
+	} else {
+		qp->rq.max_sge = attr->cap.max_recv_sge;
+		qp->rq.queue = mmap(NULL, resp->rq_mi.size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, cmd_fd, resp->rq_mi.offset);
+		if ((void *)qp->rq.queue == MAP_FAILED)
+			return errno;
+
+		qp->rq_mmap_info = resp->rq_mi;
+		rxe_spinlock_init_pd(&qp->rq.lock, pd);
+	}
+
+	qp->sq.max_sge = attr->cap.max_send_sge;
+	qp->sq.max_inline = attr->cap.max_inline_data;
+	qp->sq.queue = mmap(NULL, resp->sq_mi.size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, cmd_fd, resp->sq_mi.offset);
+	if ((void *)qp->sq.queue == MAP_FAILED) {
+		int ret = errno;
+
+		if (qp->rq_mmap_info.size) {
+			munmap(qp->rq.queue, qp->rq_mmap_info.size);
+			rxe_spinlock_destroy(&qp->rq.lock);
+		}
+		return ret;
+	}
+
+	qp->sq_mmap_info = resp->sq_mi;
+	rxe_spinlock_init_pd(&qp->sq.lock, pd);
+	rxe_get_parent_domain(pd);
+
+	return 0;
+}
+
 static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
 				    struct ibv_qp_init_attr *attr)
 {
@@ -444,7 +803,7 @@ static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
 	struct rxe_qp *qp;
 	int ret;
 
-	qp = malloc(sizeof *qp);
+	qp = calloc(1, sizeof *qp);
 	if (!qp) {
 		return NULL;
 	}
@@ -456,41 +815,15 @@ static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
 		return NULL;
 	}
 
-	if (attr->srq) {
-		qp->rq.max_sge = 0;
-		qp->rq.queue = NULL;
-		qp->rq_mmap_info.size = 0;
-	} else {
-		qp->rq.max_sge = attr->cap.max_recv_sge;
-		qp->rq.queue = mmap(NULL, resp.rq_mi.size, PROT_READ | PROT_WRITE,
-				    MAP_SHARED,
-				    pd->context->cmd_fd, resp.rq_mi.offset);
-		if ((void *)qp->rq.queue == MAP_FAILED) {
-			ibv_cmd_destroy_qp(&qp->ibv_qp);
-			free(qp);
-			return NULL;
-		}
-
-		qp->rq_mmap_info = resp.rq_mi;
-		pthread_spin_init(&qp->rq.lock, PTHREAD_PROCESS_PRIVATE);
-	}
-
-	qp->sq.max_sge = attr->cap.max_send_sge;
-	qp->sq.max_inline = attr->cap.max_inline_data;
-	qp->sq.queue = mmap(NULL, resp.sq_mi.size, PROT_READ | PROT_WRITE,
-			    MAP_SHARED,
-			    pd->context->cmd_fd, resp.sq_mi.offset);
-	if ((void *)qp->sq.queue == MAP_FAILED) {
-		if (qp->rq_mmap_info.size)
-			munmap(qp->rq.queue, qp->rq_mmap_info.size);
+	ret = map_queue_pair(pd->context->cmd_fd, qp, pd, attr,
+			     &resp.drv_payload);
+	if (ret) {
 		ibv_cmd_destroy_qp(&qp->ibv_qp);
 		free(qp);
+		errno = ret;
 		return NULL;
 	}
 
-	qp->sq_mmap_info = resp.sq_mi;
-	pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE);
-
 	return &qp->ibv_qp;
 }
 
@@ -517,13 +850,22 @@ static int rxe_destroy_qp(struct ibv_qp *ibv_qp)
 {
 	int ret;
 	struct rxe_qp *qp = to_rqp(ibv_qp);
+	struct rxe_context *ctx = to_rctx(ibv_qp->context);
 
 	ret = ibv_cmd_destroy_qp(ibv_qp);
 	if (!ret) {
+		pthread_mutex_lock(&ctx->db_lock);
+		if (qp->db_listed)
+			list_del(&qp->db_entry);
+		pthread_mutex_unlock(&ctx->db_lock);
 		if (qp->rq_mmap_info.size)
 			munmap(qp->rq.queue, qp->rq_mmap_info.size);
 		if (qp->sq_mmap_info.size)
 			munmap(qp->sq.queue, qp->sq_mmap_info.size);
+		if (qp->rq.queue)
+			rxe_spinlock_destroy(&qp->rq.lock);
+		rxe_spinlock_destroy(&qp->sq.lock);
+		rxe_put_parent_domain(ibv_qp->pd);
 
 		free(qp);
 	}
@@ -531,26 +873,36 @@ static int rxe_destroy_qp(struct ibv_qp *ibv_qp)
 	return ret;
 }
 
-/* basic sanity checks for send work request */
-static int validate_send_wr(struct rxe_wq *sq, struct ibv_send_wr *ibwr,
-			    unsigned int length)
+/*
+ * basic sanity checks for a send work request, shared by ibv_post_send and
+ * the ibv_wr_* API
+ */
+static int validate_send(struct rxe_wq *sq, unsigned int opcode,
+			 unsigned int send_flags, unsigned int num_sge,
+			 unsigned int length, uint64_t remote_addr)
 {
-	enum ibv_wr_opcode opcode = ibwr->opcode;
-
-	if (ibwr->num_sge > sq->max_sge)
+	if (num_sge > sq->max_sge)
 		return -EINVAL;
 
 	if ((opcode == IBV_WR_ATOMIC_CMP_AND_SWP)
 	    || (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD))
-		if (length < 8 || ibwr->wr.atomic.remote_addr & 0x7)
+		if (length < 8 || remote_addr & 0x7)
 			return -EINVAL;
 
-	if ((ibwr->send_flags & IBV_SEND_INLINE) && (length > sq->max_inline))
+	if ((send_flags & IBV_SEND_INLINE) && (length > sq->max_inline))
 		return -EINVAL;
 
 	return 0;
 }
 
+static int validate_send_wr(struct rxe_wq *sq, struct ibv_send_wr *ibwr,
+			    unsigned int length)
+{
+	return validate_send(sq, ibwr->opcode, ibwr->send_flags,
+			     ibwr->num_sge, length,
+			     ibwr->wr.atomic.remote_addr);
+}
+
 static void convert_send_wr(struct rxe_send_wr *kwr, struct ibv_send_wr *uwr)
 {
 	memset(kwr, 0, sizeof(*kwr));
@@ -687,6 +1039,130 @@ static int post_send_db(struct ibv_qp *ibqp)
 	return 0;
 }
 
+/*
+ * True while the kernel has not yet consumed the producer index it was last
+ * told about, i.e. the WQE published just before index prev is still queued
+ * and the requester has not started on it. The requester walks the send
+ * queue up to the producer index, so it will also pick up the WQEs published
+ * after prev. Must be called after the new producer index is stored.
+ */
+static bool sq_kernel_behind(struct rxe_qp *qp, uint32_t prev)
+{
+	struct rxe_queue *q = qp->sq.queue;
+	struct rxe_send_wqe *wqe;
+
+	if (prev == atomic_load(&q->consumer_index))
+		return false;
+
+	/* Order the producer index update before reading the state */
+	atomic_thread_fence(memory_order_seq_cst);
+	wqe = addr_from_index(q, (prev - 1) & q->index_mask);
+	return atomic_load_explicit((_Atomic(uint32_t) *)&wqe->state,
+				    memory_order_relaxed) ==
+	       RXE_WQE_STATE_POSTED;
+}
+
+/*
+ * Decide whether num WQEs just published after index prev need a doorbell.
+ * Must be called with the SQ lock held.
+ *
+ * No doorbell is needed while the kernel is still behind the previous one.
+ * Otherwise, if the context defers doorbells, up to db_batch WQEs are held
+ * back. They are flushed by the next post that reaches the batch size, or by
+ * the next CQ poll or CQ notification request on the context. While any CQ of
+ * the context waits for a notification the application may block on it, so
+ * nothing is held back.
+ */
+static bool sq_need_db(struct rxe_qp *qp, uint32_t prev, unsigned int num)
+{
+	struct rxe_context *ctx = to_rctx(qp->ibv_qp.context);
+	struct rxe_wq *sq = &qp->sq;
+	bool ring;
+
+	if (!num)
+		return false;
+
+	if (!ctx->db_batch)
+		return !sq_kernel_behind(qp, prev);
+
+	pthread_mutex_lock(&ctx->db_lock);
+	/* A held back WQE was never announced, the kernel may not run at all */
+	if (!sq->db_pending && sq_kernel_behind(qp, prev)) {
+		ring = false;
+		goto out;
+	}
+
+	ring = atomic_load(&ctx->armed_cqs) ||
+	       sq->db_pending + num >= ctx->db_batch;
+	if (ring) {
+		sq->db_pending = 0;
+		if (qp->db_listed) {
+			list_del(&qp->db_entry);
+			qp->db_listed = false;
+		}
+	} else {
+		sq->db_pending += num;
+		if (!qp->db_listed) {
+			list_add_tail(&ctx->db_list, &qp->db_entry);
+			qp->db_listed = true;
+		}
+	}
+out:
+	pthread_mutex_unlock(&ctx->db_lock);
+
+	return ring;
+}
+
+/*
+ * Ring the doorbells held back by the QPs of the context. The list is walked
+ * under db_lock so rxe_destroy_qp() cannot free a QP under us.
+ */
+static void rxe_flush_db(struct rxe_context *ctx)
+{
+	struct rxe_qp *qp;
+
+	if (!ctx->db_batch)
+		return;
+
+	pthread_mutex_lock(&ctx->db_lock);
+	while ((qp = list_pop(&ctx->db_list, struct rxe_qp, db_entry))) {
+		qp->db_listed = false;
+		qp->sq.db_pending = 0;
+		post_send_db(&qp->ibv_qp);
+	}
+	pthread_mutex_unlock(&ctx->db_lock);
+}
+
+static void rxe_cq_disarm(struct rxe_cq *cq)
+{
+	struct rxe_context *ctx = to_rctx(cq->ibv_cq.context);
+
+	if (atomic_exchange(&cq->armed, false))
+		atomic_fetch_sub(&ctx->armed_cqs, 1);
+}
+
+static int rxe_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	struct rxe_context *ctx = to_rctx(ibcq->context);
+	struct rxe_cq *cq = to_rcq(ibcq);
+
+	/*
+	 * Stop deferring before the flush so a post racing with it either
+	 * gets flushed here or rings itself. The completions waited for may
+	 * depend on held back doorbells.
+	 */
+	if (ctx->db_batch && !atomic_exchange(&cq->armed, true))
+		atomic_fetch_add(&ctx->armed_cqs, 1);
+	rxe_flush_db(ctx);
+
+	return ibv_cmd_req_notify_cq(ibcq, solicited_only);
+}
+
+static void rxe_cq_event(struct ibv_cq *ibcq)
+{
+	rxe_cq_disarm(to_rcq(ibcq));
+}
+
 /* this API does not make a distinction between
    restartable and non-restartable errors */
 static int rxe_post_send(struct ibv_qp *ibqp,
@@ -697,6 +1173,9 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	int err;
 	struct rxe_qp *qp = to_rqp(ibqp);
 	struct rxe_wq *sq = &qp->sq;
+	unsigned int num = 0;
+	uint32_t prev;
+	bool ring;
 
 	if (!bad_wr)
 		return EINVAL;
@@ -706,8 +1185,10 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	if (!sq || !wr_list || !sq->queue)
 	 	return EINVAL;
 
-	pthread_spin_lock(&sq->lock);
+	rxe_spin_lock(&sq->lock);
 
+	prev = atomic_load_explicit(&sq->queue->producer_index,
+				    memory_order_relaxed);
 	while (wr_list) {
 		rc = post_one_send(qp, sq, wr_list);
 		if (rc) {
@@ -715,15 +1196,446 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 			break;
 		}
 
+		num++;
 		wr_list = wr_list->next;
 	}
 
-	pthread_spin_unlock(&sq->lock);
+	ring = sq_need_db(qp, prev, num);
+
+	rxe_spin_unlock(&sq->lock);
 
-	err =  post_send_db(ibqp);
+	err = ring ? post_send_db(ibqp) : 0;
 	return err ? err : rc;
 }
 
+/*
+ * Extended send API. WQEs are built directly in the shared send queue
+ * starting at the producer index; the producer index is only moved, and
+ * the doorbell rung, by wr_complete.
+ */
+static struct rxe_send_wqe *init_wr(struct ibv_qp_ex *ibqp, uint32_t opcode)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+	struct rxe_queue *q = qp->sq.queue;
+	struct rxe_send_wqe *wqe;
+
+	if (qp->err)
+		return NULL;
+
+	if (((qp->cur_index + 1 - atomic_load(&q->consumer_index)) &
+	     q->index_mask) == 0) {
+		qp->err = ENOMEM;
+		return NULL;
+	}
+
+	wqe = addr_from_index(q, qp->cur_index);
+	memset(wqe, 0, offsetof(struct rxe_send_wqe, dma.inline_data));
+
+	wqe->wr.wr_id = ibqp->wr_id;
+	wqe->wr.opcode = opcode;
+	wqe->wr.send_flags = ibqp->wr_flags;
+	wqe->ssn = qp->ssn++;
+
+	qp->cur_index = next_index(q, qp->cur_index);
+
+	return wqe;
+}
+
+/* The WQE the wr_set_* calls apply to, NULL after an error */
+static struct rxe_send_wqe *cur_wr(struct rxe_qp *qp)
+{
+	struct rxe_queue *q = qp->sq.queue;
+
+	if (qp->err)
+		return NULL;
+
+	return addr_from_index(q, (qp->cur_index - 1) & q->index_mask);
+}
+
+static void rxe_wr_atomic_cmp_swp(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				  uint64_t remote_addr, uint64_t compare,
+				  uint64_t swap)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_ATOMIC_CMP_AND_SWP);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.wr.atomic.remote_addr = remote_addr;
+	wqe->wr.wr.atomic.compare_add = compare;
+	wqe->wr.wr.atomic.swap = swap;
+	wqe->wr.wr.atomic.rkey = rkey;
+	wqe->iova = remote_addr;
+}
+
+static void rxe_wr_atomic_fetch_add(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				    uint64_t remote_addr, uint64_t add)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_ATOMIC_FETCH_AND_ADD);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.wr.atomic.remote_addr = remote_addr;
+	wqe->wr.wr.atomic.compare_add = add;
+	wqe->wr.wr.atomic.rkey = rkey;
+	wqe->iova = remote_addr;
+}
+
+static void rxe_wr_local_inv(struct ibv_qp_ex *ibqp, uint32_t invalidate_rkey)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_LOCAL_INV);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.ex.invalidate_rkey = invalidate_rkey;
+}
+
+static void rxe_wr_rdma_read(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_RDMA_READ);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.wr.rdma.remote_addr = remote_addr;
+	wqe->wr.wr.rdma.rkey = rkey;
+	wqe->iova = remote_addr;
+}
+
+static void rxe_wr_rdma_write(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			      uint64_t remote_addr)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_RDMA_WRITE);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.wr.rdma.remote_addr = remote_addr;
+	wqe->wr.wr.rdma.rkey = rkey;
+	wqe->iova = remote_addr;
+}
+
+static void rxe_wr_rdma_write_imm(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				  uint64_t remote_addr, __be32 imm_data)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_RDMA_WRITE_WITH_IMM);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.wr.rdma.remote_addr = remote_addr;
+	wqe->wr.wr.rdma.rkey = rkey;
+	wqe->wr.ex.imm_data = imm_data;
+	wqe->iova = remote_addr;
+}
+
+static void rxe_wr_send(struct ibv_qp_ex *ibqp)
+{
+	init_wr(ibqp, IBV_WR_SEND);
+}
+
+static void rxe_wr_send_imm(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_SEND_WITH_IMM);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.ex.imm_data = imm_data;
+}
+
+static void rxe_wr_send_inv(struct ibv_qp_ex *ibqp, uint32_t invalidate_rkey)
+{
+	struct rxe_send_wqe *wqe = init_wr(ibqp, IBV_WR_SEND_WITH_INV);
+
+	if (!wqe)
+		return;
+
+	wqe->wr.ex.invalidate_rkey = invalidate_rkey;
+}
+
+static void rxe_wr_set_ud_addr(struct ibv_qp_ex *ibqp, struct ibv_ah *ah,
+			       uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct rxe_send_wqe *wqe = cur_wr(to_rqp_ex(ibqp));
+
+	if (!wqe)
+		return;
+
+	memcpy(&wqe->av, &to_rah(ah)->av, sizeof(wqe->av));
+	wqe->wr.wr.ud.remote_qpn = remote_qpn;
+	wqe->wr.wr.ud.remote_qkey = remote_qkey;
+}
+
+static void set_dma_length(struct rxe_send_wqe *wqe, uint32_t num_sge,
+			   uint32_t length)
+{
+	wqe->wr.num_sge = num_sge;
+	wqe->dma.length = length;
+	wqe->dma.resid = length;
+	wqe->dma.num_sge = num_sge;
+	wqe->dma.cur_sge = 0;
+	wqe->dma.sge_offset = 0;
+}
+
+static void rxe_wr_set_inline_data(struct ibv_qp_ex *ibqp, void *addr,
+				   size_t length)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+	struct rxe_send_wqe *wqe = cur_wr(qp);
+
+	if (!wqe)
+		return;
+
+	if (length > qp->sq.max_inline) {
+		qp->err = EINVAL;
+		return;
+	}
+
+	memcpy(wqe->dma.inline_data, addr, length);
+	wqe->wr.send_flags |= IBV_SEND_INLINE;
+	set_dma_length(wqe, 1, length);
+}
+
+static void rxe_wr_set_inline_data_list(struct ibv_qp_ex *ibqp, size_t num_buf,
+					const struct ibv_data_buf *buf_list)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+	struct rxe_send_wqe *wqe = cur_wr(qp);
+	uint8_t *data;
+	size_t length = 0;
+	size_t i;
+
+	if (!wqe)
+		return;
+
+	for (i = 0; i < num_buf; i++)
+		length += buf_list[i].length;
+
+	if (length > qp->sq.max_inline) {
+		qp->err = EINVAL;
+		return;
+	}
+
+	data = wqe->dma.inline_data;
+	for (i = 0; i < num_buf; i++) {
+		memcpy(data, buf_list[i].addr, buf_list[i].length);
+		data += buf_list[i].length;
+	}
+
+	wqe->wr.send_flags |= IBV_SEND_INLINE;
+	set_dma_length(wqe, num_buf, length);
+}
+
+static void rxe_wr_set_sge(struct ibv_qp_ex *ibqp, uint32_t lkey,
+			   uint64_t addr, uint32_t length)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+	struct rxe_send_wqe *wqe = cur_wr(qp);
+
+	if (!wqe)
+		return;
+
+	if (!length) {
+		set_dma_length(wqe, 0, 0);
+		return;
+	}
+
+	wqe->dma.sge[0].addr = addr;
+	wqe->dma.sge[0].length = length;
+	wqe->dma.sge[0].lkey = lkey;
+	set_dma_length(wqe, 1, length);
+}
+
+static void rxe_wr_set_sge_list(struct ibv_qp_ex *ibqp, size_t num_sge,
+				const struct ibv_sge *sg_list)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+	struct rxe_send_wqe *wqe = cur_wr(qp);
+	uint32_t length = 0;
+	size_t i;
+
+	if (!wqe)
+		return;
+
+	if (num_sge > qp->sq.max_sge) {
+		qp->err = EINVAL;
+		return;
+	}
+
+	for (i = 0; i < num_sge; i++)
+		length += sg_list[i].length;
+
+	memcpy(wqe->dma.sge, sg_list, num_sge * sizeof(*sg_list));
+	set_dma_length(wqe, num_sge, length);
+}
+
+static void rxe_wr_start(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+
+	rxe_spin_lock(&qp->sq.lock);
+
+	qp->err = 0;
+	qp->start_ssn = qp->ssn;
+	qp->cur_index = atomic_load_explicit(&qp->sq.queue->producer_index,
+					     memory_order_relaxed);
+}
+
+/*
+ * Apply the checks ibv_post_send does to every WQE built since wr_start, the
+ * setters only reject what would overflow the WQE.
+ */
+static int validate_wr_list(struct rxe_qp *qp, uint32_t index)
+{
+	struct rxe_queue *q = qp->sq.queue;
+	struct rxe_send_wqe *wqe;
+
+	for (; index != qp->cur_index; index = next_index(q, index)) {
+		wqe = addr_from_index(q, index);
+
+		if (!(qp->send_ops_flags & (1ULL << wqe->wr.opcode)))
+			return EINVAL;
+
+		if (validate_send(&qp->sq, wqe->wr.opcode,
+				  wqe->wr.send_flags, wqe->dma.num_sge,
+				  wqe->dma.length, wqe->iova))
+			return EINVAL;
+	}
+
+	return 0;
+}
+
+static int rxe_wr_complete(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+	int err = qp->err;
+	uint32_t prev;
+	bool ring;
+
+	prev = atomic_load_explicit(&qp->sq.queue->producer_index,
+				    memory_order_relaxed);
+	if (!err)
+		err = validate_wr_list(qp, prev);
+
+	if (err) {
+		/* Nothing was published, the WQEs are simply dropped */
+		qp->ssn = qp->start_ssn;
+		rxe_spin_unlock(&qp->sq.lock);
+		return err;
+	}
+
+	atomic_thread_fence(memory_order_release);
+	atomic_store(&qp->sq.queue->producer_index, qp->cur_index);
+
+	ring = sq_need_db(qp, prev,
+			  (qp->cur_index - prev) & qp->sq.queue->index_mask);
+
+	rxe_spin_unlock(&qp->sq.lock);
+
+	return ring ? post_send_db(&qp->ibv_qp) : 0;
+}
+
+static void rxe_wr_abort(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = to_rqp_ex(ibqp);
+
+	qp->ssn = qp->start_ssn;
+	rxe_spin_unlock(&qp->sq.lock);
+}
+
+enum {
+	RXE_QP_EX_SUP_SEND_OPS = IBV_QP_EX_WITH_RDMA_WRITE |
+				 IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+				 IBV_QP_EX_WITH_SEND |
+				 IBV_QP_EX_WITH_SEND_WITH_IMM |
+				 IBV_QP_EX_WITH_RDMA_READ |
+				 IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+				 IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD |
+				 IBV_QP_EX_WITH_LOCAL_INV |
+				 IBV_QP_EX_WITH_SEND_WITH_INV,
+};
+
+static void set_qp_send_ops(struct rxe_qp *qp)
+{
+	struct ibv_qp_ex *qpx = &qp->vqp.qp_ex;
+
+	qpx->wr_atomic_cmp_swp = rxe_wr_atomic_cmp_swp;
+	qpx->wr_atomic_fetch_add = rxe_wr_atomic_fetch_add;
+	qpx->wr_local_inv = rxe_wr_local_inv;
+	qpx->wr_rdma_read = rxe_wr_rdma_read;
+	qpx->wr_rdma_write = rxe_wr_rdma_write;
+	qpx->wr_rdma_write_imm = rxe_wr_rdma_write_imm;
+	qpx->wr_send = rxe_wr_send;
+	qpx->wr_send_imm = rxe_wr_send_imm;
+	qpx->wr_send_inv = rxe_wr_send_inv;
+	qpx->wr_set_ud_addr = rxe_wr_set_ud_addr;
+	qpx->wr_set_inline_data = rxe_wr_set_inline_data;
+	qpx->wr_set_inline_data_list = rxe_wr_set_inline_data_list;
+	qpx->wr_set_sge = rxe_wr_set_sge;
+	qpx->wr_set_sge_list = rxe_wr_set_sge_list;
+	qpx->wr_start = rxe_wr_start;
+	qpx->wr_complete = rxe_wr_complete;
+	qpx->wr_abort = rxe_wr_abort;
+}
+
+static struct ibv_qp *rxe_create_qp_ex(struct ibv_context *context,
+				       struct ibv_qp_init_attr_ex *attr)
+{
+	struct ibv_create_qp cmd;
+	struct urxe_create_qp_resp resp;
+	struct rxe_qp *qp;
+	int ret;
+
+	if (!check_comp_mask(attr->comp_mask,
+			     IBV_QP_INIT_ATTR_PD |
+			     IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) ||
+	    !(attr->comp_mask & IBV_QP_INIT_ATTR_PD)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	if ((attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) &&
+	    (attr->send_ops_flags & ~RXE_QP_EX_SUP_SEND_OPS)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	ret = ibv_cmd_create_qp_ex(context, &qp->vqp, sizeof(qp->vqp), attr,
+				   &cmd, sizeof(cmd), &resp.ibv_resp,
+				   sizeof(resp));
+	if (ret) {
+		free(qp);
+		errno = ret;
+		return NULL;
+	}
+
+	ret = map_queue_pair(context->cmd_fd, qp, attr->pd,
+			     (struct ibv_qp_init_attr *)attr,
+			     &resp.drv_payload);
+	if (ret) {
+		ibv_cmd_destroy_qp(&qp->ibv_qp);
+		free(qp);
+		errno = ret;
+		return NULL;
+	}
+
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		qp->send_ops_flags = attr->send_ops_flags;
+		set_qp_send_ops(qp);
+		qp->vqp.comp_mask |= VERBS_QP_EX;
+	}
+
+	return &qp->ibv_qp;
+}
+
 static int rxe_post_recv(struct ibv_qp *ibqp,
 			 struct ibv_recv_wr *recv_wr,
 			 struct ibv_recv_wr **bad_wr)
@@ -740,7 +1652,7 @@ static int rxe_post_recv(struct ibv_qp *ibqp,
 	if (!rq || !recv_wr || !rq->queue)
 		return EINVAL;
 
-	pthread_spin_lock(&rq->lock);
+	rxe_spin_lock(&rq->lock);
 
 	while (recv_wr) {
 		rc = rxe_post_one_recv(rq, recv_wr);
@@ -752,7 +1664,7 @@ static int rxe_post_recv(struct ibv_qp *ibqp,
 		recv_wr = recv_wr->next;
 	}
 
-	pthread_spin_unlock(&rq->lock);
+	rxe_spin_unlock(&rq->lock);
 
 	return rc;
 }
@@ -837,11 +1749,16 @@ static const struct verbs_context_ops rxe_ctx_ops = {
 	.query_port = rxe_query_port,
 	.alloc_pd = rxe_alloc_pd,
 	.dealloc_pd = rxe_dealloc_pd,
+	.alloc_td = rxe_alloc_td,
+	.dealloc_td = rxe_dealloc_td,
+	.alloc_parent_domain = rxe_alloc_parent_domain,
 	.reg_mr = rxe_reg_mr,
 	.dereg_mr = rxe_dereg_mr,
 	.create_cq = rxe_create_cq,
+	.create_cq_ex = rxe_create_cq_ex,
 	.poll_cq = rxe_poll_cq,
-	.req_notify_cq = ibv_cmd_req_notify_cq,
+	.req_notify_cq = rxe_req_notify_cq,
+	.cq_event = rxe_cq_event,
 	.resize_cq = rxe_resize_cq,
 	.destroy_cq = rxe_destroy_cq,
 	.create_srq = rxe_create_srq,
@@ -850,6 +1767,7 @@ static const struct verbs_context_ops rxe_ctx_ops = {
 	.destroy_srq = rxe_destroy_srq,
 	.post_srq_recv = rxe_post_srq_recv,
 	.create_qp = rxe_create_qp,
+	.create_qp_ex = rxe_create_qp_ex,
 	.query_qp = rxe_query_qp,
 	.modify_qp = rxe_modify_qp,
 	.destroy_qp = rxe_destroy_qp,
@@ -869,6 +1787,7 @@ static struct verbs_context *rxe_alloc_context(struct ibv_device *ibdev,
 	struct rxe_context *context;
 	struct ibv_get_context cmd;
 	struct ib_uverbs_get_context_resp resp;
+	char *env;
 
 	context = verbs_init_and_alloc_context(ibdev, cmd_fd, context, ibv_ctx,
 					       RDMA_DRIVER_RXE);
@@ -879,6 +1798,21 @@ static struct verbs_context *rxe_alloc_context(struct ibv_device *ibdev,
 				sizeof cmd, &resp, sizeof resp))
 		goto out;
 
+	env = getenv("RXE_DB_BATCH");
+	if (env) {
+		unsigned long batch;
+		char *end;
+
+		errno = 0;
+		batch = strtoul(env, &end, 10);
+		/* Invalid values keep the default of not deferring */
+		if (!errno && end != env && !*end && batch > 1)
+			context->db_batch = min_t(unsigned long, batch,
+						  RXE_MAX_DB_BATCH);
+	}
+	pthread_mutex_init(&context->db_lock, NULL);
+	list_head_init(&context->db_list);
+
 	verbs_set_ops(&context->ibv_ctx, &rxe_ctx_ops);
 
 	return &context->ibv_ctx;
@@ -893,6 +1827,7 @@ static void rxe_free_context(struct ibv_context *ibctx)
 {
 	struct rxe_context *context = to_rctx(ibctx);
 
+	pthread_mutex_destroy(&context->db_lock);
 	verbs_uninit_context(&context->ibv_ctx);
 	free(context);
 }
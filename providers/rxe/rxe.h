@@ -39,6 +39,10 @@
 #include <infiniband/driver.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <ccan/list.h>
 #include <rdma/rdma_user_rxe.h> /* struct rxe_av */
 #include "rxe-abi.h"
 
@@ -53,15 +57,64 @@ struct rxe_device {
 	int	abi_version;
 };
 
+/* Upper bound for RXE_DB_BATCH */
+#define RXE_MAX_DB_BATCH	256
+
+/*
+ * rxe_send_wqe.state until the kernel requester starts on the WQE, this is
+ * the zero value the library writes when posting it.
+ */
+#define RXE_WQE_STATE_POSTED	0
+
 struct rxe_context {
 	struct verbs_context	ibv_ctx;
+	/* Number of send WQEs that may wait for a doorbell, 0 to not defer */
+	unsigned int		db_batch;
+	/* QPs holding back a doorbell, protects their db_* fields */
+	pthread_mutex_t		db_lock;
+	struct list_head	db_list;
+	/* CQs with a notification requested and not yet delivered */
+	atomic_uint		armed_cqs;
+};
+
+/*
+ * Objects created on a parent domain with a thread domain are only used by
+ * one thread at a time, their queue locks are elided.
+ */
+struct rxe_spinlock {
+	pthread_spinlock_t	lock;
+	int			need_lock;
+};
+
+struct rxe_td {
+	struct ibv_td		ibv_td;
+	atomic_int		refcount;
+};
+
+struct rxe_pd {
+	struct ibv_pd		ibv_pd;
+	atomic_int		refcount;
+	struct rxe_pd		*protection_domain;
+};
+
+struct rxe_parent_domain {
+	struct rxe_pd		rpd;
+	struct rxe_td		*rtd;
 };
 
 struct rxe_cq {
-	struct ibv_cq		ibv_cq;
+	union {
+		struct ibv_cq		ibv_cq;
+		struct ibv_cq_ex	ibv_cq_ex;
+	};
 	struct mminfo		mmap_info;
 	struct rxe_queue		*queue;
-	pthread_spinlock_t	lock;
+	struct rxe_spinlock	lock;
+	/* CQE being read by the extended poll API, NULL if none */
+	struct ib_uverbs_wc	*wc;
+	struct ibv_pd		*parent_domain;
+	/* Counted in rxe_context.armed_cqs */
+	atomic_bool		armed;
 };
 
 struct rxe_ah {
@@ -71,18 +124,31 @@ struct rxe_ah {
 
 struct rxe_wq {
 	struct rxe_queue	*queue;
-	pthread_spinlock_t	lock;
+	struct rxe_spinlock	lock;
 	unsigned int		max_sge;
 	unsigned int		max_inline;
+	/* WQEs published to the kernel without a doorbell */
+	unsigned int		db_pending;
 };
 
 struct rxe_qp {
-	struct ibv_qp		ibv_qp;
+	union {
+		struct ibv_qp		ibv_qp;
+		struct verbs_qp		vqp;
+	};
 	struct mminfo		rq_mmap_info;
 	struct rxe_wq		rq;
 	struct mminfo		sq_mmap_info;
 	struct rxe_wq		sq;
 	unsigned int		ssn;
+	struct list_node	db_entry;
+	bool			db_listed;
+
+	/* ibv_wr_* state between ibv_wr_start and ibv_wr_complete */
+	uint32_t		cur_index;
+	unsigned int		start_ssn;
+	int			err;
+	uint64_t		send_ops_flags;
 };
 
 #define qp_type(qp)		((qp)->ibv_qp.qp_type)
@@ -106,16 +172,55 @@ static inline struct rxe_device *to_rdev(struct ibv_device *ibdev)
 	return container_of(ibdev, struct rxe_device, ibv_dev.device);
 }
 
+static inline struct rxe_td *to_rtd(struct ibv_td *ibtd)
+{
+	return to_rxxx(td, td);
+}
+
+/* to_rpd always returns the real rxe_pd object ie the protection domain. */
+static inline struct rxe_pd *to_rpd(struct ibv_pd *ibpd)
+{
+	struct rxe_pd *rpd = to_rxxx(pd, pd);
+
+	if (rpd->protection_domain)
+		return rpd->protection_domain;
+
+	return rpd;
+}
+
+static inline struct rxe_parent_domain *to_rparent_domain(struct ibv_pd *ibpd)
+{
+	struct rxe_parent_domain *rparent_domain =
+		ibpd ? container_of(ibpd, struct rxe_parent_domain, rpd.ibv_pd) :
+		       NULL;
+
+	if (rparent_domain && rparent_domain->rpd.protection_domain)
+		return rparent_domain;
+
+	/* Otherwise ibpd isn't a parent_domain */
+	return NULL;
+}
+
 static inline struct rxe_cq *to_rcq(struct ibv_cq *ibcq)
 {
 	return to_rxxx(cq, cq);
 }
 
+static inline struct rxe_cq *to_rcq_ex(struct ibv_cq_ex *ibcq)
+{
+	return container_of(ibcq, struct rxe_cq, ibv_cq_ex);
+}
+
 static inline struct rxe_qp *to_rqp(struct ibv_qp *ibqp)
 {
 	return to_rxxx(qp, qp);
 }
 
+static inline struct rxe_qp *to_rqp_ex(struct ibv_qp_ex *ibqp)
+{
+	return container_of(ibqp, struct rxe_qp, vqp.qp_ex);
+}
+
 static inline struct rxe_srq *to_rsrq(struct ibv_srq *ibsrq)
 {
 	return to_rxxx(srq, srq);
@@ -126,4 +231,40 @@ static inline struct rxe_ah *to_rah(struct ibv_ah *ibah)
 	return to_rxxx(ah, ah);
 }
 
+static inline int rxe_spin_lock(struct rxe_spinlock *lock)
+{
+	if (lock->need_lock)
+		return pthread_spin_lock(&lock->lock);
+
+	return 0;
+}
+
+static inline int rxe_spin_unlock(struct rxe_spinlock *lock)
+{
+	if (lock->need_lock)
+		return pthread_spin_unlock(&lock->lock);
+
+	return 0;
+}
+
+static inline int rxe_spinlock_init(struct rxe_spinlock *lock, int need_lock)
+{
+	lock->need_lock = need_lock;
+	return pthread_spin_init(&lock->lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static inline int rxe_spinlock_init_pd(struct rxe_spinlock *lock,
+				       struct ibv_pd *pd)
+{
+	struct rxe_parent_domain *rparent_domain = to_rparent_domain(pd);
+
+	return rxe_spinlock_init(lock,
+				 !(rparent_domain && rparent_domain->rtd));
+}
+
+static inline int rxe_spinlock_destroy(struct rxe_spinlock *lock)
+{
+	return pthread_spin_destroy(&lock->lock);
+}
+
 #endif /* RXE_H */
@@ -13,6 +13,7 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <assert.h>
+#include <ccan/minmax.h>
 
 #include "siw_abi.h"
 #include "siw.h"
@@ -69,7 +70,7 @@ static struct ibv_pd *siw_alloc_pd(struct ibv_context *ctx)
 {
 	struct ibv_alloc_pd cmd;
 	struct ib_uverbs_alloc_pd_resp resp;
-	struct ibv_pd *pd;
+	struct siw_pd *pd;
 
 	memset(&cmd, 0, sizeof(cmd));
 
@@ -77,18 +78,43 @@ static struct ibv_pd *siw_alloc_pd(struct ibv_context *ctx)
 	if (!pd)
 		return NULL;
 
-	if (ibv_cmd_alloc_pd(ctx, pd, &cmd, sizeof(cmd), &resp, sizeof(resp))) {
+	if (ibv_cmd_alloc_pd(ctx, &pd->base_pd, &cmd, sizeof(cmd), &resp,
+			     sizeof(resp))) {
 		free(pd);
 		return NULL;
 	}
-	return pd;
+	atomic_init(&pd->refcount, 1);
+
+	return &pd->base_pd;
+}
+
+static int siw_free_parent_domain(struct siw_parent_domain *parent_domain)
+{
+	if (atomic_load(&parent_domain->pd.refcount) > 1)
+		return EBUSY;
+
+	atomic_fetch_sub(&parent_domain->pd.protection_domain->refcount, 1);
+	if (parent_domain->td)
+		atomic_fetch_sub(&parent_domain->td->refcount, 1);
+
+	free(parent_domain);
+	return 0;
 }
 
-static int siw_free_pd(struct ibv_pd *pd)
+static int siw_free_pd(struct ibv_pd *base_pd)
 {
+	struct siw_parent_domain *parent_domain =
+		parent_domain_base2siw(base_pd);
+	struct siw_pd *pd = pd_base2siw(base_pd);
 	int rv;
 
-	rv = ibv_cmd_dealloc_pd(pd);
+	if (parent_domain)
+		return siw_free_parent_domain(parent_domain);
+
+	if (atomic_load(&pd->refcount) > 1)
+		return EBUSY;
+
+	rv = ibv_cmd_dealloc_pd(base_pd);
 	if (rv)
 		return rv;
 
@@ -96,6 +122,86 @@ static int siw_free_pd(struct ibv_pd *pd)
 	return 0;
 }
 
+static struct ibv_td *siw_alloc_td(struct ibv_context *ctx,
+				   struct ibv_td_init_attr *attr)
+{
+	struct siw_td *td;
+
+	if (attr->comp_mask) {
+		errno = EINVAL;
+		return NULL;
+	}
+	td = calloc(1, sizeof(*td));
+	if (!td) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	td->base_td.context = ctx;
+	atomic_init(&td->refcount, 1);
+
+	return &td->base_td;
+}
+
+static int siw_dealloc_td(struct ibv_td *base_td)
+{
+	struct siw_td *td = td_base2siw(base_td);
+
+	if (atomic_load(&td->refcount) > 1)
+		return EBUSY;
+
+	free(td);
+	return 0;
+}
+
+static struct ibv_pd *
+siw_alloc_parent_domain(struct ibv_context *ctx,
+			struct ibv_parent_domain_init_attr *attr)
+{
+	struct siw_parent_domain *parent_domain;
+
+	if (ibv_check_alloc_parent_domain(attr))
+		return NULL;
+
+	/* Queues are allocated by the kernel, custom allocators do not apply */
+	if (attr->comp_mask) {
+		errno = EINVAL;
+		return NULL;
+	}
+	parent_domain = calloc(1, sizeof(*parent_domain));
+	if (!parent_domain) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (attr->td) {
+		parent_domain->td = td_base2siw(attr->td);
+		atomic_fetch_add(&parent_domain->td->refcount, 1);
+	}
+	parent_domain->pd.protection_domain = pd_base2siw(attr->pd);
+	atomic_fetch_add(&parent_domain->pd.protection_domain->refcount, 1);
+	atomic_init(&parent_domain->pd.refcount, 1);
+
+	ibv_initialize_parent_domain(&parent_domain->pd.base_pd,
+				     &parent_domain->pd.protection_domain->base_pd);
+
+	return &parent_domain->pd.base_pd;
+}
+
+static void siw_get_parent_domain(struct ibv_pd *pd)
+{
+	struct siw_parent_domain *parent_domain = parent_domain_base2siw(pd);
+
+	if (parent_domain)
+		atomic_fetch_add(&parent_domain->pd.refcount, 1);
+}
+
+static void siw_put_parent_domain(struct ibv_pd *pd)
+{
+	struct siw_parent_domain *parent_domain = parent_domain_base2siw(pd);
+
+	if (parent_domain)
+		atomic_fetch_sub(&parent_domain->pd.refcount, 1);
+}
+
 static struct ibv_mr *siw_reg_mr(struct ibv_pd *pd, void *addr, size_t len,
 				 uint64_t hca_va, int access)
 {
@@ -131,20 +237,45 @@ static int siw_dereg_mr(struct verbs_mr *base_mr)
 	return 0;
 }
 
-static struct ibv_cq *siw_create_cq(struct ibv_context *ctx, int num_cqe,
-				    struct ibv_comp_channel *channel,
-				    int comp_vector)
+static struct siw_cq *create_cq(struct ibv_context *ctx,
+				struct ibv_cq_init_attr_ex *attr)
 {
 	struct siw_cmd_create_cq cmd = {};
 	struct siw_cmd_create_cq_resp resp = {};
 	struct siw_cq *cq;
-	int cq_size, rv;
+	int cq_size, rv, need_lock = 1;
+
+	if (!check_comp_mask(attr->comp_mask, IBV_CQ_INIT_ATTR_MASK_FLAGS |
+					      IBV_CQ_INIT_ATTR_MASK_PD) ||
+	    (attr->wc_flags & ~IBV_WC_STANDARD_FLAGS)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS) {
+		if (attr->flags & ~IBV_CREATE_CQ_ATTR_SINGLE_THREADED) {
+			errno = EOPNOTSUPP;
+			return NULL;
+		}
+		if (attr->flags & IBV_CREATE_CQ_ATTR_SINGLE_THREADED)
+			need_lock = 0;
+	}
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		struct siw_parent_domain *parent_domain =
+			parent_domain_base2siw(attr->parent_domain);
 
+		if (!parent_domain) {
+			errno = EINVAL;
+			return NULL;
+		}
+		if (parent_domain->td)
+			need_lock = 0;
+	}
 	cq = calloc(1, sizeof(*cq));
 	if (!cq)
 		return NULL;
 
-	rv = ibv_cmd_create_cq(ctx, num_cqe, channel, comp_vector, &cq->base_cq,
+	rv = ibv_cmd_create_cq(ctx, attr->cqe, attr->channel,
+			       attr->comp_vector, &cq->base_cq,
 			       &cmd.ibv_cmd, sizeof(cmd), &resp.ibv_resp,
 			       sizeof(resp));
 	if (rv) {
@@ -158,7 +289,7 @@ static struct ibv_cq *siw_create_cq(struct ibv_context *ctx, int num_cqe,
 			printf("libsiw: prepare CQ mapping failed\n");
 		goto fail;
 	}
-	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+	siw_lock_init(&cq->lock, need_lock);
 	cq->id = resp.cq_id;
 	cq->num_cqe = resp.num_cqe;
 
@@ -176,7 +307,11 @@ static struct ibv_cq *siw_create_cq(struct ibv_context *ctx, int num_cqe,
 	cq->ctrl = (struct siw_cq_ctrl *)&cq->queue[cq->num_cqe];
 	cq->ctrl->flags = SIW_NOTIFY_NOT;
 
-	return &cq->base_cq;
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		cq->parent_domain = attr->parent_domain;
+		siw_get_parent_domain(cq->parent_domain);
+	}
+	return cq;
 fail:
 	ibv_cmd_destroy_cq(&cq->base_cq);
 	free(cq);
@@ -184,6 +319,20 @@ fail:
 	return NULL;
 }
 
+static struct ibv_cq *siw_create_cq(struct ibv_context *ctx, int num_cqe,
+				    struct ibv_comp_channel *channel,
+				    int comp_vector)
+{
+	struct ibv_cq_init_attr_ex attr = {
+		.cqe = num_cqe,
+		.channel = channel,
+		.comp_vector = comp_vector,
+	};
+	struct siw_cq *cq = create_cq(ctx, &attr);
+
+	return cq ? &cq->base_cq : NULL;
+}
+
 static int siw_resize_cq(struct ibv_cq *base_cq, int num_cqe)
 {
 	return -EOPNOTSUPP;
@@ -194,7 +343,7 @@ static int siw_destroy_cq(struct ibv_cq *base_cq)
 	struct siw_cq *cq = cq_base2siw(base_cq);
 	int rv;
 
-	assert(pthread_spin_trylock(&cq->lock));
+	assert(pthread_spin_trylock(&cq->lock.lock));
 
 	if (cq->queue)
 		munmap(cq->queue, cq->num_cqe * sizeof(struct siw_cqe) +
@@ -202,10 +351,11 @@ static int siw_destroy_cq(struct ibv_cq *base_cq)
 
 	rv = ibv_cmd_destroy_cq(base_cq);
 	if (rv) {
-		pthread_spin_unlock(&cq->lock);
+		pthread_spin_unlock(&cq->lock.lock);
 		return rv;
 	}
-	pthread_spin_destroy(&cq->lock);
+	pthread_spin_destroy(&cq->lock.lock);
+	siw_put_parent_domain(cq->parent_domain);
 
 	free(cq);
 
@@ -238,7 +388,7 @@ static struct ibv_srq *siw_create_srq(struct ibv_pd *pd,
 			printf("libsiw: prepare SRQ mapping failed\n");
 		goto fail;
 	}
-	pthread_spin_init(&srq->lock, PTHREAD_PROCESS_PRIVATE);
+	siw_lock_init_pd(&srq->lock, pd);
 	rq_size = resp.num_rqe * sizeof(struct siw_rqe);
 	srq->num_rqe = resp.num_rqe;
 
@@ -250,6 +400,8 @@ static struct ibv_srq *siw_create_srq(struct ibv_pd *pd,
 			printf("libsiw: SRQ mapping failed: %d", errno);
 		goto fail;
 	}
+	siw_get_parent_domain(pd);
+
 	return &srq->base_srq;
 fail:
 	ibv_cmd_destroy_srq(&srq->base_srq);
@@ -265,9 +417,9 @@ static int siw_modify_srq(struct ibv_srq *base_srq, struct ibv_srq_attr *attr,
 	struct siw_srq *srq = srq_base2siw(base_srq);
 	int rv;
 
-	pthread_spin_lock(&srq->lock);
+	siw_lock(&srq->lock);
 	rv = ibv_cmd_modify_srq(base_srq, attr, attr_mask, &cmd, sizeof(cmd));
-	pthread_spin_unlock(&srq->lock);
+	siw_unlock(&srq->lock);
 
 	return rv;
 }
@@ -277,58 +429,41 @@ static int siw_destroy_srq(struct ibv_srq *base_srq)
 	struct siw_srq *srq = srq_base2siw(base_srq);
 	int rv;
 
-	assert(pthread_spin_trylock(&srq->lock));
+	assert(pthread_spin_trylock(&srq->lock.lock));
 
 	rv = ibv_cmd_destroy_srq(base_srq);
 	if (rv) {
-		pthread_spin_unlock(&srq->lock);
+		pthread_spin_unlock(&srq->lock.lock);
 		return rv;
 	}
 	if (srq->recvq)
 		munmap(srq->recvq, srq->num_rqe * sizeof(struct siw_rqe));
 
-	pthread_spin_destroy(&srq->lock);
+	pthread_spin_destroy(&srq->lock.lock);
+	siw_put_parent_domain(base_srq->pd);
 
 	free(srq);
 
 	return 0;
 }
 
-static struct ibv_qp *siw_create_qp(struct ibv_pd *pd,
-				    struct ibv_qp_init_attr *attr)
+static int map_queue_pair(struct siw_qp *qp, struct ibv_pd *pd,
+			  struct ibv_srq *srq, int sq_sig_all,
+			  struct siw_cmd_create_qp_resp *resp)
 {
-	struct siw_cmd_create_qp cmd = {};
-	struct siw_cmd_create_qp_resp resp = {};
-	struct siw_qp *qp;
 	struct ibv_context *base_ctx = pd->context;
-	int sq_size, rq_size, rv;
-
-	memset(&cmd, 0, sizeof(cmd));
-	memset(&resp, 0, sizeof(resp));
+	int sq_size, rq_size;
 
-	qp = calloc(1, sizeof(*qp));
-	if (!qp)
-		return NULL;
-
-	rv = ibv_cmd_create_qp(pd, &qp->base_qp, attr, &cmd.ibv_cmd,
-			       sizeof(cmd), &resp.ibv_resp, sizeof(resp));
-
-	if (rv) {
-		if (siw_debug)
-			printf("libsiw: QP creation failed\n");
-		free(qp);
-		return NULL;
-	}
-	if (resp.sq_key == SIW_INVAL_UOBJ_KEY ||
-	    resp.rq_key == SIW_INVAL_UOBJ_KEY) {
+	if (resp->sq_key == SIW_INVAL_UOBJ_KEY ||
+	    resp->rq_key == SIW_INVAL_UOBJ_KEY) {
 		if (siw_debug)
 			printf("libsiw: prepare QP mapping failed\n");
-		goto fail;
+		return -1;
 	}
-	qp->id = resp.qp_id;
-	qp->num_sqe = resp.num_sqe;
-	qp->num_rqe = resp.num_rqe;
-	qp->sq_sig_all = attr->sq_sig_all;
+	qp->id = resp->qp_id;
+	qp->num_sqe = resp->num_sqe;
+	qp->num_rqe = resp->num_rqe;
+	qp->sq_sig_all = sq_sig_all;
 
 	/* Init doorbell request structure */
 	qp->db_req.hdr.command = IB_USER_VERBS_CMD_POST_SEND;
@@ -339,41 +474,45 @@ static struct ibv_qp *siw_create_qp(struct ibv_pd *pd,
 	qp->db_req.sge_count = 0;
 	qp->db_req.wqe_size = sizeof(struct ibv_send_wr);
 
-	pthread_spin_init(&qp->sq_lock, PTHREAD_PROCESS_PRIVATE);
-	pthread_spin_init(&qp->rq_lock, PTHREAD_PROCESS_PRIVATE);
+	siw_lock_init_pd(&qp->sq_lock, pd);
+	siw_lock_init_pd(&qp->rq_lock, pd);
 
-	sq_size = resp.num_sqe * sizeof(struct siw_sqe);
+	sq_size = resp->num_sqe * sizeof(struct siw_sqe);
 
 	qp->sendq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
-			 MAP_SHARED, base_ctx->cmd_fd, resp.sq_key);
+			 MAP_SHARED, base_ctx->cmd_fd, resp->sq_key);
 
 	if (qp->sendq == MAP_FAILED) {
 		if (siw_debug)
 			printf("libsiw: SQ mapping failed: %d", errno);
 
 		qp->sendq = NULL;
-		goto fail;
+		return -1;
 	}
-	if (attr->srq) {
-		qp->srq = srq_base2siw(attr->srq);
+	if (srq) {
+		qp->srq = srq_base2siw(srq);
 	} else {
-		rq_size = resp.num_rqe * sizeof(struct siw_rqe);
+		rq_size = resp->num_rqe * sizeof(struct siw_rqe);
 
 		qp->recvq = mmap(NULL, rq_size, PROT_READ | PROT_WRITE,
-				 MAP_SHARED, base_ctx->cmd_fd, resp.rq_key);
+				 MAP_SHARED, base_ctx->cmd_fd, resp->rq_key);
 
 		if (qp->recvq == MAP_FAILED) {
 			if (siw_debug)
 				printf("libsiw: RQ mapping failed: %d\n",
-				       resp.num_rqe);
+				       resp->num_rqe);
 			qp->recvq = NULL;
-			goto fail;
+			return -1;
 		}
 	}
 	qp->db_req.qp_handle = qp->base_qp.handle;
+	siw_get_parent_domain(pd);
 
-	return &qp->base_qp;
-fail:
+	return 0;
+}
+
+static void unmap_queue_pair(struct siw_qp *qp)
+{
 	ibv_cmd_destroy_qp(&qp->base_qp);
 
 	if (qp->sendq)
@@ -382,8 +521,34 @@ fail:
 		munmap(qp->recvq, qp->num_rqe * sizeof(struct siw_rqe));
 
 	free(qp);
+}
 
-	return NULL;
+static struct ibv_qp *siw_create_qp(struct ibv_pd *pd,
+				    struct ibv_qp_init_attr *attr)
+{
+	struct siw_cmd_create_qp cmd = {};
+	struct siw_cmd_create_qp_resp resp = {};
+	struct siw_qp *qp;
+	int rv;
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	rv = ibv_cmd_create_qp(pd, &qp->base_qp, attr, &cmd.ibv_cmd,
+			       sizeof(cmd), &resp.ibv_resp, sizeof(resp));
+
+	if (rv) {
+		if (siw_debug)
+			printf("libsiw: QP creation failed\n");
+		free(qp);
+		return NULL;
+	}
+	if (map_queue_pair(qp, pd, attr->srq, attr->sq_sig_all, &resp)) {
+		unmap_queue_pair(qp);
+		return NULL;
+	}
+	return &qp->base_qp;
 }
 
 static int siw_modify_qp(struct ibv_qp *base_qp, struct ibv_qp_attr *attr,
@@ -395,13 +560,13 @@ static int siw_modify_qp(struct ibv_qp *base_qp, struct ibv_qp_attr *attr,
 
 	memset(&cmd, 0, sizeof(cmd));
 
-	pthread_spin_lock(&qp->sq_lock);
-	pthread_spin_lock(&qp->rq_lock);
+	siw_lock(&qp->sq_lock);
+	siw_lock(&qp->rq_lock);
 
 	rv = ibv_cmd_modify_qp(base_qp, attr, attr_mask, &cmd, sizeof(cmd));
 
-	pthread_spin_unlock(&qp->rq_lock);
-	pthread_spin_unlock(&qp->sq_lock);
+	siw_unlock(&qp->rq_lock);
+	siw_unlock(&qp->sq_lock);
 
 	return rv;
 }
@@ -411,8 +576,8 @@ static int siw_destroy_qp(struct ibv_qp *base_qp)
 	struct siw_qp *qp = qp_base2siw(base_qp);
 	int rv;
 
-	assert(pthread_spin_trylock(&qp->sq_lock));
-	assert(pthread_spin_trylock(&qp->rq_lock));
+	assert(pthread_spin_trylock(&qp->sq_lock.lock));
+	assert(pthread_spin_trylock(&qp->rq_lock.lock));
 
 	if (qp->sendq)
 		munmap(qp->sendq, qp->num_sqe * sizeof(struct siw_sqe));
@@ -421,12 +586,13 @@ static int siw_destroy_qp(struct ibv_qp *base_qp)
 
 	rv = ibv_cmd_destroy_qp(base_qp);
 	if (rv) {
-		pthread_spin_unlock(&qp->rq_lock);
-		pthread_spin_unlock(&qp->sq_lock);
+		pthread_spin_unlock(&qp->rq_lock.lock);
+		pthread_spin_unlock(&qp->sq_lock.lock);
 		return rv;
 	}
-	pthread_spin_destroy(&qp->rq_lock);
-	pthread_spin_destroy(&qp->sq_lock);
+	pthread_spin_destroy(&qp->rq_lock.lock);
+	pthread_spin_destroy(&qp->sq_lock.lock);
+	siw_put_parent_domain(base_qp->pd);
 
 	free(qp);
 
@@ -592,7 +758,7 @@ static int siw_post_send(struct ibv_qp *base_qp, struct ibv_send_wr *wr,
 
 	*bad_wr = NULL;
 
-	pthread_spin_lock(&qp->sq_lock);
+	siw_lock(&qp->sq_lock);
 
 	sq_put = qp->sq_put;
 
@@ -649,11 +815,306 @@ static int siw_post_send(struct ibv_qp *base_qp, struct ibv_send_wr *wr,
 
 		qp->sq_put = sq_put;
 	}
-	pthread_spin_unlock(&qp->sq_lock);
+	siw_unlock(&qp->sq_lock);
 
 	return rv;
 }
 
+/*
+ * ibv_wr_* support. SQEs are built in place starting at sq_put, but are
+ * made valid for the kernel only at wr_complete, in posting order.
+ */
+enum {
+	SIW_QP_EX_SUP_SEND_OPS = IBV_QP_EX_WITH_RDMA_WRITE |
+				 IBV_QP_EX_WITH_SEND |
+				 IBV_QP_EX_WITH_RDMA_READ |
+				 IBV_QP_EX_WITH_SEND_WITH_INV,
+};
+
+static struct siw_sqe *init_sqe(struct siw_qp *qp, enum siw_opcode opcode,
+				uint64_t send_op)
+{
+	struct ibv_qp_ex *qpx = &qp->vqp.qp_ex;
+	struct siw_sqe *sqe;
+	atomic_ushort *fp;
+	uint16_t flags;
+
+	if (qp->wr_err)
+		return NULL;
+
+	if (!(qp->send_ops_flags & send_op)) {
+		if (siw_debug)
+			printf("libsiw: QP[%d]: opcode %d not enabled\n",
+			       qp->id, opcode);
+		qp->wr_err = EINVAL;
+		return NULL;
+	}
+
+	sqe = &qp->sendq[qp->wr_put % qp->num_sqe];
+	fp = (atomic_ushort *)&sqe->flags;
+
+	if (qp->wr_put - qp->sq_put >= qp->num_sqe ||
+	    (atomic_load(fp) & SIW_WQE_VALID)) {
+		if (siw_debug)
+			printf("libsiw: QP[%d]: SQ overflow, idx %d\n",
+			       qp->id, qp->wr_put % qp->num_sqe);
+		qp->wr_err = ENOMEM;
+		return NULL;
+	}
+	flags = map_send_flags(qpx->wr_flags) & ~SIW_WQE_VALID;
+	if (qp->sq_sig_all)
+		flags |= SIW_WQE_SIGNALLED;
+
+	sqe->id = qpx->wr_id;
+	sqe->flags = flags;
+	sqe->num_sge = 0;
+	sqe->opcode = opcode;
+	sqe->raddr = 0;
+	sqe->rkey = 0;
+
+	qp->wr_put++;
+
+	return sqe;
+}
+
+static struct siw_sqe *cur_sqe(struct siw_qp *qp)
+{
+	if (qp->wr_err)
+		return NULL;
+
+	return &qp->sendq[(qp->wr_put - 1) % qp->num_sqe];
+}
+
+static void siw_wr_rdma_read(struct ibv_qp_ex *qpx, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	struct siw_sqe *sqe = init_sqe(qp_ex2siw(qpx), SIW_OP_READ,
+				     IBV_QP_EX_WITH_RDMA_READ);
+
+	if (!sqe)
+		return;
+
+	sqe->raddr = remote_addr;
+	sqe->rkey = rkey;
+}
+
+static void siw_wr_rdma_write(struct ibv_qp_ex *qpx, uint32_t rkey,
+			      uint64_t remote_addr)
+{
+	struct siw_sqe *sqe = init_sqe(qp_ex2siw(qpx), SIW_OP_WRITE,
+				     IBV_QP_EX_WITH_RDMA_WRITE);
+
+	if (!sqe)
+		return;
+
+	sqe->raddr = remote_addr;
+	sqe->rkey = rkey;
+}
+
+static void siw_wr_send(struct ibv_qp_ex *qpx)
+{
+	init_sqe(qp_ex2siw(qpx), SIW_OP_SEND, IBV_QP_EX_WITH_SEND);
+}
+
+static void siw_wr_send_inv(struct ibv_qp_ex *qpx, uint32_t invalidate_rkey)
+{
+	struct siw_sqe *sqe = init_sqe(qp_ex2siw(qpx), SIW_OP_SEND_REMOTE_INV,
+				     IBV_QP_EX_WITH_SEND_WITH_INV);
+
+	if (!sqe)
+		return;
+
+	sqe->rkey = invalidate_rkey;
+}
+
+static void siw_wr_set_inline_data_list(struct ibv_qp_ex *qpx, size_t num_buf,
+					const struct ibv_data_buf *buf_list)
+{
+	struct siw_qp *qp = qp_ex2siw(qpx);
+	struct siw_sqe *sqe = cur_sqe(qp);
+	char *data;
+	size_t bytes = 0, i;
+
+	if (!sqe)
+		return;
+
+	data = (char *)&sqe->sge[1];
+
+	for (i = 0; i < num_buf; i++) {
+		bytes += buf_list[i].length;
+		if (bytes > SIW_MAX_INLINE) {
+			if (siw_debug)
+				printf("libsiw: inline data: %zu:%d\n",
+				       bytes, (int)SIW_MAX_INLINE);
+			qp->wr_err = EINVAL;
+			return;
+		}
+		memcpy(data, buf_list[i].addr, buf_list[i].length);
+		data += buf_list[i].length;
+	}
+	sqe->sge[0].length = bytes;
+	sqe->num_sge = 1;
+	sqe->flags |= SIW_WQE_INLINE;
+}
+
+static void siw_wr_set_inline_data(struct ibv_qp_ex *qpx, void *addr,
+				   size_t length)
+{
+	struct ibv_data_buf buf = { .addr = addr, .length = length };
+
+	siw_wr_set_inline_data_list(qpx, 1, &buf);
+}
+
+static void siw_wr_set_sge_list(struct ibv_qp_ex *qpx, size_t num_sge,
+				const struct ibv_sge *sg_list)
+{
+	struct siw_qp *qp = qp_ex2siw(qpx);
+	struct siw_sqe *sqe = cur_sqe(qp);
+
+	if (!sqe)
+		return;
+
+	if (num_sge > qp->max_send_sge) {
+		if (siw_debug)
+			printf("libsiw: QP[%d]: %zu SGEs, max %u\n",
+			       qp->id, num_sge, qp->max_send_sge);
+		qp->wr_err = EINVAL;
+		return;
+	}
+	/* this assumes same layout of siw and base SGE */
+	memcpy(sqe->sge, sg_list, num_sge * sizeof(struct ibv_sge));
+	sqe->num_sge = num_sge;
+}
+
+static void siw_wr_set_sge(struct ibv_qp_ex *qpx, uint32_t lkey, uint64_t addr,
+			   uint32_t length)
+{
+	struct ibv_sge sge = { .addr = addr, .length = length, .lkey = lkey };
+
+	siw_wr_set_sge_list(qpx, 1, &sge);
+}
+
+static void siw_wr_start(struct ibv_qp_ex *qpx)
+{
+	struct siw_qp *qp = qp_ex2siw(qpx);
+
+	siw_lock(&qp->sq_lock);
+
+	qp->wr_put = qp->sq_put;
+	qp->wr_err = 0;
+}
+
+static void siw_wr_abort(struct ibv_qp_ex *qpx)
+{
+	struct siw_qp *qp = qp_ex2siw(qpx);
+
+	/* None of the built SQEs is valid yet, just drop them */
+	qp->wr_put = qp->sq_put;
+
+	siw_unlock(&qp->sq_lock);
+}
+
+static int siw_wr_complete(struct ibv_qp_ex *qpx)
+{
+	struct siw_qp *qp = qp_ex2siw(qpx);
+	uint32_t new_sqe = qp->wr_put - qp->sq_put;
+	uint32_t sq_put;
+	atomic_ushort *fp;
+	int rv = qp->wr_err;
+
+	if (rv || !new_sqe) {
+		siw_wr_abort(qpx);
+		return rv;
+	}
+	for (sq_put = qp->sq_put; sq_put != qp->wr_put; sq_put++) {
+		struct siw_sqe *sqe = &qp->sendq[sq_put % qp->num_sqe];
+
+		fp = (atomic_ushort *)&sqe->flags;
+		atomic_store(fp, sqe->flags | SIW_WQE_VALID);
+	}
+	/* Same doorbell avoidance as siw_post_send() */
+	if (new_sqe < qp->num_sqe) {
+		uint32_t old_idx = (qp->sq_put - 1) % qp->num_sqe;
+
+		fp = (atomic_ushort *)&qp->sendq[old_idx].flags;
+		if (!(atomic_load(fp) & SIW_WQE_VALID))
+			rv = siw_db(qp);
+	} else {
+		rv = siw_db(qp);
+	}
+	qp->sq_put = qp->wr_put;
+
+	siw_unlock(&qp->sq_lock);
+
+	return rv;
+}
+
+static void set_qp_send_ops(struct siw_qp *qp)
+{
+	struct ibv_qp_ex *qpx = &qp->vqp.qp_ex;
+
+	qpx->wr_rdma_read = siw_wr_rdma_read;
+	qpx->wr_rdma_write = siw_wr_rdma_write;
+	qpx->wr_send = siw_wr_send;
+	qpx->wr_send_inv = siw_wr_send_inv;
+	qpx->wr_set_inline_data = siw_wr_set_inline_data;
+	qpx->wr_set_inline_data_list = siw_wr_set_inline_data_list;
+	qpx->wr_set_sge = siw_wr_set_sge;
+	qpx->wr_set_sge_list = siw_wr_set_sge_list;
+	qpx->wr_start = siw_wr_start;
+	qpx->wr_complete = siw_wr_complete;
+	qpx->wr_abort = siw_wr_abort;
+}
+
+static struct ibv_qp *siw_create_qp_ex(struct ibv_context *ctx,
+				       struct ibv_qp_init_attr_ex *attr)
+{
+	struct siw_cmd_create_qp cmd = {};
+	struct siw_cmd_create_qp_resp resp = {};
+	struct siw_qp *qp;
+	int rv;
+
+	if (!check_comp_mask(attr->comp_mask,
+			     IBV_QP_INIT_ATTR_PD |
+			     IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) ||
+	    !(attr->comp_mask & IBV_QP_INIT_ATTR_PD)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	if ((attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) &&
+	    (attr->send_ops_flags & ~SIW_QP_EX_SUP_SEND_OPS)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	rv = ibv_cmd_create_qp_ex(ctx, &qp->vqp, sizeof(qp->vqp), attr,
+				  &cmd.ibv_cmd, sizeof(cmd), &resp.ibv_resp,
+				  sizeof(resp));
+	if (rv) {
+		if (siw_debug)
+			printf("libsiw: QP creation failed\n");
+		free(qp);
+		errno = rv;
+		return NULL;
+	}
+	if (map_queue_pair(qp, attr->pd, attr->srq, attr->sq_sig_all, &resp)) {
+		unmap_queue_pair(qp);
+		return NULL;
+	}
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		qp->send_ops_flags = attr->send_ops_flags;
+		/* The SQE holds no more than SIW_MAX_SGE SGEs */
+		qp->max_send_sge = min_t(uint32_t, attr->cap.max_send_sge,
+					 SIW_MAX_SGE);
+		set_qp_send_ops(qp);
+		qp->vqp.comp_mask |= VERBS_QP_EX;
+	}
+	return &qp->base_qp;
+}
+
 static inline int push_recv_wqe(struct ibv_recv_wr *base_wr,
 				struct siw_rqe *siw_rqe)
 {
@@ -685,7 +1146,7 @@ static int siw_post_recv(struct ibv_qp *base_qp, struct ibv_recv_wr *wr,
 	uint32_t rq_put;
 	int rv = 0;
 
-	pthread_spin_lock(&qp->rq_lock);
+	siw_lock(&qp->rq_lock);
 
 	rq_put = qp->rq_put;
 
@@ -714,7 +1175,7 @@ static int siw_post_recv(struct ibv_qp *base_qp, struct ibv_recv_wr *wr,
 	}
 	qp->rq_put = rq_put;
 
-	pthread_spin_unlock(&qp->rq_lock);
+	siw_unlock(&qp->rq_lock);
 
 	return rv;
 }
@@ -726,7 +1187,7 @@ static int siw_post_srq_recv(struct ibv_srq *base_srq, struct ibv_recv_wr *wr,
 	uint32_t srq_put;
 	int rv = 0;
 
-	pthread_spin_lock(&srq->lock);
+	siw_lock(&srq->lock);
 
 	srq_put = srq->rq_put;
 
@@ -754,7 +1215,7 @@ static int siw_post_srq_recv(struct ibv_srq *base_srq, struct ibv_recv_wr *wr,
 	}
 	srq->rq_put = srq_put;
 
-	pthread_spin_unlock(&srq->lock);
+	siw_unlock(&srq->lock);
 
 	return rv;
 }
@@ -810,7 +1271,7 @@ static int siw_poll_cq(struct ibv_cq *ibcq, int num_entries, struct ibv_wc *wc)
 	struct siw_cq *cq = cq_base2siw(ibcq);
 	int new = 0;
 
-	pthread_spin_lock(&cq->lock);
+	siw_lock(&cq->lock);
 
 	for (; num_entries--; wc++) {
 		struct siw_cqe *cqe = &cq->queue[cq->cq_get % cq->num_cqe];
@@ -824,19 +1285,163 @@ static int siw_poll_cq(struct ibv_cq *ibcq, int num_entries, struct ibv_wc *wc)
 		} else
 			break;
 	}
-	pthread_spin_unlock(&cq->lock);
+	siw_unlock(&cq->lock);
 
 	return new;
 }
 
+static inline int siw_cq_ex_load(struct siw_cq *cq)
+{
+	struct siw_cqe *cqe = &cq->queue[cq->cq_get % cq->num_cqe];
+	atomic_uchar *fp = (atomic_uchar *)&cqe->flags;
+
+	if (!(atomic_load(fp) & SIW_WQE_VALID)) {
+		cq->cur_cqe = NULL;
+		return ENOENT;
+	}
+	cq->cur_cqe = cqe;
+	cq->base_cq_ex.wr_id = cqe->id;
+	cq->base_cq_ex.status = map_cqe_status[cqe->status].base;
+
+	return 0;
+}
+
+static int siw_start_poll(struct ibv_cq_ex *current,
+			  struct ibv_poll_cq_attr *attr)
+{
+	struct siw_cq *cq = cq_ex2siw(current);
+
+	if (attr->comp_mask)
+		return EINVAL;
+
+	siw_lock(&cq->lock);
+
+	if (siw_cq_ex_load(cq)) {
+		siw_unlock(&cq->lock);
+		return ENOENT;
+	}
+	return 0;
+}
+
+static int siw_next_poll(struct ibv_cq_ex *current)
+{
+	struct siw_cq *cq = cq_ex2siw(current);
+
+	atomic_store((atomic_uchar *)&cq->cur_cqe->flags, 0);
+	cq->cq_get++;
+
+	return siw_cq_ex_load(cq);
+}
+
+static void siw_end_poll(struct ibv_cq_ex *current)
+{
+	struct siw_cq *cq = cq_ex2siw(current);
+
+	if (cq->cur_cqe) {
+		atomic_store((atomic_uchar *)&cq->cur_cqe->flags, 0);
+		cq->cq_get++;
+		cq->cur_cqe = NULL;
+	}
+	siw_unlock(&cq->lock);
+}
+
+static enum ibv_wc_opcode siw_read_opcode(struct ibv_cq_ex *current)
+{
+	return map_cqe_opcode[cq_ex2siw(current)->cur_cqe->opcode].base;
+}
+
+static uint32_t siw_read_vendor_err(struct ibv_cq_ex *current)
+{
+	return 0;
+}
+
+static unsigned int siw_read_wc_flags(struct ibv_cq_ex *current)
+{
+	/* No immediate data supported yet */
+	return 0;
+}
+
+static uint32_t siw_read_byte_len(struct ibv_cq_ex *current)
+{
+	return cq_ex2siw(current)->cur_cqe->bytes;
+}
+
+static __be32 siw_read_imm_data(struct ibv_cq_ex *current)
+{
+	return 0;
+}
+
+static uint32_t siw_read_qp_num(struct ibv_cq_ex *current)
+{
+	return (uint32_t)cq_ex2siw(current)->cur_cqe->qp_id;
+}
+
+static uint32_t siw_read_src_qp(struct ibv_cq_ex *current)
+{
+	return 0;
+}
+
+static uint32_t siw_read_slid(struct ibv_cq_ex *current)
+{
+	return 0;
+}
+
+static uint8_t siw_read_sl(struct ibv_cq_ex *current)
+{
+	return 0;
+}
+
+static uint8_t siw_read_dlid_path_bits(struct ibv_cq_ex *current)
+{
+	return 0;
+}
+
+static struct ibv_cq_ex *siw_create_cq_ex(struct ibv_context *ctx,
+					  struct ibv_cq_init_attr_ex *attr)
+{
+	struct siw_cq *cq;
+
+	cq = create_cq(ctx, attr);
+	if (!cq)
+		return NULL;
+
+	cq->base_cq_ex.start_poll = siw_start_poll;
+	cq->base_cq_ex.next_poll = siw_next_poll;
+	cq->base_cq_ex.end_poll = siw_end_poll;
+	cq->base_cq_ex.read_opcode = siw_read_opcode;
+	cq->base_cq_ex.read_vendor_err = siw_read_vendor_err;
+	cq->base_cq_ex.read_wc_flags = siw_read_wc_flags;
+	if (attr->wc_flags & IBV_WC_EX_WITH_BYTE_LEN)
+		cq->base_cq_ex.read_byte_len = siw_read_byte_len;
+	if (attr->wc_flags & IBV_WC_EX_WITH_IMM)
+		cq->base_cq_ex.read_imm_data = siw_read_imm_data;
+	if (attr->wc_flags & IBV_WC_EX_WITH_QP_NUM)
+		cq->base_cq_ex.read_qp_num = siw_read_qp_num;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SRC_QP)
+		cq->base_cq_ex.read_src_qp = siw_read_src_qp;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SLID)
+		cq->base_cq_ex.read_slid = siw_read_slid;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SL)
+		cq->base_cq_ex.read_sl = siw_read_sl;
+	if (attr->wc_flags & IBV_WC_EX_WITH_DLID_PATH_BITS)
+		cq->base_cq_ex.read_dlid_path_bits = siw_read_dlid_path_bits;
+
+	return &cq->base_cq_ex;
+}
+
 static const struct verbs_context_ops siw_context_ops = {
+	.alloc_parent_domain = siw_alloc_parent_domain,
 	.alloc_pd = siw_alloc_pd,
+	.alloc_td = siw_alloc_td,
 	.async_event = siw_async_event,
 	.create_ah = siw_create_ah,
 	.create_cq = siw_create_cq,
+	.create_cq_ex = siw_create_cq_ex,
 	.create_qp = siw_create_qp,
+	.create_qp_ex = siw_create_qp_ex,
 	.create_srq = siw_create_srq,
 	.dealloc_pd = siw_free_pd,
+	.dealloc_td = siw_dealloc_td,
 	.dereg_mr = siw_dereg_mr,
 	.destroy_ah = siw_destroy_ah,
 	.destroy_cq = siw_destroy_cq,
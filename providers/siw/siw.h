@@ -8,6 +8,7 @@
 
 #include <pthread.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <stddef.h>
 
 #include <infiniband/driver.h>
@@ -17,12 +18,37 @@ struct siw_device {
 	struct verbs_device base_dev;
 };
 
+/*
+ * Objects created on a parent domain with a thread domain are only used by
+ * one thread at a time, their queue locks are elided.
+ */
+struct siw_spinlock {
+	pthread_spinlock_t lock;
+	int need_lock;
+};
+
+struct siw_td {
+	struct ibv_td base_td;
+	atomic_int refcount;
+};
+
+struct siw_pd {
+	struct ibv_pd base_pd;
+	atomic_int refcount;
+	struct siw_pd *protection_domain;
+};
+
+struct siw_parent_domain {
+	struct siw_pd pd;
+	struct siw_td *td;
+};
+
 struct siw_srq {
 	struct ibv_srq base_srq;
 	struct siw_rqe *recvq;
 	uint32_t rq_put;
 	uint32_t num_rqe;
-	pthread_spinlock_t lock;
+	struct siw_spinlock lock;
 };
 
 struct siw_mr {
@@ -30,13 +56,16 @@ struct siw_mr {
 };
 
 struct siw_qp {
-	struct ibv_qp base_qp;
+	union {
+		struct ibv_qp base_qp;
+		struct verbs_qp vqp;
+	};
 	struct siw_device *siw_dev;
 
 	uint32_t id;
 
-	pthread_spinlock_t sq_lock;
-	pthread_spinlock_t rq_lock;
+	struct siw_spinlock sq_lock;
+	struct siw_spinlock rq_lock;
 
 	struct ibv_post_send db_req;
 	struct ib_uverbs_post_send_resp db_resp;
@@ -50,10 +79,19 @@ struct siw_qp {
 	uint32_t rq_put;
 	struct siw_rqe *recvq;
 	struct siw_srq *srq;
+
+	/* ibv_wr_* SQEs built since ibv_wr_start, not yet valid */
+	uint32_t wr_put;
+	int wr_err;
+	uint64_t send_ops_flags;
+	uint32_t max_send_sge;
 };
 
 struct siw_cq {
-	struct ibv_cq base_cq;
+	union {
+		struct ibv_cq base_cq;
+		struct ibv_cq_ex base_cq_ex;
+	};
 	struct siw_device *siw_dev;
 	uint32_t id;
 
@@ -65,7 +103,11 @@ struct siw_cq {
 	int num_cqe;
 	uint32_t cq_get;
 	struct siw_cqe *queue;
-	pthread_spinlock_t lock;
+	struct siw_spinlock lock;
+
+	/* CQE read by the extended poll API, NULL if none */
+	struct siw_cqe *cur_cqe;
+	struct ibv_pd *parent_domain;
 };
 
 struct siw_context {
@@ -78,16 +120,51 @@ static inline struct siw_context *ctx_ibv2siw(struct ibv_context *base)
 	return container_of(base, struct siw_context, base_ctx.context);
 }
 
+static inline struct siw_td *td_base2siw(struct ibv_td *base)
+{
+	return container_of(base, struct siw_td, base_td);
+}
+
+/* pd_base2siw always returns the protection domain, also for parent domains */
+static inline struct siw_pd *pd_base2siw(struct ibv_pd *base)
+{
+	struct siw_pd *pd = container_of(base, struct siw_pd, base_pd);
+
+	return pd->protection_domain ? pd->protection_domain : pd;
+}
+
+static inline struct siw_parent_domain *parent_domain_base2siw(struct ibv_pd *base)
+{
+	struct siw_parent_domain *parent_domain;
+
+	if (!base)
+		return NULL;
+
+	parent_domain = container_of(base, struct siw_parent_domain, pd.base_pd);
+
+	return parent_domain->pd.protection_domain ? parent_domain : NULL;
+}
+
 static inline struct siw_qp *qp_base2siw(struct ibv_qp *base)
 {
 	return container_of(base, struct siw_qp, base_qp);
 }
 
+static inline struct siw_qp *qp_ex2siw(struct ibv_qp_ex *base)
+{
+	return container_of(base, struct siw_qp, vqp.qp_ex);
+}
+
 static inline struct siw_cq *cq_base2siw(struct ibv_cq *base)
 {
 	return container_of(base, struct siw_cq, base_cq);
 }
 
+static inline struct siw_cq *cq_ex2siw(struct ibv_cq_ex *base)
+{
+	return container_of(base, struct siw_cq, base_cq_ex);
+}
+
 static inline struct siw_mr *mr_base2siw(struct verbs_mr *base)
 {
 	return container_of(base, struct siw_mr, base_mr);
@@ -98,6 +175,31 @@ static inline struct siw_srq *srq_base2siw(struct ibv_srq *base)
 	return container_of(base, struct siw_srq, base_srq);
 }
 
+static inline void siw_lock_init(struct siw_spinlock *lock, int need_lock)
+{
+	lock->need_lock = need_lock;
+	pthread_spin_init(&lock->lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static inline void siw_lock_init_pd(struct siw_spinlock *lock, struct ibv_pd *pd)
+{
+	struct siw_parent_domain *parent_domain = parent_domain_base2siw(pd);
+
+	siw_lock_init(lock, !(parent_domain && parent_domain->td));
+}
+
+static inline void siw_lock(struct siw_spinlock *lock)
+{
+	if (lock->need_lock)
+		pthread_spin_lock(&lock->lock);
+}
+
+static inline void siw_unlock(struct siw_spinlock *lock)
+{
+	if (lock->need_lock)
+		pthread_spin_unlock(&lock->lock);
+}
+
 static inline int siw_db(struct siw_qp *qp)
 {
 	int rv = write(qp->base_qp.context->cmd_fd, &qp->db_req,
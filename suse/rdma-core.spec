@@ -707,6 +707,8 @@ rm -rf %{buildroot}/%{_sbindir}/srp_daemon.sh
 %{_mandir}/man8/ibaddr*
 %{_sbindir}/ibnetdiscover
 %{_mandir}/man8/ibnetdiscover*
+%{_sbindir}/ibperfcollect
+%{_mandir}/man8/ibperfcollect*
 %{_sbindir}/ibping
 %{_mandir}/man8/ibping*
 %{_sbindir}/ibportstate